@@ -36,6 +36,7 @@ static void usage(void)
 	     "\n"
 	     "Repair:\n"
 	     "  fsck                 Check an existing filesystem for errors\n"
+	     "  scrub                Verify btree node checksums, without a full fsck\n"
 	     "\n"
 	     "Startup/shutdown, assembly of multi device filesystems:\n"
 #if 0
@@ -56,6 +57,7 @@ static void usage(void)
 	     "  device evacuate      Migrate data off of a specific device\n"
 	     "  device set-state     Mark a device as failed\n"
 	     "  device resize        Resize filesystem on a device\n"
+	     "  device resize-journal Resize journal on a device\n"
 	     "\n"
 	     "Commands for managing filesystem data:\n"
 	     "  data rereplicate     Rereplicate degraded data\n"
@@ -74,8 +76,12 @@ static void usage(void)
 	     "Debug:\n"
 	     "These commands work on offline, unmounted filesystems\n"
 	     "  dump                 Dump filesystem metadata to a qcow2 image\n"
+	     "  restore              Write qcow2 metadata dump(s) back to device(s)\n"
 	     "  list                 List filesystem metadata in textual form\n"
 	     "  list_journal         List contents of journal\n"
+	     "  list_trace           List contents of an in process trace buffer\n"
+	     "  perf                 Run btree microbenchmarks\n"
+	     "  raid-bench           Benchmark erasure coding implementations\n"
 	     "\n"
 	     "Miscellaneous:\n"
 	     "  version              Display the version of the invoked bcachefs tool\n");
@@ -128,6 +134,8 @@ static int device_cmds(int argc, char *argv[])
 		return cmd_device_set_state(argc, argv);
 	if (!strcmp(cmd, "resize"))
 		return cmd_device_resize(argc, argv);
+	if (!strcmp(cmd, "resize-journal"))
+		return cmd_device_resize_journal(argc, argv);
 
 	usage();
 	return 0;
@@ -148,6 +156,13 @@ int main(int argc, char *argv[])
 {
 	raid_init();
 
+	/*
+	 * Replace the cpuid based kernel selection with measured winners;
+	 * only the first run on a machine pays the measurement cost, after
+	 * that the selection comes from the cache file:
+	 */
+	raid_bench(RAID_BENCH_CACHE, false, NULL, NULL);
+
 	full_cmd = argv[0];
 
 	setvbuf(stdout, NULL, _IOLBF, 0);
@@ -163,6 +178,8 @@ int main(int argc, char *argv[])
 
 	if (!strcmp(cmd, "fsck"))
 		return cmd_fsck(argc, argv);
+	if (!strcmp(cmd, "scrub"))
+		return cmd_scrub(argc, argv);
 
 #if 0
 	if (!strcmp(cmd, "assemble"))
@@ -198,10 +215,18 @@ int main(int argc, char *argv[])
 
 	if (!strcmp(cmd, "dump"))
 		return cmd_dump(argc, argv);
+	if (!strcmp(cmd, "restore"))
+		return cmd_restore(argc, argv);
 	if (!strcmp(cmd, "list"))
 		return cmd_list(argc, argv);
 	if (!strcmp(cmd, "list_journal"))
 		return cmd_list_journal(argc, argv);
+	if (!strcmp(cmd, "list_trace"))
+		return cmd_list_trace(argc, argv);
+	if (!strcmp(cmd, "perf"))
+		return cmd_perf(argc, argv);
+	if (!strcmp(cmd, "raid-bench"))
+		return cmd_raid_bench(argc, argv);
 
 	if (!strcmp(cmd, "setattr"))
 		return cmd_setattr(argc, argv);
@@ -39,6 +39,12 @@
  *     darray_init(foo.a);
  *     darray_free(foo.a);
  *
+ *     darray_inline(int, 8) b;
+ *     darray_init_inline(b);      // no allocation until it outgrows 8 items
+ *     darray_free(b);
+ *
+ *     darray_init_alloc(a, 1024); // preallocate when the size is known
+ *
  * Typedefs for darrays of common types:
  *
  *     darray_char, darray_schar, darray_uchar
@@ -113,11 +119,35 @@
 
 /*** Life cycle ***/
 
-#define darray(type) struct {type *item; size_t size; size_t alloc;}
+#define darray(type) struct {type *item; size_t size; size_t alloc; int heap;}
+
+/*
+ * darray_inline(type, n) - a darray with storage for n items embedded in the
+ * struct itself: no allocation happens until the array outgrows it. All the
+ * usual macros work on it, but it must be initialized with
+ * darray_init_inline(), and (unlike a plain darray) must not be copied by
+ * assignment:
+ */
+#define darray_inline(type, n) \
+	struct {type *item; size_t size; size_t alloc; int heap; type inline_item[n];}
+
+#define darray_new() {0,0,0,0}
+#define darray_init(arr) do {(arr).item=0; (arr).size=0; (arr).alloc=0; (arr).heap=0;} while(0)
+#define darray_init_inline(arr) do { \
+		(arr).item = (arr).inline_item; \
+		(arr).size = 0; \
+		(arr).alloc = sizeof((arr).inline_item) / sizeof(*(arr).inline_item); \
+		(arr).heap = 0; \
+	} while(0)
+
+/*
+ * darray_init_alloc(arr, n) - initialize with capacity for n items up front,
+ * for when the final size is known (or a good guess exists) and the
+ * realloc-per-doubling churn of growing from nothing is worth avoiding:
+ */
+#define darray_init_alloc(arr, n) do {darray_init(arr); darray_realloc(arr, n);} while(0)
 
-#define darray_new() {0,0,0}
-#define darray_init(arr) do {(arr).item=0; (arr).size=0; (arr).alloc=0;} while(0)
-#define darray_free(arr) do {free((arr).item);} while(0)
+#define darray_free(arr) do {if ((arr).heap) free((arr).item);} while(0)
 
 
 /*
@@ -265,7 +295,19 @@ typedef darray(unsigned long)  darray_ulong;
 	} while(0)
 
 #define darray_realloc(arr, newAlloc) do { \
-		(arr).item = realloc((arr).item, ((arr).alloc = (newAlloc)) * sizeof(*(arr).item)); \
+		size_t __newAlloc = (newAlloc); \
+		if ((arr).heap || !(arr).item) { \
+			(arr).item = realloc((arr).item, __newAlloc * sizeof(*(arr).item)); \
+		} else { \
+			/* Moving off inline storage - can't realloc that: */ \
+			void *__new = malloc(__newAlloc * sizeof(*(arr).item)); \
+			memcpy(__new, (arr).item, \
+			       ((arr).size < __newAlloc ? (arr).size : __newAlloc) * \
+			       sizeof(*(arr).item)); \
+			(arr).item = __new; \
+		} \
+		(arr).heap = 1; \
+		(arr).alloc = __newAlloc; \
 	} while(0)
 #define darray_growalloc(arr, need) do { \
 		size_t __need = (need); \
@@ -279,8 +321,12 @@ typedef darray(unsigned long)  darray_ulong;
 
 static inline size_t darray_next_alloc(size_t alloc, size_t need)
 {
-	if (alloc == 0)
-		alloc = 1;
+	/*
+	 * Don't bother with allocations of less than 8 items - doubling up
+	 * from 1 is nothing but realloc traffic:
+	 */
+	if (alloc < 8)
+		alloc = 8;
 	while (alloc < need)
 		alloc *= 2;
 	return alloc;
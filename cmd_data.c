@@ -17,6 +17,7 @@ static void data_rereplicate_usage(void)
 	     "of any degraded data\n"
 	     "\n"
 	     "Options:\n"
+	     "  -j, --json                  machine readable (JSON) progress\n"
 	     "  -h, --help                  display this help and exit\n"
 	     "Report bugs to <linux-bcache@vger.kernel.org>");
 	exit(EXIT_SUCCESS);
@@ -24,10 +25,14 @@ static void data_rereplicate_usage(void)
 
 int cmd_data_rereplicate(int argc, char *argv[])
 {
+	bool json = false;
 	int opt;
 
-	while ((opt = getopt(argc, argv, "h")) != -1)
+	while ((opt = getopt(argc, argv, "jh")) != -1)
 		switch (opt) {
+		case 'j':
+			json = true;
+			break;
 		case 'h':
 			data_rereplicate_usage();
 		}
@@ -44,5 +49,5 @@ int cmd_data_rereplicate(int argc, char *argv[])
 		.op	= BCH_DATA_OP_REREPLICATE,
 		.start	= POS_MIN,
 		.end	= POS_MAX,
-	});
+	}, json);
 }
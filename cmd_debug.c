@@ -1,11 +1,17 @@
 #include <fcntl.h>
+#include <pthread.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 
+#include <linux/sort.h>
+#include <linux/tracepoint.h>
+
 #include "cmds.h"
 #include "libbcachefs.h"
 #include "qcow2.h"
+#include "raid/raid.h"
 #include "tools-util.h"
 
 #include "libbcachefs/bcachefs.h"
@@ -19,6 +25,7 @@
 #include "libbcachefs/journal.h"
 #include "libbcachefs/journal_io.h"
 #include "libbcachefs/super.h"
+#include "libbcachefs/tests.h"
 
 static void dump_usage(void)
 {
@@ -27,25 +34,37 @@ static void dump_usage(void)
 	     "\n"
 	     "Options:\n"
 	     "  -o output     Output qcow2 image(s)\n"
+	     "  -c            Compress qcow2 image(s)\n"
+	     "  -S seq        Incremental: only dump btree nodes written at\n"
+	     "                journal seq or newer\n"
+	     "  -V            Verify: restore the image(s) to sparse temporary\n"
+	     "                files, mount them and read back every btree node\n"
 	     "  -f            Force; overwrite when needed\n"
 	     "  -h            Display this help and exit\n"
 	     "Report bugs to <linux-bcache@vger.kernel.org>");
 }
 
-static void dump_one_device(struct bch_fs *c, struct bch_dev *ca, int fd)
+struct dump_dev {
+	struct bch_fs		*c;
+	struct bch_dev		*ca;
+	int			fd;
+	bool			compress;
+	ranges			data;
+	pthread_t		thread;
+};
+
+static void dump_dev_metadata_ranges(struct bch_fs *c, struct dump_dev *d)
 {
+	struct bch_dev *ca = d->ca;
 	struct bch_sb *sb = ca->disk_sb.sb;
-	ranges data;
 	unsigned i;
 
-	darray_init(data);
-
 	/* Superblock: */
-	range_add(&data, BCH_SB_LAYOUT_SECTOR << 9,
+	range_add(&d->data, BCH_SB_LAYOUT_SECTOR << 9,
 		  sizeof(struct bch_sb_layout));
 
 	for (i = 0; i < sb->layout.nr_superblocks; i++)
-		range_add(&data,
+		range_add(&d->data,
 			  le64_to_cpu(sb->layout.sb_offset[i]) << 9,
 			  vstruct_bytes(sb));
 
@@ -54,18 +73,92 @@ static void dump_one_device(struct bch_fs *c, struct bch_dev *ca, int fd)
 		if (ca->journal.bucket_seq[i] >= c->journal.last_seq_ondisk) {
 			u64 bucket = ca->journal.buckets[i];
 
-			range_add(&data,
+			range_add(&d->data,
 				  bucket_bytes(ca) * bucket,
 				  bucket_bytes(ca));
 		}
+}
+
+/*
+ * Newest journal seq this node's contents were written at, from the on disk
+ * bset headers - the headers (seq/journal_seq/u64s) aren't encrypted, so a
+ * small read per bset suffices, without pulling in the whole node:
+ */
+static u64 btree_node_seq_ondisk(struct bch_fs *c, struct bkey_s_c k)
+{
+	struct extent_ptr_decoded pick;
+	struct bch_dev *ca;
+	char buf[4096];
+	struct btree_node *n = (void *) buf;
+	struct btree_node_entry *bne = (void *) buf;
+	u64 seq = 0, first_seq = 0;
+	unsigned offset = 0;
+
+	if (bch2_bkey_pick_read_device(c, k, NULL, &pick) <= 0)
+		return 0;
+
+	ca = bch_dev_bkey_exists(c, pick.ptr.dev);
+
+	while (offset < c->opts.btree_node_size) {
+		struct bset *i;
+		unsigned sectors;
+
+		xpread(ca->disk_sb.bdev->bd_fd, buf, sizeof(buf),
+		       (pick.ptr.offset + offset) << 9);
+
+		if (!offset) {
+			i = &n->keys;
+			first_seq = le64_to_cpu(i->seq);
+			sectors = vstruct_sectors(n, c->block_bits);
+		} else {
+			i = &bne->keys;
+			if (le64_to_cpu(i->seq) != first_seq)
+				break;
+			sectors = vstruct_sectors(bne, c->block_bits);
+		}
+
+		seq = max(seq, le64_to_cpu(i->journal_seq));
+
+		if (!sectors)
+			break;
+		offset += sectors;
+	}
+
+	return seq;
+}
+
+static void dump_btree_key_ranges(struct bch_fs *c, struct dump_dev *devs,
+				  struct bkey_s_c k, u64 since_seq)
+{
+	struct bkey_ptrs_c ptrs = bch2_bkey_ptrs_c(k);
+	const struct bch_extent_ptr *ptr;
+
+	if (since_seq &&
+	    btree_node_seq_ondisk(c, k) < since_seq)
+		return;
+
+	bkey_for_each_ptr(ptrs, ptr)
+		if (ptr->dev < c->sb.nr_devices &&
+		    devs[ptr->dev].ca)
+			range_add(&devs[ptr->dev].data,
+				  ptr->offset << 9,
+				  btree_bytes(c));
+}
+
+/*
+ * One walk of each btree suffices for all devices - every node's key lists
+ * pointers to all its replicas:
+ */
+static void dump_btree_ranges(struct bch_fs *c, struct dump_dev *devs,
+			      u64 since_seq, u64 *verify_nodes)
+{
+	unsigned i;
 
-	/* Btree: */
 	for (i = 0; i < BTREE_ID_NR; i++) {
-		const struct bch_extent_ptr *ptr;
-		struct bkey_ptrs_c ptrs;
 		struct btree_trans trans;
 		struct btree_iter *iter;
 		struct btree *b;
+		u64 nr_nodes = 0;
 
 		bch2_trans_init(&trans, c, 0, 0);
 
@@ -75,31 +168,146 @@ static void dump_one_device(struct bch_fs *c, struct bch_dev *ca, int fd)
 			struct bkey_s_c k;
 
 			for_each_btree_node_key_unpack(b, k, &iter, &u) {
-				ptrs = bch2_bkey_ptrs_c(k);
-
-				bkey_for_each_ptr(ptrs, ptr)
-					if (ptr->dev == ca->dev_idx)
-						range_add(&data,
-							  ptr->offset << 9,
-							  btree_bytes(c));
+				dump_btree_key_ranges(c, devs, k, since_seq);
+				nr_nodes++;
 			}
 		}
 
 		b = c->btree_roots[i].b;
 		if (!btree_node_fake(b)) {
-			ptrs = bch2_bkey_ptrs_c(bkey_i_to_s_c(&b->key));
-
-			bkey_for_each_ptr(ptrs, ptr)
-				if (ptr->dev == ca->dev_idx)
-					range_add(&data,
-						  ptr->offset << 9,
-						  btree_bytes(c));
+			dump_btree_key_ranges(c, devs,
+					      bkey_i_to_s_c(&b->key),
+					      since_seq);
+			nr_nodes++;
 		}
+
+		if (verify_nodes)
+			verify_nodes[i] = nr_nodes;
+
 		bch2_trans_exit(&trans);
 	}
+}
+
+static void *dump_dev_thread(void *_d)
+{
+	struct dump_dev *d = _d;
+	struct bch_fs *c = d->c;
+
+	qcow2_write_image(d->ca->disk_sb.bdev->bd_fd, d->fd, &d->data,
+			  max_t(unsigned, btree_bytes(c) / 8, block_bytes(c)),
+			  d->compress);
+	close(d->fd);
+	return NULL;
+}
+
+struct verify_walk {
+	struct bch_fs		*c;
+	enum btree_id		id;
+	u64			nr_nodes;
+	pthread_t		thread;
+};
+
+static void *dump_verify_thread(void *_w)
+{
+	struct verify_walk *w = _w;
+	struct btree_trans trans;
+	struct btree_iter *iter;
+	struct btree *b;
+
+	/*
+	 * A depth 0 walk visits every node in the tree, leaves included, and
+	 * reading a node through the btree cache verifies its checksums:
+	 */
+	bch2_trans_init(&trans, w->c, 0, 0);
+
+	__for_each_btree_node(&trans, iter, w->id, POS_MIN, 0, 0, 0, b)
+		w->nr_nodes++;
+
+	bch2_trans_exit(&trans);
+	return NULL;
+}
+
+/*
+ * Prove the dump is restorable: restore the image(s) to sparse temporary
+ * files, mount them the same way dump itself mounts (metadata only, no
+ * recovery), and walk every btree with a thread per btree, checking that each
+ * node reads back clean and that we find exactly the nodes we dumped:
+ */
+static int dump_verify(char **images, unsigned nr, u64 *expected_nodes)
+{
+	struct bch_opts opts = bch2_opts_empty();
+	char **verify_devs = xcalloc(nr, sizeof(*verify_devs));
+	unsigned i;
+	int ret = 0;
+
+	opt_set(opts, inspect,		true);
+	opt_set(opts, nochanges,	true);
+	opt_set(opts, norecovery,	true);
+	opt_set(opts, degraded,		true);
+	opt_set(opts, errors,		BCH_ON_ERROR_CONTINUE);
+
+	for (i = 0; i < nr; i++) {
+		int infd = xopen(images[i], O_RDONLY);
+
+		verify_devs[i] = mprintf("%s.verify", images[i]);
+
+		/*
+		 * Restoring to a regular file gives us a sparse image - only
+		 * the clusters present in the dump take up space:
+		 */
+		int outfd = xopen(verify_devs[i], O_RDWR|O_CREAT|O_TRUNC, 0600);
+		qcow2_read_image(infd, outfd);
+		close(outfd);
+		close(infd);
+	}
+
+	struct bch_fs *c = bch2_fs_open(verify_devs, nr, opts);
+	if (IS_ERR(c)) {
+		fprintf(stderr, "dump verify: error mounting restored image: %s\n",
+			strerror(-PTR_ERR(c)));
+		ret = 1;
+		goto out;
+	}
+
+	struct verify_walk *w = xcalloc(BTREE_ID_NR, sizeof(*w));
+
+	for (i = 0; i < BTREE_ID_NR; i++) {
+		w[i].c	= c;
+		w[i].id	= i;
+
+		if (pthread_create(&w[i].thread, NULL,
+				   dump_verify_thread, &w[i]))
+			die("pthread_create error: %m");
+	}
+
+	for (i = 0; i < BTREE_ID_NR; i++) {
+		pthread_join(w[i].thread, NULL);
+
+		if (w[i].nr_nodes != expected_nodes[i]) {
+			fprintf(stderr, "dump verify: btree %s: dumped %llu nodes, read back %llu\n",
+				bch2_btree_ids[i],
+				expected_nodes[i], w[i].nr_nodes);
+			ret = 1;
+		}
+	}
+
+	if (test_bit(BCH_FS_ERROR, &c->flags)) {
+		fprintf(stderr, "dump verify: errors reading restored image\n");
+		ret = 1;
+	}
+
+	free(w);
+	bch2_fs_stop(c);
 
-	qcow2_write_image(ca->disk_sb.bdev->bd_fd, fd, &data,
-			  max_t(unsigned, btree_bytes(c) / 8, block_bytes(c)));
+	if (!ret)
+		fprintf(stderr, "dump verified\n");
+out:
+	for (i = 0; i < nr; i++) {
+		unlink(verify_devs[i]);
+		free(verify_devs[i]);
+	}
+	free(verify_devs);
+	return ret;
 }
 
 int cmd_dump(int argc, char *argv[])
@@ -108,23 +316,36 @@ int cmd_dump(int argc, char *argv[])
 	struct bch_dev *ca;
 	char *out = NULL;
 	unsigned i, nr_devices = 0;
-	bool force = false;
-	int fd, opt;
+	u64 since_seq = 0, newest_seq = 0;
+	u64 verify_nodes[BTREE_ID_NR] = { 0 };
+	bool force = false, compress = false, verify = false;
+	int fd, opt, ret = 0;
 
+	opt_set(opts, inspect,		true);
 	opt_set(opts, nochanges,	true);
 	opt_set(opts, norecovery,	true);
 	opt_set(opts, degraded,		true);
 	opt_set(opts, errors,		BCH_ON_ERROR_CONTINUE);
 	opt_set(opts, fix_errors,	FSCK_OPT_YES);
 
-	while ((opt = getopt(argc, argv, "o:fvh")) != -1)
+	while ((opt = getopt(argc, argv, "o:S:cfVvh")) != -1)
 		switch (opt) {
 		case 'o':
 			out = optarg;
 			break;
+		case 'S':
+			if (kstrtou64(optarg, 10, &since_seq))
+				die("invalid journal seq %s", optarg);
+			break;
+		case 'c':
+			compress = true;
+			break;
 		case 'f':
 			force = true;
 			break;
+		case 'V':
+			verify = true;
+			break;
 		case 'v':
 			opt_set(opts, verbose, true);
 			break;
@@ -140,6 +361,9 @@ int cmd_dump(int argc, char *argv[])
 	if (!argc)
 		die("Please supply device(s) to check");
 
+	if (verify && since_seq)
+		die("-V requires a full dump: an incremental image isn't mountable on its own");
+
 	struct bch_fs *c = bch2_fs_open(argv, argc, opts);
 	if (IS_ERR(c))
 		die("error opening %s: %s", argv[0], strerror(-PTR_ERR(c)));
@@ -151,38 +375,200 @@ int cmd_dump(int argc, char *argv[])
 
 	BUG_ON(!nr_devices);
 
+	struct dump_dev *devs = xcalloc(c->sb.nr_devices, sizeof(*devs));
+	char **image_paths = xcalloc(c->sb.nr_devices, sizeof(*image_paths));
+
 	for_each_online_member(ca, c, i) {
 		int flags = O_WRONLY|O_CREAT|O_TRUNC;
 
 		if (!force)
 			flags |= O_EXCL;
 
-		if (!c->devs[i])
-			continue;
-
 		char *path = nr_devices > 1
 			? mprintf("%s.%u", out, i)
 			: strdup(out);
 		fd = xopen(path, flags, 0600);
-		free(path);
+		image_paths[i] = path;
+
+		devs[i].c	= c;
+		devs[i].ca	= ca;
+		devs[i].fd	= fd;
+		devs[i].compress = compress;
+		darray_init(devs[i].data);
 
-		dump_one_device(c, ca, fd);
-		close(fd);
+		dump_dev_metadata_ranges(c, &devs[i]);
 	}
 
+	dump_btree_ranges(c, devs, since_seq, verify ? verify_nodes : NULL);
+
+	for_each_online_member(ca, c, i) {
+		unsigned j;
+
+		for (j = 0; j < ca->journal.nr; j++)
+			newest_seq = max(newest_seq, ca->journal.bucket_seq[j]);
+	}
+
+	/*
+	 * The btree is already in memory from the shared walk - write out all
+	 * the images concurrently:
+	 */
+	for (i = 0; i < c->sb.nr_devices; i++)
+		if (devs[i].ca &&
+		    pthread_create(&devs[i].thread, NULL,
+				   dump_dev_thread, &devs[i]))
+			die("pthread_create error: %m");
+
+	for (i = 0; i < c->sb.nr_devices; i++)
+		if (devs[i].ca) {
+			pthread_join(devs[i].thread, NULL);
+			darray_free(devs[i].data);
+		}
+
+	free(devs);
+
 	up_read(&c->gc_lock);
 
+	fprintf(stderr, "Newest journal seq %llu; pass -S %llu to dump only\n"
+		"btree nodes written since this dump\n",
+		newest_seq, newest_seq + 1);
+
+	/*
+	 * Compact the per device index array down to just the images we
+	 * wrote, before fs_stop frees the superblock:
+	 */
+	char **images = xcalloc(nr_devices, sizeof(*images));
+	unsigned nr_images = 0;
+
+	for (i = 0; i < c->sb.nr_devices; i++)
+		if (image_paths[i])
+			images[nr_images++] = image_paths[i];
+	free(image_paths);
+
 	bch2_fs_stop(c);
+
+	if (verify)
+		ret = dump_verify(images, nr_images, verify_nodes);
+
+	for (i = 0; i < nr_images; i++)
+		free(images[i]);
+	free(images);
+	return ret;
+}
+
+static void restore_usage(void)
+{
+	puts("bcachefs restore - write qcow2 metadata dump(s) back to device(s)\n"
+	     "Usage: bcachefs restore [OPTION]... <image> <device> [<image> <device>]...\n"
+	     "\n"
+	     "Each image is restored to the corresponding device; devices are\n"
+	     "written in parallel. Only clusters present in an image are\n"
+	     "written, so an incremental dump (dump -S) can be applied on top\n"
+	     "of a previous restore.\n"
+	     "\n"
+	     "Options:\n"
+	     "  -h            Display this help and exit\n"
+	     "Report bugs to <linux-bcache@vger.kernel.org>");
+}
+
+struct restore_dev {
+	int			infd;
+	int			outfd;
+	pthread_t		thread;
+};
+
+static void *restore_dev_thread(void *_d)
+{
+	struct restore_dev *d = _d;
+
+	qcow2_read_image(d->infd, d->outfd);
+	close(d->outfd);
+	close(d->infd);
+	return NULL;
+}
+
+int cmd_restore(int argc, char *argv[])
+{
+	struct restore_dev *devs;
+	unsigned i, nr;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "h")) != -1)
+		switch (opt) {
+		case 'h':
+			restore_usage();
+			exit(EXIT_SUCCESS);
+		}
+	args_shift(optind);
+
+	if (!argc || (argc & 1))
+		die("Please supply image/device pairs");
+
+	nr = argc / 2;
+	devs = xcalloc(nr, sizeof(*devs));
+
+	for (i = 0; i < nr; i++) {
+		devs[i].infd	= xopen(argv[i * 2], O_RDONLY);
+		devs[i].outfd	= xopen(argv[i * 2 + 1],
+					O_WRONLY|O_CREAT, 0600);
+	}
+
+	for (i = 0; i < nr; i++)
+		if (pthread_create(&devs[i].thread, NULL,
+				   restore_dev_thread, &devs[i]))
+			die("pthread_create error: %m");
+
+	for (i = 0; i < nr; i++)
+		pthread_join(devs[i].thread, NULL);
+
+	free(devs);
 	return 0;
 }
 
+/*
+ * Batched stdout writer: lines are formatted straight into a 1MB buffer
+ * that's written out in one go when it fills, instead of a stdio call per
+ * key - listing big btrees is output bound:
+ */
+#define LIST_BUF_SIZE	(1 << 20)
+#define LIST_LINE_MAX	4096
+
+static struct {
+	char		buf[LIST_BUF_SIZE];
+	size_t		used;
+} list_buf;
+
+static void list_buf_flush(void)
+{
+	if (list_buf.used) {
+		if (fwrite(list_buf.buf, 1, list_buf.used, stdout) !=
+		    list_buf.used)
+			die("error writing output: %m");
+		list_buf.used = 0;
+	}
+}
+
+static struct printbuf list_buf_line(void)
+{
+	if (list_buf.used + LIST_LINE_MAX > sizeof(list_buf.buf))
+		list_buf_flush();
+
+	return _PBUF(list_buf.buf + list_buf.used,
+		     sizeof(list_buf.buf) - list_buf.used);
+}
+
+static void list_buf_commit(struct printbuf *out)
+{
+	pr_buf(out, "\n");
+	list_buf.used = out->pos - list_buf.buf;
+}
+
 static void list_keys(struct bch_fs *c, enum btree_id btree_id,
 		      struct bpos start, struct bpos end)
 {
 	struct btree_trans trans;
 	struct btree_iter *iter;
 	struct bkey_s_c k;
-	char buf[512];
+	struct printbuf out;
 	int ret;
 
 	bch2_trans_init(&trans, c, 0, 0);
@@ -192,10 +578,13 @@ static void list_keys(struct bch_fs *c, enum btree_id btree_id,
 		if (bkey_cmp(k.k->p, end) > 0)
 			break;
 
-		bch2_bkey_val_to_text(&PBUF(buf), c, k);
-		puts(buf);
+		out = list_buf_line();
+		bch2_bkey_val_to_text(&out, c, k);
+		list_buf_commit(&out);
 	}
 	bch2_trans_exit(&trans);
+
+	list_buf_flush();
 }
 
 static void list_btree_formats(struct bch_fs *c, enum btree_id btree_id,
@@ -204,7 +593,7 @@ static void list_btree_formats(struct bch_fs *c, enum btree_id btree_id,
 	struct btree_trans trans;
 	struct btree_iter *iter;
 	struct btree *b;
-	char buf[4096];
+	struct printbuf out;
 
 	bch2_trans_init(&trans, c, 0, 0);
 
@@ -212,10 +601,13 @@ static void list_btree_formats(struct bch_fs *c, enum btree_id btree_id,
 		if (bkey_cmp(b->key.k.p, end) > 0)
 			break;
 
-		bch2_btree_node_to_text(&PBUF(buf), c, b);
-		puts(buf);
+		out = list_buf_line();
+		bch2_btree_node_to_text(&out, c, b);
+		list_buf_commit(&out);
 	}
 	bch2_trans_exit(&trans);
+
+	list_buf_flush();
 }
 
 static void list_nodes(struct bch_fs *c, enum btree_id btree_id,
@@ -224,7 +616,7 @@ static void list_nodes(struct bch_fs *c, enum btree_id btree_id,
 	struct btree_trans trans;
 	struct btree_iter *iter;
 	struct btree *b;
-	char buf[4096];
+	struct printbuf out;
 
 	bch2_trans_init(&trans, c, 0, 0);
 
@@ -232,94 +624,119 @@ static void list_nodes(struct bch_fs *c, enum btree_id btree_id,
 		if (bkey_cmp(b->key.k.p, end) > 0)
 			break;
 
-		bch2_bkey_val_to_text(&PBUF(buf), c, bkey_i_to_s_c(&b->key));
-		fputs(buf, stdout);
-		putchar('\n');
+		out = list_buf_line();
+		bch2_bkey_val_to_text(&out, c, bkey_i_to_s_c(&b->key));
+		list_buf_commit(&out);
 	}
 	bch2_trans_exit(&trans);
+
+	list_buf_flush();
 }
 
-static void print_node_ondisk(struct bch_fs *c, struct btree *b)
+static bool btree_node_read_ondisk(struct bch_fs *c, struct bkey_s_c k,
+				   struct btree_node *n)
 {
-	struct btree_node *n_ondisk;
 	struct extent_ptr_decoded pick;
 	struct bch_dev *ca;
 	struct bio *bio;
-	unsigned offset = 0;
 
-	if (bch2_bkey_pick_read_device(c, bkey_i_to_s_c(&b->key), NULL, &pick) <= 0) {
-		printf("error getting device to read from\n");
-		return;
-	}
+	if (bch2_bkey_pick_read_device(c, k, NULL, &pick) <= 0)
+		return false;
 
 	ca = bch_dev_bkey_exists(c, pick.ptr.dev);
-	if (!bch2_dev_get_ioref(ca, READ)) {
-		printf("error getting device to read from\n");
-		return;
-	}
-
-	n_ondisk = malloc(btree_bytes(c));
+	if (!bch2_dev_get_ioref(ca, READ))
+		return false;
 
 	bio = bio_alloc_bioset(GFP_NOIO,
-			buf_pages(n_ondisk, btree_bytes(c)),
+			buf_pages(n, btree_bytes(c)),
 			&c->btree_bio);
 	bio_set_dev(bio, ca->disk_sb.bdev);
 	bio->bi_opf		= REQ_OP_READ|REQ_META;
 	bio->bi_iter.bi_sector	= pick.ptr.offset;
-	bch2_bio_map(bio, n_ondisk, btree_bytes(c));
+	bch2_bio_map(bio, n, btree_bytes(c));
 
 	submit_bio_wait(bio);
 
 	bio_put(bio);
 	percpu_ref_put(&ca->io_ref);
+	return true;
+}
 
-	while (offset < c->opts.btree_node_size) {
-		struct bset *i;
-		struct nonce nonce;
-		struct bch_csum csum;
-		struct bkey_packed *k;
-		unsigned sectors;
+/*
+ * Verify, decrypt and return the bset at *offset, advancing *offset past it -
+ * NULL at the end of the node:
+ */
+static struct bset *btree_node_ondisk_next_bset(struct bch_fs *c,
+						struct btree_node *n,
+						unsigned *offset)
+{
+	struct bset *i;
+	struct nonce nonce;
+	struct bch_csum csum;
+	unsigned sectors;
 
-		if (!offset) {
-			i = &n_ondisk->keys;
+	if (*offset >= c->opts.btree_node_size)
+		return NULL;
 
-			if (!bch2_checksum_type_valid(c, BSET_CSUM_TYPE(i)))
-				die("unknown checksum type");
+	if (!*offset) {
+		i = &n->keys;
 
-			nonce = btree_nonce(i, offset << 9);
-			csum = csum_vstruct(c, BSET_CSUM_TYPE(i), nonce, n_ondisk);
+		if (!bch2_checksum_type_valid(c, BSET_CSUM_TYPE(i)))
+			die("unknown checksum type");
 
-			if (bch2_crc_cmp(csum, n_ondisk->csum))
-				die("invalid checksum\n");
+		nonce = btree_nonce(i, *offset << 9);
+		csum = csum_vstruct(c, BSET_CSUM_TYPE(i), nonce, n);
 
-			bset_encrypt(c, i, offset << 9);
+		if (bch2_crc_cmp(csum, n->csum))
+			die("invalid checksum\n");
 
-			sectors = vstruct_sectors(n_ondisk, c->block_bits);
-		} else {
-			struct btree_node_entry *bne = (void *) n_ondisk + (offset << 9);
+		bset_encrypt(c, i, *offset << 9);
 
-			i = &bne->keys;
+		sectors = vstruct_sectors(n, c->block_bits);
+	} else {
+		struct btree_node_entry *bne = (void *) n + (*offset << 9);
 
-			if (i->seq != n_ondisk->keys.seq)
-				break;
+		i = &bne->keys;
 
-			if (!bch2_checksum_type_valid(c, BSET_CSUM_TYPE(i)))
-				die("unknown checksum type");
+		if (i->seq != n->keys.seq)
+			return NULL;
 
-			nonce = btree_nonce(i, offset << 9);
-			csum = csum_vstruct(c, BSET_CSUM_TYPE(i), nonce, bne);
+		if (!bch2_checksum_type_valid(c, BSET_CSUM_TYPE(i)))
+			die("unknown checksum type");
 
-			if (bch2_crc_cmp(csum, bne->csum))
-				die("invalid checksum");
+		nonce = btree_nonce(i, *offset << 9);
+		csum = csum_vstruct(c, BSET_CSUM_TYPE(i), nonce, bne);
 
-			bset_encrypt(c, i, offset << 9);
+		if (bch2_crc_cmp(csum, bne->csum))
+			die("invalid checksum");
 
-			sectors = vstruct_sectors(bne, c->block_bits);
-		}
+		bset_encrypt(c, i, *offset << 9);
+
+		sectors = vstruct_sectors(bne, c->block_bits);
+	}
+
+	*offset += sectors;
+	return i;
+}
+
+static void print_node_ondisk(struct bch_fs *c, struct btree *b)
+{
+	struct btree_node *n_ondisk = malloc(btree_bytes(c));
+	unsigned offset = 0, bset_offset;
+	struct bset *i;
+
+	if (!btree_node_read_ondisk(c, bkey_i_to_s_c(&b->key), n_ondisk)) {
+		printf("error getting device to read from\n");
+		free(n_ondisk);
+		return;
+	}
+
+	while (bset_offset = offset,
+	       (i = btree_node_ondisk_next_bset(c, n_ondisk, &offset))) {
+		struct bkey_packed *k;
 
 		fprintf(stdout, "  offset %u journal seq %llu\n",
-			offset, le64_to_cpu(i->journal_seq));
-		offset += sectors;
+			bset_offset, le64_to_cpu(i->journal_seq));
 
 		for (k = i->start;
 		     k != vstruct_last(i);
@@ -335,6 +752,135 @@ static void print_node_ondisk(struct bch_fs *c, struct btree *b)
 	free(n_ondisk);
 }
 
+struct leaf_node_key {
+	BKEY_PADDED(k);
+};
+
+static u64 leaf_ptr_lba(const struct leaf_node_key *lk)
+{
+	struct bkey_ptrs_c ptrs = bch2_bkey_ptrs_c(bkey_i_to_s_c(&lk->k));
+	const struct bch_extent_ptr *ptr;
+
+	bkey_for_each_ptr(ptrs, ptr)
+		return ((u64) ptr->dev << 56) | ptr->offset;
+	return 0;
+}
+
+static int leaf_ptr_cmp(const void *_l, const void *_r)
+{
+	return cmp_int(leaf_ptr_lba(_l), leaf_ptr_lba(_r));
+}
+
+static void list_leaf_keys_ondisk(struct bch_fs *c, struct btree_node *n,
+				  struct bpos start, struct bpos end)
+{
+	unsigned offset = 0;
+	struct bset *i;
+	struct printbuf out;
+
+	while ((i = btree_node_ondisk_next_bset(c, n, &offset))) {
+		struct bkey_packed *k;
+
+		for (k = i->start;
+		     k != vstruct_last(i);
+		     k = bkey_next_skip_noops(k, vstruct_last(i))) {
+			struct bkey u;
+			struct bkey_s_c kc;
+
+			if (bkey_packed(k))
+				u = __bch2_bkey_unpack_key(&n->format, k);
+			else
+				u = *packed_to_bkey_c(k);
+
+			if (u.type == KEY_TYPE_deleted ||
+			    bkey_cmp(u.p, start) < 0 ||
+			    bkey_cmp(bkey_start_pos(&u), end) > 0)
+				continue;
+
+			kc = (struct bkey_s_c) {
+				&u, bkeyp_val(&n->format, k)
+			};
+
+			out = list_buf_line();
+			bch2_bkey_val_to_text(&out, c, kc);
+			list_buf_commit(&out);
+		}
+	}
+}
+
+/*
+ * Raw scan: leaf pointers are gathered through the (tiny) interior of the
+ * tree, then the leaves are read directly and their bsets dumped as they
+ * exist on disk - output comes in disk order, uncompacted, skipping the
+ * btree cache entirely:
+ */
+static void list_keys_ondisk(struct bch_fs *c, enum btree_id btree_id,
+			     struct bpos start, struct bpos end)
+{
+	struct btree *root = c->btree_roots[btree_id].b;
+	struct btree_node *n_ondisk = malloc(btree_bytes(c));
+	darray(struct leaf_node_key) leaves;
+	struct leaf_node_key *lk;
+
+	darray_init(leaves);
+
+	if (btree_node_fake(root))
+		goto out;
+
+	if (!root->c.level) {
+		struct leaf_node_key tmp;
+
+		bkey_copy(&tmp.k, &root->key);
+		darray_append(leaves, tmp);
+	} else {
+		struct btree_trans trans;
+		struct btree_iter *iter;
+		struct btree *b;
+		bool done = false;
+
+		bch2_trans_init(&trans, c, 0, 0);
+
+		__for_each_btree_node(&trans, iter, btree_id, start,
+				      0, 1, 0, b) {
+			struct btree_node_iter niter;
+			struct bkey u;
+			struct bkey_s_c k;
+
+			if (done)
+				break;
+
+			for_each_btree_node_key_unpack(b, k, &niter, &u) {
+				struct leaf_node_key tmp;
+
+				if (bkey_cmp(k.k->p, start) < 0)
+					continue;
+
+				bkey_reassemble(&tmp.k, k);
+				darray_append(leaves, tmp);
+
+				if (bkey_cmp(k.k->p, end) >= 0) {
+					done = true;
+					break;
+				}
+			}
+		}
+		bch2_trans_exit(&trans);
+	}
+
+	sort(leaves.item, leaves.size, sizeof(leaves.item[0]),
+	     leaf_ptr_cmp, NULL);
+
+	darray_foreach(lk, leaves)
+		if (btree_node_read_ondisk(c, bkey_i_to_s_c(&lk->k), n_ondisk))
+			list_leaf_keys_ondisk(c, n_ondisk, start, end);
+		else
+			printf("error getting device to read from\n");
+out:
+	free(n_ondisk);
+	darray_free(leaves);
+	list_buf_flush();
+}
+
 static void list_nodes_ondisk(struct bch_fs *c, enum btree_id btree_id,
 			      struct bpos start, struct bpos end)
 {
@@ -416,7 +962,8 @@ static void list_keys_usage(void)
 	     "  -s inode:offset                       Start position to list from\n"
 	     "  -e inode:offset                       End position\n"
 	     "  -i inode                              List keys for a given inode number\n"
-	     "  -m (keys|formats)                     List mode\n"
+	     "  -m (keys|formats|nodes|nodes_ondisk|\n"
+	     "      nodes_keys|keys_ondisk)           List mode\n"
 	     "  -f                                    Check (fsck) the filesystem first\n"
 	     "  -v                                    Verbose mode\n"
 	     "  -h                                    Display this help and exit\n"
@@ -429,6 +976,7 @@ static const char * const list_modes[] = {
 	"nodes",
 	"nodes_ondisk",
 	"nodes_keys",
+	"keys_ondisk",
 	NULL
 };
 
@@ -442,6 +990,7 @@ int cmd_list(int argc, char *argv[])
 	u64 inum;
 	int mode = 0, opt;
 
+	opt_set(opts, inspect,		true);
 	opt_set(opts, nochanges,	true);
 	opt_set(opts, norecovery,	true);
 	opt_set(opts, degraded,		true);
@@ -510,6 +1059,9 @@ int cmd_list(int argc, char *argv[])
 		case 4:
 			list_nodes_keys(c, btree_id, start, end);
 			break;
+		case 5:
+			list_keys_ondisk(c, btree_id, start, end);
+			break;
 		default:
 			die("Invalid mode");
 		}
@@ -519,6 +1071,253 @@ int cmd_list(int argc, char *argv[])
 	return 0;
 }
 
+/*
+ * Raw journal dump, for forensics: reads the journal buckets directly (layout
+ * from bch_sb_field_journal) with large sequential reads instead of opening
+ * the filesystem, one thread per device. Buckets are scanned at block
+ * granularity past bad magic/checksums, so entries after torn writes - which
+ * the normal read path deliberately stops at - are still dumped.
+ *
+ * Output is batched: binary mode emits validated jsets verbatim, jsonl mode
+ * emits one summary line per jset (full key contents come from binary mode).
+ */
+
+struct raw_journal_out {
+	pthread_mutex_t		lock;
+	FILE			*f;
+	bool			jsonl;
+};
+
+#define RAW_JOURNAL_BATCH	(4U << 20)
+
+struct raw_journal_dev {
+	pthread_t		thread;
+	struct raw_journal_out	*out;
+	const char		*path;
+	int			fd;
+	u64			magic;
+	unsigned		bucket_size;	/* sectors */
+	unsigned		block_size;	/* sectors */
+	unsigned		nr_buckets;
+	u64			*buckets;	/* offsets in sectors, sorted */
+
+	char			*obuf;
+	size_t			obuf_used;
+
+	u64			nr_entries;
+	u64			nr_csum_bad;
+};
+
+static int raw_journal_bucket_cmp(const void *_l, const void *_r)
+{
+	const u64 *l = _l, *r = _r;
+
+	return (*l > *r) - (*l < *r);
+}
+
+static void raw_journal_flush(struct raw_journal_dev *d)
+{
+	pthread_mutex_lock(&d->out->lock);
+	fwrite(d->obuf, 1, d->obuf_used, d->out->f);
+	pthread_mutex_unlock(&d->out->lock);
+	d->obuf_used = 0;
+}
+
+static void raw_journal_emit(struct raw_journal_dev *d,
+			     const void *data, size_t len)
+{
+	if (d->obuf_used + len > RAW_JOURNAL_BATCH)
+		raw_journal_flush(d);
+
+	if (len > RAW_JOURNAL_BATCH) {
+		pthread_mutex_lock(&d->out->lock);
+		fwrite(data, 1, len, d->out->f);
+		pthread_mutex_unlock(&d->out->lock);
+	} else {
+		memcpy(d->obuf + d->obuf_used, data, len);
+		d->obuf_used += len;
+	}
+}
+
+static struct nonce raw_journal_nonce(const struct jset *jset)
+{
+	return (struct nonce) {{
+		[0] = 0,
+		[1] = ((__le32 *) &jset->seq)[0],
+		[2] = ((__le32 *) &jset->seq)[1],
+		[3] = BCH_NONCE_JOURNAL,
+	}};
+}
+
+static void raw_journal_scan_bucket(struct raw_journal_dev *d,
+				    void *buf, u64 sector)
+{
+	size_t bucket_bytes = (size_t) d->bucket_size << 9;
+	unsigned block_bytes = d->block_size << 9;
+	size_t off = 0;
+
+	while (off + sizeof(struct jset) <= bucket_bytes) {
+		struct jset *j = buf + off;
+		unsigned csum_type = JSET_CSUM_TYPE(j);
+		bool csum_good = true;
+		size_t bytes;
+
+		if (le64_to_cpu(j->magic) != d->magic)
+			goto next_block;
+
+		bytes = vstruct_bytes(j);
+		if (bytes < sizeof(*j) ||
+		    off + bytes > bucket_bytes)
+			goto next_block;
+
+		if (csum_type >= BCH_CSUM_NR) {
+			csum_good = false;
+		} else if (!bch2_csum_type_is_encryption(csum_type)) {
+			/* crc checksums don't dereference the fs pointer: */
+			struct bch_csum csum =
+				csum_vstruct(NULL, csum_type,
+					     raw_journal_nonce(j), j);
+
+			csum_good = !bch2_crc_cmp(csum, j->csum);
+		}
+
+		d->nr_entries++;
+		d->nr_csum_bad += !csum_good;
+
+		if (!d->out->jsonl) {
+			raw_journal_emit(d, j, bytes);
+		} else {
+			struct jset_entry *entry;
+			unsigned nr_entries = 0;
+			char line[256];
+
+			vstruct_for_each(j, entry)
+				nr_entries++;
+
+			raw_journal_emit(d, line,
+				snprintf(line, sizeof(line),
+					 "{\"dev\":\"%s\",\"sector\":%llu,\"seq\":%llu,\"last_seq\":%llu,\"version\":%u,\"bytes\":%zu,\"csum_good\":%u,\"entries\":%u}\n",
+					 d->path,
+					 sector + (off >> 9),
+					 le64_to_cpu(j->seq),
+					 le64_to_cpu(j->last_seq),
+					 le32_to_cpu(j->version),
+					 bytes,
+					 csum_good,
+					 nr_entries));
+		}
+
+		off += round_up(bytes, block_bytes);
+		continue;
+next_block:
+		off += block_bytes;
+	}
+}
+
+static void *raw_journal_thread(void *arg)
+{
+	struct raw_journal_dev *d = arg;
+	size_t bucket_bytes = (size_t) d->bucket_size << 9;
+	unsigned chunk = max_t(size_t, 1, (32UL << 20) / bucket_bytes);
+	void *buf = xmalloc(chunk * bucket_bytes);
+	unsigned i = 0, j;
+
+	while (i < d->nr_buckets) {
+		unsigned nr = 1;
+
+		/* coalesce adjacent buckets into one large read: */
+		while (i + nr < d->nr_buckets &&
+		       nr < chunk &&
+		       d->buckets[i + nr] ==
+		       d->buckets[i] + (u64) nr * d->bucket_size)
+			nr++;
+
+		xpread(d->fd, buf, nr * bucket_bytes, d->buckets[i] << 9);
+
+		for (j = 0; j < nr; j++)
+			raw_journal_scan_bucket(d, buf + j * bucket_bytes,
+						d->buckets[i + j]);
+		i += nr;
+	}
+
+	raw_journal_flush(d);
+	free(buf);
+	return NULL;
+}
+
+static void list_journal_raw(char **devs, unsigned nr_devs,
+			     const char *out_path, bool jsonl)
+{
+	struct raw_journal_out out = { .jsonl = jsonl };
+	struct raw_journal_dev *d = xcalloc(nr_devs, sizeof(*d));
+	unsigned i, b;
+
+	pthread_mutex_init(&out.lock, NULL);
+
+	out.f = out_path ? fopen(out_path, "w") : stdout;
+	if (!out.f)
+		die("error opening %s: %m", out_path);
+
+	for (i = 0; i < nr_devs; i++) {
+		struct bch_opts o = bch2_opts_empty();
+		struct bch_sb_handle sb;
+		struct bch_sb_field_journal *journal;
+		struct bch_sb_field_members *mi;
+		unsigned nr;
+		int ret;
+
+		opt_set(o, noexcl,	true);
+		opt_set(o, nochanges,	true);
+
+		ret = bch2_read_super(devs[i], &o, &sb);
+		if (ret)
+			die("error opening %s: %s", devs[i], strerror(-ret));
+
+		journal	= bch2_sb_get_journal(sb.sb);
+		mi	= bch2_sb_get_members(sb.sb);
+		nr	= journal ? bch2_nr_journal_buckets(journal) : 0;
+		if (!nr || !mi)
+			die("%s has no journal", devs[i]);
+
+		d[i].out	= &out;
+		d[i].path	= devs[i];
+		d[i].fd		= xopen(devs[i], O_RDONLY);
+		d[i].magic	= __jset_magic(sb.sb);
+		d[i].bucket_size = le16_to_cpu(mi->members[sb.sb->dev_idx].bucket_size);
+		d[i].block_size	= le16_to_cpu(sb.sb->block_size);
+		d[i].nr_buckets	= nr;
+		d[i].buckets	= xcalloc(nr, sizeof(u64));
+		d[i].obuf	= xmalloc(RAW_JOURNAL_BATCH);
+
+		for (b = 0; b < nr; b++)
+			d[i].buckets[b] = le64_to_cpu(journal->buckets[b]);
+
+		qsort(d[i].buckets, nr, sizeof(u64), raw_journal_bucket_cmp);
+
+		bch2_free_super(&sb);
+	}
+
+	for (i = 0; i < nr_devs; i++)
+		if (pthread_create(&d[i].thread, NULL,
+				   raw_journal_thread, &d[i]))
+			die("pthread_create error: %m");
+
+	for (i = 0; i < nr_devs; i++) {
+		pthread_join(d[i].thread, NULL);
+
+		fprintf(stderr, "%s: %llu journal entries (%llu bad checksums)\n",
+			d[i].path, d[i].nr_entries, d[i].nr_csum_bad);
+
+		close(d[i].fd);
+		free(d[i].buckets);
+		free(d[i].obuf);
+	}
+
+	if (out_path)
+		fclose(out.f);
+	free(d);
+}
+
 static void list_journal_usage(void)
 {
 	puts("bcachefs list_journal - print contents of journal\n"
@@ -526,6 +1325,11 @@ static void list_journal_usage(void)
 	     "\n"
 	     "Options:\n"
 	     "  -a            Read entire journal, not just dirty entries\n"
+	     "  -r            Raw mode: stream journal buckets directly,\n"
+	     "                without opening the filesystem\n"
+	     "  -o output     Write output to a file instead of stdout\n"
+	     "  -F format     Raw mode output format: jsonl (summary lines,\n"
+	     "                the default) or binary (validated jsets verbatim)\n"
 	     "  -h            Display this help and exit\n"
 	     "Report bugs to <linux-bcache@vger.kernel.org>");
 }
@@ -533,6 +1337,8 @@ static void list_journal_usage(void)
 int cmd_list_journal(int argc, char *argv[])
 {
 	struct bch_opts opts = bch2_opts_empty();
+	const char *out_path = NULL;
+	bool raw = false, jsonl = true;
 	int opt;
 
 	opt_set(opts, nochanges,	true);
@@ -542,11 +1348,25 @@ int cmd_list_journal(int argc, char *argv[])
 	opt_set(opts, fix_errors,	FSCK_OPT_YES);
 	opt_set(opts, keep_journal,	true);
 
-	while ((opt = getopt(argc, argv, "ah")) != -1)
+	while ((opt = getopt(argc, argv, "aro:F:h")) != -1)
 		switch (opt) {
 		case 'a':
 			opt_set(opts, read_entire_journal, true);
 			break;
+		case 'r':
+			raw = true;
+			break;
+		case 'o':
+			out_path = optarg;
+			break;
+		case 'F':
+			if (!strcmp(optarg, "jsonl"))
+				jsonl = true;
+			else if (!strcmp(optarg, "binary"))
+				jsonl = false;
+			else
+				die("invalid format %s", optarg);
+			break;
 		case 'h':
 			list_journal_usage();
 			exit(EXIT_SUCCESS);
@@ -556,6 +1376,11 @@ int cmd_list_journal(int argc, char *argv[])
 	if (!argc)
 		die("Please supply device(s) to open");
 
+	if (raw) {
+		list_journal_raw(argv, argc, out_path, jsonl);
+		return 0;
+	}
+
 	struct bch_fs *c = bch2_fs_open(argv, argc, opts);
 	if (IS_ERR(c))
 		die("error opening %s: %s", argv[0], strerror(-PTR_ERR(c)));
@@ -593,3 +1418,261 @@ int cmd_list_journal(int argc, char *argv[])
 	bch2_fs_stop(c);
 	return 0;
 }
+
+static void list_trace_usage(void)
+{
+	puts("bcachefs list_trace - dump an in process tracing buffer\n"
+	     "Usage: bcachefs list_trace [OPTION]... <file>\n"
+	     "\n"
+	     "<file> is the trace buffer a bcachefs process was started with\n"
+	     "in BCACHEFS_TRACE\n"
+	     "\n"
+	     "Options:\n"
+	     "  -h            Display this help and exit\n"
+	     "Report bugs to <linux-bcache@vger.kernel.org>");
+}
+
+struct trace_dump_entry {
+	u64			time;
+	u64			tid;
+	u32			id;
+	u64			arg;
+};
+
+static int trace_dump_entry_cmp(const void *_l, const void *_r)
+{
+	const struct trace_dump_entry *l = _l, *r = _r;
+
+	return cmp_int(l->time, r->time);
+}
+
+int cmd_list_trace(int argc, char *argv[])
+{
+	struct trace_buf *t;
+	struct trace_dump_entry *d;
+	unsigned i, j, nr = 0;
+	int fd, opt;
+
+	while ((opt = getopt(argc, argv, "h")) != -1)
+		switch (opt) {
+		case 'h':
+			list_trace_usage();
+			exit(EXIT_SUCCESS);
+		}
+	args_shift(optind);
+
+	char *path = arg_pop();
+	if (!path)
+		die("Please supply a trace buffer file");
+
+	if (argc)
+		die("too many arguments");
+
+	fd = xopen(path, O_RDONLY);
+	t = mmap(NULL, sizeof(*t), PROT_READ, MAP_SHARED, fd, 0);
+	if (t == MAP_FAILED)
+		die("error mapping %s: %m", path);
+
+	if (t->magic != TRACE_BUF_MAGIC)
+		die("%s does not look like a trace buffer", path);
+	if (t->version != TRACE_BUF_VERSION)
+		die("unknown trace buffer version %u", t->version);
+
+	d = xmalloc(TRACE_THREADS_MAX * TRACE_RING_ENTRIES * sizeof(*d));
+
+	for (i = 0; i < TRACE_THREADS_MAX; i++) {
+		struct trace_ring *r = &t->rings[i];
+		u64 head = r->head;
+		u64 first = head > TRACE_RING_ENTRIES
+			? head - TRACE_RING_ENTRIES : 0;
+		u64 e;
+
+		if (!r->tid)
+			continue;
+
+		for (e = first; e < head; e++) {
+			struct trace_entry *s =
+				&r->entries[e & (TRACE_RING_ENTRIES - 1)];
+
+			if (!s->id || s->id > t->nr_names)
+				continue;
+
+			d[nr++] = (struct trace_dump_entry) {
+				.time	= s->time,
+				.tid	= r->tid,
+				.id	= s->id,
+				.arg	= s->arg,
+			};
+		}
+	}
+
+	sort(d, nr, sizeof(*d), trace_dump_entry_cmp, NULL);
+
+	for (j = 0; j < nr; j++)
+		printf("%20llu %8llu %-32.*s %llx\n",
+		       d[j].time,
+		       d[j].tid,
+		       TRACE_NAME_LEN, t->names[d[j].id - 1],
+		       d[j].arg);
+
+	free(d);
+	munmap(t, sizeof(*t));
+	close(fd);
+	return 0;
+}
+
+static void perf_usage(void)
+{
+	puts("bcachefs perf - run btree microbenchmarks\n"
+	     "Usage: bcachefs perf [OPTION]... <devices>\n"
+	     "\n"
+	     "Runs the requested workloads against an offline filesystem and\n"
+	     "reports ops/sec plus latency percentiles from the internal\n"
+	     "time_stats. WARNING: writes benchmark keys into the filesystem\n"
+	     "\n"
+	     "Options:\n"
+	     "  -t tests      Comma separated list of tests to run\n"
+	     "                (default: the rand_*/seq_* suite)\n"
+	     "  -n nr         Iterations per test (default 1M)\n"
+	     "  -j threads    Comma separated list of thread counts (default 1,2,4)\n"
+	     "  -h            Display this help and exit\n"
+	     "Report bugs to <linux-bcache@vger.kernel.org>");
+}
+
+static void perf_print_time_stats(struct bch_fs *c)
+{
+	static const char * const stats_names[] = {
+#define x(n) #n,
+	BCH_TIME_STATS()
+#undef x
+	};
+	unsigned i;
+
+	for (i = 0; i < ARRAY_SIZE(stats_names); i++) {
+		struct time_stats *stats = &c->times[i];
+		char buf[4096];
+		struct printbuf out = PBUF(buf);
+
+		if (!stats->count)
+			continue;
+
+		bch2_time_stats_to_text(&out, stats);
+		printf("%s:\n%s\n", stats_names[i], buf);
+	}
+}
+
+int cmd_perf(int argc, char *argv[])
+{
+	struct bch_opts opts = bch2_opts_empty();
+	char *tests = NULL, *threads = NULL, *p, *t;
+	u64 nr = 1000000;
+	int opt;
+
+	opt_set(opts, degraded, true);
+
+	while ((opt = getopt(argc, argv, "t:n:j:h")) != -1)
+		switch (opt) {
+		case 't':
+			tests = strdup(optarg);
+			break;
+		case 'n':
+			if (bch2_strtoull_h(optarg, &nr) || !nr)
+				die("invalid nr %s", optarg);
+			break;
+		case 'j':
+			threads = strdup(optarg);
+			break;
+		case 'h':
+			perf_usage();
+			exit(EXIT_SUCCESS);
+		}
+	args_shift(optind);
+
+	if (!argc)
+		die("Please supply device(s)");
+
+	if (!tests)
+		tests = strdup("rand_insert,rand_lookup,rand_mixed,rand_delete,"
+			       "seq_insert,seq_lookup,seq_overwrite,seq_delete");
+	if (!threads)
+		threads = strdup("1,2,4");
+
+	struct bch_fs *c = bch2_fs_open(argv, argc, opts);
+	if (IS_ERR(c))
+		die("error opening %s: %s", argv[0], strerror(-PTR_ERR(c)));
+
+	p = threads;
+	while ((t = strsep(&p, ","))) {
+		char *tests_copy = strdup(tests), *q = tests_copy, *test;
+		unsigned i, nr_threads;
+
+		if (kstrtouint(t, 10, &nr_threads) || !nr_threads)
+			die("invalid thread count %s", t);
+
+		while ((test = strsep(&q, ","))) {
+			for (i = 0; i < BCH_TIME_STAT_NR; i++)
+				bch2_time_stats_reset(&c->times[i]);
+
+			if (bch2_btree_perf_test(c, test, nr, nr_threads))
+				die("unknown test %s", test);
+
+			perf_print_time_stats(c);
+		}
+
+		free(tests_copy);
+	}
+
+	free(tests);
+	free(threads);
+	bch2_fs_stop(c);
+	return 0;
+}
+
+static void raid_bench_usage(void)
+{
+	puts("bcachefs raid-bench - benchmark erasure coding implementations\n"
+	     "Usage: bcachefs raid-bench [OPTION]...\n"
+	     "\n"
+	     "Runs the raid library self test, then times every parity\n"
+	     "generation and recovery implementation the CPU supports and\n"
+	     "prints the results, marking the selected winners with a *.\n"
+	     "The cached per machine selection (" RAID_BENCH_CACHE ")\n"
+	     "is refreshed with the new measurements.\n"
+	     "\n"
+	     "Options:\n"
+	     "  -h            Display this help and exit\n"
+	     "Report bugs to <linux-bcache@vger.kernel.org>");
+}
+
+static void raid_bench_report(const struct raid_bench_result *res, void *arg)
+{
+	printf("%-6s %-12s %8u MB/s%s\n",
+	       res->slot, res->tag, res->speed,
+	       res->chosen ? " *" : "");
+}
+
+int cmd_raid_bench(int argc, char *argv[])
+{
+	int opt;
+
+	while ((opt = getopt(argc, argv, "h")) != -1)
+		switch (opt) {
+		case 'h':
+			raid_bench_usage();
+			exit(EXIT_SUCCESS);
+		}
+	args_shift(optind);
+
+	if (argc)
+		die("too many arguments");
+
+	if (raid_selftest())
+		die("raid self test failed");
+
+	printf("%-6s %-12s %13s\n", "slot", "impl", "speed");
+
+	if (raid_bench(RAID_BENCH_CACHE, true, raid_bench_report, NULL))
+		die("error running raid benchmark");
+
+	return 0;
+}
@@ -33,10 +33,13 @@
 x(0,	replicas,		required_argument)	\
 x(0,	encrypted,		no_argument)		\
 x(0,	no_passphrase,		no_argument)		\
+x(0,	scrypt_n,		required_argument)	\
 x('L',	label,			required_argument)	\
 x('U',	uuid,			required_argument)	\
 x(0,	fs_size,		required_argument)	\
 x(0,	bucket_size,		required_argument)	\
+x(0,	bucket_probe,		no_argument)		\
+x(0,	encoded_extent_max,	required_argument)	\
 x('g',	group,			required_argument)	\
 x(0,	discard,		no_argument)		\
 x(0,	data_allowed,		required_argument)	\
@@ -58,6 +61,16 @@ static void usage(void)
 	     "      --replicas=#            Sets both data and metadata replicas\n"
 	     "      --encrypted             Enable whole filesystem encryption (chacha20/poly1305)\n"
 	     "      --no_passphrase         Don't encrypt master encryption key\n"
+	     "      --scrypt_n=#            Scrypt CPU/memory cost for the passphrase KDF\n"
+	     "                              (power of two, default 16384)\n"
+	     "      --bucket_probe          Measure each device's sequential/random\n"
+	     "                              performance and size buckets from that,\n"
+	     "                              recording the measurements in the superblock\n"
+	     "      --encoded_extent_max=size\n"
+	     "                              Checksum/compression granularity: max size an\n"
+	     "                              extent may be encoded as, and the unit that has\n"
+	     "                              to be re-checksummed on partial overwrites\n"
+	     "                              (default 64k)\n"
 	     "  -L, --label=label\n"
 	     "  -U, --uuid=uuid\n"
 	     "\n"
@@ -143,6 +156,22 @@ int cmd_format(int argc, char *argv[])
 		case O_no_passphrase:
 			no_passphrase = true;
 			break;
+		case O_scrypt_n: {
+			u64 v;
+
+			if (bch2_strtoull_h(optarg, &v))
+				die("invalid scrypt_n");
+
+			/* The superblock stores ilog2 of this: */
+			if (!is_power_of_2(v) || v < 2 || v > 1U << 30)
+				die("scrypt_n must be a power of two");
+
+			opts.scrypt_n = v;
+			break;
+		}
+		case O_bucket_probe:
+			opts.bucket_probe = true;
+			break;
 		case O_label:
 		case 'L':
 			opts.label = optarg;
@@ -166,6 +195,14 @@ int cmd_format(int argc, char *argv[])
 			dev_opts.bucket_size =
 				hatoi_validate(optarg, "bucket size");
 			break;
+		case O_encoded_extent_max:
+			opts.encoded_extent_max =
+				hatoi_validate(optarg, "encoded extent max");
+
+			/* The superblock stores ilog2 of this: */
+			if (!is_power_of_2(opts.encoded_extent_max))
+				die("encoded extent max must be a power of two");
+			break;
 		case O_group:
 		case 'g':
 			dev_opts.group = optarg;
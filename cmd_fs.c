@@ -28,11 +28,10 @@ static void print_dev_usage_type(const char *type,
 	       pr_units(frag, units));
 }
 
-static void print_dev_usage(struct bchfs_handle fs,
+static void print_dev_usage(struct bch_ioctl_dev_usage u,
 			    struct dev_name *d,
 			    enum units units)
 {
-	struct bch_ioctl_dev_usage u = bchu_dev_usage(fs, d->idx);
 	unsigned i;
 
 	printf("\n");
@@ -121,10 +120,45 @@ static void print_replicas_usage(const struct bch_replicas_usage *r,
 }
 
 #define for_each_usage_replica(_u, _r)					\
-	for (_r = (_u)->replicas;					\
-	     _r != (void *) (_u)->replicas + (_u)->replica_entries_bytes;\
+	for (_r = usage_all_replicas(_u);				\
+	     _r != (void *) usage_all_replicas(_u) + (_u)->replica_entries_bytes;\
 	     _r = replicas_usage_next(_r),				\
-	     BUG_ON((void *) _r > (void *) (_u)->replicas + (_u)->replica_entries_bytes))
+	     BUG_ON((void *) _r > (void *) usage_all_replicas(_u) + (_u)->replica_entries_bytes))
+
+/*
+ * Kernel doesn't have BCH_IOCTL_USAGE_ALL: build the same snapshot (minus the
+ * atomicity) from the old per device ioctls:
+ */
+static struct bch_ioctl_usage_all *
+usage_all_fallback(struct bchfs_handle fs, dev_names *dev_names)
+{
+	struct bch_ioctl_fs_usage *f = bchu_fs_usage(fs);
+	struct bch_ioctl_usage_all *u;
+	struct dev_name *dev;
+	unsigned i;
+
+	u = xcalloc(1, sizeof(*u) +
+		    BCH_SB_MEMBERS_MAX * sizeof(struct bch_ioctl_dev_usage) +
+		    f->replica_entries_bytes);
+
+	u->version		= BCH_IOCTL_USAGE_ALL_VERSION;
+	u->nr_devices		= BCH_SB_MEMBERS_MAX;
+	u->capacity		= f->capacity;
+	u->used			= f->used;
+	u->online_reserved	= f->online_reserved;
+
+	for (i = 0; i < BCH_REPLICAS_MAX; i++)
+		u->persistent_reserved[i] = f->persistent_reserved[i];
+
+	u->replica_entries_bytes = f->replica_entries_bytes;
+	memcpy(usage_all_replicas(u), f->replicas, f->replica_entries_bytes);
+	free(f);
+
+	darray_foreach(dev, *dev_names)
+		*usage_all_dev(u, dev->idx) = bchu_dev_usage(fs, dev->idx);
+
+	return u;
+}
 
 static void print_fs_usage(const char *path, enum units units)
 {
@@ -136,7 +170,8 @@ static void print_fs_usage(const char *path, enum units units)
 	struct dev_name *dev;
 	dev_names dev_names = bchu_fs_get_devices(fs);
 
-	struct bch_ioctl_fs_usage *u = bchu_fs_usage(fs);
+	struct bch_ioctl_usage_all *u = bchu_usage_all(fs) ?:
+		usage_all_fallback(fs, &dev_names);
 
 	uuid_unparse(fs.uuid.b, uuid);
 	printf("Filesystem %s:\n", uuid);
@@ -179,13 +214,13 @@ static void print_fs_usage(const char *path, enum units units)
 		if (r->r.data_type > BCH_DATA_user)
 			print_replicas_usage(r, &dev_names, units);
 
-	free(u);
-
 	sort(&darray_item(dev_names, 0), darray_size(dev_names),
 	     sizeof(darray_item(dev_names, 0)), dev_by_label_cmp, NULL);
 
 	darray_foreach(dev, dev_names)
-		print_dev_usage(fs, dev, units);
+		print_dev_usage(*usage_all_dev(u, dev->idx), dev, units);
+
+	free(u);
 
 	darray_foreach(dev, dev_names) {
 		free(dev->dev);
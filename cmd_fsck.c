@@ -17,6 +17,8 @@ static void usage(void)
 	     "  -y                     Assume \"yes\" to all questions\n"
 	     "  -f                     Force checking even if filesystem is marked clean\n"
 	     " --reconstruct_alloc     Reconstruct the alloc btree\n"
+	     " --accounting-only       Only check allocation and usage info, skipping\n"
+	     "                         namespace (inode/dirent) checks - much faster\n"
 	     "  -v                     Be verbose\n"
 	     "  -h                     Display this help and exit\n"
 	     "Report bugs to <linux-bcachefs@vger.kernel.org>");
@@ -26,6 +28,7 @@ int cmd_fsck(int argc, char *argv[])
 {
 	static const struct option longopts[] = {
 		{ "reconstruct_alloc",	no_argument,		NULL, 'R' },
+		{ "accounting-only",	no_argument,		NULL, 'A' },
 		{ NULL }
 	};
 	struct bch_opts opts = bch2_opts_empty();
@@ -62,6 +65,9 @@ int cmd_fsck(int argc, char *argv[])
 		case 'R':
 			opt_set(opts, reconstruct_alloc, true);
 			break;
+		case 'A':
+			opt_set(opts, fsck_accounting_only, true);
+			break;
 		case 'v':
 			opt_set(opts, verbose, true);
 			break;
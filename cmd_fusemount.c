@@ -3,6 +3,7 @@
 #include <errno.h>
 #include <float.h>
 #include <getopt.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <sys/statvfs.h>
 
@@ -23,15 +24,124 @@
 #include "libbcachefs/io.h"
 #include "libbcachefs/opts.h"
 #include "libbcachefs/super.h"
+#include "libbcachefs/xattr.h"
 
 /* mode_to_type(): */
 #include "libbcachefs/fs.h"
 
 #include <linux/dcache.h>
+#include <linux/sort.h>
+#include <linux/xattr.h>
 
 /* XXX cut and pasted from fsck.c */
 #define QSTR(n) { { { .len = strlen(n) } }, .name = n }
 
+static void fuse_ra_invalidate(u64 inum);
+
+/*
+ * Entry/attr cache lifetimes handed to the kernel; effectively forever by
+ * default, tunable with -o entry_timeout=/attr_timeout= for workloads where
+ * another process modifies the filesystem:
+ */
+static double bf_entry_timeout = DBL_MAX;
+static double bf_attr_timeout = DBL_MAX;
+
+/*
+ * -o readdir_inum: sort each readdir batch by inode number, so consumers that
+ * stat entries in returned order walk the inodes btree sequentially:
+ */
+static bool bf_readdir_inum;
+
+/*
+ * In process dentry cache: remembers recent lookup hits and misses per
+ * (directory, name), so storms of lookups - especially of nonexistent paths,
+ * e.g. compiler include probing - don't each do full btree lookups.
+ *
+ * Invalidation is by generation: any modification of a directory bumps its
+ * generation, lazily invalidating cached entries under it. One entry per hash
+ * bucket; collisions just overwrite.
+ */
+
+#define DCACHE_NR		8192
+#define DCACHE_DIR_GENS		256
+#define DCACHE_NAME_MAX		255
+
+struct fuse_dentry {
+	u64			dir;
+	u64			gen;
+	u64			inum;	/* 0: negative entry */
+	char			name[DCACHE_NAME_MAX + 1];
+};
+
+static struct {
+	pthread_mutex_t		lock;
+	u64			dir_gen[DCACHE_DIR_GENS];
+	struct fuse_dentry	*entries;
+} dcache = {
+	.lock			= PTHREAD_MUTEX_INITIALIZER,
+};
+
+static u64 dcache_hash(u64 dir, const char *name)
+{
+	u64 hash = dir * 0x9e3779b97f4a7c15ULL;
+
+	while (*name)
+		hash = (hash ^ *name++) * 0x100000001b3ULL;
+	return hash;
+}
+
+/* dcache.lock must be held: */
+static struct fuse_dentry *dcache_entry(u64 dir, const char *name)
+{
+	if (!dcache.entries)
+		dcache.entries = xcalloc(DCACHE_NR, sizeof(*dcache.entries));
+
+	return &dcache.entries[dcache_hash(dir, name) & (DCACHE_NR - 1)];
+}
+
+/* Returns the inum, 0 for a cached negative entry, or -1 if not cached: */
+static s64 dcache_lookup(u64 dir, const char *name)
+{
+	struct fuse_dentry *d;
+	s64 ret = -1;
+
+	if (strlen(name) > DCACHE_NAME_MAX)
+		return -1;
+
+	pthread_mutex_lock(&dcache.lock);
+	d = dcache_entry(dir, name);
+	if (d->dir == dir &&
+	    d->gen == dcache.dir_gen[dir % DCACHE_DIR_GENS] &&
+	    !strcmp(d->name, name))
+		ret = d->inum;
+	pthread_mutex_unlock(&dcache.lock);
+
+	return ret;
+}
+
+static void dcache_add(u64 dir, const char *name, u64 inum)
+{
+	struct fuse_dentry *d;
+
+	if (strlen(name) > DCACHE_NAME_MAX)
+		return;
+
+	pthread_mutex_lock(&dcache.lock);
+	d = dcache_entry(dir, name);
+	d->dir	= dir;
+	d->gen	= dcache.dir_gen[dir % DCACHE_DIR_GENS];
+	d->inum	= inum;
+	strcpy(d->name, name);
+	pthread_mutex_unlock(&dcache.lock);
+}
+
+static void dcache_invalidate(u64 dir)
+{
+	pthread_mutex_lock(&dcache.lock);
+	dcache.dir_gen[dir % DCACHE_DIR_GENS]++;
+	pthread_mutex_unlock(&dcache.lock);
+}
+
 static inline u64 map_root_ino(u64 ino)
 {
 	return ino == 1 ? 4096 : ino;
@@ -68,8 +178,8 @@ static struct fuse_entry_param inode_to_entry(struct bch_fs *c,
 		.ino		= unmap_root_ino(bi->bi_inum),
 		.generation	= bi->bi_generation,
 		.attr		= inode_to_stat(c, bi),
-		.attr_timeout	= DBL_MAX,
-		.entry_timeout	= DBL_MAX,
+		.attr_timeout	= bf_attr_timeout,
+		.entry_timeout	= bf_entry_timeout,
 	};
 }
 
@@ -81,6 +191,20 @@ static void bcachefs_fuse_init(void *arg, struct fuse_conn_info *conn)
 	} else
 		fuse_log(FUSE_LOG_DEBUG, "fuse_init: writeback not capable\n");
 
+	/*
+	 * Splice instead of copying through the fuse device wherever the
+	 * kernel supports it:
+	 */
+	conn->want |= conn->capable & (FUSE_CAP_SPLICE_READ|
+				       FUSE_CAP_SPLICE_WRITE|
+				       FUSE_CAP_SPLICE_MOVE);
+
+	/*
+	 * The writeback cache flushes dirty data to us in max_write sized
+	 * chunks; raise it so each flush arrives as a single large write:
+	 */
+	conn->max_write = 1U << 20;
+
 	//conn->want |= FUSE_CAP_POSIX_ACL;
 }
 
@@ -105,6 +229,24 @@ static void bcachefs_fuse_lookup(fuse_req_t req, fuse_ino_t dir,
 
 	dir = map_root_ino(dir);
 
+	s64 cached = dcache_lookup(dir, name);
+	if (!cached) {
+		/* Cached negative entry: */
+		struct fuse_entry_param e = {
+			.attr_timeout	= bf_attr_timeout,
+			.entry_timeout	= bf_entry_timeout,
+		};
+		fuse_reply_entry(req, &e);
+		return;
+	}
+
+	if (cached > 0 &&
+	    !bch2_inode_find_by_inum(c, cached, &bi)) {
+		struct fuse_entry_param e = inode_to_entry(c, &bi);
+		fuse_reply_entry(req, &e);
+		return;
+	}
+
 	ret = bch2_inode_find_by_inum(c, dir, &bi);
 	if (ret) {
 		fuse_reply_err(req, -ret);
@@ -116,9 +258,11 @@ static void bcachefs_fuse_lookup(fuse_req_t req, fuse_ino_t dir,
 	inum = bch2_dirent_lookup(c, dir, &hash_info, &qstr);
 	if (!inum) {
 		struct fuse_entry_param e = {
-			.attr_timeout	= DBL_MAX,
-			.entry_timeout	= DBL_MAX,
+			.attr_timeout	= bf_attr_timeout,
+			.entry_timeout	= bf_entry_timeout,
 		};
+
+		dcache_add(dir, name, 0);
 		fuse_reply_entry(req, &e);
 		return;
 	}
@@ -127,6 +271,8 @@ static void bcachefs_fuse_lookup(fuse_req_t req, fuse_ino_t dir,
 	if (ret)
 		goto err;
 
+	dcache_add(dir, name, inum);
+
 	fuse_log(FUSE_LOG_DEBUG, "fuse_lookup ret(inum=%llu)\n",
 		 bi.bi_inum);
 
@@ -161,7 +307,7 @@ static void bcachefs_fuse_getattr(fuse_req_t req, fuse_ino_t inum,
 	fuse_log(FUSE_LOG_DEBUG, "fuse_getattr success\n");
 
 	attr = inode_to_stat(c, &bi);
-	fuse_reply_attr(req, &attr, DBL_MAX);
+	fuse_reply_attr(req, &attr, bf_attr_timeout);
 }
 
 static void bcachefs_fuse_setattr(fuse_req_t req, fuse_ino_t inum,
@@ -218,8 +364,11 @@ err:
 	bch2_trans_exit(&trans);
 
 	if (!ret) {
+		if (to_set & FUSE_SET_ATTR_SIZE)
+			fuse_ra_invalidate(inum);
+
 		*attr = inode_to_stat(c, &inode_u);
-		fuse_reply_attr(req, attr, DBL_MAX);
+		fuse_reply_attr(req, attr, bf_attr_timeout);
 	} else {
 		fuse_reply_err(req, -ret);
 	}
@@ -236,11 +385,14 @@ static int do_create(struct bch_fs *c, u64 dir,
 
 	bch2_inode_init_early(c, new_inode);
 
-	return bch2_trans_do(c, NULL, NULL, 0,
+	int ret = bch2_trans_do(c, NULL, NULL, 0,
 			bch2_create_trans(&trans,
 				dir, &dir_u,
 				new_inode, &qstr,
-				0, 0, mode, rdev, NULL, NULL));
+				0, 0, mode, rdev, NULL, NULL, NULL, NULL));
+	if (!ret)
+		dcache_invalidate(dir);
+	return ret;
 }
 
 static void bcachefs_fuse_mknod(fuse_req_t req, fuse_ino_t dir,
@@ -291,6 +443,8 @@ static void bcachefs_fuse_unlink(fuse_req_t req, fuse_ino_t dir,
 	ret = bch2_trans_do(c, NULL, NULL, BTREE_INSERT_NOFAIL,
 			    bch2_unlink_trans(&trans, dir, &dir_u,
 					      &inode_u, &qstr));
+	if (!ret)
+		dcache_invalidate(dir);
 
 	fuse_reply_err(req, -ret);
 }
@@ -332,6 +486,10 @@ static void bcachefs_fuse_rename(fuse_req_t req,
 				  &src_inode_u, &dst_inode_u,
 				  &src_name, &dst_name,
 				  BCH_RENAME));
+	if (!ret) {
+		dcache_invalidate(src_dir);
+		dcache_invalidate(dst_dir);
+	}
 
 	fuse_reply_err(req, -ret);
 }
@@ -354,6 +512,7 @@ static void bcachefs_fuse_link(fuse_req_t req, fuse_ino_t inum,
 					    inum, &dir_u, &inode_u, &qstr));
 
 	if (!ret) {
+		dcache_invalidate(newparent);
 		struct fuse_entry_param e = inode_to_entry(c, &inode_u);
 		fuse_reply_entry(req, &e);
 	} else {
@@ -361,16 +520,31 @@ static void bcachefs_fuse_link(fuse_req_t req, fuse_ino_t inum,
 	}
 }
 
+/* Per file handle readahead state, hung off fi->fh: */
+struct fuse_file_ra {
+	off_t			next_offset;
+	unsigned		seq_count;
+};
+
 static void bcachefs_fuse_open(fuse_req_t req, fuse_ino_t inum,
 			       struct fuse_file_info *fi)
 {
 	fi->direct_io		= false;
 	fi->keep_cache		= true;
 	fi->cache_readdir	= true;
+	fi->fh			= (unsigned long)
+		xcalloc(1, sizeof(struct fuse_file_ra));
 
 	fuse_reply_open(req, fi);
 }
 
+static void bcachefs_fuse_release(fuse_req_t req, fuse_ino_t inum,
+				  struct fuse_file_info *fi)
+{
+	free((void *) (unsigned long) fi->fh);
+	fuse_reply_err(req, 0);
+}
+
 static void userbio_init(struct bio *bio, struct bio_vec *bv,
 			 void *buf, size_t size)
 {
@@ -444,6 +618,54 @@ static size_t align_fix_up_bytes(const struct fuse_align_io *align,
 	return bytes;
 }
 
+/*
+ * Pool of page aligned io buffers, so the read/write paths don't do an
+ * aligned_alloc() per request:
+ */
+
+#define FUSE_IO_BUF_SIZE	(2U << 20)
+#define FUSE_IO_BUF_POOL_NR	16
+
+static struct {
+	pthread_mutex_t		lock;
+	void			*bufs[FUSE_IO_BUF_POOL_NR];
+	unsigned		nr;
+} fuse_io_buf_pool = {
+	.lock			= PTHREAD_MUTEX_INITIALIZER,
+};
+
+static void *fuse_io_buf_get(size_t size)
+{
+	void *buf = NULL;
+
+	if (size > FUSE_IO_BUF_SIZE)
+		return aligned_alloc(PAGE_SIZE, size);
+
+	pthread_mutex_lock(&fuse_io_buf_pool.lock);
+	if (fuse_io_buf_pool.nr)
+		buf = fuse_io_buf_pool.bufs[--fuse_io_buf_pool.nr];
+	pthread_mutex_unlock(&fuse_io_buf_pool.lock);
+
+	return buf ?: aligned_alloc(PAGE_SIZE, FUSE_IO_BUF_SIZE);
+}
+
+static void fuse_io_buf_put(void *buf, size_t size)
+{
+	if (!buf)
+		return;
+
+	if (size <= FUSE_IO_BUF_SIZE) {
+		pthread_mutex_lock(&fuse_io_buf_pool.lock);
+		if (fuse_io_buf_pool.nr < FUSE_IO_BUF_POOL_NR) {
+			fuse_io_buf_pool.bufs[fuse_io_buf_pool.nr++] = buf;
+			buf = NULL;
+		}
+		pthread_mutex_unlock(&fuse_io_buf_pool.lock);
+	}
+
+	free(buf);
+}
+
 /*
  * Read aligned data.
  */
@@ -477,6 +699,196 @@ static int read_aligned(struct bch_fs *c, fuse_ino_t inum, size_t aligned_size,
 	return -blk_status_to_errno(rbio.bio.bi_status);
 }
 
+/*
+ * Readahead: sequential reads are detected per file handle, and trigger
+ * asynchronous prefetches of the next readahead windows into a small cache of
+ * extents keyed by inode number - without this, streaming reads through the
+ * fuse mount degrade to request sized device io:
+ */
+
+#define FUSE_RA_WINDOW		(1U << 20)
+#define FUSE_RA_EXTENTS_NR	8
+#define FUSE_RA_MIN_SEQ		2
+
+struct fuse_ra_extent {
+	u64			inum;
+	off_t			start;
+	size_t			size;
+	int			error;
+	bool			inflight;
+	unsigned		ref;
+	u64			lru;
+	void			*buf;
+};
+
+static struct {
+	pthread_mutex_t		lock;
+	pthread_cond_t		wait;
+	u64			lru_clock;
+	struct fuse_ra_extent	extents[FUSE_RA_EXTENTS_NR];
+} fuse_ra = {
+	.lock			= PTHREAD_MUTEX_INITIALIZER,
+	.wait			= PTHREAD_COND_INITIALIZER,
+};
+
+/* fuse_ra.lock must be held: */
+static struct fuse_ra_extent *fuse_ra_find(u64 inum, off_t start, size_t size)
+{
+	struct fuse_ra_extent *e;
+
+	for (e = fuse_ra.extents;
+	     e < fuse_ra.extents + FUSE_RA_EXTENTS_NR;
+	     e++)
+		if (e->buf &&
+		    e->inum == inum &&
+		    start >= e->start &&
+		    start + size <= e->start + (off_t) e->size)
+			return e;
+	return NULL;
+}
+
+struct fuse_ra_prefetch {
+	struct bch_fs		*c;
+	struct fuse_ra_extent	*e;
+};
+
+static void *fuse_ra_prefetch_fn(void *_job)
+{
+	struct fuse_ra_prefetch *job = _job;
+	struct fuse_ra_extent *e = job->e;
+	struct bch_fs *c = job->c;
+	struct bch_inode_unpacked bi;
+	size_t size = 0;
+	int ret;
+
+	ret = bch2_inode_find_by_inum(c, e->inum, &bi);
+	if (!ret) {
+		off_t end = min_t(u64, round_up(bi.bi_size, block_bytes(c)),
+				  e->start + e->size);
+
+		size = end > e->start ? end - e->start : 0;
+	}
+
+	if (size)
+		ret = read_aligned(c, e->inum, size, e->start, e->buf);
+
+	pthread_mutex_lock(&fuse_ra.lock);
+	e->size		= size;
+	e->error	= ret;
+	e->inflight	= false;
+	pthread_cond_broadcast(&fuse_ra.wait);
+	pthread_mutex_unlock(&fuse_ra.lock);
+
+	free(job);
+	return NULL;
+}
+
+static void fuse_ra_prefetch(struct bch_fs *c, u64 inum, off_t start)
+{
+	struct fuse_ra_extent *e, *evict = NULL;
+	struct fuse_ra_prefetch *job;
+	pthread_t thread;
+
+	pthread_mutex_lock(&fuse_ra.lock);
+
+	if (fuse_ra_find(inum, start, 1)) {
+		pthread_mutex_unlock(&fuse_ra.lock);
+		return;
+	}
+
+	for (e = fuse_ra.extents;
+	     e < fuse_ra.extents + FUSE_RA_EXTENTS_NR;
+	     e++)
+		if (!e->inflight && !e->ref &&
+		    (!evict || e->lru < evict->lru))
+			evict = e;
+
+	if (!evict) {
+		pthread_mutex_unlock(&fuse_ra.lock);
+		return;
+	}
+
+	if (!evict->buf) {
+		evict->buf = aligned_alloc(PAGE_SIZE, FUSE_RA_WINDOW);
+		BUG_ON(!evict->buf);
+	}
+
+	*evict = (struct fuse_ra_extent) {
+		.inum		= inum,
+		.start		= start,
+		.size		= FUSE_RA_WINDOW,
+		.inflight	= true,
+		.lru		= ++fuse_ra.lru_clock,
+		.buf		= evict->buf,
+	};
+
+	job = xmalloc(sizeof(*job));
+	*job = (struct fuse_ra_prefetch) { .c = c, .e = evict };
+
+	pthread_mutex_unlock(&fuse_ra.lock);
+
+	if (pthread_create(&thread, NULL, fuse_ra_prefetch_fn, job))
+		die("pthread_create error: %m");
+	pthread_detach(thread);
+}
+
+/*
+ * Serve a read from the readahead cache, if possible - waits for a prefetch
+ * covering the range if one is in flight:
+ */
+static bool fuse_ra_read(fuse_req_t req, u64 inum, size_t size,
+			 struct fuse_align_io *align)
+{
+	struct fuse_ra_extent *e;
+	bool ret = false;
+
+	pthread_mutex_lock(&fuse_ra.lock);
+
+	while ((e = fuse_ra_find(inum, align->start, align->size)) &&
+	       e->inflight)
+		pthread_cond_wait(&fuse_ra.wait, &fuse_ra.lock);
+
+	if (e && !e->error) {
+		struct fuse_bufvec bv = FUSE_BUFVEC_INIT(size);
+
+		e->ref++;
+		e->lru = ++fuse_ra.lru_clock;
+		pthread_mutex_unlock(&fuse_ra.lock);
+
+		bv.buf[0].mem = e->buf + (align->start - e->start) +
+			align->pad_start;
+		fuse_reply_data(req, &bv, FUSE_BUF_SPLICE_MOVE);
+
+		pthread_mutex_lock(&fuse_ra.lock);
+		e->ref--;
+		pthread_cond_broadcast(&fuse_ra.wait);
+		ret = true;
+	}
+
+	pthread_mutex_unlock(&fuse_ra.lock);
+	return ret;
+}
+
+/* Drop cached extents for an inode whose data or size changed: */
+static void fuse_ra_invalidate(u64 inum)
+{
+	struct fuse_ra_extent *e;
+
+	pthread_mutex_lock(&fuse_ra.lock);
+
+	for (e = fuse_ra.extents;
+	     e < fuse_ra.extents + FUSE_RA_EXTENTS_NR;
+	     e++) {
+		while (e->inum == inum && (e->inflight || e->ref))
+			pthread_cond_wait(&fuse_ra.wait, &fuse_ra.lock);
+
+		if (e->inum == inum)
+			e->size = 0;
+	}
+
+	pthread_mutex_unlock(&fuse_ra.lock);
+}
+
 static void bcachefs_fuse_read(fuse_req_t req, fuse_ino_t inum,
 			       size_t size, off_t offset,
 			       struct fuse_file_info *fi)
@@ -503,7 +915,27 @@ static void bcachefs_fuse_read(fuse_req_t req, fuse_ino_t inum,
 
 	struct fuse_align_io align = align_io(c, size, offset);
 
-	void *buf = aligned_alloc(PAGE_SIZE, align.size);
+	/* Sequentiality detection, per file handle: */
+	struct fuse_file_ra *ra = (void *) (unsigned long) fi->fh;
+
+	if (ra) {
+		ra->seq_count	= offset == ra->next_offset
+			? ra->seq_count + 1 : 0;
+		ra->next_offset	= offset + size;
+
+		if (ra->seq_count >= FUSE_RA_MIN_SEQ) {
+			off_t ra_start = round_down(align.end,
+						    (off_t) FUSE_RA_WINDOW);
+
+			fuse_ra_prefetch(c, inum, ra_start);
+			fuse_ra_prefetch(c, inum, ra_start + FUSE_RA_WINDOW);
+		}
+	}
+
+	if (fuse_ra_read(req, inum, size, &align))
+		return;
+
+	void *buf = fuse_io_buf_get(align.size);
 	if (!buf) {
 		fuse_reply_err(req, ENOMEM);
 		return;
@@ -511,12 +943,15 @@ static void bcachefs_fuse_read(fuse_req_t req, fuse_ino_t inum,
 
 	ret = read_aligned(c, inum, align.size, align.start, buf);
 
-	if (likely(!ret))
-		fuse_reply_buf(req, buf + align.pad_start, size);
-	else
+	if (likely(!ret)) {
+		struct fuse_bufvec bv = FUSE_BUFVEC_INIT(size);
+
+		bv.buf[0].mem = buf + align.pad_start;
+		fuse_reply_data(req, &bv, FUSE_BUF_SPLICE_MOVE);
+	} else
 		fuse_reply_err(req, -ret);
 
-	free(buf);
+	fuse_io_buf_put(buf, align.size);
 }
 
 static int inode_update_times(struct bch_fs *c, fuse_ino_t inum)
@@ -555,16 +990,16 @@ err:
 	return ret;
 }
 
-static int write_aligned(struct bch_fs *c, fuse_ino_t inum,
-			 struct bch_io_opts io_opts, void *buf,
-			 size_t aligned_size, off_t aligned_offset,
-			 off_t new_i_size, size_t *written_out)
+static int write_aligned_vecs(struct bch_fs *c, fuse_ino_t inum,
+			      struct bch_io_opts io_opts,
+			      struct bio_vec *bv, unsigned nr, size_t size,
+			      off_t aligned_offset, off_t new_i_size,
+			      size_t *written_out)
 {
 	struct bch_write_op	op = { 0 };
-	struct bio_vec		bv;
 	struct closure		cl;
 
-	BUG_ON(aligned_size & (block_bytes(c) - 1));
+	BUG_ON(size & (block_bytes(c) - 1));
 	BUG_ON(aligned_offset & (block_bytes(c) - 1));
 
 	*written_out = 0;
@@ -572,16 +1007,23 @@ static int write_aligned(struct bch_fs *c, fuse_ino_t inum,
 	closure_init_stack(&cl);
 
 	bch2_write_op_init(&op, c, io_opts); /* XXX reads from op?! */
-	op.write_point	= writepoint_hashed(0);
+	/*
+	 * Writes can run concurrently from the multithreaded session loop;
+	 * give each thread a private write point so they don't serialize on
+	 * open bucket locks or thrash the shared write point table:
+	 */
+	op.write_point	= bch2_writepoint_thread(c);
 	op.nr_replicas	= io_opts.data_replicas;
 	op.target	= io_opts.foreground_target;
 	op.pos		= POS(inum, aligned_offset >> 9);
 	op.new_i_size	= new_i_size;
 
-	userbio_init(&op.wbio.bio, &bv, buf, aligned_size);
+	bio_init(&op.wbio.bio, bv, nr);
+	op.wbio.bio.bi_vcnt		= nr;
+	op.wbio.bio.bi_iter.bi_size	= size;
 	bio_set_op_attrs(&op.wbio.bio, REQ_OP_WRITE, REQ_SYNC);
 
-	if (bch2_disk_reservation_get(c, &op.res, aligned_size >> 9,
+	if (bch2_disk_reservation_get(c, &op.res, size >> 9,
 				      op.nr_replicas, 0)) {
 		/* XXX: use check_range_allocated like dio write path */
 		return -ENOSPC;
@@ -596,28 +1038,112 @@ static int write_aligned(struct bch_fs *c, fuse_ino_t inum,
 	return op.error;
 }
 
-static void bcachefs_fuse_write(fuse_req_t req, fuse_ino_t inum,
-				const char *buf, size_t size,
-				off_t offset,
-				struct fuse_file_info *fi)
+static int write_aligned(struct bch_fs *c, fuse_ino_t inum,
+			 struct bch_io_opts io_opts, void *buf,
+			 size_t aligned_size, off_t aligned_offset,
+			 off_t new_i_size, size_t *written_out)
+{
+	struct bio_vec bv = {
+		.bv_page	= buf,
+		.bv_len		= aligned_size,
+		.bv_offset	= 0,
+	};
+
+	return write_aligned_vecs(c, inum, io_opts, &bv, 1, aligned_size,
+				  aligned_offset, new_i_size, written_out);
+}
+
+static bool fuse_bufv_in_memory(struct fuse_bufvec *bufv)
+{
+	size_t i;
+
+	for (i = 0; i < bufv->count; i++)
+		if (bufv->buf[i].flags & FUSE_BUF_IS_FD)
+			return false;
+	return true;
+}
+
+/*
+ * Zero copy write: build the bio straight over the fuse provided segments and
+ * checksum/compress out of them, no bounce buffer - O_DIRECT writes from the
+ * mount are block aligned and hit this path, so multi-megabyte writes go to
+ * the device in one op at full size:
+ */
+static void bcachefs_fuse_write_direct(fuse_req_t req, fuse_ino_t inum,
+				       struct bch_io_opts io_opts,
+				       struct fuse_bufvec *bufv, off_t offset)
+{
+	struct bch_fs *c = fuse_req_userdata(req);
+	struct bio_vec bv[bufv->count];
+	size_t size = 0, written;
+	unsigned i;
+	int ret;
+
+	for (i = 0; i < bufv->count; i++) {
+		bv[i].bv_page	= bufv->buf[i].mem;
+		bv[i].bv_len	= bufv->buf[i].size;
+		bv[i].bv_offset	= 0;
+		size		+= bufv->buf[i].size;
+	}
+
+	ret = write_aligned_vecs(c, inum, io_opts, bv, bufv->count, size,
+				 offset, offset + size, &written);
+
+	fuse_log(FUSE_LOG_DEBUG, "bcachefs_fuse_write_direct: wrote %zd bytes\n",
+		 written);
+
+	if (written > 0)
+		ret = 0;
+
+	if (!ret)
+		fuse_ra_invalidate(inum);
+
+	if (!ret)
+		ret = inode_update_times(c, inum);
+
+	if (!ret) {
+		BUG_ON(written == 0);
+		fuse_reply_write(req, written);
+	} else {
+		fuse_reply_err(req, -ret);
+	}
+}
+
+static void bcachefs_fuse_write_buf(fuse_req_t req, fuse_ino_t inum,
+				    struct fuse_bufvec *bufv, off_t offset,
+				    struct fuse_file_info *fi)
 {
 	struct bch_fs *c	= fuse_req_userdata(req);
 	struct bch_io_opts	io_opts;
+	size_t			size = fuse_buf_size(bufv);
 	size_t			aligned_written;
 	int			ret = 0;
 
-	fuse_log(FUSE_LOG_DEBUG, "bcachefs_fuse_write(%llu, %zd, %lld)\n",
+	fuse_log(FUSE_LOG_DEBUG, "bcachefs_fuse_write_buf(%llu, %zd, %lld)\n",
 		 inum, size, offset);
 
 	struct fuse_align_io align = align_io(c, size, offset);
-	void *aligned_buf = aligned_alloc(PAGE_SIZE, align.size);
-	BUG_ON(!aligned_buf);
 
 	if (get_inode_io_opts(c, inum, &io_opts)) {
-		ret = -ENOENT;
-		goto err;
+		fuse_reply_err(req, ENOENT);
+		return;
+	}
+
+	/*
+	 * Aligned writes from memory buffers don't need the bounce buffer;
+	 * bounce only when the source is a pipe (splice read negotiated) or
+	 * partial blocks need read-modify-write:
+	 */
+	if (!align.pad_start && !align.pad_end &&
+	    !bufv->idx && !bufv->off &&
+	    fuse_bufv_in_memory(bufv)) {
+		bcachefs_fuse_write_direct(req, inum, io_opts, bufv, offset);
+		return;
 	}
 
+	void *aligned_buf = fuse_io_buf_get(align.size);
+	BUG_ON(!aligned_buf);
+
 	/* Realign the data and read in start and end, if needed */
 
 	/* Read partial start data. */
@@ -647,8 +1173,19 @@ static void bcachefs_fuse_write(fuse_req_t req, fuse_ino_t inum,
 			goto err;
 	}
 
-	/* Overlay what we want to write. */
-	memcpy(aligned_buf + align.pad_start, buf, size);
+	/*
+	 * Overlay what we want to write - with splice read negotiated the
+	 * source is a pipe, and this splices instead of copying:
+	 */
+	struct fuse_bufvec dst = FUSE_BUFVEC_INIT(size);
+	dst.buf[0].mem = aligned_buf + align.pad_start;
+
+	ssize_t copied = fuse_buf_copy(&dst, bufv, 0);
+	if (copied < 0) {
+		ret = copied;
+		goto err;
+	}
+	BUG_ON((size_t) copied != size);
 
 	/* Actually write. */
 	ret = write_aligned(c, inum, io_opts, aligned_buf,
@@ -659,12 +1196,15 @@ static void bcachefs_fuse_write(fuse_req_t req, fuse_ino_t inum,
 	size_t written = align_fix_up_bytes(&align, aligned_written);
 	BUG_ON(written > size);
 
-	fuse_log(FUSE_LOG_DEBUG, "bcachefs_fuse_write: wrote %zd bytes\n",
+	fuse_log(FUSE_LOG_DEBUG, "bcachefs_fuse_write_buf: wrote %zd bytes\n",
 		 written);
 
 	if (written > 0)
 		ret = 0;
 
+	if (!ret)
+		fuse_ra_invalidate(inum);
+
 	/*
 	 * Update inode times.
 	 * TODO: Integrate with bch2_extent_update()
@@ -675,13 +1215,24 @@ static void bcachefs_fuse_write(fuse_req_t req, fuse_ino_t inum,
 	if (!ret) {
 		BUG_ON(written == 0);
 		fuse_reply_write(req, written);
-		free(aligned_buf);
+		fuse_io_buf_put(aligned_buf, align.size);
 		return;
 	}
 
 err:
 	fuse_reply_err(req, -ret);
-	free(aligned_buf);
+	fuse_io_buf_put(aligned_buf, align.size);
+}
+
+static void bcachefs_fuse_write(fuse_req_t req, fuse_ino_t inum,
+				const char *buf, size_t size,
+				off_t offset,
+				struct fuse_file_info *fi)
+{
+	struct fuse_bufvec bufv = FUSE_BUFVEC_INIT(size);
+
+	bufv.buf[0].mem = (void *) buf;
+	bcachefs_fuse_write_buf(req, inum, &bufv, offset, fi);
 }
 
 static void bcachefs_fuse_symlink(fuse_req_t req, const char *link,
@@ -708,7 +1259,7 @@ static void bcachefs_fuse_symlink(fuse_req_t req, const char *link,
 
 	struct fuse_align_io align = align_io(c, link_len + 1, 0);
 
-	void *aligned_buf = aligned_alloc(PAGE_SIZE, align.size);
+	void *aligned_buf = fuse_io_buf_get(align.size);
 	BUG_ON(!aligned_buf);
 
 	memset(aligned_buf, 0, align.size);
@@ -718,7 +1269,7 @@ static void bcachefs_fuse_symlink(fuse_req_t req, const char *link,
 	ret = write_aligned(c, new_inode.bi_inum, io_opts, aligned_buf,
 			    align.size, align.start, link_len + 1,
 			    &aligned_written);
-	free(aligned_buf);
+	fuse_io_buf_put(aligned_buf, align.size);
 
 	if (ret)
 		goto err;
@@ -755,7 +1306,7 @@ static void bcachefs_fuse_readlink(fuse_req_t req, fuse_ino_t inum)
 	struct fuse_align_io align = align_io(c, bi.bi_size, 0);
 
 	ret = -ENOMEM;
-	buf = aligned_alloc(PAGE_SIZE, align.size);
+	buf = fuse_io_buf_get(align.size);
 	if (!buf)
 		goto err;
 
@@ -771,7 +1322,8 @@ err:
 	if (ret)
 		fuse_reply_err(req, -ret);
 
-	free(buf);
+	if (buf)
+		fuse_io_buf_put(buf, align.size);
 }
 
 #if 0
@@ -788,12 +1340,6 @@ static void bcachefs_fuse_flush(fuse_req_t req, fuse_ino_t inum,
 	struct bch_fs *c = fuse_req_userdata(req);
 }
 
-static void bcachefs_fuse_release(fuse_req_t req, fuse_ino_t inum,
-				  struct fuse_file_info *fi)
-{
-	struct bch_fs *c = fuse_req_userdata(req);
-}
-
 static void bcachefs_fuse_fsync(fuse_req_t req, fuse_ino_t inum, int datasync,
 				struct fuse_file_info *fi)
 {
@@ -897,6 +1443,168 @@ static bool handle_dots(struct fuse_dir_context *ctx, fuse_ino_t dir)
 	return true;
 }
 
+/*
+ * Optional inum-ordered readdir (-o readdir_inum): dirents hash randomly
+ * across the inode space, so a consumer that stats entries in returned order
+ * bounces around the inodes btree. Sorting each batch by inum - and warming
+ * the btree nodes those inodes live in - lets rsync-style directory scans
+ * walk the inodes btree sequentially instead.
+ *
+ * Every entry in a batch carries the batch's resume offset: a reader that
+ * consumes replies in full (the normal case) sees each entry exactly once,
+ * while seeking into the middle of a batch restarts at the following batch:
+ */
+
+struct fuse_rdsort_entry {
+	char			*name;
+	u64			ino;
+	unsigned		type;
+};
+
+struct fuse_rdsort_context {
+	struct dir_context	ctx;
+	fuse_req_t		req;
+	size_t			bufsize;
+	size_t			size_est;
+	loff_t			resume;
+	darray(struct fuse_rdsort_entry) ents;
+};
+
+static int fuse_rdsort_fill(struct dir_context *_ctx,
+			    const char *name, int namelen,
+			    loff_t pos, u64 ino, unsigned type)
+{
+	struct fuse_rdsort_context *ctx =
+		container_of(_ctx, struct fuse_rdsort_context, ctx);
+	struct fuse_rdsort_entry ent = {
+		.name		= strndup(name, namelen),
+		.ino		= ino,
+		.type		= type,
+	};
+	size_t entsize = fuse_add_direntry(ctx->req, NULL, 0, ent.name,
+					   NULL, 0);
+
+	if (ctx->size_est + entsize > ctx->bufsize) {
+		free(ent.name);
+		return -1;
+	}
+
+	ctx->size_est += entsize;
+	ctx->resume = pos + 1;
+	darray_append(ctx->ents, ent);
+	return 0;
+}
+
+static int fuse_rdsort_cmp(const void *_l, const void *_r)
+{
+	const struct fuse_rdsort_entry *l = _l, *r = _r;
+
+	return cmp_int(l->ino, r->ino);
+}
+
+/* Warm the inode btree nodes covering this batch, in key order: */
+static void fuse_rdsort_prefetch(struct bch_fs *c,
+				 struct fuse_rdsort_context *ctx)
+{
+	struct btree_trans trans;
+	struct btree_iter *iter;
+	struct fuse_rdsort_entry *e;
+
+	bch2_trans_init(&trans, c, 0, 0);
+	iter = bch2_trans_get_iter(&trans, BTREE_ID_INODES, POS_MIN,
+				   BTREE_ITER_SLOTS);
+	if (IS_ERR(iter))
+		goto err;
+
+	darray_foreach(e, ctx->ents) {
+		bch2_btree_iter_set_pos(iter, POS(0, e->ino));
+
+		/* Best effort - don't bother restarting on -EINTR: */
+		if (bkey_err(bch2_btree_iter_peek_slot(iter)))
+			break;
+	}
+
+	bch2_trans_iter_put(&trans, iter);
+err:
+	bch2_trans_exit(&trans);
+}
+
+static void bcachefs_fuse_readdir_sorted(fuse_req_t req, fuse_ino_t dir,
+					 size_t size, off_t off)
+{
+	struct bch_fs *c = fuse_req_userdata(req);
+	struct bch_inode_unpacked bi;
+	struct fuse_rdsort_context ctx = {
+		.ctx.actor	= fuse_rdsort_fill,
+		.ctx.pos	= off,
+		.req		= req,
+		.bufsize	= size,
+		.resume		= off,
+	};
+	struct fuse_rdsort_entry *e;
+	char *buf = calloc(size, 1);
+	size_t used = 0;
+	int ret = 0;
+
+	dir = map_root_ino(dir);
+
+	ret = bch2_inode_find_by_inum(c, dir, &bi);
+	if (ret)
+		goto reply;
+
+	if (!S_ISDIR(bi.bi_mode)) {
+		ret = -ENOTDIR;
+		goto reply;
+	}
+
+	if (ctx.ctx.pos == 0) {
+		if (fuse_rdsort_fill(&ctx.ctx, ".", 1, ctx.ctx.pos,
+				     dir, DT_DIR) < 0)
+			goto emit;
+		ctx.ctx.pos = 1;
+	}
+
+	if (ctx.ctx.pos == 1) {
+		if (fuse_rdsort_fill(&ctx.ctx, "..", 2, ctx.ctx.pos,
+				     /*TODO: parent*/ 1, DT_DIR) < 0)
+			goto emit;
+		ctx.ctx.pos = 2;
+	}
+
+	ret = bch2_readdir(c, dir, &ctx.ctx);
+	if (ret < 0)
+		goto reply;
+	ret = 0;
+emit:
+	sort(ctx.ents.item, darray_size(ctx.ents),
+	     sizeof(ctx.ents.item[0]), fuse_rdsort_cmp, NULL);
+
+	fuse_rdsort_prefetch(c, &ctx);
+
+	darray_foreach(e, ctx.ents) {
+		struct stat statbuf = {
+			.st_ino		= unmap_root_ino(e->ino),
+			.st_mode	= e->type << 12,
+		};
+		size_t len = fuse_add_direntry(req, buf + used, size - used,
+					       e->name, &statbuf, ctx.resume);
+
+		if (len > size - used)
+			break;
+		used += len;
+	}
+reply:
+	if (!ret)
+		fuse_reply_buf(req, buf, used);
+	else
+		fuse_reply_err(req, -ret);
+
+	darray_foreach(e, ctx.ents)
+		free(e->name);
+	darray_free(ctx.ents);
+	free(buf);
+}
+
 static void bcachefs_fuse_readdir(fuse_req_t req, fuse_ino_t dir,
 				  size_t size, off_t off,
 				  struct fuse_file_info *fi)
@@ -916,6 +1624,12 @@ static void bcachefs_fuse_readdir(fuse_req_t req, fuse_ino_t dir,
 	fuse_log(FUSE_LOG_DEBUG, "bcachefs_fuse_readdir(dir=%llu, size=%zu, "
 		 "off=%lld)\n", dir, size, off);
 
+	if (bf_readdir_inum) {
+		free(buf);
+		bcachefs_fuse_readdir_sorted(req, dir, size, off);
+		return;
+	}
+
 	dir = map_root_ino(dir);
 
 	ret = bch2_inode_find_by_inum(c, dir, &bi);
@@ -943,14 +1657,208 @@ reply:
 	free(buf);
 }
 
-#if 0
+/*
+ * readdirplus: emit dirents with full attributes, so the kernel doesn't have
+ * to follow up with a lookup + getattr per entry. Dirents for the requested
+ * chunk are collected first, then all their inodes are fetched in a single
+ * btree pass in inum order, then everything is emitted in directory order:
+ */
+
+struct fuse_rdplus_entry {
+	char			*name;
+	u64			ino;	/* 0: don't fetch attrs */
+	off_t			off;
+	struct fuse_entry_param	e;
+};
+
+struct fuse_rdplus_context {
+	struct dir_context	ctx;
+	fuse_req_t		req;
+	size_t			bufsize;
+	size_t			size_est;
+	darray(struct fuse_rdplus_entry) ents;
+};
+
+static int fuse_rdplus_fill(struct dir_context *_ctx,
+			    const char *name, int namelen,
+			    loff_t pos, u64 ino, unsigned type)
+{
+	struct fuse_rdplus_context *ctx =
+		container_of(_ctx, struct fuse_rdplus_context, ctx);
+	struct fuse_rdplus_entry ent = {
+		.name		= strndup(name, namelen),
+		.ino		= ino,
+		.off		= pos + 1,
+		.e.attr		= {
+			.st_ino		= unmap_root_ino(ino),
+			.st_mode	= type << 12,
+		},
+	};
+	size_t entsize = fuse_add_direntry_plus(ctx->req, NULL, 0, ent.name,
+						NULL, 0);
+
+	if (ctx->size_est + entsize > ctx->bufsize) {
+		free(ent.name);
+		return -1;
+	}
+
+	ctx->size_est += entsize;
+	darray_append(ctx->ents, ent);
+	return 0;
+}
+
+static int fuse_rdplus_cmp(const void *_l, const void *_r)
+{
+	const struct fuse_rdplus_entry * const *l = _l, * const *r = _r;
+
+	return cmp_int((*l)->ino, (*r)->ino);
+}
+
+/* Fetch attrs for all collected entries, in one ordered btree pass: */
+static void fuse_rdplus_fetch(struct bch_fs *c,
+			      struct fuse_rdplus_context *ctx)
+{
+	struct fuse_rdplus_entry **sorted, *e;
+	struct btree_trans trans;
+	struct btree_iter *iter;
+	unsigned i, nr = 0;
+
+	sorted = xmalloc(ctx->ents.size * sizeof(*sorted));
+	darray_foreach(e, ctx->ents)
+		if (e->ino)
+			sorted[nr++] = e;
+
+	if (!nr)
+		goto out;
+
+	sort(sorted, nr, sizeof(*sorted), fuse_rdplus_cmp, NULL);
+
+	bch2_trans_init(&trans, c, 0, 0);
+retry:
+	bch2_trans_begin(&trans);
+	iter = bch2_trans_get_iter(&trans, BTREE_ID_INODES, POS_MIN,
+				   BTREE_ITER_SLOTS);
+	if (IS_ERR(iter))
+		goto err;
+
+	for (i = 0; i < nr; i++) {
+		struct bch_inode_unpacked bi;
+		struct bkey_s_c k;
+		int ret;
+
+		e = sorted[i];
+
+		bch2_btree_iter_set_pos(iter, POS(0, e->ino));
+
+		k = bch2_btree_iter_peek_slot(iter);
+		ret = bkey_err(k);
+		if (ret == -EINTR) {
+			bch2_trans_iter_put(&trans, iter);
+			goto retry;
+		}
+
+		if (ret ||
+		    k.k->type != KEY_TYPE_inode ||
+		    bch2_inode_unpack(bkey_s_c_to_inode(k), &bi))
+			continue;	/* emitted without attrs */
+
+		e->e = inode_to_entry(c, &bi);
+	}
+
+	bch2_trans_iter_put(&trans, iter);
+err:
+	bch2_trans_exit(&trans);
+out:
+	free(sorted);
+}
+
 static void bcachefs_fuse_readdirplus(fuse_req_t req, fuse_ino_t dir,
 				      size_t size, off_t off,
 				      struct fuse_file_info *fi)
 {
+	struct bch_fs *c = fuse_req_userdata(req);
+	struct bch_inode_unpacked bi;
+	struct fuse_rdplus_context ctx = {
+		.ctx.actor	= fuse_rdplus_fill,
+		.ctx.pos	= off,
+		.req		= req,
+		.bufsize	= size,
+	};
+	struct fuse_rdplus_entry *e;
+	char *buf = calloc(size, 1);
+	size_t used = 0;
+	int ret = 0;
+
+	fuse_log(FUSE_LOG_DEBUG, "bcachefs_fuse_readdirplus(dir=%llu, "
+		 "size=%zu, off=%lld)\n", dir, size, off);
+
+	dir = map_root_ino(dir);
+
+	ret = bch2_inode_find_by_inum(c, dir, &bi);
+	if (ret)
+		goto reply;
+
+	if (!S_ISDIR(bi.bi_mode)) {
+		ret = -ENOTDIR;
+		goto reply;
+	}
+
+	if (ctx.ctx.pos == 0) {
+		if (fuse_rdplus_fill(&ctx.ctx, ".", 1, ctx.ctx.pos,
+				     dir, DT_DIR) < 0)
+			goto fetch;
+		ctx.ctx.pos = 1;
+	}
+
+	if (ctx.ctx.pos == 1) {
+		/*
+		 * TODO: parent; ino 0 so attrs aren't cached and the lookup
+		 * count is untouched:
+		 */
+		struct fuse_rdplus_entry dotdot = {
+			.name		= strdup(".."),
+			.off		= 2,
+			.e.attr		= {
+				.st_ino		= 1,
+				.st_mode	= S_IFDIR,
+			},
+		};
 
+		ctx.size_est += fuse_add_direntry_plus(req, NULL, 0, "..",
+						       NULL, 0);
+		darray_append(ctx.ents, dotdot);
+		ctx.ctx.pos = 2;
+	}
+
+	ret = bch2_readdir(c, dir, &ctx.ctx);
+	if (ret < 0)
+		goto reply;
+	ret = 0;
+fetch:
+	fuse_rdplus_fetch(c, &ctx);
+
+	darray_foreach(e, ctx.ents) {
+		size_t len = fuse_add_direntry_plus(req, buf + used,
+						    size - used,
+						    e->name, &e->e, e->off);
+
+		if (len > size - used)
+			break;
+		used += len;
+	}
+reply:
+	if (!ret)
+		fuse_reply_buf(req, buf, used);
+	else
+		fuse_reply_err(req, -ret);
+
+	darray_foreach(e, ctx.ents)
+		free(e->name);
+	darray_free(ctx.ents);
+	free(buf);
 }
 
+#if 0
 static void bcachefs_fuse_releasedir(fuse_req_t req, fuse_ino_t inum,
 				     struct fuse_file_info *fi)
 {
@@ -991,25 +1899,158 @@ static void bcachefs_fuse_setxattr(fuse_req_t req, fuse_ino_t inum,
 	struct bch_fs *c = fuse_req_userdata(req);
 }
 
+static void bcachefs_fuse_removexattr(fuse_req_t req, fuse_ino_t inum,
+				      const char *name)
+{
+	struct bch_fs *c = fuse_req_userdata(req);
+}
+#endif
+
+static const char *fuse_xattr_type_prefix(u8 type)
+{
+	const struct xattr_handler **h;
+
+	for (h = bch2_xattr_handlers; *h; h++)
+		if ((u8) (*h)->flags == type)
+			return xattr_prefix(*h);
+	return NULL;
+}
+
+struct fuse_getxattr {
+	u8		type;
+	const char	*name;
+	unsigned	name_len;
+	char		*buf;
+	size_t		size;
+	int		ret;
+};
+
+static int fuse_getxattr_emit(void *arg, u8 type,
+			      const char *name, unsigned name_len,
+			      const void *val, unsigned val_len)
+{
+	struct fuse_getxattr *g = arg;
+
+	if (type != g->type ||
+	    name_len != g->name_len ||
+	    memcmp(name, g->name, name_len))
+		return 0;
+
+	g->ret = val_len;
+	if (g->buf) {
+		if (val_len > g->size)
+			g->ret = -ERANGE;
+		else
+			memcpy(g->buf, val, val_len);
+	}
+	return 1;
+}
+
 static void bcachefs_fuse_getxattr(fuse_req_t req, fuse_ino_t inum,
 				   const char *name, size_t size)
 {
 	struct bch_fs *c = fuse_req_userdata(req);
+	struct fuse_getxattr g = { .ret = -ENODATA };
+	const struct xattr_handler **h;
+	const char *prefix = NULL;
+	int ret;
+
+	fuse_log(FUSE_LOG_DEBUG, "bcachefs_fuse_getxattr(%llu, %s, %zu)\n",
+		 (u64) inum, name, size);
+
+	inum = map_root_ino(inum);
+
+	for (h = bch2_xattr_handlers; *h; h++) {
+		prefix = xattr_prefix(*h);
+		if (!strncmp(name, prefix, strlen(prefix)))
+			break;
+	}
+	if (!*h) {
+		fuse_reply_err(req, EOPNOTSUPP);
+		return;
+	}
 
-	fuse_reply_xattr(req, );
+	g.type		= (*h)->flags;
+	g.name		= name + strlen(prefix);
+	g.name_len	= strlen(g.name);
+
+	if (size) {
+		g.buf	= malloc(size);
+		g.size	= size;
+	}
+
+	ret = bch2_xattr_get_multi(c, inum, fuse_getxattr_emit, &g);
+	if (ret < 0)
+		g.ret = ret;
+
+	if (g.ret < 0)
+		fuse_reply_err(req, -g.ret);
+	else if (!size)
+		fuse_reply_xattr(req, g.ret);
+	else
+		fuse_reply_buf(req, g.buf, g.ret);
+
+	free(g.buf);
 }
 
-static void bcachefs_fuse_listxattr(fuse_req_t req, fuse_ino_t inum, size_t size)
+struct fuse_listxattr {
+	char		*buf;
+	size_t		size, used;
+};
+
+static int fuse_listxattr_emit(void *arg, u8 type,
+			       const char *name, unsigned name_len,
+			       const void *val, unsigned val_len)
 {
-	struct bch_fs *c = fuse_req_userdata(req);
+	struct fuse_listxattr *l = arg;
+	const char *prefix = fuse_xattr_type_prefix(type);
+	size_t prefix_len, len;
+
+	if (!prefix)
+		return 0;
+
+	prefix_len = strlen(prefix);
+	len = prefix_len + name_len + 1;
+
+	if (l->buf) {
+		if (l->used + len > l->size)
+			return -ERANGE;
+
+		memcpy(l->buf + l->used, prefix, prefix_len);
+		memcpy(l->buf + l->used + prefix_len, name, name_len);
+		l->buf[l->used + len - 1] = '\0';
+	}
+	l->used += len;
+	return 0;
 }
 
-static void bcachefs_fuse_removexattr(fuse_req_t req, fuse_ino_t inum,
-				      const char *name)
+static void bcachefs_fuse_listxattr(fuse_req_t req, fuse_ino_t inum, size_t size)
 {
 	struct bch_fs *c = fuse_req_userdata(req);
+	struct fuse_listxattr l = { 0 };
+	int ret;
+
+	fuse_log(FUSE_LOG_DEBUG, "bcachefs_fuse_listxattr(%llu, %zu)\n",
+		 (u64) inum, size);
+
+	inum = map_root_ino(inum);
+
+	if (size) {
+		l.buf	= malloc(size);
+		l.size	= size;
+	}
+
+	ret = bch2_xattr_get_multi(c, inum, fuse_listxattr_emit, &l);
+
+	if (ret < 0)
+		fuse_reply_err(req, -ret);
+	else if (!size)
+		fuse_reply_xattr(req, l.used);
+	else
+		fuse_reply_buf(req, l.buf, l.used);
+
+	free(l.buf);
 }
-#endif
 
 static void bcachefs_fuse_create(fuse_req_t req, fuse_ino_t dir,
 				 const char *name, mode_t mode,
@@ -1026,6 +2067,8 @@ static void bcachefs_fuse_create(fuse_req_t req, fuse_ino_t dir,
 	if (ret)
 		goto err;
 
+	fi->fh = (unsigned long) xcalloc(1, sizeof(struct fuse_file_ra));
+
 	struct fuse_entry_param e = inode_to_entry(c, &new_inode);
 	fuse_reply_create(req, &e, fi);
 	return;
@@ -1035,13 +2078,6 @@ err:
 }
 
 #if 0
-static void bcachefs_fuse_write_buf(fuse_req_t req, fuse_ino_t inum,
-				    struct fuse_bufvec *bufv, off_t off,
-				    struct fuse_file_info *fi)
-{
-	struct bch_fs *c = fuse_req_userdata(req);
-}
-
 static void bcachefs_fuse_fallocate(fuse_req_t req, fuse_ino_t inum, int mode,
 				    off_t offset, off_t length,
 				    struct fuse_file_info *fi)
@@ -1068,17 +2104,17 @@ static const struct fuse_lowlevel_ops bcachefs_fuse_ops = {
 	.read		= bcachefs_fuse_read,
 	.write		= bcachefs_fuse_write,
 	//.flush	= bcachefs_fuse_flush,
-	//.release	= bcachefs_fuse_release,
+	.release	= bcachefs_fuse_release,
 	//.fsync	= bcachefs_fuse_fsync,
 	//.opendir	= bcachefs_fuse_opendir,
 	.readdir	= bcachefs_fuse_readdir,
-	//.readdirplus	= bcachefs_fuse_readdirplus,
+	.readdirplus	= bcachefs_fuse_readdirplus,
 	//.releasedir	= bcachefs_fuse_releasedir,
 	//.fsyncdir	= bcachefs_fuse_fsyncdir,
 	.statfs		= bcachefs_fuse_statfs,
 	//.setxattr	= bcachefs_fuse_setxattr,
-	//.getxattr	= bcachefs_fuse_getxattr,
-	//.listxattr	= bcachefs_fuse_listxattr,
+	.getxattr	= bcachefs_fuse_getxattr,
+	.listxattr	= bcachefs_fuse_listxattr,
 	//.removexattr	= bcachefs_fuse_removexattr,
 	.create		= bcachefs_fuse_create,
 
@@ -1087,7 +2123,7 @@ static const struct fuse_lowlevel_ops bcachefs_fuse_ops = {
 	.getlk		= bcachefs_fuse_getlk,
 	.setlk		= bcachefs_fuse_setlk,
 #endif
-	//.write_buf	= bcachefs_fuse_write_buf,
+	.write_buf	= bcachefs_fuse_write_buf,
 	//.fallocate	= bcachefs_fuse_fallocate,
 
 };
@@ -1100,6 +2136,9 @@ struct bf_context {
 	char            *devices_str;
 	char            **devices;
 	int             nr_devices;
+	double          entry_timeout;
+	double          attr_timeout;
+	int             readdir_inum;
 };
 
 static void bf_context_free(struct bf_context *ctx)
@@ -1113,6 +2152,9 @@ static void bf_context_free(struct bf_context *ctx)
 }
 
 static struct fuse_opt bf_opts[] = {
+	{ "entry_timeout=%lf",	offsetof(struct bf_context, entry_timeout), 0 },
+	{ "attr_timeout=%lf",	offsetof(struct bf_context, attr_timeout), 0 },
+	{ "readdir_inum",	offsetof(struct bf_context, readdir_inum), 1 },
 	FUSE_OPT_END
 };
 
@@ -1181,7 +2223,10 @@ int cmd_fusemount(int argc, char *argv[])
 {
 	struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
 	struct bch_opts bch_opts = bch2_opts_empty();
-	struct bf_context ctx = { 0 };
+	struct bf_context ctx = {
+		.entry_timeout	= DBL_MAX,
+		.attr_timeout	= DBL_MAX,
+	};
 	struct bch_fs *c = NULL;
 	int ret = 0, i;
 
@@ -1189,6 +2234,10 @@ int cmd_fusemount(int argc, char *argv[])
 	if (fuse_opt_parse(&args, &ctx, bf_opts, bf_opt_proc) < 0)
 		die("fuse_opt_parse err: %m");
 
+	bf_entry_timeout	= ctx.entry_timeout;
+	bf_attr_timeout		= ctx.attr_timeout;
+	bf_readdir_inum		= ctx.readdir_inum;
+
 	struct fuse_cmdline_opts fuse_opts;
 	if (fuse_parse_cmdline(&args, &fuse_opts) < 0)
 		die("fuse_parse_cmdline err: %m");
@@ -1249,7 +2298,16 @@ int cmd_fusemount(int argc, char *argv[])
 
 	fuse_daemonize(fuse_opts.foreground);
 
-	ret = fuse_session_loop(se);
+	if (fuse_opts.singlethread) {
+		ret = fuse_session_loop(se);
+	} else {
+		struct fuse_loop_config loop_config = {
+			.clone_fd		= fuse_opts.clone_fd,
+			.max_idle_threads	= fuse_opts.max_idle_threads,
+		};
+
+		ret = fuse_session_loop_mt(se, &loop_config);
+	}
 
 	/* Cleanup */
 	fuse_session_unmount(se);
@@ -10,10 +10,17 @@
 static void unlock_usage(void)
 {
 	puts("bcachefs unlock - unlock an encrypted filesystem so it can be mounted\n"
-	     "Usage: bcachefs unlock [OPTION] device\n"
+	     "Usage: bcachefs unlock [OPTION] devices\n"
+	     "\n"
+	     "Devices whose key is already in the keyring are skipped; the\n"
+	     "passphrase is only prompted for (and the KDF only run) if at least\n"
+	     "one device actually needs unlocking.\n"
 	     "\n"
 	     "Options:\n"
 	     "  -c                     Check if a device is encrypted\n"
+	     "  -f file                Read passphrase from file instead of prompting;\n"
+	     "                         use /dev/fd/N for a descriptor inherited from a\n"
+	     "                         provisioning agent\n"
 	     "  -h                     Display this help and exit\n"
 	     "Report bugs to <linux-bcache@vger.kernel.org>");
 }
@@ -21,49 +28,96 @@ static void unlock_usage(void)
 int cmd_unlock(int argc, char *argv[])
 {
 	bool check = false;
+	char *passphrase_file = NULL;
+	char *passphrase = NULL;
+	/*
+	 * The scrypt KDF is deliberately expensive, and filesystems formatted
+	 * with the same cost parameters derive identical keys from a given
+	 * passphrase - so when unlocking many filesystems in one go, run it
+	 * once per distinct set of kdf parameters, not once per filesystem:
+	 */
+	struct {
+		u64		kdf_flags;
+		struct bch_key	key;
+	} derived[4];
+	unsigned nr_derived = 0;
+	char *dev;
 	int opt;
 
-	while ((opt = getopt(argc, argv, "ch")) != -1)
+	while ((opt = getopt(argc, argv, "cf:h")) != -1)
 		switch (opt) {
 		case 'c':
 			check = true;
 			break;
+		case 'f':
+			passphrase_file = optarg;
+			break;
 		case 'h':
 			unlock_usage();
 			exit(EXIT_SUCCESS);
 		}
 	args_shift(optind);
 
-	char *dev = arg_pop();
-	if (!dev)
-		die("Please supply a device");
+	if (!argc)
+		die("Please supply one or more devices");
 
-	if (argc)
-		die("Too many arguments");
+	while ((dev = arg_pop())) {
+		struct bch_opts opts = bch2_opts_empty();
 
-	struct bch_opts opts = bch2_opts_empty();
+		opt_set(opts, noexcl, true);
+		opt_set(opts, nochanges, true);
 
-	opt_set(opts, noexcl, true);
-	opt_set(opts, nochanges, true);
+		struct bch_sb_handle sb;
+		int ret = bch2_read_super(dev, &opts, &sb);
+		if (ret)
+			die("Error opening %s: %s", dev, strerror(-ret));
 
-	struct bch_sb_handle sb;
-	int ret = bch2_read_super(dev, &opts, &sb);
-	if (ret)
-		die("Error opening %s: %s", dev, strerror(-ret));
+		if (!bch2_sb_is_encrypted(sb.sb))
+			die("%s is not encrypted", dev);
 
-	if (!bch2_sb_is_encrypted(sb.sb))
-		die("%s is not encrypted", dev);
+		if (check || bch2_sb_key_cached(sb.sb)) {
+			bch2_free_super(&sb);
+			continue;
+		}
 
-	if (check)
-		exit(EXIT_SUCCESS);
+		if (!passphrase)
+			passphrase = passphrase_file
+				? read_passphrase_file(passphrase_file)
+				: read_passphrase("Enter passphrase: ");
+
+		struct bch_sb_field_crypt *crypt = bch2_sb_get_crypt(sb.sb);
+		struct bch_key key;
+		unsigned i;
+
+		for (i = 0; i < nr_derived; i++)
+			if (derived[i].kdf_flags == le64_to_cpu(crypt->kdf_flags))
+				break;
+
+		if (i < nr_derived) {
+			key = derived[i].key;
+		} else {
+			key = derive_passphrase(crypt, passphrase);
+
+			if (nr_derived < ARRAY_SIZE(derived)) {
+				derived[nr_derived].kdf_flags =
+					le64_to_cpu(crypt->kdf_flags);
+				derived[nr_derived].key = key;
+				nr_derived++;
+			}
+		}
 
-	char *passphrase = read_passphrase("Enter passphrase: ");
+		if (!bch2_add_passphrase_key(sb.sb, &key))
+			die("incorrect passphrase for %s", dev);
 
-	bch2_add_key(sb.sb, passphrase);
+		memzero_explicit(&key, sizeof(key));
+		bch2_free_super(&sb);
+	}
 
-	bch2_free_super(&sb);
-	memzero_explicit(passphrase, strlen(passphrase));
-	free(passphrase);
+	memzero_explicit(derived, sizeof(derived));
+	if (passphrase) {
+		memzero_explicit(passphrase, strlen(passphrase));
+		free(passphrase);
+	}
 	return 0;
 }
 
@@ -1,7 +1,9 @@
 #include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <ftw.h>
 #include <getopt.h>
+#include <pthread.h>
 #include <string.h>
 #include <sys/xattr.h>
 #include <sys/ioctl.h>
@@ -24,8 +26,11 @@
 #include <linux/dcache.h>
 #include <linux/generic-radix-tree.h>
 #include <linux/xattr.h>
+#include <zdict.h>
+
 #include "libbcachefs/bcachefs.h"
 #include "libbcachefs/alloc_background.h"
+#include "libbcachefs/compress.h"
 #include "libbcachefs/alloc_foreground.h"
 #include "libbcachefs/btree_update.h"
 #include "libbcachefs/buckets.h"
@@ -103,16 +108,15 @@ static void mark_unreserved_space(struct bch_fs *c, ranges extents)
 	struct range i;
 
 	for_each_hole(iter, extents, bucket_to_sector(ca, ca->mi.nbuckets) << 9, i) {
-		u64 b;
+		u64 b, end;
 
 		if (i.start == i.end)
 			return;
 
-		b = sector_to_bucket(ca, i.start >> 9);
-		do {
-			set_bit(b, ca->buckets_nouse);
-			b++;
-		} while (bucket_to_sector(ca, b) << 9 < i.end);
+		b	= sector_to_bucket(ca, i.start >> 9);
+		end	= DIV_ROUND_UP(i.end, bucket_bytes(ca));
+
+		bitmap_set(ca->buckets_nouse, b, end - b);
 	}
 }
 
@@ -124,7 +128,7 @@ static void update_inode(struct bch_fs *c,
 
 	bch2_inode_pack(&packed, inode);
 	ret = bch2_btree_insert(c, BTREE_ID_INODES, &packed.inode.k_i,
-				NULL, NULL, 0);
+				NULL, NULL, BTREE_INSERT_NOJOURNAL);
 	if (ret)
 		die("error updating inode: %s", strerror(-ret));
 }
@@ -157,7 +161,8 @@ static struct bch_inode_unpacked create_file(struct bch_fs *c,
 		bch2_create_trans(&trans,
 				  parent->bi_inum, parent,
 				  &new_inode, &qstr,
-				  uid, gid, mode, rdev, NULL, NULL));
+				  uid, gid, mode, rdev,
+				  NULL, NULL, NULL, NULL));
 	if (ret)
 		die("error creating file: %s", strerror(-ret));
 
@@ -232,59 +237,112 @@ static void copy_xattrs(struct bch_fs *c, struct bch_inode_unpacked *dst,
 	}
 }
 
-static char buf[1 << 20] __aligned(PAGE_SIZE);
+/*
+ * Ring of in flight data writes, so the copy isn't a strict
+ * read/write/wait cycle - each walker thread keeps DATA_COPY_NR writes
+ * in the device's queue:
+ */
+#define DATA_COPY_NR		8
+
+struct data_copy_op {
+	bool			inflight;
+	struct closure		cl;
+	struct bch_write_op	op;
+	struct bio_vec		bv[(1 << 20) / PAGE_SIZE];
+	char			buf[1 << 20] __aligned(PAGE_SIZE);
+};
+
+struct data_copy {
+	unsigned		idx;
+	struct data_copy_op	ops[DATA_COPY_NR];
+};
+
+static __thread struct data_copy *data_copy;
+
+static struct data_copy_op *data_copy_next(void)
+{
+	struct data_copy_op *o;
+
+	if (!data_copy)
+		data_copy = xcalloc(1, sizeof(*data_copy));
+
+	o = &data_copy->ops[data_copy->idx++ % DATA_COPY_NR];
+
+	if (o->inflight) {
+		closure_sync(&o->cl);
+		o->inflight = false;
+	}
+
+	return o;
+}
 
-static void write_data(struct bch_fs *c,
-		       struct bch_inode_unpacked *dst_inode,
-		       u64 dst_offset, void *buf, size_t len)
+static void data_copy_flush(void)
 {
-	struct {
-		struct bch_write_op op;
-		struct bio_vec bv[sizeof(buf) / PAGE_SIZE];
-	} o;
-	struct closure cl;
+	unsigned i;
+
+	if (!data_copy)
+		return;
+
+	for (i = 0; i < DATA_COPY_NR; i++) {
+		struct data_copy_op *o = &data_copy->ops[i];
 
+		if (o->inflight) {
+			closure_sync(&o->cl);
+			o->inflight = false;
+		}
+	}
+}
+
+static void data_copy_submit(struct bch_fs *c, struct data_copy_op *o,
+			     struct bch_inode_unpacked *dst_inode,
+			     u64 dst_offset, size_t len)
+{
 	BUG_ON(dst_offset	& (block_bytes(c) - 1));
 	BUG_ON(len		& (block_bytes(c) - 1));
+	BUG_ON(len > sizeof(o->buf));
 
-	closure_init_stack(&cl);
+	closure_init_stack(&o->cl);
 
-	bio_init(&o.op.wbio.bio, o.bv, ARRAY_SIZE(o.bv));
-	bch2_bio_map(&o.op.wbio.bio, buf, len);
+	bio_init(&o->op.wbio.bio, o->bv, ARRAY_SIZE(o->bv));
+	bch2_bio_map(&o->op.wbio.bio, o->buf, len);
 
-	bch2_write_op_init(&o.op, c, bch2_opts_to_inode_opts(c->opts));
-	o.op.write_point	= writepoint_hashed(0);
-	o.op.nr_replicas	= 1;
-	o.op.pos		= POS(dst_inode->bi_inum, dst_offset >> 9);
+	bch2_write_op_init(&o->op, c, bch2_opts_to_inode_opts(c->opts));
+	o->op.write_point	= writepoint_hashed((unsigned long) data_copy);
+	o->op.nr_replicas	= 1;
+	o->op.pos		= POS(dst_inode->bi_inum, dst_offset >> 9);
 
-	int ret = bch2_disk_reservation_get(c, &o.op.res, len >> 9,
+	int ret = bch2_disk_reservation_get(c, &o->op.res, len >> 9,
 					    c->opts.data_replicas, 0);
 	if (ret)
 		die("error reserving space in new filesystem: %s", strerror(-ret));
 
-	closure_call(&o.op.cl, bch2_write, NULL, &cl);
-	closure_sync(&cl);
+	o->inflight = true;
+	closure_call(&o->op.cl, bch2_write, NULL, &o->cl);
 
 	dst_inode->bi_sectors += len >> 9;
 }
 
 static void copy_data(struct bch_fs *c,
 		      struct bch_inode_unpacked *dst_inode,
-		      int src_fd, u64 start, u64 end)
+		      struct seq_reader *src, u64 start, u64 end)
 {
 	while (start < end) {
-		unsigned len = min_t(u64, end - start, sizeof(buf));
+		struct data_copy_op *o = data_copy_next();
+		unsigned len = min_t(u64, end - start,
+				     sizeof(o->buf));
 		unsigned pad = round_up(len, block_bytes(c)) - len;
 
-		xpread(src_fd, buf, len, start);
-		memset(buf + len, 0, pad);
+		seq_read(src, o->buf, len, start);
+		memset(o->buf + len, 0, pad);
 
-		write_data(c, dst_inode, start, buf, len + pad);
+		data_copy_submit(c, o, dst_inode, start, len + pad);
 		start += len;
 	}
 }
 
-static void link_data(struct bch_fs *c, struct bch_inode_unpacked *dst,
+static void link_data(struct bch_fs *c, struct btree_insert_buf *keys,
+		      struct disk_reservation *res,
+		      struct bch_inode_unpacked *dst,
 		      u64 logical, u64 physical, u64 length)
 {
 	struct bch_dev *ca = c->devs[0];
@@ -303,7 +361,6 @@ static void link_data(struct bch_fs *c, struct bch_inode_unpacked *dst,
 		struct bkey_i_extent *e;
 		BKEY_PADDED(k) k;
 		u64 b = sector_to_bucket(ca, physical);
-		struct disk_reservation res;
 		unsigned sectors;
 		int ret;
 
@@ -321,7 +378,7 @@ static void link_data(struct bch_fs *c, struct bch_inode_unpacked *dst,
 					.gen = bucket(ca, b)->mark.gen,
 				  });
 
-		ret = bch2_disk_reservation_get(c, &res, sectors, 1,
+		ret = bch2_disk_reservation_add(c, res, sectors,
 						BCH_DISK_RESERVATION_NOFAIL);
 		if (ret)
 			die("error reserving space in new filesystem: %s",
@@ -329,13 +386,11 @@ static void link_data(struct bch_fs *c, struct bch_inode_unpacked *dst,
 
 		bch2_mark_bkey_replicas(c, extent_i_to_s_c(e).s_c);
 
-		ret = bch2_btree_insert(c, BTREE_ID_EXTENTS, &e->k_i,
-					&res, NULL, 0);
+		ret = bch2_btree_insert_buf_add(keys, BTREE_ID_EXTENTS,
+						&e->k_i);
 		if (ret)
 			die("btree insert error %s", strerror(-ret));
 
-		bch2_disk_reservation_put(c, &res);
-
 		dst->bi_sectors	+= sectors;
 		logical		+= sectors;
 		physical	+= sectors;
@@ -344,40 +399,59 @@ static void link_data(struct bch_fs *c, struct bch_inode_unpacked *dst,
 }
 
 static void copy_link(struct bch_fs *c, struct bch_inode_unpacked *dst,
-		      char *src)
+		      int src_fd, const char *name)
 {
-	ssize_t ret = readlink(src, buf, sizeof(buf));
+	struct data_copy_op *o = data_copy_next();
+	size_t len;
+
+	ssize_t ret = readlinkat(src_fd, name, o->buf, sizeof(o->buf));
 	if (ret < 0)
 		die("readlink error: %m");
 
-	write_data(c, dst, 0, buf, round_up(ret, block_bytes(c)));
+	len = round_up(ret, block_bytes(c));
+	memset(o->buf + ret, 0, len - ret);
+
+	data_copy_submit(c, o, dst, 0, len);
 }
 
-static void copy_file(struct bch_fs *c, struct bch_inode_unpacked *dst,
+static void copy_file(struct bch_fs *c, struct btree_insert_buf *keys,
+		      struct disk_reservation *res,
+		      struct bch_inode_unpacked *dst,
 		      int src_fd, u64 src_size,
 		      char *src_path, ranges *extents)
 {
-	struct fiemap_iter iter;
-	struct fiemap_extent e;
+	fiemap_extents fe;
+	struct fiemap_extent *e;
+	struct seq_reader src;
+	bool have_src = false;
 
-	fiemap_for_each(src_fd, iter, e)
-		if (e.fe_flags & FIEMAP_EXTENT_UNKNOWN) {
+	darray_init_inline(fe);
+	fiemap_get_extents(src_fd, &fe);
+
+	darray_foreach(e, fe)
+		if (e->fe_flags & FIEMAP_EXTENT_UNKNOWN) {
 			fsync(src_fd);
+			fe.size = 0;
+			fiemap_get_extents(src_fd, &fe);
 			break;
 		}
 
-	fiemap_for_each(src_fd, iter, e) {
-		if ((e.fe_logical	& (block_bytes(c) - 1)) ||
-		    (e.fe_length	& (block_bytes(c) - 1)))
+	darray_foreach(e, fe) {
+		if ((e->fe_logical	& (block_bytes(c) - 1)) ||
+		    (e->fe_length	& (block_bytes(c) - 1)))
 			die("Unaligned extent in %s - can't handle", src_path);
 
-		if (e.fe_flags & (FIEMAP_EXTENT_UNKNOWN|
-				  FIEMAP_EXTENT_ENCODED|
-				  FIEMAP_EXTENT_NOT_ALIGNED|
-				  FIEMAP_EXTENT_DATA_INLINE)) {
-			copy_data(c, dst, src_fd, e.fe_logical,
-				  min(src_size - e.fe_logical,
-				      e.fe_length));
+		if (e->fe_flags & (FIEMAP_EXTENT_UNKNOWN|
+				   FIEMAP_EXTENT_ENCODED|
+				   FIEMAP_EXTENT_NOT_ALIGNED|
+				   FIEMAP_EXTENT_DATA_INLINE)) {
+			if (!have_src) {
+				seq_reader_init(&src, src_fd, 1 << 20);
+				have_src = true;
+			}
+			copy_data(c, dst, &src, e->fe_logical,
+				  min(src_size - e->fe_logical,
+				      e->fe_length));
 			continue;
 		}
 
@@ -385,44 +459,191 @@ static void copy_file(struct bch_fs *c, struct bch_inode_unpacked *dst,
 		 * if the data is below 1 MB, copy it so it doesn't conflict
 		 * with bcachefs's potentially larger superblock:
 		 */
-		if (e.fe_physical < 1 << 20) {
-			copy_data(c, dst, src_fd, e.fe_logical,
-				  min(src_size - e.fe_logical,
-				      e.fe_length));
+		if (e->fe_physical < 1 << 20) {
+			if (!have_src) {
+				seq_reader_init(&src, src_fd, 1 << 20);
+				have_src = true;
+			}
+			copy_data(c, dst, &src, e->fe_logical,
+				  min(src_size - e->fe_logical,
+				      e->fe_length));
 			continue;
 		}
 
-		if ((e.fe_physical	& (block_bytes(c) - 1)))
+		if ((e->fe_physical	& (block_bytes(c) - 1)))
 			die("Unaligned extent in %s - can't handle", src_path);
 
-		range_add(extents, e.fe_physical, e.fe_length);
-		link_data(c, dst, e.fe_logical, e.fe_physical, e.fe_length);
+		range_add(extents, e->fe_physical, e->fe_length);
+		link_data(c, keys, res, dst, e->fe_logical,
+			  e->fe_physical, e->fe_length);
 	}
+
+	if (have_src)
+		seq_reader_exit(&src);
+
+	darray_free(fe);
 }
 
+struct copy_dir_work {
+	struct bch_inode_unpacked inode;
+	char			*path;
+};
+
 struct copy_fs_state {
 	u64			bcachefs_inum;
 	dev_t			dev;
 
+	pthread_mutex_t		hardlinks_lock;
 	GENRADIX(u64)		hardlinks;
+
+	/* queue of directories waiting to be walked: */
+	pthread_mutex_t		lock;
+	pthread_cond_t		wait;
+	darray(struct copy_dir_work) dirs;
+	unsigned		nr_dirs_pending;
+
+	ranges			extents;
+};
+
+struct copy_thread {
+	pthread_t		thread;
+	struct copy_fs_state	*s;
+	struct bch_fs		*c;
+
+	struct btree_insert_buf	keys;
+	struct disk_reservation	res;
 	ranges			extents;
 };
 
-static void copy_dir(struct copy_fs_state *s,
-		     struct bch_fs *c,
+static void copy_dir_enqueue(struct copy_fs_state *s,
+			     struct bch_inode_unpacked *inode,
+			     char *path)
+{
+	struct copy_dir_work w = {
+		.inode	= *inode,
+		.path	= path,
+	};
+
+	pthread_mutex_lock(&s->lock);
+	darray_append(s->dirs, w);
+	s->nr_dirs_pending++;
+	pthread_cond_signal(&s->wait);
+	pthread_mutex_unlock(&s->lock);
+}
+
+/* Entries collected during the readdir pass, created in batches: */
+struct pending_create {
+	char			*name;
+	char			*path;
+	struct stat		stat;
+	struct bch_inode_unpacked inode;
+};
+
+typedef darray(struct pending_create) pending_creates;
+
+#define CREATE_BATCH_NR		32
+
+/*
+ * Create the collected entries in one transaction - the directory inode is
+ * updated once for the whole batch - then copy their contents:
+ */
+static void copy_dir_flush_creates(struct copy_thread *t,
+				   struct bch_inode_unpacked *dst,
+				   int src_fd,
+				   pending_creates *creates)
+{
+	struct copy_fs_state *s = t->s;
+	struct bch_fs *c = t->c;
+	struct bch_create_batch_entry batch[CREATE_BATCH_NR];
+	struct qstr names[CREATE_BATCH_NR];
+	unsigned i, nr = darray_size(*creates);
+	struct pending_create *p;
+	int ret;
+
+	if (!nr)
+		return;
+
+	for (i = 0; i < nr; i++) {
+		p = &creates->item[i];
+
+		names[i] = (struct qstr) QSTR(p->name);
+		batch[i] = (struct bch_create_batch_entry) {
+			.new_inode	= &p->inode,
+			.name		= &names[i],
+			.uid		= p->stat.st_uid,
+			.gid		= p->stat.st_gid,
+			.mode		= p->stat.st_mode,
+			.rdev		= p->stat.st_rdev,
+		};
+	}
+
+	ret = bch2_trans_do(c, NULL, NULL, 0,
+		bch2_create_batch_trans(&trans, dst->bi_inum, dst, batch, nr));
+	if (ret)
+		die("error creating file: %s", strerror(-ret));
+
+	darray_foreach(p, *creates) {
+		struct bch_inode_unpacked *inode = &p->inode;
+		int fd;
+
+		copy_times(c, inode, &p->stat);
+		copy_xattrs(c, inode, p->path);
+
+		switch (mode_to_type(p->stat.st_mode)) {
+		case DT_DIR:
+			/* the worker that dequeues it writes the inode: */
+			copy_dir_enqueue(s, inode, p->path);
+			p->path = NULL;
+			goto next;
+		case DT_REG:
+			inode->bi_size = p->stat.st_size;
+
+			fd = xopenat(src_fd, p->name, O_RDONLY|O_NOATIME);
+			copy_file(c, &t->keys, &t->res, inode, fd,
+				  p->stat.st_size, p->path, &t->extents);
+			close(fd);
+			break;
+		case DT_LNK:
+			inode->bi_size = p->stat.st_size;
+
+			copy_link(c, inode, src_fd, p->name);
+			break;
+		case DT_FIFO:
+		case DT_CHR:
+		case DT_BLK:
+		case DT_SOCK:
+		case DT_WHT:
+			/* nothing else to copy for these: */
+			break;
+		default:
+			BUG();
+		}
+
+		update_inode(c, inode);
+next:
+		free(p->name);
+		free(p->path);
+	}
+
+	creates->size = 0;
+}
+
+static void copy_dir(struct copy_thread *t,
 		     struct bch_inode_unpacked *dst,
 		     int src_fd, const char *src_path)
 {
+	struct copy_fs_state *s = t->s;
+	struct bch_fs *c = t->c;
 	DIR *dir = fdopendir(src_fd);
 	struct dirent *d;
+	pending_creates creates;
+
+	darray_init(creates);
 
 	while ((errno = 0), (d = readdir(dir))) {
 		struct bch_inode_unpacked inode;
 		int fd;
 
-		if (fchdir(src_fd))
-			die("chdir error: %m");
-
 		struct stat stat =
 			xfstatat(src_fd, d->d_name, AT_SYMLINK_NOFOLLOW);
 
@@ -436,64 +657,107 @@ static void copy_dir(struct copy_fs_state *s,
 		if (stat.st_dev != s->dev)
 			die("%s does not have correct st_dev!", child_path);
 
-		u64 *dst_inum = S_ISREG(stat.st_mode)
-			? genradix_ptr_alloc(&s->hardlinks, stat.st_ino, GFP_KERNEL)
-			: NULL;
-
-		if (dst_inum && *dst_inum) {
-			create_link(c, dst, d->d_name, *dst_inum, S_IFREG);
-			goto next;
-		}
+		/*
+		 * A file can only show up under multiple names if it's
+		 * hardlinked; holding the lock from lookup to publish keeps
+		 * two walkers from both creating it - so hardlinks can't sit
+		 * in a batch, and take the immediate path:
+		 */
+		bool hardlink = S_ISREG(stat.st_mode) && stat.st_nlink > 1;
+
+		if (hardlink) {
+			u64 *dst_inum;
+
+			pthread_mutex_lock(&s->hardlinks_lock);
+			dst_inum = genradix_ptr_alloc(&s->hardlinks,
+						      stat.st_ino, GFP_KERNEL);
+			if (*dst_inum) {
+				create_link(c, dst, d->d_name, *dst_inum, S_IFREG);
+				pthread_mutex_unlock(&s->hardlinks_lock);
+				free(child_path);
+				continue;
+			}
 
-		inode = create_file(c, dst, d->d_name,
-				    stat.st_uid, stat.st_gid,
-				    stat.st_mode, stat.st_rdev);
+			inode = create_file(c, dst, d->d_name,
+					    stat.st_uid, stat.st_gid,
+					    stat.st_mode, stat.st_rdev);
 
-		if (dst_inum)
 			*dst_inum = inode.bi_inum;
+			pthread_mutex_unlock(&s->hardlinks_lock);
 
-		copy_times(c, &inode, &stat);
-		copy_xattrs(c, &inode, d->d_name);
-
-		/* copy xattrs */
+			copy_times(c, &inode, &stat);
+			copy_xattrs(c, &inode, child_path);
 
-		switch (mode_to_type(stat.st_mode)) {
-		case DT_DIR:
-			fd = xopen(d->d_name, O_RDONLY|O_NOATIME);
-			copy_dir(s, c, &inode, fd, child_path);
-			close(fd);
-			break;
-		case DT_REG:
 			inode.bi_size = stat.st_size;
 
-			fd = xopen(d->d_name, O_RDONLY|O_NOATIME);
-			copy_file(c, &inode, fd, stat.st_size,
-				  child_path, &s->extents);
+			fd = xopenat(src_fd, d->d_name, O_RDONLY|O_NOATIME);
+			copy_file(c, &t->keys, &t->res, &inode, fd,
+				  stat.st_size, child_path, &t->extents);
 			close(fd);
-			break;
-		case DT_LNK:
-			inode.bi_size = stat.st_size;
 
-			copy_link(c, &inode, d->d_name);
-			break;
-		case DT_FIFO:
-		case DT_CHR:
-		case DT_BLK:
-		case DT_SOCK:
-		case DT_WHT:
-			/* nothing else to copy for these: */
-			break;
-		default:
-			BUG();
+			update_inode(c, &inode);
+			free(child_path);
+			continue;
 		}
 
-		update_inode(c, &inode);
-next:
-		free(child_path);
+		struct pending_create p = {
+			.name	= strdup(d->d_name),
+			.path	= child_path,
+			.stat	= stat,
+		};
+
+		darray_append(creates, p);
+
+		if (darray_size(creates) == CREATE_BATCH_NR)
+			copy_dir_flush_creates(t, dst, src_fd, &creates);
 	}
 
 	if (errno)
 		die("readdir error: %m");
+
+	copy_dir_flush_creates(t, dst, src_fd, &creates);
+	darray_free(creates);
+
+	closedir(dir);
+}
+
+static void *copy_dir_thread(void *_t)
+{
+	struct copy_thread *t = _t;
+	struct copy_fs_state *s = t->s;
+
+	pthread_mutex_lock(&s->lock);
+	while (s->nr_dirs_pending) {
+		struct copy_dir_work w;
+		int fd;
+
+		if (!s->dirs.size) {
+			pthread_cond_wait(&s->wait, &s->lock);
+			continue;
+		}
+
+		w = s->dirs.item[--s->dirs.size];
+		pthread_mutex_unlock(&s->lock);
+
+		fd = xopen(w.path, O_RDONLY|O_NOATIME);
+		copy_dir(t, &w.inode, fd, w.path);
+
+		/*
+		 * After the children have been created, so the source
+		 * times/ownership win - same ordering as when this was a
+		 * recursive walk:
+		 */
+		update_inode(t->c, &w.inode);
+		free(w.path);
+
+		pthread_mutex_lock(&s->lock);
+		if (!--s->nr_dirs_pending)
+			pthread_cond_broadcast(&s->wait);
+	}
+	pthread_mutex_unlock(&s->lock);
+
+	data_copy_flush();
+	return NULL;
 }
 
 static ranges reserve_new_fs_space(const char *file_path, unsigned block_size,
@@ -519,23 +783,27 @@ static ranges reserve_new_fs_space(const char *file_path, unsigned block_size,
 
 	fsync(fd);
 
-	struct fiemap_iter iter;
-	struct fiemap_extent e;
+	fiemap_extents fe;
+	struct fiemap_extent *e;
 	ranges extents = { NULL };
 
-	fiemap_for_each(fd, iter, e) {
-		if (e.fe_flags & (FIEMAP_EXTENT_UNKNOWN|
-				  FIEMAP_EXTENT_ENCODED|
-				  FIEMAP_EXTENT_NOT_ALIGNED|
-				  FIEMAP_EXTENT_DATA_INLINE))
+	darray_init_inline(fe);
+	fiemap_get_extents(fd, &fe);
+
+	darray_foreach(e, fe) {
+		if (e->fe_flags & (FIEMAP_EXTENT_UNKNOWN|
+				   FIEMAP_EXTENT_ENCODED|
+				   FIEMAP_EXTENT_NOT_ALIGNED|
+				   FIEMAP_EXTENT_DATA_INLINE))
 			die("Unable to continue: metadata file not fully mapped");
 
-		if ((e.fe_physical	& (block_size - 1)) ||
-		    (e.fe_length	& (block_size - 1)))
+		if ((e->fe_physical	& (block_size - 1)) ||
+		    (e->fe_length	& (block_size - 1)))
 			die("Unable to continue: unaligned extents in metadata file");
 
-		range_add(&extents, e.fe_physical, e.fe_length);
+		range_add(&extents, e->fe_physical, e->fe_length);
 	}
+	darray_free(fe);
 	close(fd);
 
 	ranges_sort_merge(&extents);
@@ -543,6 +811,8 @@ static ranges reserve_new_fs_space(const char *file_path, unsigned block_size,
 }
 
 static void reserve_old_fs_space(struct bch_fs *c,
+				 struct btree_insert_buf *keys,
+				 struct disk_reservation *res,
 				 struct bch_inode_unpacked *root_inode,
 				 ranges *extents)
 {
@@ -558,7 +828,7 @@ static void reserve_old_fs_space(struct bch_fs *c,
 	ranges_sort_merge(extents);
 
 	for_each_hole(iter, *extents, bucket_to_sector(ca, ca->mi.nbuckets) << 9, i)
-		link_data(c, &dst, i.start, i.start, i.end - i.start);
+		link_data(c, keys, res, &dst, i.start, i.start, i.end - i.start);
 
 	update_inode(c, &dst);
 }
@@ -573,23 +843,71 @@ static void copy_fs(struct bch_fs *c, int src_fd, const char *src_path,
 	if (ret)
 		die("error looking up root directory: %s", strerror(-ret));
 
-	if (fchdir(src_fd))
-		die("chdir error: %m");
-
 	struct stat stat = xfstat(src_fd);
 	copy_times(c, &root_inode, &stat);
-	copy_xattrs(c, &root_inode, ".");
+	copy_xattrs(c, &root_inode, (char *) src_path);
 
 	struct copy_fs_state s = {
 		.bcachefs_inum	= bcachefs_inum,
 		.dev		= stat.st_dev,
+		.hardlinks_lock	= PTHREAD_MUTEX_INITIALIZER,
+		.lock		= PTHREAD_MUTEX_INITIALIZER,
+		.wait		= PTHREAD_COND_INITIALIZER,
 		.extents	= *extents,
 	};
+	unsigned i, nr_threads = min_t(unsigned, 16,
+				       sysconf(_SC_NPROCESSORS_ONLN));
+	struct copy_thread *threads = xcalloc(nr_threads, sizeof(*threads));
+
+	copy_dir_enqueue(&s, &root_inode, strdup(src_path));
 
 	/* now, copy: */
-	copy_dir(&s, c, &root_inode, src_fd, src_path);
+	for (i = 0; i < nr_threads; i++) {
+		struct copy_thread *t = &threads[i];
+
+		t->s	= &s;
+		t->c	= c;
+		t->res	= bch2_disk_reservation_init(c, 1);
+		bch2_btree_insert_buf_init(&t->keys, c, &t->res, NULL,
+					   BTREE_INSERT_NOJOURNAL);
+		darray_init(t->extents);
+
+		if (pthread_create(&t->thread, NULL, copy_dir_thread, t))
+			die("pthread_create error: %m");
+	}
+
+	for (i = 0; i < nr_threads; i++) {
+		struct copy_thread *t = &threads[i];
+
+		pthread_join(t->thread, NULL);
+
+		ret = bch2_btree_insert_buf_flush(&t->keys);
+		if (ret)
+			die("btree insert error %s", strerror(-ret));
+
+		bch2_disk_reservation_put(c, &t->res);
 
-	reserve_old_fs_space(c, &root_inode, &s.extents);
+		darray_append_items(s.extents, t->extents.item,
+				    t->extents.size);
+		darray_free(t->extents);
+	}
+
+	free(threads);
+	darray_free(s.dirs);
+
+	struct btree_insert_buf keys;
+	struct disk_reservation res = bch2_disk_reservation_init(c, 1);
+
+	bch2_btree_insert_buf_init(&keys, c, &res, NULL,
+				   BTREE_INSERT_NOJOURNAL);
+
+	reserve_old_fs_space(c, &keys, &res, &root_inode, &s.extents);
+
+	ret = bch2_btree_insert_buf_flush(&keys);
+	if (ret)
+		die("btree insert error %s", strerror(-ret));
+
+	bch2_disk_reservation_put(c, &res);
 
 	update_inode(c, &root_inode);
 
@@ -640,6 +958,84 @@ static const struct option migrate_opts[] = {
 	{ NULL }
 };
 
+/*
+ * zstd dictionary training: when migrating with zstd compression, sample the
+ * source filesystem's file contents before copying anything, so that small
+ * extents in the new filesystem compress against a dictionary trained on
+ * representative data:
+ */
+
+#define DICT_SAMPLE_SIZE	4096
+#define DICT_NR_SAMPLES		4096
+#define DICT_CAPACITY		(32 << 10)
+
+static struct {
+	char		*buf;
+	size_t		used;
+	size_t		*sizes;
+	unsigned	nr;
+} dict_samples;
+
+static int dict_sample_visit(const char *path, const struct stat *st,
+			     int type, struct FTW *ftw)
+{
+	int fd;
+	ssize_t r;
+
+	if (type != FTW_F || !S_ISREG(st->st_mode) || !st->st_size)
+		return 0;
+
+	fd = open(path, O_RDONLY|O_NOATIME);
+	if (fd < 0)
+		return 0;
+
+	r = read(fd, dict_samples.buf + dict_samples.used, DICT_SAMPLE_SIZE);
+	close(fd);
+
+	if (r > 0) {
+		dict_samples.used += r;
+		dict_samples.sizes[dict_samples.nr++] = r;
+	}
+
+	return dict_samples.nr >= DICT_NR_SAMPLES;
+}
+
+static void train_compression_dict(struct bch_fs *c, const char *fs_path)
+{
+	void *dict;
+	size_t dict_len;
+	int ret;
+
+	if (c->opts.compression != BCH_COMPRESSION_OPT_zstd &&
+	    c->opts.background_compression != BCH_COMPRESSION_OPT_zstd)
+		return;
+
+	dict_samples.buf	= xmalloc(DICT_NR_SAMPLES * DICT_SAMPLE_SIZE);
+	dict_samples.sizes	= xcalloc(DICT_NR_SAMPLES,
+					  sizeof(dict_samples.sizes[0]));
+
+	nftw(fs_path, dict_sample_visit, 40, FTW_PHYS|FTW_MOUNT);
+
+	dict = xmalloc(DICT_CAPACITY);
+	dict_len = ZDICT_trainFromBuffer(dict, DICT_CAPACITY,
+					 dict_samples.buf,
+					 dict_samples.sizes,
+					 dict_samples.nr);
+	if (!ZDICT_isError(dict_len)) {
+		ret = bch2_fs_compression_dict_set(c, dict, dict_len);
+		if (ret)
+			die("error writing compression dictionary: %s",
+			    strerror(-ret));
+
+		printf("Trained %zu byte zstd dictionary from %u file samples\n",
+		       dict_len, dict_samples.nr);
+	}
+
+	free(dict);
+	free(dict_samples.buf);
+	free(dict_samples.sizes);
+}
+
 static int migrate_fs(const char		*fs_path,
 		      struct bch_opt_strs	fs_opt_strs,
 		      struct bch_opts		fs_opts,
@@ -703,6 +1099,8 @@ static int migrate_fs(const char		*fs_path,
 	if (ret)
 		die("Error starting new filesystem: %s", strerror(-ret));
 
+	train_compression_dict(c, fs_path);
+
 	copy_fs(c, fs_fd, fs_path, bcachefs_inum, &extents);
 
 	bch2_fs_stop(c);
@@ -0,0 +1,308 @@
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <linux/sort.h>
+
+#include "cmds.h"
+#include "libbcachefs.h"
+#include "tools-util.h"
+
+#include "libbcachefs/bcachefs.h"
+#include "libbcachefs/btree_cache.h"
+#include "libbcachefs/btree_io.h"
+#include "libbcachefs/btree_iter.h"
+#include "libbcachefs/checksum.h"
+#include "libbcachefs/error.h"
+#include "libbcachefs/extents.h"
+#include "libbcachefs/super.h"
+
+/*
+ * bcachefs scrub: read and checksum every btree node replica, without the
+ * cost of a full fsck.
+ *
+ * We enumerate btree node pointers by walking interior nodes, then sort them
+ * by device and LBA before reading: btree nodes are scattered all over the
+ * device and random order reads make scrubbing a rotational device take an
+ * order of magnitude longer than it needs to.
+ *
+ * Checksums only - key validation is fsck's job. Checksums are computed over
+ * the encrypted data, so this works without exposing keys on encrypted
+ * filesystems.
+ */
+
+static void scrub_usage(void)
+{
+	puts("bcachefs scrub - verify btree node checksums\n"
+	     "Usage: bcachefs scrub [OPTION]... <devices>\n"
+	     "\n"
+	     "Options:\n"
+	     "  -r rate       Limit reads to rate bytes/second per device\n"
+	     "  -v            Verbose mode\n"
+	     "  -h            Display this help and exit\n"
+	     "Report bugs to <linux-bcache@vger.kernel.org>");
+}
+
+struct scrub_extent {
+	u32			dev;
+	u32			btree_id;
+	u32			level;
+	u64			offset;		/* sectors */
+};
+
+typedef darray(struct scrub_extent) scrub_extents;
+
+struct scrub_dev_stats {
+	u64			nr_nodes;
+	u64			nr_errors;
+};
+
+static void scrub_add_key(struct bch_fs *c, scrub_extents *extents,
+			  struct bkey_s_c k, unsigned btree_id, unsigned level)
+{
+	struct bkey_ptrs_c ptrs = bch2_bkey_ptrs_c(k);
+	const struct bch_extent_ptr *ptr;
+
+	bkey_for_each_ptr(ptrs, ptr) {
+		if (ptr->dev >= c->sb.nr_devices ||
+		    !c->devs[ptr->dev])
+			continue;
+
+		darray_append(*extents, (struct scrub_extent) {
+			.dev		= ptr->dev,
+			.btree_id	= btree_id,
+			.level		= level,
+			.offset		= ptr->offset,
+		});
+	}
+}
+
+/*
+ * One walk of each btree suffices for all devices - every node's key lists
+ * pointers to all its replicas:
+ */
+static void scrub_get_extents(struct bch_fs *c, scrub_extents *extents)
+{
+	unsigned i;
+
+	for (i = 0; i < BTREE_ID_NR; i++) {
+		struct btree_trans trans;
+		struct btree_iter *iter;
+		struct btree *b;
+
+		bch2_trans_init(&trans, c, 0, 0);
+
+		__for_each_btree_node(&trans, iter, i, POS_MIN, 0, 1, 0, b) {
+			struct btree_node_iter node_iter;
+			struct bkey u;
+			struct bkey_s_c k;
+
+			for_each_btree_node_key_unpack(b, k, &node_iter, &u)
+				scrub_add_key(c, extents, k, i, b->c.level - 1);
+		}
+
+		b = c->btree_roots[i].b;
+		if (!btree_node_fake(b))
+			scrub_add_key(c, extents, bkey_i_to_s_c(&b->key),
+				      i, b->c.level);
+
+		bch2_trans_exit(&trans);
+	}
+}
+
+static int scrub_extent_cmp(const void *_l, const void *_r)
+{
+	const struct scrub_extent *l = _l, *r = _r;
+
+	return cmp_int(l->dev, r->dev) ?: cmp_int(l->offset, r->offset);
+}
+
+/*
+ * Walk the bsets in a node we read raw off the device, verifying each one's
+ * checksum. Checksums cover the still encrypted data, so no decryption - and
+ * no key validation, that's fsck's job. Returns an error string, or NULL on
+ * success:
+ */
+static const char *scrub_check_node(struct bch_fs *c, void *data)
+{
+	struct btree_node *bn = data;
+	struct btree_node_entry *bne;
+	struct bset *i;
+	struct nonce nonce;
+	struct bch_csum csum;
+	unsigned offset = 0;	/* sectors */
+
+	if (le64_to_cpu(bn->magic) != bset_magic(c))
+		return "bad magic";
+
+	if (!bn->keys.seq)
+		return "bad btree header";
+
+	while (offset < c->opts.btree_node_size) {
+		unsigned sectors;
+
+		if (!offset) {
+			i = &bn->keys;
+			sectors = vstruct_sectors(bn, c->block_bits);
+		} else {
+			bne = data + (offset << 9);
+			i = &bne->keys;
+
+			if (i->seq != bn->keys.seq)
+				break;
+
+			sectors = vstruct_sectors(bne, c->block_bits);
+		}
+
+		/*
+		 * Bounds check before checksumming - u64s isn't validated
+		 * until the checksum passes, and the checksum is computed
+		 * over vstruct_bytes():
+		 */
+		if (!sectors ||
+		    offset + sectors > c->opts.btree_node_size)
+			return "bset past end of btree node";
+
+		if (!bch2_checksum_type_valid(c, BSET_CSUM_TYPE(i)))
+			return "unknown checksum type";
+
+		nonce = btree_nonce(i, offset << 9);
+
+		if (!offset) {
+			csum = csum_vstruct(c, BSET_CSUM_TYPE(i), nonce, bn);
+
+			if (bch2_crc_cmp(csum, bn->csum))
+				return "invalid checksum";
+		} else {
+			csum = csum_vstruct(c, BSET_CSUM_TYPE(i), nonce, bne);
+
+			if (bch2_crc_cmp(csum, bne->csum))
+				return "invalid checksum";
+		}
+
+		offset += sectors;
+	}
+
+	return NULL;
+}
+
+static void scrub_rate_limit(u64 rate, u64 bytes_read, struct timespec *start)
+{
+	struct timespec now;
+	u64 elapsed_ns, target_ns;
+
+	if (!rate)
+		return;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	elapsed_ns = (now.tv_sec - start->tv_sec) * NSEC_PER_SEC +
+		(now.tv_nsec - start->tv_nsec);
+	target_ns = div64_u64(bytes_read * NSEC_PER_SEC, rate);
+
+	if (target_ns > elapsed_ns) {
+		struct timespec sleep = {
+			.tv_sec		= (target_ns - elapsed_ns) / NSEC_PER_SEC,
+			.tv_nsec	= (target_ns - elapsed_ns) % NSEC_PER_SEC,
+		};
+
+		nanosleep(&sleep, NULL);
+	}
+}
+
+int cmd_scrub(int argc, char *argv[])
+{
+	struct bch_opts opts = bch2_opts_empty();
+	struct scrub_dev_stats *stats;
+	scrub_extents extents = darray_new();
+	struct scrub_extent *e;
+	struct timespec start;
+	u64 rate = 0, bytes_read = 0;
+	u64 nr_errors = 0;
+	bool verbose = false;
+	unsigned i;
+	void *buf;
+	int opt;
+
+	opt_set(opts, nochanges,	true);
+	opt_set(opts, norecovery,	true);
+	opt_set(opts, degraded,		true);
+	opt_set(opts, errors,		BCH_ON_ERROR_CONTINUE);
+
+	while ((opt = getopt(argc, argv, "r:vh")) != -1)
+		switch (opt) {
+		case 'r':
+			if (bch2_strtoull_h(optarg, &rate))
+				die("invalid rate");
+			break;
+		case 'v':
+			verbose = true;
+			break;
+		case 'h':
+			scrub_usage();
+			exit(EXIT_SUCCESS);
+		}
+	args_shift(optind);
+
+	if (!argc)
+		die("Please supply device(s) to scrub");
+
+	struct bch_fs *c = bch2_fs_open(argv, argc, opts);
+	if (IS_ERR(c))
+		die("error opening %s: %s", argv[0], strerror(-PTR_ERR(c)));
+
+	scrub_get_extents(c, &extents);
+
+	sort(extents.item, darray_size(extents),
+	     sizeof(extents.item[0]), scrub_extent_cmp, NULL);
+
+	stats	= xcalloc(c->sb.nr_devices, sizeof(*stats));
+	buf	= xmalloc(btree_bytes(c));
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	darray_foreach(e, extents) {
+		struct bch_dev *ca = c->devs[e->dev];
+		const char *err;
+
+		xpread(ca->disk_sb.bdev->bd_fd, buf, btree_bytes(c),
+		       e->offset << 9);
+		bytes_read += btree_bytes(c);
+
+		stats[e->dev].nr_nodes++;
+
+		err = scrub_check_node(c, buf);
+		if (err) {
+			stats[e->dev].nr_errors++;
+			nr_errors++;
+			fprintf(stderr, "%s: btree %s level %u sector %llu: %s\n",
+				ca->name, bch2_btree_ids[e->btree_id],
+				e->level, e->offset, err);
+		} else if (verbose) {
+			printf("%s: btree %s level %u sector %llu: ok\n",
+			       ca->name, bch2_btree_ids[e->btree_id],
+			       e->level, e->offset);
+		}
+
+		scrub_rate_limit(rate, bytes_read, &start);
+	}
+
+	for (i = 0; i < c->sb.nr_devices; i++)
+		if (c->devs[i])
+			printf("%s: scrubbed %llu btree nodes, %llu errors\n",
+			       c->devs[i]->name,
+			       stats[i].nr_nodes,
+			       stats[i].nr_errors);
+
+	free(buf);
+	free(stats);
+	darray_free(extents);
+	bch2_fs_stop(c);
+
+	return nr_errors != 0;
+}
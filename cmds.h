@@ -28,6 +28,7 @@ int cmd_device_offline(int argc, char *argv[]);
 int cmd_device_evacuate(int argc, char *argv[]);
 int cmd_device_set_state(int argc, char *argv[]);
 int cmd_device_resize(int argc, char *argv[]);
+int cmd_device_resize_journal(int argc, char *argv[]);
 
 int cmd_data_rereplicate(int argc, char *argv[]);
 
@@ -36,10 +37,18 @@ int cmd_set_passphrase(int argc, char *argv[]);
 int cmd_remove_passphrase(int argc, char *argv[]);
 
 int cmd_fsck(int argc, char *argv[]);
+int cmd_scrub(int argc, char *argv[]);
 
 int cmd_dump(int argc, char *argv[]);
+int cmd_restore(int argc, char *argv[]);
 int cmd_list(int argc, char *argv[]);
 int cmd_list_journal(int argc, char *argv[]);
+int cmd_list_trace(int argc, char *argv[]);
+int cmd_perf(int argc, char *argv[]);
+
+/* Cached raid_bench() kernel selection, refreshed by bcachefs raid-bench: */
+#define RAID_BENCH_CACHE	"/var/cache/bcachefs.raid_bench"
+int cmd_raid_bench(int argc, char *argv[]);
 
 int cmd_migrate(int argc, char *argv[]);
 int cmd_migrate_superblock(int argc, char *argv[]);
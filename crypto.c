@@ -75,6 +75,31 @@ char *read_passphrase_twice(const char *prompt)
 	return pass;
 }
 
+/*
+ * Non interactive variant, for provisioning: read the first line of @path as
+ * the passphrase. @path may be /dev/fd/N for a descriptor inherited from an
+ * agent, so don't seek or reopen:
+ */
+char *read_passphrase_file(const char *path)
+{
+	char *buf = NULL;
+	size_t buflen = 0;
+	ssize_t len;
+
+	FILE *f = fopen(path, "r");
+	if (!f)
+		die("error opening %s: %m", path);
+
+	len = getline(&buf, &buflen, f);
+	if (len < 0)
+		die("error reading passphrase from %s", path);
+	if (len && buf[len - 1] == '\n')
+		buf[len - 1] = '\0';
+
+	fclose(f);
+	return buf;
+}
+
 struct bch_key derive_passphrase(struct bch_sb_field_crypt *crypt,
 				 const char *passphrase)
 {
@@ -132,14 +157,50 @@ void bch2_passphrase_check(struct bch_sb *sb, const char *passphrase,
 		die("incorrect passphrase");
 }
 
-void bch2_add_key(struct bch_sb *sb, const char *passphrase)
+/*
+ * Is the unlock key for @sb already in the keyring? If so, unlock can skip
+ * prompting - and the deliberately expensive passphrase KDF - entirely:
+ */
+bool bch2_sb_key_cached(struct bch_sb *sb)
+{
+	char uuid[40];
+	uuid_unparse_lower(sb->user_uuid.b, uuid);
+
+	char *description = mprintf("bcachefs:%s", uuid);
+	bool ret = request_key("logon", description, NULL,
+			       KEY_SPEC_USER_KEYRING) >= 0;
+
+	free(description);
+	return ret;
+}
+
+/*
+ * Add an already derived passphrase key to the keyring, checking it against
+ * @sb's encrypted key first; returns false if it doesn't unlock @sb. This
+ * lets callers unlocking multiple filesystems run the KDF once per set of kdf
+ * parameters instead of once per filesystem:
+ */
+bool bch2_add_passphrase_key(struct bch_sb *sb, struct bch_key *passphrase_key)
 {
-	struct bch_key passphrase_key;
+	struct bch_sb_field_crypt *crypt = bch2_sb_get_crypt(sb);
 	struct bch_encrypted_key sb_key;
+	bool ret;
+
+	if (!crypt)
+		die("filesystem is not encrypted");
+
+	sb_key = crypt->key;
+
+	if (!bch2_key_is_encrypted(&sb_key))
+		die("filesystem does not have encryption key");
+
+	if (bch2_chacha_encrypt_key(passphrase_key, __bch2_sb_key_nonce(sb),
+				    &sb_key, sizeof(sb_key)))
+		die("error encrypting key");
 
-	bch2_passphrase_check(sb, passphrase,
-			      &passphrase_key,
-			      &sb_key);
+	ret = !bch2_key_is_encrypted(&sb_key);
+	if (!ret)
+		goto out;
 
 	char uuid[40];
 	uuid_unparse_lower(sb->user_uuid.b, uuid);
@@ -147,22 +208,38 @@ void bch2_add_key(struct bch_sb *sb, const char *passphrase)
 	char *description = mprintf("bcachefs:%s", uuid);
 
 	if (add_key("logon", description,
-		    &passphrase_key, sizeof(passphrase_key),
+		    passphrase_key, sizeof(*passphrase_key),
 		    KEY_SPEC_USER_KEYRING) < 0 ||
 	    add_key("user", description,
-		    &passphrase_key, sizeof(passphrase_key),
+		    passphrase_key, sizeof(*passphrase_key),
 		    KEY_SPEC_USER_KEYRING) < 0)
 		die("add_key error: %m");
 
 	memzero_explicit(description, strlen(description));
 	free(description);
-	memzero_explicit(&passphrase_key, sizeof(passphrase_key));
+out:
 	memzero_explicit(&sb_key, sizeof(sb_key));
+	return ret;
+}
+
+void bch2_add_key(struct bch_sb *sb, const char *passphrase)
+{
+	struct bch_sb_field_crypt *crypt = bch2_sb_get_crypt(sb);
+	if (!crypt)
+		die("filesystem is not encrypted");
+
+	struct bch_key passphrase_key = derive_passphrase(crypt, passphrase);
+
+	if (!bch2_add_passphrase_key(sb, &passphrase_key))
+		die("incorrect passphrase");
+
+	memzero_explicit(&passphrase_key, sizeof(passphrase_key));
 }
 
 void bch_sb_crypt_init(struct bch_sb *sb,
 		       struct bch_sb_field_crypt *crypt,
-		       const char *passphrase)
+		       const char *passphrase,
+		       unsigned scrypt_n)
 {
 	crypt->key.magic = BCH_KEY_MAGIC;
 	get_random_bytes(&crypt->key.key, sizeof(crypt->key.key));
@@ -170,7 +247,7 @@ void bch_sb_crypt_init(struct bch_sb *sb,
 	if (passphrase) {
 
 		SET_BCH_CRYPT_KDF_TYPE(crypt, BCH_KDF_SCRYPT);
-		SET_BCH_KDF_SCRYPT_N(crypt, ilog2(SCRYPT_N));
+		SET_BCH_KDF_SCRYPT_N(crypt, ilog2(scrypt_n ?: SCRYPT_N));
 		SET_BCH_KDF_SCRYPT_R(crypt, ilog2(SCRYPT_r));
 		SET_BCH_KDF_SCRYPT_P(crypt, ilog2(SCRYPT_p));
 
@@ -57,6 +57,10 @@ struct bio {
 	bio_end_io_t		*bi_end_io;
 	void			*bi_private;
 
+	/* userspace io accounting (linux/blkdev.c): */
+	u64			bi_submit_time;
+	void			*bi_stack;
+
 	unsigned short		bi_vcnt;	/* how many bio_vec's */
 
 	/*
@@ -84,13 +84,35 @@ struct block_device {
 	struct gendisk		__bd_disk;
 	int			bd_fd;
 	int			bd_sync_fd;
+	int			bd_direct_fd;
+	int			bd_fixed_idx;
+	int			bd_sync_fixed_idx;
+
+	struct bdev_io_stats	*bd_stats;
 
 	struct backing_dev_info	*bd_bdi;
 	struct backing_dev_info	__bd_bdi;
 };
 
+/*
+ * Analogous to the kernel's request plugging: while a plug is active on the
+ * current thread the IO engine may accumulate requests and submit them with
+ * one syscall at blk_finish_plug() time:
+ */
+#define BLK_PLUG_MAX		64
+
+struct blk_plug {
+	unsigned		nr;
+	unsigned		pending;
+	void			*reqs[BLK_PLUG_MAX];
+};
+
+void blk_start_plug(struct blk_plug *);
+void blk_finish_plug(struct blk_plug *);
+
 void generic_make_request(struct bio *);
 int submit_bio_wait(struct bio *);
+void bdev_io_account_complete(struct bio *);
 
 static inline void submit_bio(struct bio *bio)
 {
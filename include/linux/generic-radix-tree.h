@@ -152,6 +152,15 @@ void *__genradix_ptr_alloc(struct __genradix *, size_t, gfp_t);
 struct genradix_iter {
 	size_t			offset;
 	size_t			pos;
+
+	/*
+	 * Current leaf node, cached so that advancing within a leaf doesn't
+	 * re-descend from the root. Nodes are stable until genradix_free(), so
+	 * this stays valid across insertions - but an iterator must not be
+	 * carried across genradix_free():
+	 */
+	void			*leaf;
+	size_t			leaf_offset;
 };
 
 /**
@@ -102,7 +102,7 @@
 
 #define might_sleep()
 
-#define cpu_relax()		do {} while (0)
+#define cpu_relax()		barrier()
 #define cpu_relax_lowlatency()	do {} while (0)
 
 #define panic(fmt, ...)					\
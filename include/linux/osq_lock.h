@@ -4,41 +4,35 @@
 /*
  * An MCS like lock especially tailored for optimistic spinning for sleeping
  * lock implementations (mutex, rwsem, etc).
+ *
+ * In userspace there's no percpu data, so queue nodes are per thread and the
+ * queue tail is just a pointer to the last node - see linux/osq_lock.c.
  */
 struct optimistic_spin_node {
 	struct optimistic_spin_node *next, *prev;
 	int locked; /* 1 if lock acquired */
-	int cpu; /* encoded CPU # + 1 value */
 };
 
 struct optimistic_spin_queue {
 	/*
-	 * Stores an encoded value of the CPU # of the tail node in the queue.
-	 * If the queue is empty, then it's set to OSQ_UNLOCKED_VAL.
+	 * Tail node in the queue - NULL if the queue is empty:
 	 */
-	atomic_t tail;
+	struct optimistic_spin_node *tail;
 };
 
-#define OSQ_UNLOCKED_VAL (0)
-
-/* Init macro and function. */
-#define OSQ_LOCK_UNLOCKED { ATOMIC_INIT(OSQ_UNLOCKED_VAL) }
+#define OSQ_LOCK_UNLOCKED { NULL }
 
 static inline void osq_lock_init(struct optimistic_spin_queue *lock)
 {
-	atomic_set(&lock->tail, OSQ_UNLOCKED_VAL);
-}
-
-static inline bool osq_lock(struct optimistic_spin_queue *lock)
-{
-	return false;
+	WRITE_ONCE(lock->tail, NULL);
 }
 
-static inline void osq_unlock(struct optimistic_spin_queue *lock) {}
+bool osq_lock(struct optimistic_spin_queue *lock);
+void osq_unlock(struct optimistic_spin_queue *lock);
 
 static inline bool osq_is_locked(struct optimistic_spin_queue *lock)
 {
-	return atomic_read(&lock->tail) != OSQ_UNLOCKED_VAL;
+	return READ_ONCE(lock->tail) != NULL;
 }
 
 #endif
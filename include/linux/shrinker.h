@@ -4,6 +4,8 @@
 #include <linux/list.h>
 #include <linux/types.h>
 
+struct time_stats;
+
 struct shrink_control {
 	gfp_t gfp_mask;
 	unsigned long nr_to_scan;
@@ -19,7 +21,9 @@ struct shrinker {
 
 	int seeks;	/* seeks to recreate an obj */
 	long batch;	/* reclaim batch size, 0 = default */
+	const char *name;
 	struct list_head list;
+	struct time_stats *reclaim_stats;
 };
 
 int register_shrinker(struct shrinker *);
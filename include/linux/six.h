@@ -122,6 +122,7 @@ static __always_inline void __six_lock_init(struct six_lock *lock,
 					    struct lock_class_key *key)
 {
 	atomic64_set(&lock->state.counter, 0);
+	osq_lock_init(&lock->osq);
 	raw_spin_lock_init(&lock->wait_lock);
 	INIT_LIST_HEAD(&lock->wait_list[SIX_LOCK_read]);
 	INIT_LIST_HEAD(&lock->wait_list[SIX_LOCK_intent]);
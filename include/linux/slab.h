@@ -68,36 +68,16 @@ static inline void *krealloc(void *old, size_t size, gfp_t flags)
 #define kvmalloc(size, flags)		kmalloc(size, flags)
 #define kvfree(p)			kfree(p)
 
-static inline struct page *alloc_pages(gfp_t flags, unsigned int order)
-{
-	size_t size = PAGE_SIZE << order;
-	void *p;
-
-	run_shrinkers();
-
-	p = aligned_alloc(PAGE_SIZE, size);
-	if (p && (flags & __GFP_ZERO))
-		memset(p, 0, size);
-
-	return p;
-}
+/* linux/page.c - cached in per thread magazines + a global reserve: */
+struct page *alloc_pages(gfp_t flags, unsigned int order);
+void __free_pages(struct page *page, unsigned int order);
 
 #define alloc_page(gfp)			alloc_pages(gfp, 0)
 
 #define __get_free_pages(gfp, order)	((unsigned long) alloc_pages(gfp, order))
 #define __get_free_page(gfp)		__get_free_pages(gfp, 0)
 
-#define __free_pages(page, order)			\
-do {							\
-	(void) order;					\
-	free(page);					\
-} while (0)
-
-#define free_pages(addr, order)				\
-do {							\
-	(void) order;					\
-	free((void *) (addr));				\
-} while (0)
+#define free_pages(addr, order)		__free_pages((struct page *) (addr), order)
 
 #define __free_page(page) __free_pages((page), 0)
 #define free_page(addr) free_pages((addr), 0)
@@ -1,15 +1,73 @@
 #ifndef __TOOLS_LINUX_TRACEPOINT_H
 #define __TOOLS_LINUX_TRACEPOINT_H
 
+#include <linux/types.h>
+
 #define PARAMS(args...) args
 
 #define TP_PROTO(args...)	args
 #define TP_ARGS(args...)	args
 #define TP_CONDITION(args...)	args
 
+/*
+ * In process tracing engine: tracepoints record an event id, timestamp and
+ * their first argument to per thread ring buffers in a file backed shared
+ * mapping, so a stall in a long running process (i.e. the fuse mount) can be
+ * diagnosed after the fact with bcachefs list_trace.
+ *
+ * Enabled by setting BCACHEFS_TRACE to the path of the trace buffer file;
+ * when unset the tracepoints cost a single global load and branch.
+ */
+
+#define TRACE_BUF_MAGIC		0x74726263686673ULL	/* "trbchfs" */
+#define TRACE_BUF_VERSION	1
+
+#define TRACE_NAMES_MAX		256
+#define TRACE_NAME_LEN		48
+#define TRACE_THREADS_MAX	64
+#define TRACE_RING_ENTRIES	8192
+
+struct trace_entry {
+	__u64			time;
+	__u32			id;
+	__u32			pad;
+	__u64			arg;
+};
+
+struct trace_ring {
+	__u64			tid;
+	__u64			head;	/* entries written, monotonic */
+	struct trace_entry	entries[TRACE_RING_ENTRIES];
+};
+
+struct trace_buf {
+	__u64			magic;
+	__u32			version;
+	__u32			nr_names;
+	char			names[TRACE_NAMES_MAX][TRACE_NAME_LEN];
+	struct trace_ring	rings[TRACE_THREADS_MAX];
+};
+
+struct trace_tp {
+	int			id;	/* 0 = not yet registered */
+	const char		*name;
+};
+
+extern bool bch2_trace_on;
+
+void bch2_trace_emit(struct trace_tp *, unsigned long);
+
+#define __TRACE_FIRST_ARG(_arg, ...)	(_arg)
+
 #define __DECLARE_TRACE(name, proto, args, cond, data_proto, data_args) \
 	static inline void trace_##name(proto)				\
-	{ }								\
+	{								\
+		static struct trace_tp tp = { 0, #name };		\
+									\
+		if (bch2_trace_on)					\
+			bch2_trace_emit(&tp,				\
+				(unsigned long) __TRACE_FIRST_ARG(args)); \
+	}								\
 	static inline void trace_##name##_rcuidle(proto)		\
 	{ }								\
 	static inline int						\
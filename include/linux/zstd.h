@@ -6,5 +6,8 @@
 #define ZSTD_compressCCtx(w, dst, d_len, src, src_len, params)	\
 	ZSTD_compressCCtx(w, dst, d_len, src, src_len, 0)
 
+#define ZSTD_compress_usingDict(w, dst, d_len, src, src_len, dict, dict_len, params) \
+	ZSTD_compress_usingDict(w, dst, d_len, src, src_len, dict, dict_len, 0)
+
 #define ZSTD_CCtxWorkspaceBound(p)	ZSTD_estimateCCtxSize(0)
 #define ZSTD_DCtxWorkspaceBound()	ZSTD_estimateDCtxSize()
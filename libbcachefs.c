@@ -2,17 +2,21 @@
 #include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/ioctl.h>
 #include <sys/stat.h>
 #include <sys/sysmacros.h>
 #include <sys/types.h>
 #include <time.h>
 #include <unistd.h>
 
+#include <linux/fs.h>
+
 #include <uuid/uuid.h>
 
 #include "libbcachefs.h"
@@ -74,6 +78,120 @@ static void init_layout(struct bch_sb_layout *l, unsigned block_size,
 	l->sb_offset[1]		= cpu_to_le64(backup);
 }
 
+/*
+ * Format time device probe: measure sequential write bandwidth and synced
+ * random write latency, and size buckets from the device's measured
+ * sequential/random crossover instead of capacity heuristics alone. Only run
+ * when requested - it writes to the device (fine mid-format, everything gets
+ * overwritten) and takes a few seconds per device:
+ */
+
+struct dev_probe_result {
+	bool		probed;
+	u32		seq_kb_per_sec;
+	u32		rand_iops;
+	u32		discard_usec;
+};
+
+#define PROBE_SEQ_BYTES		(16U << 20)
+#define PROBE_CHUNK_BYTES	(1U << 20)
+#define PROBE_RAND_NR		64
+#define PROBE_RAND_BYTES	4096
+#define PROBE_OFFSET		(4ULL << 20)
+
+static u64 probe_nsecs(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+static void bch2_probe_device(struct dev_opts *dev, struct dev_probe_result *r)
+{
+	void *buf = aligned_alloc(4096, PROBE_CHUNK_BYTES);
+	u64 start, elapsed, span;
+	unsigned i;
+
+	if (!dev->size)
+		dev->size = get_size(dev->path, dev->fd) >> 9;
+
+	span = dev->size << 9;
+	if (!buf || span < PROBE_OFFSET * 2 + PROBE_SEQ_BYTES)
+		goto out;
+
+	memset(buf, 0x5a, PROBE_CHUNK_BYTES);
+
+	/* sequential write bandwidth: */
+	start = probe_nsecs();
+	for (i = 0; i < PROBE_SEQ_BYTES / PROBE_CHUNK_BYTES; i++)
+		xpwrite(dev->fd, buf, PROBE_CHUNK_BYTES,
+			PROBE_OFFSET + (u64) i * PROBE_CHUNK_BYTES);
+	if (fdatasync(dev->fd))
+		goto out;
+	elapsed = max_t(u64, probe_nsecs() - start, 1);
+	r->seq_kb_per_sec = ((u64) (PROBE_SEQ_BYTES >> 10) * NSEC_PER_SEC) / elapsed;
+
+	/* random write latency, synced so the device can't just buffer: */
+	start = probe_nsecs();
+	for (i = 0; i < PROBE_RAND_NR; i++) {
+		u64 off = PROBE_OFFSET +
+			(((u64) i * 2654435761ULL) %
+			 (span - 2 * PROBE_OFFSET)) / PROBE_RAND_BYTES
+			* PROBE_RAND_BYTES;
+
+		xpwrite(dev->fd, buf, PROBE_RAND_BYTES, off);
+		if (fdatasync(dev->fd))
+			goto out;
+	}
+	elapsed = max_t(u64, probe_nsecs() - start, 1);
+	r->rand_iops = ((u64) PROBE_RAND_NR * NSEC_PER_SEC) / elapsed;
+
+	/* discard one 1MB region, if the device supports it: */
+	if (S_ISBLK(xfstat(dev->fd).st_mode)) {
+		u64 range[2] = { PROBE_OFFSET, 1U << 20 };
+
+		start = probe_nsecs();
+		if (!ioctl(dev->fd, BLKDISCARD, range))
+			r->discard_usec = (probe_nsecs() - start) / 1000;
+	}
+
+	r->probed = r->seq_kb_per_sec && r->rand_iops;
+out:
+	free(buf);
+}
+
+static void bch2_probe_bucket_size(struct dev_opts *dev,
+				   struct dev_probe_result *r)
+{
+	u64 crossover_bytes;
+
+	bch2_probe_device(dev, r);
+	if (!r->probed) {
+		fprintf(stderr, "%s: probe failed, using capacity heuristics\n",
+			dev->path);
+		return;
+	}
+
+	if (dev->bucket_size)
+		return;
+
+	/*
+	 * One random access costs the same time as streaming crossover_bytes;
+	 * size buckets at 4x that so bucket granular IO (copygc, journal)
+	 * runs at >= 80% of sequential speed. Same 128k-1M clamp as the
+	 * capacity heuristic:
+	 */
+	crossover_bytes = ((u64) r->seq_kb_per_sec * 1024) / r->rand_iops;
+
+	dev->bucket_size = clamp_t(u64,
+			roundup_pow_of_two((crossover_bytes * 4) >> 9),
+			256, 2048);
+
+	fprintf(stderr, "%s: %u KB/s sequential, %u sync write iops -> bucket size %u sectors\n",
+		dev->path, r->seq_kb_per_sec, r->rand_iops, dev->bucket_size);
+}
+
 void bch2_pick_bucket_size(struct bch_opts opts, struct dev_opts *dev)
 {
 	if (!dev->sb_offset) {
@@ -152,6 +270,60 @@ static unsigned parse_target(struct bch_sb_handle *sb,
 	return 0;
 }
 
+/*
+ * Zero a device range, offloading to the device (BLKZEROOUT/write zeroes)
+ * when it supports it so we're not shipping buffers of zeroes over the bus:
+ */
+static void zero_out(int fd, u64 offset, u64 len)
+{
+	struct stat statbuf = xfstat(fd);
+
+	if (S_ISBLK(statbuf.st_mode)) {
+		u64 range[2] = { offset, len };
+
+		if (!ioctl(fd, BLKZEROOUT, range))
+			return;
+	}
+
+	while (len) {
+		static const char zeroes[BCH_SB_SECTOR << 9];
+		u64 b = min_t(u64, len, sizeof(zeroes));
+
+		xpwrite(fd, zeroes, b, offset);
+		offset	+= b;
+		len	-= b;
+	}
+}
+
+struct write_sb_job {
+	pthread_t		thread;
+	struct dev_opts		*dev;
+	unsigned		dev_idx;
+	unsigned		block_size;
+	struct bch_sb		*sb;
+};
+
+static void *write_one_super(void *_job)
+{
+	struct write_sb_job *j = _job;
+	struct dev_opts *i = j->dev;
+
+	j->sb->dev_idx = j->dev_idx;
+
+	init_layout(&j->sb->layout, j->block_size,
+		    i->sb_offset, i->sb_end);
+
+	if (i->sb_offset == BCH_SB_SECTOR)
+		/* Zero start of disk */
+		zero_out(i->fd, 0, BCH_SB_SECTOR << 9);
+
+	bch2_super_write(i->fd, j->sb);
+	close(i->fd);
+
+	free(j->sb);
+	return NULL;
+}
+
 struct bch_sb *bch2_format(struct bch_opt_strs	fs_opt_strs,
 			   struct bch_opts	fs_opts,
 			   struct format_opts	opts,
@@ -175,9 +347,14 @@ struct bch_sb *bch2_format(struct bch_opt_strs	fs_opt_strs,
 		die("blocksize too small: %u, must be greater than device blocksize %u",
 		    fs_opts.block_size, max_dev_block_size);
 
+	struct dev_probe_result *probes = xcalloc(nr_devs, sizeof(*probes));
+
 	/* calculate bucket sizes: */
-	for (i = devs; i < devs + nr_devs; i++)
+	for (i = devs; i < devs + nr_devs; i++) {
+		if (opts.bucket_probe)
+			bch2_probe_bucket_size(i, &probes[i - devs]);
 		bch2_pick_bucket_size(fs_opts, i);
+	}
 
 	/* calculate btree node size: */
 	if (!opt_defined(fs_opts, btree_node_size)) {
@@ -288,27 +465,86 @@ struct bch_sb *bch2_format(struct bch_opt_strs	fs_opt_strs,
 		struct bch_sb_field_crypt *crypt =
 			bch2_sb_resize_crypt(&sb, sizeof(*crypt) / sizeof(u64));
 
-		bch_sb_crypt_init(sb.sb, crypt, opts.passphrase);
+		bch_sb_crypt_init(sb.sb, crypt, opts.passphrase, opts.scrypt_n);
 		SET_BCH_SB_ENCRYPTION_TYPE(sb.sb, 1);
 	}
 
+	/* Probe measurements, for later tooling: */
+	{
+		unsigned nr_probed = 0;
+
+		for (i = devs; i < devs + nr_devs; i++)
+			nr_probed += probes[i - devs].probed;
+
+		if (nr_probed) {
+			struct bch_sb_field_dev_probe *p =
+				bch2_sb_resize_dev_probe(&sb,
+					(sizeof(*p) +
+					 sizeof(p->entries[0]) * nr_probed) /
+					sizeof(u64));
+			struct bch_dev_probe_entry *e = p->entries;
+
+			for (i = devs; i < devs + nr_devs; i++) {
+				struct dev_probe_result *r = &probes[i - devs];
+
+				if (!r->probed)
+					continue;
+
+				e->dev			= i - devs;
+				e->seq_write_kb_per_sec	= cpu_to_le32(r->seq_kb_per_sec);
+				e->rand_write_iops	= cpu_to_le32(r->rand_iops);
+				e->discard_usec		= cpu_to_le32(r->discard_usec);
+				e->bucket_size		= cpu_to_le32(i->bucket_size);
+				e++;
+			}
+		}
+	}
+
+	free(probes);
+
+	struct write_sb_job *jobs = xcalloc(nr_devs, sizeof(*jobs));
+
+	/*
+	 * Each device gets its own copy of the superblock - dev_idx, layout,
+	 * and the per write offset/csum are all per device state:
+	 */
 	for (i = devs; i < devs + nr_devs; i++) {
-		sb.sb->dev_idx = i - devs;
+		struct write_sb_job *j = &jobs[i - devs];
 
-		init_layout(&sb.sb->layout, fs_opts.block_size,
-			    i->sb_offset, i->sb_end);
+		j->dev		= i;
+		j->dev_idx	= i - devs;
+		j->block_size	= fs_opts.block_size;
+		j->sb		= xmalloc(vstruct_bytes(sb.sb));
+		memcpy(j->sb, sb.sb, vstruct_bytes(sb.sb));
+
+		if (pthread_create(&j->thread, NULL, write_one_super, j))
+			die("pthread_create error: %m");
+	}
 
-		if (i->sb_offset == BCH_SB_SECTOR) {
-			/* Zero start of disk */
-			static const char zeroes[BCH_SB_SECTOR << 9];
+	{
+		bool progress = isatty(STDERR_FILENO);
+		size_t done = 0;
 
-			xpwrite(i->fd, zeroes, BCH_SB_SECTOR << 9, 0);
+		for (i = devs; i < devs + nr_devs; i++) {
+			pthread_join(jobs[i - devs].thread, NULL);
+
+			if (progress)
+				fprintf(stderr, "\33[2K\r%zu/%zu devices initialized (%s)",
+					++done, nr_devs, i->path);
 		}
 
-		bch2_super_write(i->fd, sb.sb);
-		close(i->fd);
+		if (progress)
+			fprintf(stderr, "\n");
 	}
 
+	free(jobs);
+
+	/* The returned sb keeps the last device's identity, as before: */
+	sb.sb->dev_idx = nr_devs - 1;
+	init_layout(&sb.sb->layout, fs_opts.block_size,
+		    devs[nr_devs - 1].sb_offset,
+		    devs[nr_devs - 1].sb_end);
+
 	return sb.sb;
 }
 
@@ -637,6 +873,51 @@ static void bch2_sb_print_journal_seq_blacklist(struct bch_sb *sb, struct bch_sb
 	}
 }
 
+static void bch2_sb_print_compression_dict(struct bch_sb *sb, struct bch_sb_field *f,
+				enum units units)
+{
+	struct bch_sb_field_compression_dict *d = field_to_type(f, compression_dict);
+
+	printf("  dictionary size:		%u\n",
+	       le32_to_cpu(d->dict_size));
+}
+
+static void bch2_sb_print_prewarm(struct bch_sb *sb, struct bch_sb_field *f,
+				enum units units)
+{
+	struct bch_sb_field_prewarm *p = field_to_type(f, prewarm);
+	struct btree_prewarm_entry *e;
+	unsigned nr = 0;
+
+	for (e = p->start;
+	     (void *) e < vstruct_end(&p->field);
+	     e = (void *) e + sizeof(*e) + e->key_u64s * sizeof(__u64))
+		nr++;
+
+	printf("  btree nodes:			%u\n", nr);
+}
+
+static void bch2_sb_print_dev_probe(struct bch_sb *sb, struct bch_sb_field *f,
+				enum units units)
+{
+	struct bch_sb_field_dev_probe *p = field_to_type(f, dev_probe);
+	struct bch_dev_probe_entry *e;
+
+	for (e = p->entries;
+	     (void *) e < vstruct_end(&p->field);
+	     e++)
+		printf("  device %u:\n"
+		       "    sequential write:		%u KiB/s\n"
+		       "    random sync write:		%u iops\n"
+		       "    1MB discard:		%u us\n"
+		       "    bucket size:		%u\n",
+		       e->dev,
+		       le32_to_cpu(e->seq_write_kb_per_sec),
+		       le32_to_cpu(e->rand_write_iops),
+		       le32_to_cpu(e->discard_usec),
+		       le32_to_cpu(e->bucket_size));
+}
+
 typedef void (*sb_field_print_fn)(struct bch_sb *, struct bch_sb_field *, enum units);
 
 struct bch_sb_field_toolops {
@@ -887,6 +1168,176 @@ struct bchfs_handle bcache_fs_open(const char *path)
 	return ret;
 }
 
+/*
+ * Cached fs handles: opening a filesystem by one of its block devices means
+ * probing and reading that device's superblock just to learn the filesystem
+ * uuid and device index, when the sysfs link isn't available. Repeated tool
+ * invocations (monitoring, fleet automation) pay that cost every time, so
+ * the mapping is snapshotted in /run/bcachefs/<uuid> and revalidated on each
+ * use with one small read of the superblock header, falling back to the full
+ * superblock read when the sb sequence number has moved on:
+ */
+
+#define FS_HANDLE_CACHE_DIR	"/run/bcachefs"
+#define FS_HANDLE_CACHE_MAGIC	0x68636263736e6170ULL	/* "bcchsnap" */
+#define FS_HANDLE_CACHE_VERSION	1
+
+struct fs_handle_cache_entry {
+	u64			dev;		/* dev_t */
+	u64			sb_offset;	/* bytes */
+	u32			dev_idx;
+	u32			pad;
+};
+
+struct fs_handle_cache {
+	u64			magic;
+	u32			version;
+	u32			nr;
+	u64			seq;		/* sb seq when snapshotted */
+	uuid_le			uuid;
+	struct fs_handle_cache_entry entries[];
+};
+
+static struct fs_handle_cache *fs_handle_cache_get(const char *file)
+{
+	struct fs_handle_cache *c = NULL;
+	struct stat st;
+	int fd = open(file, O_RDONLY);
+
+	if (fd < 0)
+		return NULL;
+
+	if (fstat(fd, &st) ||
+	    st.st_size < sizeof(*c))
+		goto err;
+
+	c = xmalloc(st.st_size);
+	if (read(fd, c, st.st_size) != st.st_size ||
+	    c->magic	!= FS_HANDLE_CACHE_MAGIC ||
+	    c->version	!= FS_HANDLE_CACHE_VERSION ||
+	    st.st_size	!= sizeof(*c) + c->nr * sizeof(c->entries[0])) {
+		free(c);
+		c = NULL;
+	}
+err:
+	close(fd);
+	return c;
+}
+
+/* Does the device's superblock still match what we snapshotted? */
+static bool fs_handle_cache_verify(const char *path,
+				   struct fs_handle_cache *c,
+				   struct fs_handle_cache_entry *e)
+{
+	uuid_le magic = BCACHE_MAGIC;
+	struct bch_sb sb;
+	bool ret;
+	int fd = open(path, O_RDONLY);
+
+	if (fd < 0)
+		return false;
+
+	ret = pread(fd, &sb, sizeof(sb), e->sb_offset) == sizeof(sb) &&
+		!memcmp(&sb.magic, &magic, sizeof(magic)) &&
+		!memcmp(&sb.user_uuid, &c->uuid, sizeof(c->uuid)) &&
+		le64_to_cpu(sb.seq) == c->seq &&
+		sb.dev_idx == e->dev_idx;
+
+	close(fd);
+	return ret;
+}
+
+static bool fs_handle_cache_lookup(dev_t dev, const char *path,
+				   char *uuid_str, unsigned *idx)
+{
+	DIR *dir = opendir(FS_HANDLE_CACHE_DIR);
+	struct dirent *d;
+	bool ret = false;
+
+	if (!dir)
+		return false;
+
+	while (!ret && (d = readdir(dir))) {
+		char *file = mprintf(FS_HANDLE_CACHE_DIR "/%s", d->d_name);
+		struct fs_handle_cache *c = fs_handle_cache_get(file);
+		unsigned i;
+
+		for (i = 0; c && i < c->nr; i++)
+			if (c->entries[i].dev == dev &&
+			    fs_handle_cache_verify(path, c, &c->entries[i])) {
+				uuid_unparse(c->uuid.b, uuid_str);
+				*idx = c->entries[i].dev_idx;
+				ret = true;
+				break;
+			}
+
+		free(c);
+		free(file);
+	}
+
+	closedir(dir);
+	return ret;
+}
+
+static void fs_handle_cache_update(struct bch_sb *sb, dev_t dev)
+{
+	struct fs_handle_cache *c, *old;
+	char uuid_str[40];
+	char *file, *tmp;
+	unsigned i, nr = 0;
+	int fd;
+
+	/* Best effort only - nothing below is allowed to fail the open: */
+	if (mkdir(FS_HANDLE_CACHE_DIR, 0755) && errno != EEXIST)
+		return;
+
+	uuid_unparse(sb->user_uuid.b, uuid_str);
+	file = mprintf(FS_HANDLE_CACHE_DIR "/%s", uuid_str);
+
+	old = fs_handle_cache_get(file);
+
+	/* A seq bump means devices may have come or gone - start over: */
+	if (old &&
+	    (memcmp(&old->uuid, &sb->user_uuid, sizeof(old->uuid)) ||
+	     old->seq != le64_to_cpu(sb->seq)))
+		old->nr = 0;
+
+	c = xmalloc(sizeof(*c) + ((old ? old->nr : 0) + 1) *
+		    sizeof(c->entries[0]));
+	c->magic	= FS_HANDLE_CACHE_MAGIC;
+	c->version	= FS_HANDLE_CACHE_VERSION;
+	c->seq		= le64_to_cpu(sb->seq);
+	c->uuid		= sb->user_uuid;
+
+	for (i = 0; old && i < old->nr; i++)
+		if (old->entries[i].dev != dev)
+			c->entries[nr++] = old->entries[i];
+
+	c->entries[nr++] = (struct fs_handle_cache_entry) {
+		.dev		= dev,
+		.sb_offset	= le64_to_cpu(sb->offset) << 9,
+		.dev_idx	= sb->dev_idx,
+	};
+	c->nr = nr;
+
+	tmp = mprintf("%s.%u", file, getpid());
+	fd = open(tmp, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+	if (fd >= 0) {
+		ssize_t bytes = sizeof(*c) + nr * sizeof(c->entries[0]);
+
+		if (write(fd, c, bytes) == bytes)
+			rename(tmp, file);
+		else
+			unlink(tmp);
+		close(fd);
+	}
+
+	free(old);
+	free(c);
+	free(tmp);
+	free(file);
+}
+
 /*
  * Given a path to a block device, open the filesystem it belongs to; also
  * return the device's idx:
@@ -914,6 +1365,8 @@ struct bchfs_handle bchu_fs_open_by_dev(const char *path, unsigned *idx)
 		*p = '\0';
 		p = strrchr(buf, '/');
 		uuid_str = p + 1;
+	} else if (fs_handle_cache_lookup(stat.st_rdev, path, buf, idx)) {
+		uuid_str = buf;
 	} else {
 		struct bch_opts opts = bch2_opts_empty();
 
@@ -929,13 +1382,15 @@ struct bchfs_handle bchu_fs_open_by_dev(const char *path, unsigned *idx)
 		uuid_str = buf;
 		uuid_unparse(sb.sb->user_uuid.b, uuid_str);
 
+		fs_handle_cache_update(sb.sb, stat.st_rdev);
+
 		bch2_free_super(&sb);
 	}
 
 	return bcache_fs_open(uuid_str);
 }
 
-int bchu_data(struct bchfs_handle fs, struct bch_ioctl_data cmd)
+int bchu_data(struct bchfs_handle fs, struct bch_ioctl_data cmd, bool json)
 {
 	int progress_fd = xioctl(fs.ioctl_fd, BCH_IOCTL_DATA, &cmd);
 
@@ -951,27 +1406,55 @@ int bchu_data(struct bchfs_handle fs, struct bch_ioctl_data cmd)
 		if (e.p.data_type == U8_MAX)
 			break;
 
-		printf("\33[2K\r");
-
-		printf("%llu%% complete: current position %s",
-		       e.p.sectors_total
-		       ? e.p.sectors_done * 100 / e.p.sectors_total
-		       : 0,
-		       bch2_data_types[e.p.data_type]);
-
-		switch (e.p.data_type) {
-		case BCH_DATA_btree:
-		case BCH_DATA_user:
-			printf(" %s:%llu:%llu",
+		if (json) {
+			printf("{\"data_type\":\"%s\","
+			       "\"btree_id\":\"%s\","
+			       "\"pos\":{\"inode\":%llu,\"offset\":%llu},"
+			       "\"sectors_done\":%llu,"
+			       "\"sectors_total\":%llu,"
+			       "\"sectors_per_sec\":%llu,",
+			       bch2_data_types[e.p.data_type],
 			       bch2_btree_ids[e.p.btree_id],
 			       e.p.pos.inode,
-			       e.p.pos.offset);
+			       e.p.pos.offset,
+			       e.p.sectors_done,
+			       e.p.sectors_total,
+			       e.p.sectors_per_sec);
+
+			if (e.p.eta_sec != U64_MAX)
+				printf("\"eta_sec\":%llu}\n", e.p.eta_sec);
+			else
+				printf("\"eta_sec\":null}\n");
+		} else {
+			printf("\33[2K\r");
+
+			printf("%llu%% complete: current position %s",
+			       e.p.sectors_total
+			       ? e.p.sectors_done * 100 / e.p.sectors_total
+			       : 0,
+			       bch2_data_types[e.p.data_type]);
+
+			switch (e.p.data_type) {
+			case BCH_DATA_btree:
+			case BCH_DATA_user:
+				printf(" %s:%llu:%llu",
+				       bch2_btree_ids[e.p.btree_id],
+				       e.p.pos.inode,
+				       e.p.pos.offset);
+			}
+
+			if (e.p.eta_sec != U64_MAX)
+				printf(" (%llu sec remaining)", e.p.eta_sec);
 		}
 
 		fflush(stdout);
 		sleep(1);
 	}
-	printf("\nDone\n");
+
+	if (json)
+		printf("{\"done\":true}\n");
+	else
+		printf("\nDone\n");
 
 	close(progress_fd);
 	return 0;
@@ -3,6 +3,7 @@
 
 #include <linux/uuid.h>
 #include <stdbool.h>
+#include <sys/mman.h>
 
 #include "libbcachefs/bcachefs_format.h"
 #include "libbcachefs/bcachefs_ioctl.h"
@@ -34,7 +35,10 @@ struct format_opts {
 	unsigned	encoded_extent_max;
 
 	bool		encrypted;
+	unsigned	scrypt_n;
 	char		*passphrase;
+
+	bool		bucket_probe;
 };
 
 static inline struct format_opts format_opts_default()
@@ -169,6 +173,84 @@ static inline struct bch_ioctl_dev_usage bchu_dev_usage(struct bchfs_handle fs,
 	return i;
 }
 
+/*
+ * Returns a read only mapping of the usage region (see BCH_IOCTL_USAGE_MAP),
+ * refreshed every @update_ms for as long as *@fd stays open, or NULL if the
+ * kernel doesn't support it:
+ */
+static inline struct bch_usage_map_hdr *
+bchu_usage_map(struct bchfs_handle fs, unsigned update_ms,
+	       size_t bytes, int *fd)
+{
+	struct bch_ioctl_usage_map i = {
+		.update_ms	= update_ms,
+		.bytes		= bytes,
+	};
+	void *m;
+
+	*fd = ioctl(fs.ioctl_fd, BCH_IOCTL_USAGE_MAP, &i);
+	if (*fd < 0)
+		return NULL;
+
+	m = mmap(NULL, bytes, PROT_READ, MAP_SHARED, *fd, 0);
+	if (m == MAP_FAILED) {
+		close(*fd);
+		*fd = -1;
+		return NULL;
+	}
+
+	return m;
+}
+
+/*
+ * Accessors for BCH_IOCTL_USAGE_ALL buffers: bchu_usage_all() always
+ * allocates BCH_SB_MEMBERS_MAX device slots, so the replica entries are at a
+ * fixed offset:
+ */
+static inline struct bch_ioctl_dev_usage *
+usage_all_dev(struct bch_ioctl_usage_all *u, unsigned idx)
+{
+	return (struct bch_ioctl_dev_usage *) u->data + idx;
+}
+
+static inline struct bch_replicas_usage *
+usage_all_replicas(struct bch_ioctl_usage_all *u)
+{
+	return (void *) u->data +
+		BCH_SB_MEMBERS_MAX * sizeof(struct bch_ioctl_dev_usage);
+}
+
+/* Returns NULL if the kernel doesn't have BCH_IOCTL_USAGE_ALL: */
+static inline struct bch_ioctl_usage_all *bchu_usage_all(struct bchfs_handle fs)
+{
+	struct bch_ioctl_usage_all *u = NULL;
+	size_t replica_entries_bytes = 4096;
+
+	while (1) {
+		u = xrealloc(u, sizeof(*u) +
+			     BCH_SB_MEMBERS_MAX *
+			     sizeof(struct bch_ioctl_dev_usage) +
+			     replica_entries_bytes);
+		u->version		= BCH_IOCTL_USAGE_ALL_VERSION;
+		u->nr_devices		= BCH_SB_MEMBERS_MAX;
+		u->replica_entries_bytes = replica_entries_bytes;
+		u->pad			= 0;
+
+		if (!ioctl(fs.ioctl_fd, BCH_IOCTL_USAGE_ALL, u))
+			return u;
+
+		if (errno == ENOTTY || errno == EINVAL) {
+			free(u);
+			return NULL;
+		}
+
+		if (errno != ERANGE)
+			die("BCH_IOCTL_USAGE_ALL error: %m");
+
+		replica_entries_bytes *= 2;
+	}
+}
+
 static inline struct bch_sb *bchu_read_super(struct bchfs_handle fs, unsigned idx)
 {
 	size_t size = 4096;
@@ -214,7 +296,20 @@ static inline void bchu_disk_resize(struct bchfs_handle fs,
 	xioctl(fs.ioctl_fd, BCH_IOCTL_DISK_RESIZE, &i);
 }
 
-int bchu_data(struct bchfs_handle, struct bch_ioctl_data);
+static inline void bchu_disk_resize_journal(struct bchfs_handle fs,
+					    unsigned idx,
+					    u64 nbuckets)
+{
+	struct bch_ioctl_disk_resize_journal i = {
+		.flags	= BCH_BY_INDEX,
+		.dev	= idx,
+		.nbuckets = nbuckets,
+	};
+
+	xioctl(fs.ioctl_fd, BCH_IOCTL_DISK_RESIZE_JOURNAL, &i);
+}
+
+int bchu_data(struct bchfs_handle, struct bch_ioctl_data, bool json);
 
 struct dev_name {
 	unsigned	idx;
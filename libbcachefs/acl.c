@@ -129,19 +129,10 @@ invalid:
 	     acl_e < acl->a_entries + acl->a_count;	\
 	     acl_e++)
 
-/*
- * Convert from in-memory to filesystem representation.
- */
-static struct bkey_i_xattr *
-bch2_acl_to_xattr(struct btree_trans *trans,
-		  const struct posix_acl *acl,
-		  int type)
+static int bch2_acl_u64s(const struct posix_acl *acl, unsigned *acl_len)
 {
-	struct bkey_i_xattr *xattr;
-	bch_acl_header *acl_header;
 	const struct posix_acl_entry *acl_e;
-	void *outptr;
-	unsigned nr_short = 0, nr_long = 0, acl_len, u64s;
+	unsigned nr_short = 0, nr_long = 0, u64s;
 
 	acl_for_each_entry(acl, acl_e) {
 		switch (acl_e->e_tag) {
@@ -156,19 +147,30 @@ bch2_acl_to_xattr(struct btree_trans *trans,
 			nr_short++;
 			break;
 		default:
-			return ERR_PTR(-EINVAL);
+			return -EINVAL;
 		}
 	}
 
-	acl_len = bch2_acl_size(nr_short, nr_long);
-	u64s = BKEY_U64s + xattr_val_u64s(0, acl_len);
+	*acl_len = bch2_acl_size(nr_short, nr_long);
+	u64s = BKEY_U64s + xattr_val_u64s(0, *acl_len);
 
 	if (u64s > U8_MAX)
-		return ERR_PTR(-E2BIG);
+		return -E2BIG;
 
-	xattr = bch2_trans_kmalloc(trans, u64s * sizeof(u64));
-	if (IS_ERR(xattr))
-		return xattr;
+	return u64s;
+}
+
+/*
+ * Convert from in-memory to filesystem representation.
+ */
+static void bch2_acl_fill_xattr(struct bkey_i_xattr *xattr,
+				unsigned u64s, unsigned acl_len,
+				const struct posix_acl *acl,
+				int type)
+{
+	bch_acl_header *acl_header;
+	const struct posix_acl_entry *acl_e;
+	void *outptr;
 
 	bkey_xattr_init(&xattr->k_i);
 	xattr->k.u64s		= u64s;
@@ -208,7 +210,49 @@ bch2_acl_to_xattr(struct btree_trans *trans,
 	}
 
 	BUG_ON(outptr != xattr_val(&xattr->v) + acl_len);
+}
+
+static struct bkey_i_xattr *
+bch2_acl_to_xattr(struct btree_trans *trans,
+		  const struct posix_acl *acl,
+		  int type)
+{
+	struct bkey_i_xattr *xattr;
+	unsigned acl_len;
+	int u64s = bch2_acl_u64s(acl, &acl_len);
+
+	if (u64s < 0)
+		return ERR_PTR(u64s);
 
+	xattr = bch2_trans_kmalloc(trans, u64s * sizeof(u64));
+	if (IS_ERR(xattr))
+		return xattr;
+
+	bch2_acl_fill_xattr(xattr, u64s, acl_len, acl, type);
+	return xattr;
+}
+
+/*
+ * Convert an acl to the on disk form for caching in the directory it'll be
+ * inherited from - kmalloc'd, so it outlives the transaction. Returns NULL on
+ * any failure, since the cache is only an optimization - see
+ * __bch2_create():
+ */
+struct bkey_i_xattr *bch2_acl_xattr_cached(const struct posix_acl *acl,
+					   int type)
+{
+	struct bkey_i_xattr *xattr;
+	unsigned acl_len;
+	int u64s = bch2_acl_u64s(acl, &acl_len);
+
+	if (u64s < 0)
+		return NULL;
+
+	xattr = kmalloc(u64s * sizeof(u64), GFP_NOFS);
+	if (!xattr)
+		return NULL;
+
+	bch2_acl_fill_xattr(xattr, u64s, acl_len, acl, type);
 	return xattr;
 }
 
@@ -280,6 +324,35 @@ int bch2_set_acl_trans(struct btree_trans *trans,
 	return ret == -ENOENT ? 0 : ret;
 }
 
+/*
+ * Like bch2_set_acl_trans(), but takes an acl already in the on disk form
+ * produced by bch2_acl_xattr_cached(): just copy it into the transaction and
+ * write it to the new inode.
+ */
+int bch2_set_acl_xattr_trans(struct btree_trans *trans,
+			     struct bch_inode_unpacked *inode_u,
+			     const struct bch_hash_info *hash_info,
+			     const struct bkey_i_xattr *xattr)
+{
+	struct bkey_i_xattr *copy;
+	int ret;
+
+	if (xattr->v.x_type == KEY_TYPE_XATTR_INDEX_POSIX_ACL_DEFAULT &&
+	    !S_ISDIR(inode_u->bi_mode))
+		return -EACCES;
+
+	copy = bch2_trans_kmalloc(trans, bkey_bytes(&xattr->k));
+	if (IS_ERR(copy))
+		return PTR_ERR(copy);
+
+	bkey_copy(&copy->k_i, &xattr->k_i);
+
+	ret = bch2_hash_set(trans, bch2_xattr_hash_desc, hash_info,
+			    inode_u->bi_inum, &copy->k_i, 0);
+
+	return ret == -ENOENT ? 0 : ret;
+}
+
 int bch2_set_acl(struct inode *vinode, struct posix_acl *_acl, int type)
 {
 	struct bch_inode_info *inode = to_bch_ei(vinode);
@@ -334,6 +407,17 @@ btree_err:
 				      ATTR_CTIME|ATTR_MODE);
 
 	set_cached_acl(&inode->v, type, acl);
+
+	/*
+	 * The access cache is derived from the default acl, so changing the
+	 * default acl invalidates both:
+	 */
+	if (type == ACL_TYPE_DEFAULT) {
+		kfree(inode->ei_acl_default_xattr);
+		kfree(inode->ei_acl_access_xattr);
+		inode->ei_acl_default_xattr	= NULL;
+		inode->ei_acl_access_xattr	= NULL;
+	}
 err:
 	bch2_trans_exit(&trans);
 	mutex_unlock(&inode->ei_update_lock);
@@ -5,6 +5,7 @@
 struct bch_inode_unpacked;
 struct bch_hash_info;
 struct bch_inode_info;
+struct bkey_i_xattr;
 struct posix_acl;
 
 #ifdef CONFIG_BCACHEFS_POSIX_ACL
@@ -28,10 +29,16 @@ typedef struct {
 
 struct posix_acl *bch2_get_acl(struct inode *, int);
 
+struct bkey_i_xattr *bch2_acl_xattr_cached(const struct posix_acl *, int);
+
 int bch2_set_acl_trans(struct btree_trans *,
 		       struct bch_inode_unpacked *,
 		       const struct bch_hash_info *,
 		       struct posix_acl *, int);
+int bch2_set_acl_xattr_trans(struct btree_trans *,
+			     struct bch_inode_unpacked *,
+			     const struct bch_hash_info *,
+			     const struct bkey_i_xattr *);
 int bch2_set_acl(struct inode *, struct posix_acl *, int);
 int bch2_acl_chmod(struct btree_trans *, struct bch_inode_info *,
 		   umode_t, struct posix_acl **);
@@ -46,6 +53,14 @@ static inline int bch2_set_acl_trans(struct btree_trans *trans,
 	return 0;
 }
 
+static inline int bch2_set_acl_xattr_trans(struct btree_trans *trans,
+					   struct bch_inode_unpacked *inode_u,
+					   const struct bch_hash_info *hash_info,
+					   const struct bkey_i_xattr *xattr)
+{
+	return 0;
+}
+
 static inline int bch2_acl_chmod(struct btree_trans *trans,
 				 struct bch_inode_info *inode,
 				 umode_t mode,
@@ -223,7 +223,13 @@ int bch2_alloc_read(struct bch_fs *c, struct journal_keys *journal_keys)
 	unsigned i;
 	int ret = 0;
 
-	ret = bch2_btree_and_journal_walk(c, journal_keys, BTREE_ID_ALLOC,
+	/*
+	 * On big (millions of buckets per device) filesystems the alloc read
+	 * dominates clean mount time, and marking an alloc key is just an
+	 * atomic update to that key's own bucket - walk the top level subtrees
+	 * in parallel:
+	 */
+	ret = bch2_btree_and_journal_walk_parallel(c, journal_keys, BTREE_ID_ALLOC,
 					  NULL, bch2_alloc_read_fn);
 	if (ret) {
 		bch_err(c, "error reading alloc info: %i", ret);
@@ -325,50 +331,107 @@ err:
 	return ret;
 }
 
-int bch2_alloc_write(struct bch_fs *c, unsigned flags, bool *wrote)
+static int bch2_alloc_write_dev(struct bch_fs *c, struct bch_dev *ca,
+				unsigned flags, bool *wrote)
 {
 	struct btree_trans trans;
 	struct btree_iter *iter;
-	struct bch_dev *ca;
-	unsigned i;
+	unsigned first_bucket;
 	int ret = 0;
 
-	BUG_ON(BKEY_ALLOC_VAL_U64s_MAX > 8);
+	percpu_down_read(&c->mark_lock);
+	first_bucket = bucket_array(ca)->first_bucket;
+	percpu_up_read(&c->mark_lock);
 
 	bch2_trans_init(&trans, c, BTREE_ITER_MAX, 0);
 
-	iter = bch2_trans_get_iter(&trans, BTREE_ID_ALLOC, POS_MIN,
+	iter = bch2_trans_get_iter(&trans, BTREE_ID_ALLOC,
+				   POS(ca->dev_idx, first_bucket),
 				   BTREE_ITER_SLOTS|BTREE_ITER_INTENT);
 
-	for_each_rw_member(ca, c, i) {
-		unsigned first_bucket;
+	while (1) {
+		bch2_trans_cond_resched(&trans);
 
-		percpu_down_read(&c->mark_lock);
-		first_bucket = bucket_array(ca)->first_bucket;
-		percpu_up_read(&c->mark_lock);
+		ret = bch2_alloc_write_key(&trans, iter, flags);
+		if (ret < 0 || ret == ALLOC_END)
+			break;
+		if (ret == ALLOC_WROTE)
+			*wrote = true;
+		bch2_btree_iter_next_slot(iter);
+	}
+
+	bch2_trans_exit(&trans);
+
+	return ret < 0 ? ret : 0;
+}
+
+struct alloc_write_work {
+	struct work_struct	work;
+	struct bch_fs		*c;
+	struct bch_dev		*ca;
+	unsigned		flags;
+	bool			wrote;
+	int			ret;
+};
+
+static void bch2_alloc_write_work(struct work_struct *work)
+{
+	struct alloc_write_work *w =
+		container_of(work, struct alloc_write_work, work);
+
+	w->ret = bch2_alloc_write_dev(w->c, w->ca, w->flags, &w->wrote);
+}
 
-		bch2_btree_iter_set_pos(iter, POS(i, first_bucket));
+int bch2_alloc_write(struct bch_fs *c, unsigned flags, bool *wrote)
+{
+	struct alloc_write_work *w;
+	struct bch_dev *ca;
+	unsigned i;
+	int ret = 0;
 
-		while (1) {
-			bch2_trans_cond_resched(&trans);
+	BUG_ON(BKEY_ALLOC_VAL_U64s_MAX > 8);
 
-			ret = bch2_alloc_write_key(&trans, iter, flags);
-			if (ret < 0 || ret == ALLOC_END)
+	w = kcalloc(c->sb.nr_devices, sizeof(*w), GFP_KERNEL);
+	if (!w) {
+		for_each_rw_member(ca, c, i) {
+			ret = bch2_alloc_write_dev(c, ca, flags, wrote);
+			if (ret) {
+				percpu_ref_put(&ca->io_ref);
 				break;
-			if (ret == ALLOC_WROTE)
-				*wrote = true;
-			bch2_btree_iter_next_slot(iter);
+			}
 		}
+		return ret;
+	}
 
-		if (ret < 0) {
-			percpu_ref_put(&ca->io_ref);
-			break;
-		}
+	/*
+	 * Alloc keys are disjoint by device (the pos.inode field), so the per
+	 * device flushes can run concurrently, each in its own transaction -
+	 * this is the long pole on first mount after an upgrade or fsck
+	 * repair, when most of the alloc info gets rewritten:
+	 */
+	for_each_rw_member(ca, c, i) {
+		percpu_ref_get(&ca->io_ref);
+
+		w[i] = (struct alloc_write_work) {
+			.c	= c,
+			.ca	= ca,
+			.flags	= flags,
+		};
+		INIT_WORK(&w[i].work, bch2_alloc_write_work);
+		queue_work(system_unbound_wq, &w[i].work);
 	}
 
-	bch2_trans_exit(&trans);
+	for (i = 0; i < c->sb.nr_devices; i++)
+		if (w[i].ca) {
+			flush_work(&w[i].work);
+			if (w[i].wrote)
+				*wrote = true;
+			ret = ret ?: w[i].ret;
+			percpu_ref_put(&w[i].ca->io_ref);
+		}
 
-	return ret < 0 ? ret : 0;
+	kfree(w);
+	return ret;
 }
 
 /* Bucket IO clocks: */
@@ -640,12 +703,24 @@ static void find_reclaimable_buckets_lru(struct bch_fs *c, struct bch_dev *ca)
 	 * by read priority and repeatedly replacing the maximum element until
 	 * all buckets have been visited.
 	 */
-	for (b = ca->mi.first_bucket; b < ca->mi.nbuckets; b++) {
+	for (b = find_next_bit(ca->buckets_maybe_free, ca->mi.nbuckets,
+			       ca->mi.first_bucket);
+	     b < ca->mi.nbuckets;
+	     b = find_next_bit(ca->buckets_maybe_free, ca->mi.nbuckets, b + 1)) {
 		struct bucket_mark m = READ_ONCE(buckets->b[b].mark);
 		unsigned long key = bucket_sort_key(c, ca, b, m);
 
-		if (!bch2_can_invalidate_bucket(ca, b, m))
+		if (!bch2_can_invalidate_bucket(ca, b, m)) {
+			/*
+			 * Only clear the hint if the bucket genuinely isn't
+			 * available - can_invalidate also fails for nouse
+			 * buckets and gen wraparound, which don't affect
+			 * availability:
+			 */
+			if (!is_available_bucket(m))
+				clear_bit(b, ca->buckets_maybe_free);
 			continue;
+		}
 
 		if (e.nr && e.bucket + e.nr == b && e.key == key) {
 			e.nr++;
@@ -817,73 +892,34 @@ static u64 bucket_journal_seq(struct bch_fs *c, struct bucket_mark m)
 	}
 }
 
-static int bch2_invalidate_one_bucket2(struct btree_trans *trans,
-				       struct bch_dev *ca,
-				       struct btree_iter *iter,
-				       u64 *journal_seq, unsigned flags)
-{
+#define BUCKET_INVALIDATE_BATCH_NR	8
+
+struct bucket_invalidate {
+	size_t			bucket;
+	struct bucket_mark	mark;
+	struct btree_iter	*iter;
 #if 0
-	__BKEY_PADDED(k, BKEY_ALLOC_VAL_U64s_MAX) alloc_key;
+	__BKEY_PADDED(k, BKEY_ALLOC_VAL_U64s_MAX) key;
 #else
 	/* hack: */
-	__BKEY_PADDED(k, 8) alloc_key;
+	__BKEY_PADDED(k, 8)	key;
 #endif
+};
+
+static int bch2_invalidate_one_bucket(struct btree_trans *trans,
+				      struct bch_dev *ca,
+				      struct bucket_invalidate *i)
+{
 	struct bch_fs *c = trans->c;
+	struct btree_iter *iter = i->iter;
 	struct bkey_i_alloc *a;
 	struct bkey_alloc_unpacked u;
 	struct bucket *g;
 	struct bucket_mark m;
-	bool invalidating_cached_data;
-	size_t b;
-	int ret = 0;
-
-	BUG_ON(!ca->alloc_heap.used ||
-	       !ca->alloc_heap.data[0].nr);
-	b = ca->alloc_heap.data[0].bucket;
-
-	/* first, put on free_inc and mark as owned by allocator: */
-	percpu_down_read(&c->mark_lock);
-	spin_lock(&c->freelist_lock);
-
-	verify_not_on_freelist(c, ca, b);
-
-	BUG_ON(!fifo_push(&ca->free_inc, b));
-
-	g = bucket(ca, b);
-	m = READ_ONCE(g->mark);
-
-	invalidating_cached_data = m.cached_sectors != 0;
-
-	/*
-	 * If we're not invalidating cached data, we only increment the bucket
-	 * gen in memory here, the incremented gen will be updated in the btree
-	 * by bch2_trans_mark_pointer():
-	 */
-
-	if (!invalidating_cached_data)
-		bch2_invalidate_bucket(c, ca, b, &m);
-	else
-		bch2_mark_alloc_bucket(c, ca, b, true, gc_pos_alloc(c, NULL), 0);
-
-	spin_unlock(&c->freelist_lock);
-	percpu_up_read(&c->mark_lock);
-
-	if (!invalidating_cached_data)
-		goto out;
-
-	/*
-	 * If the read-only path is trying to shut down, we can't be generating
-	 * new btree updates:
-	 */
-	if (test_bit(BCH_FS_ALLOCATOR_STOPPING, &c->flags)) {
-		ret = 1;
-		goto out;
-	}
+	int ret;
 
-	BUG_ON(BKEY_ALLOC_VAL_U64s_MAX > 8);
+	bch2_btree_iter_set_pos(iter, POS(ca->dev_idx, i->bucket));
 
-	bch2_btree_iter_set_pos(iter, POS(ca->dev_idx, b));
-retry:
 	ret = bch2_btree_iter_traverse(iter);
 	if (ret)
 		return ret;
@@ -895,8 +931,6 @@ retry:
 
 	percpu_up_read(&c->mark_lock);
 
-	invalidating_cached_data = u.cached_sectors != 0;
-
 	u.gen++;
 	u.data_type	= 0;
 	u.dirty_sectors	= 0;
@@ -904,12 +938,51 @@ retry:
 	u.read_time	= c->bucket_clock[READ].hand;
 	u.write_time	= c->bucket_clock[WRITE].hand;
 
-	a = bkey_alloc_init(&alloc_key.k);
+	a = bkey_alloc_init(&i->key.k);
 	a->k.p = iter->pos;
 	bch2_alloc_pack(a, u);
 
-	bch2_trans_update(trans, iter, &a->k_i,
-			  BTREE_TRIGGER_BUCKET_INVALIDATE);
+	return bch2_trans_update(trans, iter, &a->k_i,
+				 BTREE_TRIGGER_BUCKET_INVALIDATE);
+}
+
+/*
+ * Commit the btree updates for a batch of invalidated buckets in a single
+ * transaction; on success advance the alloc_heap past them, on failure put
+ * them back by popping them back off free_inc:
+ */
+static int bch2_invalidate_buckets_commit(struct btree_trans *trans,
+					  struct bch_dev *ca,
+					  struct bucket_invalidate *batch,
+					  unsigned *nr, u64 *journal_seq)
+{
+	struct bch_fs *c = trans->c;
+	unsigned i, flags;
+	int ret = 0;
+
+	if (!*nr)
+		return 0;
+
+	/*
+	 * If the read-only path is trying to shut down, we can't be generating
+	 * new btree updates:
+	 */
+	if (test_bit(BCH_FS_ALLOCATOR_STOPPING, &c->flags)) {
+		ret = 1;
+		goto err;
+	}
+
+	/* Only use nowait if we've already invalidated at least one bucket: */
+	flags = BTREE_INSERT_GC_LOCK_HELD|
+		(fifo_used(&ca->free_inc) > *nr ? BTREE_INSERT_NOWAIT : 0);
+retry:
+	for (i = 0; i < *nr; i++) {
+		ret = bch2_invalidate_one_bucket(trans, ca, &batch[i]);
+		if (ret == -EINTR)
+			goto retry;
+		if (ret)
+			goto err;
+	}
 
 	/*
 	 * XXX:
@@ -918,8 +991,7 @@ retry:
 	 * progress, and here the allocator is requiring space in the journal -
 	 * so we need a journal pre-reservation:
 	 */
-	ret = bch2_trans_commit(trans, NULL,
-				invalidating_cached_data ? journal_seq : NULL,
+	ret = bch2_trans_commit(trans, NULL, journal_seq,
 				BTREE_INSERT_NOUNLOCK|
 				BTREE_INSERT_NOCHECK_RW|
 				BTREE_INSERT_NOFAIL|
@@ -928,8 +1000,10 @@ retry:
 				flags);
 	if (ret == -EINTR)
 		goto retry;
-out:
-	if (!ret) {
+	if (ret)
+		goto err;
+
+	for (i = 0; i < *nr; i++) {
 		/* remove from alloc_heap: */
 		struct alloc_heap_entry e, *top = ca->alloc_heap.data;
 
@@ -944,11 +1018,17 @@ out:
 		 * bucket (i.e. deleting the last reference) before writing to
 		 * this bucket again:
 		 */
-		*journal_seq = max(*journal_seq, bucket_journal_seq(c, m));
-	} else {
-		size_t b2;
+		*journal_seq = max(*journal_seq,
+				   bucket_journal_seq(c, batch[i].mark));
+	}
+
+	*nr = 0;
+	return 0;
+err:
+	/* remove from free_inc, in reverse order: */
+	while (*nr) {
+		size_t b = batch[--(*nr)].bucket, b2;
 
-		/* remove from free_inc: */
 		percpu_down_read(&c->mark_lock);
 		spin_lock(&c->freelist_lock);
 
@@ -962,42 +1042,129 @@ out:
 		percpu_up_read(&c->mark_lock);
 	}
 
-	return ret < 0 ? ret : 0;
+	return ret;
 }
 
 /*
  * Pull buckets off ca->alloc_heap, invalidate them, move them to ca->free_inc:
+ *
+ * Buckets with cached data need their btree update to go through before
+ * they're usable, and those are batched up and committed
+ * BUCKET_INVALIDATE_BATCH_NR at a time, so that we're not paying for a journal
+ * reservation and the btree node locks per bucket:
  */
 static int bch2_invalidate_buckets(struct bch_fs *c, struct bch_dev *ca)
 {
 	struct btree_trans trans;
-	struct btree_iter *iter;
+	struct bucket_invalidate batch[BUCKET_INVALIDATE_BATCH_NR];
 	u64 journal_seq = 0;
+	unsigned i, nr = 0;
 	int ret = 0;
 
-	bch2_trans_init(&trans, c, 0, 0);
+	BUG_ON(BKEY_ALLOC_VAL_U64s_MAX > 8);
 
-	iter = bch2_trans_get_iter(&trans, BTREE_ID_ALLOC,
-				   POS(ca->dev_idx, 0),
-				   BTREE_ITER_CACHED|
-				   BTREE_ITER_CACHED_NOFILL|
-				   BTREE_ITER_INTENT);
+	bch2_trans_init(&trans, c, BUCKET_INVALIDATE_BATCH_NR, 0);
+
+	for (i = 0; i < BUCKET_INVALIDATE_BATCH_NR; i++)
+		batch[i].iter = bch2_trans_get_iter(&trans, BTREE_ID_ALLOC,
+						    POS(ca->dev_idx, 0),
+						    BTREE_ITER_CACHED|
+						    BTREE_ITER_CACHED_NOFILL|
+						    BTREE_ITER_INTENT);
 
-	/* Only use nowait if we've already invalidated at least one bucket: */
 	while (!ret &&
 	       !fifo_full(&ca->free_inc) &&
-	       ca->alloc_heap.used)
-		ret = bch2_invalidate_one_bucket2(&trans, ca, iter, &journal_seq,
-				BTREE_INSERT_GC_LOCK_HELD|
-				(!fifo_empty(&ca->free_inc)
-				 ? BTREE_INSERT_NOWAIT : 0));
+	       ca->alloc_heap.used) {
+		struct alloc_heap_entry e, *top = ca->alloc_heap.data;
+		bool invalidating_cached_data;
+		struct bucket *g;
+		struct bucket_mark m;
+		size_t b;
+
+		BUG_ON(nr >= top->nr);
+		b = top->bucket + nr;
+
+		/* first, put on free_inc and mark as owned by allocator: */
+		percpu_down_read(&c->mark_lock);
+		spin_lock(&c->freelist_lock);
+
+		g = bucket(ca, b);
+		m = READ_ONCE(g->mark);
+
+		invalidating_cached_data = m.cached_sectors != 0;
+
+		/*
+		 * A bucket with no cached data completes immediately, and it
+		 * can't jump ahead of the buckets staged before it - commit
+		 * those first:
+		 */
+		if (!invalidating_cached_data && nr) {
+			spin_unlock(&c->freelist_lock);
+			percpu_up_read(&c->mark_lock);
+
+			ret = bch2_invalidate_buckets_commit(&trans, ca, batch,
+							     &nr, &journal_seq);
+			continue;
+		}
+
+		verify_not_on_freelist(c, ca, b);
+
+		BUG_ON(!fifo_push(&ca->free_inc, b));
+
+		/*
+		 * If we're not invalidating cached data, we only increment the
+		 * bucket gen in memory here, the incremented gen will be
+		 * updated in the btree by bch2_trans_mark_pointer():
+		 */
+
+		if (!invalidating_cached_data)
+			bch2_invalidate_bucket(c, ca, b, &m);
+		else
+			bch2_mark_alloc_bucket(c, ca, b, true,
+					       gc_pos_alloc(c, NULL), 0);
+
+		spin_unlock(&c->freelist_lock);
+		percpu_up_read(&c->mark_lock);
+
+		if (!invalidating_cached_data) {
+			/* no btree update needed; remove from alloc_heap: */
+			top->bucket++;
+			top->nr--;
+
+			if (!top->nr)
+				heap_pop(&ca->alloc_heap, e, bucket_alloc_cmp, NULL);
+
+			journal_seq = max(journal_seq, bucket_journal_seq(c, m));
+			continue;
+		}
+
+		batch[nr].bucket	= b;
+		batch[nr].mark		= m;
+		nr++;
+
+		/*
+		 * Can't batch past the current alloc_heap entry - successive
+		 * buckets come from wherever the heap puts the next one:
+		 */
+		if (nr == BUCKET_INVALIDATE_BATCH_NR ||
+		    nr == top->nr)
+			ret = bch2_invalidate_buckets_commit(&trans, ca, batch,
+							     &nr, &journal_seq);
+	}
+
+	if (!ret)
+		ret = bch2_invalidate_buckets_commit(&trans, ca, batch,
+						     &nr, &journal_seq);
 
 	bch2_trans_exit(&trans);
 
 	/* If we used NOWAIT, don't return the error: */
 	if (!fifo_empty(&ca->free_inc))
 		ret = 0;
-	if (ret) {
+	/* The allocator stopping isn't an error: */
+	if (ret == 1)
+		ret = 0;
+	if (ret < 0) {
 		bch_err(ca, "error invalidating buckets: %i", ret);
 		return ret;
 	}
@@ -1012,43 +1179,64 @@ static int bch2_invalidate_buckets(struct bch_fs *c, struct bch_dev *ca)
 	return 0;
 }
 
-static int push_invalidated_bucket(struct bch_fs *c, struct bch_dev *ca, size_t bucket)
+static bool push_bucket_locked(struct bch_fs *c, struct bch_dev *ca)
 {
+	size_t bucket = fifo_peek(&ca->free_inc);
 	unsigned i;
-	int ret = 0;
 
-	while (1) {
-		set_current_state(TASK_INTERRUPTIBLE);
+	for (i = 0; i < RESERVE_NR; i++) {
 
-		spin_lock(&c->freelist_lock);
-		for (i = 0; i < RESERVE_NR; i++) {
+		/*
+		 * Don't strand buckets on the copygc freelist until
+		 * after recovery is finished:
+		 */
+		if (!test_bit(BCH_FS_STARTED, &c->flags) &&
+		    i == RESERVE_MOVINGGC)
+			continue;
 
-			/*
-			 * Don't strand buckets on the copygc freelist until
-			 * after recovery is finished:
-			 */
-			if (!test_bit(BCH_FS_STARTED, &c->flags) &&
-			    i == RESERVE_MOVINGGC)
-				continue;
+		if (fifo_push(&ca->free[i], bucket)) {
+			fifo_pop(&ca->free_inc, bucket);
+			return true;
+		}
+	}
 
-			if (fifo_push(&ca->free[i], bucket)) {
-				fifo_pop(&ca->free_inc, bucket);
+	return false;
+}
 
-				closure_wake_up(&c->freelist_wait);
-				ca->allocator_state = ALLOCATOR_RUNNING;
+static int push_invalidated_buckets(struct bch_fs *c, struct bch_dev *ca, size_t nr)
+{
+	int ret = 0;
 
-				spin_unlock(&c->freelist_lock);
-				goto out;
-			}
+	while (nr) {
+		bool pushed = false;
+
+		set_current_state(TASK_INTERRUPTIBLE);
+
+		/*
+		 * Push as much of the run as the freelists have room for under
+		 * a single lock hold - taking the lock per bucket was a
+		 * significant source of contention with the foreground
+		 * allocation path:
+		 */
+		spin_lock(&c->freelist_lock);
+		while (nr && push_bucket_locked(c, ca)) {
+			pushed = true;
+			nr--;
 		}
 
-		if (ca->allocator_state != ALLOCATOR_BLOCKED_FULL) {
+		if (pushed) {
+			closure_wake_up(&c->freelist_wait);
+			ca->allocator_state = ALLOCATOR_RUNNING;
+		} else if (ca->allocator_state != ALLOCATOR_BLOCKED_FULL) {
 			ca->allocator_state = ALLOCATOR_BLOCKED_FULL;
 			closure_wake_up(&c->freelist_wait);
 		}
 
 		spin_unlock(&c->freelist_lock);
 
+		if (!nr)
+			break;
+
 		if ((current->flags & PF_KTHREAD) &&
 		    kthread_should_stop()) {
 			ret = 1;
@@ -1058,7 +1246,7 @@ static int push_invalidated_bucket(struct bch_fs *c, struct bch_dev *ca, size_t
 		schedule();
 		try_to_freeze();
 	}
-out:
+
 	__set_current_state(TASK_RUNNING);
 	return ret;
 }
@@ -1069,16 +1257,31 @@ out:
  */
 static int discard_invalidated_buckets(struct bch_fs *c, struct bch_dev *ca)
 {
+	bool can_discard = ca->mi.discard &&
+		blk_queue_discard(bdev_get_queue(ca->disk_sb.bdev));
+
 	while (!fifo_empty(&ca->free_inc)) {
 		size_t bucket = fifo_peek(&ca->free_inc);
+		size_t nr = 1;
+
+		if (can_discard) {
+			/*
+			 * free_inc is mostly runs of contiguous buckets, since
+			 * that's the order the allocator invalidates them in -
+			 * coalesce each run into a single large discard
+			 * instead of a discard per bucket:
+			 */
+			while (nr < fifo_used(&ca->free_inc) &&
+			       fifo_idx_entry(&ca->free_inc, nr) == bucket + nr)
+				nr++;
 
-		if (ca->mi.discard &&
-		    blk_queue_discard(bdev_get_queue(ca->disk_sb.bdev)))
 			blkdev_issue_discard(ca->disk_sb.bdev,
 					     bucket_to_sector(ca, bucket),
-					     ca->mi.bucket_size, GFP_NOIO, 0);
+					     ca->mi.bucket_size * nr,
+					     GFP_NOIO, 0);
+		}
 
-		if (push_invalidated_bucket(c, ca, bucket))
+		if (push_invalidated_buckets(c, ca, nr))
 			return 1;
 	}
 
@@ -1281,7 +1484,7 @@ static bool bch2_dev_has_open_write_point(struct bch_fs *c, struct bch_dev *ca)
 	bool ret = false;
 
 	for (ob = c->open_buckets;
-	     ob < c->open_buckets + ARRAY_SIZE(c->open_buckets);
+	     ob < c->open_buckets + c->open_buckets_nr;
 	     ob++) {
 		spin_lock(&ob->lock);
 		if (ob->valid && !ob->on_partial_list &&
@@ -1305,6 +1508,8 @@ void bch2_dev_allocator_remove(struct bch_fs *c, struct bch_dev *ca)
 	for (i = 0; i < ARRAY_SIZE(c->rw_devs); i++)
 		clear_bit(ca->dev_idx, c->rw_devs[i].d);
 
+	WRITE_ONCE(c->dev_alloc_gen, c->dev_alloc_gen + 1);
+
 	/*
 	 * Capacity is calculated based off of devices in allocation groups:
 	 */
@@ -1314,6 +1519,17 @@ void bch2_dev_allocator_remove(struct bch_fs *c, struct bch_dev *ca)
 	for (i = 0; i < ARRAY_SIZE(c->write_points); i++)
 		bch2_writepoint_stop(c, ca, &c->write_points[i]);
 
+#ifndef __KERNEL__
+	{
+		struct write_point *wp;
+
+		mutex_lock(&c->thread_write_points_lock);
+		list_for_each_entry(wp, &c->thread_write_points, thread_node)
+			bch2_writepoint_stop(c, ca, wp);
+		mutex_unlock(&c->thread_write_points_lock);
+	}
+#endif
+
 	bch2_writepoint_stop(c, ca, &c->copygc_write_point);
 	bch2_writepoint_stop(c, ca, &c->rebalance_write_point);
 	bch2_writepoint_stop(c, ca, &c->btree_write_point);
@@ -1371,6 +1587,8 @@ void bch2_dev_allocator_add(struct bch_fs *c, struct bch_dev *ca)
 	for (i = 0; i < ARRAY_SIZE(c->rw_devs); i++)
 		if (ca->mi.data_allowed & (1 << i))
 			set_bit(ca->dev_idx, c->rw_devs[i].d);
+
+	WRITE_ONCE(c->dev_alloc_gen, c->dev_alloc_gen + 1);
 }
 
 void bch2_dev_allocator_quiesce(struct bch_fs *c, struct bch_dev *ca)
@@ -192,24 +192,30 @@ long bch2_bucket_alloc_new_fs(struct bch_dev *ca)
 	rcu_read_lock();
 	buckets = bucket_array(ca);
 
-	for (b = ca->mi.first_bucket; b < ca->mi.nbuckets; b++)
+	for (b = find_next_bit(ca->buckets_maybe_free, ca->mi.nbuckets,
+			       ca->mi.first_bucket);
+	     b < ca->mi.nbuckets;
+	     b = find_next_bit(ca->buckets_maybe_free, ca->mi.nbuckets, b + 1)) {
 		if (is_available_bucket(buckets->b[b].mark))
 			goto success;
+		clear_bit(b, ca->buckets_maybe_free);
+	}
 	b = -1;
 success:
 	rcu_read_unlock();
 	return b;
 }
 
-static inline unsigned open_buckets_reserved(enum alloc_reserve reserve)
+static inline unsigned open_buckets_reserved(struct bch_fs *c,
+					     enum alloc_reserve reserve)
 {
 	switch (reserve) {
 	case RESERVE_ALLOC:
 		return 0;
 	case RESERVE_BTREE:
-		return OPEN_BUCKETS_COUNT / 4;
+		return c->open_buckets_nr / 4;
 	default:
-		return OPEN_BUCKETS_COUNT / 2;
+		return c->open_buckets_nr / 2;
 	}
 }
 
@@ -247,7 +253,7 @@ struct open_bucket *bch2_bucket_alloc(struct bch_fs *c, struct bch_dev *ca,
 		}
 	}
 
-	if (unlikely(c->open_buckets_nr_free <= open_buckets_reserved(reserve))) {
+	if (unlikely(c->open_buckets_nr_free <= open_buckets_reserved(c, reserve))) {
 		if (cl)
 			closure_wait(&c->open_buckets_wait, cl);
 
@@ -358,6 +364,19 @@ struct dev_alloc_list bch2_dev_alloc_list(struct bch_fs *c,
 	return ret;
 }
 
+/* Like bch2_target_congested(), with the same time decay on read: */
+static unsigned dev_congested(struct bch_dev *ca)
+{
+	s64 congested = atomic_read(&ca->congested);
+	u64 last = READ_ONCE(ca->congested_last);
+	u64 now = local_clock();
+
+	if (time_after64(now, last))
+		congested -= (now - last) >> 12;
+
+	return clamp_t(s64, congested, 0, CONGESTED_MAX);
+}
+
 void bch2_dev_stripe_increment(struct bch_dev *ca,
 			       struct dev_stripe_state *stripe)
 {
@@ -368,6 +387,15 @@ void bch2_dev_stripe_increment(struct bch_dev *ca,
 		: 1ULL << 48;
 	u64 scale = *v / 4;
 
+	/*
+	 * A device whose completions are coming back far slower than its own
+	 * typical latency (see bch2_congested_acct()) gets its allocation
+	 * cost scaled up, to at most 4x, so striped writes drift away from a
+	 * slow device instead of every stripe queueing behind it:
+	 */
+	free_space_inv +=
+		free_space_inv * 3 * dev_congested(ca) / CONGESTED_MAX;
+
 	if (*v + free_space_inv >= *v)
 		*v += free_space_inv;
 	else
@@ -567,7 +595,15 @@ open_bucket_add_buckets(struct bch_fs *c,
 	unsigned i;
 
 	rcu_read_lock();
-	devs = target_rw_devs(c, wp->type, target);
+	if (wp->devs_cache_target != target ||
+	    wp->devs_cache_gen != READ_ONCE(c->dev_alloc_gen)) {
+		unsigned gen = READ_ONCE(c->dev_alloc_gen);
+
+		wp->devs_cache		= target_rw_devs(c, wp->type, target);
+		wp->devs_cache_target	= target;
+		wp->devs_cache_gen	= gen;
+	}
+	devs = wp->devs_cache;
 	rcu_read_unlock();
 
 	/* Don't allocate from devices we already have pointers to: */
@@ -954,21 +990,61 @@ static inline void writepoint_init(struct write_point *wp,
 {
 	mutex_init(&wp->lock);
 	wp->type = type;
+	/* force the first allocation to resolve its target: */
+	wp->devs_cache_gen = UINT_MAX;
 }
 
-void bch2_fs_allocator_foreground_init(struct bch_fs *c)
+void bch2_fs_allocator_foreground_init_early(struct bch_fs *c)
 {
-	struct open_bucket *ob;
 	struct write_point *wp;
 
 	mutex_init(&c->write_points_hash_lock);
 	c->write_points_nr = ARRAY_SIZE(c->write_points);
 
+	writepoint_init(&c->btree_write_point,		BCH_DATA_btree);
+	writepoint_init(&c->rebalance_write_point,	BCH_DATA_user);
+	writepoint_init(&c->copygc_write_point,		BCH_DATA_user);
+
+	for (wp = c->write_points;
+	     wp < c->write_points + c->write_points_nr; wp++) {
+		writepoint_init(wp, BCH_DATA_user);
+
+		wp->last_used	= sched_clock();
+		wp->write_point	= (unsigned long) wp;
+		hlist_add_head_rcu(&wp->node,
+				   writepoint_hash(c, wp->write_point));
+	}
+
+	INIT_LIST_HEAD(&c->thread_write_points);
+	mutex_init(&c->thread_write_points_lock);
+}
+
+int bch2_fs_allocator_foreground_init(struct bch_fs *c)
+{
+	struct open_bucket *ob;
+
+	/*
+	 * Scale the open bucket pool with the size of the filesystem: every
+	 * device adds more buckets that can legitimately be held open at once,
+	 * and every write point can pin a replication's worth of open buckets.
+	 * Sized at mount from the superblock's device count; devices added
+	 * later don't grow the pool, the clamps keep that from mattering much:
+	 */
+	c->open_buckets_nr =
+		clamp_t(unsigned, (unsigned) c->sb.nr_devices *
+			WRITE_POINT_MAX * BCH_REPLICAS_MAX,
+			OPEN_BUCKETS_COUNT_MIN, OPEN_BUCKETS_COUNT_MAX);
+
+	c->open_buckets = kcalloc(c->open_buckets_nr,
+				  sizeof(struct open_bucket), GFP_KERNEL);
+	if (!c->open_buckets)
+		return -ENOMEM;
+
 	/* open bucket 0 is a sentinal NULL: */
 	spin_lock_init(&c->open_buckets[0].lock);
 
 	for (ob = c->open_buckets + 1;
-	     ob < c->open_buckets + ARRAY_SIZE(c->open_buckets); ob++) {
+	     ob < c->open_buckets + c->open_buckets_nr; ob++) {
 		spin_lock_init(&ob->lock);
 		c->open_buckets_nr_free++;
 
@@ -976,17 +1052,54 @@ void bch2_fs_allocator_foreground_init(struct bch_fs *c)
 		c->open_buckets_freelist = ob - c->open_buckets;
 	}
 
-	writepoint_init(&c->btree_write_point,		BCH_DATA_btree);
-	writepoint_init(&c->rebalance_write_point,	BCH_DATA_user);
-	writepoint_init(&c->copygc_write_point,		BCH_DATA_user);
+	return 0;
+}
+
+#ifndef __KERNEL__
+/*
+ * Private per-thread default write point: untargeted streaming writers (the
+ * fuse io threads, mainly) each get their own append cursor, so they never
+ * contend on the shared write point table - no hash collisions, no LRU
+ * stealing, no lock ping-pong between threads.
+ *
+ * The write point lives until filesystem shutdown; the registry list exists
+ * so device removal and shutdown can close it like any other write point.
+ * (This assumes one bch_fs per process, which holds for the tools.)
+ */
+static __thread struct write_point *thread_write_point;
+
+struct write_point_specifier bch2_writepoint_thread(struct bch_fs *c)
+{
+	struct write_point *wp = thread_write_point;
+
+	if (unlikely(!wp)) {
+		wp = kzalloc(sizeof(*wp), GFP_KERNEL);
+		if (!wp)
+			return writepoint_hashed((unsigned long) &thread_write_point);
 
-	for (wp = c->write_points;
-	     wp < c->write_points + c->write_points_nr; wp++) {
 		writepoint_init(wp, BCH_DATA_user);
 
-		wp->last_used	= sched_clock();
-		wp->write_point	= (unsigned long) wp;
-		hlist_add_head_rcu(&wp->node,
-				   writepoint_hash(c, wp->write_point));
+		mutex_lock(&c->thread_write_points_lock);
+		list_add(&wp->thread_node, &c->thread_write_points);
+		mutex_unlock(&c->thread_write_points_lock);
+
+		thread_write_point = wp;
 	}
+
+	return writepoint_ptr(wp);
+}
+#endif
+
+void bch2_fs_allocator_foreground_exit(struct bch_fs *c)
+{
+#ifndef __KERNEL__
+	struct write_point *wp;
+
+	while ((wp = list_first_entry_or_null(&c->thread_write_points,
+					struct write_point, thread_node))) {
+		list_del(&wp->thread_node);
+		kfree(wp);
+	}
+#endif
+	kfree(c->open_buckets);
 }
@@ -133,6 +133,12 @@ static inline struct write_point_specifier writepoint_ptr(struct write_point *wp
 	return (struct write_point_specifier) { .v = (unsigned long) wp };
 }
 
-void bch2_fs_allocator_foreground_init(struct bch_fs *);
+#ifndef __KERNEL__
+struct write_point_specifier bch2_writepoint_thread(struct bch_fs *);
+#endif
+
+void bch2_fs_allocator_foreground_init_early(struct bch_fs *);
+int bch2_fs_allocator_foreground_init(struct bch_fs *);
+void bch2_fs_allocator_foreground_exit(struct bch_fs *);
 
 #endif /* _BCACHEFS_ALLOC_FOREGROUND_H */
@@ -7,6 +7,7 @@
 
 #include "clock_types.h"
 #include "fifo.h"
+#include "super_types.h"
 
 struct ec_bucket_buf;
 
@@ -46,7 +47,13 @@ enum alloc_reserve {
 
 typedef FIFO(long)	alloc_fifo;
 
-#define OPEN_BUCKETS_COUNT	1024
+/*
+ * The open bucket pool is sized at runtime from the device count and write
+ * point parallelism (see bch2_fs_allocator_foreground_init()), between these
+ * bounds - the max has to fit in open_bucket_idx_t:
+ */
+#define OPEN_BUCKETS_COUNT_MIN	1024
+#define OPEN_BUCKETS_COUNT_MAX	4096
 
 #define WRITE_POINT_HASH_NR	32
 #define WRITE_POINT_MAX		32
@@ -85,6 +92,10 @@ struct dev_stripe_state {
 
 struct write_point {
 	struct hlist_node	node;
+#ifndef __KERNEL__
+	/* on c->thread_write_points, for per-thread write points: */
+	struct list_head	thread_node;
+#endif
 	struct mutex		lock;
 	u64			last_used;
 	unsigned long		write_point;
@@ -96,6 +107,15 @@ struct write_point {
 
 	struct open_buckets	ptrs;
 	struct dev_stripe_state	stripe;
+
+	/*
+	 * Resolved target -> device mask, valid while devs_cache_gen matches
+	 * c->dev_alloc_gen - saves re-resolving the target on every
+	 * allocation (protected by wp->lock, like the rest):
+	 */
+	struct bch_devs_mask	devs_cache;
+	u16			devs_cache_target;
+	unsigned		devs_cache_gen;
 };
 
 struct write_point_specifier {
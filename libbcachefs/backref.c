@@ -0,0 +1,203 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Back references: bucket -> data hints
+ *
+ * Copygc and device evacuation find the data living in a bucket by scanning
+ * the entire extents btree and checking every pointer; on a large filesystem
+ * evacuating one small device means reading metadata for all of them.
+ *
+ * When BCH_FEATURE_backrefs is set, every extent insert also inserts a
+ * KEY_TYPE_backref key into BTREE_ID_BACKREFS, keyed by device:sector of each
+ * (non cached) pointer, recording which btree and inode own data there.
+ * Evacuation then only scans the extents of inodes that actually have data on
+ * the device being evacuated.
+ *
+ * Back references are hints, not authoritative: they're only inserted, never
+ * updated or deleted when extents are overwritten, partially overwritten or
+ * dropped, so consumers must verify them against the extents btree - moving
+ * data never trusts a backref alone. Stale backrefs cost extra reads during
+ * evacuation; they are overwritten when a bucket is reused and dropped en
+ * masse when a device is removed. Because of this insert-only discipline
+ * they're only trustworthy for finding _all_ data on a device if they've been
+ * maintained since the filesystem was created, hence the feature bit is only
+ * set by bch2_fs_initialize(), never on upgrade.
+ */
+
+#include "bcachefs.h"
+#include "backref.h"
+#include "bkey_methods.h"
+#include "btree_cache.h"
+#include "btree_update.h"
+#include "extents.h"
+
+#include <linux/sort.h>
+
+const char *bch2_backref_invalid(const struct bch_fs *c, struct bkey_s_c k)
+{
+	struct bkey_s_c_backref b = bkey_s_c_to_backref(k);
+
+	if (bkey_val_bytes(k.k) != sizeof(struct bch_backref))
+		return "incorrect value size";
+
+	if (b.v->btree_id >= BTREE_ID_NR)
+		return "invalid btree id";
+
+	return NULL;
+}
+
+void bch2_backref_to_text(struct printbuf *out, struct bch_fs *c,
+			  struct bkey_s_c k)
+{
+	struct bkey_s_c_backref b = bkey_s_c_to_backref(k);
+
+	pr_buf(out, "btree %s inum %llu",
+	       bch2_btree_ids[b.v->btree_id],
+	       le64_to_cpu(b.v->inum));
+}
+
+/*
+ * Insert/overwrite a backref for each non cached pointer of @k: called from
+ * the transactional mark path, so the backref updates are journalled
+ * atomically with the extent update itself.
+ */
+int bch2_trans_mark_backrefs(struct btree_trans *trans, struct bkey_s_c k,
+			     enum btree_id btree_id, unsigned flags)
+{
+	struct bch_fs *c = trans->c;
+	struct bkey_ptrs_c ptrs;
+	const struct bch_extent_ptr *ptr;
+	int ret = 0;
+
+	if (!bch2_backrefs_enabled(c) ||
+	    !(flags & BTREE_TRIGGER_INSERT))
+		return 0;
+
+	ptrs = bch2_bkey_ptrs_c(k);
+
+	bkey_for_each_ptr(ptrs, ptr) {
+		struct btree_iter *iter;
+		struct bkey_i_backref *b;
+
+		if (ptr->cached)
+			continue;
+
+		iter = bch2_trans_get_iter(trans, BTREE_ID_BACKREFS,
+					   POS(ptr->dev, ptr->offset),
+					   BTREE_ITER_INTENT);
+		if (IS_ERR(iter))
+			return PTR_ERR(iter);
+
+		ret = bch2_btree_iter_traverse(iter);
+		if (ret) {
+			bch2_trans_iter_put(trans, iter);
+			return ret;
+		}
+
+		b = bch2_trans_kmalloc(trans, sizeof(*b));
+		ret = PTR_ERR_OR_ZERO(b);
+		if (ret) {
+			bch2_trans_iter_put(trans, iter);
+			return ret;
+		}
+
+		bkey_backref_init(&b->k_i);
+		b->k.p		= POS(ptr->dev, ptr->offset);
+		b->v.btree_id	= btree_id;
+		b->v.inum	= cpu_to_le64(k.k->p.inode);
+
+		bch2_trans_update(trans, iter, &b->k_i, 0);
+		bch2_trans_iter_put(trans, iter);
+	}
+
+	return 0;
+}
+
+static int backref_target_cmp(const void *_l, const void *_r)
+{
+	const struct backref_target *l = _l;
+	const struct backref_target *r = _r;
+
+	return cmp_int(l->btree_id, r->btree_id) ?:
+		cmp_int(l->inum, r->inum);
+}
+
+/*
+ * Collect the distinct (btree, inode) pairs with data on @dev, per the
+ * backrefs btree: the caller is responsible for kvfree()ing @targets.
+ */
+int bch2_backref_dev_targets(struct bch_fs *c, unsigned dev,
+			     struct backref_target **targets, size_t *nr)
+{
+	struct btree_trans trans;
+	struct btree_iter *iter;
+	struct bkey_s_c k;
+	struct backref_target *d = NULL, *new;
+	size_t nr_targets = 0, size = 0, src, dst;
+	int ret = 0;
+
+	*targets = NULL;
+	*nr = 0;
+
+	bch2_trans_init(&trans, c, 0, 0);
+
+	for_each_btree_key(&trans, iter, BTREE_ID_BACKREFS,
+			   POS(dev, 0), 0, k, ret) {
+		struct bkey_s_c_backref b;
+
+		if (k.k->p.inode != dev)
+			break;
+
+		if (k.k->type != KEY_TYPE_backref)
+			continue;
+
+		b = bkey_s_c_to_backref(k);
+
+		/* backrefs for one file tend to be adjacent: */
+		if (nr_targets &&
+		    d[nr_targets - 1].btree_id == b.v->btree_id &&
+		    d[nr_targets - 1].inum == le64_to_cpu(b.v->inum))
+			continue;
+
+		if (nr_targets == size) {
+			size = max_t(size_t, 64, size * 2);
+			new = kvmalloc(size * sizeof(*d), GFP_KERNEL);
+			if (!new) {
+				ret = -ENOMEM;
+				break;
+			}
+
+			memcpy(new, d, nr_targets * sizeof(*d));
+			kvfree(d);
+			d = new;
+		}
+
+		d[nr_targets++] = (struct backref_target) {
+			.btree_id	= b.v->btree_id,
+			.inum		= le64_to_cpu(b.v->inum),
+		};
+	}
+	bch2_trans_exit(&trans);
+
+	if (ret) {
+		kvfree(d);
+		return ret;
+	}
+
+	sort(d, nr_targets, sizeof(*d), backref_target_cmp, NULL);
+
+	for (src = dst = 0; src < nr_targets; src++)
+		if (!dst || backref_target_cmp(&d[dst - 1], &d[src]))
+			d[dst++] = d[src];
+
+	*targets = d;
+	*nr = dst;
+	return 0;
+}
+
+int bch2_backref_drop_dev(struct bch_fs *c, unsigned dev)
+{
+	return bch2_btree_delete_range(c, BTREE_ID_BACKREFS,
+				       POS(dev, 0),
+				       POS(dev + 1, 0),
+				       NULL);
+}
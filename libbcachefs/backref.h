@@ -0,0 +1,33 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#ifndef _BCACHEFS_BACKREF_H
+#define _BCACHEFS_BACKREF_H
+
+const char *bch2_backref_invalid(const struct bch_fs *, struct bkey_s_c);
+void bch2_backref_to_text(struct printbuf *, struct bch_fs *, struct bkey_s_c);
+
+#define bch2_bkey_ops_backref (struct bkey_ops) {	\
+	.key_invalid	= bch2_backref_invalid,		\
+	.val_to_text	= bch2_backref_to_text,		\
+}
+
+/*
+ * Back references are only complete - and thus only usable for device
+ * evacuation - on filesystems that have had them from the start:
+ */
+static inline bool bch2_backrefs_enabled(struct bch_fs *c)
+{
+	return c->sb.features & (1ULL << BCH_FEATURE_backrefs);
+}
+
+struct backref_target {
+	u8			btree_id;
+	u64			inum;
+};
+
+int bch2_trans_mark_backrefs(struct btree_trans *, struct bkey_s_c,
+			     enum btree_id, unsigned);
+int bch2_backref_dev_targets(struct bch_fs *, unsigned,
+			     struct backref_target **, size_t *);
+int bch2_backref_drop_dev(struct bch_fs *, unsigned);
+
+#endif /* _BCACHEFS_BACKREF_H */
@@ -359,6 +359,7 @@ enum gc_phase {
 	GC_PHASE_BTREE_ALLOC,
 	GC_PHASE_BTREE_QUOTAS,
 	GC_PHASE_BTREE_REFLINK,
+	GC_PHASE_BTREE_BACKREFS,
 
 	GC_PHASE_PENDING_DELETE,
 	GC_PHASE_ALLOC,
@@ -374,6 +375,8 @@ struct io_count {
 	u64			sectors[2][BCH_DATA_NR];
 };
 
+#define BCH_FRAG_BINS		16
+
 struct bch_dev {
 	struct kobject		kobj;
 	struct percpu_ref	ref;
@@ -409,10 +412,24 @@ struct bch_dev {
 	 */
 	struct bucket_array __rcu *buckets[2];
 	unsigned long		*buckets_nouse;
+	/*
+	 * Hint for allocator scans: set bit means the bucket may pass
+	 * is_available_bucket(), clear bit means it definitely won't - see
+	 * bucket_maybe_free_update():
+	 */
+	unsigned long		*buckets_maybe_free;
 	struct rw_semaphore	bucket_lock;
 
 	struct bch_dev_usage __percpu *usage[2];
 
+	/*
+	 * Fragmentation index: number of partially full user data buckets,
+	 * binned by fraction of live sectors, kept current from the bucket
+	 * accounting so copygc candidate selection doesn't have to heap every
+	 * bucket on the device:
+	 */
+	atomic_t		frag_idx[BCH_FRAG_BINS];
+
 	/* Allocator: */
 	struct task_struct __rcu *alloc_thread;
 
@@ -428,7 +445,7 @@ struct bch_dev {
 	alloc_fifo		free[RESERVE_NR];
 	alloc_fifo		free_inc;
 
-	open_bucket_idx_t	open_buckets_partial[OPEN_BUCKETS_COUNT];
+	open_bucket_idx_t	open_buckets_partial[OPEN_BUCKETS_COUNT_MAX];
 	open_bucket_idx_t	open_buckets_partial_nr;
 
 	size_t			fifo_last_bucket;
@@ -632,12 +649,23 @@ struct bch_fs {
 	/* copygc needs its own workqueue for index updates.. */
 	struct workqueue_struct	*copygc_wq;
 	struct workqueue_struct	*journal_reclaim_wq;
+	/*
+	 * btree node checksum verification and sorting runs out of the read
+	 * completion path; give it its own worker pool so recovery/fsck with
+	 * many outstanding node reads can use every core:
+	 */
+	struct workqueue_struct	*btree_read_complete_wq;
 
 	/* ALLOCATION */
 	struct delayed_work	pd_controllers_update;
 	unsigned		pd_controllers_update_seconds;
 
 	struct bch_devs_mask	rw_devs[BCH_DATA_NR];
+	/*
+	 * Bumped whenever rw_devs or the disk groups change; invalidates the
+	 * resolved target masks cached in write points:
+	 */
+	unsigned		dev_alloc_gen;
 
 	u64			capacity; /* sectors */
 
@@ -663,6 +691,7 @@ struct bch_fs {
 	/* single element mempool: */
 	struct mutex		usage_scratch_lock;
 	struct bch_fs_usage	*usage_scratch;
+	struct bch_fs_usage * __percpu *usage_scratch_cache;
 
 	/*
 	 * When we invalidate buckets, we use both the priority and the amount
@@ -686,8 +715,9 @@ struct bch_fs {
 	u64			blocked_allocate_open_bucket;
 	open_bucket_idx_t	open_buckets_freelist;
 	open_bucket_idx_t	open_buckets_nr_free;
+	open_bucket_idx_t	open_buckets_nr;
 	struct closure_waitlist	open_buckets_wait;
-	struct open_bucket	open_buckets[OPEN_BUCKETS_COUNT];
+	struct open_bucket	*open_buckets;
 
 	struct write_point	btree_write_point;
 	struct write_point	rebalance_write_point;
@@ -697,6 +727,10 @@ struct bch_fs {
 	struct mutex		write_points_hash_lock;
 	unsigned		write_points_nr;
 
+	/* private per-thread write points (userspace only): */
+	struct list_head	thread_write_points;
+	struct mutex		thread_write_points_lock;
+
 	/* GARBAGE COLLECTION */
 	struct task_struct	*gc_thread;
 	atomic_t		kick_gc;
@@ -720,19 +754,41 @@ struct bch_fs {
 	 */
 	struct rw_semaphore	gc_lock;
 
+	/*
+	 * Serializes updates to the gc copies of bucket marks and usage
+	 * counters when the initial mark runs one worker per btree:
+	 */
+	struct mutex		gc_mark_lock;
+
 	/* IO PATH */
 	struct semaphore	io_in_flight;
+
+	/* Write completion batching (see bch2_write_index_batch()): */
+	spinlock_t		write_index_lock;
+	struct list_head	write_index_list;
+	bool			write_index_running;
+
 	struct bio_set		bio_read;
 	struct bio_set		bio_read_split;
 	struct bio_set		bio_write;
 	struct mutex		bio_bounce_pages_lock;
 	mempool_t		bio_bounce_pages;
 	struct rhashtable	promote_table;
+	u8			*promote_sketch;
+	atomic_t		promote_sketch_adds;
+
+	/*
+	 * Bumped on every transaction commit that updates extents or indirect
+	 * extents; invalidates per inode extent caches (see bch_cached_extent):
+	 */
+	atomic64_t		extents_version;
 
 	mempool_t		compression_bounce[2];
 	mempool_t		compress_workspace[BCH_COMPRESSION_TYPE_NR];
 	mempool_t		decompress_workspace;
 	ZSTD_parameters		zstd_params;
+	void			*zstd_dict;
+	size_t			zstd_dict_size;
 
 	struct crypto_shash	*sha256;
 	struct crypto_sync_skcipher *chacha20;
@@ -748,6 +804,7 @@ struct bch_fs {
 	/* COPYGC */
 	struct task_struct	*copygc_thread;
 	copygc_heap		copygc_heap;
+	struct copygc_pending __rcu *copygc_pending;
 	struct bch_pd_controller copygc_pd;
 	struct write_point	copygc_write_point;
 	u64			copygc_threshold;
@@ -759,6 +816,7 @@ struct bch_fs {
 	spinlock_t		ec_stripes_heap_lock;
 
 	/* ERASURE CODING */
+	struct hlist_head	ec_stripe_head_hash[EC_STRIPE_HEAD_HASH_NR];
 	struct list_head	ec_stripe_head_list;
 	struct mutex		ec_stripe_head_lock;
 
@@ -804,6 +862,17 @@ struct bch_fs {
 
 	u64			unused_inode_hint;
 
+	/*
+	 * Lease of (probably) free inode numbers, claimed a batch at a time by
+	 * the probe in bch2_inode_create() and handed out in memory, so
+	 * concurrent creates don't all probe the same inum neighborhood.
+	 * Slots are still checked at use - a stale entry just costs one
+	 * lookup:
+	 */
+	spinlock_t		inum_lease_lock;
+	u64			inum_lease_next;
+	u64			inum_lease_end;
+
 	/*
 	 * A btree node on disk could have too many bsets for an iterator to fit
 	 * on the stack - have to dynamically allocate them
@@ -832,6 +901,12 @@ struct bch_fs {
 #undef BCH_DEBUG_PARAM
 
 	struct time_stats	times[BCH_TIME_STAT_NR];
+
+	/* lock acquisition wait time, by btree node level: */
+	struct time_stats	btree_lock_contended_by_level[BTREE_MAX_DEPTH];
+
+	/* transaction restarts from deadlock avoidance, by level: */
+	atomic64_t		btree_trans_restart_by_level[BTREE_MAX_DEPTH];
 };
 
 static inline void bch2_set_ra_pages(struct bch_fs *c, unsigned ra_pages)
@@ -340,7 +340,8 @@ static inline void bkey_init(struct bkey *k)
 	x(reflink_p,		15)			\
 	x(reflink_v,		16)			\
 	x(inline_data,		17)			\
-	x(btree_ptr_v2,		18)
+	x(btree_ptr_v2,		18)			\
+	x(backref,		19)
 
 enum bch_bkey_type {
 #define x(name, nr) KEY_TYPE_##name	= nr,
@@ -354,6 +355,17 @@ struct bch_cookie {
 	__le64			cookie;
 };
 
+/*
+ * Back references: keyed by device:sector of the data they reference, the
+ * value records which btree and inode owns data there - see backref.c
+ */
+struct bch_backref {
+	struct bch_val		v;
+	__u8			btree_id;
+	__u8			pad[7];
+	__le64			inum;
+};
+
 /* Extents */
 
 /*
@@ -910,7 +922,10 @@ struct bch_sb_field {
 	x(disk_groups,	5)	\
 	x(clean,	6)	\
 	x(replicas,	7)	\
-	x(journal_seq_blacklist, 8)
+	x(journal_seq_blacklist, 8)	\
+	x(compression_dict, 9)	\
+	x(prewarm,	10)	\
+	x(dev_probe,	11)
 
 enum bch_sb_field_type {
 #define x(f, nr)	BCH_SB_FIELD_##f = nr,
@@ -1147,6 +1162,67 @@ struct bch_sb_field_journal_seq_blacklist {
 	};
 };
 
+/* BCH_SB_FIELD_compression_dict: */
+
+/*
+ * Trained zstd dictionary, used when compressing/decompressing small extents.
+ * Written once at format/migrate time and then immutable: extents on disk
+ * reference it, so changing or deleting it would make them unreadable.
+ */
+struct bch_sb_field_compression_dict {
+	struct bch_sb_field	field;
+
+	__le32			dict_size;
+	__le32			pad;
+	__u8			data[0];
+};
+
+/* BCH_SB_FIELD_prewarm: */
+
+/*
+ * Keys of the interior btree nodes that were in the btree node cache at clean
+ * shutdown, so the cache can be rewarmed at the next mount. Purely advisory:
+ * stale entries are detected and skipped when the set is read back.
+ */
+struct btree_prewarm_entry {
+	__u8			btree_id;
+	__u8			level;
+	__u8			key_u64s;
+	__u8			pad[5];
+	__u64			keys[0];
+};
+
+struct bch_sb_field_prewarm {
+	struct bch_sb_field	field;
+
+	union {
+	struct btree_prewarm_entry start[0];
+	__u64			_data[0];
+	};
+};
+
+/* BCH_SB_FIELD_dev_probe: */
+
+/*
+ * Device measurements taken by the format time probe, recorded so later
+ * tooling can check whether the bucket size picked at format time still
+ * matches the hardware. Purely informational:
+ */
+struct bch_dev_probe_entry {
+	__u8			dev;
+	__u8			pad[3];
+	__le32			seq_write_kb_per_sec;
+	__le32			rand_write_iops;	/* synced 4k writes */
+	__le32			discard_usec;		/* one 1MB discard; 0 if unsupported */
+	__le32			bucket_size;		/* sectors, as chosen at format */
+	__le32			pad2;
+};
+
+struct bch_sb_field_dev_probe {
+	struct bch_sb_field	field;
+	struct bch_dev_probe_entry entries[0];
+};
+
 /* Superblock: */
 
 /*
@@ -1297,6 +1373,7 @@ LE64_BITMASK(BCH_SB_BACKGROUND_COMPRESSION_TYPE,
 LE64_BITMASK(BCH_SB_GC_RESERVE_BYTES,	struct bch_sb, flags[2],  4, 64);
 
 LE64_BITMASK(BCH_SB_ERASURE_CODE,	struct bch_sb, flags[3],  0, 16);
+LE64_BITMASK(BCH_SB_INLINE_DATA,	struct bch_sb, flags[3], 16, 17);
 
 /*
  * Features:
@@ -1306,6 +1383,9 @@ LE64_BITMASK(BCH_SB_ERASURE_CODE,	struct bch_sb, flags[3],  0, 16);
  * inline_data:			gates KEY_TYPE_inline_data
  * new_siphash:			gates BCH_STR_HASH_SIPHASH
  * new_extent_overwrite:	gates BTREE_NODE_NEW_EXTENT_OVERWRITE
+ * zstd_dict:			gates BCH_SB_FIELD_compression_dict
+ * journal_compression:		gates BCH_JSET_ENTRY_compressed
+ * backrefs:			gates KEY_TYPE_backref, BTREE_ID_BACKREFS
  */
 #define BCH_SB_FEATURES()			\
 	x(lz4,				0)	\
@@ -1321,7 +1401,10 @@ LE64_BITMASK(BCH_SB_ERASURE_CODE,	struct bch_sb, flags[3],  0, 16);
 	x(incompressible,		10)	\
 	x(btree_ptr_v2,			11)	\
 	x(extents_above_btree_updates,	12)	\
-	x(btree_updates_journalled,	13)
+	x(btree_updates_journalled,	13)	\
+	x(zstd_dict,			14)	\
+	x(journal_compression,		15)	\
+	x(backrefs,			16)
 
 #define BCH_SB_FEATURES_ALL				\
 	((1ULL << BCH_FEATURE_new_siphash)|		\
@@ -1478,7 +1561,8 @@ static inline __u64 __bset_magic(struct bch_sb *sb)
 	x(blacklist,		3)		\
 	x(blacklist_v2,		4)		\
 	x(usage,		5)		\
-	x(data_usage,		6)
+	x(data_usage,		6)		\
+	x(compressed,		7)
 
 enum {
 #define x(f, nr)	BCH_JSET_ENTRY_##f	= nr,
@@ -1526,6 +1610,20 @@ struct jset_entry_data_usage {
 	struct bch_replicas_entry r;
 } __attribute__((packed));
 
+/*
+ * When a journal entry is compressed the payload is replaced by a chain of
+ * these: one lz4 stream over the original payload, split into chunks because
+ * jset_entry u64s is only 16 bits. csize is the number of compressed bytes in
+ * this chunk; u64s_uncompressed is the size of the original payload, set in
+ * the first entry of the chain:
+ */
+struct jset_entry_compressed {
+	struct jset_entry	entry;
+	__le32			csize;
+	__le32			u64s_uncompressed;
+	__u8			data[0];
+};
+
 /*
  * On disk format for a journal entry:
  * seq is monotonically increasing; every journal entry has its own unique
@@ -1576,7 +1674,8 @@ LE32_BITMASK(JSET_BIG_ENDIAN,	struct jset, flags, 4, 5);
 	x(ALLOC,	4, "alloc")			\
 	x(QUOTAS,	5, "quotas")			\
 	x(EC,		6, "stripes")			\
-	x(REFLINK,	7, "reflink")
+	x(REFLINK,	7, "reflink")			\
+	x(BACKREFS,	8, "backrefs")
 
 enum btree_id {
 #define x(kwd, val, name) BTREE_ID_##kwd = val,
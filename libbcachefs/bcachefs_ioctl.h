@@ -73,6 +73,10 @@ struct bch_ioctl_incremental {
 #define BCH_IOCTL_READ_SUPER	_IOW(0xbc,	12, struct bch_ioctl_read_super)
 #define BCH_IOCTL_DISK_GET_IDX	_IOW(0xbc,	13,  struct bch_ioctl_disk_get_idx)
 #define BCH_IOCTL_DISK_RESIZE	_IOW(0xbc,	14,  struct bch_ioctl_disk_resize)
+#define BCH_IOCTL_USAGE_ALL	_IOWR(0xbc,	15, struct bch_ioctl_usage_all)
+#define BCH_IOCTL_METRICS	_IOWR(0xbc,	16, struct bch_ioctl_metrics)
+#define BCH_IOCTL_USAGE_MAP	_IOW(0xbc,	17, struct bch_ioctl_usage_map)
+#define BCH_IOCTL_DISK_RESIZE_JOURNAL _IOW(0xbc, 18,  struct bch_ioctl_disk_resize_journal)
 
 /* ioctl below act on a particular file, not the filesystem as a whole: */
 
@@ -214,6 +218,10 @@ struct bch_ioctl_data_progress {
 
 	__u64			sectors_done;
 	__u64			sectors_total;
+
+	/* sampled at whatever interval the fd is polled at, then smoothed: */
+	__u64			sectors_per_sec;
+	__u64			eta_sec;	/* ~0 if unknown */
 } __attribute__((packed, aligned(8)));
 
 struct bch_ioctl_data_event {
@@ -284,6 +292,131 @@ struct bch_ioctl_dev_usage {
 	__u64			ec_sectors;
 };
 
+/*
+ * BCH_IOCTL_USAGE_ALL: query filesystem and all device usage in one call
+ *
+ * Combines BCH_IOCTL_FS_USAGE and BCH_IOCTL_DEV_USAGE for every member
+ * device: the whole snapshot is taken in one go, so the filesystem and per
+ * device numbers are consistent with each other, and pollers make one
+ * syscall instead of one per device.
+ *
+ * @version - in: highest layout version userspace understands; out: version
+ *	      the kernel filled out. New fields are only ever appended.
+ * @nr_devices - in: number of device slots allocated in @data; out: number
+ *	      of member slots in the filesystem. Slot i is usage for member
+ *	      device i; slots for members that don't exist are zeroed.
+ * @replica_entries_bytes - as in BCH_IOCTL_FS_USAGE
+ *
+ * @data holds @nr_devices (as passed in) struct bch_ioctl_dev_usage,
+ * followed by @replica_entries_bytes of replica usage entries.
+ *
+ * Returns -ERANGE if either section of the buffer was too small
+ */
+struct bch_ioctl_usage_all {
+	__u32			version;
+	__u32			nr_devices;
+
+	__u64			capacity;
+	__u64			used;
+	__u64			online_reserved;
+	__u64			persistent_reserved[BCH_REPLICAS_MAX];
+
+	__u32			replica_entries_bytes;
+	__u32			pad;
+
+	__u8			data[0];
+};
+
+#define BCH_IOCTL_USAGE_ALL_VERSION	1
+
+/*
+ * BCH_IOCTL_METRICS: binary snapshot of the statistics otherwise scattered
+ * over sysfs, in one call
+ *
+ * @buf is filled with a sequence of 8 byte aligned TLV records, each a
+ * struct bch_metric_hdr followed by @bytes of payload; readers skip records
+ * with types they don't know. Payloads:
+ *
+ *   counter:		one __u64, @id enumerates bch_metric_counters below
+ *   time_stats:	struct bch_metric_time_stats followed by the folded
+ *			duration histogram (remaining payload bytes / 8
+ *			buckets); @id is the bch_time_stats enum
+ *   dev_time_stats:	as time_stats; @id is dev_idx << 1 | rw
+ *   dev_io_done:	__u64 sectors[2][BCH_DATA_NR]; @id is dev_idx
+ *
+ * @bytes - in: size of @buf; out: bytes used. If the buffer is too small,
+ * returns -ERANGE with @bytes set to the size required.
+ */
+struct bch_ioctl_metrics {
+	__u32			version;
+	__u32			pad;
+	__u64			bytes;
+	__u64			buf;
+};
+
+#define BCH_IOCTL_METRICS_VERSION	1
+
+enum bch_metric_types {
+	BCH_METRIC_counter		= 0,
+	BCH_METRIC_time_stats		= 1,
+	BCH_METRIC_dev_time_stats	= 2,
+	BCH_METRIC_dev_io_done		= 3,
+};
+
+enum bch_metric_counters {
+	BCH_COUNTER_read_realloc_races	= 0,
+	BCH_COUNTER_extent_migrate_done	= 1,
+	BCH_COUNTER_extent_migrate_raced = 2,
+	BCH_COUNTER_btree_cache_size	= 3,
+};
+
+struct bch_metric_hdr {
+	__u16			type;
+	__u16			pad;
+	__u32			id;
+	__u64			bytes;
+};
+
+struct bch_metric_time_stats {
+	__u64			count;
+	__u64			average_duration;
+	__u64			average_frequency;
+	__u64			max_duration;
+};
+
+/*
+ * BCH_IOCTL_USAGE_MAP: usage counters without the syscall
+ *
+ * Returns a file descriptor; mmap it (read only) to get a region the
+ * filesystem refreshes every @update_ms milliseconds for as long as the fd is
+ * open, so pollers read usage with no syscalls after setup.
+ *
+ * The region starts with struct bch_usage_map_hdr, followed by @nr_devs
+ * struct bch_ioctl_dev_usage indexed by device index (zeroed for missing
+ * devices), followed by a struct bch_ioctl_fs_usage whose replica entries
+ * (@fs_usage_bytes of them) fill the rest of the region. @seq is even when
+ * the contents are stable and odd while an update is in flight; read it
+ * before and after copying out and retry on mismatch or an odd value. If the
+ * region is too small for the replica entries the header's
+ * BCH_USAGE_MAP_TRUNCATED flag is set and the caller should fall back to
+ * BCH_IOCTL_FS_USAGE.
+ */
+struct bch_ioctl_usage_map {
+	__u32			update_ms;
+	__u32			bytes;
+};
+
+struct bch_usage_map_hdr {
+	__u64			seq;
+	__u32			version;
+	__u32			flags;
+	__u32			fs_usage_bytes;
+	__u32			nr_devs;
+};
+
+#define BCH_USAGE_MAP_VERSION		1
+#define BCH_USAGE_MAP_TRUNCATED		(1U << 0)
+
 /*
  * BCH_IOCTL_READ_SUPER: read filesystem superblock
  *
@@ -329,4 +462,20 @@ struct bch_ioctl_disk_resize {
 	__u64			nbuckets;
 };
 
+/*
+ * BCH_IOCTL_DISK_RESIZE_JOURNAL: resize journal on a device
+ *
+ * @dev		- member to resize
+ * @nbuckets	- new number of journal buckets
+ *
+ * Growing allocates fresh buckets; shrinking flushes the journal first and
+ * only ever drops clean buckets, so it may be slow but never loses entries.
+ */
+struct bch_ioctl_disk_resize_journal {
+	__u32			flags;
+	__u32			pad;
+	__u64			dev;
+	__u64			nbuckets;
+};
+
 #endif /* _BCACHEFS_IOCTL_H */
@@ -759,6 +759,11 @@ static inline int __bkey_cmp_bits(const u64 *l, const u64 *r,
 	return cmp;
 }
 
+static inline bool cpu_has_bmi(void)
+{
+	return __builtin_cpu_supports("bmi");
+}
+
 #define I(_x)			(*(out)++ = (_x))
 #define I1(i0)						I(i0)
 #define I2(i0, i1)		(I1(i0),		I(i1))
@@ -871,14 +876,32 @@ static u8 *compile_bkey_field(const struct bkey_format *format, u8 *out,
 		shl = 64 - bit_offset - bits;
 		shr = bit_offset + shl;
 
-		if (shl) {
-			/* shl rax, imm8 */
-			I4(0x48, 0xc1, 0xe0, shl);
-		}
+		if (shl && shr && cpu_has_bmi()) {
+			/*
+			 * Field in the middle of the word: bextr extracts
+			 * bits [bit_offset, bit_offset + bits) in one
+			 * instruction instead of a shl/shr pair. The control
+			 * operand has to be a register:
+			 */
+			unsigned ctrl = bit_offset | (bits << 8);
+
+			/* mov edx, imm32 */
+			I1(0xba);
+			memcpy(out, &ctrl, 4);
+			out += 4;
 
-		if (shr) {
-			/* shr rax, imm8 */
-			I4(0x48, 0xc1, 0xe8, shr);
+			/* bextr rax, rax, rdx */
+			I5(0xc4, 0xe2, 0xe8, 0xf7, 0xc0);
+		} else {
+			if (shl) {
+				/* shl rax, imm8 */
+				I4(0x48, 0xc1, 0xe0, shl);
+			}
+
+			if (shr) {
+				/* shr rax, imm8 */
+				I4(0x48, 0xc1, 0xe8, shr);
+			}
 		}
 	} else {
 		align = min(4 - DIV_ROUND_UP(bit_offset + bits, 8), byte & 3);
@@ -1036,9 +1059,23 @@ int __bch2_bkey_cmp_packed_format_checked(const struct bkey_packed *l,
 	EBUG_ON(!bkey_packed(l) || !bkey_packed(r));
 	EBUG_ON(b->nr_key_bits != bkey_format_key_bits(f));
 
-	ret = __bkey_cmp_bits(high_word(f, l),
-			      high_word(f, r),
-			      b->nr_key_bits);
+	/*
+	 * When the whole key packs into one word - the common case on
+	 * moderately sized filesystems - the comparison is a single masked
+	 * compare, no word loop:
+	 */
+	if (likely(b->nr_key_bits &&
+		   b->nr_key_bits + high_bit_offset <= 64)) {
+		unsigned shift = 64 - high_bit_offset - b->nr_key_bits;
+		u64 l_v = (*high_word(f, l) & (~0ULL >> high_bit_offset)) >> shift;
+		u64 r_v = (*high_word(f, r) & (~0ULL >> high_bit_offset)) >> shift;
+
+		ret = cmp_int(l_v, r_v);
+	} else {
+		ret = __bkey_cmp_bits(high_word(f, l),
+				      high_word(f, r),
+				      b->nr_key_bits);
+	}
 
 	EBUG_ON(ret != bkey_cmp(bkey_unpack_pos(b, l),
 				bkey_unpack_pos(b, r)));
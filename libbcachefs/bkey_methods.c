@@ -4,6 +4,7 @@
 #include "bkey_methods.h"
 #include "btree_types.h"
 #include "alloc_background.h"
+#include "backref.h"
 #include "dirent.h"
 #include "ec.h"
 #include "error.h"
@@ -86,12 +87,25 @@ static const struct bkey_ops bch2_bkey_ops[] = {
 #undef x
 };
 
+/*
+ * Validation, merging and val_to_text run once per key in the hot btree scan
+ * loops (node read, gc, fsck), where an indirect call per key costs real
+ * time; dispatch via a generated switch so the compiler emits direct calls.
+ * The ops table sticks around for the cold paths (debugcheck, swab,
+ * normalize).
+ */
+
 const char *bch2_bkey_val_invalid(struct bch_fs *c, struct bkey_s_c k)
 {
-	if (k.k->type >= KEY_TYPE_MAX)
+	switch (k.k->type) {
+#define x(name, nr)							\
+	case KEY_TYPE_##name:						\
+		return bch2_bkey_ops_##name.key_invalid(c, k);
+	BCH_BKEY_TYPES()
+#undef x
+	default:
 		return "invalid type";
-
-	return bch2_bkey_ops[k.k->type].key_invalid(c, k);
+	}
 }
 
 const char *__bch2_bkey_invalid(struct bch_fs *c, struct bkey_s_c k,
@@ -167,35 +181,52 @@ void bch2_bkey_debugcheck(struct bch_fs *c, struct btree *b, struct bkey_s_c k)
 void bch2_bpos_to_text(struct printbuf *out, struct bpos pos)
 {
 	if (!bkey_cmp(pos, POS_MIN))
-		pr_buf(out, "POS_MIN");
+		pr_string(out, "POS_MIN");
 	else if (!bkey_cmp(pos, POS_MAX))
-		pr_buf(out, "POS_MAX");
-	else
-		pr_buf(out, "%llu:%llu", pos.inode, pos.offset);
+		pr_string(out, "POS_MAX");
+	else {
+		pr_u64(out, pos.inode);
+		pr_char(out, ':');
+		pr_u64(out, pos.offset);
+	}
 }
 
 void bch2_bkey_to_text(struct printbuf *out, const struct bkey *k)
 {
 	if (k) {
-		pr_buf(out, "u64s %u type %s ", k->u64s,
-		       bch2_bkey_types[k->type]);
+		pr_string(out, "u64s ");
+		pr_u64(out, k->u64s);
+		pr_string(out, " type ");
+		pr_string(out, bch2_bkey_types[k->type]);
+		pr_char(out, ' ');
 
 		bch2_bpos_to_text(out, k->p);
 
-		pr_buf(out, " snap %u len %u ver %llu",
-		       k->p.snapshot, k->size, k->version.lo);
+		pr_string(out, " snap ");
+		pr_u64(out, k->p.snapshot);
+		pr_string(out, " len ");
+		pr_u64(out, k->size);
+		pr_string(out, " ver ");
+		pr_u64(out, k->version.lo);
 	} else {
-		pr_buf(out, "(null)");
+		pr_string(out, "(null)");
 	}
 }
 
 void bch2_val_to_text(struct printbuf *out, struct bch_fs *c,
 		      struct bkey_s_c k)
 {
-	const struct bkey_ops *ops = &bch2_bkey_ops[k.k->type];
-
-	if (likely(ops->val_to_text))
-		ops->val_to_text(out, c, k);
+	switch (k.k->type) {
+#define x(name, nr)							\
+	case KEY_TYPE_##name:						\
+		if (bch2_bkey_ops_##name.val_to_text)			\
+			bch2_bkey_ops_##name.val_to_text(out, c, k);	\
+		break;
+	BCH_BKEY_TYPES()
+#undef x
+	default:
+		break;
+	}
 }
 
 void bch2_bkey_val_to_text(struct printbuf *out, struct bch_fs *c,
@@ -229,17 +260,26 @@ bool bch2_bkey_normalize(struct bch_fs *c, struct bkey_s k)
 enum merge_result bch2_bkey_merge(struct bch_fs *c,
 				  struct bkey_s l, struct bkey_s r)
 {
-	const struct bkey_ops *ops = &bch2_bkey_ops[l.k->type];
 	enum merge_result ret;
 
 	if (key_merging_disabled(c) ||
-	    !ops->key_merge ||
 	    l.k->type != r.k->type ||
 	    bversion_cmp(l.k->version, r.k->version) ||
 	    bkey_cmp(l.k->p, bkey_start_pos(r.k)))
 		return BCH_MERGE_NOMERGE;
 
-	ret = ops->key_merge(c, l, r);
+	switch (l.k->type) {
+#define x(name, nr)							\
+	case KEY_TYPE_##name:						\
+		if (!bch2_bkey_ops_##name.key_merge)			\
+			return BCH_MERGE_NOMERGE;			\
+		ret = bch2_bkey_ops_##name.key_merge(c, l, r);		\
+		break;
+	BCH_BKEY_TYPES()
+#undef x
+	default:
+		return BCH_MERGE_NOMERGE;
+	}
 
 	if (ret != BCH_MERGE_NOMERGE)
 		l.k->needs_whiteout |= r.k->needs_whiteout;
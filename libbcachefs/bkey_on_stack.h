@@ -9,6 +9,15 @@ struct bkey_on_stack {
 	u64		onstack[12];
 };
 
+/* Ensure capacity for @u64s; existing contents are not preserved: */
+static inline void bkey_on_stack_alloc(struct bkey_on_stack *s,
+				       struct bch_fs *c, unsigned u64s)
+{
+	if (s->k == (void *) s->onstack &&
+	    u64s > ARRAY_SIZE(s->onstack))
+		s->k = mempool_alloc(&c->large_bkey_pool, GFP_NOFS);
+}
+
 static inline void bkey_on_stack_realloc(struct bkey_on_stack *s,
 					 struct bch_fs *c, unsigned u64s)
 {
@@ -23,7 +32,8 @@ static inline void bkey_on_stack_reassemble(struct bkey_on_stack *s,
 					    struct bch_fs *c,
 					    struct bkey_s_c k)
 {
-	bkey_on_stack_realloc(s, c, k.k->u64s);
+	/* we're about to overwrite the buffer - no need to preserve it: */
+	bkey_on_stack_alloc(s, c, k.k->u64s);
 	bkey_reassemble(s->k, k);
 }
 
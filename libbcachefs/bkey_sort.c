@@ -79,6 +79,101 @@ static inline struct bkey_packed *sort_iter_next(struct sort_iter *iter,
 	return ret;
 }
 
+/*
+ * Loser tree for the mergesorts in bch2_sort_keys()/bch2_sort_extents():
+ * those always merge at most MAX_BSETS + 1 sets, so we can play a fixed four
+ * way tournament. Each internal node caches the loser of the match played
+ * there; advancing the merge then only replays the matches on the path from
+ * the advanced leaf to the root - two comparisons per key emitted, instead of
+ * re-sifting the head against every other iterator.
+ *
+ * Unlike the sift, exhausted leaves aren't removed from data[] - they just
+ * compare as greater than everything.
+ */
+struct sort_iter_lt {
+	struct sort_iter	*iter;
+
+	/*
+	 * node[0] is the overall winner; node[1] the loser of the final,
+	 * node[2] the loser of leaves 0v1, node[3] the loser of leaves 2v3:
+	 */
+	u8			node[MAX_BSETS + 1];
+};
+
+static inline struct bkey_packed *lt_leaf_key(struct sort_iter_lt *lt,
+					      unsigned l)
+{
+	struct sort_iter_set *i = lt->iter->data + l;
+
+	return l < lt->iter->used && i->k != i->end ? i->k : NULL;
+}
+
+static inline unsigned lt_winner(struct sort_iter_lt *lt, sort_cmp_fn cmp,
+				 unsigned a, unsigned b)
+{
+	struct bkey_packed *ak = lt_leaf_key(lt, a);
+	struct bkey_packed *bk = lt_leaf_key(lt, b);
+
+	if (!ak || !bk)
+		return ak ? a : b;
+
+	/* ties go to the lower index, matching the stable insertion sort: */
+	return (cmp(lt->iter->b, ak, bk) ?: cmp_int(a, b)) < 0 ? a : b;
+}
+
+static void sort_iter_lt_init(struct sort_iter_lt *lt, struct sort_iter *iter,
+			      sort_cmp_fn cmp)
+{
+	unsigned w01, w23;
+
+	BUG_ON(iter->used > ARRAY_SIZE(lt->node));
+
+	lt->iter = iter;
+
+	w01 = lt_winner(lt, cmp, 0, 1);
+	w23 = lt_winner(lt, cmp, 2, 3);
+
+	lt->node[2] = w01 ^ 1;
+	lt->node[3] = w23 ^ 1;
+	lt->node[0] = lt_winner(lt, cmp, w01, w23);
+	lt->node[1] = lt->node[0] == w01 ? w23 : w01;
+}
+
+static inline struct bkey_packed *sort_iter_lt_peek(struct sort_iter_lt *lt)
+{
+	return lt_leaf_key(lt, lt->node[0]);
+}
+
+static void sort_iter_lt_advance(struct sort_iter_lt *lt, sort_cmp_fn cmp)
+{
+	unsigned w = lt->node[0], n;
+	struct sort_iter_set *i = lt->iter->data + w;
+
+	i->k = bkey_next_skip_noops(i->k, i->end);
+
+	BUG_ON(i->k > i->end);
+
+	for (n = 2 + (w >> 1); n; n >>= 1) {
+		unsigned v = lt_winner(lt, cmp, w, lt->node[n]);
+
+		lt->node[n] = v == w ? lt->node[n] : w;
+		w = v;
+	}
+
+	lt->node[0] = w;
+}
+
+static inline struct bkey_packed *sort_iter_lt_next(struct sort_iter_lt *lt,
+						    sort_cmp_fn cmp)
+{
+	struct bkey_packed *ret = sort_iter_lt_peek(lt);
+
+	if (ret)
+		sort_iter_lt_advance(lt, cmp);
+
+	return ret;
+}
+
 /*
  * If keys compare equal, compare by pointer order:
  */
@@ -228,28 +323,83 @@ static inline int sort_keys_cmp(struct btree *b,
 		(int) l->needs_whiteout - (int) r->needs_whiteout;
 }
 
+/*
+ * Fast path for sorting a single bset: keys within one bset are unique
+ * (inserts overwrite in place), so the duplicate merging below can never
+ * trigger and runs of consecutive keys we're keeping can be copied with a
+ * single memcpy_u64s() instead of key by key:
+ */
+static unsigned sort_keys_one(struct bkey_packed *dst,
+			      struct btree *b,
+			      struct bkey_packed *in,
+			      struct bkey_packed *end,
+			      bool filter_whiteouts)
+{
+	const struct bkey_format *f = &b->format;
+	struct bkey_packed *next, *out = dst;
+
+	while (in != end) {
+		next = bkey_next_skip_noops(in, end);
+
+		if (!bkey_whiteout(in)) {
+			struct bkey_packed *run = in;
+
+			/*
+			 * Batch up a run of keys copied verbatim - ending at
+			 * a whiteout, or at noop padding we're dropping:
+			 */
+			while (next != end &&
+			       next == bkey_next(in) &&
+			       !bkey_whiteout(next)) {
+				in = next;
+				next = bkey_next_skip_noops(in, end);
+			}
+
+			memcpy_u64s(out, run,
+				    (u64 *) bkey_next(in) - (u64 *) run);
+			out = (void *) out +
+				((void *) bkey_next(in) - (void *) run);
+		} else if (!filter_whiteouts && in->needs_whiteout) {
+			memcpy_u64s(out, in, bkeyp_key_u64s(f, in));
+			set_bkeyp_val_u64s(f, out, 0);
+			out = bkey_next(out);
+		}
+
+		in = next;
+	}
+
+	return (u64 *) out - (u64 *) dst;
+}
+
 unsigned bch2_sort_keys(struct bkey_packed *dst,
 			struct sort_iter *iter,
 			bool filter_whiteouts)
 {
 	const struct bkey_format *f = &iter->b->format;
 	struct bkey_packed *in, *next, *out = dst;
+	struct sort_iter_lt lt;
+
+	if (iter->used == 1)
+		return sort_keys_one(dst, iter->b,
+				     iter->data[0].k,
+				     iter->data[0].end,
+				     filter_whiteouts);
 
-	sort_iter_sort(iter, sort_keys_cmp);
+	sort_iter_lt_init(&lt, iter, sort_keys_cmp);
 
-	while ((in = sort_iter_next(iter, sort_keys_cmp))) {
+	while ((in = sort_iter_lt_next(&lt, sort_keys_cmp))) {
 		bool needs_whiteout = false;
 
 		if (bkey_whiteout(in) &&
 		    (filter_whiteouts || !in->needs_whiteout))
 			continue;
 
-		while ((next = sort_iter_peek(iter)) &&
+		while ((next = sort_iter_lt_peek(&lt)) &&
 		       !bkey_cmp_packed(iter->b, in, next)) {
 			BUG_ON(in->needs_whiteout &&
 			       next->needs_whiteout);
 			needs_whiteout |= in->needs_whiteout;
-			in = sort_iter_next(iter, sort_keys_cmp);
+			in = sort_iter_lt_next(&lt, sort_keys_cmp);
 		}
 
 		if (bkey_whiteout(in)) {
@@ -415,10 +565,11 @@ unsigned bch2_sort_extents(struct bkey_packed *dst,
 			   bool filter_whiteouts)
 {
 	struct bkey_packed *in, *out = dst;
+	struct sort_iter_lt lt;
 
-	sort_iter_sort(iter, sort_extents_cmp);
+	sort_iter_lt_init(&lt, iter, sort_extents_cmp);
 
-	while ((in = sort_iter_next(iter, sort_extents_cmp))) {
+	while ((in = sort_iter_lt_next(&lt, sort_extents_cmp))) {
 		if (bkey_deleted(in))
 			continue;
 
@@ -5,7 +5,10 @@
 #include "btree_io.h"
 #include "btree_iter.h"
 #include "btree_locking.h"
+#include "btree_update_interior.h"
+#include "compress.h"
 #include "debug.h"
+#include "extents.h"
 
 #include <linux/prefetch.h>
 #include <linux/sched/mm.h>
@@ -146,20 +149,41 @@ int __bch2_btree_node_hash_insert(struct btree_cache *bc, struct btree *b)
 int bch2_btree_node_hash_insert(struct btree_cache *bc, struct btree *b,
 				unsigned level, enum btree_id id)
 {
+	struct btree_cache_shard *s;
 	int ret;
 
 	b->c.level	= level;
 	b->c.btree_id	= id;
 
-	mutex_lock(&bc->lock);
 	ret = __bch2_btree_node_hash_insert(bc, b);
-	if (!ret)
-		list_add(&b->list, &bc->live);
-	mutex_unlock(&bc->lock);
+	if (!ret) {
+		b->cache_shard = b->hash_val & (BTREE_CACHE_SHARD_NR - 1);
+		s = &bc->shard[b->cache_shard];
+
+		mutex_lock(&s->lock);
+		list_add(&b->list, &s->live);
+		mutex_unlock(&s->lock);
+	}
 
 	return ret;
 }
 
+/*
+ * Move a node that's on its shard's live list back to the freeable list, for
+ * when a node is freed or failed to read:
+ */
+void bch2_btree_node_to_freeable(struct bch_fs *c, struct btree *b)
+{
+	struct btree_cache *bc = &c->btree_cache;
+	struct btree_cache_shard *s = &bc->shard[b->cache_shard];
+
+	mutex_lock(&s->lock);
+	mutex_lock(&bc->lock);
+	list_move(&b->list, &bc->freeable);
+	mutex_unlock(&bc->lock);
+	mutex_unlock(&s->lock);
+}
+
 __flatten
 static inline struct btree *btree_cache_find(struct btree_cache *bc,
 				     const struct bkey_i *k)
@@ -169,16 +193,221 @@ static inline struct btree *btree_cache_find(struct btree_cache *bc,
 	return rhashtable_lookup_fast(&bc->table, &v, bch_btree_cache_params);
 }
 
+/*
+ * Compressed second tier cache:
+ *
+ * When the shrinker evicts a clean node, we lz4 compress its contents into a
+ * size bounded pool instead of just freeing them, and btree node reads check
+ * the pool before going to disk - so the cacheable metadata working set can be
+ * quite a bit bigger than what fits in RAM uncompressed.
+ *
+ * Entries are keyed by the node's hash_val, which for btree_ptr_v2 keys is the
+ * node's randomly generated sequence number: a stale entry (the node was freed
+ * and its bucket reused) is caught on lookup by checking the decompressed
+ * image's embedded sequence number against the key, so we never have to
+ * invalidate explicitly - stale entries just age out of the lru.
+ */
+
+#define BTREE_CACHE_COMPRESSED_MAX_DEFAULT	(64U << 20)
+
+struct compressed_btree_node {
+	struct rhash_head	hash;
+	u64			hash_val;
+	struct list_head	list;
+
+	/* in memory state, so restoring doesn't have to revalidate: */
+	u16			written;
+	u8			nsets;
+	struct btree_nr_keys	nr;
+	struct bset_tree	set[MAX_BSETS];
+
+	/* uncompressed image size: */
+	unsigned		bytes;
+	unsigned		compressed_bytes;
+	u8			data[];
+};
+
+static const struct rhashtable_params bch_compressed_node_params = {
+	.head_offset	= offsetof(struct compressed_btree_node, hash),
+	.key_offset	= offsetof(struct compressed_btree_node, hash_val),
+	.key_len	= sizeof(u64),
+};
+
+static void compressed_node_del(struct btree_cache *bc,
+				struct compressed_btree_node *cn)
+{
+	rhashtable_remove_fast(&bc->compressed_table, &cn->hash,
+			       bch_compressed_node_params);
+	list_del(&cn->list);
+	bc->compressed_bytes -= sizeof(*cn) + cn->compressed_bytes;
+}
+
+static void compressed_node_free(struct btree_cache *bc,
+				 struct compressed_btree_node *cn)
+{
+	compressed_node_del(bc, cn);
+	kvpfree(cn, sizeof(*cn) + cn->compressed_bytes);
+}
+
+static void bch2_btree_node_stash_compressed(struct bch_fs *c, struct btree *b)
+{
+	struct btree_cache *bc = &c->btree_cache;
+	struct compressed_btree_node *cn, *old;
+	size_t bytes = (void *) btree_bkey_last(b, bset_tree_last(b)) -
+		(void *) b->data;
+	void *buf;
+	int clen;
+
+	if (!bc->compressed_bytes_max)
+		return;
+
+	/* restoring depends on checking the node's sequence number: */
+	if (b->key.k.type != KEY_TYPE_btree_ptr_v2)
+		return;
+
+	/*
+	 * Restoring doesn't rerun the read path fixups, so only stash nodes
+	 * that don't need any:
+	 */
+	if (b->whiteout_u64s ||
+	    btree_node_need_rewrite(b) ||
+	    btree_node_old_extent_overwrite(b) ||
+	    btree_node_read_error(b))
+		return;
+
+	buf = kvpmalloc(bytes, GFP_NOFS|__GFP_NOWARN);
+	if (!buf)
+		return;
+
+	clen = bch2_lz4_compress(c, buf, bytes, b->data, bytes);
+	if (!clen) {
+		/* incompressible - not worth caching: */
+		kvpfree(buf, bytes);
+		return;
+	}
+
+	cn = kvpmalloc(sizeof(*cn) + clen, GFP_NOFS|__GFP_NOWARN);
+	if (!cn) {
+		kvpfree(buf, bytes);
+		return;
+	}
+
+	cn->hash_val		= b->hash_val;
+	cn->written		= b->written;
+	cn->nsets		= b->nsets;
+	cn->nr			= b->nr;
+	memcpy(cn->set, b->set, sizeof(cn->set));
+	cn->bytes		= bytes;
+	cn->compressed_bytes	= clen;
+	memcpy(cn->data, buf, clen);
+
+	kvpfree(buf, bytes);
+
+	mutex_lock(&bc->compressed_lock);
+
+	old = rhashtable_lookup_fast(&bc->compressed_table, &cn->hash_val,
+				     bch_compressed_node_params);
+	if (old)
+		compressed_node_free(bc, old);
+
+	if (rhashtable_lookup_insert_fast(&bc->compressed_table, &cn->hash,
+					  bch_compressed_node_params)) {
+		kvpfree(cn, sizeof(*cn) + clen);
+	} else {
+		list_add(&cn->list, &bc->compressed_lru);
+		bc->compressed_bytes += sizeof(*cn) + clen;
+
+		while (bc->compressed_bytes > bc->compressed_bytes_max)
+			compressed_node_free(bc,
+				list_last_entry(&bc->compressed_lru,
+					struct compressed_btree_node, list));
+	}
+
+	mutex_unlock(&bc->compressed_lock);
+}
+
+/*
+ * Try to fill in @b - a freshly allocated, hashed node that's about to be read
+ * - from the compressed cache, instead of reading from disk. Returns true on
+ * success; the entry is consumed either way.
+ */
+bool bch2_btree_node_read_compressed(struct bch_fs *c, struct btree *b)
+{
+	struct btree_cache *bc = &c->btree_cache;
+	struct compressed_btree_node *cn;
+	u64 v = btree_ptr_hash_val(&b->key);
+	struct bch_extent_ptr *ptr;
+	bool ret = false;
+
+	if (b->key.k.type != KEY_TYPE_btree_ptr_v2 ||
+	    !bc->compressed_table_init_done)
+		return false;
+
+	mutex_lock(&bc->compressed_lock);
+
+	cn = rhashtable_lookup_fast(&bc->compressed_table, &v,
+				    bch_compressed_node_params);
+	if (!cn)
+		goto out;
+
+	/* the node's either live again or stale - dequeue it either way: */
+	compressed_node_del(bc, cn);
+
+	if (bch2_lz4_decompress(c, b->data, cn->bytes,
+				cn->data, cn->compressed_bytes))
+		goto out_free;
+
+	/* guard against a stale entry, if the node was freed and reused: */
+	if (le64_to_cpu(b->data->magic) != bset_magic(c) ||
+	    b->data->keys.seq != bkey_i_to_btree_ptr_v2(&b->key)->v.seq)
+		goto out_free;
+
+	b->written	= cn->written;
+	b->nsets	= cn->nsets;
+	b->nr		= cn->nr;
+	memcpy(b->set, cn->set, sizeof(b->set));
+
+	/* also resets the aux trees, which we then rebuild: */
+	btree_node_set_format(b, b->data->format);
+	bch2_btree_build_aux_trees(b);
+	btree_node_reset_sib_u64s(b);
+
+	/* device states may have changed while the node was stashed: */
+	bkey_for_each_ptr(bch2_bkey_ptrs(bkey_i_to_s(&b->key)), ptr) {
+		struct bch_dev *ca = bch_dev_bkey_exists(c, ptr->dev);
+
+		if (ca->mi.state != BCH_MEMBER_STATE_RW)
+			set_btree_node_need_rewrite(b);
+	}
+
+	ret = true;
+out_free:
+	kvpfree(cn, sizeof(*cn) + cn->compressed_bytes);
+out:
+	mutex_unlock(&bc->compressed_lock);
+	return ret;
+}
+
+size_t bch2_btree_cache_compressed_size(struct btree_cache *bc)
+{
+	size_t ret;
+
+	mutex_lock(&bc->compressed_lock);
+	ret = bc->compressed_bytes;
+	mutex_unlock(&bc->compressed_lock);
+
+	return ret;
+}
+
 /*
  * this version is for btree nodes that have already been freed (we're not
  * reaping a real btree node)
  */
 static int __btree_node_reclaim(struct bch_fs *c, struct btree *b, bool flush)
 {
-	struct btree_cache *bc = &c->btree_cache;
 	int ret = 0;
 
-	lockdep_assert_held(&bc->lock);
+	/* caller holds the lock protecting whichever list b is on */
 
 	if (!six_trylock_intent(&b->c.lock))
 		return -ENOMEM;
@@ -236,11 +465,6 @@ static int btree_node_reclaim(struct bch_fs *c, struct btree *b)
 	return __btree_node_reclaim(c, b, false);
 }
 
-static int btree_node_write_and_reclaim(struct bch_fs *c, struct btree *b)
-{
-	return __btree_node_reclaim(c, b, true);
-}
-
 static unsigned long bch2_btree_cache_scan(struct shrinker *shrink,
 					   struct shrink_control *sc)
 {
@@ -252,7 +476,7 @@ static unsigned long bch2_btree_cache_scan(struct shrinker *shrink,
 	unsigned long can_free;
 	unsigned long touched = 0;
 	unsigned long freed = 0;
-	unsigned i;
+	unsigned i, nr_shards;
 
 	if (btree_shrinker_disabled(c))
 		return SHRINK_STOP;
@@ -289,44 +513,66 @@ static unsigned long bch2_btree_cache_scan(struct shrinker *shrink,
 			freed++;
 		}
 	}
+	mutex_unlock(&bc->lock);
+
+	/*
+	 * Scan the live shards round robin from where the last scan left off,
+	 * so the clock hands advance evenly across all of them:
+	 */
+	for (nr_shards = 0;
+	     nr_shards < BTREE_CACHE_SHARD_NR && freed < nr;
+	     nr_shards++) {
+		struct btree_cache_shard *s =
+			&bc->shard[bc->shard_iter++ & (BTREE_CACHE_SHARD_NR - 1)];
+
+		if (sc->gfp_mask & __GFP_FS)
+			mutex_lock(&s->lock);
+		else if (!mutex_trylock(&s->lock))
+			continue;
 restart:
-	list_for_each_entry_safe(b, t, &bc->live, list) {
-		touched++;
+		list_for_each_entry_safe(b, t, &s->live, list) {
+			touched++;
+
+			if (freed >= nr) {
+				/* Save position */
+				if (&t->list != &s->live)
+					list_move_tail(&s->live, &t->list);
+				break;
+			}
 
-		if (freed >= nr) {
-			/* Save position */
-			if (&t->list != &bc->live)
-				list_move_tail(&bc->live, &t->list);
-			break;
-		}
+			if (!btree_node_accessed(b) &&
+			    !btree_node_reclaim(c, b)) {
+				/* can't call bch2_btree_node_hash_remove under lock  */
+				freed++;
+				if (&t->list != &s->live)
+					list_move_tail(&s->live, &t->list);
 
-		if (!btree_node_accessed(b) &&
-		    !btree_node_reclaim(c, b)) {
-			/* can't call bch2_btree_node_hash_remove under lock  */
-			freed++;
-			if (&t->list != &bc->live)
-				list_move_tail(&bc->live, &t->list);
+				bch2_btree_node_stash_compressed(c, b);
 
-			btree_node_data_free(c, b);
-			mutex_unlock(&bc->lock);
+				mutex_lock(&bc->lock);
+				btree_node_data_free(c, b);
+				mutex_unlock(&bc->lock);
 
-			bch2_btree_node_hash_remove(bc, b);
-			six_unlock_write(&b->c.lock);
-			six_unlock_intent(&b->c.lock);
+				mutex_unlock(&s->lock);
 
-			if (freed >= nr)
-				goto out;
+				bch2_btree_node_hash_remove(bc, b);
+				six_unlock_write(&b->c.lock);
+				six_unlock_intent(&b->c.lock);
 
-			if (sc->gfp_mask & __GFP_FS)
-				mutex_lock(&bc->lock);
-			else if (!mutex_trylock(&bc->lock))
-				goto out;
-			goto restart;
-		} else
-			clear_btree_node_accessed(b);
-	}
+				if (freed >= nr)
+					goto out;
 
-	mutex_unlock(&bc->lock);
+				if (sc->gfp_mask & __GFP_FS)
+					mutex_lock(&s->lock);
+				else if (!mutex_trylock(&s->lock))
+					goto out;
+				goto restart;
+			} else
+				clear_btree_node_accessed(b);
+		}
+
+		mutex_unlock(&s->lock);
+	}
 out:
 	return (unsigned long) freed * btree_pages(c);
 }
@@ -344,6 +590,22 @@ static unsigned long bch2_btree_cache_count(struct shrinker *shrink,
 	return btree_cache_can_free(bc) * btree_pages(c);
 }
 
+size_t bch2_btree_cache_size(struct bch_fs *c)
+{
+	size_t ret = 0;
+	struct btree *b;
+	unsigned i;
+
+	for (i = 0; i < BTREE_CACHE_SHARD_NR; i++) {
+		mutex_lock(&c->btree_cache.shard[i].lock);
+		list_for_each_entry(b, &c->btree_cache.shard[i].live, list)
+			ret += btree_bytes(c);
+		mutex_unlock(&c->btree_cache.shard[i].lock);
+	}
+
+	return ret;
+}
+
 void bch2_fs_btree_cache_exit(struct bch_fs *c)
 {
 	struct btree_cache *bc = &c->btree_cache;
@@ -357,19 +619,20 @@ void bch2_fs_btree_cache_exit(struct bch_fs *c)
 
 #ifdef CONFIG_BCACHEFS_DEBUG
 	if (c->verify_data)
-		list_move(&c->verify_data->list, &bc->live);
+		list_move(&c->verify_data->list, &bc->freeable);
 
 	kvpfree(c->verify_ondisk, btree_bytes(c));
 #endif
 
 	for (i = 0; i < BTREE_ID_NR; i++)
 		if (c->btree_roots[i].b)
-			list_add(&c->btree_roots[i].b->list, &bc->live);
+			list_add(&c->btree_roots[i].b->list, &bc->freeable);
 
-	list_splice(&bc->freeable, &bc->live);
+	for (i = 0; i < BTREE_CACHE_SHARD_NR; i++)
+		list_splice_init(&bc->shard[i].live, &bc->freeable);
 
-	while (!list_empty(&bc->live)) {
-		b = list_first_entry(&bc->live, struct btree, list);
+	while (!list_empty(&bc->freeable)) {
+		b = list_first_entry(&bc->freeable, struct btree, list);
 
 		BUG_ON(btree_node_read_in_flight(b) ||
 		       btree_node_write_in_flight(b));
@@ -389,6 +652,14 @@ void bch2_fs_btree_cache_exit(struct bch_fs *c)
 
 	mutex_unlock(&bc->lock);
 
+	while (!list_empty(&bc->compressed_lru))
+		compressed_node_free(bc,
+			list_first_entry(&bc->compressed_lru,
+					 struct compressed_btree_node, list));
+
+	if (bc->compressed_table_init_done)
+		rhashtable_destroy(&bc->compressed_table);
+
 	if (bc->table_init_done)
 		rhashtable_destroy(&bc->table);
 }
@@ -407,6 +678,13 @@ int bch2_fs_btree_cache_init(struct bch_fs *c)
 
 	bc->table_init_done = true;
 
+	ret = rhashtable_init(&bc->compressed_table,
+			      &bch_compressed_node_params);
+	if (ret)
+		goto out;
+
+	bc->compressed_table_init_done = true;
+
 	bch2_recalc_btree_reserve(c);
 
 	for (i = 0; i < bc->reserve; i++)
@@ -415,8 +693,6 @@ int bch2_fs_btree_cache_init(struct bch_fs *c)
 			goto out;
 		}
 
-	list_splice_init(&bc->live, &bc->freeable);
-
 #ifdef CONFIG_BCACHEFS_DEBUG
 	mutex_init(&c->verify_lock);
 
@@ -439,6 +715,9 @@ int bch2_fs_btree_cache_init(struct bch_fs *c)
 	bc->shrink.scan_objects		= bch2_btree_cache_scan;
 	bc->shrink.seeks		= 4;
 	bc->shrink.batch		= btree_pages(c) * 2;
+#ifndef __KERNEL__
+	bc->shrink.name			= "btree_cache";
+#endif
 	register_shrinker(&bc->shrink);
 out:
 	pr_verbose_init(c->opts, "ret %i", ret);
@@ -447,10 +726,20 @@ out:
 
 void bch2_fs_btree_cache_init_early(struct btree_cache *bc)
 {
+	unsigned i;
+
 	mutex_init(&bc->lock);
-	INIT_LIST_HEAD(&bc->live);
 	INIT_LIST_HEAD(&bc->freeable);
 	INIT_LIST_HEAD(&bc->freed);
+
+	mutex_init(&bc->compressed_lock);
+	INIT_LIST_HEAD(&bc->compressed_lru);
+	bc->compressed_bytes_max = BTREE_CACHE_COMPRESSED_MAX_DEFAULT;
+
+	for (i = 0; i < BTREE_CACHE_SHARD_NR; i++) {
+		mutex_init(&bc->shard[i].lock);
+		INIT_LIST_HEAD(&bc->shard[i].live);
+	}
 }
 
 /*
@@ -502,18 +791,36 @@ success:
 	return 0;
 }
 
+static struct btree *btree_shard_cannibalize(struct bch_fs *c,
+					     struct btree_cache_shard *s,
+					     bool flush)
+{
+	struct btree *b;
+
+	mutex_lock(&s->lock);
+	list_for_each_entry_reverse(b, &s->live, list)
+		if (!__btree_node_reclaim(c, b, flush)) {
+			mutex_unlock(&s->lock);
+			return b;
+		}
+	mutex_unlock(&s->lock);
+
+	return NULL;
+}
+
 static struct btree *btree_node_cannibalize(struct bch_fs *c)
 {
 	struct btree_cache *bc = &c->btree_cache;
 	struct btree *b;
+	unsigned i;
 
-	list_for_each_entry_reverse(b, &bc->live, list)
-		if (!btree_node_reclaim(c, b))
+	for (i = 0; i < BTREE_CACHE_SHARD_NR; i++)
+		if ((b = btree_shard_cannibalize(c, &bc->shard[i], false)))
 			return b;
 
 	while (1) {
-		list_for_each_entry_reverse(b, &bc->live, list)
-			if (!btree_node_write_and_reclaim(c, b))
+		for (i = 0; i < BTREE_CACHE_SHARD_NR; i++)
+			if ((b = btree_shard_cannibalize(c, &bc->shard[i], true)))
 				return b;
 
 		/*
@@ -602,9 +909,20 @@ err:
 
 	/* Try to cannibalize another cached btree node: */
 	if (bc->alloc_lock == current) {
+		struct btree_cache_shard *s;
+
+		mutex_unlock(&bc->lock);
+
+		/*
+		 * The node comes back six locked, so it can't be freed or
+		 * moved off its shard's live list out from under us:
+		 */
 		b = btree_node_cannibalize(c);
+
+		s = &bc->shard[b->cache_shard];
+		mutex_lock(&s->lock);
 		list_del_init(&b->list);
-		mutex_unlock(&bc->lock);
+		mutex_unlock(&s->lock);
 
 		bch2_btree_node_hash_remove(bc, b);
 
@@ -16,6 +16,8 @@ int __bch2_btree_node_hash_insert(struct btree_cache *, struct btree *);
 int bch2_btree_node_hash_insert(struct btree_cache *, struct btree *,
 				unsigned, enum btree_id);
 
+void bch2_btree_node_to_freeable(struct bch_fs *, struct btree *);
+
 void bch2_btree_cache_cannibalize_unlock(struct bch_fs *);
 int bch2_btree_cache_cannibalize_lock(struct bch_fs *, struct closure *);
 
@@ -34,6 +36,11 @@ struct btree *bch2_btree_node_get_sibling(struct bch_fs *, struct btree_iter *,
 void bch2_btree_node_prefetch(struct bch_fs *, struct btree_iter *,
 			      const struct bkey_i *, unsigned);
 
+size_t bch2_btree_cache_size(struct bch_fs *);
+
+bool bch2_btree_node_read_compressed(struct bch_fs *, struct btree *);
+size_t bch2_btree_cache_compressed_size(struct btree_cache *);
+
 void bch2_fs_btree_cache_exit(struct bch_fs *);
 int bch2_fs_btree_cache_init(struct bch_fs *);
 void bch2_fs_btree_cache_init_early(struct btree_cache *);
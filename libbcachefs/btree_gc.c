@@ -87,8 +87,8 @@ fsck_err:
 
 /* marking of btree keys/nodes: */
 
-static int bch2_gc_mark_key(struct bch_fs *c, struct bkey_s_c k,
-			    u8 *max_stale, bool initial)
+static int __bch2_gc_mark_key(struct bch_fs *c, struct bkey_s_c k,
+			      u8 *max_stale, bool initial)
 {
 	struct bkey_ptrs_c ptrs = bch2_bkey_ptrs_c(k);
 	const struct bch_extent_ptr *ptr;
@@ -161,6 +161,24 @@ fsck_err:
 	return ret;
 }
 
+/*
+ * The userspace percpu shims degenerate to a single shared instance, so when
+ * the initial mark is running one worker per btree the usage accumulation has
+ * to be serialized - node reads, checksums and key unpacking still run in
+ * parallel:
+ */
+static int bch2_gc_mark_key(struct bch_fs *c, struct bkey_s_c k,
+			    u8 *max_stale, bool initial)
+{
+	int ret;
+
+	mutex_lock(&c->gc_mark_lock);
+	ret = __bch2_gc_mark_key(c, k, max_stale, initial);
+	mutex_unlock(&c->gc_mark_lock);
+
+	return ret;
+}
+
 static int btree_gc_mark_node(struct bch_fs *c, struct btree *b, u8 *max_stale,
 			      bool initial)
 {
@@ -199,6 +217,34 @@ static int btree_gc_mark_node(struct bch_fs *c, struct btree *b, u8 *max_stale,
 	return ret;
 }
 
+/*
+ * How many btree nodes we mark per gc_lock hold: foreground interior node
+ * updates (splits, merges) block on gc_lock, so the time to mark one batch
+ * bounds the worst case foreground stall - gc duration doesn't matter,
+ * pauses do:
+ */
+#define GC_BATCH_NODES		64
+
+static void bch2_gc_yield(struct bch_fs *c, struct btree_trans *trans)
+{
+	bch2_trans_unlock(trans);
+	up_write(&c->gc_lock);
+
+	cond_resched();
+
+	down_write(&c->gc_lock);
+
+	/*
+	 * gc doesn't track btree nodes pending free: wait for interior
+	 * updates started while the lock was dropped to drain, as at the
+	 * start of bch2_gc():
+	 */
+	closure_wait_event(&c->btree_interior_update_wait,
+			   !bch2_btree_interior_updates_nr_pending(c));
+
+	bch2_trans_relock(trans);
+}
+
 static int bch2_gc_btree(struct bch_fs *c, enum btree_id btree_id,
 			 bool initial, bool metadata_only)
 {
@@ -209,6 +255,7 @@ static int bch2_gc_btree(struct bch_fs *c, enum btree_id btree_id,
 		: expensive_debug_checks(c)		? 0
 		: !btree_node_type_needs_gc(btree_id)	? 1
 		: 0;
+	unsigned nr_nodes = 0;
 	u8 max_stale = 0;
 	int ret = 0;
 
@@ -239,6 +286,12 @@ static int bch2_gc_btree(struct bch_fs *c, enum btree_id btree_id,
 						b->data->keys.seq,
 						BTREE_INSERT_NOWAIT|
 						BTREE_INSERT_GC_LOCK_HELD);
+
+			if (++nr_nodes >= GC_BATCH_NODES) {
+				nr_nodes = 0;
+				bch2_gc_yield(c, &trans);
+				continue;
+			}
 		}
 
 		bch2_trans_cond_resched(&trans);
@@ -370,22 +423,80 @@ static inline int btree_id_gc_phase_cmp(enum btree_id l, enum btree_id r)
 		(int) btree_id_to_gc_phase(r);
 }
 
+struct gc_btree_init_work {
+	struct work_struct	work;
+	struct bch_fs		*c;
+	struct journal_keys	*journal_keys;
+	enum btree_id		id;
+	bool			metadata_only;
+	int			ret;
+};
+
+static void bch2_gc_btree_init_work(struct work_struct *work)
+{
+	struct gc_btree_init_work *w =
+		container_of(work, struct gc_btree_init_work, work);
+
+	w->ret = bch2_gc_btree_init(w->c, w->journal_keys,
+				    w->id, w->metadata_only);
+}
+
 static int bch2_gc_btrees(struct bch_fs *c, struct journal_keys *journal_keys,
 			  bool initial, bool metadata_only)
 {
 	enum btree_id ids[BTREE_ID_NR];
 	unsigned i;
 
+	if (initial) {
+		/*
+		 * The initial mark runs before foreground operations and
+		 * doesn't publish a gc cursor, so unlike runtime gc it isn't
+		 * tied to marking the btrees in gc phase order - except that
+		 * stripes have to be marked before the extents that point
+		 * into them (bch2_mark_stripe_ptr() looks up the gc stripe),
+		 * so mark the EC btree first, then dispatch one worker per
+		 * remaining btree and collect the first error:
+		 */
+		struct gc_btree_init_work w[BTREE_ID_NR];
+		int ret;
+
+		ret = bch2_gc_btree_init(c, journal_keys,
+					 BTREE_ID_EC, metadata_only);
+		if (ret)
+			return ret;
+
+		for (i = 0; i < BTREE_ID_NR; i++) {
+			if (i == BTREE_ID_EC)
+				continue;
+
+			w[i] = (struct gc_btree_init_work) {
+				.c		= c,
+				.journal_keys	= journal_keys,
+				.id		= i,
+				.metadata_only	= metadata_only,
+			};
+			INIT_WORK(&w[i].work, bch2_gc_btree_init_work);
+			queue_work(system_unbound_wq, &w[i].work);
+		}
+
+		for (i = 0; i < BTREE_ID_NR; i++) {
+			if (i == BTREE_ID_EC)
+				continue;
+
+			flush_work(&w[i].work);
+			ret = ret ?: w[i].ret;
+		}
+
+		return ret;
+	}
+
 	for (i = 0; i < BTREE_ID_NR; i++)
 		ids[i] = i;
 	bubble_sort(ids, BTREE_ID_NR, btree_id_gc_phase_cmp);
 
 	for (i = 0; i < BTREE_ID_NR; i++) {
-		enum btree_id id = ids[i];
-		int ret = initial
-			? bch2_gc_btree_init(c, journal_keys,
-					     id, metadata_only)
-			: bch2_gc_btree(c, id, initial, metadata_only);
+		int ret = bch2_gc_btree(c, ids[i], initial, metadata_only);
+
 		if (ret)
 			return ret;
 	}
@@ -514,7 +625,7 @@ static void bch2_mark_allocator_buckets(struct bch_fs *c)
 	spin_unlock(&c->freelist_lock);
 
 	for (ob = c->open_buckets;
-	     ob < c->open_buckets + ARRAY_SIZE(c->open_buckets);
+	     ob < c->open_buckets + c->open_buckets_nr;
 	     ob++) {
 		spin_lock(&ob->lock);
 		if (ob->valid) {
@@ -359,8 +359,26 @@ static bool bch2_drop_whiteouts(struct btree *b, enum compact_mode mode)
 			n = bkey_next_skip_noops(k, end);
 
 			if (!bkey_whiteout(k)) {
-				bkey_copy(out, k);
-				out = bkey_next(out);
+				struct bkey_packed *run = k;
+				unsigned u64s;
+
+				/*
+				 * Batch a contiguous run of keys we're
+				 * keeping into a single copy - ending at a
+				 * whiteout, or at noop padding we're also
+				 * dropping:
+				 */
+				while (n != end &&
+				       n == bkey_next(k) &&
+				       !bkey_whiteout(n)) {
+					k = n;
+					n = bkey_next_skip_noops(k, end);
+				}
+
+				u64s = (u64 *) bkey_next(k) - (u64 *) run;
+				if (out != run)
+					memmove_u64s_down(out, run, u64s);
+				out = (void *) out + u64s * sizeof(u64);
 			} else {
 				BUG_ON(k->needs_whiteout);
 			}
@@ -484,6 +502,27 @@ static void btree_node_sort(struct bch_fs *c, struct btree *b,
 
 	btree_bounce_free(c, bytes, used_mempool, out);
 
+	/*
+	 * A node's format is chosen when it's created and never revisited, so
+	 * one outlier key can pin wide field sizes for the node's whole life.
+	 * We can't repack in place - earlier bsets are already on disk in the
+	 * old format - but if a fresh format over the live keys would buy more
+	 * than 10% density, flag the node: the next insert then rewrites it
+	 * via the replacement path, which recomputes the format.
+	 */
+	if (sorting_entire_node && !btree_node_need_rewrite(b)) {
+		struct bkey_format_state s;
+		struct bkey_format new_f;
+
+		bch2_bkey_format_init(&s);
+		__bch2_btree_calc_format(&s, b);
+		new_f = bch2_bkey_format_done(&s);
+
+		if (bch2_btree_node_u64s_with_format(b, &new_f) * 10 <
+		    b->nr.live_u64s * 9)
+			set_btree_node_need_rewrite(b);
+	}
+
 	bch2_verify_btree_nr_keys(b);
 }
 
@@ -1159,7 +1198,7 @@ static void btree_node_read_endio(struct bio *bio)
 		bch2_latency_acct(ca, rb->start_time, READ);
 	}
 
-	queue_work(system_unbound_wq, &rb->work);
+	queue_work(c->btree_read_complete_wq, &rb->work);
 }
 
 void bch2_btree_node_read(struct bch_fs *c, struct btree *b,
@@ -1173,6 +1212,9 @@ void bch2_btree_node_read(struct bch_fs *c, struct btree *b,
 
 	trace_btree_read(c, b);
 
+	if (bch2_btree_node_read_compressed(c, b))
+		return;
+
 	ret = bch2_bkey_pick_read_device(c, bkey_i_to_s_c(&b->key),
 					 NULL, &pick);
 	if (bch2_fs_fatal_err_on(ret <= 0, c,
@@ -1219,7 +1261,7 @@ void bch2_btree_node_read(struct bch_fs *c, struct btree *b,
 		if (sync)
 			btree_node_read_work(&rb->work);
 		else
-			queue_work(system_unbound_wq, &rb->work);
+			queue_work(c->btree_read_complete_wq, &rb->work);
 
 	}
 }
@@ -1251,9 +1293,7 @@ int bch2_btree_root_read(struct bch_fs *c, enum btree_id id,
 	if (btree_node_read_error(b)) {
 		bch2_btree_node_hash_remove(&c->btree_cache, b);
 
-		mutex_lock(&c->btree_cache.lock);
-		list_move(&b->list, &c->btree_cache.freeable);
-		mutex_unlock(&c->btree_cache.lock);
+		bch2_btree_node_to_freeable(c, b);
 
 		ret = -EIO;
 		goto err;
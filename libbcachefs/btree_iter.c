@@ -278,6 +278,7 @@ bool __bch2_btree_node_lock(struct btree *b, struct bpos pos,
 	}
 
 	if (unlikely(!ret)) {
+		atomic64_inc(&trans->c->btree_trans_restart_by_level[level]);
 		trace_trans_restart_would_deadlock(iter->trans->ip);
 		return false;
 	}
@@ -290,6 +291,8 @@ bool __bch2_btree_node_lock(struct btree *b, struct bpos pos,
 
 	bch2_time_stats_update(&trans->c->times[lock_to_time_stat(type)],
 			       start_time);
+	bch2_time_stats_update(&trans->c->btree_lock_contended_by_level[level],
+			       start_time);
 	return true;
 }
 
@@ -1003,8 +1006,13 @@ static void btree_iter_prefetch(struct btree_iter *iter)
 	struct btree_node_iter node_iter = l->iter;
 	struct bkey_packed *k;
 	BKEY_PADDED(k) tmp;
+	/*
+	 * Scale the window with the number of consecutive leaf boundary
+	 * advances, so a linear scan ramps from 2 to 16 nodes of readahead
+	 * while point lookups don't read nodes they'll never use:
+	 */
 	unsigned nr = test_bit(BCH_FS_STARTED, &c->flags)
-		? (iter->level > 1 ? 0 :  2)
+		? (iter->level > 1 ? 0 : 2 << min_t(unsigned, iter->readahead, 3))
 		: (iter->level > 1 ? 1 : 16);
 	bool was_locked = btree_node_locked(iter, iter->level);
 
@@ -1346,6 +1354,10 @@ struct btree *bch2_btree_iter_next_node(struct btree_iter *iter)
 	if (!btree_iter_node(iter, iter->level))
 		return NULL;
 
+	/* node iterators are sequential by definition: */
+	if (iter->readahead < U8_MAX)
+		iter->readahead++;
+
 	bch2_trans_cond_resched(iter->trans);
 
 	btree_iter_up(iter);
@@ -1435,6 +1447,9 @@ static void btree_iter_pos_changed(struct btree_iter *iter, int cmp)
 	if (!cmp)
 		goto out;
 
+	if (cmp < 0)
+		iter->readahead = 0;
+
 	if (unlikely(btree_iter_type(iter) == BTREE_ITER_CACHED)) {
 		btree_node_unlock(iter, 0);
 		iter->l[0].b = BTREE_ITER_NO_NODE_UP;
@@ -1452,8 +1467,10 @@ static void btree_iter_pos_changed(struct btree_iter *iter, int cmp)
 		 * is expensive).
 		 */
 		if (cmp < 0 ||
-		    !btree_iter_advance_to_pos(iter, &iter->l[l], 8))
+		    !btree_iter_advance_to_pos(iter, &iter->l[l], 8)) {
 			__btree_iter_init(iter, l);
+			iter->readahead = 0;
+		}
 
 		/* Don't leave it locked if we're not supposed to: */
 		if (btree_lock_want(iter, l) == BTREE_NODE_UNLOCKED)
@@ -1505,6 +1522,9 @@ static inline bool btree_iter_set_pos_to_next_leaf(struct btree_iter *iter)
 	if (ret && !(iter->flags & BTREE_ITER_IS_EXTENTS))
 		iter->k.p = iter->pos = bkey_successor(iter->pos);
 
+	if (iter->readahead < U8_MAX)
+		iter->readahead++;
+
 	btree_iter_pos_changed(iter, 1);
 	return ret;
 }
@@ -1922,6 +1942,7 @@ static inline void bch2_btree_iter_init(struct btree_trans *trans,
 	iter->locks_want		= flags & BTREE_ITER_INTENT ? 1 : 0;
 	iter->nodes_locked		= 0;
 	iter->nodes_intent_locked	= 0;
+	iter->readahead			= 0;
 	for (i = 0; i < ARRAY_SIZE(iter->l); i++)
 		iter->l[i].b		= BTREE_ITER_NO_NODE_INIT;
 
@@ -2103,6 +2124,14 @@ static inline struct bpos bpos_diff(struct bpos l, struct bpos r)
 	return POS(r.inode - l.inode, r.offset - l.offset);
 }
 
+/* Can we reuse @iter in place, or do we have to copy it? */
+static inline bool btree_iter_reusable(struct btree_trans *trans,
+				       struct btree_iter *iter)
+{
+	return !(trans->iters_live & (1ULL << iter->idx)) &&
+		!(iter->flags & BTREE_ITER_KEEP_UNTIL_COMMIT);
+}
+
 static struct btree_iter *__btree_trans_get_iter(struct btree_trans *trans,
 						 unsigned btree_id, struct bpos pos,
 						 unsigned flags)
@@ -2118,10 +2147,25 @@ static struct btree_iter *__btree_trans_get_iter(struct btree_trans *trans,
 		if (iter->btree_id != btree_id)
 			continue;
 
-		if (best &&
-		    bkey_cmp(bpos_diff(best->pos, pos),
-			     bpos_diff(iter->pos, pos)) < 0)
-			continue;
+		if (btree_iter_reusable(trans, iter) &&
+		    !bkey_cmp(iter->pos, pos)) {
+			/* A free iterator already at @pos - can't do better: */
+			best = iter;
+			break;
+		}
+
+		/*
+		 * Prefer the nearest iterator; on ties, prefer one we can
+		 * reuse in place over one we'd have to copy:
+		 */
+		if (best) {
+			int cmp = bkey_cmp(bpos_diff(best->pos, pos),
+					   bpos_diff(iter->pos, pos));
+
+			if (cmp < 0 ||
+			    (!cmp && btree_iter_reusable(trans, best)))
+				continue;
+		}
 
 		best = iter;
 	}
@@ -2132,8 +2176,7 @@ static struct btree_iter *__btree_trans_get_iter(struct btree_trans *trans,
 			return iter;
 
 		bch2_btree_iter_init(trans, iter, btree_id, pos, flags);
-	} else if ((trans->iters_live & (1ULL << best->idx)) ||
-		   (best->flags & BTREE_ITER_KEEP_UNTIL_COMMIT)) {
+	} else if (!btree_iter_reusable(trans, best)) {
 		iter = btree_trans_iter_alloc(trans);
 		if (IS_ERR(iter))
 			return iter;
@@ -2224,6 +2267,35 @@ struct btree_iter *__bch2_trans_copy_iter(struct btree_trans *trans,
 	return iter;
 }
 
+/*
+ * Learned high water marks for transaction memory, per bch2_trans_init() call
+ * site: growing trans->mem mid commit restarts the transaction, so
+ * bch2_trans_init() preallocates what the same call site needed last time
+ * around. Slots are indexed by a hash of the call site ip - collisions just
+ * mean a site may preallocate another site's (capped) high water mark, which
+ * is harmless. Updates are racy by design; this is a heuristic:
+ */
+#define TRANS_MEM_SITES_BITS	6
+#define TRANS_MEM_LEARN_MAX	(16U << 10)
+
+static unsigned trans_mem_sites[1U << TRANS_MEM_SITES_BITS];
+
+static unsigned *trans_mem_site(unsigned long ip)
+{
+	return &trans_mem_sites[hash_long(ip, TRANS_MEM_SITES_BITS)];
+}
+
+static void trans_mem_record(struct btree_trans *trans)
+{
+	unsigned *w = trans_mem_site(trans->ip);
+	unsigned v = min_t(unsigned,
+			   max(trans->mem_max, trans->mem_top),
+			   TRANS_MEM_LEARN_MAX);
+
+	if (v > READ_ONCE(*w))
+		WRITE_ONCE(*w, v);
+}
+
 static int bch2_trans_preload_mem(struct btree_trans *trans, size_t size)
 {
 	if (size > trans->mem_bytes) {
@@ -2289,6 +2361,7 @@ void bch2_trans_reset(struct btree_trans *trans, unsigned flags)
 	trans->need_reset		= 0;
 	trans->nr_updates		= 0;
 	trans->nr_updates2		= 0;
+	trans->mem_max			= max(trans->mem_max, trans->mem_top);
 	trans->mem_top			= 0;
 
 	trans->extra_journal_entries	= NULL;
@@ -2328,6 +2401,9 @@ void bch2_trans_init(struct btree_trans *trans, struct bch_fs *c,
 	if (expected_nr_iters > trans->size)
 		bch2_trans_realloc_iters(trans, expected_nr_iters);
 
+	if (!expected_mem_bytes)
+		expected_mem_bytes = READ_ONCE(*trans_mem_site(trans->ip));
+
 	if (expected_mem_bytes)
 		bch2_trans_preload_mem(trans, expected_mem_bytes);
 
@@ -2343,6 +2419,8 @@ int bch2_trans_exit(struct btree_trans *trans)
 {
 	bch2_trans_unlock(trans);
 
+	trans_mem_record(trans);
+
 #ifdef CONFIG_BCACHEFS_DEBUG
 	mutex_lock(&trans->c->btree_trans_lock);
 	list_del(&trans->list);
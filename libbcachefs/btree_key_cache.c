@@ -41,6 +41,14 @@ btree_key_cache_find(struct bch_fs *c, enum btree_id btree_id, struct bpos pos)
 				      bch2_btree_key_cache_params);
 }
 
+static inline struct btree_key_cache_shard *
+btree_key_cache_shard(struct btree_key_cache *c,
+		      enum btree_id btree_id, struct bpos pos)
+{
+	return &c->shard[(pos.inode ^ pos.offset ^ btree_id) &
+			 (BTREE_KEY_CACHE_SHARD_NR - 1)];
+}
+
 static bool bkey_cached_lock_for_evict(struct bkey_cached *ck)
 {
 	if (!six_trylock_intent(&ck->c.lock))
@@ -68,10 +76,10 @@ static void bkey_cached_evict(struct btree_key_cache *c,
 	memset(&ck->key, ~0, sizeof(ck->key));
 }
 
-static void bkey_cached_free(struct btree_key_cache *c,
+static void bkey_cached_free(struct btree_key_cache_shard *s,
 			     struct bkey_cached *ck)
 {
-	list_move(&ck->list, &c->freed);
+	list_move(&ck->list, &s->freed);
 
 	kfree(ck->k);
 	ck->k		= NULL;
@@ -82,15 +90,16 @@ static void bkey_cached_free(struct btree_key_cache *c,
 }
 
 static struct bkey_cached *
-bkey_cached_alloc(struct btree_key_cache *c)
+bkey_cached_alloc(struct btree_key_cache *c,
+		  struct btree_key_cache_shard *s)
 {
 	struct bkey_cached *ck;
 
-	list_for_each_entry(ck, &c->freed, list)
+	list_for_each_entry(ck, &s->freed, list)
 		if (bkey_cached_lock_for_evict(ck))
 			return ck;
 
-	list_for_each_entry(ck, &c->clean, list)
+	list_for_each_entry(ck, &s->clean, list)
 		if (bkey_cached_lock_for_evict(ck)) {
 			bkey_cached_evict(c, ck);
 			return ck;
@@ -110,12 +119,13 @@ bkey_cached_alloc(struct btree_key_cache *c)
 
 static struct bkey_cached *
 btree_key_cache_create(struct btree_key_cache *c,
+		       struct btree_key_cache_shard *s,
 		       enum btree_id btree_id,
 		       struct bpos pos)
 {
 	struct bkey_cached *ck;
 
-	ck = bkey_cached_alloc(c);
+	ck = bkey_cached_alloc(c, s);
 	if (!ck)
 		return ERR_PTR(-ENOMEM);
 
@@ -131,16 +141,22 @@ btree_key_cache_create(struct btree_key_cache *c,
 					  &ck->hash,
 					  bch2_btree_key_cache_params)) {
 		/* We raced with another fill: */
-		bkey_cached_free(c, ck);
+		bkey_cached_free(s, ck);
 		return NULL;
 	}
 
-	list_move(&ck->list, &c->clean);
+	list_move(&ck->list, &s->clean);
 	six_unlock_write(&ck->c.lock);
 
 	return ck;
 }
 
+/*
+ * Note that this caches negative lookups, too: peek_slot() on an empty slot
+ * returns a deleted key at @pos, which we cache like any other - repeated
+ * probes of an absent key are then answered from the hash table without
+ * another btree descent:
+ */
 static int btree_key_cache_fill(struct btree_trans *trans,
 				struct btree_iter *ck_iter,
 				struct bkey_cached *ck)
@@ -225,10 +241,14 @@ retry:
 			return 0;
 		}
 
-		mutex_lock(&c->btree_key_cache.lock);
-		ck = btree_key_cache_create(&c->btree_key_cache,
+		struct btree_key_cache_shard *s =
+			btree_key_cache_shard(&c->btree_key_cache,
+					      iter->btree_id, iter->pos);
+
+		mutex_lock(&s->lock);
+		ck = btree_key_cache_create(&c->btree_key_cache, s,
 					    iter->btree_id, iter->pos);
-		mutex_unlock(&c->btree_key_cache.lock);
+		mutex_unlock(&s->lock);
 
 		ret = PTR_ERR_OR_ZERO(ck);
 		if (ret)
@@ -357,9 +377,13 @@ err:
 	clear_bit(BKEY_CACHED_DIRTY, &ck->flags);
 
 	if (!evict) {
-		mutex_lock(&c->btree_key_cache.lock);
-		list_move_tail(&ck->list, &c->btree_key_cache.clean);
-		mutex_unlock(&c->btree_key_cache.lock);
+		struct btree_key_cache_shard *s =
+			btree_key_cache_shard(&c->btree_key_cache,
+					      key.btree_id, key.pos);
+
+		mutex_lock(&s->lock);
+		list_move_tail(&ck->list, &s->clean);
+		mutex_unlock(&s->lock);
 	} else {
 evict:
 		BUG_ON(!btree_node_intent_locked(c_iter, 0));
@@ -369,10 +393,16 @@ evict:
 
 		six_lock_write(&ck->c.lock, NULL, NULL);
 
-		mutex_lock(&c->btree_key_cache.lock);
-		bkey_cached_evict(&c->btree_key_cache, ck);
-		bkey_cached_free(&c->btree_key_cache, ck);
-		mutex_unlock(&c->btree_key_cache.lock);
+		{
+			struct btree_key_cache_shard *s =
+				btree_key_cache_shard(&c->btree_key_cache,
+						      key.btree_id, key.pos);
+
+			mutex_lock(&s->lock);
+			bkey_cached_evict(&c->btree_key_cache, ck);
+			bkey_cached_free(s, ck);
+			mutex_unlock(&s->lock);
+		}
 	}
 out:
 	bch2_trans_iter_put(trans, b_iter);
@@ -446,11 +476,15 @@ bool bch2_btree_insert_key_cached(struct btree_trans *trans,
 	ck->valid = true;
 
 	if (!test_bit(BKEY_CACHED_DIRTY, &ck->flags)) {
-		mutex_lock(&c->btree_key_cache.lock);
+		struct btree_key_cache_shard *s =
+			btree_key_cache_shard(&c->btree_key_cache,
+					      ck->key.btree_id, ck->key.pos);
+
+		mutex_lock(&s->lock);
 		list_del_init(&ck->list);
 
 		set_bit(BKEY_CACHED_DIRTY, &ck->flags);
-		mutex_unlock(&c->btree_key_cache.lock);
+		mutex_unlock(&s->lock);
 	}
 
 	bch2_journal_pin_update(&c->journal, trans->journal_res.seq,
@@ -469,24 +503,33 @@ void bch2_btree_key_cache_verify_clean(struct btree_trans *trans,
 void bch2_fs_btree_key_cache_exit(struct btree_key_cache *c)
 {
 	struct bkey_cached *ck, *n;
+	unsigned i;
 
-	mutex_lock(&c->lock);
-	list_for_each_entry_safe(ck, n, &c->clean, list) {
-		kfree(ck->k);
-		kfree(ck);
+	for (i = 0; i < BTREE_KEY_CACHE_SHARD_NR; i++) {
+		struct btree_key_cache_shard *s = &c->shard[i];
+
+		mutex_lock(&s->lock);
+		list_for_each_entry_safe(ck, n, &s->clean, list) {
+			kfree(ck->k);
+			kfree(ck);
+		}
+		list_for_each_entry_safe(ck, n, &s->freed, list)
+			kfree(ck);
+		mutex_unlock(&s->lock);
 	}
-	list_for_each_entry_safe(ck, n, &c->freed, list)
-		kfree(ck);
-	mutex_unlock(&c->lock);
 
 	rhashtable_destroy(&c->table);
 }
 
 void bch2_fs_btree_key_cache_init_early(struct btree_key_cache *c)
 {
-	mutex_init(&c->lock);
-	INIT_LIST_HEAD(&c->freed);
-	INIT_LIST_HEAD(&c->clean);
+	unsigned i;
+
+	for (i = 0; i < BTREE_KEY_CACHE_SHARD_NR; i++) {
+		mutex_init(&c->shard[i].lock);
+		INIT_LIST_HEAD(&c->shard[i].freed);
+		INIT_LIST_HEAD(&c->shard[i].clean);
+	}
 }
 
 int bch2_fs_btree_key_cache_init(struct btree_key_cache *c)
@@ -501,7 +544,6 @@ void bch2_btree_key_cache_to_text(struct printbuf *out, struct btree_key_cache *
 	struct rhash_head *pos;
 	size_t i;
 
-	mutex_lock(&c->lock);
 	tbl = rht_dereference_rcu(c->table.tbl, &c->table);
 
 	for (i = 0; i < tbl->size; i++) {
@@ -515,5 +557,4 @@ void bch2_btree_key_cache_to_text(struct printbuf *out, struct btree_key_cache *
 			pr_buf(out, "\n");
 		}
 	}
-	mutex_unlock(&c->lock);
 }
@@ -145,6 +145,8 @@ static inline void __btree_node_lock_type(struct bch_fs *c, struct btree *b,
 
 	six_lock_type(&b->c.lock, type, NULL, NULL);
 	bch2_time_stats_update(&c->times[lock_to_time_stat(type)], start_time);
+	bch2_time_stats_update(&c->btree_lock_contended_by_level[b->c.level],
+			       start_time);
 }
 
 static inline void btree_node_lock_type(struct bch_fs *c, struct btree *b,
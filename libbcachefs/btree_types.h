@@ -76,6 +76,12 @@ struct btree {
 	u16			written;
 	u8			nsets;
 	u8			nr_key_bits;
+	/*
+	 * Which btree_cache shard's live list this node is on; assigned when
+	 * the node is hashed, and stable until it leaves the list (hash_val
+	 * gets zeroed on eviction, so it can't be rederived):
+	 */
+	u8			cache_shard;
 
 	struct bkey_format	format;
 
@@ -138,6 +144,8 @@ struct btree {
 	__BKEY_PADDED(key, BKEY_BTREE_PTR_VAL_U64s_MAX);
 };
 
+#define BTREE_CACHE_SHARD_NR	8
+
 struct btree_cache {
 	struct rhashtable	table;
 	bool			table_init_done;
@@ -155,10 +163,35 @@ struct btree_cache {
 	 * should never grow past ~2-3 nodes in practice.
 	 */
 	struct mutex		lock;
-	struct list_head	live;
 	struct list_head	freeable;
 	struct list_head	freed;
 
+	/*
+	 * The live LRU is sharded by node hash so that concurrent lookups
+	 * filling in nodes don't all serialize on one lock; a node's shard is
+	 * recorded in b->cache_shard. Lock ordering: shard lock first, then
+	 * bc->lock - never the other way around.
+	 */
+	struct btree_cache_shard {
+		struct mutex		lock;
+		struct list_head	live;
+	}			shard[BTREE_CACHE_SHARD_NR];
+
+	/* Round robin position for the shrinker: */
+	unsigned		shard_iter;
+
+	/*
+	 * Second tier cache: lz4 compressed copies of nodes evicted by the
+	 * shrinker, so re-reading a recently evicted node doesn't have to go
+	 * to disk. Size bounded, lru evicted; see btree_cache.c:
+	 */
+	struct rhashtable	compressed_table;
+	bool			compressed_table_init_done;
+	struct mutex		compressed_lock;
+	struct list_head	compressed_lru;
+	size_t			compressed_bytes;
+	size_t			compressed_bytes_max;
+
 	/* Number of elements in live + freeable lists */
 	unsigned		used;
 	unsigned		reserve;
@@ -255,6 +288,13 @@ struct btree_iter {
 	u16			flags;
 	u8			idx;
 
+	/*
+	 * Count of consecutive leaf boundary advances, for scaling the
+	 * BTREE_ITER_PREFETCH window on linear scans; reset whenever the
+	 * iterator is repositioned:
+	 */
+	u8			readahead;
+
 	enum btree_id		btree_id:4;
 	enum btree_iter_uptodate uptodate:4;
 	unsigned		level:4,
@@ -288,11 +328,21 @@ static inline struct btree_iter_level *iter_l(struct btree_iter *iter)
 	return iter->l + iter->level;
 }
 
+#define BTREE_KEY_CACHE_SHARD_NR	8
+
 struct btree_key_cache {
-	struct mutex		lock;
 	struct rhashtable	table;
-	struct list_head	freed;
-	struct list_head	clean;
+
+	/*
+	 * Lookups are lock free via the rhashtable; the lock and freelists
+	 * are sharded by key so that creating, evicting and redirtying
+	 * cached keys doesn't serialize on one mutex:
+	 */
+	struct btree_key_cache_shard {
+		struct mutex		lock;
+		struct list_head	freed;
+		struct list_head	clean;
+	}			shard[BTREE_KEY_CACHE_SHARD_NR];
 };
 
 struct bkey_cached_key {
@@ -360,6 +410,7 @@ struct btree_trans {
 	unsigned		in_traverse_all:1;
 
 	unsigned		mem_top;
+	unsigned		mem_max;
 	unsigned		mem_bytes;
 	void			*mem;
 
@@ -24,6 +24,7 @@ enum btree_insert_flags {
 	__BTREE_INSERT_JOURNAL_REPLAY,
 	__BTREE_INSERT_JOURNAL_RESERVED,
 	__BTREE_INSERT_JOURNAL_RECLAIM,
+	__BTREE_INSERT_NOJOURNAL,
 	__BTREE_INSERT_NOWAIT,
 	__BTREE_INSERT_GC_LOCK_HELD,
 	__BCH_HASH_SET_MUST_CREATE,
@@ -54,6 +55,15 @@ enum btree_insert_flags {
 /* Insert is being called from journal reclaim path: */
 #define BTREE_INSERT_JOURNAL_RECLAIM (1 << __BTREE_INSERT_JOURNAL_RECLAIM)
 
+/*
+ * Bulk load mode: don't copy keys into the journal, only take an (empty)
+ * reservation so btree node write ordering still works. NOT CRASH SAFE -
+ * keys aren't replayable, so this is only for building a filesystem from
+ * scratch (migrate), where a crash means starting over anyway and the final
+ * clean shutdown is the consistency barrier:
+ */
+#define BTREE_INSERT_NOJOURNAL		(1 << __BTREE_INSERT_NOJOURNAL)
+
 /* Don't block on allocation failure (for new btree nodes: */
 #define BTREE_INSERT_NOWAIT		(1 << __BTREE_INSERT_NOWAIT)
 #define BTREE_INSERT_GC_LOCK_HELD	(1 << __BTREE_INSERT_GC_LOCK_HELD)
@@ -67,6 +77,43 @@ int __bch2_btree_insert(struct btree_trans *, enum btree_id, struct bkey_i *);
 int bch2_btree_insert(struct bch_fs *, enum btree_id, struct bkey_i *,
 		     struct disk_reservation *, u64 *, int flags);
 
+/*
+ * Group commit: buffer up keys from multiple logical operations and insert
+ * them with a single bch2_trans_commit(), amortizing the journal reservation
+ * and node locking over the whole batch. The buffer owns copies of the keys,
+ * so a lock conflict (-EINTR) during the commit just retries the batch:
+ */
+#define BTREE_INSERT_BUF_NR	16
+#define BTREE_INSERT_BUF_U64s	512
+
+struct btree_insert_buf {
+	struct bch_fs		*c;
+	struct disk_reservation	*disk_res;
+	u64			*journal_seq;
+	int			flags;
+	unsigned		nr;
+	unsigned		u64s;
+	enum btree_id		btree_ids[BTREE_INSERT_BUF_NR];
+	u64			keys[BTREE_INSERT_BUF_U64s];
+};
+
+static inline void bch2_btree_insert_buf_init(struct btree_insert_buf *buf,
+					      struct bch_fs *c,
+					      struct disk_reservation *disk_res,
+					      u64 *journal_seq, int flags)
+{
+	buf->c			= c;
+	buf->disk_res		= disk_res;
+	buf->journal_seq	= journal_seq;
+	buf->flags		= flags;
+	buf->nr			= 0;
+	buf->u64s		= 0;
+}
+
+int bch2_btree_insert_buf_flush(struct btree_insert_buf *);
+int bch2_btree_insert_buf_add(struct btree_insert_buf *, enum btree_id,
+			      struct bkey_i *);
+
 int bch2_btree_delete_at_range(struct btree_trans *, struct btree_iter *,
 			       struct bpos, u64 *);
 int bch2_btree_delete_range(struct bch_fs *, enum btree_id,
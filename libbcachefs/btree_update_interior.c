@@ -90,8 +90,8 @@ static struct bkey_format bch2_btree_calc_format(struct btree *b)
 	return bch2_bkey_format_done(&s);
 }
 
-static size_t btree_node_u64s_with_format(struct btree *b,
-					  struct bkey_format *new_f)
+size_t bch2_btree_node_u64s_with_format(struct btree *b,
+					struct bkey_format *new_f)
 {
 	struct bkey_format *old_f = &b->format;
 
@@ -116,7 +116,7 @@ static size_t btree_node_u64s_with_format(struct btree *b,
 bool bch2_btree_node_format_fits(struct bch_fs *c, struct btree *b,
 				 struct bkey_format *new_f)
 {
-	size_t u64s = btree_node_u64s_with_format(b, new_f);
+	size_t u64s = bch2_btree_node_u64s_with_format(b, new_f);
 
 	return __vstruct_bytes(struct btree_node, u64s) < btree_bytes(c);
 }
@@ -138,15 +138,15 @@ static void __btree_node_free(struct bch_fs *c, struct btree *b)
 
 	bch2_btree_node_hash_remove(&c->btree_cache, b);
 
-	mutex_lock(&c->btree_cache.lock);
-	list_move(&b->list, &c->btree_cache.freeable);
-	mutex_unlock(&c->btree_cache.lock);
+	bch2_btree_node_to_freeable(c, b);
 }
 
 void bch2_btree_node_free_never_inserted(struct bch_fs *c, struct btree *b)
 {
 	struct open_buckets ob = b->ob;
+	BKEY_PADDED(k) tmp;
 
+	bkey_copy(&tmp.k, &b->key);
 	b->ob.nr = 0;
 
 	clear_btree_node_dirty(b);
@@ -155,7 +155,23 @@ void bch2_btree_node_free_never_inserted(struct bch_fs *c, struct btree *b)
 	__btree_node_free(c, b);
 	six_unlock_write(&b->c.lock);
 
-	bch2_open_buckets_put(c, &ob);
+	/*
+	 * This node was never reachable on disk, so the bucket can be reused
+	 * right away - stash it in the reserve cache, same as unused prealloc
+	 * nodes in bch2_btree_reserve_put(), instead of round tripping
+	 * through the allocator:
+	 */
+	mutex_lock(&c->btree_reserve_cache_lock);
+	if (c->btree_reserve_cache_nr < ARRAY_SIZE(c->btree_reserve_cache)) {
+		struct btree_alloc *a =
+			&c->btree_reserve_cache[c->btree_reserve_cache_nr++];
+
+		a->ob = ob;
+		bkey_copy(&a->k, &tmp.k);
+	} else {
+		bch2_open_buckets_put(c, &ob);
+	}
+	mutex_unlock(&c->btree_reserve_cache_lock);
 }
 
 void bch2_btree_node_free_inmem(struct bch_fs *c, struct btree *b,
@@ -952,9 +968,9 @@ err:
 static void bch2_btree_set_root_inmem(struct bch_fs *c, struct btree *b)
 {
 	/* Root nodes cannot be reaped */
-	mutex_lock(&c->btree_cache.lock);
+	mutex_lock(&c->btree_cache.shard[b->cache_shard].lock);
 	list_del_init(&b->list);
-	mutex_unlock(&c->btree_cache.lock);
+	mutex_unlock(&c->btree_cache.shard[b->cache_shard].lock);
 
 	mutex_lock(&c->btree_root_lock);
 	BUG_ON(btree_node_root(c, b) &&
@@ -1049,7 +1065,8 @@ static struct btree *__btree_split_node(struct btree_update *as,
 	size_t nr_packed = 0, nr_unpacked = 0;
 	struct btree *n2;
 	struct bset *set1, *set2;
-	struct bkey_packed *k, *prev = NULL;
+	struct bkey_packed *k, *last, *prev = NULL;
+	unsigned split_u64s;
 
 	n2 = bch2_btree_node_alloc(as, n1->c.level);
 	bch2_btree_update_add_new_node(as, n2);
@@ -1064,6 +1081,30 @@ static struct btree *__btree_split_node(struct btree_update *as,
 	set1 = btree_bset_first(n1);
 	set2 = btree_bset_first(n2);
 
+	last = set1->start;
+	for (k = set1->start;
+	     k != vstruct_last(set1);
+	     k = bkey_next_skip_noops(k, vstruct_last(set1)))
+		last = k;
+
+	/*
+	 * With sorted ingests - sequential writes, migrate, journal replay -
+	 * every insert hits the node's right edge; an even split would leave
+	 * behind a trail of 60% full nodes that nothing ever comes back to
+	 * fill. Split unevenly when the insert is an append (or prepend, for
+	 * reverse sorted ingests), so the node that's done growing is left
+	 * nearly full and new keys land in the mostly empty one:
+	 */
+	if (bkey_cmp(iter->pos, bkey_unpack_pos(n1, last)) > 0)
+		split_u64s = (le16_to_cpu(set1->u64s) * 9) / 10;
+	else if (bkey_cmp(iter->pos, bkey_unpack_pos(n1, set1->start)) < 0)
+		split_u64s = (le16_to_cpu(set1->u64s) * 1) / 10;
+	else
+		split_u64s = (le16_to_cpu(set1->u64s) * 3) / 5;
+
+	/* n1 must keep at least one key: */
+	split_u64s = max_t(unsigned, split_u64s, 1);
+
 	/*
 	 * Has to be a linear search because we don't have an auxiliary
 	 * search tree yet
@@ -1074,7 +1115,7 @@ static struct btree *__btree_split_node(struct btree_update *as,
 
 		if (n == vstruct_last(set1))
 			break;
-		if (k->_data - set1->_data >= (le16_to_cpu(set1->u64s) * 3) / 5)
+		if (k->_data - set1->_data >= split_u64s)
 			break;
 
 		if (bkey_packed(k))
@@ -1525,8 +1566,8 @@ retry:
 	__bch2_btree_calc_format(&new_s, m);
 	new_f = bch2_bkey_format_done(&new_s);
 
-	sib_u64s = btree_node_u64s_with_format(b, &new_f) +
-		btree_node_u64s_with_format(m, &new_f);
+	sib_u64s = bch2_btree_node_u64s_with_format(b, &new_f) +
+		bch2_btree_node_u64s_with_format(m, &new_f);
 
 	if (sib_u64s > BTREE_FOREGROUND_MERGE_HYSTERESIS(c)) {
 		sib_u64s -= BTREE_FOREGROUND_MERGE_HYSTERESIS(c);
@@ -1902,9 +1943,7 @@ retry:
 	bch2_btree_iter_downgrade(iter);
 err:
 	if (new_hash) {
-		mutex_lock(&c->btree_cache.lock);
-		list_move(&new_hash->list, &c->btree_cache.freeable);
-		mutex_unlock(&c->btree_cache.lock);
+		bch2_btree_node_to_freeable(c, new_hash);
 
 		six_unlock_write(&new_hash->c.lock);
 		six_unlock_intent(&new_hash->c.lock);
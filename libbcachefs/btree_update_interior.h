@@ -7,6 +7,8 @@
 #include "btree_update.h"
 
 void __bch2_btree_calc_format(struct bkey_format_state *, struct btree *);
+size_t bch2_btree_node_u64s_with_format(struct btree *,
+					struct bkey_format *);
 bool bch2_btree_node_format_fits(struct bch_fs *c, struct btree *,
 				struct bkey_format *);
 
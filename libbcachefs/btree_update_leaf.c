@@ -319,11 +319,13 @@ static inline void do_btree_insert_one(struct btree_trans *trans,
 		return;
 
 	if (likely(!(trans->flags & BTREE_INSERT_JOURNAL_REPLAY))) {
-		bch2_journal_add_keys(j, &trans->journal_res,
-				      iter->btree_id, insert);
+		if (likely(!(trans->flags & BTREE_INSERT_NOJOURNAL))) {
+			bch2_journal_add_keys(j, &trans->journal_res,
+					      iter->btree_id, insert);
 
-		bch2_journal_set_has_inode(j, &trans->journal_res,
-					   insert->k.p.inode);
+			bch2_journal_set_has_inode(j, &trans->journal_res,
+						   insert->k.p.inode);
+		}
 
 		if (trans->journal_seq)
 			*trans->journal_seq = trans->journal_res.seq;
@@ -479,6 +481,14 @@ err:
 
 /*
  * Get journal reservation, take write locks, and attempt to do btree update(s):
+ *
+ * Note on leaf level concurrency: committers updating disjoint ranges of the
+ * same leaf don't serialize on each others' btree node _writes_ - inserts go
+ * into the in memory bsets and the journal, and a dirty node accumulates keys
+ * from many transactions before it's written out, so the node write is
+ * already a group commit. The write lock here is held just for the bset
+ * insert and journal reservation; it's the intent locks, held across the
+ * whole commit, that order committers on a leaf.
  */
 static inline int do_bch2_trans_commit(struct btree_trans *trans,
 				       struct btree_insert_entry **stopped_at)
@@ -920,6 +930,9 @@ int __bch2_trans_commit(struct btree_trans *trans)
 		BUG_ON(i->iter->uptodate > BTREE_ITER_NEED_PEEK);
 		BUG_ON(i->iter->locks_want < 1);
 
+		if (trans->flags & BTREE_INSERT_NOJOURNAL)
+			continue;
+
 		u64s = jset_u64s(i->k->k.u64s);
 		if (btree_iter_type(i->iter) == BTREE_ITER_CACHED &&
 		    likely(!(trans->flags & BTREE_INSERT_JOURNAL_REPLAY)))
@@ -937,6 +950,13 @@ retry:
 	if (ret)
 		goto err;
 
+	trans_for_each_update(trans, i)
+		if (i->iter->btree_id == BTREE_ID_EXTENTS ||
+		    i->iter->btree_id == BTREE_ID_REFLINK) {
+			atomic64_inc(&trans->c->extents_version);
+			break;
+		}
+
 	trans_for_each_iter(trans, iter)
 		if ((trans->iters_live & (1ULL << iter->idx)) &&
 		    (iter->flags & BTREE_ITER_SET_POS_AFTER_COMMIT)) {
@@ -1068,6 +1088,71 @@ int bch2_btree_insert(struct bch_fs *c, enum btree_id id,
 			     __bch2_btree_insert(&trans, id, k));
 }
 
+static int btree_insert_buf_trans(struct btree_trans *trans,
+				  struct btree_insert_buf *buf)
+{
+	struct bkey_i *k = (struct bkey_i *) buf->keys;
+	unsigned i;
+	int ret;
+
+	for (i = 0; i < buf->nr; i++) {
+		ret = __bch2_btree_insert(trans, buf->btree_ids[i], k);
+		if (ret)
+			return ret;
+		k = bkey_next(k);
+	}
+
+	return 0;
+}
+
+/**
+ * bch2_btree_insert_buf_flush - commit all buffered keys in one transaction
+ *
+ * The journal reservation and node locks are taken once for the whole batch;
+ * lock conflicts retry the batch internally, so unlike bch2_trans_commit()
+ * this never returns -EINTR.
+ */
+int bch2_btree_insert_buf_flush(struct btree_insert_buf *buf)
+{
+	int ret;
+
+	if (!buf->nr)
+		return 0;
+
+	ret = bch2_trans_do(buf->c, buf->disk_res, buf->journal_seq,
+			    buf->flags,
+			    btree_insert_buf_trans(&trans, buf));
+	buf->nr		= 0;
+	buf->u64s	= 0;
+	return ret;
+}
+
+/**
+ * bch2_btree_insert_buf_add - buffer up a key for group commit
+ *
+ * Copies @k into the buffer, flushing first if the buffer is full.
+ */
+int bch2_btree_insert_buf_add(struct btree_insert_buf *buf,
+			      enum btree_id id, struct bkey_i *k)
+{
+	int ret;
+
+	BUG_ON(k->k.u64s > BTREE_INSERT_BUF_U64s);
+
+	if (buf->nr == BTREE_INSERT_BUF_NR ||
+	    buf->u64s + k->k.u64s > BTREE_INSERT_BUF_U64s) {
+		ret = bch2_btree_insert_buf_flush(buf);
+		if (ret)
+			return ret;
+	}
+
+	buf->btree_ids[buf->nr] = id;
+	bkey_copy((struct bkey_i *) (buf->keys + buf->u64s), k);
+	buf->nr++;
+	buf->u64s += k->k.u64s;
+	return 0;
+}
+
 int bch2_btree_delete_at_range(struct btree_trans *trans,
 			       struct btree_iter *iter,
 			       struct bpos end,
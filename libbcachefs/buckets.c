@@ -65,6 +65,7 @@
 
 #include "bcachefs.h"
 #include "alloc_background.h"
+#include "backref.h"
 #include "bset.h"
 #include "btree_gc.h"
 #include "btree_update.h"
@@ -150,10 +151,17 @@ void bch2_fs_usage_initialize(struct bch_fs *c)
 
 void bch2_fs_usage_scratch_put(struct bch_fs *c, struct bch_fs_usage *fs_usage)
 {
-	if (fs_usage == c->usage_scratch)
+	if (fs_usage == c->usage_scratch) {
 		mutex_unlock(&c->usage_scratch_lock);
-	else
-		kfree(fs_usage);
+		return;
+	}
+
+	/*
+	 * Stash the buffer in this cpu's cache slot for the next commit; if
+	 * the slot is already occupied we lost a race and free our copy:
+	 */
+	fs_usage = this_cpu_xchg(*c->usage_scratch_cache, fs_usage);
+	kfree(fs_usage);
 }
 
 struct bch_fs_usage *bch2_fs_usage_scratch_get(struct bch_fs *c)
@@ -161,6 +169,12 @@ struct bch_fs_usage *bch2_fs_usage_scratch_get(struct bch_fs *c)
 	struct bch_fs_usage *ret;
 	unsigned bytes = fs_usage_u64s(c) * sizeof(u64);
 
+	ret = this_cpu_xchg(*c->usage_scratch_cache, NULL);
+	if (ret) {
+		memset(ret, 0, bytes);
+		return ret;
+	}
+
 	ret = kzalloc(bytes, GFP_NOWAIT|__GFP_NOWARN);
 	if (ret)
 		return ret;
@@ -179,6 +193,23 @@ out_pool:
 	return ret;
 }
 
+/*
+ * Drop all the per-cpu cached scratch buffers: called with mark_lock held for
+ * write when the replicas table (and thus the scratch buffer size) changes:
+ */
+void bch2_fs_usage_scratch_cache_clear(struct bch_fs *c)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		struct bch_fs_usage **p =
+			per_cpu_ptr(c->usage_scratch_cache, cpu);
+
+		kfree(*p);
+		*p = NULL;
+	}
+}
+
 struct bch_dev_usage bch2_dev_usage_read(struct bch_dev *ca)
 {
 	struct bch_dev_usage ret;
@@ -441,6 +472,23 @@ static inline void account_bucket(struct bch_fs_usage *fs_usage,
 	dev_usage->buckets[type]	+= nr;
 }
 
+/*
+ * Bin a bucket by fraction of live sectors, for the fragmentation index;
+ * returns -1 for buckets that aren't copygc candidates:
+ */
+static inline int bucket_frag_bin(struct bch_dev *ca, struct bucket_mark m)
+{
+	unsigned used = bucket_sectors_used(m);
+
+	if (m.owned_by_allocator ||
+	    m.data_type != BCH_DATA_user ||
+	    !used ||
+	    used >= ca->mi.bucket_size)
+		return -1;
+
+	return used * BCH_FRAG_BINS / ca->mi.bucket_size;
+}
+
 static void bch2_dev_usage_update(struct bch_fs *c, struct bch_dev *ca,
 				  struct bch_fs_usage *fs_usage,
 				  struct bucket_mark old, struct bucket_mark new,
@@ -450,6 +498,19 @@ static void bch2_dev_usage_update(struct bch_fs *c, struct bch_dev *ca,
 
 	percpu_rwsem_assert_held(&c->mark_lock);
 
+	/* gc updates the shadow copy, not the live bucket state: */
+	if (!gc) {
+		int old_bin = bucket_frag_bin(ca, old);
+		int new_bin = bucket_frag_bin(ca, new);
+
+		if (old_bin != new_bin) {
+			if (old_bin >= 0)
+				atomic_dec(&ca->frag_idx[old_bin]);
+			if (new_bin >= 0)
+				atomic_inc(&ca->frag_idx[new_bin]);
+		}
+	}
+
 	preempt_disable();
 	u = this_cpu_ptr(ca->usage[gc]);
 
@@ -498,6 +559,8 @@ void bch2_dev_usage_from_buckets(struct bch_fs *c)
 			memset(per_cpu_ptr(ca->usage[0], cpu), 0,
 			       sizeof(*ca->usage[0]));
 
+		memset(ca->frag_idx, 0, sizeof(ca->frag_idx));
+
 		buckets = bucket_array(ca);
 
 		for_each_bucket(g, buckets)
@@ -641,6 +704,23 @@ unwind:
 	ret;								\
 })
 
+/*
+ * Maintains ca->buckets_maybe_free, the hint bitmap for the allocator's bucket
+ * scans: must be called (for non gc bucket marks) on any transition that could
+ * make a bucket available. Setting bits spuriously is fine - the scans
+ * recheck the bucket mark, and clear bits for buckets they observe to be
+ * unavailable - but a bucket that could be available must never be left with
+ * its bit clear, or the allocator will never see it:
+ */
+static void bucket_maybe_free_update(struct bch_dev *ca, size_t b,
+				     struct bucket_mark m)
+{
+	if (ca->buckets_maybe_free &&
+	    is_available_bucket(m) &&
+	    !test_bit(b, ca->buckets_maybe_free))
+		set_bit(b, ca->buckets_maybe_free);
+}
+
 static int __bch2_invalidate_bucket(struct bch_fs *c, struct bch_dev *ca,
 				    size_t b, struct bucket_mark *ret,
 				    bool gc)
@@ -665,8 +745,12 @@ static int __bch2_invalidate_bucket(struct bch_fs *c, struct bch_dev *ca,
 		update_cached_sectors(c, fs_usage, ca->dev_idx,
 				      -((s64) old.cached_sectors));
 
-	if (!gc)
+	if (!gc) {
+		/* now owned by the allocator - definitely not available: */
+		if (ca->buckets_maybe_free)
+			clear_bit(b, ca->buckets_maybe_free);
 		*ret = old;
+	}
 	return 0;
 }
 
@@ -695,6 +779,9 @@ static int __bch2_mark_alloc_bucket(struct bch_fs *c, struct bch_dev *ca,
 
 	bch2_dev_usage_update(c, ca, fs_usage, old, new, gc);
 
+	if (!gc)
+		bucket_maybe_free_update(ca, b, new);
+
 	BUG_ON(!gc &&
 	       !owned_by_allocator && !old.owned_by_allocator);
 
@@ -758,6 +845,9 @@ static int bch2_mark_alloc(struct bch_fs *c,
 	if (!(flags & BTREE_TRIGGER_ALLOC_READ))
 		bch2_dev_usage_update(c, ca, fs_usage, old_m, m, gc);
 
+	if (!gc)
+		bucket_maybe_free_update(ca, new.k->p.offset, m);
+
 	g->io_time[READ]	= u.read_time;
 	g->io_time[WRITE]	= u.write_time;
 	g->oldest_gen		= u.oldest_gen;
@@ -844,6 +934,43 @@ void bch2_mark_metadata_bucket(struct bch_fs *c, struct bch_dev *ca,
 	preempt_enable();
 }
 
+static int __bch2_unmark_metadata_bucket(struct bch_fs *c, struct bch_dev *ca,
+					 size_t b, bool gc)
+{
+	struct bucket *g = __bucket(ca, b, gc);
+	struct bucket_mark old, new;
+
+	old = bucket_cmpxchg(g, new, ({
+		new.data_type		= 0;
+		new.dirty_sectors	= 0;
+	}));
+
+	if (c)
+		bch2_dev_usage_update(c, ca, fs_usage_ptr(c, 0, gc),
+				      old, new, gc);
+
+	if (!gc)
+		bucket_maybe_free_update(ca, b, new);
+
+	return 0;
+}
+
+void bch2_unmark_metadata_bucket(struct bch_fs *c, struct bch_dev *ca,
+				 size_t b, struct gc_pos pos,
+				 unsigned flags)
+{
+	preempt_disable();
+
+	if (likely(c)) {
+		do_mark_fn(__bch2_unmark_metadata_bucket, c, pos, flags,
+			   ca, b);
+	} else {
+		__bch2_unmark_metadata_bucket(c, ca, b, 0);
+	}
+
+	preempt_enable();
+}
+
 static s64 disk_sectors_scaled(unsigned n, unsigned d, unsigned sectors)
 {
 	return DIV_ROUND_UP(sectors * n, d);
@@ -904,6 +1031,9 @@ static void bucket_set_stripe(struct bch_fs *c,
 
 	bch2_dev_usage_update(c, ca, fs_usage, old, new, gc);
 
+	if (!gc)
+		bucket_maybe_free_update(ca, PTR_BUCKET_NR(ca, ptr), new);
+
 	/*
 	 * XXX write repair code for these, flag stripe as possibly bad
 	 */
@@ -1048,6 +1178,9 @@ static int bch2_mark_pointer(struct bch_fs *c, struct bkey_s_c k,
 
 	bch2_dev_usage_update(c, ca, fs_usage, old, new, gc);
 
+	if (!gc)
+		bucket_maybe_free_update(ca, PTR_BUCKET_NR(ca, &p.ptr), new);
+
 	BUG_ON(!gc && bucket_became_unavailable(old, new));
 
 	return 0;
@@ -1813,7 +1946,11 @@ int bch2_trans_mark_key(struct btree_trans *trans, struct bkey_s_c k,
 	case KEY_TYPE_extent:
 	case KEY_TYPE_reflink_v:
 		return bch2_trans_mark_extent(trans, k, offset, sectors,
-					      flags, BCH_DATA_user);
+					      flags, BCH_DATA_user) ?:
+			bch2_trans_mark_backrefs(trans, k,
+					k.k->type == KEY_TYPE_reflink_v
+					? BTREE_ID_REFLINK
+					: BTREE_ID_EXTENTS, flags);
 	case KEY_TYPE_inode:
 		d = replicas_deltas_realloc(trans, 0);
 
@@ -2021,6 +2158,7 @@ int bch2_dev_buckets_resize(struct bch_fs *c, struct bch_dev *ca, u64 nbuckets)
 {
 	struct bucket_array *buckets = NULL, *old_buckets = NULL;
 	unsigned long *buckets_nouse = NULL;
+	unsigned long *buckets_maybe_free = NULL;
 	alloc_fifo	free[RESERVE_NR];
 	alloc_fifo	free_inc;
 	alloc_heap	alloc_heap;
@@ -2046,6 +2184,9 @@ int bch2_dev_buckets_resize(struct bch_fs *c, struct bch_dev *ca, u64 nbuckets)
 	    !(buckets_nouse	= kvpmalloc(BITS_TO_LONGS(nbuckets) *
 					    sizeof(unsigned long),
 					    GFP_KERNEL|__GFP_ZERO)) ||
+	    !(buckets_maybe_free = kvpmalloc(BITS_TO_LONGS(nbuckets) *
+					    sizeof(unsigned long),
+					    GFP_KERNEL)) ||
 	    !init_fifo(&free[RESERVE_BTREE], btree_reserve, GFP_KERNEL) ||
 	    !init_fifo(&free[RESERVE_MOVINGGC],
 		       copygc_reserve, GFP_KERNEL) ||
@@ -2057,6 +2198,10 @@ int bch2_dev_buckets_resize(struct bch_fs *c, struct bch_dev *ca, u64 nbuckets)
 	buckets->first_bucket	= ca->mi.first_bucket;
 	buckets->nbuckets	= nbuckets;
 
+	/* all buckets start out as possibly available: */
+	memset(buckets_maybe_free, 0xff,
+	       BITS_TO_LONGS(nbuckets) * sizeof(unsigned long));
+
 	bch2_copygc_stop(c);
 
 	if (resize) {
@@ -2076,12 +2221,16 @@ int bch2_dev_buckets_resize(struct bch_fs *c, struct bch_dev *ca, u64 nbuckets)
 		memcpy(buckets_nouse,
 		       ca->buckets_nouse,
 		       BITS_TO_LONGS(n) * sizeof(unsigned long));
+		memcpy(buckets_maybe_free,
+		       ca->buckets_maybe_free,
+		       BITS_TO_LONGS(n) * sizeof(unsigned long));
 	}
 
 	rcu_assign_pointer(ca->buckets[0], buckets);
 	buckets = old_buckets;
 
 	swap(ca->buckets_nouse, buckets_nouse);
+	swap(ca->buckets_maybe_free, buckets_maybe_free);
 
 	if (resize) {
 		percpu_up_write(&c->mark_lock);
@@ -2113,6 +2262,8 @@ err:
 		free_fifo(&free[i]);
 	kvpfree(buckets_nouse,
 		BITS_TO_LONGS(nbuckets) * sizeof(unsigned long));
+	kvpfree(buckets_maybe_free,
+		BITS_TO_LONGS(nbuckets) * sizeof(unsigned long));
 	if (buckets)
 		call_rcu(&old_buckets->rcu, buckets_free_rcu);
 
@@ -2129,6 +2280,8 @@ void bch2_dev_buckets_free(struct bch_dev *ca)
 		free_fifo(&ca->free[i]);
 	kvpfree(ca->buckets_nouse,
 		BITS_TO_LONGS(ca->mi.nbuckets) * sizeof(unsigned long));
+	kvpfree(ca->buckets_maybe_free,
+		BITS_TO_LONGS(ca->mi.nbuckets) * sizeof(unsigned long));
 	kvpfree(rcu_dereference_protected(ca->buckets[0], 1),
 		sizeof(struct bucket_array) +
 		ca->mi.nbuckets * sizeof(struct bucket));
@@ -231,6 +231,7 @@ static inline unsigned fs_usage_u64s(struct bch_fs *c)
 
 void bch2_fs_usage_scratch_put(struct bch_fs *, struct bch_fs_usage *);
 struct bch_fs_usage *bch2_fs_usage_scratch_get(struct bch_fs *);
+void bch2_fs_usage_scratch_cache_clear(struct bch_fs *);
 
 u64 bch2_fs_usage_read_one(struct bch_fs *, u64 *);
 
@@ -258,6 +259,8 @@ void bch2_mark_alloc_bucket(struct bch_fs *, struct bch_dev *,
 void bch2_mark_metadata_bucket(struct bch_fs *, struct bch_dev *,
 			       size_t, enum bch_data_type, unsigned,
 			       struct gc_pos, unsigned);
+void bch2_unmark_metadata_bucket(struct bch_fs *, struct bch_dev *,
+				 size_t, struct gc_pos, unsigned);
 
 int bch2_mark_key(struct bch_fs *, struct bkey_s_c, unsigned,
 		  s64, struct bch_fs_usage *, u64, unsigned);
@@ -132,4 +132,14 @@ struct copygc_heap_entry {
 
 typedef HEAP(struct copygc_heap_entry) copygc_heap;
 
+/*
+ * Buckets copygc is currently evacuating, published (RCU) so other background
+ * tasks can avoid moving the same data: see bch2_copygc_will_move().
+ */
+struct copygc_pending {
+	struct rcu_head		rcu;
+	unsigned		nr;
+	struct copygc_heap_entry d[];
+};
+
 #endif /* _BUCKETS_TYPES_H */
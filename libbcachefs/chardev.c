@@ -3,8 +3,10 @@
 
 #include "bcachefs.h"
 #include "bcachefs_ioctl.h"
+#include "btree_cache.h"
 #include "buckets.h"
 #include "chardev.h"
+#include "journal.h"
 #include "move.h"
 #include "replicas.h"
 #include "super.h"
@@ -18,9 +20,11 @@
 #include <linux/ioctl.h>
 #include <linux/kthread.h>
 #include <linux/major.h>
+#include <linux/mm.h>
 #include <linux/sched/task.h>
 #include <linux/slab.h>
 #include <linux/uaccess.h>
+#include <linux/vmalloc.h>
 
 /* returns with ref on ca->ref */
 static struct bch_dev *bch2_device_lookup(struct bch_fs *c, u64 dev,
@@ -273,6 +277,11 @@ struct bch_data_ctx {
 
 	int				ret;
 
+	/* rate estimate, updated when the progress fd is read: */
+	u64				sectors_per_sec_ewma;
+	u64				last_read_time;
+	u64				last_sectors_done;
+
 	struct task_struct		*thread;
 };
 
@@ -301,18 +310,39 @@ static ssize_t bch2_data_job_read(struct file *file, char __user *buf,
 {
 	struct bch_data_ctx *ctx = file->private_data;
 	struct bch_fs *c = ctx->c;
+	u64 done = atomic64_read(&ctx->stats.sectors_seen);
+	u64 now = local_clock();
 	struct bch_ioctl_data_event e = {
 		.type			= BCH_DATA_EVENT_PROGRESS,
 		.p.data_type		= ctx->stats.data_type,
 		.p.btree_id		= ctx->stats.btree_id,
 		.p.pos			= ctx->stats.pos,
-		.p.sectors_done		= atomic64_read(&ctx->stats.sectors_seen),
+		.p.sectors_done		= done,
 		.p.sectors_total	= bch2_fs_usage_read_short(c).used,
 	};
 
 	if (len < sizeof(e))
 		return -EINVAL;
 
+	if (ctx->last_read_time && now > ctx->last_read_time) {
+		u64 rate = div64_u64((done - ctx->last_sectors_done) *
+				     NSEC_PER_SEC,
+				     now - ctx->last_read_time);
+
+		ctx->sectors_per_sec_ewma =
+			ewma_add(ctx->sectors_per_sec_ewma, rate, 2);
+	}
+
+	ctx->last_read_time	= now;
+	ctx->last_sectors_done	= done;
+
+	e.p.sectors_per_sec	= ctx->sectors_per_sec_ewma;
+	e.p.eta_sec		= ctx->sectors_per_sec_ewma &&
+				  e.p.sectors_total > done
+		? div64_u64(e.p.sectors_total - done,
+			    ctx->sectors_per_sec_ewma)
+		: U64_MAX;
+
 	return copy_to_user(buf, &e, sizeof(e)) ?: sizeof(e);
 }
 
@@ -487,6 +517,487 @@ static long bch2_ioctl_dev_usage(struct bch_fs *c,
 	return copy_to_user(user_arg, &arg, sizeof(arg));
 }
 
+static long bch2_ioctl_usage_all(struct bch_fs *c,
+				 struct bch_ioctl_usage_all __user *user_arg)
+{
+	struct bch_ioctl_usage_all hdr;
+	struct bch_ioctl_usage_all *arg = NULL;
+	struct bch_ioctl_dev_usage *dev_e;
+	struct bch_replicas_usage *dst_e, *dst_end;
+	struct bch_fs_usage *src;
+	size_t devs_bytes;
+	unsigned i;
+	int ret = 0;
+
+	if (!test_bit(BCH_FS_STARTED, &c->flags))
+		return -EINVAL;
+
+	if (copy_from_user(&hdr, user_arg, sizeof(hdr)))
+		return -EFAULT;
+
+	if (!hdr.version || hdr.pad)
+		return -EINVAL;
+
+	devs_bytes = hdr.nr_devices * sizeof(*dev_e);
+
+	arg = kzalloc(sizeof(*arg) + devs_bytes +
+		      hdr.replica_entries_bytes, GFP_KERNEL);
+	if (!arg)
+		return -ENOMEM;
+
+	/* returns with mark_lock held - the whole snapshot is consistent: */
+	src = bch2_fs_usage_read(c);
+	if (!src) {
+		ret = -ENOMEM;
+		goto err;
+	}
+
+	arg->version		= BCH_IOCTL_USAGE_ALL_VERSION;
+	arg->nr_devices		= c->sb.nr_devices;
+	arg->capacity		= c->capacity;
+	arg->used		= bch2_fs_sectors_used(c, src);
+	arg->online_reserved	= src->online_reserved;
+
+	for (i = 0; i < BCH_REPLICAS_MAX; i++)
+		arg->persistent_reserved[i] = src->persistent_reserved[i];
+
+	if (c->sb.nr_devices > hdr.nr_devices)
+		ret = -ERANGE;
+
+	dev_e = (void *) arg->data;
+
+	rcu_read_lock();
+	for (i = 0; i < min_t(unsigned, c->sb.nr_devices, hdr.nr_devices); i++) {
+		struct bch_ioctl_dev_usage *d = dev_e + i;
+		struct bch_dev *ca = rcu_dereference(c->devs[i]);
+		struct bch_dev_usage u;
+		unsigned j;
+
+		if (!ca)
+			continue;
+
+		u = bch2_dev_usage_read(ca);
+
+		d->dev			= i;
+		d->state		= ca->mi.state;
+		d->bucket_size		= ca->mi.bucket_size;
+		d->nr_buckets		= ca->mi.nbuckets - ca->mi.first_bucket;
+		d->available_buckets	= d->nr_buckets - u.buckets_unavailable;
+		d->ec_buckets		= u.buckets_ec;
+		d->ec_sectors		= u.sectors_ec;
+
+		for (j = 0; j < BCH_DATA_NR; j++) {
+			d->buckets[j] = u.buckets[j];
+			d->sectors[j] = u.sectors[j];
+		}
+	}
+	rcu_read_unlock();
+
+	dst_e	= (void *) arg->data + devs_bytes;
+	dst_end = (void *) dst_e + hdr.replica_entries_bytes;
+
+	for (i = 0; i < c->replicas.nr; i++) {
+		struct bch_replicas_entry *src_e =
+			cpu_replicas_entry(&c->replicas, i);
+
+		if (replicas_usage_next(dst_e) > dst_end) {
+			ret = -ERANGE;
+			break;
+		}
+
+		dst_e->sectors		= src->replicas[i];
+		dst_e->r		= *src_e;
+
+		/* recheck after setting nr_devs: */
+		if (replicas_usage_next(dst_e) > dst_end) {
+			ret = -ERANGE;
+			break;
+		}
+
+		memcpy(dst_e->r.devs, src_e->devs, src_e->nr_devs);
+
+		dst_e = replicas_usage_next(dst_e);
+	}
+
+	arg->replica_entries_bytes =
+		(void *) dst_e - ((void *) arg->data + devs_bytes);
+
+	percpu_up_read(&c->mark_lock);
+	kfree(src);
+
+	if (!ret)
+		ret = copy_to_user(user_arg, arg,
+			sizeof(*arg) + devs_bytes +
+			arg->replica_entries_bytes);
+err:
+	kfree(arg);
+	return ret;
+}
+
+struct bch_usage_map {
+	struct bch_fs		*c;
+	void			*buf;
+	size_t			bytes;
+	unsigned		update_ms;
+	struct delayed_work	work;
+};
+
+static void bch2_usage_map_update(struct work_struct *work)
+{
+	struct bch_usage_map *m =
+		container_of(work, struct bch_usage_map, work.work);
+	struct bch_fs *c = m->c;
+	struct bch_usage_map_hdr *hdr = m->buf;
+	struct bch_ioctl_dev_usage *dev_e = (void *) (hdr + 1);
+	struct bch_ioctl_fs_usage *fs_u =
+		(void *) (dev_e + hdr->nr_devs);
+	struct bch_replicas_usage *dst_e, *dst_end;
+	struct bch_fs_usage *src;
+	unsigned i;
+
+	/* returns with mark_lock held - the whole snapshot is consistent: */
+	src = bch2_fs_usage_read(c);
+	if (!src)
+		goto requeue;
+
+	/*
+	 * Odd seq marks the contents unstable: readers check it before and
+	 * after copying out, and retry on mismatch:
+	 */
+	hdr->seq++;
+	smp_wmb();
+
+	hdr->flags = 0;
+
+	memset(dev_e, 0, hdr->nr_devs * sizeof(*dev_e));
+
+	rcu_read_lock();
+	for (i = 0; i < min_t(unsigned, c->sb.nr_devices, hdr->nr_devs); i++) {
+		struct bch_ioctl_dev_usage *d = dev_e + i;
+		struct bch_dev *ca = rcu_dereference(c->devs[i]);
+		struct bch_dev_usage u;
+		unsigned j;
+
+		if (!ca)
+			continue;
+
+		u = bch2_dev_usage_read(ca);
+
+		d->dev			= i;
+		d->state		= ca->mi.state;
+		d->bucket_size		= ca->mi.bucket_size;
+		d->nr_buckets		= ca->mi.nbuckets - ca->mi.first_bucket;
+		d->available_buckets	= d->nr_buckets - u.buckets_unavailable;
+		d->ec_buckets		= u.buckets_ec;
+		d->ec_sectors		= u.sectors_ec;
+
+		for (j = 0; j < BCH_DATA_NR; j++) {
+			d->buckets[j] = u.buckets[j];
+			d->sectors[j] = u.sectors[j];
+		}
+	}
+	rcu_read_unlock();
+
+	memset(fs_u, 0, sizeof(*fs_u));
+	fs_u->capacity		= c->capacity;
+	fs_u->used		= bch2_fs_sectors_used(c, src);
+	fs_u->online_reserved	= src->online_reserved;
+
+	for (i = 0; i < BCH_REPLICAS_MAX; i++)
+		fs_u->persistent_reserved[i] = src->persistent_reserved[i];
+
+	dst_e	= fs_u->replicas;
+	dst_end = m->buf + m->bytes;
+
+	for (i = 0; i < c->replicas.nr; i++) {
+		struct bch_replicas_entry *src_e =
+			cpu_replicas_entry(&c->replicas, i);
+
+		if (replicas_usage_next(dst_e) > dst_end) {
+			hdr->flags |= BCH_USAGE_MAP_TRUNCATED;
+			break;
+		}
+
+		dst_e->sectors		= src->replicas[i];
+		dst_e->r		= *src_e;
+
+		/* recheck after setting nr_devs: */
+		if (replicas_usage_next(dst_e) > dst_end) {
+			hdr->flags |= BCH_USAGE_MAP_TRUNCATED;
+			break;
+		}
+
+		memcpy(dst_e->r.devs, src_e->devs, src_e->nr_devs);
+
+		dst_e = replicas_usage_next(dst_e);
+	}
+
+	fs_u->replica_entries_bytes = (void *) dst_e - (void *) fs_u->replicas;
+	hdr->fs_usage_bytes = fs_u->replica_entries_bytes;
+
+	percpu_up_read(&c->mark_lock);
+	kfree(src);
+
+	smp_wmb();
+	hdr->seq++;
+requeue:
+	schedule_delayed_work(&m->work, msecs_to_jiffies(m->update_ms));
+}
+
+static int bch2_usage_map_release(struct inode *inode, struct file *file)
+{
+	struct bch_usage_map *m = file->private_data;
+
+	cancel_delayed_work_sync(&m->work);
+	vfree(m->buf);
+	kfree(m);
+	return 0;
+}
+
+static int bch2_usage_map_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct bch_usage_map *m = file->private_data;
+
+	if (vma->vm_flags & VM_WRITE)
+		return -EPERM;
+
+	return remap_vmalloc_range(vma, m->buf, vma->vm_pgoff);
+}
+
+static const struct file_operations bcachefs_usage_map_ops = {
+	.release	= bch2_usage_map_release,
+	.mmap		= bch2_usage_map_mmap,
+	.llseek		= no_llseek,
+};
+
+static long bch2_ioctl_usage_map(struct bch_fs *c,
+				 struct bch_ioctl_usage_map arg)
+{
+	struct bch_usage_map *m;
+	struct bch_usage_map_hdr *hdr;
+	struct file *file = NULL;
+	unsigned flags = O_RDONLY|O_CLOEXEC;
+	size_t bytes;
+	int ret, fd = -1;
+
+	if (!test_bit(BCH_FS_STARTED, &c->flags))
+		return -EINVAL;
+
+	if (arg.update_ms < 10 || arg.update_ms > 60000)
+		return -EINVAL;
+
+	bytes = round_up(max_t(size_t, arg.bytes,
+			sizeof(struct bch_usage_map_hdr) +
+			c->sb.nr_devices *
+			sizeof(struct bch_ioctl_dev_usage) +
+			sizeof(struct bch_ioctl_fs_usage) + 4096),
+		PAGE_SIZE);
+	if (bytes > 1U << 20)
+		return -EINVAL;
+
+	m = kzalloc(sizeof(*m), GFP_KERNEL);
+	if (!m)
+		return -ENOMEM;
+
+	m->c		= c;
+	m->bytes	= bytes;
+	m->update_ms	= arg.update_ms;
+	m->buf		= vmalloc_user(bytes);
+	if (!m->buf) {
+		ret = -ENOMEM;
+		goto err;
+	}
+
+	hdr		= m->buf;
+	hdr->version	= BCH_USAGE_MAP_VERSION;
+	hdr->nr_devs	= c->sb.nr_devices;
+
+	INIT_DELAYED_WORK(&m->work, bch2_usage_map_update);
+
+	ret = get_unused_fd_flags(flags);
+	if (ret < 0)
+		goto err;
+	fd = ret;
+
+	file = anon_inode_getfile("[bcachefs]", &bcachefs_usage_map_ops,
+				  m, flags);
+	if (IS_ERR(file)) {
+		ret = PTR_ERR(file);
+		goto err;
+	}
+
+	/*
+	 * Fill synchronously so the mapping is never empty; this also kicks
+	 * off the periodic updates:
+	 */
+	bch2_usage_map_update(&m->work.work);
+
+	fd_install(fd, file);
+	return fd;
+err:
+	if (fd >= 0)
+		put_unused_fd(fd);
+	if (m)
+		vfree(m->buf);
+	kfree(m);
+	return ret;
+}
+
+static void *metrics_emit(void *p, unsigned type, unsigned id, size_t bytes)
+{
+	struct bch_metric_hdr *hdr = p;
+
+	hdr->type	= type;
+	hdr->pad	= 0;
+	hdr->id		= id;
+	hdr->bytes	= bytes;
+
+	return hdr + 1;
+}
+
+static void *metrics_emit_time_stats(void *p, unsigned type, unsigned id,
+				     struct time_stats *stats)
+{
+	struct bch_metric_time_stats *t;
+	unsigned long flags;
+	u64 *hist;
+	unsigned i;
+	int cpu;
+
+	p = metrics_emit(p, type, id, sizeof(*t) +
+			 TIME_STATS_HIST_NR * sizeof(u64));
+	t = p;
+
+	spin_lock_irqsave(&stats->lock, flags);
+	t->count		= stats->count;
+	t->average_duration	= stats->average_duration;
+	t->average_frequency	= stats->average_frequency;
+	t->max_duration		= stats->max_duration;
+	spin_unlock_irqrestore(&stats->lock, flags);
+
+	hist = (u64 *) (t + 1);
+	memset(hist, 0, TIME_STATS_HIST_NR * sizeof(u64));
+
+	for_each_possible_cpu(cpu)
+		for (i = 0; i < TIME_STATS_HIST_NR; i++)
+			hist[i] += *(per_cpu_ptr(stats->hist, cpu) + i);
+
+	return hist + TIME_STATS_HIST_NR;
+}
+
+static long bch2_ioctl_metrics(struct bch_fs *c,
+			       struct bch_ioctl_metrics __user *user_arg)
+{
+	struct bch_ioctl_metrics arg;
+	struct bch_dev *ca;
+	size_t bytes = 0;
+	void *buf, *p;
+	unsigned i, rw;
+	int ret = 0;
+
+	if (!test_bit(BCH_FS_STARTED, &c->flags))
+		return -EINVAL;
+
+	if (copy_from_user(&arg, user_arg, sizeof(arg)))
+		return -EFAULT;
+
+	if (!arg.version || arg.pad)
+		return -EINVAL;
+
+	bytes += 4 * (sizeof(struct bch_metric_hdr) + sizeof(u64));
+	bytes += BCH_TIME_STAT_NR *
+		(sizeof(struct bch_metric_hdr) +
+		 sizeof(struct bch_metric_time_stats) +
+		 TIME_STATS_HIST_NR * sizeof(u64));
+
+	rcu_read_lock();
+	for (i = 0; i < c->sb.nr_devices; i++)
+		if (rcu_dereference(c->devs[i]))
+			bytes += 2 * (sizeof(struct bch_metric_hdr) +
+				      sizeof(struct bch_metric_time_stats) +
+				      TIME_STATS_HIST_NR * sizeof(u64)) +
+				sizeof(struct bch_metric_hdr) +
+				sizeof(u64) * 2 * BCH_DATA_NR;
+	rcu_read_unlock();
+
+	if (bytes > arg.bytes) {
+		arg.bytes = bytes;
+		if (copy_to_user(user_arg, &arg, sizeof(arg)))
+			return -EFAULT;
+		return -ERANGE;
+	}
+
+	buf = kvpmalloc(bytes, GFP_KERNEL);
+	if (!buf)
+		return -ENOMEM;
+
+	p = buf;
+
+	p = metrics_emit(p, BCH_METRIC_counter,
+			 BCH_COUNTER_read_realloc_races, sizeof(u64));
+	*(u64 *) p = atomic_long_read(&c->read_realloc_races);
+	p += sizeof(u64);
+
+	p = metrics_emit(p, BCH_METRIC_counter,
+			 BCH_COUNTER_extent_migrate_done, sizeof(u64));
+	*(u64 *) p = atomic_long_read(&c->extent_migrate_done);
+	p += sizeof(u64);
+
+	p = metrics_emit(p, BCH_METRIC_counter,
+			 BCH_COUNTER_extent_migrate_raced, sizeof(u64));
+	*(u64 *) p = atomic_long_read(&c->extent_migrate_raced);
+	p += sizeof(u64);
+
+	p = metrics_emit(p, BCH_METRIC_counter,
+			 BCH_COUNTER_btree_cache_size, sizeof(u64));
+	*(u64 *) p = bch2_btree_cache_size(c);
+	p += sizeof(u64);
+
+	for (i = 0; i < BCH_TIME_STAT_NR; i++)
+		p = metrics_emit_time_stats(p, BCH_METRIC_time_stats, i,
+					    &c->times[i]);
+
+	rcu_read_lock();
+	for (i = 0; i < c->sb.nr_devices; i++) {
+		struct io_count io = { 0 };
+		unsigned j;
+		int cpu;
+
+		ca = rcu_dereference(c->devs[i]);
+		if (!ca)
+			continue;
+
+		for (rw = 0; rw < 2; rw++)
+			p = metrics_emit_time_stats(p,
+					BCH_METRIC_dev_time_stats,
+					(i << 1)|rw, &ca->io_latency[rw]);
+
+		for_each_possible_cpu(cpu)
+			for (rw = 0; rw < 2; rw++)
+				for (j = 0; j < BCH_DATA_NR; j++)
+					io.sectors[rw][j] +=
+						per_cpu_ptr(ca->io_done, cpu)->sectors[rw][j];
+
+		p = metrics_emit(p, BCH_METRIC_dev_io_done, i,
+				 sizeof(u64) * 2 * BCH_DATA_NR);
+		memcpy(p, io.sectors, sizeof(io.sectors));
+		p += sizeof(io.sectors);
+	}
+	rcu_read_unlock();
+
+	BUG_ON(p != buf + bytes);
+
+	arg.version	= BCH_IOCTL_METRICS_VERSION;
+	arg.bytes	= bytes;
+
+	if (copy_to_user((void __user *)(unsigned long) arg.buf, buf, bytes) ||
+	    copy_to_user(user_arg, &arg, sizeof(arg)))
+		ret = -EFAULT;
+
+	kvpfree(buf, bytes);
+	return ret;
+}
+
 static long bch2_ioctl_read_super(struct bch_fs *c,
 				  struct bch_ioctl_read_super arg)
 {
@@ -563,6 +1074,26 @@ static long bch2_ioctl_disk_resize(struct bch_fs *c,
 	return ret;
 }
 
+static long bch2_ioctl_disk_resize_journal(struct bch_fs *c,
+				   struct bch_ioctl_disk_resize_journal arg)
+{
+	struct bch_dev *ca;
+	int ret;
+
+	if ((arg.flags & ~BCH_BY_INDEX) ||
+	    arg.pad)
+		return -EINVAL;
+
+	ca = bch2_device_lookup(c, arg.dev, arg.flags);
+	if (IS_ERR(ca))
+		return PTR_ERR(ca);
+
+	ret = bch2_set_nr_journal_buckets(c, ca, arg.nbuckets);
+
+	percpu_ref_put(&ca->ref);
+	return ret;
+}
+
 #define BCH_IOCTL(_name, _argtype)					\
 do {									\
 	_argtype i;							\
@@ -582,6 +1113,12 @@ long bch2_fs_ioctl(struct bch_fs *c, unsigned cmd, void __user *arg)
 		return bch2_ioctl_fs_usage(c, arg);
 	case BCH_IOCTL_DEV_USAGE:
 		return bch2_ioctl_dev_usage(c, arg);
+	case BCH_IOCTL_USAGE_ALL:
+		return bch2_ioctl_usage_all(c, arg);
+	case BCH_IOCTL_METRICS:
+		return bch2_ioctl_metrics(c, arg);
+	case BCH_IOCTL_USAGE_MAP:
+		BCH_IOCTL(usage_map, struct bch_ioctl_usage_map);
 	}
 
 	if (!capable(CAP_SYS_ADMIN))
@@ -619,6 +1156,8 @@ long bch2_fs_ioctl(struct bch_fs *c, unsigned cmd, void __user *arg)
 		BCH_IOCTL(data, struct bch_ioctl_data);
 	case BCH_IOCTL_DISK_RESIZE:
 		BCH_IOCTL(disk_resize, struct bch_ioctl_disk_resize);
+	case BCH_IOCTL_DISK_RESIZE_JOURNAL:
+		BCH_IOCTL(disk_resize_journal, struct bch_ioctl_disk_resize_journal);
 
 	default:
 		return -ENOTTY;
@@ -262,6 +262,20 @@ void bch2_encrypt_bio(struct bch_fs *c, unsigned type,
 	sg_init_table(sgl, ARRAY_SIZE(sgl));
 
 	bio_for_each_segment(bv, bio, iter) {
+		/*
+		 * Bio segments are almost always virtually contiguous here -
+		 * merge them, so that whole bios go to chacha20 as single
+		 * calls instead of 16 segments at a time, each batch paying
+		 * for a fresh cipher state setup:
+		 */
+		if (sg != sgl &&
+		    page_address(bv.bv_page) + bv.bv_offset ==
+		    sg_virt(sg - 1) + (sg - 1)->length) {
+			(sg - 1)->length += bv.bv_len;
+			bytes += bv.bv_len;
+			continue;
+		}
+
 		if (sg == sgl + ARRAY_SIZE(sgl)) {
 			sg_mark_end(sg - 1);
 			do_encrypt_sg(c->chacha20, nonce, sgl, bytes);
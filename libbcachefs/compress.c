@@ -10,6 +10,15 @@
 #include <linux/zlib.h>
 #include <linux/zstd.h>
 
+/*
+ * Extents up to this size are compressed with the filesystem's trained zstd
+ * dictionary when one is present - stateless zstd does poorly on small
+ * inputs. Frames written with the dictionary embed its ID, so frames written
+ * without it (larger extents, or extents older than the dictionary) still
+ * decompress correctly when the dictionary is passed:
+ */
+#define BCH_ZSTD_DICT_MAX_SRC_LEN	(16U << 10)
+
 /* Bounce buffer: */
 struct bbuf {
 	void		*b;
@@ -150,6 +159,105 @@ static inline void zlib_set_workspace(z_stream *strm, void *workspace)
 #endif
 }
 
+/*
+ * Per thread workspace cache: in userspace mempool_alloc() is just a malloc,
+ * so going through the workspace mempools meant a multi megabyte allocation
+ * per compress/decompress call - and for zstd, reinitializing the compression
+ * context from scratch each time. Cache one workspace per compression type
+ * per thread instead, so concurrent rebalance/move threads never contend or
+ * reallocate; freed when the thread exits:
+ */
+
+struct compress_ws_cache {
+	void		*ws[BCH_COMPRESSION_TYPE_NR];
+	size_t		ws_size[BCH_COMPRESSION_TYPE_NR];
+	void		*decompress_ws;
+	size_t		decompress_ws_size;
+};
+
+static __thread struct compress_ws_cache *compress_ws_cache;
+static pthread_key_t compress_ws_key;
+static pthread_once_t compress_ws_once = PTHREAD_ONCE_INIT;
+
+static void compress_ws_cache_free(void *_cache)
+{
+	struct compress_ws_cache *cache = _cache;
+	unsigned i;
+
+	for (i = 0; i < BCH_COMPRESSION_TYPE_NR; i++)
+		kvpfree(cache->ws[i], cache->ws_size[i]);
+	kvpfree(cache->decompress_ws, cache->decompress_ws_size);
+	kfree(cache);
+}
+
+static void compress_ws_key_init(void)
+{
+	BUG_ON(pthread_key_create(&compress_ws_key, compress_ws_cache_free));
+}
+
+static struct compress_ws_cache *compress_ws_cache_get(void)
+{
+	struct compress_ws_cache *cache = compress_ws_cache;
+
+	if (unlikely(!cache)) {
+		pthread_once(&compress_ws_once, compress_ws_key_init);
+
+		cache = kzalloc(sizeof(*cache), GFP_NOIO);
+		BUG_ON(!cache);
+		BUG_ON(pthread_setspecific(compress_ws_key, cache));
+		compress_ws_cache = cache;
+	}
+
+	return cache;
+}
+
+static void *compress_ws_resize(void **ws, size_t *ws_size, size_t size)
+{
+	if (*ws_size < size) {
+		kvpfree(*ws, *ws_size);
+		*ws		= kvpmalloc(size, GFP_NOIO);
+		BUG_ON(!*ws);
+		*ws_size	= size;
+	}
+
+	return *ws;
+}
+
+static void *compress_workspace_get(struct bch_fs *c,
+				    enum bch_compression_type compression_type)
+{
+	struct compress_ws_cache *cache = compress_ws_cache_get();
+	size_t size;
+
+	switch (compression_type) {
+	case BCH_COMPRESSION_TYPE_lz4_old:
+	case BCH_COMPRESSION_TYPE_lz4:
+		size = LZ4_MEM_COMPRESS;
+		break;
+	case BCH_COMPRESSION_TYPE_gzip:
+		size = zlib_deflate_workspacesize(MAX_WBITS, DEF_MEM_LEVEL);
+		break;
+	case BCH_COMPRESSION_TYPE_zstd:
+		size = ZSTD_CCtxWorkspaceBound(c->zstd_params.cParams);
+		break;
+	default:
+		BUG();
+	}
+
+	return compress_ws_resize(&cache->ws[compression_type],
+				  &cache->ws_size[compression_type], size);
+}
+
+static void *decompress_workspace_get(struct bch_fs *c)
+{
+	struct compress_ws_cache *cache = compress_ws_cache_get();
+	size_t size = max_t(size_t, zlib_inflate_workspacesize(),
+			    ZSTD_DCtxWorkspaceBound());
+
+	return compress_ws_resize(&cache->decompress_ws,
+				  &cache->decompress_ws_size, size);
+}
+
 static int __bio_uncompress(struct bch_fs *c, struct bio *src,
 			    void *dst_data, struct bch_extent_crc_unpacked crc)
 {
@@ -177,14 +285,12 @@ static int __bio_uncompress(struct bch_fs *c, struct bio *src,
 			.avail_out	= dst_len,
 		};
 
-		workspace = mempool_alloc(&c->decompress_workspace, GFP_NOIO);
+		workspace = decompress_workspace_get(c);
 
 		zlib_set_workspace(&strm, workspace);
 		zlib_inflateInit2(&strm, -MAX_WBITS);
 		ret = zlib_inflate(&strm, Z_FINISH);
 
-		mempool_free(workspace, &c->decompress_workspace);
-
 		if (ret != Z_STREAM_END)
 			goto err;
 		break;
@@ -196,14 +302,18 @@ static int __bio_uncompress(struct bch_fs *c, struct bio *src,
 		if (real_src_len > src_len - 4)
 			goto err;
 
-		workspace = mempool_alloc(&c->decompress_workspace, GFP_NOIO);
+		workspace = decompress_workspace_get(c);
 		ctx = ZSTD_initDCtx(workspace, ZSTD_DCtxWorkspaceBound());
 
-		ret = ZSTD_decompressDCtx(ctx,
-				dst_data,	dst_len,
-				src_data.b + 4, real_src_len);
-
-		mempool_free(workspace, &c->decompress_workspace);
+		if (c->zstd_dict)
+			ret = ZSTD_decompress_usingDict(ctx,
+					dst_data,	dst_len,
+					src_data.b + 4, real_src_len,
+					c->zstd_dict,	c->zstd_dict_size);
+		else
+			ret = ZSTD_decompressDCtx(ctx,
+					dst_data,	dst_len,
+					src_data.b + 4, real_src_len);
 
 		if (ret != dst_len)
 			goto err;
@@ -335,8 +445,16 @@ static int attempt_compress(struct bch_fs *c,
 	case BCH_COMPRESSION_TYPE_zstd: {
 		ZSTD_CCtx *ctx = ZSTD_initCCtx(workspace,
 			ZSTD_CCtxWorkspaceBound(c->zstd_params.cParams));
+		size_t len;
 
-		size_t len = ZSTD_compressCCtx(ctx,
+		if (c->zstd_dict && src_len <= BCH_ZSTD_DICT_MAX_SRC_LEN)
+			len = ZSTD_compress_usingDict(ctx,
+				dst + 4,	dst_len - 4,
+				src,		src_len,
+				c->zstd_dict,	c->zstd_dict_size,
+				c->zstd_params);
+		else
+			len = ZSTD_compressCCtx(ctx,
 				dst + 4,	dst_len - 4,
 				src,		src_len,
 				c->zstd_params);
@@ -351,6 +469,32 @@ static int attempt_compress(struct bch_fs *c,
 	}
 }
 
+/*
+ * Simple buffer to buffer helpers, for compressing things that aren't extents
+ * (currently just the journal write path). These don't touch the mempools, so
+ * they work even when compression isn't enabled for data:
+ */
+int bch2_lz4_compress(struct bch_fs *c, void *dst, size_t dst_len,
+		      const void *src, size_t src_len)
+{
+	void *workspace = compress_workspace_get(c, BCH_COMPRESSION_TYPE_lz4);
+	int len = src_len;
+	int ret = LZ4_compress_destSize((void *) src, dst, &len,
+					dst_len, workspace);
+
+	/* Only useful if the entire source was consumed: */
+	return ret > 0 && len == src_len ? ret : 0;
+}
+
+int bch2_lz4_decompress(struct bch_fs *c, void *dst, size_t dst_len,
+			const void *src, size_t src_len)
+{
+	int ret = LZ4_decompress_safe_partial((void *) src, dst,
+					      src_len, dst_len, dst_len);
+
+	return ret == dst_len ? 0 : -EIO;
+}
+
 static unsigned __bio_compress(struct bch_fs *c,
 			       struct bio *dst, size_t *dst_len,
 			       struct bio *src, size_t *src_len,
@@ -371,7 +515,7 @@ static unsigned __bio_compress(struct bch_fs *c,
 	dst_data = bio_map_or_bounce(c, dst, WRITE);
 	src_data = bio_map_or_bounce(c, src, READ);
 
-	workspace = mempool_alloc(&c->compress_workspace[compression_type], GFP_NOIO);
+	workspace = compress_workspace_get(c, compression_type);
 
 	*src_len = src->bi_iter.bi_size;
 	*dst_len = dst->bi_iter.bi_size;
@@ -414,8 +558,6 @@ static unsigned __bio_compress(struct bch_fs *c,
 		*src_len = round_down(*src_len, block_bytes(c));
 	}
 
-	mempool_free(workspace, &c->compress_workspace[compression_type]);
-
 	if (ret)
 		goto err;
 
@@ -520,10 +662,96 @@ int bch2_check_set_has_compressed_data(struct bch_fs *c,
 		: 0;
 }
 
+static const char *bch2_sb_validate_compression_dict(struct bch_sb *sb,
+						     struct bch_sb_field *f)
+{
+	struct bch_sb_field_compression_dict *d =
+		field_to_type(f, compression_dict);
+
+	if (vstruct_bytes(&d->field) < sizeof(*d) ||
+	    vstruct_bytes(&d->field) < sizeof(*d) + le32_to_cpu(d->dict_size))
+		return "invalid field compression_dict: wrong size";
+
+	return NULL;
+}
+
+const struct bch_sb_field_ops bch_sb_field_ops_compression_dict = {
+	.validate	= bch2_sb_validate_compression_dict,
+};
+
+static int compression_dict_init(struct bch_fs *c)
+{
+	struct bch_sb_field_compression_dict *d =
+		bch2_sb_get_compression_dict(c->disk_sb.sb);
+	size_t bytes;
+
+	if (!d || c->zstd_dict)
+		return 0;
+
+	bytes = le32_to_cpu(d->dict_size);
+
+	c->zstd_dict = kvpmalloc(bytes, GFP_KERNEL);
+	if (!c->zstd_dict)
+		return -ENOMEM;
+
+	memcpy(c->zstd_dict, d->data, bytes);
+	c->zstd_dict_size = bytes;
+	return 0;
+}
+
+int bch2_fs_compression_dict_set(struct bch_fs *c, const void *dict, size_t len)
+{
+	struct bch_sb_field_compression_dict *d;
+	unsigned u64s = DIV_ROUND_UP(sizeof(*d) + len, sizeof(u64));
+	void *copy;
+	int ret = 0;
+
+	copy = kvpmalloc(len, GFP_KERNEL);
+	if (!copy)
+		return -ENOMEM;
+	memcpy(copy, dict, len);
+
+	mutex_lock(&c->sb_lock);
+
+	/*
+	 * The dictionary is write once - extents on disk may have been
+	 * compressed against an existing one:
+	 */
+	if (c->zstd_dict ||
+	    bch2_sb_get_compression_dict(c->disk_sb.sb)) {
+		ret = -EEXIST;
+		goto err;
+	}
+
+	d = bch2_sb_resize_compression_dict(&c->disk_sb, u64s);
+	if (!d) {
+		ret = -ENOSPC;
+		goto err;
+	}
+
+	memset(d->data, 0, vstruct_bytes(&d->field) - sizeof(*d));
+	d->dict_size = cpu_to_le32(len);
+	memcpy(d->data, dict, len);
+
+	c->disk_sb.sb->features[0] |=
+		cpu_to_le64(1ULL << BCH_FEATURE_zstd_dict);
+	bch2_write_super(c);
+
+	c->zstd_dict		= copy;
+	c->zstd_dict_size	= len;
+	copy = NULL;
+err:
+	mutex_unlock(&c->sb_lock);
+	if (copy)
+		kvpfree(copy, len);
+	return ret;
+}
+
 void bch2_fs_compress_exit(struct bch_fs *c)
 {
 	unsigned i;
 
+	kvpfree(c->zstd_dict, c->zstd_dict_size);
 	mempool_exit(&c->decompress_workspace);
 	for (i = 0; i < ARRAY_SIZE(c->compress_workspace); i++)
 		mempool_exit(&c->compress_workspace[i]);
@@ -565,6 +793,9 @@ static int __bch2_fs_compress_init(struct bch_fs *c, u64 features)
 
 	goto out;
 have_compressed:
+	ret = compression_dict_init(c);
+	if (ret)
+		goto out;
 
 	if (!mempool_initialized(&c->compression_bounce[READ])) {
 		ret = mempool_init_kvpmalloc_pool(&c->compression_bounce[READ],
@@ -4,6 +4,8 @@
 
 #include "extents_types.h"
 
+extern const struct bch_sb_field_ops bch_sb_field_ops_compression_dict;
+
 int bch2_bio_uncompress_inplace(struct bch_fs *, struct bio *,
 				struct bch_extent_crc_unpacked *);
 int bch2_bio_uncompress(struct bch_fs *, struct bio *, struct bio *,
@@ -11,6 +13,9 @@ int bch2_bio_uncompress(struct bch_fs *, struct bio *, struct bio *,
 unsigned bch2_bio_compress(struct bch_fs *, struct bio *, size_t *,
 			   struct bio *, size_t *, unsigned);
 
+int bch2_fs_compression_dict_set(struct bch_fs *, const void *, size_t);
+int bch2_lz4_compress(struct bch_fs *, void *, size_t, const void *, size_t);
+int bch2_lz4_decompress(struct bch_fs *, void *, size_t, const void *, size_t);
 int bch2_check_set_has_compressed_data(struct bch_fs *, unsigned);
 void bch2_fs_compress_exit(struct bch_fs *);
 int bch2_fs_compress_init(struct bch_fs *);
@@ -22,13 +22,8 @@ unsigned bch2_dirent_name_bytes(struct bkey_s_c_dirent d)
 static u64 bch2_dirent_hash(const struct bch_hash_info *info,
 			    const struct qstr *name)
 {
-	struct bch_str_hash_ctx ctx;
-
-	bch2_str_hash_init(&ctx, info);
-	bch2_str_hash_update(&ctx, info, name->name, name->len);
-
 	/* [0,2) reserved for dots */
-	return max_t(u64, bch2_str_hash_end(&ctx, info), 2);
+	return max_t(u64, bch2_str_hash(info, name->name, name->len), 2);
 }
 
 static u64 dirent_hash_key(const struct bch_hash_info *info, const void *key)
@@ -72,6 +67,227 @@ const struct bch_hash_desc bch2_dirent_hash_desc = {
 	.cmp_bkey	= dirent_cmp_bkey,
 };
 
+#ifndef __KERNEL__
+/*
+ * In memory directory index: the fuse frontend and fsck both hit the same
+ * directories with repeated lookups, and each lookup walks the dirents btree
+ * through the hash chain, probing past collisions and whiteouts. Cache
+ * name hash -> key offset per directory so repeat lookups of hot directories
+ * seek straight to the right slot.
+ *
+ * Hits are always verified against the btree - the key at the cached offset
+ * still has to be a dirent that compares equal to the name being looked up -
+ * so a stale entry can never return a wrong answer, it just falls back to the
+ * full hash chain walk. That makes invalidation purely an optimization and we
+ * can be conservative about it (invalidating from an update that ends up not
+ * committing is fine).
+ */
+
+struct dirent_idx_entry {
+	u64			hash;	/* 0 == empty; live hashes are >= 2 */
+	u64			offset;
+};
+
+struct dirent_idx {
+	u64			dir_inum;
+	u64			last_used;
+	size_t			size;	/* power of two */
+	size_t			nr;
+	struct dirent_idx_entry	*entries;
+};
+
+#define DIRENT_IDX_NR_DIRS	8
+#define DIRENT_IDX_MIN_SIZE	64UL
+#define DIRENT_IDX_MAX_SIZE	(1UL << 20)
+
+static struct dirent_idx dirent_idx_cache[DIRENT_IDX_NR_DIRS];
+static u64 dirent_idx_clock;
+static DEFINE_MUTEX(dirent_idx_lock);
+
+static struct dirent_idx *dirent_idx_find(u64 dir_inum)
+{
+	struct dirent_idx *idx;
+
+	for (idx = dirent_idx_cache;
+	     idx < dirent_idx_cache + DIRENT_IDX_NR_DIRS;
+	     idx++)
+		if (idx->entries && idx->dir_inum == dir_inum) {
+			idx->last_used = ++dirent_idx_clock;
+			return idx;
+		}
+
+	return NULL;
+}
+
+static void __dirent_idx_insert(struct dirent_idx *idx, u64 hash, u64 offset)
+{
+	size_t i = hash & (idx->size - 1);
+
+	while (idx->entries[i].hash) {
+		if (idx->entries[i].hash == hash &&
+		    idx->entries[i].offset == offset)
+			return;
+		i = (i + 1) & (idx->size - 1);
+	}
+
+	idx->entries[i].hash	= hash;
+	idx->entries[i].offset	= offset;
+	idx->nr++;
+}
+
+static int dirent_idx_grow(struct dirent_idx *idx)
+{
+	struct dirent_idx_entry *old = idx->entries;
+	size_t old_size = idx->size, i;
+
+	if (idx->size >= DIRENT_IDX_MAX_SIZE)
+		return -ENOSPC;
+
+	idx->size	= old ? old_size * 2 : DIRENT_IDX_MIN_SIZE;
+	idx->entries	= kcalloc(idx->size, sizeof(*idx->entries), GFP_KERNEL);
+	if (!idx->entries) {
+		idx->entries	= old;
+		idx->size	= old_size;
+		return -ENOMEM;
+	}
+
+	idx->nr = 0;
+	for (i = 0; i < old_size; i++)
+		if (old[i].hash)
+			__dirent_idx_insert(idx, old[i].hash, old[i].offset);
+	kfree(old);
+	return 0;
+}
+
+static bool dirent_idx_lookup(u64 dir_inum, u64 hash, u64 *offset)
+{
+	struct dirent_idx *idx;
+	bool found = false;
+	size_t i;
+
+	mutex_lock(&dirent_idx_lock);
+	idx = dirent_idx_find(dir_inum);
+	if (idx) {
+		i = hash & (idx->size - 1);
+		while (idx->entries[i].hash) {
+			if (idx->entries[i].hash == hash) {
+				/*
+				 * If two names in this directory share a hash
+				 * we return the first - the caller's verify
+				 * will fail for the other name and it'll take
+				 * the slow path:
+				 */
+				*offset = idx->entries[i].offset;
+				found = true;
+				break;
+			}
+			i = (i + 1) & (idx->size - 1);
+		}
+	}
+	mutex_unlock(&dirent_idx_lock);
+
+	return found;
+}
+
+static void dirent_idx_add(u64 dir_inum, u64 hash, u64 offset)
+{
+	struct dirent_idx *idx;
+
+	mutex_lock(&dirent_idx_lock);
+	idx = dirent_idx_find(dir_inum);
+	if (idx) {
+		if (idx->nr * 4 >= idx->size * 3 &&
+		    dirent_idx_grow(idx)) {
+			/* over the size cap: stop indexing this directory */
+			kfree(idx->entries);
+			memset(idx, 0, sizeof(*idx));
+			idx = NULL;
+		}
+
+		if (idx)
+			__dirent_idx_insert(idx, hash, offset);
+	}
+	mutex_unlock(&dirent_idx_lock);
+}
+
+/*
+ * Allocate an index for @dir_inum, evicting the least recently used
+ * directory; returns true if this directory didn't have one yet and the
+ * caller should populate it:
+ */
+static bool dirent_idx_create(u64 dir_inum)
+{
+	struct dirent_idx *idx, *lru;
+	bool created = false;
+
+	mutex_lock(&dirent_idx_lock);
+	if (!dirent_idx_find(dir_inum)) {
+		lru = dirent_idx_cache;
+		for (idx = dirent_idx_cache + 1;
+		     idx < dirent_idx_cache + DIRENT_IDX_NR_DIRS;
+		     idx++)
+			if (idx->last_used < lru->last_used)
+				lru = idx;
+
+		kfree(lru->entries);
+		memset(lru, 0, sizeof(*lru));
+
+		if (!dirent_idx_grow(lru)) {
+			lru->dir_inum	= dir_inum;
+			lru->last_used	= ++dirent_idx_clock;
+			created = true;
+		}
+	}
+	mutex_unlock(&dirent_idx_lock);
+
+	return created;
+}
+
+static void dirent_idx_invalidate(u64 dir_inum)
+{
+	struct dirent_idx *idx;
+
+	mutex_lock(&dirent_idx_lock);
+	idx = dirent_idx_find(dir_inum);
+	if (idx) {
+		kfree(idx->entries);
+		memset(idx, 0, sizeof(*idx));
+	}
+	mutex_unlock(&dirent_idx_lock);
+}
+
+static void dirent_idx_build(struct btree_trans *trans, u64 dir_inum,
+			     const struct bch_hash_info *hash_info)
+{
+	struct btree_iter *iter;
+	struct bkey_s_c k;
+	int ret;
+
+	for_each_btree_key(trans, iter, BTREE_ID_DIRENTS,
+			   POS(dir_inum, 0), 0, k, ret) {
+		if (k.k->p.inode > dir_inum)
+			break;
+
+		if (k.k->type != KEY_TYPE_dirent)
+			continue;
+
+		dirent_idx_add(dir_inum,
+			       dirent_hash_bkey(hash_info, k),
+			       k.k->p.offset);
+	}
+	bch2_trans_iter_put(trans, iter);
+
+	/*
+	 * If the scan errored out we're left with a partial index; entries
+	 * are verified on hit, so that's fine:
+	 */
+}
+#else /* __KERNEL__ */
+
+static inline void dirent_idx_invalidate(u64 dir_inum) {}
+
+#endif
+
 const char *bch2_dirent_invalid(const struct bch_fs *c, struct bkey_s_c k)
 {
 	struct bkey_s_c_dirent d = bkey_s_c_to_dirent(k);
@@ -104,7 +320,10 @@ void bch2_dirent_to_text(struct printbuf *out, struct bch_fs *c,
 
 	bch_scnmemcpy(out, d.v->d_name,
 		      bch2_dirent_name_bytes(d));
-	pr_buf(out, " -> %llu type %u", d.v->d_inum, d.v->d_type);
+	pr_string(out, " -> ");
+	pr_u64(out, d.v->d_inum);
+	pr_string(out, " type ");
+	pr_u64(out, d.v->d_type);
 }
 
 static struct bkey_i_dirent *dirent_create_key(struct btree_trans *trans,
@@ -151,8 +370,11 @@ int bch2_dirent_create(struct btree_trans *trans,
 	if (ret)
 		return ret;
 
-	return bch2_hash_set(trans, bch2_dirent_hash_desc, hash_info,
-			     dir_inum, &dirent->k_i, flags);
+	ret = bch2_hash_set(trans, bch2_dirent_hash_desc, hash_info,
+			    dir_inum, &dirent->k_i, flags);
+	if (!ret)
+		dirent_idx_invalidate(dir_inum);
+	return ret;
 }
 
 static void dirent_copy_target(struct bkey_i_dirent *dst,
@@ -279,6 +501,8 @@ int bch2_dirent_rename(struct btree_trans *trans,
 	bch2_trans_update(trans, src_iter, &new_src->k_i, 0);
 	bch2_trans_update(trans, dst_iter, &new_dst->k_i, 0);
 out:
+	dirent_idx_invalidate(src_dir);
+	dirent_idx_invalidate(dst_dir);
 	bch2_trans_iter_put(trans, src_iter);
 	bch2_trans_iter_put(trans, dst_iter);
 	return ret;
@@ -288,8 +512,11 @@ int bch2_dirent_delete_at(struct btree_trans *trans,
 			  const struct bch_hash_info *hash_info,
 			  struct btree_iter *iter)
 {
-	return bch2_hash_delete_at(trans, bch2_dirent_hash_desc,
-				   hash_info, iter);
+	int ret = bch2_hash_delete_at(trans, bch2_dirent_hash_desc,
+				      hash_info, iter);
+	if (!ret)
+		dirent_idx_invalidate(iter->pos.inode);
+	return ret;
 }
 
 struct btree_iter *
@@ -297,8 +524,51 @@ __bch2_dirent_lookup_trans(struct btree_trans *trans, u64 dir_inum,
 			   const struct bch_hash_info *hash_info,
 			   const struct qstr *name, unsigned flags)
 {
+#ifndef __KERNEL__
+	struct btree_iter *iter;
+	struct bkey_s_c k;
+	u64 hash = bch2_dirent_hash(hash_info, name);
+	u64 offset;
+	bool stale;
+
+	if (!dirent_idx_lookup(dir_inum, hash, &offset)) {
+		if (dirent_idx_create(dir_inum))
+			dirent_idx_build(trans, dir_inum, hash_info);
+		if (!dirent_idx_lookup(dir_inum, hash, &offset))
+			goto slowpath;
+	}
+
+	iter = bch2_trans_get_iter(trans, BTREE_ID_DIRENTS,
+				   POS(dir_inum, offset),
+				   BTREE_ITER_SLOTS|flags);
+	if (IS_ERR(iter))
+		return iter;
+
+	k = bch2_btree_iter_peek_slot(iter);
+	if (!bkey_err(k) &&
+	    k.k->type == KEY_TYPE_dirent &&
+	    !dirent_cmp_key(k, name))
+		return iter;
+
+	/*
+	 * Hash collision with another name, or the cached slot no longer
+	 * holds a dirent (stale) - drop the index in the stale case, and
+	 * take the full hash chain walk:
+	 */
+	stale = !bkey_err(k) && k.k->type != KEY_TYPE_dirent;
+	bch2_trans_iter_put(trans, iter);
+	if (stale)
+		dirent_idx_invalidate(dir_inum);
+slowpath:
+	iter = bch2_hash_lookup(trans, bch2_dirent_hash_desc,
+				hash_info, dir_inum, name, flags);
+	if (!IS_ERR(iter))
+		dirent_idx_add(dir_inum, hash, iter->pos.offset);
+	return iter;
+#else
 	return bch2_hash_lookup(trans, bch2_dirent_hash_desc,
 				hash_info, dir_inum, name, flags);
+#endif
 }
 
 u64 bch2_dirent_lookup(struct bch_fs *c, u64 dir_inum,
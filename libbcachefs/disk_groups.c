@@ -164,6 +164,8 @@ int bch2_sb_disk_groups_to_cpu(struct bch_fs *c)
 	if (old_g)
 		kfree_rcu(old_g, rcu);
 
+	WRITE_ONCE(c->dev_alloc_gen, c->dev_alloc_gen + 1);
+
 	return 0;
 }
 
@@ -18,6 +18,7 @@
 #include "super-io.h"
 #include "util.h"
 
+#include <linux/rculist.h>
 #include <linux/sort.h>
 
 #ifdef __KERNEL__
@@ -86,6 +87,37 @@ static void raid_rec(int nr, int *ir, int nd, int np, size_t size, void **v)
 	}
 }
 
+static int raid_check(int nr, int *ir, int nd, int np, size_t size, void **v)
+{
+	void *saved[2] = { NULL, NULL };
+	int i, ret = 0;
+
+	BUG_ON(nr);
+	BUG_ON(np > 2);
+
+	for (i = 0; i < np; i++) {
+		saved[i] = kvpmalloc(size, GFP_KERNEL);
+		if (!saved[i]) {
+			ret = -ENOMEM;
+			goto out;
+		}
+
+		memcpy(saved[i], v[nd + i], size);
+	}
+
+	raid_gen(nd, np, size, v);
+
+	for (i = 0; i < np; i++) {
+		if (memcmp(saved[i], v[nd + i], size))
+			ret = -1;
+		memcpy(v[nd + i], saved[i], size);
+	}
+out:
+	for (i = 0; i < np; i++)
+		kvpfree(saved[i], size);
+	return ret;
+}
+
 #else
 
 #include <raid/raid.h>
@@ -490,6 +522,219 @@ err:
 	return ret;
 }
 
+/* scrub: */
+
+#define STRIPE_SCRUB_BATCH	16
+
+struct stripe_scrub_io {
+	struct ec_stripe_buf	*buf;
+	unsigned		block;
+	unsigned		dev;
+	u64			offset;
+};
+
+static int stripe_scrub_io_cmp(const void *_l, const void *_r)
+{
+	const struct stripe_scrub_io *l = _l, *r = _r;
+
+	return  cmp_int(l->dev, r->dev) ?:
+		cmp_int(l->offset, r->offset);
+}
+
+static struct ec_stripe_buf *stripe_scrub_buf_alloc(struct bkey_s_c k)
+{
+	struct ec_stripe_buf *buf;
+	unsigned i;
+
+	buf = kzalloc(sizeof(*buf), GFP_KERNEL);
+	if (!buf)
+		return NULL;
+
+	bkey_reassemble(&buf->key.k_i, k);
+
+	buf->offset	= 0;
+	buf->size	= le16_to_cpu(buf->key.v.sectors);
+	memset(buf->valid, 0xFF, sizeof(buf->valid));
+
+	for (i = 0; i < buf->key.v.nr_blocks; i++) {
+		buf->data[i] = kvpmalloc(buf->size << 9, GFP_KERNEL);
+		if (!buf->data[i])
+			goto err;
+	}
+
+	return buf;
+err:
+	while (i--)
+		kvpfree(buf->data[i], buf->size << 9);
+	kfree(buf);
+	return NULL;
+}
+
+static void stripe_scrub_buf_free(struct ec_stripe_buf *buf)
+{
+	unsigned i;
+
+	for (i = 0; i < buf->key.v.nr_blocks; i++)
+		kvpfree(buf->data[i], buf->size << 9);
+	kfree(buf);
+}
+
+static int ec_stripe_scrub_verify(struct bch_fs *c, struct ec_stripe_buf *buf)
+{
+	struct bch_stripe *v = &buf->key.v;
+	unsigned nr_data = v->nr_blocks - v->nr_redundant;
+
+	if (ec_nr_failed(buf)) {
+		bch_err(c, "stripe %llu: scrub unable to read %u blocks",
+			buf->key.k.p.offset, ec_nr_failed(buf));
+		return -EIO;
+	}
+
+	ec_validate_checksums(c, buf);
+
+	if (ec_nr_failed(buf)) {
+		bch_err(c, "stripe %llu: scrub found %u checksum errors",
+			buf->key.k.p.offset, ec_nr_failed(buf));
+		return -EIO;
+	}
+
+	if (raid_check(0, NULL, nr_data, v->nr_redundant,
+		       buf->size << 9, buf->data)) {
+		bch_err(c, "stripe %llu: scrub found parity inconsistency",
+			buf->key.k.p.offset);
+		return -EIO;
+	}
+
+	return 0;
+}
+
+int bch2_stripes_scrub(struct bch_fs *c, struct bch_ratelimit *rate,
+		       struct bch_move_stats *stats,
+		       struct bpos start, struct bpos end)
+{
+	struct btree_trans trans;
+	struct btree_iter *iter;
+	struct bkey_s_c k;
+	struct ec_stripe_buf *bufs[STRIPE_SCRUB_BATCH];
+	struct stripe_scrub_io *ios;
+	struct closure cl;
+	unsigned i, b, nr, nr_ios;
+	int ret = 0, scrub_err = 0;
+
+	closure_init_stack(&cl);
+
+	ios = kmalloc_array(STRIPE_SCRUB_BATCH * EC_STRIPE_MAX,
+			    sizeof(*ios), GFP_KERNEL);
+	if (!ios)
+		return -ENOMEM;
+
+	bch2_trans_init(&trans, c, 0, 0);
+
+	stats->data_type	= BCH_DATA_user;
+	stats->btree_id		= BTREE_ID_EC;
+	stats->pos		= start;
+
+	if (rate)
+		bch2_ratelimit_reset(rate);
+
+	iter = bch2_trans_get_iter(&trans, BTREE_ID_EC, start,
+				   BTREE_ITER_PREFETCH);
+
+	while (1) {
+		nr = 0;
+		while (nr < STRIPE_SCRUB_BATCH &&
+		       (k = bch2_btree_iter_peek(iter)).k &&
+		       !(ret = bkey_err(k)) &&
+		       bkey_cmp(k.k->p, end) < 0) {
+			stats->pos = iter->pos;
+
+			if (k.k->type == KEY_TYPE_stripe) {
+				bufs[nr] = stripe_scrub_buf_alloc(k);
+				if (!bufs[nr]) {
+					ret = -ENOMEM;
+					break;
+				}
+				nr++;
+			}
+
+			bch2_btree_iter_next(iter);
+		}
+
+		if (!nr)
+			break;
+
+		bch2_trans_unlock(&trans);
+
+		/*
+		 * Issue the reads in device lba order, so that each device
+		 * sees the whole batch as a single sequential stream instead
+		 * of one random read per stripe block:
+		 */
+		nr_ios = 0;
+		for (i = 0; i < nr; i++) {
+			struct bch_stripe *v = &bufs[i]->key.v;
+
+			for (b = 0; b < v->nr_blocks; b++) {
+				struct bch_extent_ptr *ptr = v->ptrs + b;
+				struct bch_dev *ca = bch_dev_bkey_exists(c, ptr->dev);
+
+				if (ptr_stale(ca, ptr)) {
+					clear_bit(b, bufs[i]->valid);
+					continue;
+				}
+
+				ios[nr_ios++] = (struct stripe_scrub_io) {
+					.buf	= bufs[i],
+					.block	= b,
+					.dev	= ptr->dev,
+					.offset	= ptr->offset,
+				};
+			}
+		}
+
+		sort(ios, nr_ios, sizeof(ios[0]), stripe_scrub_io_cmp, NULL);
+
+		for (i = 0; i < nr_ios; i++)
+			ec_block_io(c, ios[i].buf, REQ_OP_READ,
+				    ios[i].block, &cl);
+
+		closure_sync(&cl);
+
+		for (i = 0; i < nr; i++) {
+			struct bch_stripe *v = &bufs[i]->key.v;
+			unsigned sectors = le16_to_cpu(v->sectors) * v->nr_blocks;
+
+			if (!ret)
+				scrub_err = ec_stripe_scrub_verify(c, bufs[i]) ?:
+					scrub_err;
+
+			atomic64_add(sectors, &stats->sectors_seen);
+			if (rate)
+				bch2_ratelimit_increment(rate, sectors);
+
+			stripe_scrub_buf_free(bufs[i]);
+		}
+
+		if (ret)
+			break;
+
+		if (rate) {
+			u64 delay;
+
+			while ((delay = bch2_ratelimit_delay(rate))) {
+				set_current_state(TASK_INTERRUPTIBLE);
+				schedule_timeout(delay);
+			}
+			__set_current_state(TASK_RUNNING);
+		}
+	}
+
+	bch2_trans_exit(&trans);
+	kfree(ios);
+
+	return ret ?: scrub_err;
+}
+
 /* stripe bucket accounting: */
 
 static int __ec_stripe_mem_alloc(struct bch_fs *c, size_t idx, gfp_t gfp)
@@ -743,11 +988,11 @@ static void extent_stripe_ptr_add(struct bkey_s_extent e,
 	};
 }
 
-static int ec_stripe_update_ptrs(struct bch_fs *c,
+static int ec_stripe_update_ptrs(struct btree_trans *trans,
 				 struct ec_stripe_buf *s,
 				 struct bkey *pos)
 {
-	struct btree_trans trans;
+	struct bch_fs *c = trans->c;
 	struct btree_iter *iter;
 	struct bkey_s_c k;
 	struct bkey_s_extent e;
@@ -755,11 +1000,10 @@ static int ec_stripe_update_ptrs(struct bch_fs *c,
 	int ret = 0, dev, idx;
 
 	bkey_on_stack_init(&sk);
-	bch2_trans_init(&trans, c, BTREE_ITER_MAX, 0);
 
 	/* XXX this doesn't support the reflink btree */
 
-	iter = bch2_trans_get_iter(&trans, BTREE_ID_EXTENTS,
+	iter = bch2_trans_get_iter(trans, BTREE_ID_EXTENTS,
 				   bkey_start_pos(pos),
 				   BTREE_ITER_INTENT);
 
@@ -791,9 +1035,9 @@ static int ec_stripe_update_ptrs(struct bch_fs *c,
 		extent_stripe_ptr_add(e, s, ec_ptr, idx);
 
 		bch2_btree_iter_set_pos(iter, bkey_start_pos(&sk.k->k));
-		bch2_trans_update(&trans, iter, sk.k, 0);
+		bch2_trans_update(trans, iter, sk.k, 0);
 
-		ret = bch2_trans_commit(&trans, NULL, NULL,
+		ret = bch2_trans_commit(trans, NULL, NULL,
 					BTREE_INSERT_NOFAIL|
 					BTREE_INSERT_USE_RESERVE);
 		if (ret == -EINTR)
@@ -802,7 +1046,7 @@ static int ec_stripe_update_ptrs(struct bch_fs *c,
 			break;
 	}
 
-	bch2_trans_exit(&trans);
+	bch2_trans_iter_put(trans, iter);
 	bkey_on_stack_exit(&sk, c);
 
 	return ret;
@@ -814,6 +1058,7 @@ static int ec_stripe_update_ptrs(struct bch_fs *c,
 static void ec_stripe_create(struct ec_stripe_new *s)
 {
 	struct bch_fs *c = s->c;
+	struct btree_trans trans;
 	struct open_bucket *ob;
 	struct bkey_i *k;
 	struct stripe *m;
@@ -865,14 +1110,22 @@ static void ec_stripe_create(struct ec_stripe_new *s)
 		goto err_put_writes;
 	}
 
+	/*
+	 * Update all the extents with one btree_trans, instead of paying for
+	 * transaction setup per key:
+	 */
+	bch2_trans_init(&trans, c, BTREE_ITER_MAX, 0);
+
 	for_each_keylist_key(&s->keys, k) {
-		ret = ec_stripe_update_ptrs(c, &s->stripe, &k->k);
+		ret = ec_stripe_update_ptrs(&trans, &s->stripe, &k->k);
 		if (ret) {
 			bch_err(c, "error creating stripe: error updating pointers");
 			break;
 		}
 	}
 
+	bch2_trans_exit(&trans);
+
 	spin_lock(&c->ec_stripes_heap_lock);
 	m = genradix_ptr(&c->stripes[0], s->stripe.key.k.p.offset);
 #if 0
@@ -1121,6 +1374,32 @@ err:
 	return -ENOMEM;
 }
 
+static inline struct hlist_head *stripe_head_hash(struct bch_fs *c,
+						  unsigned target,
+						  unsigned algo,
+						  unsigned redundancy)
+{
+	unsigned hash = hash_32(target ^ (algo << 16) ^ (redundancy << 24),
+				ilog2(ARRAY_SIZE(c->ec_stripe_head_hash)));
+
+	return &c->ec_stripe_head_hash[hash];
+}
+
+static struct ec_stripe_head *
+__stripe_head_find(struct hlist_head *head, unsigned target,
+		   unsigned algo, unsigned redundancy)
+{
+	struct ec_stripe_head *h;
+
+	hlist_for_each_entry_rcu(h, head, hash)
+		if (h->target		== target &&
+		    h->algo		== algo &&
+		    h->redundancy	== redundancy)
+			return h;
+
+	return NULL;
+}
+
 static struct ec_stripe_head *
 ec_new_stripe_head_alloc(struct bch_fs *c, unsigned target,
 			 unsigned algo, unsigned redundancy)
@@ -1155,6 +1434,8 @@ ec_new_stripe_head_alloc(struct bch_fs *c, unsigned target,
 
 	rcu_read_unlock();
 	list_add(&h->list, &c->ec_stripe_head_list);
+	hlist_add_head_rcu(&h->hash,
+			   stripe_head_hash(c, target, algo, redundancy));
 	return h;
 }
 
@@ -1174,22 +1455,32 @@ struct ec_stripe_head *__bch2_ec_stripe_head_get(struct bch_fs *c,
 					       unsigned algo,
 					       unsigned redundancy)
 {
+	struct hlist_head *head = stripe_head_hash(c, target, algo, redundancy);
 	struct ec_stripe_head *h;
 
 	if (!redundancy)
 		return NULL;
 
-	mutex_lock(&c->ec_stripe_head_lock);
-	list_for_each_entry(h, &c->ec_stripe_head_list, list)
-		if (h->target		== target &&
-		    h->algo		== algo &&
-		    h->redundancy	== redundancy) {
-			mutex_lock(&h->lock);
-			goto found;
-		}
+	/*
+	 * Fast path: stripe heads are created on first use and only freed at
+	 * shutdown, after all writers are gone - once we've found one under
+	 * rcu_read_lock() it stays valid and we can take h->lock without
+	 * ec_stripe_head_lock:
+	 */
+	rcu_read_lock();
+	h = __stripe_head_find(head, target, algo, redundancy);
+	rcu_read_unlock();
+	if (h) {
+		mutex_lock(&h->lock);
+		return h;
+	}
 
-	h = ec_new_stripe_head_alloc(c, target, algo, redundancy);
-found:
+	mutex_lock(&c->ec_stripe_head_lock);
+	h = __stripe_head_find(head, target, algo, redundancy);
+	if (h)
+		mutex_lock(&h->lock);
+	else
+		h = ec_new_stripe_head_alloc(c, target, algo, redundancy);
 	mutex_unlock(&c->ec_stripe_head_lock);
 	return h;
 }
@@ -1612,8 +1903,10 @@ void bch2_fs_ec_exit(struct bch_fs *c)
 		mutex_lock(&c->ec_stripe_head_lock);
 		h = list_first_entry_or_null(&c->ec_stripe_head_list,
 					     struct ec_stripe_head, list);
-		if (h)
+		if (h) {
 			list_del(&h->list);
+			hlist_del_rcu(&h->hash);
+		}
 		mutex_unlock(&c->ec_stripe_head_lock);
 		if (!h)
 			break;
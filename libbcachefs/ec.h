@@ -114,6 +114,7 @@ struct ec_stripe_new {
 
 struct ec_stripe_head {
 	struct list_head	list;
+	struct hlist_node	hash;
 	struct mutex		lock;
 
 	unsigned		target;
@@ -150,6 +151,10 @@ void bch2_stripes_heap_update(struct bch_fs *, struct stripe *, size_t);
 void bch2_stripes_heap_del(struct bch_fs *, struct stripe *, size_t);
 void bch2_stripes_heap_insert(struct bch_fs *, struct stripe *, size_t);
 
+struct bch_move_stats;
+int bch2_stripes_scrub(struct bch_fs *, struct bch_ratelimit *,
+		       struct bch_move_stats *, struct bpos, struct bpos);
+
 void bch2_ec_stop_dev(struct bch_fs *, struct bch_dev *);
 
 void bch2_ec_flush_new_stripes(struct bch_fs *);
@@ -6,6 +6,8 @@
 
 #define EC_STRIPE_MAX	16
 
+#define EC_STRIPE_HEAD_HASH_NR	32
+
 struct bch_replicas_padded {
 	struct bch_replicas_entry	e;
 	u8				pad[EC_STRIPE_MAX];
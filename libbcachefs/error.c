@@ -101,16 +101,29 @@ found:
 	s->nr++;
 	if (c->opts.ratelimit_errors &&
 	    s->nr >= FSCK_ERR_RATELIMIT_NR) {
-		if (s->nr == FSCK_ERR_RATELIMIT_NR)
-			suppressing = true;
-		else
+		if (s->nr == FSCK_ERR_RATELIMIT_NR) {
+			suppressing	= true;
+			s->ratelimited	= true;
+		} else
 			print = false;
 	}
 	buf		= s->buf;
 print:
-	va_start(args, fmt);
-	vscnprintf(buf, sizeof(_buf), fmt, args);
-	va_end(args);
+	/*
+	 * Only format if the message is actually going somewhere: a corrupt
+	 * node can emit one fsck_err per key, and once we're suppressing,
+	 * formatting millions of identical complaints is where the time goes.
+	 * s->buf keeps the last printed instance as the example shown by
+	 * bch2_flush_fsck_errs():
+	 */
+	if (print ||
+	    c->opts.fix_errors == FSCK_OPT_EXIT ||
+	    ((flags & FSCK_CAN_FIX) &&
+	     c->opts.fix_errors == FSCK_OPT_ASK)) {
+		va_start(args, fmt);
+		vscnprintf(buf, sizeof(_buf), fmt, args);
+		va_end(args);
+	}
 
 	if (c->opts.fix_errors == FSCK_OPT_EXIT) {
 		bch_err(c, "%s, exiting", buf);
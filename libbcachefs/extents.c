@@ -967,7 +967,7 @@ void bch2_bkey_ptrs_to_text(struct printbuf *out, struct bch_fs *c,
 
 	bkey_extent_entry_for_each(ptrs, entry) {
 		if (!first)
-			pr_buf(out, " ");
+			pr_char(out, ' ');
 
 		switch (__extent_entry_type(entry)) {
 		case BCH_EXTENT_ENTRY_ptr:
@@ -976,23 +976,34 @@ void bch2_bkey_ptrs_to_text(struct printbuf *out, struct bch_fs *c,
 				? bch_dev_bkey_exists(c, ptr->dev)
 				: NULL;
 
-			pr_buf(out, "ptr: %u:%llu gen %u%s%s", ptr->dev,
-			       (u64) ptr->offset, ptr->gen,
-			       ptr->cached ? " cached" : "",
-			       ca && ptr_stale(ca, ptr)
-			       ? " stale" : "");
+			pr_string(out, "ptr: ");
+			pr_u64(out, ptr->dev);
+			pr_char(out, ':');
+			pr_u64(out, ptr->offset);
+			pr_string(out, " gen ");
+			pr_u64(out, ptr->gen);
+			if (ptr->cached)
+				pr_string(out, " cached");
+			if (ca && ptr_stale(ca, ptr))
+				pr_string(out, " stale");
 			break;
 		case BCH_EXTENT_ENTRY_crc32:
 		case BCH_EXTENT_ENTRY_crc64:
 		case BCH_EXTENT_ENTRY_crc128:
 			crc = bch2_extent_crc_unpack(k.k, entry_to_crc(entry));
 
-			pr_buf(out, "crc: c_size %u size %u offset %u nonce %u csum %u compress %u",
-			       crc.compressed_size,
-			       crc.uncompressed_size,
-			       crc.offset, crc.nonce,
-			       crc.csum_type,
-			       crc.compression_type);
+			pr_string(out, "crc: c_size ");
+			pr_u64(out, crc.compressed_size);
+			pr_string(out, " size ");
+			pr_u64(out, crc.uncompressed_size);
+			pr_string(out, " offset ");
+			pr_u64(out, crc.offset);
+			pr_string(out, " nonce ");
+			pr_u64(out, crc.nonce);
+			pr_string(out, " csum ");
+			pr_u64(out, crc.csum_type);
+			pr_string(out, " compress ");
+			pr_u64(out, crc.compression_type);
 			break;
 		case BCH_EXTENT_ENTRY_stripe_ptr:
 			ec = &entry->stripe_ptr;
@@ -9,6 +9,7 @@
 #include "xattr.h"
 
 #include <linux/posix_acl.h>
+#include <linux/sort.h>
 
 int bch2_create_trans(struct btree_trans *trans, u64 dir_inum,
 		      struct bch_inode_unpacked *dir_u,
@@ -16,7 +17,9 @@ int bch2_create_trans(struct btree_trans *trans, u64 dir_inum,
 		      const struct qstr *name,
 		      uid_t uid, gid_t gid, umode_t mode, dev_t rdev,
 		      struct posix_acl *default_acl,
-		      struct posix_acl *acl)
+		      struct posix_acl *acl,
+		      const struct bkey_i_xattr *default_acl_xattr,
+		      const struct bkey_i_xattr *acl_xattr)
 {
 	struct bch_fs *c = trans->c;
 	struct btree_iter *dir_iter = NULL;
@@ -40,14 +43,29 @@ int bch2_create_trans(struct btree_trans *trans, u64 dir_inum,
 	if (ret)
 		goto err;
 
-	if (default_acl) {
+	/*
+	 * Inherited acls come either preconverted to the on disk form - the
+	 * parent directory's cache, see __bch2_create() - or as posix_acls
+	 * that have to be converted here:
+	 */
+	if (default_acl_xattr) {
+		ret = bch2_set_acl_xattr_trans(trans, new_inode, &hash,
+					       default_acl_xattr);
+		if (ret)
+			goto err;
+	} else if (default_acl) {
 		ret = bch2_set_acl_trans(trans, new_inode, &hash,
 					 default_acl, ACL_TYPE_DEFAULT);
 		if (ret)
 			goto err;
 	}
 
-	if (acl) {
+	if (acl_xattr) {
+		ret = bch2_set_acl_xattr_trans(trans, new_inode, &hash,
+					       acl_xattr);
+		if (ret)
+			goto err;
+	} else if (acl) {
 		ret = bch2_set_acl_trans(trans, new_inode, &hash,
 					 acl, ACL_TYPE_ACCESS);
 		if (ret)
@@ -77,6 +95,81 @@ err:
 	return ret;
 }
 
+static int create_batch_entry_cmp(const void *_l, const void *_r)
+{
+	const struct bch_create_batch_entry *l = _l;
+	const struct bch_create_batch_entry *r = _r;
+
+	return l->hash < r->hash ? -1 : l->hash > r->hash;
+}
+
+/*
+ * Create several files in one directory in a single transaction: the directory
+ * inode is read and written once for the whole batch, and the dirents are
+ * inserted in hash (i.e. key) order so the updates walk the directory leaves
+ * in order instead of bouncing around them. No ACL support - this is for bulk
+ * ingest paths (migrate, fuse), which don't set ACLs at create time.
+ */
+int bch2_create_batch_trans(struct btree_trans *trans, u64 dir_inum,
+			    struct bch_inode_unpacked *dir_u,
+			    struct bch_create_batch_entry *entries,
+			    unsigned nr)
+{
+	struct bch_fs *c = trans->c;
+	struct btree_iter *dir_iter = NULL;
+	struct bch_hash_info dir_hash;
+	u64 now = bch2_current_time(c);
+	unsigned i;
+	int ret;
+
+	dir_iter = bch2_inode_peek(trans, dir_u, dir_inum, BTREE_ITER_INTENT);
+	ret = PTR_ERR_OR_ZERO(dir_iter);
+	if (ret)
+		goto err;
+
+	dir_hash = bch2_hash_info_init(c, dir_u);
+
+	for (i = 0; i < nr; i++) {
+		struct bch_create_batch_entry *e = &entries[i];
+
+		bch2_inode_init_late(e->new_inode, now, e->uid, e->gid,
+				     e->mode, e->rdev, dir_u);
+
+		ret = bch2_inode_create(trans, e->new_inode,
+					BLOCKDEV_INODE_MAX, 0,
+					&c->unused_inode_hint);
+		if (ret)
+			goto err;
+
+		if (S_ISDIR(e->mode))
+			dir_u->bi_nlink++;
+
+		e->hash = bch2_dirent_hash_desc.hash_key(&dir_hash, e->name);
+	}
+
+	dir_u->bi_mtime = dir_u->bi_ctime = now;
+
+	ret = bch2_inode_write(trans, dir_iter, dir_u);
+	if (ret)
+		goto err;
+
+	sort(entries, nr, sizeof(entries[0]), create_batch_entry_cmp, NULL);
+
+	for (i = 0; i < nr; i++) {
+		struct bch_create_batch_entry *e = &entries[i];
+
+		ret = bch2_dirent_create(trans, dir_inum, &dir_hash,
+					 mode_to_type(e->new_inode->bi_mode),
+					 e->name, e->new_inode->bi_inum,
+					 BCH_HASH_SET_MUST_CREATE);
+		if (ret)
+			goto err;
+	}
+err:
+	bch2_trans_iter_put(trans, dir_iter);
+	return ret;
+}
+
 int bch2_link_trans(struct btree_trans *trans, u64 dir_inum,
 		    u64 inum, struct bch_inode_unpacked *dir_u,
 		    struct bch_inode_unpacked *inode_u, const struct qstr *name)
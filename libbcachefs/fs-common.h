@@ -2,6 +2,7 @@
 #ifndef _BCACHEFS_FS_COMMON_H
 #define _BCACHEFS_FS_COMMON_H
 
+struct bkey_i_xattr;
 struct posix_acl;
 
 int bch2_create_trans(struct btree_trans *, u64,
@@ -10,7 +11,24 @@ int bch2_create_trans(struct btree_trans *, u64,
 		      const struct qstr *,
 		      uid_t, gid_t, umode_t, dev_t,
 		      struct posix_acl *,
-		      struct posix_acl *);
+		      struct posix_acl *,
+		      const struct bkey_i_xattr *,
+		      const struct bkey_i_xattr *);
+
+struct bch_create_batch_entry {
+	struct bch_inode_unpacked *new_inode;
+	const struct qstr	*name;
+	uid_t			uid;
+	gid_t			gid;
+	umode_t			mode;
+	dev_t			rdev;
+	u64			hash;	/* set by bch2_create_batch_trans() */
+};
+
+int bch2_create_batch_trans(struct btree_trans *, u64,
+			    struct bch_inode_unpacked *,
+			    struct bch_create_batch_entry *,
+			    unsigned);
 
 int bch2_link_trans(struct btree_trans *, u64,
 		    u64, struct bch_inode_unpacked *,
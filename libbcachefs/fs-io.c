@@ -811,12 +811,64 @@ static void readpage_bio_extend(struct readpages_iter *iter,
 	}
 }
 
+static bool bch2_extent_cache_lookup(struct bch_fs *c,
+				     struct bch_inode_info *inode,
+				     u64 offset, struct bkey_on_stack *sk)
+{
+	u64 version = atomic64_read(&c->extents_version);
+	struct bch_cached_extent *ce;
+	bool ret = false;
+	unsigned i;
+
+	spin_lock(&inode->ei_extent_cache_lock);
+	for (i = 0; i < BCH_EXTENT_CACHE_NR; i++) {
+		ce = inode->ei_extent_cache + i;
+
+		if (ce->version == version &&
+		    bkey_start_offset(&ce->k.k) <= offset &&
+		    offset < ce->k.k.p.offset) {
+			bkey_on_stack_realloc(sk, c, ce->k.k.u64s);
+			bkey_copy(sk->k, &ce->k);
+			ret = true;
+			break;
+		}
+	}
+	spin_unlock(&inode->ei_extent_cache_lock);
+
+	return ret;
+}
+
+/*
+ * @version must have been read before the btree lookup that produced @k -
+ * tagging with a version read after the lookup could mark a key made stale by
+ * an intervening commit as current:
+ */
+static void bch2_extent_cache_add(struct bch_fs *c,
+				  struct bch_inode_info *inode,
+				  struct bkey_s_c k, u64 version)
+{
+	struct bch_cached_extent *ce;
+
+	if (k.k->type == KEY_TYPE_reflink_p ||
+	    k.k->u64s > BKEY_EXTENT_U64s_MAX)
+		return;
+
+	spin_lock(&inode->ei_extent_cache_lock);
+	ce = inode->ei_extent_cache +
+		inode->ei_extent_cache_idx++ % BCH_EXTENT_CACHE_NR;
+	bkey_reassemble(&ce->k, k);
+	ce->version = version;
+	spin_unlock(&inode->ei_extent_cache_lock);
+}
+
 static void bchfs_read(struct btree_trans *trans, struct btree_iter *iter,
-		       struct bch_read_bio *rbio, u64 inum,
+		       struct bch_read_bio *rbio,
+		       struct bch_inode_info *inode,
 		       struct readpages_iter *readpages_iter)
 {
 	struct bch_fs *c = trans->c;
 	struct bkey_on_stack sk;
+	u64 inum = inode->v.i_ino;
 	int flags = BCH_READ_RETRY_IF_STALE|
 		BCH_READ_MAY_PROMOTE;
 	int ret = 0;
@@ -829,20 +881,26 @@ retry:
 	while (1) {
 		struct bkey_s_c k;
 		unsigned bytes, sectors, offset_into_extent;
+		u64 sector = rbio->bio.bi_iter.bi_sector;
+		u64 cache_version = atomic64_read(&c->extents_version);
 
-		bch2_btree_iter_set_pos(iter,
-				POS(inum, rbio->bio.bi_iter.bi_sector));
+		if (bch2_extent_cache_lookup(c, inode, sector, &sk)) {
+			k = bkey_i_to_s_c(sk.k);
+		} else {
+			bch2_btree_iter_set_pos(iter, POS(inum, sector));
 
-		k = bch2_btree_iter_peek_slot(iter);
-		ret = bkey_err(k);
-		if (ret)
-			break;
+			k = bch2_btree_iter_peek_slot(iter);
+			ret = bkey_err(k);
+			if (ret)
+				break;
+
+			bkey_on_stack_reassemble(&sk, c, k);
+			k = bkey_i_to_s_c(sk.k);
 
-		bkey_on_stack_reassemble(&sk, c, k);
-		k = bkey_i_to_s_c(sk.k);
+			bch2_extent_cache_add(c, inode, k, cache_version);
+		}
 
-		offset_into_extent = iter->pos.offset -
-			bkey_start_offset(k.k);
+		offset_into_extent = sector - bkey_start_offset(k.k);
 		sectors = k.k->size - offset_into_extent;
 
 		ret = bch2_read_indirect_extent(trans,
@@ -897,11 +955,18 @@ int bch2_readpages(struct file *file, struct address_space *mapping,
 	struct btree_iter *iter;
 	struct page *page;
 	struct readpages_iter readpages_iter;
+	struct blk_plug plug;
 	int ret;
 
 	ret = readpages_iter_init(&readpages_iter, mapping, pages, nr_pages);
 	BUG_ON(ret);
 
+	/*
+	 * Plug so the per extent bios for the whole readahead window are
+	 * submitted in one batch, where the elevator can sort and merge them:
+	 */
+	blk_start_plug(&plug);
+
 	bch2_trans_init(&trans, c, 0, 0);
 
 	iter = bch2_trans_get_iter(&trans, BTREE_ID_EXTENTS, POS_MIN,
@@ -926,20 +991,20 @@ int bch2_readpages(struct file *file, struct address_space *mapping,
 		rbio->bio.bi_end_io = bch2_readpages_end_io;
 		BUG_ON(!bio_add_page(&rbio->bio, page, PAGE_SIZE, 0));
 
-		bchfs_read(&trans, iter, rbio, inode->v.i_ino,
-			   &readpages_iter);
+		bchfs_read(&trans, iter, rbio, inode, &readpages_iter);
 	}
 
 	bch2_pagecache_add_put(&inode->ei_pagecache_lock);
 
 	bch2_trans_exit(&trans);
+	blk_finish_plug(&plug);
 	kfree(readpages_iter.pages);
 
 	return 0;
 }
 
 static void __bchfs_readpage(struct bch_fs *c, struct bch_read_bio *rbio,
-			     u64 inum, struct page *page)
+			     struct bch_inode_info *inode, struct page *page)
 {
 	struct btree_trans trans;
 	struct btree_iter *iter;
@@ -955,7 +1020,7 @@ static void __bchfs_readpage(struct bch_fs *c, struct bch_read_bio *rbio,
 	iter = bch2_trans_get_iter(&trans, BTREE_ID_EXTENTS, POS_MIN,
 				   BTREE_ITER_SLOTS);
 
-	bchfs_read(&trans, iter, rbio, inum, NULL);
+	bchfs_read(&trans, iter, rbio, inode, NULL);
 
 	bch2_trans_exit(&trans);
 }
@@ -970,7 +1035,7 @@ int bch2_readpage(struct file *file, struct page *page)
 	rbio = rbio_init(bio_alloc_bioset(GFP_NOFS, 1, &c->bio_read), opts);
 	rbio->bio.bi_end_io = bch2_readpages_end_io;
 
-	__bchfs_readpage(c, rbio, inode->v.i_ino, page);
+	__bchfs_readpage(c, rbio, inode, page);
 	return 0;
 }
 
@@ -993,7 +1058,7 @@ static int bch2_read_single_page(struct page *page,
 	rbio->bio.bi_private = &done;
 	rbio->bio.bi_end_io = bch2_read_single_page_end_io;
 
-	__bchfs_readpage(c, rbio, inode->v.i_ino, page);
+	__bchfs_readpage(c, rbio, inode, page);
 	wait_for_completion(&done);
 
 	ret = blk_status_to_errno(rbio->bio.bi_status);
@@ -1011,13 +1076,35 @@ static int bch2_read_single_page(struct page *page,
 struct bch_writepage_state {
 	struct bch_writepage_io	*io;
 	struct bch_io_opts	opts;
+	unsigned		max_sectors;
 };
 
+/*
+ * Writeback cluster size: accumulate dirty pages into bucket sized writes
+ * when a device has buckets bigger than BIO_MAX_PAGES worth - the write path
+ * then allocates and lays out the whole span at once, so streaming writes
+ * produce maximally contiguous extents. In userspace bios are just kmalloc'd
+ * bvec arrays, so exceeding BIO_MAX_PAGES is fine:
+ */
+static unsigned bch2_writepage_max_sectors(struct bch_fs *c)
+{
+	struct bch_dev *ca;
+	unsigned i, ret = BIO_MAX_PAGES * PAGE_SECTORS;
+
+	rcu_read_lock();
+	for_each_member_device_rcu(ca, c, i, NULL)
+		ret = max_t(unsigned, ret, ca->mi.bucket_size);
+	rcu_read_unlock();
+
+	return ret;
+}
+
 static inline struct bch_writepage_state bch_writepage_state_init(struct bch_fs *c,
 								  struct bch_inode_info *inode)
 {
 	return (struct bch_writepage_state) {
-		.opts = io_opts(c, &inode->ei_inode)
+		.opts		= io_opts(c, &inode->ei_inode),
+		.max_sectors	= bch2_writepage_max_sectors(c),
 	};
 }
 
@@ -1118,7 +1205,8 @@ static void bch2_writepage_io_alloc(struct bch_fs *c,
 	struct bch_write_op *op;
 
 	w->io = container_of(bio_alloc_bioset(GFP_NOFS,
-					      BIO_MAX_PAGES,
+					      DIV_ROUND_UP(w->max_sectors,
+							   PAGE_SECTORS),
 					      &c->writepage_bioset),
 			     struct bch_writepage_io, op.wbio.bio);
 
@@ -1241,7 +1329,7 @@ do_io:
 		    (w->io->op.res.nr_replicas != nr_replicas_this_write ||
 		     bio_full(&w->io->op.wbio.bio, PAGE_SIZE) ||
 		     w->io->op.wbio.bio.bi_iter.bi_size + (sectors << 9) >=
-		     (BIO_MAX_PAGES * PAGE_SIZE) ||
+		     (w->max_sectors << 9) ||
 		     bio_end_sector(&w->io->op.wbio.bio) != sector))
 			bch2_writepage_do_io(w);
 
@@ -233,6 +233,8 @@ __bch2_create(struct bch_inode_info *dir, struct dentry *dentry,
 	struct bch_inode_info *inode, *old;
 	struct bch_inode_unpacked inode_u;
 	struct posix_acl *default_acl = NULL, *acl = NULL;
+	const struct bkey_i_xattr *default_acl_xattr = NULL, *acl_xattr = NULL;
+	umode_t orig_mode __maybe_unused = mode;
 	u64 journal_seq = 0;
 	int ret;
 
@@ -256,6 +258,37 @@ __bch2_create(struct bch_inode_info *dir, struct dentry *dentry,
 	if (!tmpfile)
 		mutex_lock(&dir->ei_update_lock);
 
+#ifdef CONFIG_BCACHEFS_POSIX_ACL
+	/*
+	 * The inherited acls are a pure function of the parent's default acl
+	 * and the create mode, so their on disk form can be cached in the
+	 * parent and reused for every create - including across transaction
+	 * restarts - instead of being reconverted each time. The cache is
+	 * protected by ei_update_lock, which we don't hold for tmpfiles:
+	 */
+	if (!tmpfile) {
+		if (default_acl) {
+			if (!dir->ei_acl_default_xattr)
+				dir->ei_acl_default_xattr =
+					bch2_acl_xattr_cached(default_acl,
+							ACL_TYPE_DEFAULT);
+			default_acl_xattr = dir->ei_acl_default_xattr;
+		}
+
+		if (acl) {
+			if (!dir->ei_acl_access_xattr ||
+			    dir->ei_acl_access_mode != orig_mode) {
+				kfree(dir->ei_acl_access_xattr);
+				dir->ei_acl_access_xattr =
+					bch2_acl_xattr_cached(acl,
+							ACL_TYPE_ACCESS);
+				dir->ei_acl_access_mode = orig_mode;
+			}
+			acl_xattr = dir->ei_acl_access_xattr;
+		}
+	}
+#endif
+
 	bch2_trans_init(&trans, c, 8, 1024);
 retry:
 	bch2_trans_begin(&trans);
@@ -265,7 +298,8 @@ retry:
 				  from_kuid(ns, current_fsuid()),
 				  from_kgid(ns, current_fsgid()),
 				  mode, rdev,
-				  default_acl, acl) ?:
+				  default_acl, acl,
+				  default_acl_xattr, acl_xattr) ?:
 		bch2_quota_acct(c, bch_qid(&inode_u), Q_INO, 1,
 				KEY_TYPE_QUOTA_PREALLOC);
 	if (unlikely(ret))
@@ -1153,6 +1187,7 @@ static void bch2_vfs_inode_init(struct bch_fs *c,
 static struct inode *bch2_alloc_inode(struct super_block *sb)
 {
 	struct bch_inode_info *inode;
+	unsigned i;
 
 	inode = kmem_cache_alloc(bch2_inode_cache, GFP_NOFS);
 	if (!inode)
@@ -1164,6 +1199,18 @@ static struct inode *bch2_alloc_inode(struct super_block *sb)
 	mutex_init(&inode->ei_quota_lock);
 	inode->ei_journal_seq = 0;
 
+	spin_lock_init(&inode->ei_extent_cache_lock);
+	inode->ei_extent_cache_idx = 0;
+
+#ifdef CONFIG_BCACHEFS_POSIX_ACL
+	inode->ei_acl_default_xattr	= NULL;
+	inode->ei_acl_access_xattr	= NULL;
+#endif
+
+	/* version 0 never matches - c->extents_version starts at 1: */
+	for (i = 0; i < BCH_EXTENT_CACHE_NR; i++)
+		inode->ei_extent_cache[i].version = 0;
+
 	return &inode->v;
 }
 
@@ -1177,6 +1224,13 @@ static void bch2_i_callback(struct rcu_head *head)
 
 static void bch2_destroy_inode(struct inode *vinode)
 {
+#ifdef CONFIG_BCACHEFS_POSIX_ACL
+	struct bch_inode_info *inode = to_bch_ei(vinode);
+
+	kfree(inode->ei_acl_default_xattr);
+	kfree(inode->ei_acl_access_xattr);
+#endif
+
 	call_rcu(&vinode->i_rcu, bch2_i_callback);
 }
 
@@ -30,9 +30,28 @@ void bch2_pagecache_add_get(struct pagecache_lock *);
 void bch2_pagecache_block_put(struct pagecache_lock *);
 void bch2_pagecache_block_get(struct pagecache_lock *);
 
+/*
+ * Per inode cache of recently resolved extents, consulted before walking the
+ * extents btree in the buffered read path. Coherence is by version number:
+ * c->extents_version is bumped by every transaction that updates extents or
+ * indirect extents, which kills all cached mappings filesystem wide - cheap,
+ * and the case that matters is hot files read far more often than anything
+ * is written:
+ */
+#define BCH_EXTENT_CACHE_NR	8
+
+struct bch_cached_extent {
+	u64			version;
+	BKEY_PADDED(k);
+};
+
 struct bch_inode_info {
 	struct inode		v;
 
+	spinlock_t		ei_extent_cache_lock;
+	unsigned		ei_extent_cache_idx;
+	struct bch_cached_extent ei_extent_cache[BCH_EXTENT_CACHE_NR];
+
 	struct mutex		ei_update_lock;
 	u64			ei_journal_seq;
 	u64			ei_quota_reserved;
@@ -45,6 +64,19 @@ struct bch_inode_info {
 
 	struct bch_hash_info	ei_str_hash;
 
+#ifdef CONFIG_BCACHEFS_POSIX_ACL
+	/*
+	 * Cached on disk form of the acls inherited by new children, so
+	 * create-heavy workloads don't reconvert them for every file:
+	 * protected by ei_update_lock, invalidated when this directory's
+	 * default acl changes. ei_acl_access_xattr is only valid for creates
+	 * with mode ei_acl_access_mode:
+	 */
+	struct bkey_i_xattr	*ei_acl_default_xattr;
+	struct bkey_i_xattr	*ei_acl_access_xattr;
+	umode_t			ei_acl_access_mode;
+#endif
+
 	/* copy of inode in btree: */
 	struct bch_inode_unpacked ei_inode;
 };
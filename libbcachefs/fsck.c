@@ -13,7 +13,6 @@
 #include "xattr.h"
 
 #include <linux/dcache.h> /* struct qstr */
-#include <linux/generic-radix-tree.h>
 
 #define QSTR(n) { { { .len = strlen(n) } }, .name = n }
 
@@ -859,7 +858,8 @@ create_lostfound:
 		bch2_create_trans(&trans,
 				  BCACHEFS_ROOT_INO, root_inode,
 				  lostfound_inode, &lostfound,
-				  0, 0, S_IFDIR|0700, 0, NULL, NULL));
+				  0, 0, S_IFDIR|0700, 0,
+				  NULL, NULL, NULL, NULL));
 	if (ret)
 		bch_err(c, "error creating lost+found: %i", ret);
 
@@ -1076,23 +1076,110 @@ struct nlink {
 	u32	dir_count;
 };
 
-typedef GENRADIX(struct nlink) nlink_table;
+/*
+ * The nlink table is indexed by inode number and gets enormous on large
+ * filesystems. Instead of growing it incrementally - which fragments the heap
+ * and doesn't fail until the OOM killer shows up - we size it upfront for the
+ * range of inodes each pass covers, and when it won't fit in memory back it
+ * with an mmapped temporary file: a slow fsck beats one that dies at hour six.
+ */
+struct nlink_table {
+	struct nlink	*t;
+	u64		nr;
+#ifndef __KERNEL__
+	bool		file_backed;
+#endif
+};
+
+/*
+ * Bounds the per pass table: when file backed this only limits address space
+ * and temporary file size, not memory usage:
+ */
+#define NLINK_TABLE_MAX_BYTES	(16ULL << 30)
+
+#ifndef __KERNEL__
+#include <sys/mman.h>
+#include <unistd.h>
+
+static u64 nlink_table_mem_budget(void)
+{
+	return ((u64) sysconf(_SC_PHYS_PAGES) *
+		(u64) sysconf(_SC_PAGE_SIZE)) / 2;
+}
+
+static int nlink_table_alloc(struct bch_fs *c, struct nlink_table *t, u64 nr)
+{
+	size_t bytes = nr * sizeof(struct nlink);
+
+	t->t		= NULL;
+	t->nr		= nr;
+	t->file_backed	= false;
+
+	if (bytes <= nlink_table_mem_budget())
+		t->t = vzalloc(bytes);
+
+	if (!t->t) {
+		FILE *f = tmpfile();
+
+		if (!f)
+			return -ENOMEM;
+
+		if (ftruncate(fileno(f), bytes)) {
+			fclose(f);
+			return -ENOMEM;
+		}
+
+		t->t = mmap(NULL, bytes, PROT_READ|PROT_WRITE,
+			    MAP_SHARED, fileno(f), 0);
+		fclose(f);
+
+		if (t->t == MAP_FAILED) {
+			t->t = NULL;
+			return -ENOMEM;
+		}
+
+		t->file_backed = true;
+		bch_verbose(c, "fsck: nlink table (%zu bytes) backed by temporary file",
+			    bytes);
+	}
 
-static void inc_link(struct bch_fs *c, nlink_table *links,
-		     u64 range_start, u64 *range_end,
+	return 0;
+}
+
+static void nlink_table_free(struct nlink_table *t)
+{
+	if (t->file_backed)
+		munmap(t->t, t->nr * sizeof(struct nlink));
+	else
+		vfree(t->t);
+	t->t = NULL;
+}
+#else
+static int nlink_table_alloc(struct bch_fs *c, struct nlink_table *t, u64 nr)
+{
+	t->nr	= nr;
+	t->t	= vzalloc(nr * sizeof(struct nlink));
+
+	return t->t ? 0 : -ENOMEM;
+}
+
+static void nlink_table_free(struct nlink_table *t)
+{
+	vfree(t->t);
+	t->t = NULL;
+}
+#endif
+
+static void inc_link(struct bch_fs *c, struct nlink_table *links,
+		     u64 range_start, u64 range_end,
 		     u64 inum, bool dir)
 {
 	struct nlink *link;
 
-	if (inum < range_start || inum >= *range_end)
+	if (inum < range_start || inum >= range_end)
 		return;
 
-	link = genradix_ptr_alloc(links, inum - range_start, GFP_KERNEL);
-	if (!link) {
-		bch_verbose(c, "allocation failed during fsck - will need another pass");
-		*range_end = inum;
-		return;
-	}
+	link = &links->t[inum - range_start];
 
 	if (dir)
 		link->dir_count++;
@@ -1101,8 +1188,8 @@ static void inc_link(struct bch_fs *c, nlink_table *links,
 }
 
 noinline_for_stack
-static int bch2_gc_walk_dirents(struct bch_fs *c, nlink_table *links,
-			       u64 range_start, u64 *range_end)
+static int bch2_gc_walk_dirents(struct bch_fs *c, struct nlink_table *links,
+			       u64 range_start, u64 range_end)
 {
 	struct btree_trans trans;
 	struct btree_iter *iter;
@@ -1343,37 +1430,38 @@ fsck_err:
 noinline_for_stack
 static int bch2_gc_walk_inodes(struct bch_fs *c,
 			       struct bch_inode_unpacked *lostfound_inode,
-			       nlink_table *links,
+			       struct nlink_table *links,
 			       u64 range_start, u64 range_end)
 {
 	struct btree_trans trans;
 	struct btree_iter *iter;
 	struct bkey_s_c k;
 	struct nlink *link, zero_links = { 0, 0 };
-	struct genradix_iter nlinks_iter;
 	int ret = 0, ret2 = 0;
+	u64 nlinks_idx = 0;
 	u64 nlinks_pos;
 
 	bch2_trans_init(&trans, c, BTREE_ITER_MAX, 0);
 
 	iter = bch2_trans_get_iter(&trans, BTREE_ID_INODES,
 				   POS(0, range_start), 0);
-	nlinks_iter = genradix_iter_init(links, 0);
 
 	while ((k = bch2_btree_iter_peek(iter)).k &&
 	       !(ret2 = bkey_err(k))) {
-peek_nlinks:	link = genradix_iter_peek(&nlinks_iter, links);
+peek_nlinks:	link = nlinks_idx < links->nr
+			? &links->t[nlinks_idx]
+			: NULL;
 
 		if (!link && (!k.k || iter->pos.offset >= range_end))
 			break;
 
-		nlinks_pos = range_start + nlinks_iter.pos;
+		nlinks_pos = range_start + nlinks_idx;
 		if (iter->pos.offset > nlinks_pos) {
 			/* Should have been caught by dirents pass: */
 			need_fsck_err_on(link && link->count, c,
 				"missing inode %llu (nlink %u)",
 				nlinks_pos, link->count);
-			genradix_iter_advance(&nlinks_iter, links);
+			nlinks_idx++;
 			goto peek_nlinks;
 		}
 
@@ -1394,7 +1482,7 @@ peek_nlinks:	link = genradix_iter_peek(&nlinks_iter, links);
 		}
 
 		if (nlinks_pos == iter->pos.offset)
-			genradix_iter_advance(&nlinks_iter, links);
+			nlinks_idx++;
 
 		bch2_btree_iter_next(iter);
 		bch2_trans_cond_resched(&trans);
@@ -1408,38 +1496,76 @@ fsck_err:
 	return ret ?: ret2;
 }
 
+static int bch2_count_inodes(struct bch_fs *c, u64 *nr_inodes, u64 *max_inum)
+{
+	struct btree_trans trans;
+	struct btree_iter *iter;
+	struct bkey_s_c k;
+	int ret;
+
+	*nr_inodes	= 0;
+	*max_inum	= 0;
+
+	bch2_trans_init(&trans, c, BTREE_ITER_MAX, 0);
+
+	for_each_btree_key(&trans, iter, BTREE_ID_INODES, POS_MIN, 0, k, ret)
+		if (k.k->type == KEY_TYPE_inode) {
+			(*nr_inodes)++;
+			*max_inum = k.k->p.offset;
+		}
+
+	return bch2_trans_exit(&trans) ?: ret;
+}
+
 noinline_for_stack
 static int check_inode_nlinks(struct bch_fs *c,
 			      struct bch_inode_unpacked *lostfound_inode)
 {
-	nlink_table links;
+	struct nlink_table links;
+	u64 nr_inodes, max_inum;
 	u64 this_iter_range_start, next_iter_range_start = 0;
 	int ret = 0;
 
 	bch_verbose(c, "checking inode nlinks");
 
-	genradix_init(&links);
+	ret = bch2_count_inodes(c, &nr_inodes, &max_inum);
+	if (ret) {
+		bch_err(c, "error in fsck: btree error %i while counting inodes", ret);
+		return ret;
+	}
+
+	bch_verbose(c, "fsck: %llu inodes, max inode number %llu",
+		    nr_inodes, max_inum);
 
 	do {
+		u64 nr = min_t(u64, max_inum + 1 - next_iter_range_start,
+			       NLINK_TABLE_MAX_BYTES / sizeof(struct nlink));
+
 		this_iter_range_start = next_iter_range_start;
-		next_iter_range_start = U64_MAX;
+
+		while ((ret = nlink_table_alloc(c, &links, nr)) &&
+		       nr > 1024)
+			nr /= 2;
+		if (ret) {
+			bch_err(c, "error in fsck: unable to allocate nlink table");
+			break;
+		}
+
+		next_iter_range_start = this_iter_range_start + nr;
 
 		ret = bch2_gc_walk_dirents(c, &links,
 					  this_iter_range_start,
-					  &next_iter_range_start);
-		if (ret)
-			break;
+					  next_iter_range_start);
+		if (!ret)
+			ret = bch2_gc_walk_inodes(c, lostfound_inode, &links,
+						 this_iter_range_start,
+						 next_iter_range_start);
+
+		nlink_table_free(&links);
 
-		ret = bch2_gc_walk_inodes(c, lostfound_inode, &links,
-					 this_iter_range_start,
-					 next_iter_range_start);
 		if (ret)
 			break;
-
-		genradix_free(&links);
-	} while (next_iter_range_start != U64_MAX);
-
-	genradix_free(&links);
+	} while (next_iter_range_start <= max_inum);
 
 	return ret;
 }
@@ -1448,17 +1574,90 @@ static int check_inode_nlinks(struct bch_fs *c,
  * Checks for inconsistencies that shouldn't happen, unless we have a bug.
  * Doesn't fix them yet, mainly because they haven't yet been observed:
  */
+struct fsck_pass_work {
+	struct work_struct	work;
+	struct bch_fs		*c;
+	const char		*name;
+	int			(*fn)(struct bch_fs *);
+	u64			elapsed;
+	int			ret;
+};
+
+static void fsck_pass_work_fn(struct work_struct *work)
+{
+	struct fsck_pass_work *w =
+		container_of(work, struct fsck_pass_work, work);
+	u64 start = local_clock();
+
+	w->ret = w->fn(w->c);
+	w->elapsed = local_clock() - start;
+}
+
+static void fsck_pass_done(struct bch_fs *c, const char *name, u64 elapsed)
+{
+	bch_verbose(c, "fsck pass %s done in %llu ms",
+		    name, div_u64(elapsed, NSEC_PER_MSEC));
+}
+
 int bch2_fsck_full(struct bch_fs *c)
 {
 	struct bch_inode_unpacked root_inode, lostfound_inode;
+#define FSCK_PASS(_fn)	{ .c = c, .fn = _fn, .name = #_fn }
+	struct fsck_pass_work w[] = {
+		FSCK_PASS(check_extents),
+		FSCK_PASS(check_dirents),
+		FSCK_PASS(check_xattrs),
+	};
+#undef FSCK_PASS
+	unsigned i;
+	u64 start;
+	int ret = 0;
 
-	return  check_extents(c) ?:
-		check_dirents(c) ?:
-		check_xattrs(c) ?:
-		check_root(c, &root_inode) ?:
-		check_lostfound(c, &root_inode, &lostfound_inode) ?:
-		check_directory_structure(c, &lostfound_inode) ?:
-		check_inode_nlinks(c, &lostfound_inode);
+	/*
+	 * The leading passes each scan their own btree and only do point
+	 * lookups against the inodes btree; none depends on another's
+	 * repairs. Running them concurrently keeps every btree scan in
+	 * flight at once, instead of paying cold cache read latency
+	 * serially pass after pass.
+	 *
+	 * The remaining passes stay ordered: directory structure needs
+	 * repaired dirents, and the nlink check has to count dirents after
+	 * the dirent repairs:
+	 */
+	for (i = 0; i < ARRAY_SIZE(w); i++) {
+		INIT_WORK(&w[i].work, fsck_pass_work_fn);
+		queue_work(system_unbound_wq, &w[i].work);
+	}
+
+	for (i = 0; i < ARRAY_SIZE(w); i++) {
+		flush_work(&w[i].work);
+		fsck_pass_done(c, w[i].name, w[i].elapsed);
+		ret = ret ?: w[i].ret;
+	}
+
+	if (ret)
+		return ret;
+
+	start = local_clock();
+	ret =   check_root(c, &root_inode) ?:
+		check_lostfound(c, &root_inode, &lostfound_inode);
+	if (ret)
+		return ret;
+	fsck_pass_done(c, "check_root", local_clock() - start);
+
+	start = local_clock();
+	ret = check_directory_structure(c, &lostfound_inode);
+	if (ret)
+		return ret;
+	fsck_pass_done(c, "check_directory_structure", local_clock() - start);
+
+	start = local_clock();
+	ret = check_inode_nlinks(c, &lostfound_inode);
+	if (ret)
+		return ret;
+	fsck_pass_done(c, "check_inode_nlinks", local_clock() - start);
+
+	return 0;
 }
 
 int bch2_fsck_inode_nlink(struct bch_fs *c)
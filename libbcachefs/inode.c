@@ -88,6 +88,68 @@ static int inode_decode_field(const u8 *in, const u8 *end,
 	return bytes;
 }
 
+enum {
+	BCH_INODE_FIELDS_NR	= 0
+#define x(_name, _bits)		+ 1
+	BCH_INODE_FIELDS()
+#undef x
+};
+
+/*
+ * Decode variant requiring a padded input buffer: reads a full 16 bytes at @in
+ * regardless of the field's actual length, trading the byte at a time copy in
+ * inode_decode_field() for two unaligned loads:
+ */
+static int inode_decode_field_fast(const u8 *in, const u8 *end,
+				   u64 out[2], unsigned *out_bits)
+{
+	unsigned bytes, shift, bit;
+	u64 hi, lo;
+
+	if (in >= end)
+		return -1;
+
+	if (!*in)
+		return -1;
+
+	/*
+	 * position of highest set bit indicates number of bytes:
+	 * shift = number of bits to remove in high byte:
+	 */
+	shift	= 8 - __fls(*in); /* 1 <= shift <= 8 */
+	bytes	= byte_table[shift - 1];
+
+	if (in + bytes > end)
+		return -1;
+
+	hi = get_unaligned_be64(in);
+	lo = get_unaligned_be64(in + 8);
+
+	/* right align the bytes long big endian value in hi:lo: */
+	if (bytes <= 8) {
+		lo = hi >> ((8 - bytes) << 3);
+		hi = 0;
+	} else {
+		unsigned drop = (16 - bytes) << 3;
+
+		lo = (lo >> drop) | (hi << (64 - drop));
+		hi >>= drop;
+	}
+
+	/* clear the length marker bit: */
+	bit = (bytes << 3) - shift;
+	if (bit < 64)
+		lo ^= 1ULL << bit;
+	else
+		hi ^= 1ULL << (bit - 64);
+
+	out[0] = hi;
+	out[1] = lo;
+	*out_bits = out[0] ? 64 + fls64(out[0]) : fls64(out[1]);
+
+	return bytes;
+}
+
 void bch2_inode_pack(struct bkey_inode_buf *packed,
 		     const struct bch_inode_unpacked *inode)
 {
@@ -143,11 +205,26 @@ void bch2_inode_pack(struct bkey_inode_buf *packed,
 int bch2_inode_unpack(struct bkey_s_c_inode inode,
 		      struct bch_inode_unpacked *unpacked)
 {
+	u8 buf[13 * BCH_INODE_FIELDS_NR + 16];
 	const u8 *in = inode.v->fields;
 	const u8 *end = (void *) inode.v + bkey_val_bytes(inode.k);
 	u64 field[2];
 	unsigned fieldnr = 0, field_bits;
 	int ret;
+	bool fast = end - in <= (int) sizeof(buf) - 16;
+
+	/*
+	 * Copy the field area to a stack buffer with 16 bytes of zero padding,
+	 * so the fast decoder's full width loads can never read out of bounds.
+	 * Any sanely encoded inode fits; too-long field areas (corruption, or
+	 * a future format) take the byte at a time path:
+	 */
+	if (likely(fast)) {
+		memcpy(buf, in, end - in);
+		memset(buf + (end - in), 0, 16);
+		end = buf + (end - in);
+		in = buf;
+	}
 
 	unpacked->bi_inum	= inode.k->p.offset;
 	unpacked->bi_hash_seed	= inode.v->bi_hash_seed;
@@ -162,7 +239,9 @@ int bch2_inode_unpack(struct bkey_s_c_inode inode,
 		return 0;						\
 	}								\
 									\
-	ret = inode_decode_field(in, end, field, &field_bits);		\
+	ret = likely(fast)						\
+		? inode_decode_field_fast(in, end, field, &field_bits)	\
+		: inode_decode_field(in, end, field, &field_bits);	\
 	if (ret < 0)							\
 		return ret;						\
 									\
@@ -272,7 +351,9 @@ void bch2_inode_to_text(struct printbuf *out, struct bch_fs *c,
 	}
 
 #define x(_name, _bits)						\
-	pr_buf(out, #_name ": %llu ", (u64) unpacked._name);
+	pr_string(out, #_name ": ");				\
+	pr_u64(out, (u64) unpacked._name);			\
+	pr_char(out, ' ');
 	BCH_INODE_FIELDS()
 #undef  x
 }
@@ -358,20 +439,48 @@ static inline u32 bkey_generation(struct bkey_s_c k)
 	}
 }
 
+#define INODE_LEASE_NR		1024
+
+static u64 inum_lease_get(struct bch_fs *c, u64 min, u64 max)
+{
+	u64 ret = 0;
+
+	spin_lock(&c->inum_lease_lock);
+	if (c->inum_lease_next < c->inum_lease_end &&
+	    c->inum_lease_next >= min &&
+	    c->inum_lease_next <  max)
+		ret = c->inum_lease_next++;
+	spin_unlock(&c->inum_lease_lock);
+
+	return ret;
+}
+
+static void inum_lease_set(struct bch_fs *c, u64 start, u64 end)
+{
+	spin_lock(&c->inum_lease_lock);
+	/* don't clobber a bigger lease another probe just set: */
+	if (end - start > c->inum_lease_end - c->inum_lease_next) {
+		c->inum_lease_next	= start;
+		c->inum_lease_end	= end;
+	}
+	spin_unlock(&c->inum_lease_lock);
+}
+
 int bch2_inode_create(struct btree_trans *trans,
 		      struct bch_inode_unpacked *inode_u,
 		      u64 min, u64 max, u64 *hint)
 {
+	struct bch_fs *c = trans->c;
 	struct bkey_inode_buf *inode_p;
 	struct btree_iter *iter = NULL;
 	struct bkey_s_c k;
-	u64 start;
+	u64 start, inum;
 	int ret;
 
 	if (!max)
 		max = ULLONG_MAX;
 
-	if (trans->c->opts.inodes_32bit)
+	if (c->opts.inodes_32bit)
 		max = min_t(u64, max, U32_MAX);
 
 	start = READ_ONCE(*hint);
@@ -382,14 +491,45 @@ int bch2_inode_create(struct btree_trans *trans,
 	inode_p = bch2_trans_kmalloc(trans, sizeof(*inode_p));
 	if (IS_ERR(inode_p))
 		return PTR_ERR(inode_p);
+
+	/*
+	 * Fast path: take an inum from the lease - one slot read (we still
+	 * need the old key for the generation number) instead of probing.
+	 * Occupied slots just mean the lease was set optimistically; skip
+	 * them:
+	 */
+	while ((inum = inum_lease_get(c, min, max))) {
+		iter = bch2_trans_get_iter(trans, BTREE_ID_INODES,
+					   POS(0, inum),
+					   BTREE_ITER_SLOTS|BTREE_ITER_INTENT);
+		k = bch2_btree_iter_peek_slot(iter);
+		ret = bkey_err(k);
+		if (ret) {
+			bch2_trans_iter_put(trans, iter);
+			return ret;
+		}
+
+		if (k.k->type != KEY_TYPE_inode)
+			goto found_slot;
+
+		bch2_trans_iter_put(trans, iter);
+	}
 again:
 	for_each_btree_key(trans, iter, BTREE_ID_INODES, POS(0, start),
 			   BTREE_ITER_SLOTS|BTREE_ITER_INTENT, k, ret) {
 		if (bkey_cmp(iter->pos, POS(0, max)) > 0)
 			break;
 
-		if (k.k->type != KEY_TYPE_inode)
+		if (k.k->type != KEY_TYPE_inode) {
+			/*
+			 * Lease out the inums after the one we're using;
+			 * they're only probably free, but handout rechecks:
+			 */
+			inum_lease_set(c, k.k->p.offset + 1,
+				       min_t(u64, k.k->p.offset + 1 +
+					     INODE_LEASE_NR, max));
 			goto found_slot;
+		}
 	}
 
 	bch2_trans_iter_put(trans, iter);
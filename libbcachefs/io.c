@@ -242,16 +242,19 @@ static int sum_sector_overwrites(struct btree_trans *trans,
 	return ret;
 }
 
-int bch2_extent_update(struct btree_trans *trans,
-		       struct btree_iter *iter,
-		       struct bkey_i *k,
-		       struct disk_reservation *disk_res,
-		       u64 *journal_seq,
-		       u64 new_i_size,
-		       s64 *i_sectors_delta)
+/*
+ * Stage an extent update (and the corresponding inode i_size/i_sectors
+ * update) in @trans, without committing: @inode_p is caller provided storage
+ * that must live until after the commit.
+ */
+static int bch2_extent_update_stage(struct btree_trans *trans,
+				    struct btree_iter *iter,
+				    struct bkey_i *k,
+				    bool may_allocate,
+				    u64 new_i_size,
+				    struct bkey_inode_buf *inode_p,
+				    s64 *i_sectors_delta)
 {
-	/* this must live until after bch2_trans_commit(): */
-	struct bkey_inode_buf inode_p;
 	bool extending = false;
 	s64 delta = 0;
 	int ret;
@@ -260,9 +263,8 @@ int bch2_extent_update(struct btree_trans *trans,
 	if (ret)
 		return ret;
 
-	ret = sum_sector_overwrites(trans, iter, k,
-			disk_res && disk_res->sectors != 0,
-			&extending, &delta);
+	ret = sum_sector_overwrites(trans, iter, k, may_allocate,
+				    &extending, &delta);
 	if (ret)
 		return ret;
 
@@ -300,9 +302,9 @@ int bch2_extent_update(struct btree_trans *trans,
 		inode_u.bi_sectors += delta;
 
 		if (delta || new_i_size) {
-			bch2_inode_pack(&inode_p, &inode_u);
+			bch2_inode_pack(inode_p, &inode_u);
 			bch2_trans_update(trans, inode_iter,
-					  &inode_p.inode.k_i, 0);
+					  &inode_p->inode.k_i, 0);
 		}
 
 		bch2_trans_iter_put(trans, inode_iter);
@@ -310,6 +312,31 @@ int bch2_extent_update(struct btree_trans *trans,
 
 	bch2_trans_update(trans, iter, k, 0);
 
+	if (i_sectors_delta)
+		*i_sectors_delta = delta;
+
+	return 0;
+}
+
+int bch2_extent_update(struct btree_trans *trans,
+		       struct btree_iter *iter,
+		       struct bkey_i *k,
+		       struct disk_reservation *disk_res,
+		       u64 *journal_seq,
+		       u64 new_i_size,
+		       s64 *i_sectors_delta)
+{
+	/* this must live until after bch2_trans_commit(): */
+	struct bkey_inode_buf inode_p;
+	s64 delta = 0;
+	int ret;
+
+	ret = bch2_extent_update_stage(trans, iter, k,
+			disk_res && disk_res->sectors != 0,
+			new_i_size, &inode_p, &delta);
+	if (ret)
+		return ret;
+
 	ret = bch2_trans_commit(trans, disk_res, journal_seq,
 				BTREE_INSERT_NOCHECK_RW|
 				BTREE_INSERT_NOFAIL|
@@ -397,6 +424,7 @@ int bch2_write_index_default(struct bch_write_op *op)
 	struct bkey_on_stack sk;
 	struct keylist *keys = &op->insert_keys;
 	struct bkey_i *k = bch2_keylist_front(keys);
+	struct bkey_i *n;
 	struct btree_trans trans;
 	struct btree_iter *iter;
 	int ret;
@@ -417,6 +445,24 @@ int bch2_write_index_default(struct bch_write_op *op)
 		bkey_copy(sk.k, k);
 		bch2_cut_front(iter->pos, sk.k);
 
+		/*
+		 * A write that got split - by the allocator, or to respect
+		 * encoded_extent_max - comes back as a run of contiguous
+		 * extents: merge them back together here, before they go to
+		 * the btree, so the run costs one btree update and one
+		 * journal entry instead of one per extent (they'd be merged
+		 * on insert anyways, but only after being journalled
+		 * individually):
+		 */
+		for (n = bkey_next(k); n != keys->top; n = bkey_next(n)) {
+			if ((u64) sk.k->k.size + n->k.size > KEY_SIZE_MAX)
+				break;
+
+			if (bch2_bkey_merge(c, bkey_i_to_s(sk.k),
+					    bkey_i_to_s(n)) != BCH_MERGE_MERGE)
+				break;
+		}
+
 		ret = bch2_extent_update(&trans, iter, sk.k,
 					 &op->res, op_journal_seq(op),
 					 op->new_i_size, &op->i_sectors_delta);
@@ -425,7 +471,9 @@ int bch2_write_index_default(struct bch_write_op *op)
 		if (ret)
 			break;
 
-		if (bkey_cmp(iter->pos, k->k.p) >= 0)
+		while (!bch2_keylist_empty(keys) &&
+		       bkey_cmp(iter->pos,
+				bch2_keylist_front(keys)->k.p) >= 0)
 			bch2_keylist_pop_front(keys);
 	} while (!bch2_keylist_empty(keys));
 
@@ -525,14 +573,12 @@ static void bch2_write_done(struct closure *cl)
 /**
  * bch_write_index - after a write, update index to point to new data
  */
-static void __bch2_write_index(struct bch_write_op *op)
+static int bch2_write_index_prep(struct bch_write_op *op)
 {
 	struct bch_fs *c = op->c;
 	struct keylist *keys = &op->insert_keys;
 	struct bch_extent_ptr *ptr;
 	struct bkey_i *src, *dst = keys->keys, *n, *k;
-	unsigned dev;
-	int ret;
 
 	for (src = keys->keys; src != keys->top; src = n) {
 		n = bkey_next(src);
@@ -541,10 +587,8 @@ static void __bch2_write_index(struct bch_write_op *op)
 			bch2_bkey_drop_ptrs(bkey_i_to_s(src), ptr,
 					    test_bit(ptr->dev, op->failed.d));
 
-			if (!bch2_bkey_nr_ptrs(bkey_i_to_s_c(src))) {
-				ret = -EIO;
-				goto err;
-			}
+			if (!bch2_bkey_nr_ptrs(bkey_i_to_s_c(src)))
+				return -EIO;
 		}
 
 		if (dst != src)
@@ -567,6 +611,13 @@ static void __bch2_write_index(struct bch_write_op *op)
 
 	}
 
+	return 0;
+}
+
+static void bch2_write_op_index_update(struct bch_write_op *op)
+{
+	struct keylist *keys = &op->insert_keys;
+
 	if (!bch2_keylist_empty(keys)) {
 		u64 sectors_start = keylist_sectors(keys);
 		int ret = op->index_update_fn(op);
@@ -577,21 +628,300 @@ static void __bch2_write_index(struct bch_write_op *op)
 		op->written += sectors_start - keylist_sectors(keys);
 
 		if (ret) {
-			__bcache_io_error(c, "btree IO error %i", ret);
+			__bcache_io_error(op->c, "btree IO error %i", ret);
 			op->error = ret;
 		}
 	}
+}
+
+static void __bch2_write_index(struct bch_write_op *op)
+{
+	struct bch_fs *c = op->c;
+	unsigned dev;
+	int ret;
+
+	ret = bch2_write_index_prep(op);
+	if (ret) {
+		op->insert_keys.top = op->insert_keys.keys;
+		op->error = ret;
+		goto out;
+	}
+
+	bch2_write_op_index_update(op);
 out:
 	/* If some a bucket wasn't written, we can't erasure code it: */
 	for_each_set_bit(dev, op->failed.d, BCH_SB_MEMBERS_MAX)
 		bch2_open_bucket_write_error(c, &op->open_buckets, dev);
 
 	bch2_open_buckets_put(c, &op->open_buckets);
-	return;
-err:
-	keys->top = keys->keys;
-	op->error = ret;
-	goto out;
+}
+
+/*
+ * Write completion batching: under high iops every completing small write did
+ * its own transaction commit, each taking and releasing the journal
+ * reservation lock. Completions that arrive close together are instead
+ * staged on a per filesystem list, and whichever op gets there first drains
+ * it, merging index updates into shared commits.
+ *
+ * Only one extent per inode goes in a given commit (two updates to the same
+ * inode key would clobber each other's i_size/i_sectors update), so merged
+ * updates can never overlap; ops whose extents don't fit the fast path fall
+ * back to the usual one-op path. Ops' disk reservations are moved into a
+ * combined reservation for the shared commit, and the leftover is released
+ * directly - by then the donating ops have nothing left to allocate.
+ */
+
+#define WRITE_INDEX_BATCH_MAX	8
+
+struct write_index_batch_entry {
+	struct bch_write_op	*op;
+	struct btree_iter	*iter;
+	struct bkey_on_stack	k;
+	/* must live until after bch2_trans_commit(): */
+	struct bkey_inode_buf	inode_p;
+	s64			delta;
+	u64			res_sectors;
+};
+
+static void bch2_write_op_index_done(struct bch_write_op *op)
+{
+	struct bch_fs *c = op->c;
+	struct closure *cl = &op->cl;
+	unsigned dev;
+
+	/* If some a bucket wasn't written, we can't erasure code it: */
+	for_each_set_bit(dev, op->failed.d, BCH_SB_MEMBERS_MAX)
+		bch2_open_bucket_write_error(c, &op->open_buckets, dev);
+
+	bch2_open_buckets_put(c, &op->open_buckets);
+
+	if (!op->error && (op->flags & BCH_WRITE_FLUSH)) {
+		bch2_journal_flush_seq_async(&c->journal,
+					     *op_journal_seq(op),
+					     cl);
+		continue_at_noreturn(cl, bch2_write_done, index_update_wq(op));
+	} else {
+		continue_at_nobarrier(cl, bch2_write_done, NULL);
+	}
+}
+
+static void bch2_write_index_batch_update(struct bch_fs *c,
+					  struct list_head *batch)
+{
+	struct write_index_batch_entry e[WRITE_INDEX_BATCH_MAX];
+	struct btree_trans trans;
+	struct bch_write_op *op, *t;
+	LIST_HEAD(fallback);
+	unsigned i, nr;
+	int ret;
+
+	/*
+	 * Failed ptr dropping and the rebalance hooks don't need the
+	 * transaction; weed out ops that can't take the merged path while
+	 * we're at it:
+	 */
+	list_for_each_entry_safe(op, t, batch, index_list) {
+		struct keylist *keys = &op->insert_keys;
+
+		ret = bch2_write_index_prep(op);
+		if (ret) {
+			keys->top = keys->keys;
+			op->error = ret;
+			list_del(&op->index_list);
+			bch2_write_op_index_done(op);
+			continue;
+		}
+
+		if (bch2_keylist_empty(keys)) {
+			list_del(&op->index_list);
+			bch2_write_op_index_done(op);
+			continue;
+		}
+
+		/* Writes that got split take the one-op path: */
+		if (bkey_next(bch2_keylist_front(keys)) != keys->top)
+			list_move_tail(&op->index_list, &fallback);
+	}
+
+	for (i = 0; i < WRITE_INDEX_BATCH_MAX; i++)
+		bkey_on_stack_init(&e[i].k);
+
+	bch2_trans_init(&trans, c, BTREE_ITER_MAX, 1024);
+
+	while (!list_empty(batch)) {
+		struct disk_reservation res = { 0 };
+		u64 batch_seq = 0;
+
+		nr = 0;
+retry:
+		bch2_trans_begin(&trans);
+
+		list_for_each_entry_safe(op, t, batch, index_list) {
+			struct bkey_i *orig =
+				bch2_keylist_front(&op->insert_keys);
+			struct write_index_batch_entry *b = &e[nr];
+
+			if (nr == WRITE_INDEX_BATCH_MAX)
+				break;
+
+			if (!nr)
+				res.nr_replicas = op->res.nr_replicas;
+			else if (op->res.nr_replicas != res.nr_replicas)
+				continue;
+
+			/* One extent per inode per commit: */
+			for (i = 0; i < nr; i++)
+				if (e[i].k.k->k.p.inode == orig->k.p.inode)
+					break;
+			if (i != nr)
+				continue;
+
+			b->op = op;
+			b->delta = 0;
+			bkey_on_stack_realloc(&b->k, c, orig->k.u64s);
+			bkey_copy(b->k.k, orig);
+
+			b->iter = bch2_trans_get_iter(&trans, BTREE_ID_EXTENTS,
+					bkey_start_pos(&orig->k),
+					BTREE_ITER_SLOTS|BTREE_ITER_INTENT);
+			if (IS_ERR(b->iter)) {
+				list_move_tail(&op->index_list, &fallback);
+				continue;
+			}
+
+			/*
+			 * An extent that would be trimmed needs the usual
+			 * cut-and-loop; check before anything is staged:
+			 */
+			ret = bch2_extent_trim_atomic(b->k.k, b->iter);
+			if (ret || bkey_cmp(b->k.k->k.p, orig->k.p)) {
+				bch2_trans_iter_put(&trans, b->iter);
+				list_move_tail(&op->index_list, &fallback);
+				continue;
+			}
+
+			ret = bch2_extent_update_stage(&trans, b->iter, b->k.k,
+					op->res.sectors != 0,
+					op->new_i_size,
+					&b->inode_p, &b->delta);
+			if (ret == -EINTR) {
+				bch2_trans_iter_put(&trans, b->iter);
+				goto err_restore;
+			}
+			if (ret) {
+				bch2_trans_iter_put(&trans, b->iter);
+				list_move_tail(&op->index_list, &fallback);
+				continue;
+			}
+
+			b->res_sectors	 = op->res.sectors;
+			res.sectors	+= op->res.sectors;
+			op->res.sectors	 = 0;
+			nr++;
+		}
+
+		if (!nr)
+			continue;
+
+		ret = bch2_trans_commit(&trans, &res, &batch_seq,
+					BTREE_INSERT_NOCHECK_RW|
+					BTREE_INSERT_NOFAIL|
+					BTREE_INSERT_USE_RESERVE);
+		if (ret == -EINTR)
+			goto err_restore;
+		if (ret) {
+			/* Reservations weren't consumed: */
+			for (i = 0; i < nr; i++) {
+				e[i].op->res.sectors += e[i].res_sectors;
+				bch2_trans_iter_put(&trans, e[i].iter);
+				list_move_tail(&e[i].op->index_list, &fallback);
+			}
+			continue;
+		}
+
+		bch2_disk_reservation_put(c, &res);
+
+		for (i = 0; i < nr; i++) {
+			struct keylist *keys;
+
+			op = e[i].op;
+			keys = &op->insert_keys;
+
+			*op_journal_seq(op)	 = batch_seq;
+			op->i_sectors_delta	+= e[i].delta;
+			op->written		+= keylist_sectors(keys);
+			bch2_keylist_pop_front(keys);
+
+			bch2_trans_iter_put(&trans, e[i].iter);
+			list_del(&op->index_list);
+			bch2_write_op_index_done(op);
+		}
+		continue;
+err_restore:
+		for (i = 0; i < nr; i++) {
+			e[i].op->res.sectors += e[i].res_sectors;
+			bch2_trans_iter_put(&trans, e[i].iter);
+		}
+		nr = 0;
+		res.sectors = 0;
+		goto retry;
+	}
+
+	bch2_trans_exit(&trans);
+
+	for (i = 0; i < WRITE_INDEX_BATCH_MAX; i++)
+		bkey_on_stack_exit(&e[i].k, c);
+
+	list_for_each_entry_safe(op, t, &fallback, index_list) {
+		list_del(&op->index_list);
+		bch2_write_op_index_update(op);
+		bch2_write_op_index_done(op);
+	}
+}
+
+static bool bch2_write_index_batch(struct bch_write_op *op)
+{
+	struct bch_fs *c = op->c;
+
+	if (!(op->flags & BCH_WRITE_DONE) ||
+	    op->error ||
+	    op->index_update_fn != bch2_write_index_default)
+		return false;
+
+	spin_lock(&c->write_index_lock);
+	list_add_tail(&op->index_list, &c->write_index_list);
+
+	if (c->write_index_running) {
+		/* The current drainer will pick us up: */
+		spin_unlock(&c->write_index_lock);
+		return true;
+	}
+
+	c->write_index_running = true;
+
+	while (!list_empty(&c->write_index_list)) {
+		LIST_HEAD(batch);
+		unsigned nr = 0;
+
+		while (nr < WRITE_INDEX_BATCH_MAX &&
+		       !list_empty(&c->write_index_list)) {
+			struct bch_write_op *i =
+				list_first_entry(&c->write_index_list,
+						 struct bch_write_op,
+						 index_list);
+
+			list_move_tail(&i->index_list, &batch);
+			nr++;
+		}
+
+		spin_unlock(&c->write_index_lock);
+		bch2_write_index_batch_update(c, &batch);
+		spin_lock(&c->write_index_lock);
+	}
+
+	c->write_index_running = false;
+	spin_unlock(&c->write_index_lock);
+	return true;
 }
 
 static void bch2_write_index(struct closure *cl)
@@ -599,6 +929,9 @@ static void bch2_write_index(struct closure *cl)
 	struct bch_write_op *op = container_of(cl, struct bch_write_op, cl);
 	struct bch_fs *c = op->c;
 
+	if (bch2_write_index_batch(op))
+		return;
+
 	__bch2_write_index(op);
 
 	if (!(op->flags & BCH_WRITE_DONE)) {
@@ -862,6 +1195,128 @@ static enum prep_encoded_ret {
 	return PREP_ENCODED_OK;
 }
 
+/*
+ * Parallel compression offload: each checksum unit (at most
+ * encoded_extent_max) compresses independently, but normally
+ * bch2_write_extent() compresses them one after the other on the submitting
+ * thread, capping compressed write throughput at single core compression
+ * speed. When the compression_offload option is enabled we slice large writes
+ * into those units up front and compress them concurrently on
+ * system_unbound_wq (where the read path already punts decompression), then
+ * consume the results in order.
+ *
+ * The offloaded results are only valid as long as each unit consumed a full
+ * slice of input; the first unit that comes back incompressible or short
+ * invalidates the slicing of everything after it, and the remainder of the
+ * write falls back to compressing inline.
+ */
+
+struct compress_offload_task {
+	struct work_struct	work;
+	struct completion	done;
+	struct bch_fs		*c;
+	struct bio		src;
+	struct bio		dst;
+	void			*buf;
+	size_t			buf_size;
+	size_t			src_len;
+	size_t			dst_len;
+	unsigned		compression_type;
+	struct bio_vec		inline_vecs[0];
+};
+
+static void compress_offload_fn(struct work_struct *work)
+{
+	struct compress_offload_task *t =
+		container_of(work, struct compress_offload_task, work);
+
+	t->compression_type =
+		bch2_bio_compress(t->c, &t->dst, &t->dst_len,
+				  &t->src, &t->src_len,
+				  t->compression_type);
+	complete(&t->done);
+}
+
+static struct compress_offload_task **
+compress_offload_start(struct bch_write_op *op, struct bio *src, unsigned *nr)
+{
+	struct bch_fs *c = op->c;
+	unsigned chunk = c->sb.encoded_extent_max << 9;
+	struct bvec_iter iter = src->bi_iter;
+	struct compress_offload_task **tasks;
+	unsigned i;
+
+	*nr = DIV_ROUND_UP(src->bi_iter.bi_size, chunk);
+
+	tasks = kcalloc(*nr, sizeof(*tasks), GFP_NOIO);
+	if (!tasks)
+		return NULL;
+
+	for (i = 0; i < *nr; i++) {
+		unsigned src_len = min(iter.bi_size, chunk);
+		unsigned nr_vecs = DIV_ROUND_UP(src_len, PAGE_SIZE) + 1;
+		struct compress_offload_task *t;
+
+		t = kzalloc(sizeof(*t) +
+			    sizeof(struct bio_vec) * nr_vecs, GFP_NOIO);
+		if (t) {
+			t->buf = kvpmalloc(src_len, GFP_NOIO);
+			if (!t->buf) {
+				kfree(t);
+				t = NULL;
+			}
+		}
+		if (!t) {
+			/* compress the rest inline: */
+			*nr = i;
+			break;
+		}
+
+		t->c			= c;
+		t->compression_type	= op->compression_type;
+		t->buf_size		= src_len;
+
+		bio_init(&t->src, src->bi_io_vec, src->bi_max_vecs);
+		t->src.bi_iter		= iter;
+		t->src.bi_iter.bi_size	= src_len;
+
+		bio_init(&t->dst, t->inline_vecs, nr_vecs);
+		bch2_bio_map(&t->dst, t->buf, src_len);
+
+		init_completion(&t->done);
+		INIT_WORK(&t->work, compress_offload_fn);
+		queue_work(system_unbound_wq, &t->work);
+
+		tasks[i] = t;
+		bio_advance_iter(src, &iter, src_len);
+	}
+
+	if (!*nr) {
+		kfree(tasks);
+		tasks = NULL;
+	}
+
+	return tasks;
+}
+
+static void compress_offload_finish(struct compress_offload_task **tasks,
+				    unsigned nr, unsigned idx)
+{
+	unsigned i;
+
+	if (!tasks)
+		return;
+
+	for (i = idx; i < nr; i++) {
+		struct compress_offload_task *t = tasks[i];
+
+		wait_for_completion(&t->done);
+		kvpfree(t->buf, t->buf_size);
+		kfree(t);
+	}
+	kfree(tasks);
+}
+
 static int bch2_write_extent(struct bch_write_op *op, struct write_point *wp,
 			     struct bio **_dst)
 {
@@ -870,6 +1325,8 @@ static int bch2_write_extent(struct bch_write_op *op, struct write_point *wp,
 	struct bvec_iter saved_iter;
 	void *ec_buf;
 	struct bpos ec_pos = op->pos;
+	struct compress_offload_task **offload = NULL;
+	unsigned offload_nr = 0, offload_idx = 0;
 	unsigned total_output = 0, total_input = 0;
 	bool bounce = false;
 	bool page_alloc_failed = false;
@@ -913,6 +1370,13 @@ static int bch2_write_extent(struct bch_write_op *op, struct write_point *wp,
 		bounce = true;
 	}
 
+	if (c->opts.compression_offload &&
+	    op->compression_type &&
+	    !op->incompressible &&
+	    !(op->flags & BCH_WRITE_DATA_ENCODED) &&
+	    src->bi_iter.bi_size > (c->sb.encoded_extent_max << 9))
+		offload = compress_offload_start(op, src, &offload_nr);
+
 	saved_iter = dst->bi_iter;
 
 	do {
@@ -920,6 +1384,7 @@ static int bch2_write_extent(struct bch_write_op *op, struct write_point *wp,
 			(struct bch_extent_crc_unpacked) { 0 };
 		struct bversion version = op->version;
 		size_t dst_len, src_len;
+		bool offloaded = false;
 
 		if (page_alloc_failed &&
 		    bio_sectors(dst) < wp->sectors_free &&
@@ -931,12 +1396,53 @@ static int bch2_write_extent(struct bch_write_op *op, struct write_point *wp,
 		       bch2_csum_type_is_encryption(op->crc.csum_type));
 		BUG_ON(op->compression_type && !bounce);
 
-		crc.compression_type = op->incompressible
-			? BCH_COMPRESSION_TYPE_incompressible
-			: op->compression_type
-			? bch2_bio_compress(c, dst, &dst_len, src, &src_len,
-					    op->compression_type)
-			: 0;
+		if (offload) {
+			struct compress_offload_task *t = offload[offload_idx];
+			unsigned planned = min_t(unsigned, src->bi_iter.bi_size,
+						 c->sb.encoded_extent_max << 9);
+			size_t t_src_len;
+			bool usable;
+
+			wait_for_completion(&t->done);
+
+			usable = t->compression_type &&
+				t->dst_len <= dst->bi_iter.bi_size;
+
+			if (usable) {
+				struct bvec_iter dst_iter = dst->bi_iter;
+
+				dst_iter.bi_size = t->dst_len;
+				memcpy_to_bio(dst, dst_iter, t->buf);
+
+				crc.compression_type	= t->compression_type;
+				src_len			= t->src_len;
+				dst_len			= t->dst_len;
+				offloaded		= true;
+			}
+
+			t_src_len = t->src_len;
+			kvpfree(t->buf, t->buf_size);
+			kfree(t);
+			offload[offload_idx++] = NULL;
+
+			if (!usable || t_src_len != planned) {
+				compress_offload_finish(offload, offload_nr,
+							offload_idx);
+				offload = NULL;
+			} else if (offload_idx == offload_nr) {
+				kfree(offload);
+				offload = NULL;
+			}
+		}
+
+		if (!offloaded)
+			crc.compression_type = op->incompressible
+				? BCH_COMPRESSION_TYPE_incompressible
+				: op->compression_type
+				? bch2_bio_compress(c, dst, &dst_len,
+						    src, &src_len,
+						    op->compression_type)
+				: 0;
 		if (!crc_is_compressed(crc)) {
 			dst_len = min(dst->bi_iter.bi_size, src->bi_iter.bi_size);
 			dst_len = min_t(unsigned, dst_len, wp->sectors_free << 9);
@@ -1024,6 +1530,10 @@ static int bch2_write_extent(struct bch_write_op *op, struct write_point *wp,
 				      ARRAY_SIZE(op->inline_keys),
 				      BKEY_EXTENT_U64s_MAX));
 
+	/* toss precompressed results we didn't have room for: */
+	compress_offload_finish(offload, offload_nr, offload_idx);
+	offload = NULL;
+
 	more = src->bi_iter.bi_size != 0;
 
 	dst->bi_iter = saved_iter;
@@ -1050,6 +1560,8 @@ csum_err:
 		"rewriting existing data (memory corruption?)");
 	ret = -EIO;
 err:
+	compress_offload_finish(offload, offload_nr, offload_idx);
+
 	if (to_wbio(dst)->bounce)
 		bch2_bio_free_pages_pool(c, dst);
 	if (to_wbio(dst)->put_bio)
@@ -1344,6 +1856,55 @@ static const struct rhashtable_params bch_promote_params = {
 	.key_len	= sizeof(struct bpos),
 };
 
+/*
+ * Promote admission filter: a small counting sketch over recent read
+ * positions, so data is only promoted to the cache tier on its second recent
+ * access - a single pass over cold data (backups, scrubs) then can't evict
+ * the hot set. Counters are halved once enough accesses accumulate, so the
+ * width of the "recent" window scales with read traffic:
+ */
+#define PROMOTE_SKETCH_SIZE	(1U << 16)
+/* accesses are counted at 1MB granularity: */
+#define PROMOTE_SKETCH_SHIFT	11
+
+static bool promote_admit(struct bch_fs *c, struct bpos pos)
+{
+	u8 *sketch = c->promote_sketch;
+	u64 h = hash_64(pos.inode ^ (pos.offset >> PROMOTE_SKETCH_SHIFT) *
+			GOLDEN_RATIO_64, 64);
+	unsigned i1 = h & (PROMOTE_SKETCH_SIZE - 1);
+	unsigned i2 = (h >> 32) & (PROMOTE_SKETCH_SIZE - 1);
+	u8 v;
+
+	if (!sketch)
+		return true;
+
+	/*
+	 * Unlocked: racing updates can only lose or double count an access,
+	 * and this is just a heuristic.
+	 *
+	 * Conservative update - only bump the minimum of the two counters, so
+	 * hash collisions inflate counts as little as possible:
+	 */
+	v = min(sketch[i1], sketch[i2]);
+
+	if (sketch[i1] == v && v != U8_MAX)
+		sketch[i1] = v + 1;
+	if (sketch[i2] == v && v != U8_MAX)
+		sketch[i2] = v + 1;
+
+	if (atomic_inc_return(&c->promote_sketch_adds) ==
+	    PROMOTE_SKETCH_SIZE * 4) {
+		unsigned i;
+
+		atomic_set(&c->promote_sketch_adds, 0);
+		for (i = 0; i < PROMOTE_SKETCH_SIZE; i++)
+			sketch[i] >>= 1;
+	}
+
+	return v != 0;
+}
+
 static inline bool should_promote(struct bch_fs *c, struct bkey_s_c k,
 				  struct bpos pos,
 				  struct bch_io_opts opts,
@@ -1363,6 +1924,9 @@ static inline bool should_promote(struct bch_fs *c, struct bkey_s_c k,
 		return false;
 	}
 
+	if (!promote_admit(c, pos))
+		return false;
+
 	if (rhashtable_lookup_fast(&c->promote_table, &pos,
 				   bch_promote_params))
 		return false;
@@ -2020,6 +2584,20 @@ err:
 	return ret;
 }
 
+static void bch2_ec_reconstruct_work(struct work_struct *work)
+{
+	struct bch_read_bio *rbio =
+		container_of(work, struct bch_read_bio, work);
+	struct bch_fs *c = rbio->c;
+
+	if (bch2_ec_read_extent(c, rbio)) {
+		bch2_rbio_error(rbio, READ_RETRY_AVOID, BLK_STS_IOERR);
+		return;
+	}
+
+	bio_endio(&rbio->bio);
+}
+
 int __bch2_read_extent(struct bch_fs *c, struct bch_read_bio *orig,
 		       struct bvec_iter iter, struct bkey_s_c k,
 		       unsigned offset_into_extent,
@@ -2217,14 +2795,23 @@ get_bio:
 		else
 			submit_bio_wait(&rbio->bio);
 	} else {
-		/* Attempting reconstruct read: */
+		/*
+		 * Attempting reconstruct read: this blocks on reads of all the
+		 * stripe's remaining blocks and then runs raid_rec, so punt it
+		 * to the worker pool when we can - a degraded read stream then
+		 * reconstructs multiple stripes concurrently instead of one at
+		 * a time on the submitting thread:
+		 */
+		if (likely(!(flags & BCH_READ_IN_RETRY))) {
+			INIT_WORK(&rbio->work, bch2_ec_reconstruct_work);
+			queue_work(system_unbound_wq, &rbio->work);
+			goto out;
+		}
+
 		if (bch2_ec_read_extent(c, rbio)) {
 			bch2_rbio_error(rbio, READ_RETRY_AVOID, BLK_STS_IOERR);
 			goto out;
 		}
-
-		if (likely(!(flags & BCH_READ_IN_RETRY)))
-			bio_endio(&rbio->bio);
 	}
 out:
 	if (likely(!(flags & BCH_READ_IN_RETRY))) {
@@ -2275,9 +2862,16 @@ void bch2_read(struct bch_fs *c, struct bch_read_bio *rbio, u64 inode)
 	struct btree_iter *iter;
 	struct bkey_on_stack sk;
 	struct bkey_s_c k;
+	struct blk_plug plug;
+	/*
+	 * In userspace the caller's buffer is process owned memory, not a user
+	 * mapping that can be scribbled over mid read - so unlike the kernel
+	 * direct IO path we don't set BCH_READ_USER_MAPPED, and encrypted and
+	 * crc-narrowable reads checksum and decrypt in place in the
+	 * destination buffer instead of bouncing:
+	 */
 	unsigned flags = BCH_READ_RETRY_IF_STALE|
-		BCH_READ_MAY_PROMOTE|
-		BCH_READ_USER_MAPPED;
+		BCH_READ_MAY_PROMOTE;
 	int ret;
 
 	BUG_ON(rbio->_state);
@@ -2287,6 +2881,14 @@ void bch2_read(struct bch_fs *c, struct bch_read_bio *rbio, u64 inode)
 	rbio->c = c;
 	rbio->start_time = local_clock();
 
+	/*
+	 * A fragmented file turns into one bio per extent: plug so they're
+	 * submitted in a batch and the elevator can sort and merge physically
+	 * contiguous extents into a few large IOs. The caller doesn't wait on
+	 * rbio until after we return, when the plug has been flushed:
+	 */
+	blk_start_plug(&plug);
+
 	bkey_on_stack_init(&sk);
 	bch2_trans_init(&trans, c, 0, 0);
 retry:
@@ -2347,6 +2949,7 @@ retry:
 out:
 	bch2_trans_exit(&trans);
 	bkey_on_stack_exit(&sk, c);
+	blk_finish_plug(&plug);
 	return;
 err:
 	if (ret == -EINTR)
@@ -2361,6 +2964,7 @@ void bch2_fs_io_exit(struct bch_fs *c)
 {
 	if (c->promote_table.tbl)
 		rhashtable_destroy(&c->promote_table);
+	kvpfree(c->promote_sketch, PROMOTE_SKETCH_SIZE);
 	mempool_exit(&c->bio_bounce_pages);
 	bioset_exit(&c->bio_write);
 	bioset_exit(&c->bio_read_split);
@@ -2369,6 +2973,11 @@ void bch2_fs_io_exit(struct bch_fs *c)
 
 int bch2_fs_io_init(struct bch_fs *c)
 {
+	c->promote_sketch = kvpmalloc(PROMOTE_SKETCH_SIZE, GFP_KERNEL);
+	if (!c->promote_sketch)
+		return -ENOMEM;
+	memset(c->promote_sketch, 0, PROMOTE_SKETCH_SIZE);
+
 	if (bioset_init(&c->bio_read, 1, offsetof(struct bch_read_bio, bio),
 			BIOSET_NEED_BVECS) ||
 	    bioset_init(&c->bio_read_split, 1, offsetof(struct bch_read_bio, bio),
@@ -136,6 +136,9 @@ struct bch_write_op {
 
 	int			(*index_update_fn)(struct bch_write_op *);
 
+	/* Protected by bch_fs write_index_lock: */
+	struct list_head	index_list;
+
 	struct bch_devs_mask	failed;
 
 	struct keylist		insert_keys;
@@ -119,12 +119,11 @@ static bool __journal_entry_close(struct journal *j)
 			set_need_write = true;
 		}
 
-		if (new.prev_buf_unwritten)
-			return false;
-
 		new.cur_entry_offset = JOURNAL_ENTRY_CLOSED_VAL;
 		new.idx++;
-		new.prev_buf_unwritten = 1;
+
+		if (new.idx == new.unwritten_idx)
+			return false;
 
 		BUG_ON(journal_state_count(new, new.idx));
 	} while ((v = atomic64_cmpxchg(&j->reservations.counter,
@@ -132,6 +131,21 @@ static bool __journal_entry_close(struct journal *j)
 
 	buf->data->u64s		= cpu_to_le32(old.cur_entry_offset);
 
+	/*
+	 * Learn the workload's entry size: if recent entries have been
+	 * filling most of the buffer - extent heavy commits from migrate,
+	 * say - grow buf_size_want now, instead of waiting for a reservation
+	 * to fail on a full buf, which closes the entry early and costs an
+	 * extra flush:
+	 */
+	j->entry_bytes_ewma = ewma_add(j->entry_bytes_ewma,
+				le32_to_cpu(buf->data->u64s) * sizeof(u64), 3);
+
+	if (j->entry_bytes_ewma > buf->buf_size - (buf->buf_size >> 2) &&
+	    buf->buf_size >> 9 < buf->disk_sectors &&
+	    buf->buf_size < JOURNAL_ENTRY_SIZE_MAX)
+		j->buf_size_want = max(j->buf_size_want, buf->buf_size << 1);
+
 	sectors = vstruct_blocks_plus(buf->data, c->block_bits,
 				      buf->u64s_reserved) << c->block_bits;
 	BUG_ON(sectors > buf->sectors);
@@ -188,6 +202,21 @@ static bool journal_entry_close(struct journal *j)
 	return ret;
 }
 
+/*
+ * Adaptive flush delay: on devices where the write latency is orders of
+ * magnitude lower than write_delay_ms there's little batching benefit to
+ * letting an open journal entry sit for the full delay - it just adds latency
+ * for whatever ends up waiting on the entry. Scale the delay with the observed
+ * write time, with write_delay_ms as the upper bound:
+ */
+static unsigned long journal_write_delay(struct journal *j)
+{
+	u64 delay_ns = min_t(u64, j->write_time->average_duration * 4,
+			     (u64) j->write_delay_ms * NSEC_PER_MSEC);
+
+	return nsecs_to_jiffies(max_t(u64, delay_ns, NSEC_PER_MSEC));
+}
+
 /*
  * should _only_ called from journal_res_get() - when we actually want a
  * journal reservation - journal entry is open means journal is dirty:
@@ -254,7 +283,7 @@ static int journal_entry_open(struct journal *j)
 
 	mod_delayed_work(system_freezable_wq,
 			 &j->write_work,
-			 msecs_to_jiffies(j->write_delay_ms));
+			 journal_write_delay(j));
 	journal_wake(j);
 	return 0;
 }
@@ -262,7 +291,8 @@ static int journal_entry_open(struct journal *j)
 static bool journal_quiesced(struct journal *j)
 {
 	union journal_res_state state = READ_ONCE(j->reservations);
-	bool ret = !state.prev_buf_unwritten && !__journal_entry_is_open(state);
+	bool ret = state.idx == state.unwritten_idx &&
+		!__journal_entry_is_open(state);
 
 	if (!ret)
 		journal_entry_close(j);
@@ -289,17 +319,28 @@ static void journal_write_work(struct work_struct *work)
 u64 bch2_inode_journal_seq(struct journal *j, u64 inode)
 {
 	size_t h = hash_64(inode, ilog2(sizeof(j->buf[0].has_inode) * 8));
+	union journal_res_state s;
+	unsigned i;
 	u64 seq = 0;
 
-	if (!test_bit(h, j->buf[0].has_inode) &&
-	    !test_bit(h, j->buf[1].has_inode))
-		return 0;
+	for (i = 0; i < ARRAY_SIZE(j->buf); i++)
+		if (test_bit(h, j->buf[i].has_inode))
+			goto slowpath;
 
+	return 0;
+slowpath:
 	spin_lock(&j->lock);
-	if (test_bit(h, journal_cur_buf(j)->has_inode))
-		seq = journal_cur_seq(j);
-	else if (test_bit(h, journal_prev_buf(j)->has_inode))
-		seq = journal_cur_seq(j) - 1;
+	s = READ_ONCE(j->reservations);
+
+	/* current entry, and any that are closed but still unwritten: */
+	i = s.unwritten_idx;
+	while (1) {
+		if (test_bit(h, j->buf[i].has_inode))
+			seq = le64_to_cpu(j->buf[i].data->seq);
+		if (i == s.idx)
+			break;
+		i = (i + 1) & JOURNAL_BUF_MASK;
+	}
 	spin_unlock(&j->lock);
 
 	return seq;
@@ -490,12 +531,12 @@ out:
 
 u64 bch2_journal_last_unwritten_seq(struct journal *j)
 {
+	union journal_res_state s;
 	u64 seq;
 
 	spin_lock(&j->lock);
-	seq = journal_cur_seq(j);
-	if (j->reservations.prev_buf_unwritten)
-		seq--;
+	s = READ_ONCE(j->reservations);
+	seq = journal_cur_seq(j) - ((s.idx - s.unwritten_idx) & JOURNAL_BUF_MASK);
 	spin_unlock(&j->lock);
 
 	return seq;
@@ -556,16 +597,30 @@ int bch2_journal_open_seq_async(struct journal *j, u64 seq, struct closure *cl)
 	return ret;
 }
 
-static int journal_seq_error(struct journal *j, u64 seq)
+/*
+ * Returns true if @seq is newer than the most recent journal entry that got
+ * written to disk - i.e. it's the current entry, or closed but still in the
+ * ring of unwritten bufs:
+ */
+static bool journal_seq_unwritten(struct journal *j, u64 seq)
 {
-	union journal_res_state state = READ_ONCE(j->reservations);
+	union journal_res_state s = READ_ONCE(j->reservations);
+
+	return seq > j->seq_ondisk &&
+		seq + ((s.idx - s.unwritten_idx) & JOURNAL_BUF_MASK) >=
+		journal_cur_seq(j);
+}
 
+static int journal_seq_error(struct journal *j, u64 seq)
+{
 	if (seq == journal_cur_seq(j))
 		return bch2_journal_error(j);
 
-	if (seq + 1 == journal_cur_seq(j) &&
-	    !state.prev_buf_unwritten &&
-	    seq > j->seq_ondisk)
+	/*
+	 * The write completed, but seq_ondisk wasn't updated - the write
+	 * failed:
+	 */
+	if (seq > j->seq_ondisk && !journal_seq_unwritten(j, seq))
 		return -EIO;
 
 	return 0;
@@ -574,17 +629,18 @@ static int journal_seq_error(struct journal *j, u64 seq)
 static inline struct journal_buf *
 journal_seq_to_buf(struct journal *j, u64 seq)
 {
+	struct journal_buf *buf = NULL;
+
 	/* seq should be for a journal entry that has been opened: */
 	BUG_ON(seq > journal_cur_seq(j));
 	BUG_ON(seq == journal_cur_seq(j) &&
 	       j->reservations.cur_entry_offset == JOURNAL_ENTRY_CLOSED_VAL);
 
-	if (seq == journal_cur_seq(j))
-		return journal_cur_buf(j);
-	if (seq + 1 == journal_cur_seq(j) &&
-	    j->reservations.prev_buf_unwritten)
-		return journal_prev_buf(j);
-	return NULL;
+	if (journal_seq_unwritten(j, seq)) {
+		buf = j->buf + (seq & JOURNAL_BUF_MASK);
+		EBUG_ON(le64_to_cpu(buf->data->seq) != seq);
+	}
+	return buf;
 }
 
 /**
@@ -869,9 +925,112 @@ err:
 	return ret;
 }
 
+static int __bch2_set_nr_journal_buckets_shrink(struct bch_fs *c,
+						struct bch_dev *ca,
+						unsigned nr)
+{
+	struct journal *j = &c->journal;
+	struct journal_device *ja = &ca->journal;
+	struct bch_sb_field_journal *journal_buckets;
+	unsigned i;
+	int ret = 0;
+
+	lockdep_assert_held(&c->sb_lock);
+
+	bch2_journal_block(j);
+
+	percpu_down_read(&c->mark_lock);
+	spin_lock(&j->lock);
+
+	while (ja->nr > nr) {
+		/* Drop the oldest bucket first: */
+		unsigned pos = (ja->cur_idx + 1) % ja->nr;
+		u64 bucket = ja->buckets[pos];
+
+		/*
+		 * The caller flushed the journal, so everything but the
+		 * bucket currently being written to should be clean - but
+		 * recheck, we never drop a bucket with entries that could
+		 * still be needed for replay:
+		 */
+		if (pos == ja->cur_idx ||
+		    ja->bucket_seq[pos] > j->last_seq_ondisk) {
+			ret = -EBUSY;
+			break;
+		}
+
+		memmove(&ja->buckets[pos],
+			&ja->buckets[pos + 1],
+			(ja->nr - pos - 1) * sizeof(ja->buckets[0]));
+		memmove(&ja->bucket_seq[pos],
+			&ja->bucket_seq[pos + 1],
+			(ja->nr - pos - 1) * sizeof(ja->bucket_seq[0]));
+		ja->nr--;
+
+		if (ja->discard_idx > pos)
+			ja->discard_idx--;
+		if (ja->dirty_idx_ondisk > pos)
+			ja->dirty_idx_ondisk--;
+		if (ja->dirty_idx > pos)
+			ja->dirty_idx--;
+		if (ja->cur_idx > pos)
+			ja->cur_idx--;
+
+		ja->discard_idx		%= ja->nr;
+		ja->dirty_idx_ondisk	%= ja->nr;
+		ja->dirty_idx		%= ja->nr;
+		ja->cur_idx		%= ja->nr;
+
+		bch2_unmark_metadata_bucket(c, ca, bucket,
+					    gc_phase(GC_PHASE_SB), 0);
+	}
+
+	spin_unlock(&j->lock);
+	percpu_up_read(&c->mark_lock);
+
+	journal_buckets = bch2_sb_resize_journal(&ca->disk_sb,
+				ja->nr + sizeof(*journal_buckets) / sizeof(u64));
+	if (journal_buckets)
+		for (i = 0; i < ja->nr; i++)
+			journal_buckets->buckets[i] = cpu_to_le64(ja->buckets[i]);
+	else
+		ret = -ENOMEM;
+
+	bch2_journal_unblock(j);
+
+	return ret;
+}
+
+static int bch2_set_nr_journal_buckets_shrink(struct bch_fs *c,
+					      struct bch_dev *ca,
+					      unsigned nr)
+{
+	unsigned current_nr = ca->journal.nr;
+	int ret;
+
+	if (nr < 2)
+		return -EINVAL;
+
+	/*
+	 * Entries not yet flushed to the btree keep their buckets pinned:
+	 * flushing first means the shrink path only ever drops clean buckets,
+	 * and never has to copy journal entries between buckets:
+	 */
+	bch2_journal_flush_all_pins(&c->journal);
+
+	mutex_lock(&c->sb_lock);
+	ret = __bch2_set_nr_journal_buckets_shrink(c, ca, nr);
+	if (ca->journal.nr != current_nr)
+		bch2_write_super(c);
+	mutex_unlock(&c->sb_lock);
+
+	return ret;
+}
+
 /*
- * Allocate more journal space at runtime - not currently making use if it, but
- * the code works:
+ * Resize the journal at runtime: used by BCH_IOCTL_DISK_RESIZE_JOURNAL.
+ * Growing allocates fresh buckets from the allocator; shrinking flushes the
+ * journal and drops the oldest (clean) buckets.
  */
 int bch2_set_nr_journal_buckets(struct bch_fs *c, struct bch_dev *ca,
 				unsigned nr)
@@ -881,6 +1040,9 @@ int bch2_set_nr_journal_buckets(struct bch_fs *c, struct bch_dev *ca,
 	unsigned current_nr;
 	int ret;
 
+	if (nr < ja->nr)
+		return bch2_set_nr_journal_buckets_shrink(c, ca, nr);
+
 	closure_init_stack(&cl);
 
 	do {
@@ -940,15 +1102,18 @@ int bch2_dev_journal_alloc(struct bch_dev *ca)
 static bool bch2_journal_writing_to_device(struct journal *j, unsigned dev_idx)
 {
 	union journal_res_state state;
-	struct journal_buf *w;
-	bool ret;
+	bool ret = false;
+	unsigned i;
 
 	spin_lock(&j->lock);
 	state = READ_ONCE(j->reservations);
-	w = j->buf + !state.idx;
 
-	ret = state.prev_buf_unwritten &&
-		bch2_bkey_has_device(bkey_i_to_s_c(&w->key), dev_idx);
+	for (i = state.unwritten_idx;
+	     i != state.idx;
+	     i = (i + 1) & JOURNAL_BUF_MASK)
+		if (bch2_bkey_has_device(bkey_i_to_s_c(&j->buf[i].key),
+					 dev_idx))
+			ret = true;
 	spin_unlock(&j->lock);
 
 	return ret;
@@ -1008,6 +1173,12 @@ int bch2_fs_journal_start(struct journal *j, u64 cur_seq,
 	j->pin.back		= cur_seq;
 	atomic64_set(&j->seq, cur_seq - 1);
 
+	/*
+	 * The first entry we open will have sequence number @cur_seq, and
+	 * entry @seq always lives in buf[seq & JOURNAL_BUF_MASK]:
+	 */
+	j->reservations.idx = j->reservations.unwritten_idx = cur_seq;
+
 	fifo_for_each_entry_ptr(p, &j->pin, seq) {
 		INIT_LIST_HEAD(&p->list);
 		INIT_LIST_HEAD(&p->flushed);
@@ -1083,8 +1254,10 @@ int bch2_dev_journal_init(struct bch_dev *ca, struct bch_sb *sb)
 
 void bch2_fs_journal_exit(struct journal *j)
 {
-	kvpfree(j->buf[1].data, j->buf[1].buf_size);
-	kvpfree(j->buf[0].data, j->buf[0].buf_size);
+	unsigned i;
+
+	for (i = 0; i < ARRAY_SIZE(j->buf); i++)
+		kvpfree(j->buf[i].data, j->buf[i].buf_size);
 	free_fifo(&j->pin);
 }
 
@@ -1092,6 +1265,7 @@ int bch2_fs_journal_init(struct journal *j)
 {
 	struct bch_fs *c = container_of(j, struct bch_fs, journal);
 	static struct lock_class_key res_key;
+	unsigned i;
 	int ret = 0;
 
 	pr_verbose_init(c->opts, "");
@@ -1107,8 +1281,6 @@ int bch2_fs_journal_init(struct journal *j)
 
 	lockdep_init_map(&j->res_map, "journal res", &res_key, 0);
 
-	j->buf[0].buf_size	= JOURNAL_ENTRY_SIZE_MIN;
-	j->buf[1].buf_size	= JOURNAL_ENTRY_SIZE_MIN;
 	j->write_delay_ms	= 1000;
 	j->reclaim_delay_ms	= 100;
 
@@ -1120,13 +1292,20 @@ int bch2_fs_journal_init(struct journal *j)
 		((union journal_res_state)
 		 { .cur_entry_offset = JOURNAL_ENTRY_CLOSED_VAL }).v);
 
-	if (!(init_fifo(&j->pin, JOURNAL_PIN, GFP_KERNEL)) ||
-	    !(j->buf[0].data = kvpmalloc(j->buf[0].buf_size, GFP_KERNEL)) ||
-	    !(j->buf[1].data = kvpmalloc(j->buf[1].buf_size, GFP_KERNEL))) {
+	if (!(init_fifo(&j->pin, JOURNAL_PIN, GFP_KERNEL))) {
 		ret = -ENOMEM;
 		goto out;
 	}
 
+	for (i = 0; i < ARRAY_SIZE(j->buf); i++) {
+		j->buf[i].buf_size = JOURNAL_ENTRY_SIZE_MIN;
+		j->buf[i].data = kvpmalloc(j->buf[i].buf_size, GFP_KERNEL);
+		if (!j->buf[i].data) {
+			ret = -ENOMEM;
+			goto out;
+		}
+	}
+
 	j->pin.front = j->pin.back = 1;
 out:
 	pr_verbose_init(c->opts, "ret %i", ret);
@@ -1177,16 +1356,16 @@ void bch2_journal_debug_to_text(struct printbuf *out, struct journal *j)
 	}
 
 	pr_buf(out,
-	       "current entry refs:\t%u\n"
-	       "prev entry unwritten:\t",
+	       "current entry refs:\t%u\n",
 	       journal_state_count(s, s.idx));
 
-	if (s.prev_buf_unwritten)
-		pr_buf(out, "yes, ref %u sectors %u\n",
-		       journal_state_count(s, !s.idx),
-		       journal_prev_buf(j)->sectors);
-	else
-		pr_buf(out, "no\n");
+	for (iter = s.unwritten_idx;
+	     iter != s.idx;
+	     iter = (iter + 1) & JOURNAL_BUF_MASK)
+		pr_buf(out, "unwritten entry:\t%u refs %u sectors %u\n",
+		       iter,
+		       journal_state_count(s, iter),
+		       j->buf[iter].sectors);
 
 	pr_buf(out,
 	       "need write:\t\t%i\n"
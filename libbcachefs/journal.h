@@ -127,9 +127,9 @@ static inline struct journal_buf *journal_cur_buf(struct journal *j)
 	return j->buf + j->reservations.idx;
 }
 
-static inline struct journal_buf *journal_prev_buf(struct journal *j)
+static inline struct journal_buf *journal_last_unwritten_buf(struct journal *j)
 {
-	return j->buf + !j->reservations.idx;
+	return j->buf + j->reservations.unwritten_idx;
 }
 
 /* Sequence number of oldest dirty journal entry */
@@ -150,13 +150,21 @@ u64 bch2_inode_journal_seq(struct journal *, u64);
 
 static inline int journal_state_count(union journal_res_state s, int idx)
 {
-	return idx == 0 ? s.buf0_count : s.buf1_count;
+	switch (idx) {
+	case 0: return s.buf0_count;
+	case 1: return s.buf1_count;
+	case 2: return s.buf2_count;
+	case 3: return s.buf3_count;
+	}
+	BUG();
 }
 
 static inline void journal_state_inc(union journal_res_state *s)
 {
 	s->buf0_count += s->idx == 0;
 	s->buf1_count += s->idx == 1;
+	s->buf2_count += s->idx == 2;
+	s->buf3_count += s->idx == 3;
 }
 
 static inline void bch2_journal_set_has_inode(struct journal *j,
@@ -264,9 +272,18 @@ static inline void bch2_journal_buf_put(struct journal *j, unsigned idx,
 	s.v = atomic64_sub_return(((union journal_res_state) {
 				    .buf0_count = idx == 0,
 				    .buf1_count = idx == 1,
+				    .buf2_count = idx == 2,
+				    .buf3_count = idx == 3,
 				    }).v, &j->reservations.counter);
-	if (!journal_state_count(s, idx)) {
-		EBUG_ON(s.idx == idx || !s.prev_buf_unwritten);
+
+	/*
+	 * Writes are issued in order: don't kick off the write for this buf
+	 * until it's the oldest unwritten one - if it isn't,
+	 * journal_write_done() will get to it when the previous write
+	 * completes:
+	 */
+	if (!journal_state_count(s, idx) && idx == s.unwritten_idx) {
+		EBUG_ON(s.idx == idx);
 		__bch2_journal_buf_put(j, need_write_just_set);
 	}
 }
@@ -5,6 +5,7 @@
 #include "btree_update_interior.h"
 #include "buckets.h"
 #include "checksum.h"
+#include "compress.h"
 #include "error.h"
 #include "io.h"
 #include "journal.h"
@@ -12,12 +13,15 @@
 #include "journal_reclaim.h"
 #include "replicas.h"
 
+#include <linux/sort.h>
 #include <trace/events/bcachefs.h>
 
 struct journal_list {
 	struct closure		cl;
 	struct mutex		lock;
 	struct list_head	*head;
+	/* a device had read errors - entries may only exist on replicas: */
+	bool			degraded;
 	int			ret;
 };
 
@@ -365,6 +369,27 @@ fsck_err:
 	return ret;
 }
 
+static int journal_entry_validate_compressed(struct bch_fs *c,
+					struct jset *jset,
+					struct jset_entry *entry,
+					int write)
+{
+	int ret = 0;
+
+	/*
+	 * Compressed payloads are unpacked when the jset is first read off
+	 * disk; a compressed entry should never survive to entry validation:
+	 */
+	if (journal_entry_err_on(true, c,
+				 "unexpected compressed journal entry")) {
+		journal_entry_null_range(entry, vstruct_next(entry));
+		return ret;
+	}
+
+fsck_err:
+	return ret;
+}
+
 struct jset_entry_ops {
 	int (*validate)(struct bch_fs *, struct jset *,
 			struct jset_entry *, int);
@@ -501,15 +526,100 @@ static int journal_read_buf_realloc(struct journal_read_buf *b,
 	return 0;
 }
 
+static inline bool jset_payload_compressed(struct jset *j)
+{
+	return le32_to_cpu(j->u64s) &&
+		j->start[0].type == BCH_JSET_ENTRY_compressed;
+}
+
+/*
+ * Unpack a jset whose payload was compressed at write time: the payload is a
+ * single lz4 stream split across a chain of BCH_JSET_ENTRY_compressed
+ * entries. Returns a new jset with the original (uncompressed) payload; the
+ * checksum has already been verified against the compressed payload, so a
+ * decompression failure here means a bug or a bitflip the checksum missed:
+ */
+static int jset_decompress(struct bch_fs *c, struct jset *j, struct jset **out)
+{
+	struct jset_entry *entry;
+	struct jset_entry_compressed *d;
+	struct jset *n;
+	size_t u64s = 0, csize = 0, bytes;
+	void *cbuf, *p;
+	int ret;
+
+	vstruct_for_each(j, entry) {
+		if (entry->type != BCH_JSET_ENTRY_compressed ||
+		    le16_to_cpu(entry->u64s) < 1)
+			goto err;
+
+		d = container_of(entry, struct jset_entry_compressed, entry);
+
+		if (le32_to_cpu(d->csize) >
+		    (le16_to_cpu(entry->u64s) - 1) * sizeof(u64))
+			goto err;
+
+		if (entry == j->start)
+			u64s = le32_to_cpu(d->u64s_uncompressed);
+		csize += le32_to_cpu(d->csize);
+	}
+
+	if (!u64s || !csize ||
+	    u64s > JOURNAL_ENTRY_SIZE_MAX / sizeof(u64))
+		goto err;
+
+	cbuf = kvpmalloc(csize, GFP_KERNEL);
+	if (!cbuf)
+		return -ENOMEM;
+
+	p = cbuf;
+	vstruct_for_each(j, entry) {
+		d = container_of(entry, struct jset_entry_compressed, entry);
+		memcpy(p, d->data, le32_to_cpu(d->csize));
+		p += le32_to_cpu(d->csize);
+	}
+
+	bytes = sizeof(*n) + u64s * sizeof(u64);
+	n = kvpmalloc(bytes, GFP_KERNEL);
+	if (!n) {
+		kvpfree(cbuf, csize);
+		return -ENOMEM;
+	}
+
+	*n = *j;
+	n->u64s = cpu_to_le32(u64s);
+
+	ret = bch2_lz4_decompress(c, n->start, u64s * sizeof(u64),
+				  cbuf, csize);
+	kvpfree(cbuf, csize);
+	if (ret) {
+		kvpfree(n, bytes);
+		goto err;
+	}
+
+	*out = n;
+	return 0;
+err:
+	bch_err(c, "journal entry %llu: error decompressing payload",
+		le64_to_cpu(j->seq));
+	return -EIO;
+}
+
+/*
+ * Process one journal bucket; the first @sectors_read sectors may already be
+ * in @buf from the prefetch window, in which case we skip the initial read:
+ */
 static int journal_read_bucket(struct bch_dev *ca,
 			       struct journal_read_buf *buf,
 			       struct journal_list *jlist,
-			       unsigned bucket)
+			       unsigned bucket,
+			       unsigned sectors_read)
 {
 	struct bch_fs *c = ca->fs;
 	struct journal_device *ja = &ca->journal;
-	struct jset *j = NULL;
-	unsigned sectors, sectors_read = 0;
+	struct jset *j = sectors_read ? buf->data : NULL;
+	struct jset *uncompressed = NULL;
+	unsigned sectors;
 	u64 offset = bucket_to_sector(ca, ja->buckets[bucket]),
 	    end = offset + ca->mi.bucket_size;
 	bool saw_bad = false;
@@ -538,8 +648,19 @@ reread:
 			if (bch2_dev_io_err_on(ret, ca,
 					       "journal read from sector %llu",
 					       offset) ||
-			    bch2_meta_read_fault("journal"))
-				return -EIO;
+			    bch2_meta_read_fault("journal")) {
+				/*
+				 * Give up on this bucket, not on the whole
+				 * journal: entries we can't read here are
+				 * picked up from the other devices holding
+				 * them, and recovery complains about any seq
+				 * that ends up missing everywhere:
+				 */
+				mutex_lock(&jlist->lock);
+				jlist->degraded = true;
+				mutex_unlock(&jlist->lock);
+				return 0;
+			}
 
 			j = buf->data;
 		}
@@ -588,10 +709,33 @@ reread:
 
 		ja->bucket_seq[bucket] = le64_to_cpu(j->seq);
 
+		/*
+		 * If the payload was compressed at write time, unpack it to a
+		 * temporary jset and add that; @j keeps pointing into the
+		 * read buffer so the block advance below still uses the on
+		 * disk (compressed) size:
+		 */
+		if (!ret && jset_payload_compressed(j)) {
+			int ret2 = jset_decompress(c, j, &uncompressed);
+
+			if (ret2 == -ENOMEM)
+				return ret2;
+			if (ret2) {
+				saw_bad = true;
+				goto next_block;
+			}
+		}
+
 		mutex_lock(&jlist->lock);
-		ret = journal_entry_add(c, ca, jlist, j, ret != 0);
+		ret = journal_entry_add(c, ca, jlist,
+					uncompressed ?: j, ret != 0);
 		mutex_unlock(&jlist->lock);
 
+		if (uncompressed) {
+			kvpfree(uncompressed, vstruct_bytes(uncompressed));
+			uncompressed = NULL;
+		}
+
 		switch (ret) {
 		case JOURNAL_ENTRY_ADD_OK:
 			break;
@@ -610,6 +754,61 @@ next_block:
 	return 0;
 }
 
+/*
+ * Keep several bucket reads in flight per device so the journal scan is
+ * pipelined instead of waiting out the full device latency for every bucket:
+ */
+#define JOURNAL_READ_AHEAD	8
+
+struct journal_bucket_prefetch {
+	struct journal_read_buf	buf;
+	struct completion	done;
+	unsigned		sectors;
+	blk_status_t		status;
+};
+
+static void journal_prefetch_endio(struct bio *bio)
+{
+	struct journal_bucket_prefetch *p = bio->bi_private;
+
+	p->status = bio->bi_status;
+	complete(&p->done);
+	bio_put(bio);
+}
+
+static int journal_prefetch_bucket(struct bch_dev *ca,
+				   struct journal_bucket_prefetch *p,
+				   unsigned bucket)
+{
+	struct journal_device *ja = &ca->journal;
+	struct bio *bio;
+	int ret;
+
+	if (!p->buf.data) {
+		ret = journal_read_buf_realloc(&p->buf,
+				min_t(size_t,
+				      (size_t) ca->mi.bucket_size << 9,
+				      JOURNAL_ENTRY_SIZE_MAX));
+		if (ret)
+			return ret;
+	}
+
+	p->sectors = min_t(unsigned, ca->mi.bucket_size, p->buf.size >> 9);
+
+	init_completion(&p->done);
+
+	bio = bio_kmalloc(GFP_KERNEL, buf_pages(p->buf.data, p->sectors << 9));
+	bio_set_dev(bio, ca->disk_sb.bdev);
+	bio->bi_iter.bi_sector	= bucket_to_sector(ca, ja->buckets[bucket]);
+	bio_set_op_attrs(bio, REQ_OP_READ, 0);
+	bch2_bio_map(bio, p->buf.data, p->sectors << 9);
+	bio->bi_private	= p;
+	bio->bi_end_io	= journal_prefetch_endio;
+	submit_bio(bio);
+
+	return 0;
+}
+
 static void bch2_journal_read_device(struct closure *cl)
 {
 	struct journal_device *ja =
@@ -617,22 +816,52 @@ static void bch2_journal_read_device(struct closure *cl)
 	struct bch_dev *ca = container_of(ja, struct bch_dev, journal);
 	struct journal_list *jlist =
 		container_of(cl->parent, struct journal_list, cl);
-	struct journal_read_buf buf = { NULL, 0 };
+	struct journal_bucket_prefetch ra[JOURNAL_READ_AHEAD];
+	unsigned nr_issued = 0, nr_waited = 0;
+	struct blk_plug plug;
 	u64 min_seq = U64_MAX;
 	unsigned i;
-	int ret;
+	int ret = 0;
+
+	memset(ra, 0, sizeof(ra));
 
 	if (!ja->nr)
 		goto out;
 
-	ret = journal_read_buf_realloc(&buf, PAGE_SIZE);
-	if (ret)
-		goto err;
-
 	pr_debug("%u journal buckets", ja->nr);
 
 	for (i = 0; i < ja->nr; i++) {
-		ret = journal_read_bucket(ca, &buf, jlist, i);
+		struct journal_bucket_prefetch *p = &ra[i % JOURNAL_READ_AHEAD];
+
+		blk_start_plug(&plug);
+		while (nr_issued < min_t(unsigned, i + JOURNAL_READ_AHEAD,
+					 ja->nr)) {
+			ret = journal_prefetch_bucket(ca,
+					&ra[nr_issued % JOURNAL_READ_AHEAD],
+					nr_issued);
+			if (ret)
+				break;
+			nr_issued++;
+		}
+		blk_finish_plug(&plug);
+		if (ret)
+			goto err;
+
+		wait_for_completion(&p->done);
+		nr_waited = i + 1;
+
+		if (bch2_dev_io_err_on(blk_status_to_errno(p->status), ca,
+				       "journal read from sector %llu",
+				       bucket_to_sector(ca, ja->buckets[i])) ||
+		    bch2_meta_read_fault("journal")) {
+			/* skip this bucket; replicas cover its entries: */
+			mutex_lock(&jlist->lock);
+			jlist->degraded = true;
+			mutex_unlock(&jlist->lock);
+			continue;
+		}
+
+		ret = journal_read_bucket(ca, &p->buf, jlist, i, p->sectors);
 		if (ret)
 			goto err;
 	}
@@ -666,7 +895,15 @@ static void bch2_journal_read_device(struct closure *cl)
 	ja->discard_idx = ja->dirty_idx_ondisk =
 		ja->dirty_idx = (ja->cur_idx + 1) % ja->nr;
 out:
-	kvpfree(buf.data, buf.size);
+	/* Can't free buffers with reads still in flight: */
+	while (nr_waited < nr_issued) {
+		wait_for_completion(&ra[nr_waited % JOURNAL_READ_AHEAD].done);
+		nr_waited++;
+	}
+
+	for (i = 0; i < JOURNAL_READ_AHEAD; i++)
+		kvpfree(ra[i].buf.data, ra[i].buf.size);
+
 	percpu_ref_put(&ca->io_ref);
 	closure_return(cl);
 	return;
@@ -690,6 +927,7 @@ int bch2_journal_read(struct bch_fs *c, struct list_head *list)
 	closure_init_stack(&jlist.cl);
 	mutex_init(&jlist.lock);
 	jlist.head = list;
+	jlist.degraded = false;
 	jlist.ret = 0;
 
 	for_each_member_device(ca, c, iter) {
@@ -713,6 +951,12 @@ int bch2_journal_read(struct bch_fs *c, struct list_head *list)
 	if (jlist.ret)
 		return jlist.ret;
 
+	/*
+	 * Read errors were patched over from replicas - don't trust that we
+	 * saw every journal replica when updating the replicas section:
+	 */
+	degraded |= jlist.degraded;
+
 	list_for_each_entry(i, list, list) {
 		struct jset_entry *entry;
 		struct bkey_i *k, *_n;
@@ -867,6 +1111,138 @@ done:
 	return replicas >= c->opts.metadata_replicas_required ? 0 : -EROFS;
 }
 
+struct jset_key_ref {
+	struct jset_entry	*entry;
+	struct bkey_i		*k;
+	bool			dead;
+};
+
+static int jset_key_ref_pos_cmp(const void *_l, const void *_r)
+{
+	const struct jset_key_ref *l = _l, *r = _r;
+
+	return  cmp_int(l->entry->btree_id, r->entry->btree_id) ?:
+		cmp_int(l->entry->level, r->entry->level) ?:
+		bkey_cmp(l->k->k.p, r->k->k.p) ?:
+		/* jset order - the key at the higher address is newer: */
+		cmp_int(l->k, r->k);
+}
+
+static int jset_key_ref_ptr_cmp(const void *_l, const void *_r)
+{
+	const struct jset_key_ref *l = _l, *r = _r;
+
+	return cmp_int(l->k, r->k);
+}
+
+/*
+ * Drop keys that are overwritten later in the same jset: a jset is an atomic
+ * unit for replay, so for non extent btrees only the newest version of a key
+ * affects the final state. Extent btrees are left alone - overlapping extents
+ * partially overwrite each other and both versions matter.
+ *
+ * This must not look across jsets: eliding a key from this write because a
+ * newer version sits in a not yet written entry would lose the update
+ * entirely if we crashed between the two writes.
+ */
+static void journal_write_squash(struct bch_fs *c, struct jset *jset)
+{
+	struct jset_key_ref *refs;
+	struct jset_entry *entry;
+	struct bkey_i *k, *_n;
+	size_t nr = 0, i;
+
+	for_each_jset_key(k, _n, entry, jset)
+		if (entry->btree_id != BTREE_ID_EXTENTS &&
+		    entry->btree_id != BTREE_ID_REFLINK)
+			nr++;
+
+	if (nr < 2)
+		return;
+
+	refs = kvpmalloc(nr * sizeof(*refs), GFP_NOIO|__GFP_NOWARN);
+	if (!refs)
+		return;
+
+	nr = 0;
+	for_each_jset_key(k, _n, entry, jset)
+		if (entry->btree_id != BTREE_ID_EXTENTS &&
+		    entry->btree_id != BTREE_ID_REFLINK) {
+			refs[nr].entry	= entry;
+			refs[nr].k	= k;
+			refs[nr].dead	= false;
+			nr++;
+		}
+
+	sort(refs, nr, sizeof(refs[0]), jset_key_ref_pos_cmp, NULL);
+
+	for (i = 0; i + 1 < nr; i++)
+		if (refs[i].entry->btree_id == refs[i + 1].entry->btree_id &&
+		    refs[i].entry->level   == refs[i + 1].entry->level &&
+		    !bkey_cmp(refs[i].k->k.p, refs[i + 1].k->k.p))
+			refs[i].dead = true;
+
+	/* back to jset order, to walk in parallel with the entries: */
+	sort(refs, nr, sizeof(refs[0]), jset_key_ref_ptr_cmp, NULL);
+
+	/*
+	 * Single streaming compaction over the whole jset: as keys are
+	 * dropped, everything after them - including subsequent entries -
+	 * moves down, so no stale gaps are left behind and we never step by
+	 * an entry's u64s after modifying it. Each entry's end is taken from
+	 * its header before anything is overwritten; writes trail reads, so
+	 * unread data is never clobbered.
+	 */
+	i = 0;
+	{
+		struct jset_entry *src, *dst = jset->start, *next;
+
+		for (src = jset->start;
+		     src != vstruct_last(jset);
+		     src = next) {
+			next = vstruct_next(src);
+
+			if (src->type == BCH_JSET_ENTRY_btree_keys) {
+				struct jset_entry hdr = *src;
+				u64 *out = dst->_data;
+
+				for (k = (void *) src->_data;
+				     k != (void *) next;
+				     k = _n) {
+					unsigned u64s = k->k.u64s;
+					bool dead = false;
+
+					_n = bkey_next(k);
+
+					if (i < nr && refs[i].k == k)
+						dead = refs[i++].dead;
+
+					if (dead)
+						continue;
+
+					if ((u64 *) k != out)
+						memmove_u64s_down(out, k, u64s);
+					out += u64s;
+				}
+
+				hdr.u64s = cpu_to_le16(out - dst->_data);
+				*dst = hdr;
+			} else {
+				unsigned u64s = jset_u64s(le16_to_cpu(src->u64s));
+
+				if (src != dst)
+					memmove_u64s_down(dst, src, u64s);
+			}
+
+			dst = vstruct_next(dst);
+		}
+
+		jset->u64s = cpu_to_le32((u64 *) dst - jset->_data);
+	}
+
+	kvpfree(refs, nr * sizeof(*refs));
+}
+
 static void journal_write_compact(struct jset *jset)
 {
 	struct jset_entry *i, *next, *prev = NULL;
@@ -933,7 +1309,9 @@ static void journal_write_done(struct closure *cl)
 {
 	struct journal *j = container_of(cl, struct journal, io);
 	struct bch_fs *c = container_of(j, struct bch_fs, journal);
-	struct journal_buf *w = journal_prev_buf(j);
+	struct journal_buf *w = journal_last_unwritten_buf(j);
+	union journal_res_state old, new;
+	u64 v;
 	struct bch_devs_list devs =
 		bch2_bkey_devs(bkey_i_to_s_c(&w->key));
 	struct bch_replicas_padded replicas;
@@ -972,9 +1350,14 @@ out:
 	/* also must come before signalling write completion: */
 	closure_debug_destroy(cl);
 
-	BUG_ON(!j->reservations.prev_buf_unwritten);
-	atomic64_sub(((union journal_res_state) { .prev_buf_unwritten = 1 }).v,
-		     &j->reservations.counter);
+	v = atomic64_read(&j->reservations.counter);
+	do {
+		old.v = new.v = v;
+		BUG_ON(new.idx == new.unwritten_idx);
+
+		new.unwritten_idx++;
+	} while ((v = atomic64_cmpxchg(&j->reservations.counter,
+				       old.v, new.v)) != old.v);
 
 	closure_wake_up(&w->wait);
 	journal_wake(j);
@@ -982,6 +1365,15 @@ out:
 	if (test_bit(JOURNAL_NEED_WRITE, &j->flags))
 		mod_delayed_work(system_freezable_wq, &j->write_work, 0);
 	spin_unlock(&j->lock);
+
+	/*
+	 * More journal entries may have been closed while this write was in
+	 * flight - if the next oldest one's reservations have already been
+	 * dropped it's our job to kick off its write:
+	 */
+	if (new.unwritten_idx != new.idx &&
+	    !journal_state_count(new, new.unwritten_idx))
+		closure_call(&j->io, bch2_journal_write, system_highpri_wq, NULL);
 	return;
 err:
 	bch2_fatal_error(c);
@@ -997,7 +1389,7 @@ static void journal_write_endio(struct bio *bio)
 	if (bch2_dev_io_err_on(bio->bi_status, ca, "journal write: %s",
 			       bch2_blk_status_to_str(bio->bi_status)) ||
 	    bch2_meta_write_fault("journal")) {
-		struct journal_buf *w = journal_prev_buf(j);
+		struct journal_buf *w = journal_last_unwritten_buf(j);
 		unsigned long flags;
 
 		spin_lock_irqsave(&j->err_lock, flags);
@@ -1009,12 +1401,85 @@ static void journal_write_endio(struct bio *bio)
 	percpu_ref_put(&ca->io_ref);
 }
 
+/*
+ * Maximum compressed payload per jset_entry: u64s is only 16 bits, so a
+ * single entry tops out a bit over 512k; use a smaller round number:
+ */
+#define JSET_COMPRESSED_CHUNK	(256U << 10)
+
+/*
+ * Optionally lz4 compress the journal entry payload before it's checksummed
+ * and written: the payload is replaced with a chain of
+ * BCH_JSET_ENTRY_compressed entries carrying a single compressed stream.
+ * Only worth doing if it saves at least a full block, since the write is
+ * padded out to a block boundary anyways; if it doesn't (or the allocation
+ * fails - compression is strictly optional) the entry is written as is.
+ */
+static void journal_write_compress(struct bch_fs *c, struct jset *jset)
+{
+	size_t u64s	= le32_to_cpu(jset->u64s);
+	size_t bytes	= u64s * sizeof(u64);
+	size_t csize, chunk, new_u64s, nr;
+	struct jset_entry *entry;
+	struct jset_entry_compressed *d;
+	void *buf, *p;
+
+	if (!bytes)
+		return;
+
+	buf = kvpmalloc(bytes, GFP_NOIO);
+	if (!buf)
+		return;
+
+	csize = bch2_lz4_compress(c, buf, bytes, jset->start, bytes);
+	if (!csize)
+		goto out;
+
+	/*
+	 * Each chunk costs two u64s of headers, and only the last chunk can
+	 * have a size that isn't a multiple of eight:
+	 */
+	nr = DIV_ROUND_UP(csize, JSET_COMPRESSED_CHUNK);
+	new_u64s = 2 * nr + DIV_ROUND_UP(csize, sizeof(u64));
+
+	if (round_up(sizeof(*jset) + new_u64s * sizeof(u64), block_bytes(c)) >=
+	    round_up(sizeof(*jset) + bytes, block_bytes(c)))
+		goto out;
+
+	entry = jset->start;
+	p = buf;
+
+	while (csize) {
+		chunk = min_t(size_t, csize, JSET_COMPRESSED_CHUNK);
+
+		d = container_of(entry, struct jset_entry_compressed, entry);
+		memset(d, 0, sizeof(*d));
+		d->entry.type	= BCH_JSET_ENTRY_compressed;
+		d->entry.u64s	= cpu_to_le16(1 + DIV_ROUND_UP(chunk, sizeof(u64)));
+		d->csize	= cpu_to_le32(chunk);
+		if (entry == jset->start)
+			d->u64s_uncompressed = cpu_to_le32(u64s);
+
+		/* zero the padding in the last word: */
+		((u64 *) d->data)[DIV_ROUND_UP(chunk, sizeof(u64)) - 1] = 0;
+		memcpy(d->data, p, chunk);
+
+		p	+= chunk;
+		csize	-= chunk;
+		entry	= vstruct_next(entry);
+	}
+
+	jset->u64s = cpu_to_le32((u64 *) entry - jset->_data);
+out:
+	kvpfree(buf, bytes);
+}
+
 void bch2_journal_write(struct closure *cl)
 {
 	struct journal *j = container_of(cl, struct journal, io);
 	struct bch_fs *c = container_of(j, struct bch_fs, journal);
 	struct bch_dev *ca;
-	struct journal_buf *w = journal_prev_buf(j);
+	struct journal_buf *w = journal_last_unwritten_buf(j);
 	struct jset_entry *start, *end;
 	struct jset *jset;
 	struct bio *bio;
@@ -1054,6 +1519,7 @@ void bch2_journal_write(struct closure *cl)
 	le32_add_cpu(&jset->u64s, u64s);
 	BUG_ON(vstruct_sectors(jset, c->block_bits) > w->sectors);
 
+	journal_write_squash(c, jset);
 	journal_write_compact(jset);
 
 	jset->read_clock	= cpu_to_le16(c->bucket_clock[READ].hand);
@@ -1073,10 +1539,17 @@ void bch2_journal_write(struct closure *cl)
 	if (le32_to_cpu(jset->version) < bcachefs_metadata_version_max)
 		validate_before_checksum = true;
 
+	/* entries must be validated before they're compressed: */
+	if (c->opts.journal_compression)
+		validate_before_checksum = true;
+
 	if (validate_before_checksum &&
 	    jset_validate_entries(c, jset, WRITE))
 		goto err;
 
+	if (c->opts.journal_compression)
+		journal_write_compress(c, jset);
+
 	bch2_encrypt(c, JSET_CSUM_TYPE(jset), journal_nonce(jset),
 		    jset->encrypted_start,
 		    vstruct_end(jset) - (void *) jset->encrypted_start);
@@ -61,12 +61,16 @@ static struct journal_space {
 {
 	struct bch_fs *c = container_of(j, struct bch_fs, journal);
 	struct bch_dev *ca;
+	union journal_res_state state = READ_ONCE(j->reservations);
 	unsigned sectors_next_entry	= UINT_MAX;
 	unsigned sectors_total		= UINT_MAX;
 	unsigned i, nr_devs = 0;
-	unsigned unwritten_sectors = j->reservations.prev_buf_unwritten
-		? journal_prev_buf(j)->sectors
-		: 0;
+	unsigned unwritten_sectors = 0;
+
+	for (i = state.unwritten_idx;
+	     i != state.idx;
+	     i = (i + 1) & JOURNAL_BUF_MASK)
+		unwritten_sectors += j->buf[i].sectors;
 
 	rcu_read_lock();
 	for_each_member_device_rcu(ca, c, i,
@@ -328,6 +332,9 @@ static void bch2_journal_pin_add_locked(struct journal *j, u64 seq,
 	pin->seq	= seq;
 	pin->flush	= flush_fn;
 
+	if (flush_fn)
+		j->pin_scan_hint = min(j->pin_scan_hint, seq);
+
 	list_add(&pin->list, flush_fn ? &pin_list->list : &pin_list->flushed);
 }
 
@@ -365,6 +372,7 @@ void bch2_journal_pin_update(struct journal *j, u64 seq,
 		 * If the pin is already pinning the right sequence number, it
 		 * still might've already been flushed:
 		 */
+		j->pin_scan_hint = min(j->pin_scan_hint, seq);
 		list_move(&pin->list, &pin_list->list);
 	}
 
@@ -421,11 +429,24 @@ journal_get_next_pin(struct journal *j, u64 max_seq, u64 *seq)
 
 	spin_lock(&j->lock);
 
-	fifo_for_each_entry_ptr(pin_list, &j->pin, *seq)
+	/*
+	 * Start at pin_scan_hint - everything below it was seen to have an
+	 * empty unflushed list on a previous scan, and pin adds lower the
+	 * hint - so repeated scans don't repay the cost of walking over pin
+	 * lists that were already flushed:
+	 */
+	for (*seq = max(j->pin.front, j->pin_scan_hint);
+	     *seq < j->pin.back;
+	     (*seq)++) {
+		pin_list = journal_seq_pin(j, *seq);
+
 		if (*seq > max_seq ||
 		    (ret = list_first_entry_or_null(&pin_list->list,
 				struct journal_entry_pin, list)))
 			break;
+	}
+
+	j->pin_scan_hint = *seq;
 
 	if (ret) {
 		list_move(&ret->list, &pin_list->flushed);
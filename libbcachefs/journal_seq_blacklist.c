@@ -81,14 +81,22 @@ int bch2_journal_seq_blacklist_add(struct bch_fs *c, u64 start, u64 end)
 			struct journal_seq_blacklist_entry *e =
 				bl->start + i;
 
-			if (start == le64_to_cpu(e->start) &&
-			    end   == le64_to_cpu(e->end))
-				goto out;
-
-			if (start <= le64_to_cpu(e->start) &&
-			    end   >= le64_to_cpu(e->end)) {
-				e->start = cpu_to_le64(start);
-				e->end	= cpu_to_le64(end);
+			/*
+			 * Extend any entry the new range overlaps or abuts,
+			 * rather than adding a new one - entries are kept
+			 * sorted and non overlapping, so the table only grows
+			 * for genuinely disjoint ranges:
+			 */
+			if (start <= le64_to_cpu(e->end) &&
+			    end   >= le64_to_cpu(e->start)) {
+				if (start >= le64_to_cpu(e->start) &&
+				    end   <= le64_to_cpu(e->end))
+					goto out;
+
+				e->start = cpu_to_le64(min(start,
+						le64_to_cpu(e->start)));
+				e->end	 = cpu_to_le64(max(end,
+						le64_to_cpu(e->end)));
 
 				if (i + 1 < nr)
 					bl = blacklist_entry_try_merge(c,
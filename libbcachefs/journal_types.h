@@ -11,9 +11,13 @@
 
 struct journal_res;
 
+#define JOURNAL_BUF_BITS	2
+#define JOURNAL_BUF_NR		(1U << JOURNAL_BUF_BITS)
+#define JOURNAL_BUF_MASK	(JOURNAL_BUF_NR - 1)
+
 /*
- * We put two of these in struct journal; we used them for writes to the
- * journal that are being staged or in flight.
+ * We put JOURNAL_BUF_NR of these in struct journal; we used them for writes to
+ * the journal that are being staged or in flight.
  */
 struct journal_buf {
 	struct jset		*data;
@@ -81,10 +85,12 @@ union journal_res_state {
 
 	struct {
 		u64		cur_entry_offset:20,
-				idx:1,
-				prev_buf_unwritten:1,
-				buf0_count:21,
-				buf1_count:21;
+				idx:2,
+				unwritten_idx:2,
+				buf0_count:10,
+				buf1_count:10,
+				buf2_count:10,
+				buf3_count:10;
 	};
 };
 
@@ -157,10 +163,18 @@ struct journal {
 	unsigned		buf_size_want;
 
 	/*
-	 * Two journal entries -- one is currently open for new entries, the
-	 * other is possibly being written out.
+	 * Decaying average of entry size at close, in bytes: when the
+	 * workload's entries have been filling most of the buffer we grow
+	 * buf_size_want before reservations start failing on a full buf:
+	 */
+	unsigned		entry_bytes_ewma;
+
+	/*
+	 * Ring of journal entries: one is currently open for new entries, the
+	 * bufs in [unwritten_idx, idx) are closed and being written out. Entry
+	 * with sequence number @seq lives in buf[seq & JOURNAL_BUF_MASK].
 	 */
-	struct journal_buf	buf[2];
+	struct journal_buf	buf[JOURNAL_BUF_NR];
 
 	spinlock_t		lock;
 
@@ -203,6 +217,14 @@ struct journal {
 		struct journal_entry_pin_list *data;
 	}			pin;
 
+	/*
+	 * Every pin list below this sequence number has an empty unflushed
+	 * pin list, so journal_get_next_pin() can start scanning here
+	 * instead of at the front of the fifo; lowered when a pin is added,
+	 * protected by j->lock:
+	 */
+	u64			pin_scan_hint;
+
 	u64			replay_journal_seq;
 	u64			replay_journal_seq_end;
 
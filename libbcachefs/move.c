@@ -2,17 +2,22 @@
 
 #include "bcachefs.h"
 #include "alloc_foreground.h"
+#include "backref.h"
 #include "bkey_on_stack.h"
 #include "btree_gc.h"
 #include "btree_update.h"
 #include "btree_update_interior.h"
 #include "buckets.h"
+#include "checksum.h"
 #include "disk_groups.h"
+#include "ec.h"
+#include "error.h"
 #include "inode.h"
 #include "io.h"
 #include "journal_reclaim.h"
 #include "move.h"
 #include "replicas.h"
+#include "super.h"
 #include "super-io.h"
 #include "keylist.h"
 
@@ -21,8 +26,6 @@
 
 #include <trace/events/bcachefs.h>
 
-#define SECTORS_IN_FLIGHT_PER_DEVICE	2048
-
 struct moving_io {
 	struct list_head	list;
 	struct closure		cl;
@@ -31,6 +34,9 @@ struct moving_io {
 	unsigned		read_sectors;
 	unsigned		write_sectors;
 
+	/* copy of the key being moved, for reads deferred by the elevator: */
+	struct bkey_on_stack	k;
+
 	struct bch_read_bio	rbio;
 
 	struct migrate_write	write;
@@ -126,6 +132,17 @@ static int bch2_migrate_index_update(struct bch_write_op *op)
 
 			bch2_extent_ptr_decoded_append(insert, &p);
 			did_work = true;
+
+			/*
+			 * Remember where the new copy went, so we can read it
+			 * back - the crc here is the one the write path
+			 * produced, which may differ from what we read if the
+			 * data was recompressed or rechecksummed:
+			 */
+			if (m->verify && !m->verify_ptr_valid) {
+				m->verify_pick = p;
+				m->verify_ptr_valid = true;
+			}
 		}
 
 		if (!did_work)
@@ -324,6 +341,7 @@ static void move_free(struct closure *cl)
 	struct bio_vec *bv;
 
 	bch2_disk_reservation_put(io->write.op.c, &io->write.op.res);
+	bkey_on_stack_exit(&io->k, io->write.op.c);
 
 	bio_for_each_segment_all(bv, &io->write.op.wbio.bio, iter)
 		if (bv->bv_page)
@@ -334,10 +352,98 @@ static void move_free(struct closure *cl)
 	kfree(io);
 }
 
+/*
+ * Read back the copy we just wrote and check it, to catch misdirected and torn
+ * writes while the data still exists elsewhere: the write path only trusts the
+ * device's completion. Checksummed extents are verified against the checksum
+ * the write path produced; extents with no checksum have no other end to end
+ * protection, so for those we compare the raw data against what we submitted
+ * when the write didn't re-encode it.
+ */
+static void bch2_move_verify_write(struct moving_io *io)
+{
+	struct migrate_write *m = &io->write;
+	struct bch_fs *c = m->op.c;
+	struct extent_ptr_decoded *p = &m->verify_pick;
+	struct bch_dev *ca = bch_dev_bkey_exists(c, p->ptr.dev);
+	unsigned bytes = p->crc.compressed_size << 9;
+	struct bio *bio;
+	void *buf;
+
+	if (c->opts.nochanges)
+		return;
+
+	if (!bch2_dev_get_ioref(ca, READ))
+		return;
+
+	buf = kvpmalloc(bytes, GFP_KERNEL);
+	if (!buf)
+		goto out_ioref;
+
+	bio = bio_alloc_bioset(GFP_KERNEL, buf_pages(buf, bytes),
+			       &c->bio_read);
+	bio_set_dev(bio, ca->disk_sb.bdev);
+	bio->bi_opf		= REQ_OP_READ;
+	bio->bi_iter.bi_sector	= p->ptr.offset;
+	bch2_bio_map(bio, buf, bytes);
+
+	submit_bio_wait(bio);
+
+	if (bio->bi_status) {
+		bch2_dev_io_error(ca, "error reading back moved data");
+		goto out_bio;
+	}
+
+	if (p->crc.csum_type) {
+		struct nonce nonce = extent_nonce(m->op.version, p->crc);
+		struct bch_csum csum = bch2_checksum_bio(c, p->crc.csum_type,
+							 nonce, bio);
+
+		if (bch2_crc_cmp(csum, p->crc.csum))
+			bch2_dev_io_error(ca,
+				"checksum error verifying moved data: expected %0llx:%0llx got %0llx:%0llx (type %u)",
+				p->crc.csum.hi, p->crc.csum.lo,
+				csum.hi, csum.lo, p->crc.csum_type);
+	} else if (!crc_is_compressed(p->crc) &&
+		   !crc_is_compressed(m->op.crc) &&
+		   !m->op.crc.csum_type) {
+		/* Write path passed the data through untouched: */
+		struct bvec_iter_all iter;
+		struct bio_vec *bv;
+		unsigned done = 0;
+
+		bio_for_each_segment_all(bv, &m->op.wbio.bio, iter) {
+			unsigned b = min_t(unsigned, bv->bv_len, bytes - done);
+
+			if (memcmp(buf + done,
+				   page_address(bv->bv_page) + bv->bv_offset,
+				   b)) {
+				bch2_dev_io_error(ca,
+					"data mismatch verifying moved data (unchecksummed extent)");
+				break;
+			}
+
+			done += b;
+			if (done == bytes)
+				break;
+		}
+	}
+out_bio:
+	bio_put(bio);
+	kvpfree(buf, bytes);
+out_ioref:
+	percpu_ref_put(&ca->io_ref);
+}
+
 static void move_write_done(struct closure *cl)
 {
 	struct moving_io *io = container_of(cl, struct moving_io, cl);
 
+	if (io->write.verify &&
+	    io->write.verify_ptr_valid &&
+	    !io->write.op.error)
+		bch2_move_verify_write(io);
+
 	atomic_sub(io->write_sectors, &io->write.ctxt->write_sectors);
 	closure_return_with_destructor(cl, move_free);
 }
@@ -345,6 +451,8 @@ static void move_write_done(struct closure *cl)
 static void move_write(struct closure *cl)
 {
 	struct moving_io *io = container_of(cl, struct moving_io, cl);
+	struct migrate_write *m = &io->write;
+	struct bch_fs *c = m->op.c;
 
 	if (unlikely(io->rbio.bio.bi_status || io->rbio.hole)) {
 		closure_return_with_destructor(cl, move_free);
@@ -353,9 +461,19 @@ static void move_write(struct closure *cl)
 
 	bch2_migrate_read_done(&io->write, &io->rbio);
 
+	m->verify = c->opts.move_verify_percent &&
+		(!m->op.crc.csum_type ||
+		 bch2_rand_range(100) < c->opts.move_verify_percent);
+
 	atomic_add(io->write_sectors, &io->write.ctxt->write_sectors);
 	closure_call(&io->write.op.cl, bch2_write, NULL, cl);
-	continue_at(cl, move_write_done, NULL);
+
+	/*
+	 * The verify read blocks - don't run move_write_done() from the write
+	 * completion context:
+	 */
+	continue_at(cl, move_write_done,
+		    m->verify ? system_unbound_wq : NULL);
 }
 
 static inline struct moving_io *next_pending_write(struct moving_context *ctxt)
@@ -409,7 +527,7 @@ static void bch2_move_ctxt_wait_for_io(struct moving_context *ctxt)
 		atomic_read(&ctxt->write_sectors) != sectors_pending);
 }
 
-static int bch2_move_extent(struct bch_fs *c,
+static struct moving_io *bch2_move_extent_start(struct bch_fs *c,
 			    struct moving_context *ctxt,
 			    struct write_point_specifier wp,
 			    struct bch_io_opts io_opts,
@@ -427,11 +545,11 @@ static int bch2_move_extent(struct bch_fs *c,
 
 	move_ctxt_wait_event(ctxt,
 		atomic_read(&ctxt->write_sectors) <
-		SECTORS_IN_FLIGHT_PER_DEVICE);
+		c->opts.move_sectors_in_flight);
 
 	move_ctxt_wait_event(ctxt,
 		atomic_read(&ctxt->read_sectors) <
-		SECTORS_IN_FLIGHT_PER_DEVICE);
+		c->opts.move_sectors_in_flight);
 
 	/* write path might have to decompress data: */
 	bkey_for_each_ptr_decode(k.k, ptrs, p, entry)
@@ -446,6 +564,7 @@ static int bch2_move_extent(struct bch_fs *c,
 	io->write.ctxt		= ctxt;
 	io->read_sectors	= k.k->size;
 	io->write_sectors	= k.k->size;
+	bkey_on_stack_init(&io->k);
 
 	bio_init(&io->write.op.wbio.bio, io->bi_inline_vecs, pages);
 	bio_set_prio(&io->write.op.wbio.bio,
@@ -476,7 +595,6 @@ static int bch2_move_extent(struct bch_fs *c,
 
 	trace_move_extent(k.k);
 
-	atomic_add(io->read_sectors, &ctxt->read_sectors);
 	list_add_tail(&io->list, &ctxt->reads);
 
 	/*
@@ -484,17 +602,140 @@ static int bch2_move_extent(struct bch_fs *c,
 	 * ctxt when doing wakeup
 	 */
 	closure_get(&ctxt->cl);
-	bch2_read_extent(c, &io->rbio, k, 0,
-			 BCH_READ_NODECODE|
-			 BCH_READ_LAST_FRAGMENT);
-	return 0;
+	return io;
 err_free_pages:
 	bio_free_pages(&io->write.op.wbio.bio);
 err_free:
 	kfree(io);
 err:
 	trace_move_alloc_fail(k.k);
-	return ret;
+	return ERR_PTR(ret);
+}
+
+static void move_read_issue(struct bch_fs *c, struct moving_io *io,
+			    struct bkey_s_c k)
+{
+	atomic_add(io->read_sectors, &io->write.ctxt->read_sectors);
+	bch2_read_extent(c, &io->rbio, k, 0,
+			 BCH_READ_NODECODE|
+			 BCH_READ_LAST_FRAGMENT);
+}
+
+static int bch2_move_extent(struct bch_fs *c,
+			    struct moving_context *ctxt,
+			    struct write_point_specifier wp,
+			    struct bch_io_opts io_opts,
+			    enum btree_id btree_id,
+			    struct bkey_s_c k,
+			    enum data_cmd data_cmd,
+			    struct data_opts data_opts)
+{
+	struct moving_io *io = bch2_move_extent_start(c, ctxt, wp, io_opts,
+					btree_id, k, data_cmd, data_opts);
+
+	if (IS_ERR(io))
+		return PTR_ERR(io);
+
+	move_read_issue(c, io, k);
+	return 0;
+}
+
+/*
+ * Move elevator: walking extents in key order means random source reads on a
+ * fragmented filesystem. When move_window is set we batch up a window of
+ * candidate extents and issue their reads sorted by disk address, so a
+ * rotational device sees mostly ascending offsets instead of seeks.
+ *
+ * Writes still happen in key order: ios are added to ctxt->reads in key order
+ * when the window is filled, and next_pending_write() only takes ios from the
+ * head of that list.
+ */
+
+struct move_window_io {
+	struct moving_io	*io;
+	/* device and offset of the pointer we expect the read to pick: */
+	u32			dev;
+	u64			offset;
+};
+
+struct move_window {
+	struct move_window_io	*e;
+	unsigned		nr;
+	unsigned		capacity;
+	unsigned		sectors;
+};
+
+static int move_window_io_cmp(const void *_l, const void *_r, size_t size)
+{
+	const struct move_window_io *l = _l, *r = _r;
+
+	return  cmp_int(l->dev, r->dev) ?:
+		cmp_int(l->offset, r->offset);
+}
+
+static void move_window_flush(struct bch_fs *c, struct move_window *w)
+{
+	unsigned i;
+
+	sort_cmp_size(w->e, w->nr, sizeof(w->e[0]),
+		      move_window_io_cmp, NULL);
+
+	for (i = 0; i < w->nr; i++)
+		move_read_issue(c, w->e[i].io,
+				bkey_i_to_s_c(w->e[i].io->k.k));
+
+	w->nr		= 0;
+	w->sectors	= 0;
+}
+
+static int move_window_add(struct bch_fs *c, struct move_window *w,
+			   struct moving_context *ctxt,
+			   struct write_point_specifier wp,
+			   struct bch_io_opts io_opts,
+			   enum btree_id btree_id,
+			   struct bkey_s_c k,
+			   enum data_cmd data_cmd,
+			   struct data_opts data_opts)
+{
+	struct moving_io *io = bch2_move_extent_start(c, ctxt, wp, io_opts,
+					btree_id, k, data_cmd, data_opts);
+	struct move_window_io *e;
+	struct bkey_ptrs_c ptrs;
+	const struct bch_extent_ptr *ptr;
+
+	if (IS_ERR(io))
+		return PTR_ERR(io);
+
+	/* the caller's copy of @k doesn't survive until the flush: */
+	bkey_on_stack_reassemble(&io->k, c, k);
+
+	e = &w->e[w->nr++];
+	e->io		= io;
+	/*
+	 * The first non cached pointer is what the read path will pick absent
+	 * errors or congestion - good enough for scheduling:
+	 */
+	e->dev		= U32_MAX;
+	e->offset	= 0;
+
+	ptrs = bch2_bkey_ptrs_c(k);
+	bkey_for_each_ptr(ptrs, ptr)
+		if (!ptr->cached) {
+			e->dev		= ptr->dev;
+			e->offset	= ptr->offset;
+			break;
+		}
+
+	/*
+	 * Buffers for unissued reads aren't counted in ctxt->read_sectors, so
+	 * also cap the window by sectors to bound memory usage:
+	 */
+	w->sectors += k.k->size;
+	if (w->nr == w->capacity ||
+	    w->sectors >= c->opts.move_sectors_in_flight)
+		move_window_flush(c, w);
+
+	return 0;
 }
 
 static int __bch2_move_data(struct bch_fs *c,
@@ -515,12 +756,21 @@ static int __bch2_move_data(struct bch_fs *c,
 	struct bkey_s_c k;
 	struct data_opts data_opts;
 	enum data_cmd data_cmd;
+	struct move_window win = { NULL };
 	u64 delay, cur_inum = U64_MAX;
 	int ret = 0, ret2;
 
 	bkey_on_stack_init(&sk);
 	bch2_trans_init(&trans, c, 0, 0);
 
+	if (c->opts.move_window > 1) {
+		/* on allocation failure, fall back to reading in key order: */
+		win.e = kcalloc(c->opts.move_window, sizeof(win.e[0]),
+				GFP_KERNEL);
+		if (win.e)
+			win.capacity = c->opts.move_window;
+	}
+
 	stats->data_type = BCH_DATA_user;
 	stats->btree_id	= btree_id;
 	stats->pos	= POS_MIN;
@@ -550,6 +800,8 @@ static int __bch2_move_data(struct bch_fs *c,
 
 			if (unlikely(freezing(current))) {
 				bch2_trans_unlock(&trans);
+				if (win.e)
+					move_window_flush(c, &win);
 				move_ctxt_wait_event(ctxt, list_empty(&ctxt->reads));
 				try_to_freeze();
 			}
@@ -602,11 +854,16 @@ peek:
 		k = bkey_i_to_s_c(sk.k);
 		bch2_trans_unlock(&trans);
 
-		ret2 = bch2_move_extent(c, ctxt, wp, io_opts, btree_id, k,
-					data_cmd, data_opts);
+		ret2 = win.e
+			? move_window_add(c, &win, ctxt, wp, io_opts,
+					  btree_id, k, data_cmd, data_opts)
+			: bch2_move_extent(c, ctxt, wp, io_opts, btree_id, k,
+					   data_cmd, data_opts);
 		if (ret2) {
 			if (ret2 == -ENOMEM) {
 				/* memory allocation failure, wait for some IO to finish */
+				if (win.e)
+					move_window_flush(c, &win);
 				bch2_move_ctxt_wait_for_io(ctxt);
 				continue;
 			}
@@ -626,6 +883,16 @@ next_nondata:
 	}
 out:
 	ret = bch2_trans_exit(&trans) ?: ret;
+
+	/*
+	 * ios in the window already hold refs on ctxt->cl and are on
+	 * ctxt->reads - issue them even if we're stopping, so the caller's
+	 * wait for list_empty(&ctxt->reads) can make progress:
+	 */
+	if (win.e) {
+		move_window_flush(c, &win);
+		kfree(win.e);
+	}
 	bkey_on_stack_exit(&sk, c);
 
 	return ret;
@@ -665,6 +932,209 @@ int bch2_move_data(struct bch_fs *c,
 	return ret;
 }
 
+/*
+ * Like bch2_move_data(), but instead of scanning everything, only scan the
+ * extents of inodes that - per the backrefs btree - have data on @dev: on
+ * filesystems with many devices this makes evacuating one device proportional
+ * to the data being evacuated, not to total metadata. Backrefs are hints, so
+ * @pred still verifies every extent; the caller must fall back to a full scan
+ * on error.
+ */
+int bch2_move_data_backrefs(struct bch_fs *c, unsigned dev,
+			    struct bch_ratelimit *rate,
+			    struct write_point_specifier wp,
+			    move_pred_fn pred, void *arg,
+			    struct bch_move_stats *stats)
+{
+	struct moving_context ctxt = { .stats = stats };
+	struct backref_target *targets;
+	size_t nr, i;
+	int ret;
+
+	ret = bch2_backref_dev_targets(c, dev, &targets, &nr);
+	if (ret)
+		return ret;
+
+	closure_init_stack(&ctxt.cl);
+	INIT_LIST_HEAD(&ctxt.reads);
+	init_waitqueue_head(&ctxt.wait);
+
+	stats->data_type = BCH_DATA_user;
+
+	for (i = 0; i < nr && !ret; i++)
+		ret = __bch2_move_data(c, &ctxt, rate, wp,
+				       POS(targets[i].inum, 0),
+				       POS(targets[i].inum + 1, 0),
+				       pred, arg, stats,
+				       targets[i].btree_id);
+
+	kvfree(targets);
+
+	move_ctxt_wait_event(&ctxt, list_empty(&ctxt.reads));
+	closure_sync(&ctxt.cl);
+
+	EBUG_ON(atomic_read(&ctxt.write_sectors));
+
+	trace_move_data(c,
+			atomic64_read(&stats->sectors_moved),
+			atomic64_read(&stats->keys_moved));
+
+	return ret;
+}
+
+/* striped moves: */
+
+#define MOVE_STREAMS_MAX	16
+
+struct move_stream {
+	struct bch_fs		*c;
+	struct task_struct	*task;
+	struct completion	done;
+
+	struct bch_ratelimit	*rate;
+	struct bpos		start;
+	struct bpos		end;
+	move_pred_fn		pred;
+	void			*arg;
+	struct bch_move_stats	*stats;
+	int			ret;
+};
+
+static int move_stream_fn(void *arg)
+{
+	struct move_stream *s = arg;
+
+	s->ret = bch2_move_data(s->c, s->rate,
+				writepoint_hashed((unsigned long) current),
+				s->start, s->end,
+				s->pred, s->arg, s->stats);
+	complete(&s->done);
+	return 0;
+}
+
+/*
+ * Pick split points for partitioning [start, end) into @nr roughly equal key
+ * ranges, from the boundaries of the extent btree's level 1 nodes - the only
+ * cheap approximation of the key distribution we have:
+ */
+static unsigned move_data_split_points(struct bch_fs *c,
+				       struct bpos start, struct bpos end,
+				       unsigned nr, struct bpos *splits)
+{
+	struct btree_trans trans;
+	struct btree_iter *iter;
+	struct btree *b;
+	unsigned nr_nodes = 0, nr_splits = 0, step, i = 0;
+
+	bch2_trans_init(&trans, c, 0, 0);
+
+	__for_each_btree_node(&trans, iter, BTREE_ID_EXTENTS, start,
+			      0, 1, 0, b) {
+		nr_nodes++;
+		if (bkey_cmp(b->key.k.p, end) >= 0)
+			break;
+	}
+
+	bch2_trans_exit(&trans);
+
+	if (nr_nodes < nr * 2)
+		return 0;
+
+	step = DIV_ROUND_UP(nr_nodes, nr);
+
+	bch2_trans_init(&trans, c, 0, 0);
+
+	__for_each_btree_node(&trans, iter, BTREE_ID_EXTENTS, start,
+			      0, 1, 0, b) {
+		if (++i % step == 0 &&
+		    nr_splits < nr - 1 &&
+		    bkey_cmp(b->key.k.p, end) < 0)
+			splits[nr_splits++] = b->key.k.p;
+
+		if (bkey_cmp(b->key.k.p, end) >= 0)
+			break;
+	}
+
+	bch2_trans_exit(&trans);
+
+	return nr_splits;
+}
+
+int bch2_move_data_parallel(struct bch_fs *c, unsigned nr_streams,
+			    struct bch_ratelimit *rate,
+			    struct write_point_specifier wp,
+			    struct bpos start, struct bpos end,
+			    move_pred_fn pred, void *arg,
+			    struct bch_move_stats *stats)
+{
+	struct bpos splits[MOVE_STREAMS_MAX - 1];
+	struct move_stream *streams;
+	unsigned nr_splits = 0, nr, i;
+	int ret = 0;
+
+	nr_streams = clamp_t(unsigned, nr_streams, 1, MOVE_STREAMS_MAX);
+
+	if (nr_streams > 1)
+		nr_splits = move_data_split_points(c, start, end,
+						   nr_streams, splits);
+	if (!nr_splits)
+		return bch2_move_data(c, rate, wp, start, end,
+				      pred, arg, stats);
+
+	nr = nr_splits + 1;
+
+	streams = kcalloc(nr, sizeof(*streams), GFP_KERNEL);
+	if (!streams)
+		return bch2_move_data(c, rate, wp, start, end,
+				      pred, arg, stats);
+
+	/*
+	 * Streams share @stats: the counters are atomic, so this also gives
+	 * the caller merged progress reporting for free. Each stream gets its
+	 * own write point; the rate limiter is a shared token bucket, so the
+	 * streams are throttled collectively, not each at the full rate:
+	 */
+	for (i = 0; i < nr; i++) {
+		struct move_stream *s = streams + i;
+
+		s->c	= c;
+		s->rate	= rate;
+		s->start = i ? splits[i - 1] : start;
+		s->end	 = i < nr_splits ? splits[i] : end;
+		s->pred	= pred;
+		s->arg	= arg;
+		s->stats = stats;
+		init_completion(&s->done);
+
+		s->task = kthread_create(move_stream_fn, s, "bch_move/%u", i);
+		if (IS_ERR(s->task)) {
+			/* can't spawn a thread - run this partition here: */
+			s->task = NULL;
+			s->ret = bch2_move_data(c, s->rate, wp,
+						s->start, s->end,
+						pred, arg, stats);
+		} else {
+			get_task_struct(s->task);
+			wake_up_process(s->task);
+		}
+	}
+
+	for (i = 0; i < nr; i++) {
+		struct move_stream *s = streams + i;
+
+		if (s->task) {
+			wait_for_completion(&s->done);
+			kthread_stop(s->task);
+			put_task_struct(s->task);
+		}
+
+		ret = s->ret ?: ret;
+	}
+
+	kfree(streams);
+	return ret;
+}
+
 static int bch2_move_btree(struct bch_fs *c,
 			   move_pred_fn pred,
 			   void *arg,
@@ -773,9 +1243,12 @@ int bch2_data_job(struct bch_fs *c,
 		  struct bch_move_stats *stats,
 		  struct bch_ioctl_data op)
 {
-	int ret = 0;
+	int ret = 0, ret2;
 
 	switch (op.op) {
+	case BCH_DATA_OP_SCRUB:
+		ret = bch2_stripes_scrub(c, NULL, stats, op.start, op.end);
+		break;
 	case BCH_DATA_OP_REREPLICATE:
 		stats->data_type = BCH_DATA_journal;
 		ret = bch2_journal_flush_device_pins(&c->journal, -1);
@@ -787,7 +1260,7 @@ int bch2_data_job(struct bch_fs *c,
 
 		ret = bch2_replicas_gc2(c) ?: ret;
 
-		ret = bch2_move_data(c, NULL,
+		ret = bch2_move_data_parallel(c, c->opts.data_job_streams, NULL,
 				     writepoint_hashed((unsigned long) current),
 				     op.start,
 				     op.end,
@@ -804,11 +1277,25 @@ int bch2_data_job(struct bch_fs *c,
 		ret = bch2_move_btree(c, migrate_pred, &op, stats) ?: ret;
 		ret = bch2_replicas_gc2(c) ?: ret;
 
-		ret = bch2_move_data(c, NULL,
+		/*
+		 * When backrefs are available, only scan inodes with data on
+		 * the device being evacuated - falling back to the full scan
+		 * if anything goes wrong:
+		 */
+		ret2 = bch2_backrefs_enabled(c) &&
+			!bkey_cmp(op.start, POS_MIN) &&
+			!bkey_cmp(op.end, POS_MAX)
+			? bch2_move_data_backrefs(c, op.migrate.dev, NULL,
+				     writepoint_hashed((unsigned long) current),
+				     migrate_pred, &op, stats)
+			: -EOPNOTSUPP;
+		if (ret2)
+			ret2 = bch2_move_data_parallel(c, c->opts.data_job_streams, NULL,
 				     writepoint_hashed((unsigned long) current),
 				     op.start,
 				     op.end,
-				     migrate_pred, &op, stats) ?: ret;
+				     migrate_pred, &op, stats);
+		ret = ret2 ?: ret;
 		ret = bch2_replicas_gc2(c) ?: ret;
 		break;
 	default:
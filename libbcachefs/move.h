@@ -31,6 +31,14 @@ struct migrate_write {
 
 	unsigned		nr_ptrs_reserved;
 
+	/*
+	 * Read back and verify the copy we wrote? Always done for extents with
+	 * no checksum, sampled for the rest:
+	 */
+	bool			verify;
+	bool			verify_ptr_valid;
+	struct extent_ptr_decoded verify_pick;
+
 	struct moving_context	*ctxt;
 
 	/* what we read: */
@@ -57,6 +65,19 @@ int bch2_move_data(struct bch_fs *, struct bch_ratelimit *,
 		   move_pred_fn, void *,
 		   struct bch_move_stats *);
 
+int bch2_move_data_parallel(struct bch_fs *, unsigned,
+			    struct bch_ratelimit *,
+			    struct write_point_specifier,
+			    struct bpos, struct bpos,
+			    move_pred_fn, void *,
+			    struct bch_move_stats *);
+
+int bch2_move_data_backrefs(struct bch_fs *, unsigned,
+			    struct bch_ratelimit *,
+			    struct write_point_specifier,
+			    move_pred_fn, void *,
+			    struct bch_move_stats *);
+
 int bch2_data_job(struct bch_fs *,
 		  struct bch_move_stats *,
 		  struct bch_ioctl_data);
@@ -89,6 +89,60 @@ static int __copygc_pred(struct bch_fs *c, struct bkey_s_c k)
 	return -1;
 }
 
+/*
+ * Work deduplication with other background tasks: is @k's data in a bucket
+ * copygc is currently evacuating? Copygc's moves are written with the
+ * background target and compression options applied (see
+ * bch2_migrate_write_init()), so if so there's no reason for rebalance to
+ * also move it:
+ */
+bool bch2_copygc_will_move(struct bch_fs *c, struct bkey_s_c k)
+{
+	struct copygc_pending *p;
+	struct bkey_ptrs_c ptrs;
+	const struct bch_extent_ptr *ptr;
+	bool ret = false;
+
+	rcu_read_lock();
+	p = rcu_dereference(c->copygc_pending);
+	if (!p)
+		goto out;
+
+	ptrs = bch2_bkey_ptrs_c(k);
+	bkey_for_each_ptr(ptrs, ptr) {
+		struct bch_dev *ca = bch_dev_bkey_exists(c, ptr->dev);
+		struct copygc_heap_entry search = {
+			.dev	= ptr->dev,
+			.offset	= ptr->offset,
+		};
+
+		ssize_t i = eytzinger0_find_le(p->d, p->nr,
+					       sizeof(p->d[0]),
+					       bucket_offset_cmp, &search);
+
+		if (i >= 0 &&
+		    ptr->offset < p->d[i].offset + ca->mi.bucket_size &&
+		    ptr->gen == p->d[i].gen) {
+			ret = true;
+			break;
+		}
+	}
+out:
+	rcu_read_unlock();
+	return ret;
+}
+
+static void copygc_pending_publish(struct bch_fs *c,
+				   struct copygc_pending *new)
+{
+	struct copygc_pending *old =
+		rcu_dereference_protected(c->copygc_pending, 1);
+
+	rcu_assign_pointer(c->copygc_pending, new);
+	if (old)
+		kfree_rcu(old, rcu);
+}
+
 static enum data_cmd copygc_pred(struct bch_fs *c, void *arg,
 				 struct bkey_s_c k,
 				 struct bch_io_opts *io_opts,
@@ -158,12 +212,39 @@ static int bch2_copygc(struct bch_fs *c)
 	}
 
 	for_each_rw_member(ca, c, dev_idx) {
+		size_t nr_candidates = 0;
+		u64 dev_reserve, est = 0;
+		unsigned cutoff;
+
 		closure_wait_event(&c->freelist_wait, have_copygc_reserve(ca));
 
 		spin_lock(&ca->fs->freelist_lock);
-		sectors_reserved += fifo_used(&ca->free[RESERVE_MOVINGGC]) * ca->mi.bucket_size;
+		dev_reserve = fifo_used(&ca->free[RESERVE_MOVINGGC]) * ca->mi.bucket_size;
 		spin_unlock(&ca->fs->freelist_lock);
 
+		sectors_reserved += dev_reserve;
+
+		/*
+		 * Pick a live sectors cutoff from the fragmentation index:
+		 * take bins from emptiest up while the data they hold fits in
+		 * this device's copygc reserve and the heap. Buckets in fuller
+		 * bins couldn't survive the trim below anyway, and skipping
+		 * them here means the heap only ever sees real candidates:
+		 */
+		for (cutoff = 0; cutoff < BCH_FRAG_BINS; cutoff++) {
+			size_t nr = atomic_read(&ca->frag_idx[cutoff]);
+			u64 s = nr * ((u64) cutoff * 2 + 1) *
+				ca->mi.bucket_size / (BCH_FRAG_BINS * 2);
+
+			if (nr_candidates &&
+			    (est + s > dev_reserve ||
+			     nr_candidates + nr > h->size))
+				break;
+
+			nr_candidates	+= nr;
+			est		+= s;
+		}
+
 		down_read(&ca->bucket_lock);
 		buckets = bucket_array(ca);
 
@@ -177,6 +258,10 @@ static int bch2_copygc(struct bch_fs *c)
 			    bucket_sectors_used(m) >= ca->mi.bucket_size)
 				continue;
 
+			if (bucket_sectors_used(m) * BCH_FRAG_BINS /
+			    ca->mi.bucket_size >= cutoff)
+				continue;
+
 			e = (struct copygc_heap_entry) {
 				.dev		= dev_idx,
 				.gen		= m.gen,
@@ -212,12 +297,31 @@ static int bch2_copygc(struct bch_fs *c)
 			sizeof(h->data[0]),
 			bucket_offset_cmp, NULL);
 
+	/*
+	 * Publish the buckets we're evacuating, so rebalance can skip extents
+	 * this pass is about to move anyway; allocation failure just means no
+	 * deduplication this pass:
+	 */
+	{
+		struct copygc_pending *new =
+			kmalloc(sizeof(*new) + h->used * sizeof(new->d[0]),
+				GFP_KERNEL);
+
+		if (new) {
+			new->nr = h->used;
+			memcpy(new->d, h->data, h->used * sizeof(new->d[0]));
+		}
+		copygc_pending_publish(c, new);
+	}
+
 	ret = bch2_move_data(c, &c->copygc_pd.rate,
 			     writepoint_ptr(&c->copygc_write_point),
 			     POS_MIN, POS_MAX,
 			     copygc_pred, NULL,
 			     &move_stats);
 
+	copygc_pending_publish(c, NULL);
+
 	for_each_rw_member(ca, c, dev_idx) {
 		down_read(&ca->bucket_lock);
 		buckets = bucket_array(ca);
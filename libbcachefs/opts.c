@@ -305,6 +305,10 @@ int bch2_opt_check_may_set(struct bch_fs *c, int id, u64 v)
 		if (v)
 			bch2_check_set_feature(c, BCH_FEATURE_ec);
 		break;
+	case Opt_journal_compression:
+		if (v)
+			bch2_check_set_feature(c, BCH_FEATURE_journal_compression);
+		break;
 	}
 
 	return ret;
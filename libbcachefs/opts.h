@@ -131,6 +131,39 @@ enum opt_type {
 	  OPT_STR(bch2_compression_opts),				\
 	  BCH_SB_BACKGROUND_COMPRESSION_TYPE,BCH_COMPRESSION_OPT_none,	\
 	  NULL,		NULL)						\
+	x(compression_offload,		u8,				\
+	  OPT_MOUNT|OPT_RUNTIME,					\
+	  OPT_BOOL(),							\
+	  NO_SB_OPT,			false,				\
+	  NULL,		"Compress large writes in parallel on the\n"	\
+			"worker pool instead of inline on the\n"	\
+			"submitting thread")				\
+	x(move_sectors_in_flight,	u32,				\
+	  OPT_MOUNT|OPT_RUNTIME,					\
+	  OPT_UINT(256, 1U << 20),					\
+	  NO_SB_OPT,			2048,				\
+	  NULL,		"Amount of IO in flight for copygc, rebalance\n"\
+			"and data move jobs, in sectors")		\
+	x(move_window,			u16,				\
+	  OPT_MOUNT|OPT_RUNTIME,					\
+	  OPT_UINT(0, 1024),						\
+	  NO_SB_OPT,			0,				\
+	  NULL,		"Number of extents for data move jobs to\n"	\
+			"batch and sort by disk address before\n"	\
+			"reading, for rotational devices (0: disabled)")\
+	x(data_job_streams,		u8,				\
+	  OPT_MOUNT|OPT_RUNTIME,					\
+	  OPT_UINT(1, 16),						\
+	  NO_SB_OPT,			1,				\
+	  NULL,		"Number of parallel streams for data jobs\n"	\
+			"(migrate, rereplicate)")			\
+	x(move_verify_percent,		u8,				\
+	  OPT_MOUNT|OPT_RUNTIME,					\
+	  OPT_UINT(0, 100),						\
+	  NO_SB_OPT,			0,				\
+	  NULL,		"Percent of moved extents to read back and\n"	\
+			"verify after writing; extents with no\n"	\
+			"checksum are always verified")			\
 	x(str_hash,			u8,				\
 	  OPT_FORMAT|OPT_MOUNT|OPT_RUNTIME,				\
 	  OPT_STR(bch2_str_hash_types),					\
@@ -183,9 +216,9 @@ enum opt_type {
 	  BCH_SB_128_BIT_MACS,		false,				\
 	  NULL,		"Store full 128 bits of cryptographic MACs, instead of 80")\
 	x(inline_data,			u8,				\
-	  OPT_MOUNT|OPT_RUNTIME,					\
+	  OPT_FORMAT|OPT_MOUNT|OPT_RUNTIME,				\
 	  OPT_BOOL(),							\
-	  NO_SB_OPT,			false,				\
+	  BCH_SB_INLINE_DATA,		false,				\
 	  NULL,		"Enable inline data extents")			\
 	x(acl,				u8,				\
 	  OPT_FORMAT|OPT_MOUNT,						\
@@ -234,6 +267,11 @@ enum opt_type {
 	  NULL,		"Disable journal flush on sync/fsync\n"		\
 			"If enabled, writes can be lost, but only since the\n"\
 			"last journal write (default 1 second)")	\
+	x(journal_compression,		u8,				\
+	  OPT_MOUNT|OPT_RUNTIME,					\
+	  OPT_BOOL(),							\
+	  NO_SB_OPT,			false,				\
+	  NULL,		"Compress journal entries (lz4) before write")	\
 	x(fsck,				u8,				\
 	  OPT_MOUNT,							\
 	  OPT_BOOL(),							\
@@ -244,6 +282,11 @@ enum opt_type {
 	  OPT_BOOL(),							\
 	  NO_SB_OPT,			false,				\
 	  NULL,		"Fix errors during fsck without asking")	\
+	x(fsck_accounting_only,		u8,				\
+	  OPT_MOUNT,							\
+	  OPT_BOOL(),							\
+	  NO_SB_OPT,			false,				\
+	  NULL,		"Fsck: only check allocation/usage info, skipping namespace checks")\
 	x(ratelimit_errors,		u8,				\
 	  OPT_MOUNT,							\
 	  OPT_BOOL(),							\
@@ -260,6 +303,13 @@ enum opt_type {
 	  OPT_BOOL(),							\
 	  NO_SB_OPT,			false,				\
 	  NULL,		"Don't replay the journal")			\
+	x(inspect,			u8,				\
+	  OPT_MOUNT,							\
+	  OPT_BOOL(),							\
+	  NO_SB_OPT,			false,				\
+	  NULL,		"Fast read only open for inspection tools:\n"	\
+			"implies nochanges+norecovery, and skips\n"	\
+			"reading allocation info")			\
 	x(rebuild_replicas,		u8,				\
 	  OPT_MOUNT,							\
 	  OPT_BOOL(),							\
@@ -0,0 +1,233 @@
+// SPDX-License-Identifier: GPL-2.0
+
+/*
+ * Mount time btree cache prewarming:
+ *
+ * Every mount starts with a cold btree node cache, and the first traversals
+ * fault in interior nodes one at a time with random reads. On clean shutdown
+ * we save the keys of the interior nodes in the btree node cache to the
+ * superblock; at the next mount, after recovery, we read that set back in
+ * sorted by device offset, warming the cache with one mostly sequential pass.
+ *
+ * The saved set is purely advisory - entries whose pointers have gone stale
+ * since the shutdown that wrote them are skipped, as bucket gens are
+ * incremented when btree node buckets are reused.
+ */
+
+#include "bcachefs.h"
+#include "bkey_methods.h"
+#include "btree_cache.h"
+#include "buckets.h"
+#include "extents.h"
+#include "prewarm.h"
+#include "super-io.h"
+
+#include <linux/sort.h>
+
+/* cap on the superblock space we'll use, in u64s: */
+#define PREWARM_U64S_MAX		(1U << 13)
+
+static inline struct btree_prewarm_entry *
+prewarm_entry_next(struct btree_prewarm_entry *e)
+{
+	return (void *) e + sizeof(*e) + e->key_u64s * sizeof(__u64);
+}
+
+static const char *bch2_sb_validate_prewarm(struct bch_sb *sb,
+					    struct bch_sb_field *f)
+{
+	struct bch_sb_field_prewarm *p = field_to_type(f, prewarm);
+	struct btree_prewarm_entry *e;
+
+	for (e = p->start;
+	     (void *) e < vstruct_end(&p->field);
+	     e = prewarm_entry_next(e)) {
+		if ((void *) e + sizeof(*e) > vstruct_end(&p->field))
+			return "invalid field prewarm: entry overruns field";
+
+		if (e->key_u64s < BKEY_U64s ||
+		    e->key_u64s > BKEY_BTREE_PTR_U64s_MAX ||
+		    (void *) prewarm_entry_next(e) > vstruct_end(&p->field))
+			return "invalid field prewarm: bad key size";
+
+		if (e->btree_id >= BTREE_ID_NR ||
+		    !e->level ||
+		    e->level >= BTREE_MAX_DEPTH)
+			return "invalid field prewarm: bad btree id/level";
+	}
+
+	return NULL;
+}
+
+const struct bch_sb_field_ops bch_sb_field_ops_prewarm = {
+	.validate	= bch2_sb_validate_prewarm,
+};
+
+void bch2_btree_cache_prewarm_save(struct bch_fs *c)
+{
+	struct btree_cache *bc = &c->btree_cache;
+	struct bch_sb_field_prewarm *p;
+	struct btree_prewarm_entry *e;
+	struct btree *b;
+	unsigned i, u64s = sizeof(*p) / sizeof(u64);
+
+	mutex_lock(&c->sb_lock);
+
+	for (i = 0; i < BTREE_CACHE_SHARD_NR; i++) {
+		struct btree_cache_shard *s = bc->shard + i;
+
+		mutex_lock(&s->lock);
+		list_for_each_entry(b, &s->live, list)
+			if (b->c.level)
+				u64s += sizeof(*e) / sizeof(u64) +
+					b->key.k.u64s;
+		mutex_unlock(&s->lock);
+	}
+
+	if (u64s == sizeof(*p) / sizeof(u64) ||
+	    u64s > PREWARM_U64S_MAX)
+		goto out;
+
+	p = bch2_sb_resize_prewarm(&c->disk_sb, u64s);
+	if (!p)
+		goto out;
+
+	e = p->start;
+
+	for (i = 0; i < BTREE_CACHE_SHARD_NR; i++) {
+		struct btree_cache_shard *s = bc->shard + i;
+
+		mutex_lock(&s->lock);
+		list_for_each_entry(b, &s->live, list) {
+			if (!b->c.level)
+				continue;
+
+			/* the cache may have shrunk or grown since we sized: */
+			if ((void *) e + sizeof(*e) +
+			    b->key.k.u64s * sizeof(u64) >
+			    vstruct_end(&p->field))
+				break;
+
+			e->btree_id	= b->c.btree_id;
+			e->level	= b->c.level;
+			e->key_u64s	= b->key.k.u64s;
+			memset(e->pad, 0, sizeof(e->pad));
+			memcpy(e->keys, &b->key,
+			       b->key.k.u64s * sizeof(u64));
+			e = prewarm_entry_next(e);
+		}
+		mutex_unlock(&s->lock);
+	}
+
+	bch2_sb_resize_prewarm(&c->disk_sb,
+			(u64 *) e - (u64 *) p);
+out:
+	mutex_unlock(&c->sb_lock);
+}
+
+struct prewarm_read {
+	unsigned		dev;
+	u64			offset;
+	u8			btree_id;
+	u8			level;
+	struct bkey_i		*k;
+};
+
+static int prewarm_read_cmp(const void *_l, const void *_r)
+{
+	const struct prewarm_read *l = _l, *r = _r;
+
+	return cmp_int(l->dev, r->dev) ?:
+		cmp_int(l->offset, r->offset);
+}
+
+void bch2_btree_cache_prewarm(struct bch_fs *c)
+{
+	struct bch_sb_field_prewarm *p;
+	struct btree_prewarm_entry *e;
+	struct prewarm_read *r = NULL;
+	void *buf = NULL, *end;
+	size_t bytes = 0;
+	unsigned i, nr = 0;
+
+	mutex_lock(&c->sb_lock);
+	p = bch2_sb_get_prewarm(c->disk_sb.sb);
+	if (p) {
+		bytes = vstruct_bytes(&p->field);
+		buf = kmalloc(bytes, GFP_KERNEL);
+		if (buf)
+			memcpy(buf, p, bytes);
+	}
+	mutex_unlock(&c->sb_lock);
+
+	if (!buf)
+		return;
+
+	p = buf;
+	end = (void *) p + bytes;
+
+	for (e = p->start; (void *) e < end; e = prewarm_entry_next(e))
+		nr++;
+
+	r = kcalloc(nr, sizeof(*r), GFP_KERNEL);
+	if (!r)
+		goto out;
+
+	nr = 0;
+	for (e = p->start; (void *) e < end; e = prewarm_entry_next(e)) {
+		struct bkey_i *k = (struct bkey_i *) e->keys;
+		struct bkey_ptrs_c ptrs;
+		const struct bch_extent_ptr *ptr;
+		const struct bch_extent_ptr *first = NULL;
+		bool stale = false;
+
+		if (k->k.u64s != e->key_u64s ||
+		    bch2_bkey_invalid(c, bkey_i_to_s_c(k), BKEY_TYPE_BTREE))
+			continue;
+
+		ptrs = bch2_bkey_ptrs_c(bkey_i_to_s_c(k));
+		bkey_for_each_ptr(ptrs, ptr) {
+			if (!bch2_dev_exists2(c, ptr->dev) ||
+			    ptr_stale(bch_dev_bkey_exists(c, ptr->dev), ptr)) {
+				stale = true;
+				break;
+			}
+
+			if (!first)
+				first = ptr;
+		}
+
+		if (stale || !first)
+			continue;
+
+		r[nr++] = (struct prewarm_read) {
+			.dev		= first->dev,
+			.offset		= first->offset,
+			.btree_id	= e->btree_id,
+			.level		= e->level,
+			.k		= k,
+		};
+	}
+
+	sort(r, nr, sizeof(*r), prewarm_read_cmp, NULL);
+
+	for (i = 0; i < nr; i++) {
+		struct btree *b = bch2_btree_node_get_noiter(c, r[i].k,
+						r[i].btree_id, r[i].level);
+
+		if (!IS_ERR(b)) {
+			six_unlock_read(&b->c.lock);
+			continue;
+		}
+
+		/* out of memory for btree nodes - cache is as warm as it gets: */
+		if (PTR_ERR(b) == -ENOMEM)
+			break;
+	}
+
+	if (nr)
+		bch_verbose(c, "prewarmed %u btree nodes", nr);
+out:
+	kfree(r);
+	kfree(buf);
+}
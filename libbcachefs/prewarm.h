@@ -0,0 +1,10 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#ifndef _BCACHEFS_PREWARM_H
+#define _BCACHEFS_PREWARM_H
+
+void bch2_btree_cache_prewarm_save(struct bch_fs *);
+void bch2_btree_cache_prewarm(struct bch_fs *);
+
+extern const struct bch_sb_field_ops bch_sb_field_ops_prewarm;
+
+#endif /* _BCACHEFS_PREWARM_H */
@@ -218,6 +218,72 @@ static int bch2_quota_check_limit(struct bch_fs *c,
 	return 0;
 }
 
+/*
+ * Fold deltas accounted outside q->lock back into the authoritative
+ * counters; must be called with q->lock held before trusting ->v:
+ */
+static void quota_fold_buffered(struct bch_memquota *mq)
+{
+	unsigned i;
+
+	for (i = 0; i < Q_COUNTERS; i++)
+		mq->c[i].v += atomic64_xchg(&mq->c[i].buffered, 0);
+}
+
+/*
+ * The lockless fast path may only buffer a delta when every enabled qtype is
+ * at least this far from any configured limit: the margin has to cover both
+ * the staleness of our unlocked read of ->v and whatever other threads have
+ * buffered but not yet folded, so that limits enforced under q->lock can't be
+ * overshot by more than the margin we already required to be free:
+ */
+#define QUOTA_BUFFER_MARGIN	(1U << 16)
+
+static bool bch2_quota_acct_fast(struct bch_fs *c, struct bch_qid qid,
+				 enum quota_counters counter, s64 v,
+				 enum quota_acct_mode mode)
+{
+	unsigned qtypes = enabled_qtypes(c);
+	struct bch_memquota_type *q;
+	struct bch_memquota *mq[QTYP_NR];
+	unsigned i;
+
+	if (mode == KEY_TYPE_QUOTA_PREALLOC)
+		return false;
+
+	for_each_set_qtype(c, i, q, qtypes) {
+		struct memquota_counter *qc;
+		u64 n;
+
+		/*
+		 * Unlocked lookup: genradix entries are never freed while
+		 * the filesystem is in use, so this is safe - a miss (entry
+		 * not allocated yet) just takes the slow path:
+		 */
+		mq[i] = genradix_ptr(&q->table, qid.q[i]);
+		if (!mq[i])
+			return false;
+
+		qc = &mq[i]->c[counter];
+
+		/* warning state changes are handled under q->lock: */
+		if (qc->warning_issued || qc->timer)
+			return false;
+
+		n = qc->v + atomic64_read(&qc->buffered) + v +
+			QUOTA_BUFFER_MARGIN;
+
+		if ((qc->hardlimit && n >= qc->hardlimit) ||
+		    (qc->softlimit && n >= qc->softlimit))
+			return false;
+	}
+
+	for_each_set_qtype(c, i, q, qtypes)
+		atomic64_add(v, &mq[i]->c[counter].buffered);
+
+	return true;
+}
+
 int bch2_quota_acct(struct bch_fs *c, struct bch_qid qid,
 		    enum quota_counters counter, s64 v,
 		    enum quota_acct_mode mode)
@@ -229,6 +295,9 @@ int bch2_quota_acct(struct bch_fs *c, struct bch_qid qid,
 	unsigned i;
 	int ret = 0;
 
+	if (bch2_quota_acct_fast(c, qid, counter, v, mode))
+		return 0;
+
 	memset(&msgs, 0, sizeof(msgs));
 
 	for_each_set_qtype(c, i, q, qtypes)
@@ -241,6 +310,8 @@ int bch2_quota_acct(struct bch_fs *c, struct bch_qid qid,
 			goto err;
 		}
 
+		quota_fold_buffered(mq[i]);
+
 		ret = bch2_quota_check_limit(c, i, mq[i], &msgs, counter, v, mode);
 		if (ret)
 			goto err;
@@ -295,6 +366,9 @@ int bch2_quota_transfer(struct bch_fs *c, unsigned qtypes,
 			goto err;
 		}
 
+		quota_fold_buffered(src_q[i]);
+		quota_fold_buffered(dst_q[i]);
+
 		ret = bch2_quota_check_limit(c, i, dst_q[i], &msgs, Q_SPC,
 					     dst_q[i]->c[Q_SPC].v + space,
 					     mode);
@@ -653,6 +727,8 @@ static int bch2_quota_set_info(struct super_block *sb, int type,
 
 static void __bch2_quota_get(struct qc_dqblk *dst, struct bch_memquota *src)
 {
+	quota_fold_buffered(src);
+
 	dst->d_space		= src->c[Q_SPC].v << 9;
 	dst->d_spc_hardlimit	= src->c[Q_SPC].hardlimit << 9;
 	dst->d_spc_softlimit	= src->c[Q_SPC].softlimit << 9;
@@ -16,6 +16,11 @@ enum quota_acct_mode {
 
 struct memquota_counter {
 	u64				v;
+	/*
+	 * Deltas accounted outside q->lock, by bch2_quota_acct()'s fast
+	 * path; folded into @v whenever the lock is taken:
+	 */
+	atomic64_t			buffered;
 	u64				hardlimit;
 	u64				softlimit;
 	s64				timer;
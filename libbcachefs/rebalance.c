@@ -9,6 +9,7 @@
 #include "extents.h"
 #include "io.h"
 #include "move.h"
+#include "movinggc.h"
 #include "rebalance.h"
 #include "super-io.h"
 
@@ -17,6 +18,8 @@
 #include <linux/sched/cputime.h>
 #include <trace/events/bcachefs.h>
 
+#define REBALANCE_WORK_QUEUE_NR		512
+
 /*
  * Check if an extent should be moved:
  * returns -1 if it should not be moved, or
@@ -47,6 +50,38 @@ static int __bch2_rebalance_pred(struct bch_fs *c,
 	return -1;
 }
 
+static void rebalance_work_queue_add(struct bch_fs *c, struct bkey_s_c k)
+{
+	struct bch_fs_rebalance *r = &c->rebalance;
+	struct rebalance_work_range n = {
+		.start	= bkey_start_pos(k.k),
+		.end	= k.k->p,
+	};
+
+	spin_lock(&r->work_queue_lock);
+
+	if (!fifo_empty(&r->work_queue)) {
+		struct rebalance_work_range *last =
+			&fifo_peek_back(&r->work_queue);
+
+		/* writes are mostly sequential - merge adjacent ranges: */
+		if (bkey_cmp(n.start, last->end) <= 0) {
+			if (bkey_cmp(n.end, last->end) > 0)
+				last->end = n.end;
+			if (bkey_cmp(n.start, last->start) < 0)
+				last->start = n.start;
+			goto out;
+		}
+	}
+
+	if (fifo_full(&r->work_queue))
+		r->work_queue_overflow = true;
+	else
+		fifo_push(&r->work_queue, n);
+out:
+	spin_unlock(&r->work_queue_lock);
+}
+
 void bch2_rebalance_add_key(struct bch_fs *c,
 			    struct bkey_s_c k,
 			    struct bch_io_opts *io_opts)
@@ -58,6 +93,8 @@ void bch2_rebalance_add_key(struct bch_fs *c,
 	if (dev < 0)
 		return;
 
+	rebalance_work_queue_add(c, k);
+
 	counter = dev < INT_MAX
 		? &bch_dev_bkey_exists(c, dev)->rebalance_work
 		: &c->rebalance.work_unknown_dev;
@@ -72,6 +109,14 @@ static enum data_cmd rebalance_pred(struct bch_fs *c, void *arg,
 				    struct data_opts *data_opts)
 {
 	if (__bch2_rebalance_pred(c, k, io_opts) >= 0) {
+		/*
+		 * Copygc is about to evacuate this extent's bucket, and its
+		 * move will apply the background target and compression
+		 * options - don't move the same data twice:
+		 */
+		if (bch2_copygc_will_move(c, k))
+			return DATA_SKIP;
+
 		data_opts->target		= io_opts->background_target;
 		data_opts->btree_insert_flags	= 0;
 		return DATA_ADD_REPLICAS;
@@ -82,6 +127,13 @@ static enum data_cmd rebalance_pred(struct bch_fs *c, void *arg,
 
 void bch2_rebalance_add_work(struct bch_fs *c, u64 sectors)
 {
+	struct bch_fs_rebalance *r = &c->rebalance;
+
+	/* work we can't attribute to a key range - have to scan everything: */
+	spin_lock(&r->work_queue_lock);
+	r->work_queue_overflow = true;
+	spin_unlock(&r->work_queue_lock);
+
 	if (atomic64_add_return(sectors, &c->rebalance.work_unknown_dev) ==
 	    sectors)
 		rebalance_wakeup(c);
@@ -151,6 +203,76 @@ static void rebalance_work_reset(struct bch_fs *c)
 	atomic64_set(&c->rebalance.work_unknown_dev, 0);
 }
 
+/*
+ * Move just the key ranges the write path flagged, falling back to a full
+ * scan if the queue overflowed or work was added that couldn't be attributed
+ * to a range:
+ */
+static void rebalance_run_queue(struct bch_fs *c)
+{
+	struct bch_fs_rebalance *r = &c->rebalance;
+	struct rebalance_work_range range;
+	bool overflow, nonempty;
+
+	spin_lock(&r->work_queue_lock);
+	overflow = r->work_queue_overflow;
+	r->work_queue_overflow = false;
+	if (overflow)
+		r->work_queue.front = r->work_queue.back;
+	spin_unlock(&r->work_queue_lock);
+
+	if (overflow) {
+		bch2_move_data(c, &r->pd.rate,
+			       writepoint_ptr(&c->rebalance_write_point),
+			       POS_MIN, POS_MAX,
+			       rebalance_pred, NULL,
+			       &r->move_stats);
+		return;
+	}
+
+	while (1) {
+		spin_lock(&r->work_queue_lock);
+		nonempty = fifo_pop(&r->work_queue, range);
+		spin_unlock(&r->work_queue_lock);
+
+		if (!nonempty)
+			break;
+
+		bch2_move_data(c, &r->pd.rate,
+			       writepoint_ptr(&c->rebalance_write_point),
+			       range.start, range.end,
+			       rebalance_pred, NULL,
+			       &r->move_stats);
+	}
+}
+
+/*
+ * Foreground latency feedback: if reads are currently taking much longer than
+ * they normally do, background work is likely what's getting in the way - shed
+ * bandwidth until latency recovers. The baseline is a slow moving average of
+ * the worst device's read latency, so a sustained change in workload
+ * eventually becomes the new normal instead of throttling us forever:
+ */
+static bool rebalance_latency_shed(struct bch_fs *c)
+{
+	struct bch_fs_rebalance *r = &c->rebalance;
+	struct bch_dev *ca;
+	u64 lat = 0;
+	unsigned i;
+
+	for_each_rw_member(ca, c, i)
+		lat = max(lat, ca->io_latency[READ].average_duration);
+
+	if (!lat)
+		return false;
+
+	r->read_lat_baseline = r->read_lat_baseline
+		? ewma_add(r->read_lat_baseline, lat, 6)
+		: lat;
+
+	return lat > r->read_lat_baseline * 2;
+}
+
 static unsigned long curr_cputime(void)
 {
 	u64 utime, stime;
@@ -228,6 +350,10 @@ static int bch2_rebalance_thread(void *arg)
 			      max(p.dev_most_full_percent, 1U) /
 			      max(w.dev_most_full_percent, 1U));
 
+		if (rebalance_latency_shed(c))
+			r->pd.rate.rate = max_t(u64, 1 << 11,
+						r->pd.rate.rate / 2);
+
 		io_start	= atomic_long_read(&clock->now);
 		p		= w;
 		prev_start	= start;
@@ -237,13 +363,7 @@ static int bch2_rebalance_thread(void *arg)
 		memset(&r->move_stats, 0, sizeof(r->move_stats));
 		rebalance_work_reset(c);
 
-		bch2_move_data(c,
-			       /* ratelimiting disabled for now */
-			       NULL, /*  &r->pd.rate, */
-			       writepoint_ptr(&c->rebalance_write_point),
-			       POS_MIN, POS_MAX,
-			       rebalance_pred, NULL,
-			       &r->move_stats);
+		rebalance_run_queue(c);
 	}
 
 	return 0;
@@ -328,4 +448,13 @@ void bch2_fs_rebalance_init(struct bch_fs *c)
 	bch2_pd_controller_init(&c->rebalance.pd);
 
 	atomic64_set(&c->rebalance.work_unknown_dev, S64_MAX);
+
+	spin_lock_init(&c->rebalance.work_queue_lock);
+	if (!init_fifo(&c->rebalance.work_queue,
+		       REBALANCE_WORK_QUEUE_NR, GFP_KERNEL))
+		c->rebalance.work_queue.size =
+			c->rebalance.work_queue.mask = 0;
+
+	/* everything written before we were running is unaccounted for: */
+	c->rebalance.work_queue_overflow = true;
 }
@@ -2,8 +2,18 @@
 #ifndef _BCACHEFS_REBALANCE_TYPES_H
 #define _BCACHEFS_REBALANCE_TYPES_H
 
+#include "fifo.h"
 #include "move_types.h"
 
+/*
+ * Range of keys known to contain extents violating background_target or
+ * background_compression, recorded at write time:
+ */
+struct rebalance_work_range {
+	struct bpos		start;
+	struct bpos		end;
+};
+
 enum rebalance_state {
 	REBALANCE_WAITING,
 	REBALANCE_THROTTLED,
@@ -16,6 +26,22 @@ struct bch_fs_rebalance {
 
 	atomic64_t		work_unknown_dev;
 
+	/*
+	 * Queue of dirty key ranges, so the thread can scan just the regions
+	 * with work to do; when it overflows (or work is added that we can't
+	 * attribute to a range) we fall back to scanning everything:
+	 */
+	spinlock_t		work_queue_lock;
+	DECLARE_FIFO(struct rebalance_work_range, work_queue);
+	bool			work_queue_overflow;
+
+	/*
+	 * Slow moving baseline of the worst device's average read latency, for
+	 * detecting when background work is getting in the way of foreground
+	 * reads:
+	 */
+	u64			read_lat_baseline;
+
 	enum rebalance_state	state;
 	unsigned long		throttled_until_iotime;
 	unsigned long		throttled_until_cputime;
@@ -3,6 +3,7 @@
 #include "bcachefs.h"
 #include "alloc_background.h"
 #include "btree_gc.h"
+#include "btree_cache.h"
 #include "btree_update.h"
 #include "btree_update_interior.h"
 #include "btree_io.h"
@@ -263,6 +264,121 @@ int bch2_btree_and_journal_walk(struct bch_fs *c, struct journal_keys *journal_k
 	return ret;
 }
 
+struct btree_and_journal_walk_work {
+	struct work_struct	work;
+	struct bch_fs		*c;
+	struct journal_keys	*journal_keys;
+	enum btree_id		btree_id;
+	btree_walk_node_fn	node_fn;
+	btree_walk_key_fn	key_fn;
+	BKEY_PADDED(key);
+	unsigned		level;
+	int			ret;
+};
+
+static void bch2_btree_and_journal_walk_work(struct work_struct *work)
+{
+	struct btree_and_journal_walk_work *w =
+		container_of(work, struct btree_and_journal_walk_work, work);
+	struct bch_fs *c = w->c;
+	struct btree *b =
+		bch2_btree_node_get_noiter(c, &w->key, w->btree_id, w->level);
+
+	if (IS_ERR(b)) {
+		w->ret = PTR_ERR(b);
+		return;
+	}
+
+	w->ret = (w->node_fn ? w->node_fn(c, b) : 0) ?:
+		bch2_btree_and_journal_walk_recurse(c, b, w->journal_keys,
+					w->btree_id, w->node_fn, w->key_fn);
+	six_unlock_read(&b->c.lock);
+}
+
+/*
+ * Variant of bch2_btree_and_journal_walk() that dispatches the subtree under
+ * each child of the root to a worker, for walks whose key_fn is safe to run
+ * concurrently (the alloc read only does atomic updates to disjoint buckets).
+ * Iteration order is preserved within a subtree; subtrees complete in no
+ * particular order:
+ */
+int bch2_btree_and_journal_walk_parallel(struct bch_fs *c,
+				struct journal_keys *journal_keys,
+				enum btree_id btree_id,
+				btree_walk_node_fn node_fn,
+				btree_walk_key_fn key_fn)
+{
+	struct btree *b = c->btree_roots[btree_id].b;
+	struct btree_and_journal_iter iter;
+	struct btree_and_journal_walk_work *w;
+	unsigned nr_children = 0, nr_queued = 0, i;
+	struct bkey_s_c k;
+	int ret = 0;
+
+	if (btree_node_fake(b))
+		return 0;
+
+	if (!b->c.level)
+		return bch2_btree_and_journal_walk(c, journal_keys, btree_id,
+						   node_fn, key_fn);
+
+	six_lock_read(&b->c.lock, NULL, NULL);
+
+	ret = node_fn ? node_fn(c, b) : 0;
+	if (ret)
+		goto unlock;
+
+	bch2_btree_and_journal_iter_init_node_iter(&iter, journal_keys, b);
+	while ((k = bch2_btree_and_journal_iter_peek(&iter)).k) {
+		nr_children++;
+		bch2_btree_and_journal_iter_advance(&iter);
+	}
+
+	w = kcalloc(nr_children, sizeof(*w), GFP_KERNEL);
+	if (!w) {
+		ret = -ENOMEM;
+		goto unlock;
+	}
+
+	bch2_btree_and_journal_iter_init_node_iter(&iter, journal_keys, b);
+	while (nr_queued < nr_children &&
+	       (k = bch2_btree_and_journal_iter_peek(&iter)).k) {
+		struct btree_and_journal_walk_work *t = w + nr_queued;
+
+		ret = key_fn(c, btree_id, b->c.level, k);
+		if (ret)
+			break;
+
+		t->c		= c;
+		t->journal_keys	= journal_keys;
+		t->btree_id	= btree_id;
+		t->node_fn	= node_fn;
+		t->key_fn	= key_fn;
+		t->level	= b->c.level - 1;
+		bkey_reassemble(&t->key, k);
+
+		INIT_WORK(&t->work, bch2_btree_and_journal_walk_work);
+		queue_work(system_unbound_wq, &t->work);
+		nr_queued++;
+
+		bch2_btree_and_journal_iter_advance(&iter);
+	}
+
+	for (i = 0; i < nr_queued; i++) {
+		flush_work(&w[i].work);
+		ret = ret ?: w[i].ret;
+	}
+
+	if (!ret)
+		ret = key_fn(c, btree_id, b->c.level + 1,
+			     bkey_i_to_s_c(&b->key));
+
+	kfree(w);
+unlock:
+	six_unlock_read(&b->c.lock);
+	return ret;
+}
+
 /* sort and dedup all keys in the journal: */
 
 void bch2_journal_entries_free(struct list_head *list)
@@ -514,6 +630,49 @@ static int bch2_journal_replay_key(struct bch_fs *c, enum btree_id id,
 			     __bch2_journal_replay_key(&trans, id, level, k));
 }
 
+/*
+ * Replaying one key per transaction means a full traversal from the root per
+ * key; batching consecutive leaf keys into one transaction lets the second
+ * and later iterators reuse the first one's path and locks, and costs one
+ * commit per batch:
+ */
+#define JOURNAL_REPLAY_BATCH	8
+
+static int __bch2_journal_replay_batch(struct btree_trans *trans,
+				       struct journal_key **batch,
+				       unsigned nr)
+{
+	unsigned i;
+	int ret = 0;
+
+	for (i = 0; i < nr && !ret; i++)
+		ret = __bch2_journal_replay_key(trans, batch[i]->btree_id,
+						batch[i]->level, batch[i]->k);
+	return ret;
+}
+
+static int journal_replay_batch_flush(struct bch_fs *c,
+				      struct journal_keys *keys,
+				      struct journal_key **batch,
+				      unsigned *nr)
+{
+	int ret;
+
+	if (!*nr)
+		return 0;
+
+	replay_now_at(&c->journal, keys->journal_seq_base +
+		      batch[*nr - 1]->journal_seq);
+
+	ret = bch2_trans_do(c, NULL, NULL,
+			    BTREE_INSERT_NOFAIL|
+			    BTREE_INSERT_LAZY_RW|
+			    BTREE_INSERT_JOURNAL_REPLAY,
+			    __bch2_journal_replay_batch(&trans, batch, *nr));
+	*nr = 0;
+	return ret;
+}
+
 static int __bch2_alloc_replay_key(struct btree_trans *trans, struct bkey_i *k)
 {
 	struct btree_iter *iter;
@@ -539,6 +698,68 @@ static int bch2_alloc_replay_key(struct bch_fs *c, struct bkey_i *k)
 			__bch2_alloc_replay_key(&trans, k));
 }
 
+/*
+ * Issue reads for all the leaf nodes replay will touch before replaying
+ * anything, so replay is CPU bound instead of latency bound on cold
+ * metadata. Purely an optimization: errors here are ignored, they'll
+ * surface during the actual replay:
+ */
+static void bch2_journal_replay_prefetch(struct bch_fs *c,
+					 struct journal_keys *keys)
+{
+	struct btree_trans trans;
+	struct journal_key *i;
+	enum btree_id prev_btree = BTREE_ID_NR;
+	struct bpos prev_max = POS_MIN;
+
+	bch2_trans_init(&trans, c, 0, 0);
+
+	for_each_journal_key(*keys, i) {
+		struct btree_iter *iter;
+		struct btree_root *r = &c->btree_roots[i->btree_id];
+		struct btree_node_iter node_iter;
+		struct bkey_packed *k;
+		struct btree *b;
+		BKEY_PADDED(k) tmp;
+
+		if (i->level || i->btree_id == BTREE_ID_ALLOC)
+			continue;
+
+		/* Root is a leaf - nothing to prefetch: */
+		if (!r->b || !r->b->c.level)
+			continue;
+
+		/* Already covered by the last leaf we prefetched? */
+		if (i->btree_id == prev_btree &&
+		    bkey_cmp(i->k->k.p, prev_max) <= 0)
+			continue;
+
+		iter = bch2_trans_get_node_iter(&trans, i->btree_id,
+						i->k->k.p, 0, 1, 0);
+		if (IS_ERR(iter))
+			break;
+
+		if (!bch2_btree_iter_traverse(iter)) {
+			b = iter->l[1].b;
+			node_iter = iter->l[1].iter;
+
+			k = bch2_btree_node_iter_peek(&node_iter, b);
+			if (k) {
+				bch2_bkey_unpack(b, &tmp.k, k);
+				bch2_btree_node_prefetch(c, iter, &tmp.k, 0);
+
+				prev_btree	= i->btree_id;
+				prev_max	= tmp.k.k.p;
+			}
+		}
+
+		bch2_trans_iter_put(&trans, iter);
+		bch2_trans_cond_resched(&trans);
+	}
+
+	bch2_trans_exit(&trans);
+}
+
 static int journal_sort_seq_cmp(const void *_l, const void *_r)
 {
 	const struct journal_key *l = _l;
@@ -555,9 +776,15 @@ static int bch2_journal_replay(struct bch_fs *c,
 {
 	struct journal *j = &c->journal;
 	struct journal_key *i;
+	struct journal_key *replay_batch[JOURNAL_REPLAY_BATCH];
+	unsigned replay_batch_nr = 0;
 	u64 seq;
 	int ret;
 
+	/* keys are still sorted by (btree_id, pos) here, which gives the
+	 * prefetch pass locality in the interior nodes: */
+	bch2_journal_replay_prefetch(c, &keys);
+
 	sort(keys.d, keys.nr, sizeof(keys.d[0]), journal_sort_seq_cmp, NULL);
 
 	if (keys.nr)
@@ -608,20 +835,56 @@ static int bch2_journal_replay(struct bch_fs *c,
 	 * Now replay leaf node updates:
 	 */
 	for_each_journal_key(keys, i) {
+		unsigned b;
+		bool flush;
+
 		cond_resched();
 
 		if (i->level || i->btree_id == BTREE_ID_ALLOC)
 			continue;
 
-		replay_now_at(j, keys.journal_seq_base + i->journal_seq);
+		if (i->k->k.size) {
+			/*
+			 * Extents have their own replay path; flush first so
+			 * updates to overlapping positions stay ordered by
+			 * journal seq:
+			 */
+			ret = journal_replay_batch_flush(c, &keys,
+						replay_batch, &replay_batch_nr);
+			if (ret)
+				goto err;
 
-		ret = i->k->k.size
-			? bch2_extent_replay_key(c, i->btree_id, i->k)
-			: bch2_journal_replay_key(c, i->btree_id, i->level, i->k);
-		if (ret)
-			goto err;
+			replay_now_at(j, keys.journal_seq_base + i->journal_seq);
+
+			ret = bch2_extent_replay_key(c, i->btree_id, i->k);
+			if (ret)
+				goto err;
+			continue;
+		}
+
+		/*
+		 * A second update to the same position must not land in the
+		 * same transaction:
+		 */
+		flush = replay_batch_nr == JOURNAL_REPLAY_BATCH;
+		for (b = 0; b < replay_batch_nr && !flush; b++)
+			flush = replay_batch[b]->btree_id == i->btree_id &&
+				!bkey_cmp(replay_batch[b]->k->k.p, i->k->k.p);
+
+		if (flush) {
+			ret = journal_replay_batch_flush(c, &keys,
+						replay_batch, &replay_batch_nr);
+			if (ret)
+				goto err;
+		}
+
+		replay_batch[replay_batch_nr++] = i;
 	}
 
+	ret = journal_replay_batch_flush(c, &keys, replay_batch, &replay_batch_nr);
+	if (ret)
+		goto err;
+
 	replay_now_at(j, j->replay_journal_seq_end);
 	j->replay_journal_seq = 0;
 
@@ -1064,6 +1327,16 @@ int bch2_fs_recovery(struct bch_fs *c)
 	if (ret)
 		goto err;
 
+	/*
+	 * Inspection tools don't need allocation info or bucket marks: no
+	 * writes will be issued and the allocator never runs. Leaving
+	 * BCH_FS_ALLOC_READ_DONE and BCH_FS_INITIAL_GC_DONE unset also
+	 * disables the bucket gen consistency checks that would look at marks
+	 * we didn't read:
+	 */
+	if (c->opts.inspect)
+		goto out;
+
 	bch_verbose(c, "starting alloc read");
 	err = "error reading allocation information";
 	ret = bch2_alloc_read(c, &c->journal_keys);
@@ -1145,7 +1418,7 @@ int bch2_fs_recovery(struct bch_fs *c)
 		set_bit(BCH_FS_ALLOC_WRITTEN, &c->flags);
 	}
 
-	if (!c->sb.clean) {
+	if (!c->sb.clean && !c->opts.fsck_accounting_only) {
 		if (!(c->sb.features & (1 << BCH_FEATURE_atomic_nlink))) {
 			bch_info(c, "checking inode link counts");
 			err = "error in recovery";
@@ -1164,7 +1437,7 @@ int bch2_fs_recovery(struct bch_fs *c)
 		}
 	}
 
-	if (c->opts.fsck) {
+	if (c->opts.fsck && !c->opts.fsck_accounting_only) {
 		bch_info(c, "starting fsck");
 		err = "error in fsck";
 		ret = bch2_fsck_full(c);
@@ -1252,6 +1525,12 @@ int bch2_fs_initialize(struct bch_fs *c)
 		le16_to_cpu(bcachefs_metadata_version_current);
 	c->disk_sb.sb->features[0] |= 1ULL << BCH_FEATURE_atomic_nlink;
 	c->disk_sb.sb->features[0] |= BCH_SB_FEATURES_ALL;
+	/*
+	 * Backrefs are only complete - and thus usable for device evacuation -
+	 * if they've been maintained from the start, so the feature is only
+	 * set on fresh filesystems, never on upgrade:
+	 */
+	c->disk_sb.sb->features[0] |= 1ULL << BCH_FEATURE_backrefs;
 
 	bch2_write_super(c);
 	mutex_unlock(&c->sb_lock);
@@ -1301,7 +1580,7 @@ int bch2_fs_initialize(struct bch_fs *c)
 				  &root_inode, &lostfound_inode,
 				  &lostfound,
 				  0, 0, S_IFDIR|0700, 0,
-				  NULL, NULL));
+				  NULL, NULL, NULL, NULL));
 	if (ret)
 		goto err;
 
@@ -152,6 +152,13 @@ static struct bkey_s_c get_next_src(struct btree_iter *iter, struct bpos end)
 	return k;
 }
 
+/*
+ * Max src extents to remap per transaction commit - bounds the size of the
+ * transaction (two updates per indirect extent created, plus the dst extent
+ * and inode updates) and thus its journal reservation:
+ */
+#define REMAP_EXTENTS_MAX	8
+
 s64 bch2_remap_range(struct bch_fs *c,
 		     struct bpos dst_start, struct bpos src_start,
 		     u64 remap_sectors, u64 *journal_seq,
@@ -165,6 +172,7 @@ s64 bch2_remap_range(struct bch_fs *c,
 	struct bpos dst_end = dst_start, src_end = src_start;
 	struct bpos dst_want, src_want;
 	u64 src_done, dst_done;
+	unsigned batch;
 	int ret = 0, ret2 = 0;
 
 	if (!c->opts.reflink)
@@ -253,6 +261,78 @@ s64 bch2_remap_range(struct bch_fs *c,
 				min(src_k.k->p.offset - src_iter->pos.offset,
 				    dst_end.offset - dst_iter->pos.offset));
 
+		/*
+		 * Batching: indirect extents are allocated sequentially (via
+		 * c->reflink_hint), so a run of adjacent src extents usually
+		 * maps to one contiguous range of the reflink btree - which
+		 * means we can make several src extents indirect in this
+		 * transaction and cover them all with a single dst key and a
+		 * single commit, instead of one commit per src extent.
+		 *
+		 * If a later extent in the run turns out not to be contiguous
+		 * with the dst key we've built, its (pending) indirect
+		 * conversion still commits with this transaction - the next
+		 * pass over that range just sees it as a reflink_p. Same
+		 * story if bch2_extent_update() trims our dst key to an
+		 * atomic boundary: dst only advances as far as the commit
+		 * did, and src position is recomputed from dst position, so
+		 * nothing is skipped:
+		 */
+		for (batch = 1; batch < REMAP_EXTENTS_MAX; batch++) {
+			struct bpos src_next = POS(src_start.inode,
+				bkey_start_offset(&new_dst.k.k) -
+				dst_start.offset + src_start.offset +
+				new_dst.k.k.size);
+			u64 offset;
+
+			if (new_dst.k.k.p.offset >= dst_end.offset ||
+			    src_next.offset >= src_end.offset ||
+			    new_dst.k.k.size >= KEY_SIZE_MAX / 2)
+				break;
+
+			bch2_btree_iter_set_pos(src_iter, src_next);
+
+			src_k = get_next_src(src_iter, src_end);
+			ret = bkey_err(src_k);
+			if (ret)
+				goto btree_err;
+
+			/* end of src, or a hole - needs an fpunch: */
+			if (!src_k.k ||
+			    bkey_cmp(bkey_start_pos(src_k.k), src_next) > 0)
+				break;
+
+			if (src_k.k->type == KEY_TYPE_extent) {
+				bkey_on_stack_reassemble(&new_src, c, src_k);
+				src_k = bkey_i_to_s_c(new_src.k);
+
+				bch2_cut_front(src_iter->pos,	new_src.k);
+				bch2_cut_back(src_end,		new_src.k);
+
+				ret = bch2_make_extent_indirect(&trans, src_iter,
+						bkey_i_to_extent(new_src.k));
+				if (ret)
+					goto btree_err;
+			}
+
+			if (src_k.k->type != KEY_TYPE_reflink_p)
+				break;
+
+			offset = le64_to_cpu(bkey_s_c_to_reflink_p(src_k).v->idx) +
+				(src_iter->pos.offset -
+				 bkey_start_offset(src_k.k));
+
+			if (offset !=
+			    le64_to_cpu(bkey_i_to_reflink_p(&new_dst.k)->v.idx) +
+			    new_dst.k.k.size)
+				break;
+
+			bch2_key_resize(&new_dst.k.k,
+				new_dst.k.k.size +
+				min(src_k.k->p.offset - src_iter->pos.offset,
+				    dst_end.offset - new_dst.k.k.p.offset));
+		}
+
 		ret = bch2_extent_update(&trans, dst_iter, &new_dst.k,
 					 NULL, journal_seq,
 					 new_i_size, i_sectors_delta);
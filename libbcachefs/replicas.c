@@ -185,18 +185,31 @@ static inline int __replicas_entry_idx(struct bch_replicas_cpu *r,
 				       struct bch_replicas_entry *search)
 {
 	int idx, entry_size = replicas_entry_bytes(search);
+	unsigned cached = READ_ONCE(r->last_idx);
 
 	if (unlikely(entry_size > r->entry_size))
 		return -1;
 
 	verify_replicas_entry(search);
 
+	/*
+	 * Marking extents hits the same few entries over and over - check the
+	 * last entry we found before doing a full search:
+	 */
+	if (cached < r->nr &&
+	    !memcmp(cpu_replicas_entry(r, cached), search, entry_size))
+		return cached;
+
 #define entry_cmp(_l, _r, size)	memcmp(_l, _r, entry_size)
 	idx = eytzinger0_find(r->entries, r->nr, r->entry_size,
 			      entry_cmp, search);
 #undef entry_cmp
 
-	return idx < r->nr ? idx : -1;
+	if (idx >= r->nr)
+		return -1;
+
+	WRITE_ONCE(r->last_idx, idx);
+	return idx;
 }
 
 int bch2_replicas_entry_idx(struct bch_fs *c,
@@ -283,14 +296,19 @@ static int replicas_table_update(struct bch_fs *c,
 		sizeof(u64) * new_r->nr;
 	int ret = -ENOMEM;
 
+	/*
+	 * Cacheline align the percpu counters, so that different cpus' copies
+	 * don't share lines with each other or with whatever the percpu
+	 * allocator places next to them:
+	 */
 	if (!(new_base = kzalloc(bytes, GFP_NOIO)) ||
-	    !(new_usage[0] = __alloc_percpu_gfp(bytes, sizeof(u64),
+	    !(new_usage[0] = __alloc_percpu_gfp(bytes, SMP_CACHE_BYTES,
 						GFP_NOIO)) ||
-	    !(new_usage[1] = __alloc_percpu_gfp(bytes, sizeof(u64),
+	    !(new_usage[1] = __alloc_percpu_gfp(bytes, SMP_CACHE_BYTES,
 						GFP_NOIO)) ||
 	    !(new_scratch  = kmalloc(bytes, GFP_NOIO)) ||
 	    (c->usage_gc &&
-	     !(new_gc = __alloc_percpu_gfp(bytes, sizeof(u64), GFP_NOIO)))) {
+	     !(new_gc = __alloc_percpu_gfp(bytes, SMP_CACHE_BYTES, GFP_NOIO)))) {
 		bch_err(c, "error updating replicas table: memory allocation failure");
 		goto err;
 	}
@@ -314,6 +332,9 @@ static int replicas_table_update(struct bch_fs *c,
 	swap(c->usage_scratch,	new_scratch);
 	swap(c->usage_gc,	new_gc);
 	swap(c->replicas,	*new_r);
+
+	/* cached scratch buffers are now the wrong size: */
+	bch2_fs_usage_scratch_cache_clear(c);
 	ret = 0;
 err:
 	free_percpu(new_gc);
@@ -391,10 +412,35 @@ static int bch2_mark_replicas_slowpath(struct bch_fs *c,
 
 	/* allocations done, now commit: */
 
-	if (new_r.entries)
+	/*
+	 * We've updated the superblock's replicas section in memory, so any
+	 * superblock write from here on persists the new entry - but we don't
+	 * need to force one synchronously:
+	 *
+	 * Once the journal is running, every journal write embeds the full
+	 * replicas set as BCH_JSET_ENTRY_data_usage entries (via
+	 * bch2_journal_super_entries_add_common()), and journal_replay_early()
+	 * adds missing entries back to c->replicas before anything uses them -
+	 * so the first journal write containing keys that reference the new
+	 * entry also makes it persistent, and the superblock gets compacted at
+	 * the next natural superblock write (clean shutdown at the latest, via
+	 * bch2_fs_mark_clean()).
+	 *
+	 * Journal replicas entries are the exception: the journal read path
+	 * checks them against the superblock before replay, when c->replicas
+	 * hasn't been filled in from the journal yet - those still get flushed
+	 * synchronously, but they only change on device add/remove.
+	 */
+	if (new_r.entries &&
+	    (new_entry->data_type == BCH_DATA_journal ||
+	     !test_bit(JOURNAL_STARTED, &c->journal.flags)))
 		bch2_write_super(c);
 
-	/* don't update in memory replicas until changes are persistent */
+	/*
+	 * Update in memory replicas - from here on journal writes will embed
+	 * the new entry, making it persistent no later than the first journal
+	 * write containing keys that reference it:
+	 */
 	percpu_down_write(&c->mark_lock);
 	if (new_r.entries)
 		ret = replicas_table_update(c, &new_r);
@@ -715,7 +761,7 @@ int bch2_sb_replicas_to_cpu_replicas(struct bch_fs *c)
 {
 	struct bch_sb_field_replicas *sb_v1;
 	struct bch_sb_field_replicas_v0 *sb_v0;
-	struct bch_replicas_cpu new_r = { 0, 0, NULL };
+	struct bch_replicas_cpu new_r = { 0, 0, 0, NULL };
 	int ret = 0;
 
 	if ((sb_v1 = bch2_sb_get_replicas(c->disk_sb.sb)))
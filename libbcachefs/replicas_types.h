@@ -4,6 +4,7 @@
 struct bch_replicas_cpu {
 	unsigned		nr;
 	unsigned		entry_size;
+	unsigned		last_idx;
 	struct bch_replicas_entry *entries;
 };
 
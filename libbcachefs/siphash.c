@@ -51,29 +51,34 @@
 
 #include "siphash.h"
 
-static void SipHash_Rounds(SIPHASH_CTX *ctx, int rounds)
+static inline void SipHash_RawRounds(u64 v[4], int rounds)
 {
 	while (rounds--) {
-		ctx->v[0] += ctx->v[1];
-		ctx->v[2] += ctx->v[3];
-		ctx->v[1] = rol64(ctx->v[1], 13);
-		ctx->v[3] = rol64(ctx->v[3], 16);
-
-		ctx->v[1] ^= ctx->v[0];
-		ctx->v[3] ^= ctx->v[2];
-		ctx->v[0] = rol64(ctx->v[0], 32);
-
-		ctx->v[2] += ctx->v[1];
-		ctx->v[0] += ctx->v[3];
-		ctx->v[1] = rol64(ctx->v[1], 17);
-		ctx->v[3] = rol64(ctx->v[3], 21);
-
-		ctx->v[1] ^= ctx->v[2];
-		ctx->v[3] ^= ctx->v[0];
-		ctx->v[2] = rol64(ctx->v[2], 32);
+		v[0] += v[1];
+		v[2] += v[3];
+		v[1] = rol64(v[1], 13);
+		v[3] = rol64(v[3], 16);
+
+		v[1] ^= v[0];
+		v[3] ^= v[2];
+		v[0] = rol64(v[0], 32);
+
+		v[2] += v[1];
+		v[0] += v[3];
+		v[1] = rol64(v[1], 17);
+		v[3] = rol64(v[3], 21);
+
+		v[1] ^= v[2];
+		v[3] ^= v[0];
+		v[2] = rol64(v[2], 32);
 	}
 }
 
+static void SipHash_Rounds(SIPHASH_CTX *ctx, int rounds)
+{
+	SipHash_RawRounds(ctx->v, rounds);
+}
+
 static void SipHash_CRounds(SIPHASH_CTX *ctx, const void *ptr, int rounds)
 {
 	u64 m = get_unaligned_le64(ptr);
@@ -171,3 +176,59 @@ u64 SipHash(const SIPHASH_KEY *key, int rc, int rf, const void *src, size_t len)
 	SipHash_Update(&ctx, rc, rf, src, len);
 	return SipHash_End(&ctx, rc, rf);
 }
+
+/*
+ * Key setup is identical for every message hashed with the same key; when a
+ * caller will hash many messages (one per dirent lookup, say) it can derive
+ * the initial state once and hash each message with SipHash_FromState():
+ */
+void SipHash_State(const SIPHASH_KEY *key, u64 state[4])
+{
+	u64 k0, k1;
+
+	k0 = le64_to_cpu(key->k0);
+	k1 = le64_to_cpu(key->k1);
+
+	state[0] = 0x736f6d6570736575ULL ^ k0;
+	state[1] = 0x646f72616e646f6dULL ^ k1;
+	state[2] = 0x6c7967656e657261ULL ^ k0;
+	state[3] = 0x7465646279746573ULL ^ k1;
+}
+
+/*
+ * One shot hash of a contiguous buffer from a precomputed initial state: no
+ * streaming context, so no block buffer copies or context wiping - just one
+ * compression round per 8 bytes of input:
+ */
+u64 SipHash_FromState(const u64 state[4], int rc, int rf,
+		      const void *src, size_t len)
+{
+	u64 v[4] = { state[0], state[1], state[2], state[3] };
+	const u8 *ptr = src;
+	size_t left = len;
+	u8 buf[SIPHASH_BLOCK_LENGTH] = { 0 };
+	u64 m;
+
+	while (left >= SIPHASH_BLOCK_LENGTH) {
+		m = get_unaligned_le64(ptr);
+		v[3] ^= m;
+		SipHash_RawRounds(v, rc);
+		v[0] ^= m;
+
+		ptr	+= SIPHASH_BLOCK_LENGTH;
+		left	-= SIPHASH_BLOCK_LENGTH;
+	}
+
+	memcpy(buf, ptr, left);
+	buf[7] = len;
+
+	m = get_unaligned_le64(buf);
+	v[3] ^= m;
+	SipHash_RawRounds(v, rc);
+	v[0] ^= m;
+
+	v[2] ^= 0xff;
+	SipHash_RawRounds(v, rf);
+
+	return (v[0] ^ v[1]) ^ (v[2] ^ v[3]);
+}
@@ -71,12 +71,16 @@ void	SipHash_Update(SIPHASH_CTX *, int, int, const void *, size_t);
 u64	SipHash_End(SIPHASH_CTX *, int, int);
 void	SipHash_Final(void *, SIPHASH_CTX *, int, int);
 u64	SipHash(const SIPHASH_KEY *, int, int, const void *, size_t);
+void	SipHash_State(const SIPHASH_KEY *, u64[4]);
+u64	SipHash_FromState(const u64[4], int, int, const void *, size_t);
 
 #define SipHash24_Init(_c, _k)		SipHash_Init((_c), (_k))
 #define SipHash24_Update(_c, _p, _l)	SipHash_Update((_c), 2, 4, (_p), (_l))
 #define SipHash24_End(_d)		SipHash_End((_d), 2, 4)
 #define SipHash24_Final(_d, _c)		SipHash_Final((_d), (_c), 2, 4)
 #define SipHash24(_k, _p, _l)		SipHash((_k), 2, 4, (_p), (_l))
+#define SipHash24_State(_k, _s)		SipHash_State((_k), (_s))
+#define SipHash24_FromState(_s, _p, _l) SipHash_FromState((_s), 2, 4, (_p), (_l))
 
 #define SipHash48_Init(_c, _k)		SipHash_Init((_c), (_k))
 #define SipHash48_Update(_c, _p, _l)	SipHash_Update((_c), 4, 8, (_p), (_l))
@@ -37,6 +37,15 @@ struct bch_hash_info {
 		__le64		crc_key;
 		SIPHASH_KEY	siphash_key;
 	};
+	/*
+	 * Key setup hoisted out of the per-name hash calls: the siphash
+	 * initial state only depends on the key, so derive it once per
+	 * hash_info instead of once per lookup:
+	 */
+	u64			siphash_state[4];
+	/* Same idea for the crc types - the key is folded in once, here: */
+	u32			crc32c_seed;
+	u64			crc64_seed;
 };
 
 static inline struct bch_hash_info
@@ -60,6 +69,13 @@ bch2_hash_info_init(struct bch_fs *c, const struct bch_inode_unpacked *bi)
 		memcpy(&info.siphash_key, digest, sizeof(info.siphash_key));
 	}
 
+	if (info.type == BCH_STR_HASH_SIPHASH_OLD ||
+	    info.type == BCH_STR_HASH_SIPHASH)
+		SipHash24_State(&info.siphash_key, info.siphash_state);
+
+	info.crc32c_seed = crc32c(~0, &info.crc_key, sizeof(info.crc_key));
+	info.crc64_seed	 = crc64_be(~0, &info.crc_key, sizeof(info.crc_key));
+
 	return info;
 }
 
@@ -76,10 +92,10 @@ static inline void bch2_str_hash_init(struct bch_str_hash_ctx *ctx,
 {
 	switch (info->type) {
 	case BCH_STR_HASH_CRC32C:
-		ctx->crc32c = crc32c(~0, &info->crc_key, sizeof(info->crc_key));
+		ctx->crc32c = info->crc32c_seed;
 		break;
 	case BCH_STR_HASH_CRC64:
-		ctx->crc64 = crc64_be(~0, &info->crc_key, sizeof(info->crc_key));
+		ctx->crc64 = info->crc64_seed;
 		break;
 	case BCH_STR_HASH_SIPHASH_OLD:
 	case BCH_STR_HASH_SIPHASH:
@@ -126,6 +142,27 @@ static inline u64 bch2_str_hash_end(struct bch_str_hash_ctx *ctx,
 	}
 }
 
+/*
+ * One shot hash of a single contiguous buffer - the common case (one dirent
+ * name per lookup). Skips the streaming context entirely; for siphash that
+ * means no block buffering and the precomputed key state from hash_info:
+ */
+static inline u64 bch2_str_hash(const struct bch_hash_info *info,
+				const void *data, size_t len)
+{
+	switch (info->type) {
+	case BCH_STR_HASH_CRC32C:
+		return crc32c(info->crc32c_seed, data, len);
+	case BCH_STR_HASH_CRC64:
+		return crc64_be(info->crc64_seed, data, len) >> 1;
+	case BCH_STR_HASH_SIPHASH_OLD:
+	case BCH_STR_HASH_SIPHASH:
+		return SipHash24_FromState(info->siphash_state, data, len) >> 1;
+	default:
+		BUG();
+	}
+}
+
 struct bch_hash_desc {
 	enum btree_id	btree_id;
 	u8		key_type;
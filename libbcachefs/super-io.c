@@ -4,12 +4,14 @@
 #include "btree_update_interior.h"
 #include "buckets.h"
 #include "checksum.h"
+#include "compress.h"
 #include "disk_groups.h"
 #include "ec.h"
 #include "error.h"
 #include "io.h"
 #include "journal.h"
 #include "journal_seq_blacklist.h"
+#include "prewarm.h"
 #include "replicas.h"
 #include "quota.h"
 #include "super-io.h"
@@ -42,6 +44,29 @@ struct bch_sb_field *bch2_sb_field_get(struct bch_sb *sb,
 	return NULL;
 }
 
+/*
+ * Rebuild the field offset index; must be called after anything that moves
+ * fields around. Careful with ordering - a new field's type isn't set until
+ * after __bch2_sb_field_resize() returns:
+ */
+static void bch2_sb_field_index_rebuild(struct bch_sb_handle *sb)
+{
+	struct bch_sb_field *f;
+
+	memset(sb->field_offset, 0, sizeof(sb->field_offset));
+
+	vstruct_for_each(sb->sb, f) {
+		unsigned type = le32_to_cpu(f->type);
+
+		/* don't walk past a corrupt field on an unvalidated sb: */
+		if (!f->u64s || vstruct_next(f) > vstruct_last(sb->sb))
+			break;
+
+		if (type < BCH_SB_FIELD_NR && !sb->field_offset[type])
+			sb->field_offset[type] = (u64 *) f - (u64 *) sb->sb;
+	}
+}
+
 static struct bch_sb_field *__bch2_sb_field_resize(struct bch_sb_handle *sb,
 						   struct bch_sb_field *f,
 						   unsigned u64s)
@@ -85,10 +110,12 @@ static struct bch_sb_field *__bch2_sb_field_resize(struct bch_sb_handle *sb,
 void bch2_sb_field_delete(struct bch_sb_handle *sb,
 			  enum bch_sb_field_type type)
 {
-	struct bch_sb_field *f = bch2_sb_field_get(sb->sb, type);
+	struct bch_sb_field *f = bch2_sb_field_get_idx(sb, type);
 
-	if (f)
+	if (f) {
 		__bch2_sb_field_resize(sb, f, 0);
+		bch2_sb_field_index_rebuild(sb);
+	}
 }
 
 /* Superblock realloc/free: */
@@ -161,7 +188,7 @@ struct bch_sb_field *bch2_sb_field_resize(struct bch_sb_handle *sb,
 					  enum bch_sb_field_type type,
 					  unsigned u64s)
 {
-	struct bch_sb_field *f = bch2_sb_field_get(sb->sb, type);
+	struct bch_sb_field *f = bch2_sb_field_get_idx(sb, type);
 	ssize_t old_u64s = f ? le32_to_cpu(f->u64s) : 0;
 	ssize_t d = -old_u64s + u64s;
 
@@ -187,10 +214,12 @@ struct bch_sb_field *bch2_sb_field_resize(struct bch_sb_handle *sb,
 		}
 	}
 
-	f = bch2_sb_field_get(sb->sb, type);
+	f = bch2_sb_field_get_idx(sb, type);
 	f = __bch2_sb_field_resize(sb, f, u64s);
 	if (f)
 		f->type = cpu_to_le32(type);
+
+	bch2_sb_field_index_rebuild(sb);
 	return f;
 }
 
@@ -233,11 +262,9 @@ static const char *validate_sb_layout(struct bch_sb_layout *layout)
 	return NULL;
 }
 
-const char *bch2_sb_validate(struct bch_sb_handle *disk_sb)
+static const char *bch2_sb_validate_common(struct bch_sb *sb)
 {
-	struct bch_sb *sb = disk_sb->sb;
 	struct bch_sb_field *f;
-	struct bch_sb_field_members *mi;
 	const char *err;
 	u32 version, version_min;
 	u16 block_size;
@@ -326,6 +353,20 @@ const char *bch2_sb_validate(struct bch_sb_handle *disk_sb)
 			return "Invalid superblock: invalid optional field";
 	}
 
+	return NULL;
+}
+
+const char *bch2_sb_validate(struct bch_sb_handle *disk_sb)
+{
+	struct bch_sb *sb = disk_sb->sb;
+	struct bch_sb_field *f;
+	struct bch_sb_field_members *mi;
+	const char *err;
+
+	err = bch2_sb_validate_common(sb);
+	if (err)
+		return err;
+
 	/* members must be validated first: */
 	mi = bch2_sb_get_members(sb);
 	if (!mi)
@@ -347,6 +388,25 @@ const char *bch2_sb_validate(struct bch_sb_handle *disk_sb)
 	return NULL;
 }
 
+/*
+ * Device superblocks are identical copies of the filesystem superblock
+ * except for the journal field, so when we're writing every device's
+ * superblock the shared fields only need validating once - the per device
+ * pass just covers the header and the journal field:
+ */
+static const char *bch2_sb_validate_dev(struct bch_sb_handle *disk_sb)
+{
+	struct bch_sb_field *f =
+		bch2_sb_field_get_idx(disk_sb, BCH_SB_FIELD_journal);
+	const char *err;
+
+	err = bch2_sb_validate_common(disk_sb->sb);
+	if (err)
+		return err;
+
+	return f ? bch2_sb_field_validate(disk_sb->sb, f) : NULL;
+}
+
 /* device open: */
 
 static void bch2_sb_update(struct bch_fs *c)
@@ -412,6 +472,8 @@ static void __copy_super(struct bch_sb_handle *dst_handle, struct bch_sb *src)
 		if (src_f)
 			memcpy(dst_f, src_f, vstruct_bytes(src_f));
 	}
+
+	bch2_sb_field_index_rebuild(dst_handle);
 }
 
 int bch2_sb_to_fs(struct bch_fs *c, struct bch_sb *src)
@@ -509,6 +571,8 @@ reread:
 
 	sb->seq = le64_to_cpu(sb->sb->seq);
 
+	bch2_sb_field_index_rebuild(sb);
+
 	return NULL;
 }
 
@@ -664,6 +728,36 @@ static void read_back_super(struct bch_fs *c, struct bch_dev *ca)
 	closure_bio_submit(bio, &c->sb_write);
 }
 
+/*
+ * Each superblock copy embeds its own offset and checksum, so copies written
+ * concurrently can't share the superblock buffer - writes after the first get
+ * a private copy, freed on completion:
+ */
+struct sb_copy_write {
+	struct bch_dev		*ca;
+	unsigned		page_order;
+	struct bch_sb		*sb;
+};
+
+static void write_super_copy_endio(struct bio *bio)
+{
+	struct sb_copy_write *w = bio->bi_private;
+	struct bch_dev *ca = w->ca;
+
+	/* XXX: return errors directly */
+
+	if (bch2_dev_io_err_on(bio->bi_status, ca, "superblock write: %s",
+			       bch2_blk_status_to_str(bio->bi_status)))
+		ca->sb_write_error = 1;
+
+	free_pages((unsigned long) w->sb, w->page_order);
+	kfree(w);
+	bio_put(bio);
+
+	closure_put(&ca->fs->sb_write);
+	percpu_ref_put(&ca->io_ref);
+}
+
 static void write_one_super(struct bch_fs *c, struct bch_dev *ca, unsigned idx)
 {
 	struct bch_sb *sb = ca->disk_sb.sb;
@@ -692,6 +786,57 @@ static void write_one_super(struct bch_fs *c, struct bch_dev *ca, unsigned idx)
 	closure_bio_submit(bio, &c->sb_write);
 }
 
+static void write_super_copy(struct bch_fs *c, struct bch_dev *ca, unsigned idx)
+{
+	struct bch_sb *sb = ca->disk_sb.sb;
+	size_t bytes = roundup((size_t) vstruct_bytes(sb),
+			       bdev_logical_block_size(ca->disk_sb.bdev));
+	unsigned order = get_order(bytes);
+	struct sb_copy_write *w;
+	struct bch_sb *buf;
+	struct bio *bio;
+
+	w	= kmalloc(sizeof(*w), GFP_NOFS);
+	bio	= bio_kmalloc(GFP_NOFS, 1 << order);
+	buf	= (void *) __get_free_pages(GFP_NOFS, order);
+
+	if (!w || !bio || !buf) {
+		/* write through the shared buffer, serially: */
+		kfree(w);
+		if (bio)
+			bio_put(bio);
+		free_pages((unsigned long) buf, order);
+
+		write_one_super(c, ca, idx);
+		closure_sync(&c->sb_write);
+		return;
+	}
+
+	memcpy(buf, sb, vstruct_bytes(sb));
+	buf->offset = buf->layout.sb_offset[idx];
+
+	SET_BCH_SB_CSUM_TYPE(buf, c->opts.metadata_checksum);
+	buf->csum = csum_vstruct(c, BCH_SB_CSUM_TYPE(buf),
+				 null_nonce(), buf);
+
+	w->ca		= ca;
+	w->page_order	= order;
+	w->sb		= buf;
+
+	bio_set_dev(bio, ca->disk_sb.bdev);
+	bio->bi_iter.bi_sector	= le64_to_cpu(buf->offset);
+	bio->bi_end_io		= write_super_copy_endio;
+	bio->bi_private		= w;
+	bio_set_op_attrs(bio, REQ_OP_WRITE, REQ_SYNC|REQ_META);
+	bch2_bio_map(bio, buf, bytes);
+
+	this_cpu_add(ca->io_done->sectors[WRITE][BCH_DATA_sb],
+		     bio_sectors(bio));
+
+	percpu_ref_get(&ca->io_ref);
+	closure_bio_submit(bio, &c->sb_write);
+}
+
 int bch2_write_super(struct bch_fs *c)
 {
 	struct closure *cl = &c->sb_write;
@@ -699,7 +844,7 @@ int bch2_write_super(struct bch_fs *c)
 	unsigned i, sb = 0, nr_wrote;
 	const char *err;
 	struct bch_devs_mask sb_written;
-	bool wrote, can_mount_without_written, can_mount_with_written;
+	bool can_mount_without_written, can_mount_with_written;
 	int ret = 0;
 
 	lockdep_assert_held(&c->sb_lock);
@@ -715,10 +860,18 @@ int bch2_write_super(struct bch_fs *c)
 	for_each_online_member(ca, c, i)
 		bch2_sb_from_fs(c, ca);
 
+	err = bch2_sb_validate(&c->disk_sb);
+	if (err) {
+		bch2_fs_inconsistent(c, "sb invalid before write: %s", err);
+		ret = -1;
+		goto out;
+	}
+
 	for_each_online_member(ca, c, i) {
-		err = bch2_sb_validate(&ca->disk_sb);
+		err = bch2_sb_validate_dev(&ca->disk_sb);
 		if (err) {
 			bch2_fs_inconsistent(c, "sb invalid before write: %s", err);
+			percpu_ref_put(&ca->io_ref);
 			ret = -1;
 			goto out;
 		}
@@ -748,17 +901,27 @@ int bch2_write_super(struct bch_fs *c)
 		}
 	}
 
-	do {
-		wrote = false;
-		for_each_online_member(ca, c, i)
-			if (!ca->sb_write_error &&
-			    sb < ca->disk_sb.sb->layout.nr_superblocks) {
-				write_one_super(c, ca, sb);
-				wrote = true;
-			}
-		closure_sync(cl);
-		sb++;
-	} while (wrote);
+	/*
+	 * Write the first superblock copy on every device and wait for it
+	 * before fanning out the rest: if we crash partway through, only
+	 * copies still in flight can be torn, so a device always has a
+	 * complete superblock - the new first copy or an old one. The
+	 * remaining copies then all go out concurrently, so sb commit
+	 * latency is two round trips to the slowest device instead of one
+	 * per copy:
+	 */
+	for_each_online_member(ca, c, i)
+		if (!ca->sb_write_error)
+			write_one_super(c, ca, 0);
+	closure_sync(cl);
+
+	for_each_online_member(ca, c, i)
+		if (!ca->sb_write_error)
+			for (sb = 1;
+			     sb < ca->disk_sb.sb->layout.nr_superblocks;
+			     sb++)
+				write_super_copy(c, ca, sb);
+	closure_sync(cl);
 
 	for_each_online_member(ca, c, i) {
 		if (ca->sb_write_error)
@@ -1122,6 +1285,24 @@ static const struct bch_sb_field_ops bch_sb_field_ops_clean = {
 	.validate	= bch2_sb_validate_clean,
 };
 
+/* Format time device probe measurements: */
+
+static const char *bch2_sb_validate_dev_probe(struct bch_sb *sb,
+					      struct bch_sb_field *f)
+{
+	struct bch_sb_field_dev_probe *p = field_to_type(f, dev_probe);
+
+	if ((vstruct_bytes(&p->field) - sizeof(*p)) %
+	    sizeof(struct bch_dev_probe_entry))
+		return "invalid field dev_probe: wrong size";
+
+	return NULL;
+}
+
+static const struct bch_sb_field_ops bch_sb_field_ops_dev_probe = {
+	.validate	= bch2_sb_validate_dev_probe,
+};
+
 static const struct bch_sb_field_ops *bch2_sb_field_ops[] = {
 #define x(f, nr)					\
 	[BCH_SB_FIELD_##f] = &bch_sb_field_ops_##f,
@@ -14,6 +14,18 @@ struct bch_sb_field *bch2_sb_field_resize(struct bch_sb_handle *,
 					  enum bch_sb_field_type, unsigned);
 void bch2_sb_field_delete(struct bch_sb_handle *, enum bch_sb_field_type);
 
+/*
+ * When we have the handle, field lookups are O(1) via the offset index built
+ * at read time:
+ */
+static inline struct bch_sb_field *
+bch2_sb_field_get_idx(struct bch_sb_handle *sb, enum bch_sb_field_type type)
+{
+	return sb->field_offset[type]
+		? (struct bch_sb_field *) ((u64 *) sb->sb + sb->field_offset[type])
+		: NULL;
+}
+
 #define field_to_type(_f, _name)					\
 	container_of_or_null(_f, struct bch_sb_field_##_name, field)
 
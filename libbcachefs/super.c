@@ -10,6 +10,7 @@
 #include "bcachefs.h"
 #include "alloc_background.h"
 #include "alloc_foreground.h"
+#include "backref.h"
 #include "bkey_sort.h"
 #include "btree_cache.h"
 #include "btree_gc.h"
@@ -35,6 +36,7 @@
 #include "move.h"
 #include "migrate.h"
 #include "movinggc.h"
+#include "prewarm.h"
 #include "quota.h"
 #include "rebalance.h"
 #include "recovery.h"
@@ -358,6 +360,7 @@ void bch2_fs_read_only(struct bch_fs *c)
 	    test_bit(BCH_FS_ALLOC_CLEAN, &c->flags) &&
 	    !c->opts.norecovery) {
 		bch_verbose(c, "marking filesystem clean");
+		bch2_btree_cache_prewarm_save(c);
 		bch2_fs_mark_clean(c);
 	}
 
@@ -489,9 +492,20 @@ int bch2_fs_read_write(struct bch_fs *c)
 
 int bch2_fs_read_write_early(struct bch_fs *c)
 {
-	lockdep_assert_held(&c->state_lock);
+	int ret;
+
+	/*
+	 * Unlike bch2_fs_read_write(), nothing upstack holds state_lock here -
+	 * this is called from the BTREE_INSERT_LAZY_RW slowpath, where multiple
+	 * threads (e.g. concurrent fsck passes) can race to do the transition;
+	 * running __bch2_fs_read_write() twice would double start the
+	 * allocator threads and leak a ref on c->writes:
+	 */
+	down_write(&c->state_lock);
+	ret = __bch2_fs_read_write(c, true);
+	up_write(&c->state_lock);
 
-	return __bch2_fs_read_write(c, true);
+	return ret;
 }
 
 /* Filesystem startup/shutdown: */
@@ -502,9 +516,12 @@ static void bch2_fs_free(struct bch_fs *c)
 
 	for (i = 0; i < BCH_TIME_STAT_NR; i++)
 		bch2_time_stats_exit(&c->times[i]);
+	for (i = 0; i < BTREE_MAX_DEPTH; i++)
+		bch2_time_stats_exit(&c->btree_lock_contended_by_level[i]);
 
 	bch2_fs_quota_exit(c);
 	bch2_fs_fsio_exit(c);
+	bch2_fs_allocator_foreground_exit(c);
 	bch2_fs_ec_exit(c);
 	bch2_fs_encryption_exit(c);
 	bch2_fs_io_exit(c);
@@ -518,7 +535,11 @@ static void bch2_fs_free(struct bch_fs *c)
 	bch2_fs_compress_exit(c);
 	bch2_journal_keys_free(&c->journal_keys);
 	bch2_journal_entries_free(&c->journal_entries);
+	free_fifo(&c->rebalance.work_queue);
 	percpu_free_rwsem(&c->mark_lock);
+	if (c->usage_scratch_cache)
+		bch2_fs_usage_scratch_cache_clear(c);
+	free_percpu(c->usage_scratch_cache);
 	kfree(c->usage_scratch);
 	free_percpu(c->usage[1]);
 	free_percpu(c->usage[0]);
@@ -533,8 +554,11 @@ static void bch2_fs_free(struct bch_fs *c)
 	kfree(c->replicas_gc.entries);
 	kfree(rcu_dereference_protected(c->disk_groups, 1));
 	kfree(c->journal_seq_blacklist_table);
+	kfree(rcu_dereference_protected(c->copygc_pending, 1));
 	free_heap(&c->copygc_heap);
 
+	if (c->btree_read_complete_wq)
+		destroy_workqueue(c->btree_read_complete_wq);
 	if (c->journal_reclaim_wq)
 		destroy_workqueue(c->journal_reclaim_wq);
 	if (c->copygc_wq)
@@ -679,14 +703,17 @@ static struct bch_fs *bch2_fs_alloc(struct bch_sb *sb, struct bch_opts opts)
 	INIT_WORK(&c->read_only_work, bch2_fs_read_only_work);
 
 	init_rwsem(&c->gc_lock);
+	mutex_init(&c->gc_mark_lock);
 
 	for (i = 0; i < BCH_TIME_STAT_NR; i++)
 		bch2_time_stats_init(&c->times[i]);
+	for (i = 0; i < BTREE_MAX_DEPTH; i++)
+		bch2_time_stats_init(&c->btree_lock_contended_by_level[i]);
 
 	bch2_fs_copygc_init(c);
 	bch2_fs_btree_key_cache_init_early(&c->btree_key_cache);
 	bch2_fs_allocator_background_init(c);
-	bch2_fs_allocator_foreground_init(c);
+	bch2_fs_allocator_foreground_init_early(c);
 	bch2_fs_rebalance_init(c);
 	bch2_fs_quota_init(c);
 
@@ -696,6 +723,11 @@ static struct bch_fs *bch2_fs_alloc(struct bch_sb *sb, struct bch_opts opts)
 
 	mutex_init(&c->bio_bounce_pages_lock);
 
+	spin_lock_init(&c->inum_lease_lock);
+
+	/* so zeroed bch_cached_extents (version 0) never match: */
+	atomic64_set(&c->extents_version, 1);
+
 	bio_list_init(&c->btree_write_error_list);
 	spin_lock_init(&c->btree_write_error_lock);
 	INIT_WORK(&c->btree_write_error_work, bch2_btree_write_error_work);
@@ -722,6 +754,9 @@ static struct bch_fs *bch2_fs_alloc(struct bch_sb *sb, struct bch_opts opts)
 
 	sema_init(&c->io_in_flight, 64);
 
+	spin_lock_init(&c->write_index_lock);
+	INIT_LIST_HEAD(&c->write_index_list);
+
 	c->copy_gc_enabled		= 1;
 	c->rebalance.enabled		= 1;
 	c->promote_whole_extents	= true;
@@ -751,6 +786,12 @@ static struct bch_fs *bch2_fs_alloc(struct bch_sb *sb, struct bch_opts opts)
 	bch2_opts_apply(&c->opts, bch2_opts_from_sb(sb));
 	bch2_opts_apply(&c->opts, opts);
 
+	if (c->opts.inspect) {
+		c->opts.nochanges	= true;
+		c->opts.norecovery	= true;
+		c->opts.read_only	= true;
+	}
+
 	c->block_bits		= ilog2(c->opts.block_size);
 	c->btree_foreground_merge_threshold = BTREE_FOREGROUND_MERGE_THRESHOLD(c);
 
@@ -767,6 +808,8 @@ static struct bch_fs *bch2_fs_alloc(struct bch_sb *sb, struct bch_opts opts)
 				WQ_FREEZABLE|WQ_MEM_RECLAIM|WQ_CPU_INTENSIVE, 1)) ||
 	    !(c->journal_reclaim_wq = alloc_workqueue("bcache_journal",
 				WQ_FREEZABLE|WQ_MEM_RECLAIM|WQ_HIGHPRI, 1)) ||
+	    !(c->btree_read_complete_wq = alloc_workqueue("bcachefs_btree_read",
+				WQ_FREEZABLE|WQ_MEM_RECLAIM|WQ_UNBOUND, 0)) ||
 	    percpu_ref_init(&c->writes, bch2_writes_disabled,
 			    PERCPU_REF_INIT_DEAD, GFP_KERNEL) ||
 	    mempool_init_kmalloc_pool(&c->fill_iter, 1, iter_size) ||
@@ -775,9 +818,14 @@ static struct bch_fs *bch2_fs_alloc(struct bch_sb *sb, struct bch_opts opts)
 			    offsetof(struct btree_write_bio, wbio.bio)),
 			BIOSET_NEED_BVECS) ||
 	    !(c->pcpu = alloc_percpu(struct bch_fs_pcpu)) ||
+	    !(c->usage_scratch_cache = alloc_percpu(struct bch_fs_usage *)) ||
 	    mempool_init_kvpmalloc_pool(&c->btree_bounce_pool, 1,
 					btree_bytes(c)) ||
-	    mempool_init_kmalloc_pool(&c->large_bkey_pool, 1, 2048) ||
+	    /*
+	     * One reserved element per data job stream - move/copygc/fsck
+	     * each hold an oversize key for the duration of their scan loop:
+	     */
+	    mempool_init_kmalloc_pool(&c->large_bkey_pool, 8, 2048) ||
 	    bch2_io_clock_init(&c->io_clock[READ]) ||
 	    bch2_io_clock_init(&c->io_clock[WRITE]) ||
 	    bch2_fs_journal_init(&c->journal) ||
@@ -786,6 +834,7 @@ static struct bch_fs *bch2_fs_alloc(struct bch_sb *sb, struct bch_opts opts)
 	    bch2_fs_btree_key_cache_init(&c->btree_key_cache) ||
 	    bch2_fs_btree_iter_init(c) ||
 	    bch2_fs_btree_interior_update_init(c) ||
+	    bch2_fs_allocator_foreground_init(c) ||
 	    bch2_fs_io_init(c) ||
 	    bch2_fs_encryption_init(c) ||
 	    bch2_fs_compress_init(c) ||
@@ -895,6 +944,8 @@ int bch2_fs_start(struct bch_fs *c)
 	if (ret)
 		goto err;
 
+	bch2_btree_cache_prewarm(c);
+
 	ret = bch2_opts_check_may_set(c);
 	if (ret)
 		goto err;
@@ -1474,22 +1525,38 @@ int bch2_dev_remove(struct bch_fs *c, struct bch_dev *ca, int flags)
 
 	__bch2_dev_read_only(c, ca);
 
+	/*
+	 * The device is now read only, so no new data will land on it: the
+	 * evacuation - by far the longest part of a removal - doesn't need to
+	 * exclude other state changes. Drop to a read lock so foreground
+	 * operations that take state_lock aren't blocked for its duration; we
+	 * hold a ref on ca, so the device can't go away under us:
+	 */
+	up_write(&c->state_lock);
+	down_read(&c->state_lock);
+
 	ret = bch2_dev_data_drop(c, ca->dev_idx, flags);
 	if (ret) {
 		bch_err(ca, "Remove failed: error %i dropping data", ret);
-		goto err;
+		goto err_unlock_read;
 	}
 
 	ret = bch2_journal_flush_device_pins(&c->journal, ca->dev_idx);
 	if (ret) {
 		bch_err(ca, "Remove failed: error %i flushing journal", ret);
-		goto err;
+		goto err_unlock_read;
 	}
 
 	ret = bch2_dev_remove_alloc(c, ca);
 	if (ret) {
 		bch_err(ca, "Remove failed, error deleting alloc info");
-		goto err;
+		goto err_unlock_read;
+	}
+
+	ret = bch2_backref_drop_dev(c, ca->dev_idx);
+	if (ret) {
+		bch_err(ca, "Remove failed, error deleting backrefs");
+		goto err_unlock_read;
 	}
 
 	/*
@@ -1504,15 +1571,24 @@ int bch2_dev_remove(struct bch_fs *c, struct bch_dev *ca, int flags)
 	ret = bch2_journal_error(&c->journal);
 	if (ret) {
 		bch_err(ca, "Remove failed, journal error");
-		goto err;
+		goto err_unlock_read;
 	}
 
 	ret = bch2_replicas_gc2(c);
 	if (ret) {
 		bch_err(ca, "Remove failed: error %i from replicas gc", ret);
-		goto err;
+		goto err_unlock_read;
 	}
 
+	/* retake exclusively for the removal commit: */
+	up_read(&c->state_lock);
+	down_write(&c->state_lock);
+
+	/*
+	 * Checked under the write lock: if the device was flipped back to rw
+	 * and written to while we didn't hold state_lock exclusively, this
+	 * catches it:
+	 */
 	data = bch2_dev_has_data(c, ca);
 	if (data) {
 		char data_has_str[100];
@@ -1548,6 +1624,9 @@ int bch2_dev_remove(struct bch_fs *c, struct bch_dev *ca, int flags)
 	mutex_unlock(&c->sb_lock);
 	up_write(&c->state_lock);
 	return 0;
+err_unlock_read:
+	up_read(&c->state_lock);
+	down_write(&c->state_lock);
 err:
 	if (ca->mi.state == BCH_MEMBER_STATE_RW &&
 	    !percpu_ref_is_zero(&ca->io_ref))
@@ -12,6 +12,13 @@ struct bch_sb_handle {
 	unsigned		have_bio:1;
 	unsigned		fs_sb:1;
 	u64			seq;
+
+	/*
+	 * Field offsets from the start of the superblock, in u64s, so they
+	 * survive realloc; 0 means not present. Maintained by
+	 * bch2_sb_field_resize() and friends:
+	 */
+	u32			field_offset[BCH_SB_FIELD_NR];
 };
 
 struct bch_devs_mask {
@@ -160,6 +160,8 @@ read_attribute(bucket_quantiles_oldest_gen);
 
 read_attribute(reserve_stats);
 read_attribute(btree_cache_size);
+read_attribute(btree_cache_compressed_size);
+rw_attribute(btree_cache_compressed_max);
 read_attribute(compression_stats);
 read_attribute(journal_debug);
 read_attribute(journal_pins);
@@ -203,6 +205,8 @@ read_attribute(data_replicas_have);
 
 read_attribute(io_timers_read);
 read_attribute(io_timers_write);
+read_attribute(btree_lock_contended_by_level);
+read_attribute(btree_trans_restart_by_level);
 
 #ifdef CONFIG_BCACHEFS_TESTS
 write_attribute(perf_test);
@@ -225,19 +229,6 @@ static struct attribute sysfs_state_rw = {
 	.mode = S_IRUGO
 };
 
-static size_t bch2_btree_cache_size(struct bch_fs *c)
-{
-	size_t ret = 0;
-	struct btree *b;
-
-	mutex_lock(&c->btree_cache.lock);
-	list_for_each_entry(b, &c->btree_cache.live, list)
-		ret += btree_bytes(c);
-
-	mutex_unlock(&c->btree_cache.lock);
-	return ret;
-}
-
 static int fs_alloc_debug_to_text(struct printbuf *out, struct bch_fs *c)
 {
 	struct bch_fs_usage *fs_usage = bch2_fs_usage_read(c);
@@ -326,6 +317,10 @@ SHOW(bch2_fs)
 	sysfs_print(block_size,			block_bytes(c));
 	sysfs_print(btree_node_size,		btree_bytes(c));
 	sysfs_hprint(btree_cache_size,		bch2_btree_cache_size(c));
+	sysfs_hprint(btree_cache_compressed_size,
+		     bch2_btree_cache_compressed_size(&c->btree_cache));
+	sysfs_hprint(btree_cache_compressed_max,
+		     c->btree_cache.compressed_bytes_max);
 
 	sysfs_print(read_realloc_races,
 		    atomic_long_read(&c->read_realloc_races));
@@ -414,6 +409,26 @@ SHOW(bch2_fs)
 		return out.pos - buf;
 	}
 
+	if (attr == &sysfs_btree_lock_contended_by_level) {
+		unsigned l;
+
+		for (l = 0; l < BTREE_MAX_DEPTH; l++) {
+			pr_buf(&out, "level %u:\n", l);
+			bch2_time_stats_to_text(&out,
+				&c->btree_lock_contended_by_level[l]);
+		}
+		return out.pos - buf;
+	}
+
+	if (attr == &sysfs_btree_trans_restart_by_level) {
+		unsigned l;
+
+		for (l = 0; l < BTREE_MAX_DEPTH; l++)
+			pr_buf(&out, "level %u:\t%llu\n", l,
+			       (u64) atomic64_read(&c->btree_trans_restart_by_level[l]));
+		return out.pos - buf;
+	}
+
 #define BCH_DEBUG_PARAM(name, description) sysfs_print(name, c->name);
 	BCH_DEBUG_PARAMS()
 #undef BCH_DEBUG_PARAM
@@ -428,6 +443,9 @@ STORE(bch2_fs)
 	sysfs_strtoul(journal_write_delay_ms, c->journal.write_delay_ms);
 	sysfs_strtoul(journal_reclaim_delay_ms, c->journal.reclaim_delay_ms);
 
+	sysfs_strtoul(btree_cache_compressed_max,
+		      c->btree_cache.compressed_bytes_max);
+
 	if (attr == &sysfs_btree_gc_periodic) {
 		ssize_t ret = strtoul_safe(buf, c->btree_gc_periodic)
 			?: (ssize_t) size;
@@ -526,6 +544,8 @@ struct attribute *bch2_fs_files[] = {
 	&sysfs_block_size,
 	&sysfs_btree_node_size,
 	&sysfs_btree_cache_size,
+	&sysfs_btree_cache_compressed_size,
+	&sysfs_btree_cache_compressed_max,
 
 	&sysfs_meta_replicas_have,
 	&sysfs_data_replicas_have,
@@ -589,6 +609,9 @@ struct attribute *bch2_fs_internal_files[] = {
 	&sysfs_io_timers_read,
 	&sysfs_io_timers_write,
 
+	&sysfs_btree_lock_contended_by_level,
+	&sysfs_btree_trans_restart_by_level,
+
 	&sysfs_internal_uuid,
 
 #define BCH_DEBUG_PARAM(name, description) &sysfs_##name,
@@ -804,7 +827,7 @@ static void dev_alloc_debug_to_text(struct printbuf *out, struct bch_dev *ca)
 
 	memset(nr, 0, sizeof(nr));
 
-	for (i = 0; i < ARRAY_SIZE(c->open_buckets); i++)
+	for (i = 0; i < c->open_buckets_nr; i++)
 		nr[c->open_buckets[i].type]++;
 
 	pr_buf(out,
@@ -859,7 +882,7 @@ static void dev_alloc_debug_to_text(struct printbuf *out, struct bch_dev *ca)
 		stats.sectors_fragmented,
 		c->copygc_threshold,
 		c->freelist_wait.list.first		? "waiting" : "empty",
-		c->open_buckets_nr_free, OPEN_BUCKETS_COUNT,
+		c->open_buckets_nr_free, c->open_buckets_nr,
 		BTREE_NODE_OPEN_BUCKET_RESERVE,
 		c->open_buckets_wait.list.first		? "waiting" : "empty",
 		nr[BCH_DATA_btree],
@@ -219,6 +219,30 @@ static void bch2_quantiles_update(struct quantiles *q, u64 v)
 
 /* time stats: */
 
+static unsigned time_stats_hist_idx(u64 v)
+{
+	unsigned b = fls64(v);
+
+	if (b <= TIME_STATS_HIST_SUB_BITS)
+		return v;
+
+	return ((b - TIME_STATS_HIST_SUB_BITS) << TIME_STATS_HIST_SUB_BITS) +
+		((v >> (b - 1 - TIME_STATS_HIST_SUB_BITS)) &
+		 ((1U << TIME_STATS_HIST_SUB_BITS) - 1));
+}
+
+/* smallest value that maps to a given bucket: */
+static u64 time_stats_hist_bound(unsigned idx)
+{
+	unsigned g = idx >> TIME_STATS_HIST_SUB_BITS;
+	unsigned s = idx & ((1U << TIME_STATS_HIST_SUB_BITS) - 1);
+
+	return !g
+		? s
+		: (1ULL << (g + TIME_STATS_HIST_SUB_BITS - 1)) +
+		  ((u64) s << (g - 1));
+}
+
 static void bch2_time_stats_update_one(struct time_stats *stats,
 				       u64 start, u64 end)
 {
@@ -244,6 +268,9 @@ static void bch2_time_stats_update_one(struct time_stats *stats,
 	stats->last_event = end;
 
 	bch2_quantiles_update(&stats->quantiles, duration);
+
+	if (stats->hist)
+		this_cpu_ptr(stats->hist)[time_stats_hist_idx(duration)]++;
 }
 
 void __bch2_time_stats_update(struct time_stats *stats, u64 start, u64 end)
@@ -252,6 +279,12 @@ void __bch2_time_stats_update(struct time_stats *stats, u64 start, u64 end)
 
 	if (!stats->buffer) {
 		spin_lock_irqsave(&stats->lock, flags);
+
+		if (!stats->hist)
+			stats->hist = __alloc_percpu_gfp(
+					TIME_STATS_HIST_NR * sizeof(u64),
+					sizeof(u64), GFP_ATOMIC);
+
 		bch2_time_stats_update_one(stats, start, end);
 
 		if (stats->average_frequency < 32 &&
@@ -352,10 +385,69 @@ void bch2_time_stats_to_text(struct printbuf *out, struct time_stats *stats)
 		       is_last ? "\n" : " ");
 		last_q = q;
 	}
+
+	if (stats->hist) {
+		static const unsigned pctl[] = { 50, 90, 99 };
+		u64 *h = kcalloc(TIME_STATS_HIST_NR, sizeof(u64), GFP_KERNEL);
+		u64 total = 0, cum = 0;
+		unsigned cpu, p = 0;
+
+		if (!h)
+			return;
+
+		for_each_possible_cpu(cpu)
+			for (i = 0; i < TIME_STATS_HIST_NR; i++)
+				h[i] += per_cpu_ptr(stats->hist, cpu)[i];
+
+		for (i = 0; i < TIME_STATS_HIST_NR; i++)
+			total += h[i];
+
+		for (i = 0;
+		     i < TIME_STATS_HIST_NR && total && p < ARRAY_SIZE(pctl);
+		     i++) {
+			cum += h[i];
+
+			while (p < ARRAY_SIZE(pctl) &&
+			       cum * 100 >= total * pctl[p]) {
+				pr_buf(out, "p%u:\t\t", pctl[p]);
+				pr_time_units(out, time_stats_hist_bound(i));
+				pr_buf(out, "\n");
+				p++;
+			}
+		}
+
+		kfree(h);
+	}
+}
+
+/*
+ * Reset everything but the allocations; samples still sitting in the percpu
+ * update buffer may be counted after the reset, which is fine for the
+ * benchmarking this is for:
+ */
+void bch2_time_stats_reset(struct time_stats *stats)
+{
+	unsigned long flags;
+	int cpu;
+
+	spin_lock_irqsave(&stats->lock, flags);
+	stats->count			= 0;
+	stats->average_duration		= 0;
+	stats->average_frequency	= 0;
+	stats->max_duration		= 0;
+	stats->last_event		= 0;
+	memset(&stats->quantiles, 0, sizeof(stats->quantiles));
+
+	if (stats->hist)
+		for_each_possible_cpu(cpu)
+			memset(per_cpu_ptr(stats->hist, cpu), 0,
+			       TIME_STATS_HIST_NR * sizeof(u64));
+	spin_unlock_irqrestore(&stats->lock, flags);
 }
 
 void bch2_time_stats_exit(struct time_stats *stats)
 {
+	free_percpu(stats->hist);
 	free_percpu(stats->buffer);
 }
 
@@ -367,6 +459,11 @@ void bch2_time_stats_init(struct time_stats *stats)
 
 /* ratelimit: */
 
+static u64 bch2_ratelimit_burst(struct bch_ratelimit *d)
+{
+	return d->burst ?: max_t(u64, d->rate / 16, 1);
+}
+
 /**
  * bch2_ratelimit_delay() - return how long to delay until the next time to do
  * some work
@@ -378,10 +475,28 @@ void bch2_time_stats_init(struct time_stats *stats)
 u64 bch2_ratelimit_delay(struct bch_ratelimit *d)
 {
 	u64 now = local_clock();
+	unsigned long flags;
+	u64 ret = 0;
 
-	return time_after64(d->next, now)
-		? nsecs_to_jiffies(d->next - now)
-		: 0;
+	spin_lock_irqsave(&d->lock, flags);
+
+	/* local_clock() isn't quite monotonic across cpus: */
+	if (time_after64(now, d->last)) {
+		d->tokens += div_u64(min_t(u64, now - d->last, NSEC_PER_SEC) *
+				     d->rate, NSEC_PER_SEC);
+		d->last = now;
+	}
+
+	if (d->tokens > (s64) bch2_ratelimit_burst(d))
+		d->tokens = bch2_ratelimit_burst(d);
+
+	if (d->tokens < 0)
+		ret = nsecs_to_jiffies(div_u64(-d->tokens * NSEC_PER_SEC,
+					       max(d->rate, 1U)));
+
+	spin_unlock_irqrestore(&d->lock, flags);
+
+	return ret;
 }
 
 /**
@@ -392,15 +507,36 @@ u64 bch2_ratelimit_delay(struct bch_ratelimit *d)
  */
 void bch2_ratelimit_increment(struct bch_ratelimit *d, u64 done)
 {
-	u64 now = local_clock();
+	unsigned long flags;
+
+	spin_lock_irqsave(&d->lock, flags);
+
+	d->tokens -= done;
+
+	/*
+	 * Bound the debt, so that dropping the rate doesn't stall us
+	 * arbitrarily long paying off work charged at the old rate:
+	 */
+	if (d->tokens < -((s64) d->rate))
+		d->tokens = -((s64) d->rate);
+
+	spin_unlock_irqrestore(&d->lock, flags);
+}
 
-	d->next += div_u64(done * NSEC_PER_SEC, d->rate);
+/*
+ * Would the token bucket be full right now? If so, nobody's calling
+ * bch2_ratelimit_delay() - the consumer isn't keeping up with the rate:
+ */
+static bool bch2_ratelimit_idle(struct bch_ratelimit *d)
+{
+	u64 now = local_clock();
+	s64 tokens = d->tokens;
 
-	if (time_before64(now + NSEC_PER_SEC, d->next))
-		d->next = now + NSEC_PER_SEC;
+	if (time_after64(now, d->last))
+		tokens += div_u64(min_t(u64, now - d->last, NSEC_PER_SEC) *
+				  d->rate, NSEC_PER_SEC);
 
-	if (time_after64(now - NSEC_PER_SEC * 2, d->next))
-		d->next = now - NSEC_PER_SEC * 2;
+	return tokens >= (s64) bch2_ratelimit_burst(d);
 }
 
 /* pd controller: */
@@ -441,8 +577,7 @@ void bch2_pd_controller_update(struct bch_pd_controller *pd,
 	/* Don't increase rate if not keeping up */
 	if (change > 0 &&
 	    pd->backpressure &&
-	    time_after64(local_clock(),
-			 pd->rate.next + NSEC_PER_MSEC))
+	    bch2_ratelimit_idle(&pd->rate))
 		change = 0;
 
 	change *= (sign * -1);
@@ -459,6 +594,7 @@ void bch2_pd_controller_update(struct bch_pd_controller *pd,
 
 void bch2_pd_controller_init(struct bch_pd_controller *pd)
 {
+	spin_lock_init(&pd->rate.lock);
 	pd->rate.rate		= 1024;
 	pd->last_update		= jiffies;
 	pd->p_term_inverse	= 6000;
@@ -485,7 +621,10 @@ size_t bch2_pd_controller_print_debug(struct bch_pd_controller *pd, char *buf)
 	bch2_hprint(&PBUF(derivative),	pd->last_derivative);
 	bch2_hprint(&PBUF(change),	pd->last_change);
 
-	next_io = div64_s64(pd->rate.next - local_clock(), NSEC_PER_MSEC);
+	next_io = pd->rate.tokens < 0
+		? div64_s64(-pd->rate.tokens * MSEC_PER_SEC,
+			    max(pd->rate.rate, 1U))
+		: 0;
 
 	return sprintf(buf,
 		       "rate:\t\t%s/sec\n"
@@ -588,6 +727,19 @@ void bch_scnmemcpy(struct printbuf *out,
 	}
 }
 
+void pr_u64(struct printbuf *out, u64 v)
+{
+	char buf[21];
+	char *p = buf + sizeof(buf);
+
+	do {
+		*--p = '0' + v % 10;
+		v /= 10;
+	} while (v);
+
+	bch_scnmemcpy(out, p, buf + sizeof(buf) - p);
+}
+
 #include "eytzinger.h"
 
 static int alignment_ok(const void *base, size_t align)
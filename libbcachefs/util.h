@@ -275,6 +275,26 @@ do {									\
 
 void bch_scnmemcpy(struct printbuf *, const char *, size_t);
 
+/*
+ * Direct formatting fast paths: the to_text code is hot enough in dump/list
+ * and fsck verbose logging that vsnprintf format parsing shows up in
+ * profiles. Output is identical to the pr_buf() equivalents:
+ */
+static inline void pr_char(struct printbuf *out, char c)
+{
+	if (printbuf_remaining(out) > 1) {
+		*out->pos++ = c;
+		*out->pos = '\0';
+	}
+}
+
+static inline void pr_string(struct printbuf *out, const char *str)
+{
+	bch_scnmemcpy(out, str, strlen(str));
+}
+
+void pr_u64(struct printbuf *, u64);
+
 int bch2_strtoint_h(const char *, int *);
 int bch2_strtouint_h(const char *, unsigned int *);
 int bch2_strtoll_h(const char *, long long *);
@@ -378,6 +398,16 @@ struct time_stat_buffer {
 	}		entries[32];
 };
 
+/*
+ * Log bucketed duration histogram: each power of two is subdivided into
+ * 2^TIME_STATS_HIST_SUB_BITS linear buckets, so quantiles are accurate to
+ * within one part in 2^sub_bits with a small fixed footprint:
+ */
+#define TIME_STATS_HIST_SUB_BITS	2
+#define TIME_STATS_HIST_NR						\
+	((((64 - TIME_STATS_HIST_SUB_BITS) << TIME_STATS_HIST_SUB_BITS)) + \
+	 (1U << TIME_STATS_HIST_SUB_BITS))
+
 struct time_stats {
 	spinlock_t	lock;
 	u64		count;
@@ -388,6 +418,9 @@ struct time_stats {
 	u64		last_event;
 	struct quantiles quantiles;
 
+	/* counters are per cpu, folded when read: */
+	u64 __percpu	*hist;
+
 	struct time_stat_buffer __percpu *buffer;
 };
 
@@ -399,6 +432,7 @@ static inline void bch2_time_stats_update(struct time_stats *stats, u64 start)
 }
 
 void bch2_time_stats_to_text(struct printbuf *, struct time_stats *);
+void bch2_time_stats_reset(struct time_stats *);
 
 void bch2_time_stats_exit(struct time_stats *);
 void bch2_time_stats_init(struct time_stats *);
@@ -411,21 +445,44 @@ void bch2_time_stats_init(struct time_stats *);
 	(((_ewma << _weight) - _ewma) + (val)) >> _weight;		\
 })
 
+/*
+ * Token bucket rate limiter: tokens accrue at @rate up to a cap of @burst, and
+ * work is charged against them - so bursts after an idle period are bounded by
+ * @burst instead of by how long we were idle, and the limiter may be shared by
+ * multiple threads:
+ */
 struct bch_ratelimit {
-	/* Next time we want to do some work, in nanoseconds */
-	u64			next;
+	spinlock_t		lock;
+
+	/* Time of the last token refill, in nanoseconds */
+	u64			last;
 
 	/*
-	 * Rate at which we want to do work, in units per nanosecond
-	 * The units here correspond to the units passed to
+	 * Tokens available: goes negative when a unit of work larger than the
+	 * available tokens is charged, and we delay until the debt is paid
+	 * off. The units here correspond to the units passed to
 	 * bch2_ratelimit_increment()
 	 */
+	s64			tokens;
+
+	/* Rate at which tokens accrue, in units per second */
 	unsigned		rate;
+
+	/*
+	 * Cap on accumulated tokens, in units; 0 means the default of 1/16th
+	 * of a second's worth at the current rate:
+	 */
+	u64			burst;
 };
 
 static inline void bch2_ratelimit_reset(struct bch_ratelimit *d)
 {
-	d->next = local_clock();
+	unsigned long flags;
+
+	spin_lock_irqsave(&d->lock, flags);
+	d->last		= local_clock();
+	d->tokens	= 0;
+	spin_unlock_irqrestore(&d->lock, flags);
 }
 
 u64 bch2_ratelimit_delay(struct bch_ratelimit *);
@@ -460,6 +517,7 @@ size_t bch2_pd_controller_print_debug(struct bch_pd_controller *, char *);
 #define sysfs_pd_controller_attribute(name)				\
 	rw_attribute(name##_rate);					\
 	rw_attribute(name##_rate_bytes);				\
+	rw_attribute(name##_rate_burst);				\
 	rw_attribute(name##_rate_d_term);				\
 	rw_attribute(name##_rate_p_term_inverse);			\
 	read_attribute(name##_rate_debug)
@@ -467,6 +525,7 @@ size_t bch2_pd_controller_print_debug(struct bch_pd_controller *, char *);
 #define sysfs_pd_controller_files(name)					\
 	&sysfs_##name##_rate,						\
 	&sysfs_##name##_rate_bytes,					\
+	&sysfs_##name##_rate_burst,					\
 	&sysfs_##name##_rate_d_term,					\
 	&sysfs_##name##_rate_p_term_inverse,				\
 	&sysfs_##name##_rate_debug
@@ -475,6 +534,7 @@ size_t bch2_pd_controller_print_debug(struct bch_pd_controller *, char *);
 do {									\
 	sysfs_hprint(name##_rate,		(var)->rate.rate);	\
 	sysfs_print(name##_rate_bytes,		(var)->rate.rate);	\
+	sysfs_print(name##_rate_burst,		(var)->rate.burst);	\
 	sysfs_print(name##_rate_d_term,		(var)->d_term);		\
 	sysfs_print(name##_rate_p_term_inverse,	(var)->p_term_inverse);	\
 									\
@@ -488,6 +548,7 @@ do {									\
 			    (var)->rate.rate, 1, UINT_MAX);		\
 	sysfs_strtoul_clamp(name##_rate_bytes,				\
 			    (var)->rate.rate, 1, UINT_MAX);		\
+	sysfs_strtoul(name##_rate_burst,	(var)->rate.burst);	\
 	sysfs_strtoul(name##_rate_d_term,	(var)->d_term);		\
 	sysfs_strtoul_clamp(name##_rate_p_term_inverse,			\
 			    (var)->p_term_inverse, 1, INT_MAX);		\
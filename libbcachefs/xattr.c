@@ -152,6 +152,48 @@ int bch2_xattr_get(struct bch_fs *c, struct bch_inode_info *inode,
 	return ret;
 }
 
+/*
+ * Fetch every xattr of @inum with a single range scan over its xattr
+ * keyspace, instead of one full hash lookup per attribute - wins when the
+ * caller wants several of them (listxattr, or security attributes + posix
+ * acls on every access check).
+ *
+ * @emit is called once per xattr; returning nonzero stops the scan and is
+ * returned to the caller.
+ */
+int bch2_xattr_get_multi(struct bch_fs *c, u64 inum,
+			 bch_xattr_emit_fn emit, void *arg)
+{
+	struct btree_trans trans;
+	struct btree_iter *iter;
+	struct bkey_s_c k;
+	int ret;
+
+	bch2_trans_init(&trans, c, 0, 0);
+
+	for_each_btree_key(&trans, iter, BTREE_ID_XATTRS,
+			   POS(inum, 0), 0, k, ret) {
+		struct bkey_s_c_xattr xattr;
+
+		if (k.k->p.inode > inum)
+			break;
+
+		if (k.k->type != KEY_TYPE_xattr)
+			continue;
+
+		xattr = bkey_s_c_to_xattr(k);
+
+		ret = emit(arg, xattr.v->x_type,
+			   xattr.v->x_name, xattr.v->x_name_len,
+			   xattr_val(xattr.v),
+			   le16_to_cpu(xattr.v->x_val_len));
+		if (ret)
+			break;
+	}
+
+	return bch2_trans_exit(&trans) ?: ret;
+}
+
 int bch2_xattr_set(struct btree_trans *trans, u64 inum,
 		   const struct bch_hash_info *hash_info,
 		   const char *name, const void *value, size_t size,
@@ -39,6 +39,11 @@ struct bch_inode_info;
 int bch2_xattr_get(struct bch_fs *, struct bch_inode_info *,
 		  const char *, void *, size_t, int);
 
+typedef int (*bch_xattr_emit_fn)(void *, u8, const char *, unsigned,
+				 const void *, unsigned);
+
+int bch2_xattr_get_multi(struct bch_fs *, u64, bch_xattr_emit_fn, void *);
+
 int bch2_xattr_set(struct btree_trans *, u64, const struct bch_hash_info *,
 		   const char *, const void *, size_t, int, int);
 
@@ -265,6 +265,8 @@ again:
 	if (!bio_remaining_done(bio))
 		return;
 
+	bdev_io_account_complete(bio);
+
 	/*
 	 * Need to have a real endio function for chained bios, otherwise
 	 * various corner cases will break (like stacking block devices that
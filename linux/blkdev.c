@@ -1,29 +1,1396 @@
+#include <alloca.h>
+#include <errno.h>
+#include <execinfo.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <libaio.h>
+
+#ifdef CONFIG_VALGRIND
+#include <valgrind/memcheck.h>
+#endif
+
+#include <linux/bio.h>
+#include <linux/blkdev.h>
+#include <linux/completion.h>
+#include <linux/fs.h>
+#include <linux/kthread.h>
+#include <linux/list.h>
+
+#include "libbcachefs/util.h"
+#include "tools-util.h"
+
+#ifdef __linux__
+#include <linux/io_uring.h>
+#define BLKDEV_HAVE_IO_URING	1
+#endif
+
+static atomic_t running_requests;
+
+/*
+ * Per device IO statistics: latency time_stats (with histogram percentiles),
+ * throughput and queue depth, sampled at submit/complete in the shim.
+ * Dumped to stderr on SIGUSR1, and at exit if BCACHEFS_IO_STATS is set;
+ * setting BCACHEFS_IO_STACKS additionally captures the submitter's stack for
+ * every in flight op, dumped in folded (flamegraph) format.
+ */
+
+struct bdev_io_stats {
+	struct list_head	list;
+	char			name[BDEVNAME_SIZE];
+	struct time_stats	latency[2];	/* READ, WRITE */
+	atomic64_t		ios[2];
+	atomic64_t		sectors[2];
+	atomic_t		in_flight;
+	unsigned		peak_in_flight;
+};
+
+static LIST_HEAD(bdev_stats_list);
+static pthread_mutex_t bdev_stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static bool bdev_io_stacks;
+
+#define IO_STACK_DEPTH		16
+#define IO_STACK_NR		1024
+
+struct io_stack {
+	int			nr;	/* 0 = free */
+	void			*ips[IO_STACK_DEPTH];
+};
+
+static struct io_stack io_stacks[IO_STACK_NR];
+
+static void bdev_io_account_submit(struct bio *bio)
+{
+	struct bdev_io_stats *s = bio->bi_bdev->bd_stats;
+	int rw = op_is_write(bio->bi_opf);
+	int v;
+
+	if (!s)
+		return;
+
+	bio->bi_submit_time = local_clock();
+
+	atomic64_inc(&s->ios[rw]);
+	atomic64_add(bio_sectors(bio), &s->sectors[rw]);
+
+	v = atomic_inc_return(&s->in_flight);
+	if (v > s->peak_in_flight)
+		s->peak_in_flight = v;
+
+	if (bdev_io_stacks) {
+		unsigned i;
+
+		pthread_mutex_lock(&bdev_stats_lock);
+		for (i = 0; i < IO_STACK_NR; i++)
+			if (!io_stacks[i].nr) {
+				io_stacks[i].nr =
+					backtrace(io_stacks[i].ips,
+						  IO_STACK_DEPTH);
+				if (io_stacks[i].nr > 0)
+					bio->bi_stack = &io_stacks[i];
+				else
+					io_stacks[i].nr = 0;
+				break;
+			}
+		pthread_mutex_unlock(&bdev_stats_lock);
+	}
+}
+
+void bdev_io_account_complete(struct bio *bio)
+{
+	struct bdev_io_stats *s;
+
+	if (!bio->bi_submit_time || !bio->bi_bdev)
+		return;
+
+	s = bio->bi_bdev->bd_stats;
+	if (s) {
+		__bch2_time_stats_update(&s->latency[op_is_write(bio->bi_opf)],
+					 bio->bi_submit_time, local_clock());
+		atomic_dec(&s->in_flight);
+	}
+
+	if (bio->bi_stack) {
+		((struct io_stack *) bio->bi_stack)->nr = 0;
+		bio->bi_stack = NULL;
+	}
+
+	bio->bi_submit_time = 0;
+}
+
+static void bdev_io_stacks_dump(void)
+{
+	static struct io_stack snap[IO_STACK_NR];
+	unsigned i, j;
+
+	memcpy(snap, io_stacks, sizeof(snap));
+
+	for (i = 0; i < IO_STACK_NR; i++) {
+		unsigned count = 1;
+		char **syms;
+		int k;
+
+		if (snap[i].nr <= 0)
+			continue;
+
+		/* aggregate identical stacks: */
+		for (j = 0; j < i; j++)
+			if (snap[j].nr == snap[i].nr &&
+			    !memcmp(snap[j].ips, snap[i].ips,
+				    snap[i].nr * sizeof(void *)))
+				break;
+		if (j < i)
+			continue;
+
+		for (j = i + 1; j < IO_STACK_NR; j++)
+			count += snap[j].nr == snap[i].nr &&
+				!memcmp(snap[j].ips, snap[i].ips,
+					snap[i].nr * sizeof(void *));
+
+		syms = backtrace_symbols(snap[i].ips, snap[i].nr);
+		if (!syms)
+			continue;
+
+		/* folded format: root;...;leaf count */
+		for (k = snap[i].nr - 1; k >= 0; k--)
+			fprintf(stderr, "%s%c", syms[k], k ? ';' : ' ');
+		fprintf(stderr, "%u\n", count);
+		free(syms);
+	}
+}
+
+static void blkcache_stats_dump(void);
+
+static void bdev_io_stats_dump(void)
+{
+	static const char * const rw[] = { "read", "write" };
+	struct bdev_io_stats *s;
+	unsigned i;
+
+	pthread_mutex_lock(&bdev_stats_lock);
+	list_for_each_entry(s, &bdev_stats_list, list) {
+		fprintf(stderr, "\nio stats for %s: (in flight %i, peak %u)\n",
+			s->name,
+			atomic_read(&s->in_flight),
+			s->peak_in_flight);
+
+		for (i = 0; i < 2; i++) {
+			char buf[4096];
+			struct printbuf out = PBUF(buf);
+
+			if (!s->latency[i].count)
+				continue;
+
+			fprintf(stderr, "%ss: %llu ios, %llu sectors\n",
+				rw[i],
+				(u64) atomic64_read(&s->ios[i]),
+				(u64) atomic64_read(&s->sectors[i]));
+			bch2_time_stats_to_text(&out, &s->latency[i]);
+			fputs(buf, stderr);
+		}
+	}
+	pthread_mutex_unlock(&bdev_stats_lock);
+
+	blkcache_stats_dump();
+
+	if (bdev_io_stacks) {
+		fprintf(stderr, "\nin flight op stacks:\n");
+		bdev_io_stacks_dump();
+	}
+}
+
+/* best effort - not async signal safe, but this is for debugging: */
+static void bdev_io_stats_sigusr1(int sig)
+{
+	bdev_io_stats_dump();
+}
+
+/*
+ * The IO engine turns bios into whatever the host kernel wants to see - we
+ * default to libaio, with an opt-in io_uring engine (BCACHEFS_IO_ENGINE=
+ * io_uring) that avoids a syscall per bio and can run with SQPOLL
+ * (BCACHEFS_IO_URING_SQPOLL=1) for fully syscall-free submission.
+ */
+struct io_engine {
+	const char	*name;
+	int		(*init)(void);
+	void		(*exit)(void);
+	void		(*submit)(struct bio *, struct iovec *, unsigned);
+	void		(*flush_plug)(struct blk_plug *);
+	void		(*register_bdev)(struct block_device *);
+	void		(*unregister_bdev)(struct block_device *);
+};
+
+static const struct io_engine *io_engine;
+
+static __thread struct blk_plug *current_plug;
+
+/*
+ * We normally do buffered IO, which costs a copy through the page cache in
+ * each direction. When a bio's offset and every segment are block aligned we
+ * can submit it on the O_DIRECT fd instead and do zero-copy IO straight to
+ * the caller's pages; the buffered fd is the fallback for unaligned IO (and
+ * for paths, e.g. regular files on weird filesystems, where the O_DIRECT
+ * open failed):
+ */
+#define BLKDEV_DIRECT_ALIGN	4096
+
+static int bio_best_fd(struct bio *bio, struct iovec *iov, unsigned nr,
+		       int *fixed_idx)
+{
+	struct block_device *bdev = bio->bi_bdev;
+	unsigned i;
+
+	if (bio->bi_opf & REQ_FUA) {
+		*fixed_idx = bdev->bd_sync_fixed_idx;
+		return bdev->bd_sync_fd;
+	}
+
+	*fixed_idx = bdev->bd_fixed_idx;
+
+	if (bdev->bd_direct_fd < 0)
+		return bdev->bd_fd;
+
+	if ((bio->bi_iter.bi_sector << 9) & (BLKDEV_DIRECT_ALIGN - 1))
+		return bdev->bd_fd;
+
+	for (i = 0; i < nr; i++)
+		if (((unsigned long) iov[i].iov_base |
+		     iov[i].iov_len) & (BLKDEV_DIRECT_ALIGN - 1))
+			return bdev->bd_fd;
+
+	*fixed_idx = -1;
+	return bdev->bd_direct_fd;
+}
+
+/* libaio engine: */
+
+#define AIO_NR_COMPLETION_THREADS	4
+
+static io_context_t aio_ctx;
+
+/*
+ * FUA writes (i.e. journal writes) get their own submission context and
+ * completion thread: they're latency critical - fsync waits on them - and on
+ * the shared context they'd queue behind however much bulk IO happens to be in
+ * flight. With a device dedicated to the journal (format with
+ * --data_allowed=journal), fsync latency then reflects only that device:
+ */
+static io_context_t aio_sync_ctx;
+
+/*
+ * IOPRIO_PRIO_VALUE(IOPRIO_CLASS_RT, 0) - linux/ioprio.h isn't exported to
+ * userspace:
+ */
+#define BLKDEV_IOPRIO_RT		(1U << 13)
+
+/*
+ * io_submit() consumes the iovec synchronously, but a plugged iocb has to
+ * stay around until the plug is flushed:
+ */
+struct aio_io {
+	struct iocb	iocb;
+	struct iovec	iov[];
+};
+
+static void aio_submit_iocbs(io_context_t ctx, struct iocb **iocbs, unsigned nr)
+{
+	ssize_t ret;
+
+	while (nr) {
+		ret = io_submit(ctx, nr, iocbs);
+		if (ret == -EAGAIN || ret == -EINTR)
+			continue;
+		if (ret <= 0)
+			die("io_submit err: %s", strerror(-ret));
+
+		iocbs	+= ret;
+		nr	-= ret;
+	}
+}
+
+static int aio_iocb_cmp(const void *_l, const void *_r)
+{
+	const struct iocb *l = *(const struct iocb * const *) _l;
+	const struct iocb *r = *(const struct iocb * const *) _r;
+
+	if (l->aio_fildes != r->aio_fildes)
+		return l->aio_fildes < r->aio_fildes ? -1 : 1;
+	if (l->u.v.offset != r->u.v.offset)
+		return l->u.v.offset < r->u.v.offset ? -1 : 1;
+	return 0;
+}
+
+static void aio_flush_plug(struct blk_plug *plug)
+{
+	/*
+	 * Sort plugged requests by device and LBA before submission, elevator
+	 * style: physically contiguous reads of different logical ranges then
+	 * arrive at the host kernel adjacent and in order, where the block
+	 * layer can merge them into a few large device commands:
+	 */
+	qsort(plug->reqs, plug->nr, sizeof(plug->reqs[0]), aio_iocb_cmp);
+
+	aio_submit_iocbs(aio_ctx, (struct iocb **) plug->reqs, plug->nr);
+	plug->nr = 0;
+}
+
+static void aio_submit_bio(struct bio *bio, struct iovec *iov, unsigned nr)
+{
+	struct aio_io *io;
+	struct iocb *iocbp;
+	int fixed_idx;
+
+	io = malloc(sizeof(*io) + sizeof(io->iov[0]) * nr);
+	if (!io)
+		die("insufficient memory");
+
+	memcpy(io->iov, iov, sizeof(io->iov[0]) * nr);
+
+	memset(&io->iocb, 0, sizeof(io->iocb));
+	io->iocb.data		= bio;
+	io->iocb.aio_fildes	= bio_best_fd(bio, io->iov, nr, &fixed_idx);
+	io->iocb.aio_lio_opcode	= bio_op(bio) == REQ_OP_READ
+		? IO_CMD_PREADV
+		: IO_CMD_PWRITEV;
+	io->iocb.u.v.vec	= io->iov;
+	io->iocb.u.v.nr		= nr;
+	io->iocb.u.v.offset	= bio->bi_iter.bi_sector << 9;
+
+	if (bio->bi_opf & REQ_FUA) {
+		/*
+		 * Never plugged - a FUA write is by definition one the caller
+		 * is about to wait on, and batching it behind bulk IO would
+		 * defeat the dedicated context:
+		 */
+#ifdef IOCB_FLAG_IOPRIO
+		io->iocb.u.c.flags	|= IOCB_FLAG_IOPRIO;
+		io->iocb.aio_reqprio	= BLKDEV_IOPRIO_RT;
+#endif
+		iocbp = &io->iocb;
+		aio_submit_iocbs(aio_sync_ctx, &iocbp, 1);
+		return;
+	}
+
+	if (current_plug) {
+		if (current_plug->nr == BLK_PLUG_MAX)
+			aio_flush_plug(current_plug);
+
+		current_plug->reqs[current_plug->nr++] = &io->iocb;
+		return;
+	}
+
+	iocbp = &io->iocb;
+	aio_submit_iocbs(aio_ctx, &iocbp, 1);
+}
+
+static bool aio_stop;
+
+static int aio_completion_thread(void *arg)
+{
+	io_context_t ctx = arg;
+	struct io_event events[8], *ev;
+	int ret;
+	bool stop = false;
+
+	while (!stop) {
+		/*
+		 * Finite timeout: which reaper a given event (including the
+		 * shutdown wakeup) lands on is up to the kernel, so every
+		 * thread has to poll the stop flag:
+		 */
+		struct timespec timeout = { .tv_nsec = 100 * 1000 * 1000 };
+
+		ret = io_getevents(ctx, 1, ARRAY_SIZE(events),
+				   events, &timeout);
+
+		if (!ret || ret == -EINTR) {
+			if (READ_ONCE(aio_stop))
+				break;
+			continue;
+		}
+		if (ret < 0)
+			die("io_getevents() error: %s", strerror(-ret));
+
+		for (ev = events; ev < events + ret; ev++) {
+			struct bio *bio = (struct bio *) ev->data;
+
+			/* This should only happen during blkdev_cleanup() */
+			if (!bio) {
+				BUG_ON(atomic_read(&running_requests) != 0);
+				stop = true;
+				continue;
+			}
+
+			if (ev->res != bio->bi_iter.bi_size)
+				bio->bi_status = BLK_STS_IOERR;
+
+			free(container_of(ev->obj, struct aio_io, iocb));
+			bio_endio(bio);
+			atomic_dec(&running_requests);
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Checksum verification runs from the endio callback: reap completions on
+ * several threads so it isn't serialized behind one io_getevents() loop.
+ * io_getevents() on a shared context is thread safe; the kernel distributes
+ * events among concurrent callers.
+ */
+static struct task_struct *aio_tasks[AIO_NR_COMPLETION_THREADS + 1];
+static unsigned aio_nr_threads;
+
+static int aio_init(void)
+{
+	struct task_struct *p;
+	long nr_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	unsigned i;
+
+	if (io_setup(256, &aio_ctx))
+		return -errno;
+
+	if (io_setup(64, &aio_sync_ctx)) {
+		io_destroy(aio_ctx);
+		return -errno;
+	}
+
+	aio_nr_threads = min_t(unsigned, AIO_NR_COMPLETION_THREADS,
+			       max_t(long, nr_cpus, 1));
+
+	for (i = 0; i < aio_nr_threads; i++) {
+		p = kthread_run(aio_completion_thread, aio_ctx,
+				"aio_completion/%u", i);
+		BUG_ON(IS_ERR(p));
+		aio_tasks[i] = p;
+	}
+
+	/*
+	 * One reaper suffices for the sync context - the journal only has a
+	 * single write in flight at a time:
+	 */
+	p = kthread_run(aio_completion_thread, aio_sync_ctx,
+			"aio_sync_completion");
+	BUG_ON(IS_ERR(p));
+	aio_tasks[aio_nr_threads++] = p;
+
+	return 0;
+}
+
+static void aio_exit(void)
+{
+	unsigned i;
+
+	WRITE_ONCE(aio_stop, true);
+	smp_mb();
+
+	/* I mean, really?! IO_CMD_NOOP is even defined, but not implemented. */
+	int fds[2];
+	int ret = pipe(fds);
+	if (ret != 0)
+		die("pipe err: %s", strerror(ret));
+
+	/* Wake up one completion thread with spurious work; the stop flag
+	 * catches the rest. */
+	int junk = 0;
+	struct iocb iocb = {
+		.aio_lio_opcode = IO_CMD_PWRITE,
+		.data = NULL, /* Signal to stop */
+		.aio_fildes = fds[1],
+		.u.c.buf = &junk,
+		.u.c.nbytes = 1,
+	}, *iocbp = &iocb;
+	ret = io_submit(aio_ctx, 1, &iocbp);
+	if (ret != 1)
+		die("io_submit cleanup err: %s", strerror(-ret));
+
+	/* io_submit() copies the iocb; safe to reuse for the sync context: */
+	ret = io_submit(aio_sync_ctx, 1, &iocbp);
+	if (ret != 1)
+		die("io_submit cleanup err: %s", strerror(-ret));
+
+	for (i = 0; i < aio_nr_threads; i++) {
+		struct task_struct *p = NULL;
+		swap(aio_tasks[i], p);
+		get_task_struct(p);
+
+		ret = kthread_stop(p);
+		BUG_ON(ret);
+
+		put_task_struct(p);
+	}
+
+	close(fds[0]);
+	close(fds[1]);
+}
+
+static const struct io_engine aio_engine = {
+	.name		= "aio",
+	.init		= aio_init,
+	.exit		= aio_exit,
+	.submit		= aio_submit_bio,
+	.flush_plug	= aio_flush_plug,
+};
+
+/* io_uring engine: */
+
+#ifdef BLKDEV_HAVE_IO_URING
+
+#ifndef __NR_io_uring_setup
+#define __NR_io_uring_setup	425
+#endif
+#ifndef __NR_io_uring_enter
+#define __NR_io_uring_enter	426
+#endif
+#ifndef __NR_io_uring_register
+#define __NR_io_uring_register	427
+#endif
+
+#define URING_ENTRIES		256
+#define URING_MAX_FILES		256
+
+struct uring_io {
+	struct bio	*bio;
+	struct iovec	iov[];
+};
+
+static struct {
+	int		ring_fd;
+	bool		sqpoll;
+	pthread_mutex_t	lock;
+
+	struct {
+		unsigned	*khead;
+		unsigned	*ktail;
+		unsigned	*kflags;
+		unsigned	*array;
+		unsigned	mask;
+		struct io_uring_sqe *sqes;
+	} sq;
+
+	struct {
+		unsigned	*khead;
+		unsigned	*ktail;
+		unsigned	mask;
+		struct io_uring_cqe *cqes;
+	} cq;
+
+	bool		files_registered;
+	int		registered_fds[URING_MAX_FILES];
+} uring;
+
+static struct task_struct *uring_task;
+
+static int io_uring_setup(unsigned entries, struct io_uring_params *p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int io_uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+			  unsigned flags)
+{
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+		       flags, NULL, 0);
+}
+
+static int io_uring_register(int fd, unsigned opcode, void *arg, unsigned nr)
+{
+	return syscall(__NR_io_uring_register, fd, opcode, arg, nr);
+}
+
+static void uring_submit_pending(struct blk_plug *plug)
+{
+	unsigned pending = plug->pending;
+	int ret;
+
+	plug->pending = 0;
+
+	if (pending) {
+		ret = io_uring_enter(uring.ring_fd, pending, 0, 0);
+		if (ret < 0)
+			die("io_uring_enter err: %m");
+	}
+}
+
+static void uring_submit_sqe(struct io_uring_sqe *sqe)
+{
+	unsigned tail, idx;
+	int ret;
+
+	pthread_mutex_lock(&uring.lock);
+
+	/* Bound deferred batches, like the aio engine: */
+	if (current_plug && !uring.sqpoll &&
+	    current_plug->pending == BLK_PLUG_MAX)
+		uring_submit_pending(current_plug);
+
+	tail = *uring.sq.ktail;
+
+	/*
+	 * SQ full: without SQPOLL the kernel only consumes sqes in
+	 * io_uring_enter(), so if we have a deferred batch outstanding it has
+	 * to be submitted before waiting - khead won't advance past it and
+	 * we'd spin here forever:
+	 */
+	while (tail - smp_load_acquire(uring.sq.khead) >= URING_ENTRIES) {
+		if (current_plug && current_plug->pending)
+			uring_submit_pending(current_plug);
+		else
+			sched_yield();
+	}
+
+	idx = tail & uring.sq.mask;
+	uring.sq.sqes[idx]	= *sqe;
+	uring.sq.array[idx]	= idx;
+	smp_store_release(uring.sq.ktail, tail + 1);
+
+	if (current_plug && !uring.sqpoll) {
+		/* Defer the enter syscall to blk_finish_plug(): */
+		current_plug->pending++;
+		pthread_mutex_unlock(&uring.lock);
+		return;
+	}
+
+	if (!uring.sqpoll) {
+		ret = io_uring_enter(uring.ring_fd, 1, 0, 0);
+		if (ret < 0)
+			die("io_uring_enter err: %m");
+	} else if (smp_load_acquire(uring.sq.kflags) & IORING_SQ_NEED_WAKEUP) {
+		ret = io_uring_enter(uring.ring_fd, 0, 0,
+				     IORING_ENTER_SQ_WAKEUP);
+		if (ret < 0)
+			die("io_uring_enter err: %m");
+	}
+
+	pthread_mutex_unlock(&uring.lock);
+}
+
+static void uring_submit_bio(struct bio *bio, struct iovec *iov, unsigned nr)
+{
+	struct uring_io *io;
+	struct io_uring_sqe sqe;
+	int fixed_idx;
+	int fd;
+
+	/*
+	 * Unlike io_submit(), the sqe may be consumed after we return (SQPOLL)
+	 * - the iovec has to live until completion:
+	 */
+	io = malloc(sizeof(*io) + sizeof(io->iov[0]) * nr);
+	if (!io)
+		die("insufficient memory");
+
+	io->bio = bio;
+	memcpy(io->iov, iov, sizeof(io->iov[0]) * nr);
+
+	fd = bio_best_fd(bio, io->iov, nr, &fixed_idx);
+
+	memset(&sqe, 0, sizeof(sqe));
+	sqe.opcode	= bio_op(bio) == REQ_OP_READ
+		? IORING_OP_READV
+		: IORING_OP_WRITEV;
+	sqe.addr	= (unsigned long) io->iov;
+	sqe.len		= nr;
+	sqe.off		= bio->bi_iter.bi_sector << 9;
+	sqe.user_data	= (unsigned long) io;
+
+	/*
+	 * FUA writes (journal writes) jump the device queue: there's no
+	 * separate ring for them, but RT ioprio gets them dispatched ahead of
+	 * queued bulk IO:
+	 */
+	if (bio->bi_opf & REQ_FUA)
+		sqe.ioprio	= BLKDEV_IOPRIO_RT;
+
+	if (fixed_idx >= 0) {
+		sqe.fd		= fixed_idx;
+		sqe.flags	|= IOSQE_FIXED_FILE;
+	} else {
+		sqe.fd		= fd;
+	}
+
+	uring_submit_sqe(&sqe);
+}
+
+static int uring_completion_thread(void *arg)
+{
+	bool stop = false;
+
+	while (!stop) {
+		unsigned head = *uring.cq.khead;
+		unsigned nr = 0;
+
+		while (head != smp_load_acquire(uring.cq.ktail)) {
+			struct io_uring_cqe *cqe =
+				&uring.cq.cqes[head & uring.cq.mask];
+			struct uring_io *io =
+				(struct uring_io *) (unsigned long) cqe->user_data;
+
+			if (!io) {
+				/* From blkdev_cleanup() */
+				BUG_ON(atomic_read(&running_requests) != 0);
+				stop = true;
+			} else {
+				struct bio *bio = io->bio;
+
+				if (cqe->res != bio->bi_iter.bi_size)
+					bio->bi_status = BLK_STS_IOERR;
+
+				bio_endio(bio);
+				free(io);
+				atomic_dec(&running_requests);
+			}
+
+			head++;
+			nr++;
+		}
+
+		smp_store_release(uring.cq.khead, head);
+
+		if (!nr && !stop) {
+			int ret = io_uring_enter(uring.ring_fd, 0, 1,
+						 IORING_ENTER_GETEVENTS);
+			if (ret < 0 && errno != EINTR)
+				die("io_uring_enter err: %m");
+		}
+	}
+
+	return 0;
+}
+
+static void uring_register_bdev(struct block_device *bdev)
+{
+#ifdef IORING_REGISTER_FILES_UPDATE
+	struct io_uring_files_update update;
+	unsigned i;
+
+	if (!uring.files_registered)
+		return;
+
+	pthread_mutex_lock(&uring.lock);
+
+	for (i = 0; i + 1 < URING_MAX_FILES; i++)
+		if (uring.registered_fds[i] == -1 &&
+		    uring.registered_fds[i + 1] == -1)
+			break;
+
+	if (i + 1 < URING_MAX_FILES) {
+		__s32 fds[2] = { bdev->bd_fd, bdev->bd_sync_fd };
+
+		uring.registered_fds[i]		= bdev->bd_fd;
+		uring.registered_fds[i + 1]	= bdev->bd_sync_fd;
+
+		memset(&update, 0, sizeof(update));
+		update.offset	= i;
+		update.fds	= (unsigned long) fds;
+
+		if (io_uring_register(uring.ring_fd,
+				      IORING_REGISTER_FILES_UPDATE,
+				      &update, 2) == 2) {
+			bdev->bd_fixed_idx	= i;
+			bdev->bd_sync_fixed_idx	= i + 1;
+		} else {
+			uring.registered_fds[i]		= -1;
+			uring.registered_fds[i + 1]	= -1;
+		}
+	}
+
+	pthread_mutex_unlock(&uring.lock);
+#endif
+}
+
+static void uring_unregister_bdev(struct block_device *bdev)
+{
+#ifdef IORING_REGISTER_FILES_UPDATE
+	struct io_uring_files_update update;
+	__s32 fds[2] = { -1, -1 };
+
+	if (bdev->bd_fixed_idx < 0)
+		return;
+
+	pthread_mutex_lock(&uring.lock);
+
+	uring.registered_fds[bdev->bd_fixed_idx]	= -1;
+	uring.registered_fds[bdev->bd_sync_fixed_idx]	= -1;
+
+	memset(&update, 0, sizeof(update));
+	update.offset	= bdev->bd_fixed_idx;
+	update.fds	= (unsigned long) fds;
+
+	io_uring_register(uring.ring_fd, IORING_REGISTER_FILES_UPDATE,
+			  &update, 2);
+
+	bdev->bd_fixed_idx	= -1;
+	bdev->bd_sync_fixed_idx	= -1;
+
+	pthread_mutex_unlock(&uring.lock);
+#endif
+}
+
+static int uring_init(void)
+{
+	struct io_uring_params p;
+	struct task_struct *t;
+	size_t sq_size, cq_size;
+	void *sq_ring, *cq_ring;
+	unsigned i;
+	int fd;
+
+	memset(&p, 0, sizeof(p));
+
+	if (getenv("BCACHEFS_IO_URING_SQPOLL")) {
+		p.flags |= IORING_SETUP_SQPOLL;
+		p.sq_thread_idle = 1000;
+	}
+
+	fd = io_uring_setup(URING_ENTRIES, &p);
+	if (fd < 0 && (p.flags & IORING_SETUP_SQPOLL)) {
+		/* SQPOLL needs privileges - fall back to plain rings: */
+		memset(&p, 0, sizeof(p));
+		fd = io_uring_setup(URING_ENTRIES, &p);
+	}
+	if (fd < 0)
+		return -errno;
+
+	uring.ring_fd	= fd;
+	uring.sqpoll	= (p.flags & IORING_SETUP_SQPOLL) != 0;
+	pthread_mutex_init(&uring.lock, NULL);
+
+	sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	cq_size = p.cq_off.cqes  + p.cq_entries * sizeof(struct io_uring_cqe);
+
+	sq_ring = mmap(NULL, sq_size, PROT_READ|PROT_WRITE,
+		       MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+	cq_ring = mmap(NULL, cq_size, PROT_READ|PROT_WRITE,
+		       MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+	uring.sq.sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+			     PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE,
+			     fd, IORING_OFF_SQES);
+	if (sq_ring == MAP_FAILED ||
+	    cq_ring == MAP_FAILED ||
+	    uring.sq.sqes == MAP_FAILED)
+		die("io_uring mmap error: %m");
+
+	uring.sq.khead	= sq_ring + p.sq_off.head;
+	uring.sq.ktail	= sq_ring + p.sq_off.tail;
+	uring.sq.kflags	= sq_ring + p.sq_off.flags;
+	uring.sq.array	= sq_ring + p.sq_off.array;
+	uring.sq.mask	= *(unsigned *) (sq_ring + p.sq_off.ring_mask);
+
+	uring.cq.khead	= cq_ring + p.cq_off.head;
+	uring.cq.ktail	= cq_ring + p.cq_off.tail;
+	uring.cq.mask	= *(unsigned *) (cq_ring + p.cq_off.ring_mask);
+	uring.cq.cqes	= cq_ring + p.cq_off.cqes;
+
+	/*
+	 * Sparse fixed file table, filled in as devices are opened - SQPOLL
+	 * requires registered files, and they skip fdget() overhead
+	 * everywhere else:
+	 */
+	for (i = 0; i < URING_MAX_FILES; i++)
+		uring.registered_fds[i] = -1;
+
+	uring.files_registered =
+		io_uring_register(fd, IORING_REGISTER_FILES,
+				  uring.registered_fds, URING_MAX_FILES) == 0;
+
+	t = kthread_run(uring_completion_thread, NULL, "uring_completion");
+	BUG_ON(IS_ERR(t));
+	uring_task = t;
+
+	return 0;
+}
 
-#include <alloca.h>
-#include <errno.h>
-#include <fcntl.h>
-#include <sys/ioctl.h>
-#include <sys/stat.h>
-#include <sys/types.h>
-#include <sys/uio.h>
-#include <unistd.h>
+static void uring_exit(void)
+{
+	struct io_uring_sqe sqe;
+	struct task_struct *t = NULL;
 
-#include <libaio.h>
+	swap(uring_task, t);
+	get_task_struct(t);
 
-#ifdef CONFIG_VALGRIND
-#include <valgrind/memcheck.h>
-#endif
+	memset(&sqe, 0, sizeof(sqe));
+	sqe.opcode	= IORING_OP_NOP;
+	sqe.user_data	= 0; /* Signal to stop */
 
-#include <linux/bio.h>
-#include <linux/blkdev.h>
-#include <linux/completion.h>
-#include <linux/fs.h>
-#include <linux/kthread.h>
+	uring_submit_sqe(&sqe);
 
-#include "tools-util.h"
+	BUG_ON(kthread_stop(t));
+	put_task_struct(t);
 
-static io_context_t aio_ctx;
-static atomic_t running_requests;
+	close(uring.ring_fd);
+}
+
+static void uring_flush_plug(struct blk_plug *plug)
+{
+	uring_submit_pending(plug);
+}
+
+static const struct io_engine uring_engine = {
+	.name			= "io_uring",
+	.init			= uring_init,
+	.exit			= uring_exit,
+	.submit			= uring_submit_bio,
+	.flush_plug		= uring_flush_plug,
+	.register_bdev		= uring_register_bdev,
+	.unregister_bdev	= uring_unregister_bdev,
+};
+
+#endif /* BLKDEV_HAVE_IO_URING */
+
+void blk_start_plug(struct blk_plug *plug)
+{
+	/* Plugs don't nest, matching the kernel: */
+	if (current_plug)
+		return;
+
+	plug->nr	= 0;
+	plug->pending	= 0;
+	current_plug	= plug;
+}
+
+void blk_finish_plug(struct blk_plug *plug)
+{
+	if (current_plug != plug)
+		return;
+
+	current_plug = NULL;
+
+	if (io_engine->flush_plug)
+		io_engine->flush_plug(plug);
+}
+
+/*
+ * Async discard queue: discards come from the allocator thread, and a slow
+ * FTL discard would otherwise stall every submission behind it. Queue them
+ * for a dedicated worker instead (in flight count bounded at one), merging
+ * adjacent ranges, so foreground IO latency is isolated from discard storms
+ * after large deletes.
+ *
+ * Discards are only a hint, so when the queue fills up new ones are simply
+ * dropped - but a discard must never be applied after the range has been
+ * rewritten, so writes cancel queued discards they overlap and wait out an
+ * overlapping discard that's already in flight.
+ */
+
+#define DISCARD_QUEUE_MAX	1024
+
+struct discard_range {
+	struct list_head	list;
+	struct block_device	*bdev;
+	u64			sector;
+	u64			nr_sects;
+};
+
+static LIST_HEAD(discard_queue);
+static unsigned discard_queue_nr;
+static struct discard_range discard_in_flight;	/* .bdev NULL when idle */
+static atomic_t discard_nr_pending;		/* queued + in flight */
+static pthread_mutex_t discard_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t discard_work = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t discard_done = PTHREAD_COND_INITIALIZER;
+
+static bool discard_overlaps(struct discard_range *r, struct block_device *bdev,
+			     u64 sector, u64 nr_sects)
+{
+	return r->bdev == bdev &&
+		r->sector < sector + nr_sects &&
+		sector < r->sector + r->nr_sects;
+}
+
+static void discard_one(struct block_device *bdev, u64 sector, u64 nr_sects)
+{
+	struct stat statbuf;
+
+	if (fstat(bdev->bd_fd, &statbuf))
+		return;
+
+	/* errors (e.g. EOPNOTSUPP) deliberately ignored - it's only a hint */
+	if (S_ISBLK(statbuf.st_mode)) {
+		u64 range[2] = { sector << 9, nr_sects << 9 };
+
+		ioctl(bdev->bd_fd, BLKDISCARD, range);
+	} else {
+		fallocate(bdev->bd_fd,
+			  FALLOC_FL_PUNCH_HOLE|FALLOC_FL_KEEP_SIZE,
+			  sector << 9, nr_sects << 9);
+	}
+}
+
+static int discard_thread(void *arg)
+{
+	struct discard_range *r;
+
+	pthread_mutex_lock(&discard_lock);
+	while (1) {
+		while (list_empty(&discard_queue))
+			pthread_cond_wait(&discard_work, &discard_lock);
+
+		r = list_first_entry(&discard_queue, struct discard_range, list);
+		list_del(&r->list);
+		discard_queue_nr--;
+		discard_in_flight = *r;
+		free(r);
+
+		pthread_mutex_unlock(&discard_lock);
+		discard_one(discard_in_flight.bdev,
+			    discard_in_flight.sector,
+			    discard_in_flight.nr_sects);
+		pthread_mutex_lock(&discard_lock);
+
+		discard_in_flight.bdev = NULL;
+		atomic_dec(&discard_nr_pending);
+		pthread_cond_broadcast(&discard_done);
+	}
+
+	return 0;
+}
+
+static pthread_once_t discard_once = PTHREAD_ONCE_INIT;
+
+static void discard_thread_init(void)
+{
+	BUG_ON(IS_ERR(kthread_run(discard_thread, NULL, "discard")));
+}
+
+/*
+ * Called on write submission: a queued discard that overlaps the write would
+ * destroy the new data if it was issued afterwards:
+ */
+static void discard_write_barrier(struct block_device *bdev,
+				  u64 sector, u64 nr_sects)
+{
+	struct discard_range *r, *t;
+
+	if (likely(!atomic_read(&discard_nr_pending)))
+		return;
+
+	pthread_mutex_lock(&discard_lock);
+
+	list_for_each_entry_safe(r, t, &discard_queue, list)
+		if (discard_overlaps(r, bdev, sector, nr_sects)) {
+			list_del(&r->list);
+			discard_queue_nr--;
+			atomic_dec(&discard_nr_pending);
+			free(r);
+		}
+
+	while (discard_in_flight.bdev &&
+	       discard_overlaps(&discard_in_flight, bdev, sector, nr_sects))
+		pthread_cond_wait(&discard_done, &discard_lock);
+
+	pthread_mutex_unlock(&discard_lock);
+}
+
+/* Drop queued discards for @bdev and wait out an in flight one, for close: */
+static void discard_bdev_flush(struct block_device *bdev)
+{
+	struct discard_range *r, *t;
+
+	pthread_mutex_lock(&discard_lock);
+
+	list_for_each_entry_safe(r, t, &discard_queue, list)
+		if (r->bdev == bdev) {
+			list_del(&r->list);
+			discard_queue_nr--;
+			atomic_dec(&discard_nr_pending);
+			free(r);
+		}
+
+	while (discard_in_flight.bdev == bdev)
+		pthread_cond_wait(&discard_done, &discard_lock);
+
+	pthread_mutex_unlock(&discard_lock);
+}
+
+/*
+ * Optional userspace block cache (BCACHEFS_BLOCK_CACHE=<size in MB>, default
+ * 128 if no size given): multi phase commands re-read the same metadata over
+ * and over - fsck reads the journal, then runs gc, then the passes proper -
+ * and when those reads are aligned they go via the O_DIRECT fd and bypass the
+ * host page cache entirely. Reads are cached whole, keyed by exact (device,
+ * sector, length); writes invalidate everything they overlap. Hit/miss
+ * counters are included in the BCACHEFS_IO_STATS/SIGUSR1 dump.
+ *
+ * Eviction is scan resistant, ARC style but simpler: entries start on a "once"
+ * list and move to a "repeat" list on their first hit, and eviction takes from
+ * the once list first - so one large sequential pass can't flush the metadata
+ * that's actually being re-read.
+ */
+
+#define BLKCACHE_HASH_BITS	12
+#define BLKCACHE_HASH_SIZE	(1U << BLKCACHE_HASH_BITS)
+#define BLKCACHE_MAX_IO		(1U << 20)
+
+struct blkcache_entry {
+	struct list_head	hash;
+	struct list_head	lru;
+	struct block_device	*bdev;
+	u64			sector;
+	unsigned		bytes;
+	char			data[];
+};
+
+/* Saved completion, for filling the cache when the read finishes: */
+struct blkcache_fill {
+	bio_end_io_t		*end_io;
+	void			*private;
+	unsigned long		write_gen;
+};
+
+static struct {
+	size_t			size_max;	/* 0 = disabled */
+	size_t			size;
+	/*
+	 * Bumped on every write: an entry must not be filled from a read that
+	 * was in flight when a write landed, so fills check the generation they
+	 * were submitted under. One global counter, not per device - writes
+	 * during the read heavy phases this cache is for are rare:
+	 */
+	unsigned long		write_gen;
+	struct list_head	hash[BLKCACHE_HASH_SIZE];
+	struct list_head	once_lru;
+	struct list_head	repeat_lru;
+	pthread_mutex_t		lock;
+	atomic64_t		hits;
+	atomic64_t		misses;
+	atomic64_t		evictions;
+} blkcache = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static struct list_head *blkcache_hash(struct block_device *bdev, u64 sector)
+{
+	unsigned long h = ((unsigned long) bdev >> 6) ^ sector;
+
+	return &blkcache.hash[h & (BLKCACHE_HASH_SIZE - 1)];
+}
+
+static struct blkcache_entry *blkcache_find(struct block_device *bdev,
+					    u64 sector, unsigned bytes)
+{
+	struct blkcache_entry *e;
+
+	list_for_each_entry(e, blkcache_hash(bdev, sector), hash)
+		if (e->bdev == bdev &&
+		    e->sector == sector &&
+		    e->bytes == bytes)
+			return e;
+	return NULL;
+}
+
+static void blkcache_drop(struct blkcache_entry *e)
+{
+	list_del(&e->hash);
+	list_del(&e->lru);
+	blkcache.size -= e->bytes;
+	free(e);
+}
+
+static void blkcache_fill_endio(struct bio *bio)
+{
+	struct blkcache_fill *fill = bio->bi_private;
+	unsigned bytes = bio->bi_iter.bi_size;
+
+	bio->bi_end_io	= fill->end_io;
+	bio->bi_private	= fill->private;
+
+	if (!bio->bi_status) {
+		pthread_mutex_lock(&blkcache.lock);
+
+		if (fill->write_gen == blkcache.write_gen &&
+		    !blkcache_find(bio->bi_bdev, bio->bi_iter.bi_sector, bytes)) {
+			struct blkcache_entry *e = malloc(sizeof(*e) + bytes);
+
+			if (e) {
+				struct bvec_iter iter;
+				struct bio_vec bv;
+				unsigned offset = 0;
+
+				e->bdev		= bio->bi_bdev;
+				e->sector	= bio->bi_iter.bi_sector;
+				e->bytes	= bytes;
+
+				bio_for_each_segment(bv, bio, iter) {
+					memcpy(e->data + offset,
+					       page_address(bv.bv_page) +
+					       bv.bv_offset, bv.bv_len);
+					offset += bv.bv_len;
+				}
+
+				list_add(&e->hash,
+					 blkcache_hash(e->bdev, e->sector));
+				list_add(&e->lru, &blkcache.once_lru);
+				blkcache.size += bytes;
+
+				while (blkcache.size > blkcache.size_max) {
+					struct list_head *lru =
+						!list_empty(&blkcache.once_lru)
+						? &blkcache.once_lru
+						: &blkcache.repeat_lru;
+
+					blkcache_drop(list_last_entry(lru,
+						struct blkcache_entry, lru));
+					atomic64_inc(&blkcache.evictions);
+				}
+			}
+		}
+
+		pthread_mutex_unlock(&blkcache.lock);
+	}
+
+	free(fill);
+	/* bio_endio() already did the accounting - just run the completion: */
+	if (bio->bi_end_io)
+		bio->bi_end_io(bio);
+}
+
+/* Returns true if the bio was completed from cache: */
+static bool blkcache_read(struct bio *bio)
+{
+	struct blkcache_entry *e;
+	struct blkcache_fill *fill;
+
+	if (!blkcache.size_max ||
+	    bio->bi_iter.bi_size > BLKCACHE_MAX_IO)
+		return false;
+
+	pthread_mutex_lock(&blkcache.lock);
+
+	e = blkcache_find(bio->bi_bdev, bio->bi_iter.bi_sector,
+			  bio->bi_iter.bi_size);
+	if (e) {
+		struct bvec_iter iter;
+		struct bio_vec bv;
+		unsigned offset = 0;
+
+		bio_for_each_segment(bv, bio, iter) {
+			memcpy(page_address(bv.bv_page) + bv.bv_offset,
+			       e->data + offset, bv.bv_len);
+			offset += bv.bv_len;
+		}
+
+		list_move(&e->lru, &blkcache.repeat_lru);
+		atomic64_inc(&blkcache.hits);
+		pthread_mutex_unlock(&blkcache.lock);
+
+		bio_endio(bio);
+		return true;
+	}
+
+	atomic64_inc(&blkcache.misses);
+
+	/* Fill the cache when this read completes: */
+	fill = malloc(sizeof(*fill));
+	if (fill) {
+		fill->end_io	= bio->bi_end_io;
+		fill->private	= bio->bi_private;
+		fill->write_gen	= blkcache.write_gen;
+		bio->bi_end_io	= blkcache_fill_endio;
+		bio->bi_private	= fill;
+	}
+
+	pthread_mutex_unlock(&blkcache.lock);
+	return false;
+}
+
+static void blkcache_write_invalidate(struct bio *bio)
+{
+	struct blkcache_entry *e, *t;
+	u64 sector	= bio->bi_iter.bi_sector;
+	u64 end		= sector + bio_sectors(bio);
+
+	if (!blkcache.size_max)
+		return;
+
+	pthread_mutex_lock(&blkcache.lock);
+
+	blkcache.write_gen++;
+
+	list_for_each_entry_safe(e, t, &blkcache.once_lru, lru)
+		if (e->bdev == bio->bi_bdev &&
+		    e->sector < end &&
+		    sector < e->sector + (e->bytes >> 9))
+			blkcache_drop(e);
+
+	list_for_each_entry_safe(e, t, &blkcache.repeat_lru, lru)
+		if (e->bdev == bio->bi_bdev &&
+		    e->sector < end &&
+		    sector < e->sector + (e->bytes >> 9))
+			blkcache_drop(e);
+
+	pthread_mutex_unlock(&blkcache.lock);
+}
+
+/* For blkdev_put() - the bdev pointer may be reused by a later open: */
+static void blkcache_drop_bdev(struct block_device *bdev)
+{
+	struct blkcache_entry *e, *t;
+
+	if (!blkcache.size_max)
+		return;
+
+	pthread_mutex_lock(&blkcache.lock);
+
+	blkcache.write_gen++;
+
+	list_for_each_entry_safe(e, t, &blkcache.once_lru, lru)
+		if (e->bdev == bdev)
+			blkcache_drop(e);
+
+	list_for_each_entry_safe(e, t, &blkcache.repeat_lru, lru)
+		if (e->bdev == bdev)
+			blkcache_drop(e);
+
+	pthread_mutex_unlock(&blkcache.lock);
+}
+
+static void blkcache_stats_dump(void)
+{
+	u64 hits	= atomic64_read(&blkcache.hits);
+	u64 misses	= atomic64_read(&blkcache.misses);
+
+	if (!blkcache.size_max)
+		return;
+
+	fprintf(stderr, "\nblock cache: %llu hits, %llu misses (%llu%% hit rate), %zu bytes cached, %llu evictions\n",
+		hits, misses,
+		hits + misses ? hits * 100 / (hits + misses) : 0,
+		blkcache.size,
+		(u64) atomic64_read(&blkcache.evictions));
+}
+
+static void blkcache_init(void)
+{
+	const char *cache = getenv("BCACHEFS_BLOCK_CACHE");
+	unsigned long mb;
+	unsigned i;
+
+	if (!cache)
+		return;
+
+	mb = strtoul(cache, NULL, 10);
+	if (!mb)
+		mb = 128;
+
+	for (i = 0; i < BLKCACHE_HASH_SIZE; i++)
+		INIT_LIST_HEAD(&blkcache.hash[i]);
+	INIT_LIST_HEAD(&blkcache.once_lru);
+	INIT_LIST_HEAD(&blkcache.repeat_lru);
+
+	blkcache.size_max = mb << 20;
+}
 
 void generic_make_request(struct bio *bio)
 {
@@ -66,35 +1433,19 @@ void generic_make_request(struct bio *bio)
 #endif
 	}
 
-	struct iocb iocb = {
-		.data		= bio,
-		.aio_fildes	= bio->bi_opf & REQ_FUA
-			? bio->bi_bdev->bd_sync_fd
-			: bio->bi_bdev->bd_fd,
-	}, *iocbp = &iocb;
-
 	switch (bio_op(bio)) {
-	case REQ_OP_READ:
-		iocb.aio_lio_opcode	= IO_CMD_PREADV;
-		iocb.u.v.vec		= iov;
-		iocb.u.v.nr		= i;
-		iocb.u.v.offset		= bio->bi_iter.bi_sector << 9;
-
-		atomic_inc(&running_requests);
-		ret = io_submit(aio_ctx, 1, &iocbp);
-		if (ret != 1)
-			die("io_submit err: %s", strerror(-ret));
-		break;
 	case REQ_OP_WRITE:
-		iocb.aio_lio_opcode	= IO_CMD_PWRITEV;
-		iocb.u.v.vec		= iov;
-		iocb.u.v.nr		= i;
-		iocb.u.v.offset		= bio->bi_iter.bi_sector << 9;
-
+		discard_write_barrier(bio->bi_bdev, bio->bi_iter.bi_sector,
+				      bio_sectors(bio));
+		blkcache_write_invalidate(bio);
+		goto submit;
+	case REQ_OP_READ:
+		if (blkcache_read(bio))
+			break;
+submit:
 		atomic_inc(&running_requests);
-		ret = io_submit(aio_ctx, 1, &iocbp);
-		if (ret != 1)
-			die("io_submit err: %s", strerror(-ret));
+		bdev_io_account_submit(bio);
+		io_engine->submit(bio, iov, i);
 		break;
 	case REQ_OP_FLUSH:
 		ret = fsync(bio->bi_bdev->bd_fd);
@@ -121,6 +1472,15 @@ int submit_bio_wait(struct bio *bio)
 	bio->bi_end_io = submit_bio_wait_endio;
 	bio->bi_opf |= REQ_SYNC;
 	submit_bio(bio);
+
+	/*
+	 * The kernel flushes the current plug whenever a task blocks; we have
+	 * to do it by hand, or we'd be waiting on a bio still sitting in our
+	 * own plug:
+	 */
+	if (current_plug && io_engine->flush_plug)
+		io_engine->flush_plug(current_plug);
+
 	wait_for_completion(&done);
 
 	return blk_status_to_errno(bio->bi_status);
@@ -130,6 +1490,44 @@ int blkdev_issue_discard(struct block_device *bdev,
 			 sector_t sector, sector_t nr_sects,
 			 gfp_t gfp_mask, unsigned long flags)
 {
+	struct discard_range *r;
+
+	pthread_once(&discard_once, discard_thread_init);
+
+	pthread_mutex_lock(&discard_lock);
+
+	/* Merge with an adjacent queued range, if there is one: */
+	list_for_each_entry(r, &discard_queue, list) {
+		if (r->bdev != bdev)
+			continue;
+
+		if (r->sector + r->nr_sects == sector) {
+			r->nr_sects += nr_sects;
+			goto out;
+		}
+		if (sector + nr_sects == r->sector) {
+			r->sector = sector;
+			r->nr_sects += nr_sects;
+			goto out;
+		}
+	}
+
+	if (discard_queue_nr >= DISCARD_QUEUE_MAX)
+		goto out;
+
+	r = malloc(sizeof(*r));
+	if (!r)
+		goto out;
+
+	r->bdev		= bdev;
+	r->sector	= sector;
+	r->nr_sects	= nr_sects;
+	list_add_tail(&r->list, &discard_queue);
+	discard_queue_nr++;
+	atomic_inc(&discard_nr_pending);
+	pthread_cond_signal(&discard_work);
+out:
+	pthread_mutex_unlock(&discard_lock);
 	return 0;
 }
 
@@ -173,9 +1571,18 @@ sector_t get_capacity(struct gendisk *disk)
 
 void blkdev_put(struct block_device *bdev, fmode_t mode)
 {
+	discard_bdev_flush(bdev);
+	blkcache_drop_bdev(bdev);
+
+	if (io_engine->unregister_bdev)
+		io_engine->unregister_bdev(bdev);
+
 	fdatasync(bdev->bd_fd);
+	if (bdev->bd_direct_fd >= 0)
+		close(bdev->bd_direct_fd);
 	close(bdev->bd_sync_fd);
 	close(bdev->bd_fd);
+	/* bd_stats stays on bdev_stats_list for the exit dump */
 	free(bdev);
 }
 
@@ -183,7 +1590,7 @@ struct block_device *blkdev_get_by_path(const char *path, fmode_t mode,
 					void *holder)
 {
 	struct block_device *bdev;
-	int fd, sync_fd, flags = O_DIRECT;
+	int fd, sync_fd, flags = 0;
 
 	if ((mode & (FMODE_READ|FMODE_WRITE)) == (FMODE_READ|FMODE_WRITE))
 		flags = O_RDWR;
@@ -215,13 +1622,31 @@ struct block_device *blkdev_get_by_path(const char *path, fmode_t mode,
 	strncpy(bdev->name, path, sizeof(bdev->name));
 	bdev->name[sizeof(bdev->name) - 1] = '\0';
 
+	bdev->bd_stats = calloc(1, sizeof(*bdev->bd_stats));
+	if (bdev->bd_stats) {
+		strncpy(bdev->bd_stats->name, path,
+			sizeof(bdev->bd_stats->name) - 1);
+		bch2_time_stats_init(&bdev->bd_stats->latency[0]);
+		bch2_time_stats_init(&bdev->bd_stats->latency[1]);
+
+		pthread_mutex_lock(&bdev_stats_lock);
+		list_add_tail(&bdev->bd_stats->list, &bdev_stats_list);
+		pthread_mutex_unlock(&bdev_stats_lock);
+	}
+
 	bdev->bd_fd		= fd;
 	bdev->bd_sync_fd	= sync_fd;
+	bdev->bd_direct_fd	= open(path, flags|O_DIRECT);
+	bdev->bd_fixed_idx	= -1;
+	bdev->bd_sync_fixed_idx	= -1;
 	bdev->bd_holder		= holder;
 	bdev->bd_disk		= &bdev->__bd_disk;
 	bdev->bd_bdi		= &bdev->__bd_bdi;
 	bdev->queue.backing_dev_info = bdev->bd_bdi;
 
+	if (io_engine->register_bdev)
+		io_engine->register_bdev(bdev);
+
 	return bdev;
 }
 
@@ -235,89 +1660,38 @@ struct block_device *lookup_bdev(const char *path)
 	return ERR_PTR(-EINVAL);
 }
 
-static int aio_completion_thread(void *arg)
+__attribute__((constructor(102)))
+static void blkdev_init(void)
 {
-	struct io_event events[8], *ev;
+	const char *engine = getenv("BCACHEFS_IO_ENGINE");
 	int ret;
-	bool stop = false;
-
-	while (!stop) {
-		ret = io_getevents(aio_ctx, 1, ARRAY_SIZE(events),
-				   events, NULL);
-
-		if (ret < 0 && ret == -EINTR)
-			continue;
-		if (ret < 0)
-			die("io_getevents() error: %s", strerror(-ret));
-
-		for (ev = events; ev < events + ret; ev++) {
-			struct bio *bio = (struct bio *) ev->data;
-
-			/* This should only happen during blkdev_cleanup() */
-			if (!bio) {
-				BUG_ON(atomic_read(&running_requests) != 0);
-				stop = true;
-				continue;
-			}
-
-			if (ev->res != bio->bi_iter.bi_size)
-				bio->bi_status = BLK_STS_IOERR;
-
-			bio_endio(bio);
-			atomic_dec(&running_requests);
-		}
-	}
-
-	return 0;
-}
 
-static struct task_struct *aio_task = NULL;
+	io_engine = &aio_engine;
 
-__attribute__((constructor(102)))
-static void blkdev_init(void)
-{
-	struct task_struct *p;
+#ifdef BLKDEV_HAVE_IO_URING
+	if (engine && !strcmp(engine, "io_uring"))
+		io_engine = &uring_engine;
+	else
+#endif
+	if (engine && strcmp(engine, "aio"))
+		die("unknown io engine %s", engine);
 
-	if (io_setup(256, &aio_ctx))
-		die("io_setup() error: %m");
+	ret = io_engine->init();
+	if (ret)
+		die("error starting %s io engine: %s",
+		    io_engine->name, strerror(-ret));
 
-	p = kthread_run(aio_completion_thread, NULL, "aio_completion");
-	BUG_ON(IS_ERR(p));
+	blkcache_init();
 
-	aio_task = p;
+	bdev_io_stacks = getenv("BCACHEFS_IO_STACKS") != NULL;
+	signal(SIGUSR1, bdev_io_stats_sigusr1);
 }
 
 __attribute__((destructor(102)))
 static void blkdev_cleanup(void)
 {
-	struct task_struct *p = NULL;
-	swap(aio_task, p);
-	get_task_struct(p);
-
-	/* I mean, really?! IO_CMD_NOOP is even defined, but not implemented. */
-	int fds[2];
-	int ret = pipe(fds);
-	if (ret != 0)
-		die("pipe err: %s", strerror(ret));
-
-	/* Wake up the completion thread with spurious work. */
-	int junk = 0;
-	struct iocb iocb = {
-		.aio_lio_opcode = IO_CMD_PWRITE,
-		.data = NULL, /* Signal to stop */
-		.aio_fildes = fds[1],
-		.u.c.buf = &junk,
-		.u.c.nbytes = 1,
-	}, *iocbp = &iocb;
-	ret = io_submit(aio_ctx, 1, &iocbp);
-	if (ret != 1)
-		die("io_submit cleanup err: %s", strerror(-ret));
-
-	ret = kthread_stop(p);
-	BUG_ON(ret);
-
-	put_task_struct(p);
+	io_engine->exit();
 
-	close(fds[0]);
-	close(fds[1]);
+	if (getenv("BCACHEFS_IO_STATS"))
+		bdev_io_stats_dump();
 }
@@ -10,7 +10,34 @@
 #include <linux/export.h>
 #include <linux/seq_file.h>
 
-static inline void closure_put_after_sub(struct closure *cl, int flags)
+/*
+ * When a batch of closures completes together (a wake up releasing the last
+ * ref on many closures with the same parent - journal writes fan in hundreds
+ * per flush), the parent puts can be coalesced into one atomic op instead of
+ * hammering the parent's cacheline once per child:
+ */
+struct closure_put_batch {
+	struct closure		*parent;
+	int			nr;
+};
+
+static void closure_sub_batch(struct closure *cl, int v,
+			      struct closure_put_batch *batch);
+
+static void closure_put_batch_flush(struct closure_put_batch *batch)
+{
+	struct closure *parent = batch->parent;
+	int nr = batch->nr;
+
+	if (parent) {
+		batch->parent	= NULL;
+		batch->nr	= 0;
+		closure_sub_batch(parent, nr, NULL);
+	}
+}
+
+static inline void closure_put_after_sub(struct closure *cl, int flags,
+					 struct closure_put_batch *batch)
 {
 	int r = flags & CLOSURE_REMAINING_MASK;
 
@@ -31,16 +58,31 @@ static inline void closure_put_after_sub(struct closure *cl, int flags)
 			if (destructor)
 				destructor(cl);
 
-			if (parent)
-				closure_put(parent);
+			if (parent) {
+				if (!batch) {
+					closure_put(parent);
+				} else if (batch->parent == parent) {
+					batch->nr++;
+				} else {
+					closure_put_batch_flush(batch);
+					batch->parent	= parent;
+					batch->nr	= 1;
+				}
+			}
 		}
 	}
 }
 
+static void closure_sub_batch(struct closure *cl, int v,
+			      struct closure_put_batch *batch)
+{
+	closure_put_after_sub(cl, atomic_sub_return(v, &cl->remaining), batch);
+}
+
 /* For clearing flags with the same atomic op as a put */
 void closure_sub(struct closure *cl, int v)
 {
-	closure_put_after_sub(cl, atomic_sub_return(v, &cl->remaining));
+	closure_sub_batch(cl, v, NULL);
 }
 EXPORT_SYMBOL(closure_sub);
 
@@ -49,7 +91,7 @@ EXPORT_SYMBOL(closure_sub);
  */
 void closure_put(struct closure *cl)
 {
-	closure_put_after_sub(cl, atomic_dec_return(&cl->remaining));
+	closure_put_after_sub(cl, atomic_dec_return(&cl->remaining), NULL);
 }
 EXPORT_SYMBOL(closure_put);
 
@@ -58,6 +100,7 @@ EXPORT_SYMBOL(closure_put);
  */
 void __closure_wake_up(struct closure_waitlist *wait_list)
 {
+	struct closure_put_batch batch = { NULL, 0 };
 	struct llist_node *list, *next;
 	struct closure *cl;
 
@@ -72,8 +115,10 @@ void __closure_wake_up(struct closure_waitlist *wait_list)
 		cl = container_of(list, struct closure, list);
 
 		closure_set_waiting(cl, 0);
-		closure_sub(cl, CLOSURE_WAITING + 1);
+		closure_sub_batch(cl, CLOSURE_WAITING + 1, &batch);
 	}
+
+	closure_put_batch_flush(&batch);
 }
 EXPORT_SYMBOL(__closure_wake_up);
 
@@ -132,6 +177,22 @@ EXPORT_SYMBOL(__closure_sync);
 static LIST_HEAD(closure_list);
 static DEFINE_SPINLOCK(closure_list_lock);
 
+/*
+ * Even in a debug build, the global list is opt-in at runtime
+ * (BCACHEFS_DEBUG_CLOSURES in the environment): every bio completion is a
+ * closure, and the list lock serializes all the IO completion threads. When
+ * it's off we keep only the magic check and a per thread tally of
+ * creates minus destroys - closures routinely die on a different thread than
+ * made them, so only the sum across threads is the live count:
+ */
+static bool closure_debug_enabled;
+static __thread long closure_nr_live;
+
+static void __attribute__((constructor)) closure_debug_init_early(void)
+{
+	closure_debug_enabled = getenv("BCACHEFS_DEBUG_CLOSURES") != NULL;
+}
+
 void closure_debug_create(struct closure *cl)
 {
 	unsigned long flags;
@@ -139,6 +200,11 @@ void closure_debug_create(struct closure *cl)
 	BUG_ON(cl->magic == CLOSURE_MAGIC_ALIVE);
 	cl->magic = CLOSURE_MAGIC_ALIVE;
 
+	if (!closure_debug_enabled) {
+		closure_nr_live++;
+		return;
+	}
+
 	spin_lock_irqsave(&closure_list_lock, flags);
 	list_add(&cl->all, &closure_list);
 	spin_unlock_irqrestore(&closure_list_lock, flags);
@@ -152,6 +218,11 @@ void closure_debug_destroy(struct closure *cl)
 	BUG_ON(cl->magic != CLOSURE_MAGIC_ALIVE);
 	cl->magic = CLOSURE_MAGIC_DEAD;
 
+	if (!closure_debug_enabled) {
+		closure_nr_live--;
+		return;
+	}
+
 	spin_lock_irqsave(&closure_list_lock, flags);
 	list_del(&cl->all);
 	spin_unlock_irqrestore(&closure_list_lock, flags);
@@ -3,6 +3,7 @@
 #include <linux/export.h>
 #include <linux/generic-radix-tree.h>
 #include <linux/gfp.h>
+#include <linux/spinlock.h>
 
 #define GENRADIX_ARY		(PAGE_SIZE / sizeof(struct genradix_node *))
 #define GENRADIX_ARY_SHIFT	ilog2(GENRADIX_ARY)
@@ -37,6 +38,61 @@ static inline size_t genradix_depth_size(unsigned depth)
 #define GENRADIX_DEPTH_MASK				\
 	((unsigned long) (roundup_pow_of_two(GENRADIX_MAX_DEPTH + 1) - 1))
 
+/*
+ * Node pool: a genradix is typically torn down and repopulated many times over
+ * a process's life (gc runs, ec stripe tables), and a big one is built one
+ * page sized node at a time. Freed nodes are stashed on a freelist, capped so
+ * an unusually large tree doesn't pin memory forever, and allocations pop from
+ * it before hitting the allocator:
+ */
+#define GENRADIX_POOL_MAX	512
+
+static struct genradix_node *node_pool;
+static unsigned long node_pool_nr;
+static DEFINE_SPINLOCK(node_pool_lock);
+
+static struct genradix_node *genradix_alloc_node(gfp_t gfp_mask)
+{
+	struct genradix_node *n = NULL;
+
+	if (READ_ONCE(node_pool)) {
+		spin_lock(&node_pool_lock);
+		n = node_pool;
+		if (n) {
+			node_pool = n->children[0];
+			node_pool_nr--;
+		}
+		spin_unlock(&node_pool_lock);
+	}
+
+	if (n) {
+		memset(n, 0, sizeof(*n));
+		return n;
+	}
+
+	return (void *) __get_free_page(gfp_mask|__GFP_ZERO);
+}
+
+static void genradix_free_node(struct genradix_node *n)
+{
+	if (!n)
+		return;
+
+	if (READ_ONCE(node_pool_nr) < GENRADIX_POOL_MAX) {
+		spin_lock(&node_pool_lock);
+		if (node_pool_nr < GENRADIX_POOL_MAX) {
+			n->children[0] = node_pool;
+			node_pool = n;
+			node_pool_nr++;
+			n = NULL;
+		}
+		spin_unlock(&node_pool_lock);
+	}
+
+	if (n)
+		free_page((unsigned long) n);
+}
+
 unsigned genradix_root_to_depth(struct genradix_root *r)
 {
 	return (unsigned long) r & GENRADIX_DEPTH_MASK;
@@ -98,8 +154,7 @@ void *__genradix_ptr_alloc(struct __genradix *radix, size_t offset,
 			break;
 
 		if (!new_node) {
-			new_node = (void *)
-				__get_free_page(gfp_mask|__GFP_ZERO);
+			new_node = genradix_alloc_node(gfp_mask);
 			if (!new_node)
 				return NULL;
 		}
@@ -122,8 +177,7 @@ void *__genradix_ptr_alloc(struct __genradix *radix, size_t offset,
 		n = READ_ONCE(*p);
 		if (!n) {
 			if (!new_node) {
-				new_node = (void *)
-					__get_free_page(gfp_mask|__GFP_ZERO);
+				new_node = genradix_alloc_node(gfp_mask);
 				if (!new_node)
 					return NULL;
 			}
@@ -134,7 +188,7 @@ void *__genradix_ptr_alloc(struct __genradix *radix, size_t offset,
 	}
 
 	if (new_node)
-		free_page((unsigned long) new_node);
+		genradix_free_node(new_node);
 
 	return &n->data[offset];
 }
@@ -147,6 +201,16 @@ void *__genradix_iter_peek(struct genradix_iter *iter,
 	struct genradix_root *r;
 	struct genradix_node *n;
 	unsigned level, i;
+
+	/*
+	 * Fast path: nodes never move until genradix_free(), so while the
+	 * iterator stays within one leaf we can skip the descent from the
+	 * root. (An iterator must not be carried across genradix_free().)
+	 */
+	if (iter->leaf &&
+	    iter->leaf_offset == (iter->offset & ~(size_t) (PAGE_SIZE - 1)))
+		return &((struct genradix_node *) iter->leaf)
+			->data[iter->offset & (PAGE_SIZE - 1)];
 restart:
 	r = READ_ONCE(radix->root);
 	if (!r)
@@ -178,6 +242,9 @@ restart:
 		n = n->children[i];
 	}
 
+	iter->leaf	  = n;
+	iter->leaf_offset = iter->offset & ~(size_t) (PAGE_SIZE - 1);
+
 	return &n->data[iter->offset & (PAGE_SIZE - 1)];
 }
 EXPORT_SYMBOL(__genradix_iter_peek);
@@ -192,18 +259,56 @@ static void genradix_free_recurse(struct genradix_node *n, unsigned level)
 				genradix_free_recurse(n->children[i], level - 1);
 	}
 
-	free_page((unsigned long) n);
+	genradix_free_node(n);
 }
 
 int __genradix_prealloc(struct __genradix *radix, size_t size,
 			gfp_t gfp_mask)
 {
+	size_t leaves = DIV_ROUND_UP(size, PAGE_SIZE);
+	size_t nr_nodes = leaves + DIV_ROUND_UP(leaves, GENRADIX_ARY - 1) + 1;
 	size_t offset;
 
+	/*
+	 * Prefill the node pool in one pass - the allocation loop below then
+	 * runs without touching the allocator. The pool cap only limits what's
+	 * retained across genradix_free(), not an explicit reservation:
+	 */
+	while (READ_ONCE(node_pool_nr) < nr_nodes) {
+		struct genradix_node *n = (void *)
+			__get_free_page(gfp_mask|__GFP_ZERO);
+
+		if (!n)
+			return -ENOMEM;
+
+		spin_lock(&node_pool_lock);
+		n->children[0] = node_pool;
+		node_pool = n;
+		node_pool_nr++;
+		spin_unlock(&node_pool_lock);
+	}
+
 	for (offset = 0; offset < size; offset += PAGE_SIZE)
 		if (!__genradix_ptr_alloc(radix, offset, gfp_mask))
 			return -ENOMEM;
 
+	/*
+	 * The estimate overshoots slightly (and part of the tree may have
+	 * already existed) - trim the surplus back under the cap:
+	 */
+	spin_lock(&node_pool_lock);
+	while (node_pool_nr > GENRADIX_POOL_MAX) {
+		struct genradix_node *n = node_pool;
+
+		node_pool = n->children[0];
+		node_pool_nr--;
+
+		spin_unlock(&node_pool_lock);
+		free_page((unsigned long) n);
+		spin_lock(&node_pool_lock);
+	}
+	spin_unlock(&node_pool_lock);
+
 	return 0;
 }
 EXPORT_SYMBOL(__genradix_prealloc);
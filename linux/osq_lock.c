@@ -0,0 +1,173 @@
+// SPDX-License-Identifier: GPL-2.0
+
+#include <linux/atomic.h>
+#include <linux/compiler.h>
+#include <linux/kernel.h>
+#include <linux/osq_lock.h>
+
+/*
+ * MCS queue for optimistic spinning, adapted from the kernel's
+ * kernel/locking/osq_lock.c for userspace: nodes live in thread local
+ * storage instead of percpu data, and the tail is a plain node pointer
+ * instead of an encoded cpu number.
+ *
+ * The kernel unqueues a spinner when need_resched() is set; we have no
+ * equivalent signal, and unlike the kernel we can be preempted while
+ * spinning, so spinners instead give up (and fall back to blocking in the
+ * caller) after a fixed spin budget.
+ */
+
+#define OSQ_SPIN_BUDGET	(1U << 12)
+
+static __thread struct optimistic_spin_node osq_node;
+
+/*
+ * Get a stable @node->next pointer, or NULL if the queue ends at @node -
+ * in which case atomically move the tail back to @prev.
+ */
+static struct optimistic_spin_node *
+osq_wait_next(struct optimistic_spin_queue *lock,
+	      struct optimistic_spin_node *node,
+	      struct optimistic_spin_node *prev)
+{
+	struct optimistic_spin_node *next;
+
+	for (;;) {
+		if (READ_ONCE(lock->tail) == node &&
+		    cmpxchg(&lock->tail, node, prev) == node)
+			/*
+			 * We were the last queued; we moved @lock back. @prev
+			 * will now observe @lock and will complete its
+			 * unlock()/unqueue().
+			 */
+			return NULL;
+
+		/*
+		 * We must xchg() the @node->next value, because if we were to
+		 * leave it in, a concurrent unlock()/unqueue() from
+		 * @node->next might complete Step-A and think its @prev is
+		 * still valid.
+		 *
+		 * If the concurrent unlock()/unqueue() wins the race, we'll
+		 * wait for either @lock to point to us, through its Step-B, or
+		 * wait for a new @node->next from its Step-C.
+		 */
+		if (READ_ONCE(node->next)) {
+			next = xchg(&node->next, NULL);
+			if (next)
+				return next;
+		}
+
+		cpu_relax();
+	}
+}
+
+bool osq_lock(struct optimistic_spin_queue *lock)
+{
+	struct optimistic_spin_node *node = &osq_node;
+	struct optimistic_spin_node *prev, *next;
+	unsigned spin = OSQ_SPIN_BUDGET;
+
+	node->locked = 0;
+	node->next = NULL;
+
+	prev = xchg(&lock->tail, node);
+	if (!prev)
+		return true;
+
+	node->prev = prev;
+	WRITE_ONCE(prev->next, node);
+
+	/*
+	 * Normally @prev is untouchable after the above store; because at that
+	 * moment unlock can proceed and wipe the node element from stack.
+	 *
+	 * However, since our nodes are in thread local storage, we're
+	 * guaranteed their existence - this allows us to apply cmpxchg in an
+	 * attempt to undo our queueing.
+	 */
+	while (!READ_ONCE(node->locked)) {
+		if (!--spin)
+			goto unqueue;
+
+		cpu_relax();
+	}
+	return true;
+
+unqueue:
+	/*
+	 * Step - A  -- stabilize @prev
+	 *
+	 * Undo our @prev->next assignment; this will make @prev's
+	 * unlock()/unqueue() wait for a next pointer since @lock points to us
+	 * (or later).
+	 */
+	for (;;) {
+		if (READ_ONCE(prev->next) == node &&
+		    cmpxchg(&prev->next, node, NULL) == node)
+			break;
+
+		/*
+		 * We can only fail the cmpxchg() racing against an unlock(),
+		 * in which case we should observe @node->locked becoming
+		 * true.
+		 */
+		if (smp_load_acquire(&node->locked))
+			return true;
+
+		cpu_relax();
+
+		/*
+		 * Or we race against a concurrent unqueue()'s step-B, in which
+		 * case its step-C will write us a new @node->prev pointer.
+		 */
+		prev = READ_ONCE(node->prev);
+	}
+
+	/*
+	 * Step - B -- stabilize @next
+	 *
+	 * Similar to unlock(), wait for @node->next or move @lock from @node
+	 * back to @prev.
+	 */
+	next = osq_wait_next(lock, node, prev);
+	if (!next)
+		return false;
+
+	/*
+	 * Step - C -- unlink
+	 *
+	 * @prev is stable because it's still waiting for a new @prev->next
+	 * pointer, @next is stable because our @node->next pointer is NULL and
+	 * it will wait in Step-A.
+	 */
+	WRITE_ONCE(next->prev, prev);
+	WRITE_ONCE(prev->next, next);
+
+	return false;
+}
+
+void osq_unlock(struct optimistic_spin_queue *lock)
+{
+	struct optimistic_spin_node *node = &osq_node;
+	struct optimistic_spin_node *next;
+
+	/*
+	 * Fast path for the uncontended case.
+	 */
+	if (likely(cmpxchg_release(&lock->tail, node, NULL) == node))
+		return;
+
+	/*
+	 * Second most likely case:
+	 */
+	next = xchg(&node->next, NULL);
+	if (next) {
+		WRITE_ONCE(next->locked, 1);
+		return;
+	}
+
+	next = osq_wait_next(lock, node, NULL);
+	if (next)
+		WRITE_ONCE(next->locked, 1);
+}
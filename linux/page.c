@@ -0,0 +1,488 @@
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <linux/atomic.h>
+#include <linux/kernel.h>
+#include <linux/page.h>
+#include <linux/shrinker.h>
+#include <linux/slab.h>
+
+#include "tools-util.h"
+
+/*
+ * Page allocator with caching: bio payloads are allocated and freed a page at
+ * a time, and with pages coming straight from malloc that was measured as a
+ * significant chunk of cmd_dump/migrate runtime. Freed pages instead go on a
+ * per thread magazine (no locking in the fast path), which spills to and
+ * refills from a global per-order reserve in batches; only reserve overflow
+ * and underflow hit the system allocator.
+ *
+ * Orders 0-3 are cached, each with its own magazine and reserve - larger
+ * allocations are rare and go straight to malloc. Per order counters track
+ * magazine hits and reserve/system traffic so a mis-sized reserve shows up,
+ * and allocs - frees gives a leak count; dumped to stderr at exit if
+ * BCACHEFS_PAGE_POOL_STATS is set.
+ *
+ * With BCACHEFS_NUMA set the reserves are split per NUMA node: anonymous pages
+ * get their placement on first touch, so a recycled page keeps the node of
+ * whichever thread used it first, and a single shared reserve launders pages
+ * across sockets. Magazines are already per thread; spills and refills then
+ * stay on the freeing/allocating thread's node (see the matching worker
+ * affinity in the workqueue shim).
+ */
+
+#define PAGE_POOL_ORDERS	4
+#define PAGE_POOL_MAG		64	/* order 0, halved per order above */
+#define PAGE_POOL_NODES		8
+
+#define PAGE_POOL_RESERVE_BYTES	(8UL << 20)	/* per order */
+
+#define page_pool_mag_size(order)	(PAGE_POOL_MAG >> (order))
+
+#define page_pool_reserve_max(order)				\
+	(PAGE_POOL_RESERVE_BYTES / (PAGE_SIZE << (order)))
+
+/* freelist link, stored in the free page itself: */
+struct pool_page {
+	struct pool_page	*next;
+};
+
+struct page_mag {
+	unsigned		nr;
+	void			*pages[PAGE_POOL_MAG];
+};
+
+struct page_cache {
+	struct page_mag		mag[PAGE_POOL_ORDERS];
+};
+
+struct page_class {
+	pthread_mutex_t		lock;
+	struct pool_page	*reserve[PAGE_POOL_NODES];
+	unsigned long		reserve_nr[PAGE_POOL_NODES];
+
+	atomic64_t		allocs;
+	atomic64_t		frees;
+	atomic64_t		mag_hits;
+	atomic64_t		refills;
+	atomic64_t		spills;
+	atomic64_t		system_allocs;
+	atomic64_t		system_frees;
+};
+
+static struct page_class page_classes[PAGE_POOL_ORDERS] = {
+	[0 ... PAGE_POOL_ORDERS - 1] = {
+		.lock = PTHREAD_MUTEX_INITIALIZER,
+	},
+};
+
+static __thread struct page_cache *page_cache;
+static pthread_key_t page_cache_key;
+static bool page_pool_numa;
+
+/*
+ * Large allocations - btree node buffers (up to 256k) and journal buffers -
+ * are too big for the magazines and used to go straight to malloc, each
+ * eating its own set of 4k TLB entries; fsck with ~100k cached nodes spends
+ * measurable time in dTLB misses. They're instead carved out of 2MB aligned,
+ * MADV_HUGEPAGE'd arenas, so the kernel can back them with hugepages.
+ *
+ * One freelist per order under a single lock - these allocations are orders
+ * of magnitude rarer than bio pages. Freed chunks are kept for reuse rather
+ * than unmapped; retention is bounded by peak usage, which the btree cache
+ * shrinker already caps. mmap failure falls back to the old malloc path
+ * (frees check arena membership, so the two can coexist):
+ */
+
+#define HUGE_ARENA_SHIFT	21
+#define HUGE_ARENA_BYTES	(1UL << HUGE_ARENA_SHIFT)
+#define HUGE_MAX_ORDER		(HUGE_ARENA_SHIFT - PAGE_SHIFT)
+
+struct huge_class {
+	struct pool_page	*freelist;
+	atomic64_t		allocs;
+	atomic64_t		frees;
+	atomic64_t		hits;
+};
+
+static pthread_mutex_t huge_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct huge_class huge_classes[HUGE_MAX_ORDER + 1];
+static void **huge_arena_bases;
+static unsigned long huge_arenas;
+static unsigned long huge_madvise_fails;
+
+/* Map a 2MB aligned arena; called with huge_lock held: */
+static void *huge_arena_map(void)
+{
+	size_t size = HUGE_ARENA_BYTES;
+	void *m = mmap(NULL, size * 2, PROT_READ|PROT_WRITE,
+		       MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+	void *p, **bases;
+
+	if (m == MAP_FAILED)
+		return NULL;
+
+	bases = realloc(huge_arena_bases,
+			(huge_arenas + 1) * sizeof(*bases));
+	if (!bases) {
+		munmap(m, size * 2);
+		return NULL;
+	}
+	huge_arena_bases = bases;
+
+	p = (void *) round_up((unsigned long) m, size);
+	if (p != m)
+		munmap(m, p - m);
+	if (p + size != m + size * 2)
+		munmap(p + size, (m + size * 2) - (p + size));
+
+	if (madvise(p, size, MADV_HUGEPAGE))
+		huge_madvise_fails++;
+
+	huge_arena_bases[huge_arenas++] = p;
+	return p;
+}
+
+static bool huge_arena_contains(void *p)
+{
+	unsigned long i;
+
+	for (i = 0; i < huge_arenas; i++)
+		if (p >= huge_arena_bases[i] &&
+		    p <  huge_arena_bases[i] + HUGE_ARENA_BYTES)
+			return true;
+	return false;
+}
+
+static void *huge_alloc(unsigned order)
+{
+	struct huge_class *class = &huge_classes[order];
+	size_t size = PAGE_SIZE << order;
+	struct pool_page *p;
+
+	pthread_mutex_lock(&huge_lock);
+	atomic64_inc(&class->allocs);
+
+	p = class->freelist;
+	if (p) {
+		class->freelist = p->next;
+		atomic64_inc(&class->hits);
+	} else {
+		void *arena = huge_arena_map();
+
+		if (arena) {
+			size_t offset;
+
+			/* carve the rest of the arena into chunks: */
+			for (offset = size; offset < HUGE_ARENA_BYTES;
+			     offset += size) {
+				struct pool_page *c = arena + offset;
+
+				c->next = class->freelist;
+				class->freelist = c;
+			}
+		}
+		p = (struct pool_page *) arena;
+	}
+	pthread_mutex_unlock(&huge_lock);
+	return p;
+}
+
+static bool huge_free(void *p, unsigned order)
+{
+	struct huge_class *class = &huge_classes[order];
+	struct pool_page *page = p;
+	bool ret;
+
+	pthread_mutex_lock(&huge_lock);
+	ret = huge_arena_contains(p);
+	if (ret) {
+		atomic64_inc(&class->frees);
+		page->next = class->freelist;
+		class->freelist = page;
+	}
+	pthread_mutex_unlock(&huge_lock);
+	return ret;
+}
+
+/* Which reserve to use - node 0 unless NUMA mode is on: */
+static unsigned page_local_node(void)
+{
+	unsigned cpu, node;
+
+	if (!page_pool_numa ||
+	    syscall(SYS_getcpu, &cpu, &node, NULL))
+		return 0;
+
+	return min_t(unsigned, node, PAGE_POOL_NODES - 1);
+}
+
+static struct page_cache *get_page_cache(void)
+{
+	struct page_cache *cache = page_cache;
+	int ret;
+
+	if (likely(cache))
+		return cache;
+
+	/* plain calloc: kmalloc() would recurse into run_shrinkers() */
+	cache = calloc(1, sizeof(*cache));
+	if (!cache)
+		die("error allocating page cache");
+
+	ret = pthread_setspecific(page_cache_key, cache);
+	if (ret)
+		die("pthread_setspecific error %s", strerror(ret));
+
+	page_cache = cache;
+	return cache;
+}
+
+/* Move half the magazine to the reserve, freeing what doesn't fit: */
+static void page_mag_spill(struct page_class *class, struct page_mag *mag,
+			   unsigned order)
+{
+	unsigned keep = page_pool_mag_size(order) / 2;
+	unsigned node = page_local_node();
+
+	atomic64_inc(&class->spills);
+
+	pthread_mutex_lock(&class->lock);
+	while (mag->nr > keep) {
+		struct pool_page *p = mag->pages[--mag->nr];
+
+		if (class->reserve_nr[node] < page_pool_reserve_max(order)) {
+			p->next = class->reserve[node];
+			class->reserve[node] = p;
+			class->reserve_nr[node]++;
+		} else {
+			atomic64_inc(&class->system_frees);
+			free(p);
+		}
+	}
+	pthread_mutex_unlock(&class->lock);
+}
+
+static void page_mag_refill(struct page_class *class, struct page_mag *mag,
+			    unsigned order)
+{
+	unsigned want = page_pool_mag_size(order) / 2;
+	unsigned node = page_local_node();
+
+	atomic64_inc(&class->refills);
+
+	pthread_mutex_lock(&class->lock);
+	while (mag->nr < want && class->reserve[node]) {
+		struct pool_page *p = class->reserve[node];
+
+		class->reserve[node] = p->next;
+		class->reserve_nr[node]--;
+		mag->pages[mag->nr++] = p;
+	}
+	pthread_mutex_unlock(&class->lock);
+}
+
+struct page *alloc_pages(gfp_t gfp, unsigned int order)
+{
+	size_t size = PAGE_SIZE << order;
+	void *p = NULL;
+
+	if (order < PAGE_POOL_ORDERS) {
+		struct page_class *class = &page_classes[order];
+		struct page_mag *mag = &get_page_cache()->mag[order];
+
+		atomic64_inc(&class->allocs);
+
+		if (!mag->nr)
+			page_mag_refill(class, mag, order);
+
+		if (mag->nr) {
+			p = mag->pages[--mag->nr];
+			atomic64_inc(&class->mag_hits);
+		} else {
+			atomic64_inc(&class->system_allocs);
+		}
+	} else if (order <= HUGE_MAX_ORDER) {
+		p = huge_alloc(order);
+	}
+
+	if (!p) {
+		run_shrinkers();
+		p = aligned_alloc(PAGE_SIZE, size);
+	}
+
+	if (p && (gfp & __GFP_ZERO))
+		memset(p, 0, size);
+
+	return p;
+}
+
+void __free_pages(struct page *page, unsigned int order)
+{
+	void *p = page;
+
+	if (!p)
+		return;
+
+	if (order < PAGE_POOL_ORDERS) {
+		struct page_class *class = &page_classes[order];
+		struct page_mag *mag = &get_page_cache()->mag[order];
+
+		atomic64_inc(&class->frees);
+
+		if (mag->nr == page_pool_mag_size(order))
+			page_mag_spill(class, mag, order);
+
+		mag->pages[mag->nr++] = p;
+		return;
+	}
+
+	if (order <= HUGE_MAX_ORDER && huge_free(p, order))
+		return;
+
+	free(p);
+}
+
+/* Thread exit: push the magazines back to the reserves. */
+static void page_cache_exit(void *p)
+{
+	struct page_cache *cache = p;
+	unsigned order;
+
+	for (order = 0; order < PAGE_POOL_ORDERS; order++) {
+		struct page_class *class = &page_classes[order];
+		struct page_mag *mag = &cache->mag[order];
+		unsigned node = page_local_node();
+
+		pthread_mutex_lock(&class->lock);
+		while (mag->nr) {
+			struct pool_page *page = mag->pages[--mag->nr];
+
+			if (class->reserve_nr[node] < page_pool_reserve_max(order)) {
+				page->next = class->reserve[node];
+				class->reserve[node] = page;
+				class->reserve_nr[node]++;
+			} else {
+				atomic64_inc(&class->system_frees);
+				free(page);
+			}
+		}
+		pthread_mutex_unlock(&class->lock);
+	}
+
+	free(cache);
+	page_cache = NULL;
+}
+
+static void page_pool_stats_dump(void)
+{
+	unsigned order;
+
+	for (order = 0; order < PAGE_POOL_ORDERS; order++) {
+		struct page_class *class = &page_classes[order];
+		u64 allocs	= atomic64_read(&class->allocs);
+		u64 frees	= atomic64_read(&class->frees);
+
+		if (!allocs)
+			continue;
+
+		fprintf(stderr, "\npage pool, order %u:\n", order);
+		fprintf(stderr, "allocs:\t\t%llu\n",	allocs);
+		fprintf(stderr, "frees:\t\t%llu\n",	frees);
+		fprintf(stderr, "mag hits:\t%llu\n",
+			(u64) atomic64_read(&class->mag_hits));
+		fprintf(stderr, "refills:\t%llu\n",
+			(u64) atomic64_read(&class->refills));
+		fprintf(stderr, "spills:\t\t%llu\n",
+			(u64) atomic64_read(&class->spills));
+		fprintf(stderr, "system allocs:\t%llu\n",
+			(u64) atomic64_read(&class->system_allocs));
+		fprintf(stderr, "system frees:\t%llu\n",
+			(u64) atomic64_read(&class->system_frees));
+		{
+			unsigned long reserve_nr = 0;
+			unsigned node;
+
+			for (node = 0; node < PAGE_POOL_NODES; node++)
+				reserve_nr += class->reserve_nr[node];
+
+			fprintf(stderr, "reserve:\t%lu\n", reserve_nr);
+		}
+
+		if (allocs != frees)
+			fprintf(stderr, "leaked:\t\t%llu (%llu bytes)\n",
+				allocs - frees,
+				(allocs - frees) * (PAGE_SIZE << order));
+	}
+}
+
+/* How much of our address space the kernel actually backed with hugepages: */
+static unsigned long anon_huge_kb(void)
+{
+	FILE *f = fopen("/proc/self/smaps_rollup", "r");
+	char line[256];
+	unsigned long kb = 0;
+
+	if (!f)
+		return 0;
+
+	while (fgets(line, sizeof(line), f))
+		if (sscanf(line, "AnonHugePages: %lu kB", &kb) == 1)
+			break;
+
+	fclose(f);
+	return kb;
+}
+
+static void huge_pool_stats_dump(void)
+{
+	unsigned order;
+
+	if (!huge_arenas)
+		return;
+
+	fprintf(stderr, "\nhuge arenas:\t%lu (%lu MB, %lu madvise failures)\n",
+		huge_arenas,
+		huge_arenas << (HUGE_ARENA_SHIFT - 20),
+		huge_madvise_fails);
+	fprintf(stderr, "AnonHugePages:\t%lu kB\n", anon_huge_kb());
+
+	for (order = 0; order <= HUGE_MAX_ORDER; order++) {
+		struct huge_class *class = &huge_classes[order];
+		u64 allocs = atomic64_read(&class->allocs);
+
+		if (!allocs)
+			continue;
+
+		fprintf(stderr, "order %u:\tallocs %llu frees %llu freelist hits %llu\n",
+			order, allocs,
+			(u64) atomic64_read(&class->frees),
+			(u64) atomic64_read(&class->hits));
+	}
+}
+
+__attribute__((constructor(101)))
+static void page_pool_init(void)
+{
+	int ret = pthread_key_create(&page_cache_key, page_cache_exit);
+
+	if (ret)
+		die("pthread_key_create error %s", strerror(ret));
+
+	page_pool_numa = getenv("BCACHEFS_NUMA") != NULL;
+}
+
+__attribute__((destructor(101)))
+static void page_pool_cleanup(void)
+{
+	if (getenv("BCACHEFS_PAGE_POOL_STATS")) {
+		page_pool_stats_dump();
+		huge_pool_stats_dump();
+	}
+}
@@ -345,8 +345,20 @@ int rhashtable_insert_rehash(struct rhashtable *ht,
 	else if (old_tbl != tbl)
 		goto fail;
 
+	/*
+	 * In the kernel, a large GFP_ATOMIC allocation fails and we fall back
+	 * to the worker, which allocates in process context; in userspace
+	 * malloc doesn't fail, so without an explicit bound we'd zero and
+	 * initialize the entire new table inline here - a multi-ms stall in
+	 * the insert path when the table is big. Enforce the bound the
+	 * kernel gets for free:
+	 */
 	err = -ENOMEM;
 
+	if (sizeof(struct bucket_table) + size * sizeof(new_tbl->buckets[0]) >
+	    (PAGE_SIZE << PAGE_ALLOC_COSTLY_ORDER))
+		goto fail;
+
 	new_tbl = bucket_table_alloc(ht, size, GFP_ATOMIC);
 	if (new_tbl == NULL)
 		goto fail;
@@ -37,9 +37,17 @@ void schedule(void)
 
 	rcu_quiescent_state();
 
+	/*
+	 * Only cleared across a voluntary sleep - lock owners that spin or get
+	 * preempted still count as running, which is what spin-on-owner wants:
+	 */
+	current->on_cpu = false;
+
 	while ((v = READ_ONCE(current->state)) != TASK_RUNNING)
 		futex(&current->state, FUTEX_WAIT|FUTEX_PRIVATE_FLAG,
 		      v, NULL, NULL, 0);
+
+	current->on_cpu = true;
 }
 
 struct process_timer {
@@ -111,6 +119,7 @@ static void sched_init(void)
 	memset(p, 0, sizeof(*p));
 
 	p->state	= TASK_RUNNING;
+	p->on_cpu	= true;
 	atomic_set(&p->usage, 1);
 	init_completion(&p->exited);
 
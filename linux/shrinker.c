@@ -1,30 +1,19 @@
 
+#include <pthread.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
 
 #include <linux/list.h>
 #include <linux/mutex.h>
 #include <linux/shrinker.h>
 
+#include "libbcachefs/util.h"
 #include "tools-util.h"
 
 static LIST_HEAD(shrinker_list);
 static DEFINE_MUTEX(shrinker_lock);
 
-int register_shrinker(struct shrinker *shrinker)
-{
-	mutex_lock(&shrinker_lock);
-	list_add_tail(&shrinker->list, &shrinker_list);
-	mutex_unlock(&shrinker_lock);
-	return 0;
-}
-
-void unregister_shrinker(struct shrinker *shrinker)
-{
-	mutex_lock(&shrinker_lock);
-	list_del(&shrinker->list);
-	mutex_unlock(&shrinker_lock);
-}
-
 struct meminfo {
 	u64		total;
 	u64		available;
@@ -66,29 +55,174 @@ static struct meminfo read_meminfo(void)
 	return ret;
 }
 
-void run_shrinkers(void)
+/*
+ * Parsing /proc/meminfo costs a few syscalls, which we don't want in the
+ * allocation paths that call run_shrinkers() - a background thread samples it
+ * every 100ms into a snapshot the fast path reads instead, and reclaims ahead
+ * of pressure itself so the foreground rarely has to:
+ *
+ * - below MEM_LOW the watcher starts running the shrinkers, and keeps
+ *   running them until we're back above MEM_HIGH (hysteresis, so we don't
+ *   oscillate around a single watermark)
+ *
+ * - foreground run_shrinkers() only reclaims synchronously, stalling the
+ *   caller, as a last resort below MEM_CRITICAL
+ */
+#define MEMWATCH_INTERVAL_NS	(100 * NSEC_PER_MSEC)
+
+#define MEM_LOW(total)		((total) >> 2)
+#define MEM_HIGH(total)		((total) / 3)
+#define MEM_CRITICAL(total)	((total) >> 3)
+
+static u64 mem_total;
+static atomic64_t mem_available;
+
+static pthread_t memwatch_thread;
+static bool memwatch_running;
+static bool memwatch_exit;
+
+static void do_run_shrinkers(s64 want_shrink)
 {
 	struct shrinker *shrinker;
-	struct meminfo info;
-	s64 want_shrink;
-
-	/* Fast out if there are no shrinkers to run. */
-	if (list_empty(&shrinker_list))
-		return;
-
-	info = read_meminfo();
-	want_shrink = (info.total >> 2) - info.available;
 
 	if (want_shrink <= 0)
 		return;
 
-	mutex_lock(&shrinker_lock);
+	/*
+	 * If someone else is already reclaiming - including ourselves, since
+	 * the shrinkers themselves allocate memory - don't pile up behind
+	 * them:
+	 */
+	if (!mutex_trylock(&shrinker_lock))
+		return;
 	list_for_each_entry(shrinker, &shrinker_list, list) {
 		struct shrink_control sc = {
 			.nr_to_scan = want_shrink >> PAGE_SHIFT
 		};
+		u64 start_time = local_clock();
 
 		shrinker->scan_objects(shrinker, &sc);
+		bch2_time_stats_update(shrinker->reclaim_stats, start_time);
+	}
+	mutex_unlock(&shrinker_lock);
+}
+
+static void *memwatch_fn(void *arg)
+{
+	bool reclaiming = false;
+
+	while (!READ_ONCE(memwatch_exit)) {
+		struct timespec ts = { .tv_nsec = MEMWATCH_INTERVAL_NS };
+		struct meminfo info = read_meminfo();
+
+		atomic64_set(&mem_available, info.available);
+
+		if (info.available < MEM_LOW(info.total))
+			reclaiming = true;
+		else if (info.available > MEM_HIGH(info.total))
+			reclaiming = false;
+
+		if (reclaiming)
+			do_run_shrinkers(MEM_HIGH(info.total) - info.available);
+
+		nanosleep(&ts, NULL);
 	}
+
+	return NULL;
+}
+
+/* must hold shrinker_lock: */
+static void memwatch_start(void)
+{
+	struct meminfo info;
+	int ret;
+
+	if (memwatch_running)
+		return;
+
+	/*
+	 * Prime the snapshot so run_shrinkers() has something to look at
+	 * before the first sample:
+	 */
+	info = read_meminfo();
+	mem_total = info.total;
+	atomic64_set(&mem_available, info.available);
+
+	memwatch_exit = false;
+	ret = pthread_create(&memwatch_thread, NULL, memwatch_fn, NULL);
+	if (ret)
+		die("pthread_create error %s", strerror(ret));
+	memwatch_running = true;
+}
+
+static void shrinker_dump_stats(struct shrinker *shrinker)
+{
+	char buf[4096];
+	struct printbuf out = PBUF(buf);
+
+	if (!shrinker->reclaim_stats->count)
+		return;
+
+	fprintf(stderr, "\nreclaim stats for shrinker %s:\n",
+		shrinker->name ?: "(unnamed)");
+	bch2_time_stats_to_text(&out, shrinker->reclaim_stats);
+	fputs(buf, stderr);
+}
+
+int register_shrinker(struct shrinker *shrinker)
+{
+	shrinker->reclaim_stats = calloc(1, sizeof(*shrinker->reclaim_stats));
+	bch2_time_stats_init(shrinker->reclaim_stats);
+
+	mutex_lock(&shrinker_lock);
+	memwatch_start();
+	list_add_tail(&shrinker->list, &shrinker_list);
 	mutex_unlock(&shrinker_lock);
+	return 0;
+}
+
+void unregister_shrinker(struct shrinker *shrinker)
+{
+	bool stop;
+
+	mutex_lock(&shrinker_lock);
+	list_del(&shrinker->list);
+	stop = list_empty(&shrinker_list);
+	mutex_unlock(&shrinker_lock);
+
+	/* can't join with shrinker_lock held - the watcher takes it: */
+	if (stop) {
+		WRITE_ONCE(memwatch_exit, true);
+		pthread_join(memwatch_thread, NULL);
+		memwatch_running = false;
+	}
+
+	if (getenv("BCACHEFS_SHRINKER_STATS"))
+		shrinker_dump_stats(shrinker);
+
+	bch2_time_stats_exit(shrinker->reclaim_stats);
+	free(shrinker->reclaim_stats);
+	shrinker->reclaim_stats = NULL;
+}
+
+void run_shrinkers(void)
+{
+	s64 available;
+	u64 total;
+
+	/* Fast out if there are no shrinkers to run. */
+	if (list_empty(&shrinker_list))
+		return;
+
+	total		= READ_ONCE(mem_total);
+	available	= atomic64_read(&mem_available);
+
+	/*
+	 * The watcher thread reclaims ahead of pressure; only stall the
+	 * caller as a last resort:
+	 */
+	if (available >= (s64) MEM_CRITICAL(total))
+		return;
+
+	do_run_shrinkers(MEM_LOW(total) - available);
 }
@@ -139,6 +139,11 @@ static bool __six_relock_type(struct six_lock *lock, enum six_lock_type type,
 struct six_lock_waiter {
 	struct list_head	list;
 	struct task_struct	*task;
+	/*
+	 * Set by six_lock_wakeup() when it takes the lock on our behalf as
+	 * part of a group grant of all waiting readers:
+	 */
+	bool			granted;
 };
 
 /* This is probably up there with the more evil things I've done */
@@ -166,9 +171,16 @@ static inline int six_can_spin_on_owner(struct six_lock *lock)
 	return retval;
 }
 
+/*
+ * In the kernel a spinner that gets preempted has need_resched() set and
+ * bails; in userspace we can't detect that, so bound the spin instead:
+ */
+#define SIX_SPIN_ON_OWNER_BUDGET	(1U << 12)
+
 static inline bool six_spin_on_owner(struct six_lock *lock,
 				     struct task_struct *owner)
 {
+	unsigned budget = SIX_SPIN_ON_OWNER_BUDGET;
 	bool ret = true;
 
 	rcu_read_lock();
@@ -181,7 +193,7 @@ static inline bool six_spin_on_owner(struct six_lock *lock,
 		 */
 		barrier();
 
-		if (!owner->on_cpu || need_resched()) {
+		if (!owner->on_cpu || need_resched() || !--budget) {
 			ret = false;
 			break;
 		}
@@ -266,6 +278,10 @@ static inline bool six_optimistic_spin(struct six_lock *lock, enum six_lock_type
 
 #endif
 
+static inline void six_lock_wakeup(struct six_lock *lock,
+				   union six_lock_state state,
+				   unsigned waitlist_id);
+
 noinline
 static int __six_lock_type_slowpath(struct six_lock *lock, enum six_lock_type type,
 				    six_lock_should_sleep_fn should_sleep_fn, void *p)
@@ -273,6 +289,7 @@ static int __six_lock_type_slowpath(struct six_lock *lock, enum six_lock_type ty
 	const struct six_lock_vals l[] = LOCK_VALS;
 	union six_lock_state old, new;
 	struct six_lock_waiter wait;
+	bool handoff = false;
 	int ret = 0;
 	u64 v;
 
@@ -287,12 +304,18 @@ static int __six_lock_type_slowpath(struct six_lock *lock, enum six_lock_type ty
 
 	INIT_LIST_HEAD(&wait.list);
 	wait.task = current;
+	wait.granted = false;
+	old.v = 0;
 
 	while (1) {
 		set_current_state(TASK_UNINTERRUPTIBLE);
 		if (type == SIX_LOCK_write)
 			EBUG_ON(lock->owner != current);
-		else if (list_empty_careful(&wait.list)) {
+		else if (READ_ONCE(wait.granted)) {
+			/* six_lock_wakeup() took the lock for us: */
+			handoff = true;
+			break;
+		} else if (list_empty_careful(&wait.list)) {
 			raw_spin_lock(&lock->wait_lock);
 			list_add_tail(&wait.list, &lock->wait_list[type]);
 			raw_spin_unlock(&lock->wait_lock);
@@ -332,6 +355,22 @@ static int __six_lock_type_slowpath(struct six_lock *lock, enum six_lock_type ty
 		raw_spin_unlock(&lock->wait_lock);
 	}
 
+	/* Pairs with the smp_wmb() before list_del_init() in the waker: */
+	smp_rmb();
+
+	/*
+	 * The waker may have granted us the lock after we took it ourselves,
+	 * or after should_sleep_fn() told us to bail - put back the extra
+	 * reference:
+	 */
+	if (READ_ONCE(wait.granted) && !handoff) {
+		union six_lock_state state;
+
+		state.v = atomic64_add_return_release(l[SIX_LOCK_read].unlock_val,
+						      &lock->state.counter);
+		six_lock_wakeup(lock, state, l[SIX_LOCK_read].unlock_wakeup);
+	}
+
 	return ret;
 }
 
@@ -381,15 +420,65 @@ static inline void six_lock_wakeup(struct six_lock *lock,
 
 	raw_spin_lock(&lock->wait_lock);
 
-	list_for_each_entry_safe(w, next, wait_list, list) {
-		list_del_init(&w->list);
+	if (waitlist_id == SIX_LOCK_read) {
+		const struct six_lock_vals l[] = LOCK_VALS;
+		union six_lock_state old;
+		bool granted = false;
+		unsigned nr = 0;
+		u64 v;
 
-		if (wake_up_process(w->task) &&
-		    waitlist_id != SIX_LOCK_read) {
-			if (!list_empty(wait_list))
-				set_bit(waitlist_bitnr(waitlist_id),
-					(unsigned long *) &lock->state.v);
-			break;
+		list_for_each_entry(w, wait_list, list)
+			nr++;
+
+		if (!nr)
+			goto no_grant;
+
+		/*
+		 * Group grant: flip the lock state once, taking a read
+		 * reference for every waiter, instead of having each woken
+		 * reader separately retry the cmpxchg - where it can lose to
+		 * a freshly arrived writer and go back to sleep, one at a
+		 * time (the wake convoy this replaces). Fails only if a new
+		 * writer snuck in since our unlock; then the readers retry
+		 * themselves as before:
+		 */
+		v = READ_ONCE(lock->state.v);
+		do {
+			old.v = v;
+
+			if (old.v & l[SIX_LOCK_read].lock_fail)
+				goto no_grant;
+		} while ((v = atomic64_cmpxchg_acquire(&lock->state.counter,
+					old.v,
+					old.v + nr * l[SIX_LOCK_read].lock_val)) != old.v);
+
+		granted = true;
+no_grant:
+		list_for_each_entry_safe(w, next, wait_list, list) {
+			struct task_struct *task = w->task;
+
+			if (granted)
+				WRITE_ONCE(w->granted, true);
+			/*
+			 * Order the granted store before deleting from the
+			 * list: a waiter that took the lock itself skips
+			 * wait_lock when it finds its entry already removed,
+			 * and must still observe @granted:
+			 */
+			smp_wmb();
+			list_del_init(&w->list);
+			wake_up_process(task);
+		}
+	} else {
+		list_for_each_entry_safe(w, next, wait_list, list) {
+			list_del_init(&w->list);
+
+			if (wake_up_process(w->task)) {
+				if (!list_empty(wait_list))
+					set_bit(waitlist_bitnr(waitlist_id),
+						(unsigned long *) &lock->state.v);
+				break;
+			}
 		}
 	}
 
@@ -5,6 +5,7 @@
 
 #include <linux/kernel.h>
 #include <linux/kthread.h>
+#include <linux/list.h>
 #include <linux/timer.h>
 
 /**
@@ -23,114 +24,29 @@ static struct timespec timespec_add_ns(struct timespec a, u64 ns)
 	return a;
 }
 
-#define DECLARE_HEAP(type)						\
-struct {								\
-	size_t size, used;						\
-	type *data;							\
-}
+/*
+ * Hierarchical timer wheel: pending timers hang off a slot determined by
+ * their expiry time, so arming and deleting a timer are O(1) list operations
+ * instead of a scan of every pending timer, and a tick expires a whole slot
+ * at a time.
+ *
+ * Level 0 slots are a jiffy wide; each level up is 64x coarser. When level
+ * n wraps, the current level n+1 slot is cascaded - its timers are
+ * re-added, landing in finer grained slots now that their expiry is closer.
+ */
+#define WHEEL_BITS	6
+#define WHEEL_SIZE	(1UL << WHEEL_BITS)
+#define WHEEL_MASK	(WHEEL_SIZE - 1)
+#define WHEEL_LEVELS	4
 
-#define heap_init(heap, _size)						\
-({									\
-	size_t _bytes;							\
-	(heap)->used = 0;						\
-	(heap)->size = (_size);						\
-	_bytes = (heap)->size * sizeof(*(heap)->data);			\
-	(heap)->data = malloc(_bytes);					\
-	(heap)->data;							\
-})
-
-#define heap_free(heap)							\
-do {									\
-	kvfree((heap)->data);						\
-	(heap)->data = NULL;						\
-} while (0)
-
-#define heap_swap(h, i, j)	swap((h)->data[i], (h)->data[j])
-
-#define heap_sift(h, i, cmp)						\
-do {									\
-	size_t _r, _j = i;						\
-									\
-	for (; _j * 2 + 1 < (h)->used; _j = _r) {			\
-		_r = _j * 2 + 1;					\
-		if (_r + 1 < (h)->used &&				\
-		    cmp((h)->data[_r], (h)->data[_r + 1]))		\
-			_r++;						\
-									\
-		if (cmp((h)->data[_r], (h)->data[_j]))			\
-			break;						\
-		heap_swap(h, _r, _j);					\
-	}								\
-} while (0)
-
-#define heap_sift_down(h, i, cmp)					\
-do {									\
-	while (i) {							\
-		size_t p = (i - 1) / 2;					\
-		if (cmp((h)->data[i], (h)->data[p]))			\
-			break;						\
-		heap_swap(h, i, p);					\
-		i = p;							\
-	}								\
-} while (0)
-
-#define heap_add(h, d, cmp)						\
-({									\
-	bool _r = !heap_full(h);					\
-	if (_r) {							\
-		size_t _i = (h)->used++;				\
-		(h)->data[_i] = d;					\
-									\
-		heap_sift_down(h, _i, cmp);				\
-		heap_sift(h, _i, cmp);					\
-	}								\
-	_r;								\
-})
-
-#define heap_del(h, i, cmp)						\
-do {									\
-	size_t _i = (i);						\
-									\
-	BUG_ON(_i >= (h)->used);					\
-	(h)->used--;							\
-	heap_swap(h, _i, (h)->used);					\
-	heap_sift_down(h, _i, cmp);					\
-	heap_sift(h, _i, cmp);						\
-} while (0)
-
-#define heap_pop(h, d, cmp)						\
-({									\
-	bool _r = (h)->used;						\
-	if (_r) {							\
-		(d) = (h)->data[0];					\
-		heap_del(h, 0, cmp);					\
-	}								\
-	_r;								\
-})
-
-#define heap_peek(h)	((h)->used ? &(h)->data[0] : NULL)
-#define heap_full(h)	((h)->used == (h)->size)
-#define heap_empty(h)	((h)->used == 0)
-
-#define heap_resort(heap, cmp)						\
-do {									\
-	ssize_t _i;							\
-	for (_i = (ssize_t) (heap)->used / 2 -  1; _i >= 0; --_i)	\
-		heap_sift(heap, _i, cmp);				\
-} while (0)
-
-struct pending_timer {
-	struct timer_list	*timer;
-	unsigned long		expires;
-};
-
-static inline bool pending_timer_cmp(struct pending_timer a,
-				     struct pending_timer b)
-{
-	return a.expires < b.expires;
-}
+#define WHEEL_LEVEL_SHIFT(level)	(WHEEL_BITS * (level))
+#define WHEEL_LEVEL_RANGE(level)	(1UL << WHEEL_LEVEL_SHIFT((level) + 1))
+
+static struct list_head timer_wheel[WHEEL_LEVELS][WHEEL_SIZE];
 
-static DECLARE_HEAP(struct pending_timer) pending_timers;
+/* First jiffy the timer thread hasn't processed yet: */
+static unsigned long	wheel_clock;
+static unsigned long	timers_pending;
 
 static pthread_mutex_t	timer_lock = PTHREAD_MUTEX_INITIALIZER;
 static pthread_cond_t	timer_cond = PTHREAD_COND_INITIALIZER;
@@ -142,30 +58,138 @@ static inline bool timer_running(void)
 	return timer_seq & 1;
 }
 
-static ssize_t timer_idx(struct timer_list *timer)
+/* must hold timer_lock: */
+static void timer_wheel_add(struct timer_list *timer)
+{
+	unsigned long expires = timer->expires;
+	unsigned long delta;
+	unsigned level;
+
+	/*
+	 * A timer expiring in the past goes in the next slot we'll process -
+	 * it can't go further back, wheel_clock only stands still while
+	 * timer_lock is held:
+	 */
+	if (time_before(expires, wheel_clock))
+		expires = wheel_clock;
+
+	/*
+	 * Timers past the top level's range just go in the furthest slot -
+	 * they'll be cascaded and re-added, with their real expiry now closer:
+	 */
+	if (time_after_eq(expires, wheel_clock +
+			  WHEEL_LEVEL_RANGE(WHEEL_LEVELS - 1)))
+		expires = wheel_clock + WHEEL_LEVEL_RANGE(WHEEL_LEVELS - 1) - 1;
+
+	delta = expires - wheel_clock;
+
+	for (level = 0; level < WHEEL_LEVELS - 1; level++)
+		if (delta < WHEEL_LEVEL_RANGE(level))
+			break;
+
+	list_add_tail(&timer->entry,
+		      &timer_wheel[level][(expires >> WHEEL_LEVEL_SHIFT(level)) &
+					  WHEEL_MASK]);
+	timers_pending++;
+}
+
+/* must hold timer_lock: */
+static void timer_wheel_del(struct timer_list *timer)
+{
+	list_del(&timer->entry);
+	timer->pending = false;
+	timers_pending--;
+}
+
+/*
+ * Advance the wheel up to and including @now, collecting expired timers onto
+ * @expired in expiry order. Must hold timer_lock.
+ */
+static void timer_wheel_advance(unsigned long now, struct list_head *expired)
 {
-	size_t i;
+	if (!timers_pending) {
+		wheel_clock = now + 1;
+		return;
+	}
 
-	for (i = 0; i < pending_timers.used; i++)
-		if (pending_timers.data[i].timer == timer)
-			return i;
+	while (time_before_eq(wheel_clock, now)) {
+		unsigned long slot = wheel_clock & WHEEL_MASK;
+		unsigned level;
+
+		/*
+		 * Level 0 just wrapped: cascade the next slot at each coarser
+		 * level, stopping at the first level that didn't also wrap:
+		 */
+		if (!slot)
+			for (level = 1; level < WHEEL_LEVELS; level++) {
+				unsigned long idx =
+					(wheel_clock >> WHEEL_LEVEL_SHIFT(level)) &
+					WHEEL_MASK;
+				struct list_head cascade;
+				struct timer_list *timer;
+
+				list_replace_init(&timer_wheel[level][idx],
+						  &cascade);
+
+				while (!list_empty(&cascade)) {
+					timer = list_first_entry(&cascade,
+							struct timer_list, entry);
+					list_del(&timer->entry);
+					timers_pending--;
+					timer_wheel_add(timer);
+				}
+
+				if (idx)
+					break;
+			}
+
+		while (!list_empty(&timer_wheel[0][slot]))
+			list_move_tail(timer_wheel[0][slot].next, expired);
+		wheel_clock++;
+	}
+}
+
+/*
+ * Next jiffy the timer thread has something to do: either expiring a level 0
+ * slot, or cascading a slot at a coarser level. Must hold timer_lock, and
+ * there must be a pending timer.
+ */
+static unsigned long timer_wheel_next_event(void)
+{
+	unsigned long next = wheel_clock + WHEEL_LEVEL_RANGE(WHEEL_LEVELS - 1);
+	unsigned level, i;
+
+	for (level = 0; level < WHEEL_LEVELS; level++) {
+		unsigned long clk = wheel_clock >> WHEEL_LEVEL_SHIFT(level);
+
+		for (i = 0; i < WHEEL_SIZE; i++) {
+			unsigned long t = (clk + i) << WHEEL_LEVEL_SHIFT(level);
+
+			if (time_before(t, wheel_clock))
+				continue;
+			if (time_after_eq(t, next))
+				break;
+
+			if (!list_empty(&timer_wheel[level][(clk + i) &
+							    WHEEL_MASK]))
+				next = t;
+		}
+	}
 
-	return -1;
+	return next;
 }
 
 int del_timer(struct timer_list *timer)
 {
-	ssize_t idx;
+	bool pending;
 
 	pthread_mutex_lock(&timer_lock);
-	idx = timer_idx(timer);
-	if (idx >= 0)
-		heap_del(&pending_timers, idx, pending_timer_cmp);
-
-	timer->pending = false;
+	pending = timer->pending;
+	if (pending)
+		timer_wheel_del(timer);
 	pthread_mutex_unlock(&timer_lock);
 
-	return idx >= 0;
+	return pending;
 }
 
 void flush_timers(void)
@@ -183,111 +207,95 @@ void flush_timers(void)
 int del_timer_sync(struct timer_list *timer)
 {
 	unsigned long seq;
-	ssize_t idx;
+	bool pending;
 
 	pthread_mutex_lock(&timer_lock);
-	idx = timer_idx(timer);
-	if (idx >= 0)
-		heap_del(&pending_timers, idx, pending_timer_cmp);
-
-	timer->pending = false;
+	pending = timer->pending;
+	if (pending)
+		timer_wheel_del(timer);
 
 	seq = timer_seq;
 	while (timer_running() && seq == timer_seq)
 		pthread_cond_wait(&timer_running_cond, &timer_lock);
 	pthread_mutex_unlock(&timer_lock);
 
-	return idx >= 0;
+	return pending;
 }
 
 int mod_timer(struct timer_list *timer, unsigned long expires)
 {
-	ssize_t idx;
+	bool pending;
 
 	pthread_mutex_lock(&timer_lock);
-	timer->expires = expires;
-	timer->pending = true;
-	idx = timer_idx(timer);
+	pending = timer->pending;
 
-	if (idx >= 0 &&
-	    pending_timers.data[idx].expires == expires)
+	if (pending && timer->expires == expires)
 		goto out;
 
-	if (idx >= 0) {
-		pending_timers.data[idx].expires = expires;
-
-		heap_sift_down(&pending_timers, idx, pending_timer_cmp);
-		heap_sift(&pending_timers, idx, pending_timer_cmp);
-	} else {
-		if (heap_full(&pending_timers)) {
-			pending_timers.size *= 2;
-			pending_timers.data =
-				realloc(pending_timers.data,
-					pending_timers.size *
-					sizeof(struct pending_timer));
+	if (pending)
+		timer_wheel_del(timer);
 
-			BUG_ON(!pending_timers.data);
-		}
-
-		heap_add(&pending_timers,
-			 ((struct pending_timer) {
-				.timer = timer,
-				.expires = expires,
-			 }),
-			 pending_timer_cmp);
-	}
+	timer->expires = expires;
+	timer->pending = true;
+	timer_wheel_add(timer);
 
 	pthread_cond_signal(&timer_cond);
 out:
 	pthread_mutex_unlock(&timer_lock);
 
-	return idx >= 0;
+	return pending;
 }
 
 static bool timer_thread_stop = false;
 
 static int timer_thread(void *arg)
 {
-	struct pending_timer *p;
+	struct timer_list *timer;
 	struct timespec ts;
-	unsigned long now;
+	unsigned long now, next;
+	LIST_HEAD(expired);
 	int ret;
 
 	pthread_mutex_lock(&timer_lock);
 
 	while (!timer_thread_stop) {
 		now = jiffies;
-		p = heap_peek(&pending_timers);
-
-		if (!p) {
-			pthread_cond_wait(&timer_cond, &timer_lock);
-			continue;
-		}
-
-		if (time_after_eq(now, p->expires)) {
-			struct timer_list *timer = p->timer;
-
-			heap_del(&pending_timers, 0, pending_timer_cmp);
-			BUG_ON(!timer_pending(timer));
-			timer->pending = false;
+		timer_wheel_advance(now, &expired);
 
+		if (!list_empty(&expired)) {
+			/*
+			 * The whole batch counts as a single critical section
+			 * for flush_timers()/del_timer_sync():
+			 */
 			timer_seq++;
 			BUG_ON(!timer_running());
 
-			pthread_mutex_unlock(&timer_lock);
-			timer->function(timer);
-			pthread_mutex_lock(&timer_lock);
+			while (!list_empty(&expired)) {
+				timer = list_first_entry(&expired,
+						struct timer_list, entry);
+				timer_wheel_del(timer);
+
+				pthread_mutex_unlock(&timer_lock);
+				timer->function(timer);
+				pthread_mutex_lock(&timer_lock);
+			}
 
 			timer_seq++;
 			pthread_cond_broadcast(&timer_running_cond);
 			continue;
 		}
 
+		if (!timers_pending) {
+			pthread_cond_wait(&timer_cond, &timer_lock);
+			continue;
+		}
+
+		next = timer_wheel_next_event();
 
 		ret = clock_gettime(CLOCK_REALTIME, &ts);
 		BUG_ON(ret);
 
-		ts = timespec_add_ns(ts, jiffies_to_nsecs(p->expires - now));
+		ts = timespec_add_ns(ts, jiffies_to_nsecs(next - now));
 
 		pthread_cond_timedwait(&timer_cond, &timer_lock, &ts);
 	}
@@ -302,8 +310,13 @@ struct task_struct *timer_task;
 __attribute__((constructor(103)))
 static void timers_init(void)
 {
-	heap_init(&pending_timers, 64);
-	BUG_ON(!pending_timers.data);
+	unsigned level, i;
+
+	for (level = 0; level < WHEEL_LEVELS; level++)
+		for (i = 0; i < WHEEL_SIZE; i++)
+			INIT_LIST_HEAD(&timer_wheel[level][i]);
+
+	wheel_clock = jiffies;
 
 	timer_task = kthread_run(timer_thread, NULL, "timers");
 	BUG_ON(IS_ERR(timer_task));
@@ -0,0 +1,143 @@
+// SPDX-License-Identifier: GPL-2.0
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <linux/tracepoint.h>
+
+bool bch2_trace_on;
+
+static struct trace_buf *trace_buf;
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread struct trace_ring *trace_ring;
+
+static u64 trace_clock(void)
+{
+#ifdef __x86_64__
+	return __builtin_ia32_rdtsc();
+#else
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (u64) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+__attribute__((constructor))
+static void bch2_trace_init(void)
+{
+	const char *path = getenv("BCACHEFS_TRACE");
+	int fd;
+
+	if (!path)
+		return;
+
+	fd = open(path, O_RDWR|O_CREAT, 0600);
+	if (fd < 0)
+		return;
+
+	if (ftruncate(fd, sizeof(struct trace_buf))) {
+		close(fd);
+		return;
+	}
+
+	trace_buf = mmap(NULL, sizeof(struct trace_buf),
+			 PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+
+	if (trace_buf == MAP_FAILED) {
+		trace_buf = NULL;
+		return;
+	}
+
+	/*
+	 * If the file already existed we keep its name table and rings, so ids
+	 * stay stable across restarts:
+	 */
+	if (trace_buf->magic != TRACE_BUF_MAGIC ||
+	    trace_buf->version != TRACE_BUF_VERSION) {
+		memset(trace_buf, 0, sizeof(struct trace_buf));
+		trace_buf->magic	= TRACE_BUF_MAGIC;
+		trace_buf->version	= TRACE_BUF_VERSION;
+	}
+
+	bch2_trace_on = true;
+}
+
+static int trace_register(struct trace_tp *tp)
+{
+	unsigned i;
+	int ret = 0;
+
+	pthread_mutex_lock(&trace_lock);
+
+	for (i = 0; i < trace_buf->nr_names; i++)
+		if (!strncmp(trace_buf->names[i], tp->name, TRACE_NAME_LEN)) {
+			ret = i + 1;
+			goto out;
+		}
+
+	if (trace_buf->nr_names < TRACE_NAMES_MAX) {
+		i = trace_buf->nr_names++;
+		strncpy(trace_buf->names[i], tp->name, TRACE_NAME_LEN - 1);
+		ret = i + 1;
+	}
+out:
+	pthread_mutex_unlock(&trace_lock);
+	return ret;
+}
+
+static struct trace_ring *trace_ring_get(void)
+{
+	u64 tid = syscall(SYS_gettid);
+	unsigned i;
+
+	pthread_mutex_lock(&trace_lock);
+
+	for (i = 0; i < TRACE_THREADS_MAX; i++)
+		if (!trace_buf->rings[i].tid) {
+			trace_buf->rings[i].tid = tid;
+			trace_ring = &trace_buf->rings[i];
+			break;
+		}
+
+	pthread_mutex_unlock(&trace_lock);
+	return trace_ring;
+}
+
+void bch2_trace_emit(struct trace_tp *tp, unsigned long arg)
+{
+	struct trace_ring *r = trace_ring ?: trace_ring_get();
+	struct trace_entry *e;
+
+	if (!r)
+		return;
+
+	if (!tp->id) {
+		tp->id = trace_register(tp);
+		if (!tp->id) {
+			tp->id = -1;
+			return;
+		}
+	}
+
+	if (tp->id < 0)
+		return;
+
+	e = &r->entries[r->head & (TRACE_RING_ENTRIES - 1)];
+	e->time	= trace_clock();
+	e->id	= tp->id;
+	e->arg	= arg;
+	/*
+	 * head is published after the entry; a concurrent dump may see one
+	 * torn entry at the head, which is fine for diagnostics:
+	 */
+	r->head++;
+}
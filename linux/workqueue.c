@@ -1,20 +1,58 @@
 #include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <unistd.h>
 
 #include <linux/kthread.h>
 #include <linux/slab.h>
 #include <linux/workqueue.h>
 
+/*
+ * With BCACHEFS_NUMA set, workers are pinned round robin across CPUs: a
+ * migrating worker drags nothing with it, so on multi socket machines the
+ * buffers it first touched (NUMA placement is first touch, and the page pool's
+ * reserves are split per node to preserve it - see linux/page.c) end up remote
+ * for the rest of their life. Pinning keeps a worker's sorts and searches on
+ * the node where its buffers live:
+ */
+static bool		wq_numa;
+static atomic_t		wq_next_cpu;
+
+static void wq_worker_set_affinity(void)
+{
+	long nr_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	cpu_set_t cpus;
+	unsigned cpu;
+
+	if (!wq_numa || nr_cpus <= 0)
+		return;
+
+	cpu = (atomic_inc_return(&wq_next_cpu) - 1) % nr_cpus;
+
+	CPU_ZERO(&cpus);
+	CPU_SET(cpu, &cpus);
+	pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+}
+
 static pthread_mutex_t	wq_lock = PTHREAD_MUTEX_INITIALIZER;
 static pthread_cond_t	work_finished = PTHREAD_COND_INITIALIZER;
 static LIST_HEAD(wq_list);
 
+#define WQ_MAX_WORKERS		64
+
+struct wq_worker {
+	struct workqueue_struct	*wq;
+	struct task_struct	*task;
+	struct work_struct	*current_work;
+};
+
 struct workqueue_struct {
 	struct list_head	list;
 
-	struct work_struct	*current_work;
 	struct list_head	pending_work;
 
-	struct task_struct	*worker;
+	unsigned		nr_workers;
+	struct wq_worker	workers[WQ_MAX_WORKERS];
 	char			name[24];
 };
 
@@ -40,11 +78,21 @@ static bool set_work_pending(struct work_struct *work)
 static void __queue_work(struct workqueue_struct *wq,
 			 struct work_struct *work)
 {
+	unsigned i;
+
 	BUG_ON(!work_pending(work));
 	BUG_ON(!list_empty(&work->entry));
 
 	list_add_tail(&work->entry, &wq->pending_work);
-	wake_up_process(wq->worker);
+
+	/*
+	 * All workers sleep in schedule() with the pending list under wq_lock;
+	 * waking them all is work conserving and an idle pool is cheap to
+	 * wake:
+	 */
+	for (i = 0; i < wq->nr_workers; i++)
+		if (!wq->workers[i].current_work)
+			wake_up_process(wq->workers[i].task);
 }
 
 bool queue_work(struct workqueue_struct *wq, struct work_struct *work)
@@ -137,10 +185,12 @@ retry:
 static bool work_running(struct work_struct *work)
 {
 	struct workqueue_struct *wq;
+	unsigned i;
 
 	list_for_each_entry(wq, &wq_list, list)
-		if (wq->current_work == work)
-			return true;
+		for (i = 0; i < wq->nr_workers; i++)
+			if (wq->workers[i].current_work == work)
+				return true;
 
 	return false;
 }
@@ -232,18 +282,21 @@ bool cancel_delayed_work_sync(struct delayed_work *dwork)
 
 static int worker_thread(void *arg)
 {
-	struct workqueue_struct *wq = arg;
+	struct wq_worker *worker = arg;
+	struct workqueue_struct *wq = worker->wq;
 	struct work_struct *work;
 
+	wq_worker_set_affinity();
+
 	pthread_mutex_lock(&wq_lock);
 	while (1) {
 		__set_current_state(TASK_INTERRUPTIBLE);
 		work = list_first_entry_or_null(&wq->pending_work,
 				struct work_struct, entry);
-		wq->current_work = work;
+		worker->current_work = work;
 
 		if (kthread_should_stop()) {
-			BUG_ON(wq->current_work);
+			BUG_ON(worker->current_work);
 			break;
 		}
 
@@ -271,7 +324,10 @@ static int worker_thread(void *arg)
 
 void destroy_workqueue(struct workqueue_struct *wq)
 {
-	kthread_stop(wq->worker);
+	unsigned i;
+
+	for (i = 0; i < wq->nr_workers; i++)
+		kthread_stop(wq->workers[i].task);
 
 	pthread_mutex_lock(&wq_lock);
 	list_del(&wq->list);
@@ -287,6 +343,8 @@ struct workqueue_struct *alloc_workqueue(const char *fmt,
 {
 	va_list args;
 	struct workqueue_struct *wq;
+	long nr_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	unsigned i;
 
 	wq = kzalloc(sizeof(*wq), GFP_KERNEL);
 	if (!wq)
@@ -299,10 +357,33 @@ struct workqueue_struct *alloc_workqueue(const char *fmt,
 	vsnprintf(wq->name, sizeof(wq->name), fmt, args);
 	va_end(args);
 
-	wq->worker = kthread_run(worker_thread, wq, "%s", wq->name);
-	if (IS_ERR(wq->worker)) {
-		kfree(wq);
-		return NULL;
+	/*
+	 * In the kernel max_active is a per-cpu limit for bound workqueues
+	 * and a total limit for WQ_UNBOUND; an unbound workqueue with
+	 * max_active 1 is ordered and must stay single threaded. All workers
+	 * on a workqueue pull from the shared pending list, so sizing the
+	 * pool to the concurrency limit makes the pool work conserving:
+	 */
+	if (!max_active)
+		max_active = 16;
+
+	wq->nr_workers = flags & WQ_UNBOUND
+		? max_active
+		: max_active * max_t(long, nr_cpus, 1);
+	wq->nr_workers = min_t(unsigned, wq->nr_workers, WQ_MAX_WORKERS);
+
+	for (i = 0; i < wq->nr_workers; i++) {
+		struct wq_worker *worker = &wq->workers[i];
+
+		worker->wq = wq;
+		worker->task = kthread_run(worker_thread, worker,
+					   "%s/%u", wq->name, i);
+		if (IS_ERR(worker->task)) {
+			while (i--)
+				kthread_stop(wq->workers[i].task);
+			kfree(wq);
+			return NULL;
+		}
 	}
 
 	pthread_mutex_lock(&wq_lock);
@@ -321,6 +402,8 @@ struct workqueue_struct *system_freezable_wq;
 __attribute__((constructor(102)))
 static void wq_init(void)
 {
+	wq_numa = getenv("BCACHEFS_NUMA") != NULL;
+
 	system_wq = alloc_workqueue("events", 0, 0);
 	system_highpri_wq = alloc_workqueue("events_highpri", WQ_HIGHPRI, 0);
 	system_long_wq = alloc_workqueue("events_long", 0, 0);
@@ -1,7 +1,10 @@
 
 #include <errno.h>
+#include <pthread.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
+#include <zlib.h>
 
 #include "qcow2.h"
 #include "tools-util.h"
@@ -9,6 +12,9 @@
 #define QCOW_MAGIC		(('Q' << 24) | ('F' << 16) | ('I' << 8) | 0xfb)
 #define QCOW_VERSION		2
 #define QCOW_OFLAG_COPIED	(1LL << 63)
+#define QCOW_OFLAG_COMPRESSED	(1LL << 62)
+
+#define QCOW2_BATCH_NR		64
 
 struct qcow2_hdr {
 	u32			magic;
@@ -44,6 +50,9 @@ struct qcow2_image {
 static void flush_l2(struct qcow2_image *img)
 {
 	if (img->l1_index != -1) {
+		/* L2 tables must be cluster aligned, compressed data isn't: */
+		img->offset = round_up(img->offset, img->block_size);
+
 		img->l1_table[img->l1_index] =
 			cpu_to_be64(img->offset|QCOW_OFLAG_COPIED);
 		xpwrite(img->fd, img->l2_table, img->block_size, img->offset);
@@ -54,7 +63,7 @@ static void flush_l2(struct qcow2_image *img)
 	}
 }
 
-static void add_l2(struct qcow2_image *img, u64 src_blk, u64 dst_offset)
+static void add_l2(struct qcow2_image *img, u64 src_blk, u64 l2_entry)
 {
 	unsigned l2_size = img->block_size / sizeof(u64);
 	u64 l1_index = src_blk / l2_size;
@@ -65,11 +74,116 @@ static void add_l2(struct qcow2_image *img, u64 src_blk, u64 dst_offset)
 		img->l1_index = l1_index;
 	}
 
-	img->l2_table[l2_index] = cpu_to_be64(dst_offset|QCOW_OFLAG_COPIED);
+	img->l2_table[l2_index] = cpu_to_be64(l2_entry);
+}
+
+/* Batched parallel read + compress, with in order writing of the results: */
+
+struct qcow2_cluster {
+	u64			src_offset;
+	char			*src;
+	char			*compressed;
+	unsigned		csize;	/* 0: incompressible, stored raw */
+};
+
+struct qcow2_compress_thread {
+	pthread_t		thread;
+	struct qcow2_cluster	*clusters;
+	unsigned		nr;
+	unsigned		idx;
+	unsigned		stride;
+	unsigned		block_size;
+	int			infd;
+};
+
+static void *qcow2_compress_thread_fn(void *_t)
+{
+	struct qcow2_compress_thread *t = _t;
+	unsigned i;
+
+	for (i = t->idx; i < t->nr; i += t->stride) {
+		struct qcow2_cluster *c = &t->clusters[i];
+		z_stream strm = { 0 };
+		int ret;
+
+		xpread(t->infd, c->src, t->block_size, c->src_offset);
+
+		/* qcow2 compressed clusters are raw deflate, 4k window: */
+		ret = deflateInit2(&strm, Z_DEFAULT_COMPRESSION, Z_DEFLATED,
+				   -12, 9, Z_DEFAULT_STRATEGY);
+		if (ret != Z_OK)
+			die("deflateInit2 error: %i", ret);
+
+		strm.avail_in	= t->block_size;
+		strm.next_in	= (void *) c->src;
+		strm.avail_out	= t->block_size - 1;
+		strm.next_out	= (void *) c->compressed;
+
+		ret = deflate(&strm, Z_FINISH);
+		c->csize = ret == Z_STREAM_END
+			? t->block_size - 1 - strm.avail_out
+			: 0;
+		deflateEnd(&strm);
+	}
+	return NULL;
+}
+
+static void qcow2_write_batch(struct qcow2_image *img, int infd,
+			      struct qcow2_cluster *clusters, unsigned nr)
+{
+	struct qcow2_compress_thread t[QCOW2_BATCH_NR];
+	unsigned i, nr_threads =
+		min_t(unsigned, nr, sysconf(_SC_NPROCESSORS_ONLN));
+
+	for (i = 0; i < nr_threads; i++) {
+		t[i] = (struct qcow2_compress_thread) {
+			.clusters	= clusters,
+			.nr		= nr,
+			.idx		= i,
+			.stride		= nr_threads,
+			.block_size	= img->block_size,
+			.infd		= infd,
+		};
+
+		if (pthread_create(&t[i].thread, NULL,
+				   qcow2_compress_thread_fn, &t[i]))
+			die("pthread_create error: %m");
+	}
+
+	for (i = 0; i < nr_threads; i++)
+		pthread_join(t[i].thread, NULL);
+
+	for (i = 0; i < nr; i++) {
+		struct qcow2_cluster *c = &clusters[i];
+		u64 src_blk = c->src_offset / img->block_size;
+		u64 dst_offset;
+
+		if (c->csize) {
+			unsigned x = 62 - (ilog2(img->block_size) - 8);
+			u64 nb_csectors;
+
+			dst_offset = img->offset;
+			img->offset += c->csize;
+
+			nb_csectors = DIV_ROUND_UP((dst_offset & 511) + c->csize,
+						   512);
+
+			xpwrite(img->fd, c->compressed, c->csize, dst_offset);
+			add_l2(img, src_blk, QCOW_OFLAG_COMPRESSED|
+			       (nb_csectors << x)|dst_offset);
+		} else {
+			/* Uncompressed clusters must be cluster aligned: */
+			dst_offset = round_up(img->offset, img->block_size);
+			img->offset = dst_offset + img->block_size;
+
+			xpwrite(img->fd, c->src, img->block_size, dst_offset);
+			add_l2(img, src_blk, dst_offset|QCOW_OFLAG_COPIED);
+		}
+	}
 }
 
 void qcow2_write_image(int infd, int outfd, ranges *data,
-		       unsigned block_size)
+		       unsigned block_size, bool compress)
 {
 	u64 image_size = get_size(NULL, infd);
 	unsigned l2_size = block_size / sizeof(u64);
@@ -83,12 +197,20 @@ void qcow2_write_image(int infd, int outfd, ranges *data,
 		.l1_index	= -1,
 		.offset		= round_up(sizeof(hdr), block_size),
 	};
+	struct qcow2_cluster *clusters = NULL;
+	char *cluster_bufs = NULL;
+	unsigned nr_clusters = 0;
 	struct range *r;
 	char *buf = xmalloc(block_size);
 	u64 src_offset, dst_offset;
 
 	assert(is_power_of_2(block_size));
 
+	if (compress) {
+		clusters	= xcalloc(QCOW2_BATCH_NR, sizeof(*clusters));
+		cluster_bufs	= xmalloc(QCOW2_BATCH_NR * block_size * 2);
+	}
+
 	ranges_roundup(data, block_size);
 	ranges_sort_merge(data);
 
@@ -97,15 +219,36 @@ void qcow2_write_image(int infd, int outfd, ranges *data,
 		for (src_offset = r->start;
 		     src_offset < r->end;
 		     src_offset += block_size) {
+			if (compress) {
+				clusters[nr_clusters] = (struct qcow2_cluster) {
+					.src_offset	= src_offset,
+					.src		= cluster_bufs +
+						(nr_clusters * 2) * block_size,
+					.compressed	= cluster_bufs +
+						(nr_clusters * 2 + 1) * block_size,
+				};
+
+				if (++nr_clusters == QCOW2_BATCH_NR) {
+					qcow2_write_batch(&img, infd,
+							  clusters, nr_clusters);
+					nr_clusters = 0;
+				}
+				continue;
+			}
+
 			dst_offset = img.offset;
 			img.offset += img.block_size;
 
 			xpread(infd, buf, block_size, src_offset);
 			xpwrite(outfd, buf, block_size, dst_offset);
 
-			add_l2(&img, src_offset / block_size, dst_offset);
+			add_l2(&img, src_offset / block_size,
+			       dst_offset|QCOW_OFLAG_COPIED);
 		}
 
+	if (nr_clusters)
+		qcow2_write_batch(&img, infd, clusters, nr_clusters);
+
 	flush_l2(&img);
 
 	/* Write L1 table: */
@@ -127,5 +270,141 @@ void qcow2_write_image(int infd, int outfd, ranges *data,
 
 	free(img.l2_table);
 	free(img.l1_table);
+	free(cluster_bufs);
+	free(clusters);
+	free(buf);
+}
+
+/* Reading an image back (bcachefs restore): */
+
+#define QCOW2_RESTORE_BATCH_NR	64
+
+static void qcow2_decompress(char *dst, unsigned dst_len,
+			     const char *src, unsigned src_len)
+{
+	z_stream strm = { 0 };
+	int ret;
+
+	/* Compressed clusters are raw deflate, 4k window: */
+	ret = inflateInit2(&strm, -12);
+	if (ret != Z_OK)
+		die("inflateInit2 error: %i", ret);
+
+	strm.avail_in	= src_len;
+	strm.next_in	= (void *) src;
+	strm.avail_out	= dst_len;
+	strm.next_out	= (void *) dst;
+
+	ret = inflate(&strm, Z_FINISH);
+	if (ret != Z_STREAM_END || strm.avail_out)
+		die("error decompressing cluster: %i", ret);
+
+	inflateEnd(&strm);
+}
+
+void qcow2_read_image(int infd, int outfd)
+{
+	struct qcow2_hdr hdr;
+	struct stat statbuf = xfstat(outfd);
+	u64 *l1_table, *l2_table;
+	char *buf, *cbuf;
+	unsigned block_bits, block_size, l1_size, l2_size;
+	unsigned buf_used = 0, buf_size;
+	u64 image_size, buf_start = 0;
+	unsigned i, j;
+
+	xpread(infd, &hdr, sizeof(hdr), 0);
+
+	if (be32_to_cpu(hdr.magic) != QCOW_MAGIC)
+		die("not a qcow2 image");
+	if (be32_to_cpu(hdr.version) != QCOW_VERSION)
+		die("unsupported qcow2 version %u", be32_to_cpu(hdr.version));
+	if (hdr.crypt_method || hdr.backing_file_offset || hdr.nb_snapshots)
+		die("unsupported qcow2 image");
+
+	block_bits	= be32_to_cpu(hdr.block_bits);
+	block_size	= 1U << block_bits;
+	image_size	= be64_to_cpu(hdr.size);
+	l1_size		= be32_to_cpu(hdr.l1_size);
+	l2_size		= block_size / sizeof(u64);
+
+	if (S_ISREG(statbuf.st_mode)) {
+		if (ftruncate(outfd, image_size))
+			die("ftruncate error: %m");
+	} else if (get_size(NULL, outfd) < image_size) {
+		die("%llu byte image won't fit on %llu byte device",
+		    image_size, get_size(NULL, outfd));
+	}
+
+	l1_table = xcalloc(l1_size, sizeof(u64));
+	l2_table = xmalloc(block_size);
+	cbuf	 = xmalloc(block_size * 2);
+	buf_size = QCOW2_RESTORE_BATCH_NR * block_size;
+	buf	 = xmalloc(buf_size);
+
+	xpread(infd, l1_table, l1_size * sizeof(u64),
+	       be64_to_cpu(hdr.l1_table_offset));
+
+	/*
+	 * Walking the L1/L2 tables in order visits clusters in ascending
+	 * guest LBA order - adjacent clusters are coalesced into large
+	 * sequential writes:
+	 */
+	for (i = 0; i < l1_size; i++) {
+		u64 l1_entry = be64_to_cpu(l1_table[i]);
+
+		if (!(l1_entry & ~QCOW_OFLAG_COPIED))
+			continue;
+
+		xpread(infd, l2_table, block_size,
+		       l1_entry & ~QCOW_OFLAG_COPIED);
+
+		for (j = 0; j < l2_size; j++) {
+			u64 l2_entry = be64_to_cpu(l2_table[j]);
+			u64 dst_offset = ((u64) i * l2_size + j) << block_bits;
+
+			if (!l2_entry)
+				continue;
+
+			if (buf_used &&
+			    (dst_offset != buf_start + buf_used ||
+			     buf_used == buf_size)) {
+				xpwrite(outfd, buf, buf_used, buf_start);
+				buf_used = 0;
+			}
+
+			if (!buf_used)
+				buf_start = dst_offset;
+
+			if (l2_entry & QCOW_OFLAG_COMPRESSED) {
+				unsigned x = 62 - (block_bits - 8);
+				u64 coffset = l2_entry & (((u64) 1 << x) - 1);
+				u64 nb_csectors = (l2_entry >> x) &
+					(((u64) 1 << (62 - x)) - 1);
+				unsigned csize = nb_csectors * 512 -
+					(coffset & 511);
+
+				if (!csize || csize > block_size * 2)
+					die("bad compressed cluster size %u",
+					    csize);
+
+				xpread(infd, cbuf, csize, coffset);
+				qcow2_decompress(buf + buf_used, block_size,
+						 cbuf, csize);
+			} else {
+				xpread(infd, buf + buf_used, block_size,
+				       l2_entry & ~QCOW_OFLAG_COPIED);
+			}
+
+			buf_used += block_size;
+		}
+	}
+
+	if (buf_used)
+		xpwrite(outfd, buf, buf_used, buf_start);
+
 	free(buf);
+	free(cbuf);
+	free(l2_table);
+	free(l1_table);
 }
@@ -4,6 +4,7 @@
 #include <linux/types.h>
 #include "tools-util.h"
 
-void qcow2_write_image(int, int, ranges *, unsigned);
+void qcow2_write_image(int, int, ranges *, unsigned, bool);
+void qcow2_read_image(int, int);
 
 #endif /* _QCOW2_H */
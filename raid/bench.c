@@ -0,0 +1,640 @@
+/*
+ * Copyright (C) 2020 the bcachefs authors
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include "internal.h"
+#include "memory.h"
+#include "cpu.h"
+
+#include <stdio.h>
+#include <time.h>
+
+/*
+ * Measured selection of the fastest kernels.
+ *
+ * raid_init() picks implementations purely from cpuid, but cpuid doesn't
+ * tell the whole story: on some CPUs the wider vector units downclock the
+ * core enough that a nominally slower instruction set wins, and the
+ * extended register variants trade register pressure against decode
+ * bandwidth differently across microarchitectures.
+ *
+ * raid_bench() instead times every candidate for each forwarder on
+ * realistic block sizes and installs the measured winner. The result is
+ * cached in a file keyed on the detected instruction sets, so only the
+ * first run on a machine pays the (few ms) measurement cost.
+ */
+
+/*
+ * Number of data blocks to bench with.
+ */
+#define BENCH_DATA 8
+
+/*
+ * Size of the blocks to bench with.
+ */
+#define BENCH_SIZE 4096
+
+/*
+ * Measurement time for each candidate, in nanoseconds.
+ */
+#define BENCH_TIME 100000
+
+/*
+ * Maximum number of candidates for a single forwarder.
+ */
+#define BENCH_FUNC_MAX 8
+
+/*
+ * Number of forwarders to select.
+ */
+#define BENCH_SLOT_MAX 10
+
+struct bench_func {
+	const char *tag;
+	void (*gen)(int nd, size_t size, void **vv);
+	void (*rec)(int nr, int *id, int *ip, int nd, size_t size, void **vv);
+	unsigned speed;
+};
+
+struct bench_slot {
+	const char *name;
+	int nr;
+	int nf;
+	struct bench_func f[BENCH_FUNC_MAX];
+};
+
+static void bench_gen(struct bench_slot *b, const char *tag,
+	void (*gen)(int nd, size_t size, void **vv))
+{
+	BUG_ON(b->nf >= BENCH_FUNC_MAX);
+	b->f[b->nf].tag = tag;
+	b->f[b->nf].gen = gen;
+	b->f[b->nf].rec = 0;
+	b->f[b->nf].speed = 0;
+	++b->nf;
+}
+
+static void bench_rec(struct bench_slot *b, const char *tag,
+	void (*rec)(int nr, int *id, int *ip, int nd, size_t size, void **vv))
+{
+	BUG_ON(b->nf >= BENCH_FUNC_MAX);
+	b->f[b->nf].tag = tag;
+	b->f[b->nf].gen = 0;
+	b->f[b->nf].rec = rec;
+	b->f[b->nf].speed = 0;
+	++b->nf;
+}
+
+/*
+ * Loads the candidate table.
+ *
+ * The cpuid guards must match the ones in raid_init(), but unlike
+ * raid_init() all the viable variants are listed, because choosing
+ * between them is exactly what the measurement is for.
+ */
+static int bench_slots(struct bench_slot *s)
+{
+	struct bench_slot *b;
+	int n = 0;
+
+	/* gen1 */
+	b = &s[n++];
+	b->name = "gen1";
+	b->nr = 1;
+	b->nf = 0;
+	if (sizeof(void *) == 4)
+		bench_gen(b, "int32", raid_gen1_int32);
+	else
+		bench_gen(b, "int64", raid_gen1_int64);
+#ifdef CONFIG_X86
+#ifdef CONFIG_SSE2
+	if (raid_cpu_has_sse2())
+		bench_gen(b, "sse2", raid_gen1_sse2);
+#endif
+#ifdef CONFIG_AVX2
+	if (raid_cpu_has_avx2())
+		bench_gen(b, "avx2", raid_gen1_avx2);
+#endif
+#ifdef CONFIG_AVX512GFNI
+	if (raid_cpu_has_avx512gfni())
+		bench_gen(b, "avx512", raid_gen1_avx512);
+#endif
+#endif
+
+	/* gen2 */
+	b = &s[n++];
+	b->name = "gen2";
+	b->nr = 2;
+	b->nf = 0;
+	if (sizeof(void *) == 4)
+		bench_gen(b, "int32", raid_gen2_int32);
+	else
+		bench_gen(b, "int64", raid_gen2_int64);
+#ifdef CONFIG_X86
+#ifdef CONFIG_SSE2
+	if (raid_cpu_has_sse2()) {
+		bench_gen(b, "sse2", raid_gen2_sse2);
+#ifdef CONFIG_X86_64
+		bench_gen(b, "sse2e", raid_gen2_sse2ext);
+#endif
+	}
+#endif
+#ifdef CONFIG_AVX2
+	if (raid_cpu_has_avx2())
+		bench_gen(b, "avx2", raid_gen2_avx2);
+#endif
+#ifdef CONFIG_AVX512GFNI
+	if (raid_cpu_has_avx512gfni())
+		bench_gen(b, "avx512gfni", raid_gen2_avx512gfni);
+#endif
+#endif
+
+	/* genz */
+	b = &s[n++];
+	b->name = "genz";
+	b->nr = 3;
+	b->nf = 0;
+	if (sizeof(void *) == 4)
+		bench_gen(b, "int32", raid_genz_int32);
+	else
+		bench_gen(b, "int64", raid_genz_int64);
+#ifdef CONFIG_X86
+#ifdef CONFIG_SSE2
+	if (raid_cpu_has_sse2()) {
+		bench_gen(b, "sse2", raid_genz_sse2);
+#ifdef CONFIG_X86_64
+		bench_gen(b, "sse2e", raid_genz_sse2ext);
+#endif
+	}
+#endif
+#ifdef CONFIG_AVX2
+#ifdef CONFIG_X86_64
+	if (raid_cpu_has_avx2())
+		bench_gen(b, "avx2e", raid_genz_avx2ext);
+#endif
+#endif
+#endif
+
+	/* gen3 */
+	b = &s[n++];
+	b->name = "gen3";
+	b->nr = 3;
+	b->nf = 0;
+	bench_gen(b, "int8", raid_gen3_int8);
+#ifdef CONFIG_X86
+#ifdef CONFIG_SSSE3
+	if (raid_cpu_has_ssse3()) {
+		bench_gen(b, "ssse3", raid_gen3_ssse3);
+#ifdef CONFIG_X86_64
+		bench_gen(b, "ssse3e", raid_gen3_ssse3ext);
+#endif
+	}
+#endif
+#ifdef CONFIG_AVX2
+#ifdef CONFIG_X86_64
+	if (raid_cpu_has_avx2())
+		bench_gen(b, "avx2e", raid_gen3_avx2ext);
+#endif
+#endif
+#endif
+
+	/* gen4 */
+	b = &s[n++];
+	b->name = "gen4";
+	b->nr = 4;
+	b->nf = 0;
+	bench_gen(b, "int8", raid_gen4_int8);
+#ifdef CONFIG_X86
+#ifdef CONFIG_SSSE3
+	if (raid_cpu_has_ssse3()) {
+		bench_gen(b, "ssse3", raid_gen4_ssse3);
+#ifdef CONFIG_X86_64
+		bench_gen(b, "ssse3e", raid_gen4_ssse3ext);
+#endif
+	}
+#endif
+#ifdef CONFIG_AVX2
+#ifdef CONFIG_X86_64
+	if (raid_cpu_has_avx2())
+		bench_gen(b, "avx2e", raid_gen4_avx2ext);
+#endif
+#endif
+#endif
+
+	/* gen5 */
+	b = &s[n++];
+	b->name = "gen5";
+	b->nr = 5;
+	b->nf = 0;
+	bench_gen(b, "int8", raid_gen5_int8);
+#ifdef CONFIG_X86
+#ifdef CONFIG_SSSE3
+	if (raid_cpu_has_ssse3()) {
+		bench_gen(b, "ssse3", raid_gen5_ssse3);
+#ifdef CONFIG_X86_64
+		bench_gen(b, "ssse3e", raid_gen5_ssse3ext);
+#endif
+	}
+#endif
+#ifdef CONFIG_AVX2
+#ifdef CONFIG_X86_64
+	if (raid_cpu_has_avx2())
+		bench_gen(b, "avx2e", raid_gen5_avx2ext);
+#endif
+#endif
+#endif
+
+	/* gen6 */
+	b = &s[n++];
+	b->name = "gen6";
+	b->nr = 6;
+	b->nf = 0;
+	bench_gen(b, "int8", raid_gen6_int8);
+#ifdef CONFIG_X86
+#ifdef CONFIG_SSSE3
+	if (raid_cpu_has_ssse3()) {
+		bench_gen(b, "ssse3", raid_gen6_ssse3);
+#ifdef CONFIG_X86_64
+		bench_gen(b, "ssse3e", raid_gen6_ssse3ext);
+#endif
+	}
+#endif
+#ifdef CONFIG_AVX2
+#ifdef CONFIG_X86_64
+	if (raid_cpu_has_avx2())
+		bench_gen(b, "avx2e", raid_gen6_avx2ext);
+#endif
+#endif
+#endif
+
+	/* rec1 */
+	b = &s[n++];
+	b->name = "rec1";
+	b->nr = 1;
+	b->nf = 0;
+	bench_rec(b, "int8", raid_rec1_int8);
+#ifdef CONFIG_X86
+#ifdef CONFIG_SSSE3
+	if (raid_cpu_has_ssse3())
+		bench_rec(b, "ssse3", raid_rec1_ssse3);
+#endif
+#ifdef CONFIG_AVX2
+	if (raid_cpu_has_avx2())
+		bench_rec(b, "avx2", raid_rec1_avx2);
+#endif
+#ifdef CONFIG_AVX512GFNI
+	if (raid_cpu_has_avx512gfni())
+		bench_rec(b, "avx512gfni", raid_rec1_avx512gfni);
+#endif
+#endif
+
+	/* rec2 */
+	b = &s[n++];
+	b->name = "rec2";
+	b->nr = 2;
+	b->nf = 0;
+	bench_rec(b, "int8", raid_rec2_int8);
+#ifdef CONFIG_X86
+#ifdef CONFIG_SSSE3
+	if (raid_cpu_has_ssse3())
+		bench_rec(b, "ssse3", raid_rec2_ssse3);
+#endif
+#ifdef CONFIG_AVX2
+	if (raid_cpu_has_avx2())
+		bench_rec(b, "avx2", raid_rec2_avx2);
+#endif
+#ifdef CONFIG_AVX512GFNI
+	if (raid_cpu_has_avx512gfni())
+		bench_rec(b, "avx512gfni", raid_rec2_avx512gfni);
+#endif
+#endif
+
+	/* recX */
+	b = &s[n++];
+	b->name = "recX";
+	b->nr = 3;
+	b->nf = 0;
+	bench_rec(b, "int8", raid_recX_int8);
+#ifdef CONFIG_X86
+#ifdef CONFIG_SSSE3
+	if (raid_cpu_has_ssse3())
+		bench_rec(b, "ssse3", raid_recX_ssse3);
+#endif
+#ifdef CONFIG_AVX2
+	if (raid_cpu_has_avx2())
+		bench_rec(b, "avx2", raid_recX_avx2);
+#endif
+#endif
+
+	BUG_ON(n != BENCH_SLOT_MAX);
+
+	return n;
+}
+
+/*
+ * Installs the winner of the specified forwarder.
+ */
+static void bench_install(int i, const struct bench_func *f)
+{
+	switch (i) {
+	case 0:
+		raid_gen_ptr[0] = f->gen;
+		break;
+	case 1:
+		raid_gen_ptr[1] = f->gen;
+		break;
+	case 2:
+		raid_genz_ptr = f->gen;
+		break;
+	case 3:
+		raid_gen3_ptr = f->gen;
+		break;
+	case 4:
+		raid_gen_ptr[3] = f->gen;
+		break;
+	case 5:
+		raid_gen_ptr[4] = f->gen;
+		break;
+	case 6:
+		raid_gen_ptr[5] = f->gen;
+		break;
+	case 7:
+		raid_rec_ptr[0] = f->rec;
+		break;
+	case 8:
+		raid_rec_ptr[1] = f->rec;
+		break;
+	case 9:
+		raid_rec_ptr[2] = f->rec;
+		raid_rec_ptr[3] = f->rec;
+		raid_rec_ptr[4] = f->rec;
+		raid_rec_ptr[5] = f->rec;
+		break;
+	}
+}
+
+static int64_t bench_time(void)
+{
+	struct timespec t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+
+	return t.tv_sec * 1000000000LL + t.tv_nsec;
+}
+
+/*
+ * Measures one candidate, returning the speed in MB/s.
+ *
+ * @v Vector with BENCH_DATA data blocks followed by RAID_PARITY_MAX
+ *   reference parity blocks.
+ * @t Scratch vector of the same geometry, with scratch blocks in the
+ *   positions the candidate writes to.
+ */
+static unsigned bench_func(const struct bench_slot *b,
+	const struct bench_func *f, size_t size, void **t)
+{
+	int id[RAID_PARITY_MAX];
+	int ip[RAID_PARITY_MAX];
+	int64_t start, elapsed;
+	int64_t bytes = 0;
+	int i;
+
+	for (i = 0; i < b->nr; ++i) {
+		id[i] = i;
+		ip[i] = i;
+	}
+
+	/* warm up caches and branch predictors */
+	if (f->gen)
+		f->gen(BENCH_DATA, size, t);
+	else
+		f->rec(b->nr, id, ip, BENCH_DATA, size, t);
+
+	start = bench_time();
+	do {
+		if (f->gen)
+			f->gen(BENCH_DATA, size, t);
+		else
+			f->rec(b->nr, id, ip, BENCH_DATA, size, t);
+		bytes += BENCH_DATA * size;
+		elapsed = bench_time() - start;
+	} while (elapsed < BENCH_TIME);
+
+	/* bytes/ns * 1000 == MB/s */
+	return bytes * 1000 / (elapsed ? elapsed : 1);
+}
+
+/*
+ * Instruction set signature used to validate the cache file.
+ */
+static void bench_signature(char *buf, size_t len)
+{
+	int n;
+
+	n = snprintf(buf, len, "%u", (unsigned)sizeof(void *) * 8);
+
+#ifdef CONFIG_X86
+#ifdef CONFIG_SSE2
+	if (raid_cpu_has_sse2())
+		n += snprintf(buf + n, len - n, " sse2");
+#endif
+#ifdef CONFIG_SSSE3
+	if (raid_cpu_has_ssse3())
+		n += snprintf(buf + n, len - n, " ssse3");
+#endif
+#ifdef CONFIG_AVX2
+	if (raid_cpu_has_avx2())
+		n += snprintf(buf + n, len - n, " avx2");
+#endif
+#ifdef CONFIG_AVX512GFNI
+	if (raid_cpu_has_avx512gfni())
+		n += snprintf(buf + n, len - n, " avx512gfni");
+#endif
+#endif
+
+	(void)n;
+}
+
+/*
+ * Loads cached results, installing the winners.
+ *
+ * Returns 0 if the cache was valid and complete.
+ */
+static int bench_load(const char *cache, struct bench_slot *s, int ns)
+{
+	char sig[128];
+	char line[128];
+	int done = 0;
+	FILE *fp;
+
+	fp = fopen(cache, "r");
+	if (!fp)
+		return -1;
+
+	bench_signature(sig, sizeof(sig));
+
+	if (!fgets(line, sizeof(line), fp))
+		goto bail;
+	line[strcspn(line, "\n")] = 0;
+	if (strncmp(line, "raid_bench 1 ", 13) != 0
+		|| strcmp(line + 13, sig) != 0)
+		goto bail;
+
+	while (fgets(line, sizeof(line), fp)) {
+		char *tag;
+		int i, j;
+
+		line[strcspn(line, "\n")] = 0;
+		tag = strchr(line, ' ');
+		if (!tag)
+			goto bail;
+		*tag++ = 0;
+
+		for (i = 0; i < ns; ++i)
+			if (strcmp(s[i].name, line) == 0)
+				break;
+		if (i == ns)
+			goto bail;
+
+		for (j = 0; j < s[i].nf; ++j)
+			if (strcmp(s[i].f[j].tag, tag) == 0)
+				break;
+		if (j == s[i].nf)
+			goto bail;
+
+		bench_install(i, &s[i].f[j]);
+		++done;
+	}
+
+	if (done != ns)
+		goto bail;
+
+	fclose(fp);
+	return 0;
+
+bail:
+	fclose(fp);
+	return -1;
+}
+
+/*
+ * Saves the winners. Failures are ignored, the cache is only an
+ * optimization.
+ */
+static void bench_save(const char *cache, struct bench_slot *s, int ns,
+	int *win)
+{
+	char sig[128];
+	FILE *fp;
+	int i;
+
+	fp = fopen(cache, "w");
+	if (!fp)
+		return;
+
+	bench_signature(sig, sizeof(sig));
+	fprintf(fp, "raid_bench 1 %s\n", sig);
+
+	for (i = 0; i < ns; ++i)
+		fprintf(fp, "%s %s\n", s[i].name, s[i].f[win[i]].tag);
+
+	fclose(fp);
+}
+
+int raid_bench(const char *cache, int force,
+	void (*report)(const struct raid_bench_result *res, void *arg),
+	void *arg)
+{
+	struct bench_slot s[BENCH_SLOT_MAX];
+	int win[BENCH_SLOT_MAX];
+	const int nd = BENCH_DATA;
+	const size_t size = BENCH_SIZE;
+	void *v_alloc;
+	void **v;
+	void *t[BENCH_DATA + RAID_PARITY_MAX];
+	int nv;
+	int i, j, ns;
+
+	ns = bench_slots(s);
+
+	if (!force && cache && bench_load(cache, s, ns) == 0)
+		return 0;
+
+	/* data + reference parity + scratch parity/data + zero */
+	nv = nd + RAID_PARITY_MAX * 2 + 1;
+
+	v = raid_malloc_vector(nd, nv, size, &v_alloc);
+	if (!v) {
+		/* LCOV_EXCL_START */
+		return -1;
+		/* LCOV_EXCL_STOP */
+	}
+
+	memset(v[nv - 1], 0, size);
+	raid_zero(v[nv - 1]);
+
+	/* fill with pseudo-random data with the arbitrary seed "1" */
+	raid_mrand_vector(1, nd, size, v);
+
+	/* compute reference parity */
+	raid_gen_ref(nd, RAID_PARITY_MAX, size, v);
+
+	for (i = 0; i < ns; ++i) {
+		struct bench_slot *b = &s[i];
+
+		/*
+		 * Generation writes scratch parity; recovery reads the
+		 * reference parity and rewrites the "missing" leading data
+		 * blocks in place, recomputing the same contents each
+		 * iteration.
+		 */
+		for (j = 0; j < nd; ++j)
+			t[j] = v[j];
+		for (j = 0; j < RAID_PARITY_MAX; ++j)
+			t[nd + j] = b->f[0].gen
+				? v[nd + RAID_PARITY_MAX + j]
+				: v[nd + j];
+
+		win[i] = 0;
+		for (j = 0; j < b->nf; ++j) {
+			b->f[j].speed = bench_func(b, &b->f[j], size, t);
+			if (b->f[j].speed > b->f[win[i]].speed)
+				win[i] = j;
+		}
+
+		bench_install(i, &b->f[win[i]]);
+
+		if (report) {
+			for (j = 0; j < b->nf; ++j) {
+				struct raid_bench_result res;
+
+				res.slot = b->name;
+				res.tag = b->f[j].tag;
+				res.speed = b->f[j].speed;
+				res.chosen = j == win[i];
+				report(&res, arg);
+			}
+		}
+	}
+
+	/* refresh the forwarder of the default mode, like raid_init() */
+	raid_mode(RAID_MODE_CAUCHY);
+
+	if (cache)
+		bench_save(cache, s, ns, win);
+
+	free(v);
+	free(v_alloc);
+
+	return 0;
+}
@@ -118,7 +118,7 @@ static inline int raid_cpu_match_avx(uint32_t cpuid_1_ecx, uint32_t cpuid_7_ebx,
 static inline int raid_cpu_has_sse2(void)
 {
 	/*
-	 * Intel� 64 and IA-32 Architectures Software Developer's Manual
+	 * Intel� 64 and IA-32 Architectures Software Developer's Manual
 	 * 325462-048US September 2013
 	 *
 	 * 11.6.2 Checking for SSE/SSE2 Support
@@ -137,7 +137,7 @@ static inline int raid_cpu_has_sse2(void)
 static inline int raid_cpu_has_ssse3(void)
 {
 	/*
-	 * Intel� 64 and IA-32 Architectures Software Developer's Manual
+	 * Intel� 64 and IA-32 Architectures Software Developer's Manual
 	 * 325462-048US September 2013
 	 *
 	 * 12.7.2 Checking for SSSE3 Support
@@ -154,7 +154,7 @@ static inline int raid_cpu_has_ssse3(void)
 static inline int raid_cpu_has_crc32(void)
 {
 	/*
-	 * Intel� 64 and IA-32 Architectures Software Developer's Manual
+	 * Intel� 64 and IA-32 Architectures Software Developer's Manual
 	 * 325462-048US September 2013
 	 *
 	 * 12.12.3 Checking for SSE4.2 Support
@@ -212,6 +212,26 @@ static inline int raid_cpu_has_avx512bw(void)
 		(3 << 1) | (7 << 5)); /* OS saves XMM, YMM and ZMM registers */
 }
 
+static inline int raid_cpu_has_avx512gfni(void)
+{
+	uint32_t reg[4];
+
+	/*
+	 * Intel Architecture Instruction Set Extensions Programming Reference
+	 * 319433-034 May 2018
+	 *
+	 * The Galois field affine instructions operating on the 512 bit
+	 * registers require AVX512F (checked together with the OS saving the
+	 * ZMM registers) plus CPUID.(EAX=07H, ECX=0):ECX.GFNI[bit 8].
+	 */
+	if (!raid_cpu_has_avx512bw())
+		return 0;
+
+	raid_cpuid(7, 0, reg);
+
+	return (reg[2] >> 8) & 1;
+}
+
 /**
  * Check if it's an Intel Atom CPU.
  */
@@ -53,6 +53,9 @@
 #if HAVE_AVX2
 #define CONFIG_AVX2 1
 #endif
+#if HAVE_AVX512GFNI
+#define CONFIG_AVX512GFNI 1
+#endif
 
 #else /* if HAVE_CONFIG_H is not defined */
 
@@ -73,6 +76,9 @@
 #define CONFIG_SSSE3 1
 #define CONFIG_AVX2 1
 #endif
+#ifdef CONFIG_X86_64
+#define CONFIG_AVX512GFNI 1
+#endif
 #endif
 
 /*
@@ -170,6 +176,10 @@ void raid_recX_ssse3(int nr, int *id, int *ip, int nd, size_t size, void **vv);
 void raid_rec1_avx2(int nr, int *id, int *ip, int nd, size_t size, void **vv);
 void raid_rec2_avx2(int nr, int *id, int *ip, int nd, size_t size, void **vv);
 void raid_recX_avx2(int nr, int *id, int *ip, int nd, size_t size, void **vv);
+void raid_gen1_avx512(int nd, size_t size, void **vv);
+void raid_gen2_avx512gfni(int nd, size_t size, void **vv);
+void raid_rec1_avx512gfni(int nr, int *id, int *ip, int nd, size_t size, void **vv);
+void raid_rec2_avx512gfni(int nr, int *id, int *ip, int nd, size_t size, void **vv);
 
 /*
  * Internal naming.
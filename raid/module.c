@@ -110,6 +110,15 @@ void raid_init(void)
 		raid_rec_ptr[5] = raid_recX_avx2;
 	}
 #endif
+
+#ifdef CONFIG_AVX512GFNI
+	if (raid_cpu_has_avx512gfni()) {
+		raid_gen_ptr[0] = raid_gen1_avx512;
+		raid_gen_ptr[1] = raid_gen2_avx512gfni;
+		raid_rec_ptr[0] = raid_rec1_avx512gfni;
+		raid_rec_ptr[1] = raid_rec2_avx512gfni;
+	}
+#endif
 #endif /* CONFIG_X86 */
 
 	/* set the default mode */
@@ -225,5 +225,56 @@ int raid_check(int nr, int *ir, int nd, int np, size_t size, void **v);
  */
 int raid_scan(int *ir, int nd, int np, size_t size, void **v);
 
+/**
+ * Result of benchmarking a single implementation.
+ *
+ * Passed to the raid_bench() report function once per candidate.
+ */
+struct raid_bench_result {
+	/**
+	 * Forwarder the implementation is a candidate for.
+	 * One of "gen1".."gen6", "genz", "rec1", "rec2", "recX".
+	 */
+	const char *slot;
+
+	/**
+	 * Implementation name, like the raid_*_tag() functions return.
+	 */
+	const char *tag;
+
+	/**
+	 * Measured speed in MB/s.
+	 */
+	unsigned speed;
+
+	/**
+	 * Nonzero if this implementation was selected.
+	 */
+	int chosen;
+};
+
+/**
+ * Benchmarks all the available implementations and selects the fastest.
+ *
+ * raid_init() selects implementations from cpuid only, which doesn't
+ * account for effects like frequency downclocking with the wider vector
+ * units. This function instead times every candidate on realistic block
+ * sizes, taking a few milliseconds, and installs the measured winners.
+ *
+ * Call it after raid_init(). It leaves the mode set to RAID_MODE_CAUCHY,
+ * like raid_init() does.
+ *
+ * @cache Path of a file used to cache the selection, keyed on the
+ *   detected instruction sets, so the measurement only runs once per
+ *   machine. Pass 0 to always measure and never cache.
+ * @force If nonzero, ignore and rewrite the cache.
+ * @report If not 0, called with the result of each measurement.
+ * @arg Context passed to @report.
+ * @return 0 on success. On failure the selection is left unchanged.
+ */
+int raid_bench(const char *cache, int force,
+	void (*report)(const struct raid_bench_result *res, void *arg),
+	void *arg);
+
 #endif
 
@@ -74,6 +74,12 @@ static struct raid_func {
 	{ "avx2e", raid_gen5_avx2ext },
 	{ "avx2e", raid_gen6_avx2ext },
 #endif
+#ifdef CONFIG_AVX512GFNI
+	{ "avx512", raid_gen1_avx512 },
+	{ "avx512gfni", raid_gen2_avx512gfni },
+	{ "avx512gfni", raid_rec1_avx512gfni },
+	{ "avx512gfni", raid_rec2_avx512gfni },
+#endif
 #endif
 	{ 0, 0 }
 };
@@ -2450,3 +2450,211 @@ void raid_recX_avx2(int nr, int *id, int *ip, int nd, size_t size, void **vv)
 }
 #endif
 
+
+#if defined(CONFIG_X86_64) && defined(CONFIG_AVX512GFNI)
+/*
+ * Builds the affine matrix for GF(2^8) multiplication by the constant @c, in
+ * the qword format the vgf2p8affineqb instruction expects: matrix byte 7 - i
+ * is the row producing output bit i, and bit k of a row selects input bit k,
+ * so the rows are assembled from the columns of the multiply-by-c linear map,
+ * i.e. c * 2^k:
+ */
+static uint64_t gfnimatrix(uint8_t c)
+{
+	uint64_t m = 0;
+	int i, k;
+
+	for (k = 0; k < 8; ++k) {
+		uint8_t col = mul(c, 1 << k);
+
+		for (i = 0; i < 8; ++i)
+			if (col & (1 << i))
+				m |= 1ULL << ((7 - i) * 8 + k);
+	}
+
+	return m;
+}
+
+/*
+ * GEN1 (RAID5 with xor) AVX512 implementation
+ */
+void raid_gen1_avx512(int nd, size_t size, void **vv)
+{
+	uint8_t **v = (uint8_t **)vv;
+	uint8_t *p;
+	int d, l;
+	size_t i;
+
+	l = nd - 1;
+	p = v[nd];
+
+	raid_avx_begin();
+
+	for (i = 0; i < size; i += 64) {
+		asm volatile ("vmovdqa64 %0,%%zmm0" : : "m" (v[l][i]));
+		for (d = l - 1; d >= 0; --d) {
+			asm volatile ("vmovdqa64 %0,%%zmm1" : : "m" (v[d][i]));
+			asm volatile ("vpxorq %zmm1,%zmm0,%zmm0");
+		}
+		asm volatile ("vmovntdq %%zmm0,%0" : "=m" (p[i]));
+	}
+
+	raid_avx_end();
+}
+
+/*
+ * GEN2 (RAID6 with powers of 2) AVX512 GFNI implementation
+ *
+ * The multiplication by 2 of the running q parity is a single
+ * vgf2p8affineqb with the multiply-by-2 affine matrix, replacing the
+ * compare/add/and/xor sequence of the AVX2 implementation and operating
+ * on twice the width.
+ */
+void raid_gen2_avx512gfni(int nd, size_t size, void **vv)
+{
+	uint8_t **v = (uint8_t **)vv;
+	uint8_t *p;
+	uint8_t *q;
+	uint64_t m2 = gfnimatrix(2);
+	int d, l;
+	size_t i;
+
+	l = nd - 1;
+	p = v[nd];
+	q = v[nd + 1];
+
+	raid_avx_begin();
+
+	asm volatile ("vpbroadcastq %0,%%zmm7" : : "m" (m2));
+
+	for (i = 0; i < size; i += 64) {
+		asm volatile ("vmovdqa64 %0,%%zmm0" : : "m" (v[l][i]));
+		asm volatile ("vmovdqa64 %zmm0,%zmm1");
+		for (d = l - 1; d >= 0; --d) {
+			asm volatile ("vgf2p8affineqb $0,%zmm7,%zmm1,%zmm1");
+			asm volatile ("vmovdqa64 %0,%%zmm2" : : "m" (v[d][i]));
+			asm volatile ("vpxorq %zmm2,%zmm0,%zmm0");
+			asm volatile ("vpxorq %zmm2,%zmm1,%zmm1");
+		}
+		asm volatile ("vmovntdq %%zmm0,%0" : "=m" (p[i]));
+		asm volatile ("vmovntdq %%zmm1,%0" : "=m" (q[i]));
+	}
+
+	raid_avx_end();
+}
+
+/*
+ * RAID recovering for one disk AVX512 GFNI implementation
+ */
+void raid_rec1_avx512gfni(int nr, int *id, int *ip, int nd, size_t size, void **vv)
+{
+	uint8_t **v = (uint8_t **)vv;
+	uint8_t *p;
+	uint8_t *pa;
+	uint8_t G;
+	uint8_t V;
+	uint64_t m;
+	size_t i;
+
+	(void)nr; /* unused, it's always 1 */
+
+	/* if it's RAID5 uses the faster function */
+	if (ip[0] == 0) {
+		raid_rec1of1(id, nd, size, vv);
+		return;
+	}
+
+	/* setup the coefficients matrix */
+	G = A(ip[0], id[0]);
+
+	/* invert it to solve the system of linear equations */
+	V = inv(G);
+
+	/* compute delta parity */
+	raid_delta_gen(1, id, ip, nd, size, vv);
+
+	p = v[nd + ip[0]];
+	pa = v[id[0]];
+
+	m = gfnimatrix(V);
+
+	raid_avx_begin();
+
+	asm volatile ("vpbroadcastq %0,%%zmm7" : : "m" (m));
+
+	for (i = 0; i < size; i += 64) {
+		asm volatile ("vmovdqa64 %0,%%zmm0" : : "m" (p[i]));
+		asm volatile ("vmovdqa64 %0,%%zmm1" : : "m" (pa[i]));
+		asm volatile ("vpxorq %zmm1,%zmm0,%zmm0");
+		asm volatile ("vgf2p8affineqb $0,%zmm7,%zmm0,%zmm0");
+		asm volatile ("vmovdqa64 %%zmm0,%0" : "=m" (pa[i]));
+	}
+
+	raid_avx_end();
+}
+
+/*
+ * RAID recovering for two disks AVX512 GFNI implementation
+ */
+void raid_rec2_avx512gfni(int nr, int *id, int *ip, int nd, size_t size, void **vv)
+{
+	uint8_t **v = (uint8_t **)vv;
+	const int N = 2;
+	uint8_t *p[N];
+	uint8_t *pa[N];
+	uint8_t G[N * N];
+	uint8_t V[N * N];
+	uint64_t m[N * N];
+	size_t i;
+	int j, k;
+
+	(void)nr; /* unused, it's always 2 */
+
+	/* setup the coefficients matrix */
+	for (j = 0; j < N; ++j)
+		for (k = 0; k < N; ++k)
+			G[j * N + k] = A(ip[j], id[k]);
+
+	/* invert it to solve the system of linear equations */
+	raid_invert(G, V, N);
+
+	/* compute delta parity */
+	raid_delta_gen(N, id, ip, nd, size, vv);
+
+	for (j = 0; j < N; ++j) {
+		p[j] = v[nd + ip[j]];
+		pa[j] = v[id[j]];
+	}
+
+	for (j = 0; j < N * N; ++j)
+		m[j] = gfnimatrix(V[j]);
+
+	raid_avx_begin();
+
+	asm volatile ("vpbroadcastq %0,%%zmm4" : : "m" (m[0]));
+	asm volatile ("vpbroadcastq %0,%%zmm5" : : "m" (m[1]));
+	asm volatile ("vpbroadcastq %0,%%zmm6" : : "m" (m[2]));
+	asm volatile ("vpbroadcastq %0,%%zmm7" : : "m" (m[3]));
+
+	for (i = 0; i < size; i += 64) {
+		asm volatile ("vmovdqa64 %0,%%zmm0" : : "m" (p[0][i]));
+		asm volatile ("vmovdqa64 %0,%%zmm2" : : "m" (pa[0][i]));
+		asm volatile ("vmovdqa64 %0,%%zmm1" : : "m" (p[1][i]));
+		asm volatile ("vmovdqa64 %0,%%zmm3" : : "m" (pa[1][i]));
+		asm volatile ("vpxorq %zmm2,%zmm0,%zmm0");
+		asm volatile ("vpxorq %zmm3,%zmm1,%zmm1");
+
+		asm volatile ("vgf2p8affineqb $0,%zmm4,%zmm0,%zmm2");
+		asm volatile ("vgf2p8affineqb $0,%zmm5,%zmm1,%zmm3");
+		asm volatile ("vpxorq %zmm3,%zmm2,%zmm2");
+		asm volatile ("vmovdqa64 %%zmm2,%0" : "=m" (pa[0][i]));
+
+		asm volatile ("vgf2p8affineqb $0,%zmm6,%zmm0,%zmm2");
+		asm volatile ("vgf2p8affineqb $0,%zmm7,%zmm1,%zmm3");
+		asm volatile ("vpxorq %zmm3,%zmm2,%zmm2");
+		asm volatile ("vmovdqa64 %%zmm2,%0" : "=m" (pa[1][i]));
+	}
+
+	raid_avx_end();
+}
+#endif
@@ -0,0 +1,308 @@
+#!/usr/bin/python3
+#
+# End to end benchmark and performance regression harness.
+#
+# Drives scripted scenarios (format, fsck, btree microbenchmarks, dump,
+# list, raid-bench, optionally a fuse + fio passthrough run) against
+# filesystems on sparse files, with the process pinned to a fixed set of
+# CPUs, and records wall time plus rusage (cpu time, max rss, block I/O
+# counts) as JSON into tests/bench_results/.
+#
+# Results are compared against a baseline with noise aware thresholds:
+# each scenario runs several times, the minimum is compared against the
+# baseline minimum with a margin derived from the baseline's own spread.
+# Baselines are per machine - record one on a reference box with
+# `make bench-baseline`, then `make bench` fails if a scenario regresses.
+#
+# Scenarios that need facilities the environment doesn't have (fuse
+# build, fio, root) are recorded as skipped rather than failing.
+
+import argparse
+import json
+import os
+import resource
+import shutil
+import subprocess
+import sys
+import tempfile
+import time
+
+from pathlib import Path
+
+TESTS_DIR = Path(__file__).parent.resolve()
+BCH_PATH = TESTS_DIR.parent / 'bcachefs'
+RESULTS_DIR = TESTS_DIR / 'bench_results'
+BASELINE = RESULTS_DIR / 'baseline.json'
+
+# Comparison thresholds: a scenario fails if its best run is slower than
+# baseline * (1 + margin), margin being at least MIN_MARGIN and at least
+# NOISE_FACTOR times the baseline's observed relative spread.
+MIN_MARGIN = 0.10
+NOISE_FACTOR = 2.0
+
+DEV_SIZE = 1 << 30
+
+def run(*args, check=True):
+    """Run a command, capturing output; returns (status, wall, rusage, out)."""
+    cmds = [str(a) for a in args]
+
+    start = time.monotonic()
+    p = subprocess.Popen(cmds, stdout=subprocess.PIPE,
+                         stderr=subprocess.STDOUT, encoding='utf-8')
+    # communicate() would reap the child itself and a second wait would
+    # fail with ECHILD: drain the pipe by hand, then reap via wait4() so
+    # we get rusage:
+    out = p.stdout.read()
+    p.stdout.close()
+    _, status, ru = os.wait4(p.pid, 0)
+    p.returncode = status
+    wall = time.monotonic() - start
+
+    if check and status != 0:
+        print(out)
+        raise RuntimeError('{} exited with status {}'.format(cmds, status))
+
+    return status, wall, ru, out
+
+def run_bch(*args, **kwargs):
+    return run(BCH_PATH, *args, **kwargs)
+
+def sparse_dev(tmpdir, name='dev'):
+    path = Path(tmpdir) / name
+    path.touch(mode=0o600)
+    os.truncate(path, DEV_SIZE)
+    return path
+
+def formatted_dev(tmpdir):
+    dev = sparse_dev(tmpdir)
+    run_bch('format', '-q', dev)
+    return dev
+
+def populated_dev(tmpdir):
+    """A filesystem with btree contents, populated via the perf command."""
+    dev = formatted_dev(tmpdir)
+    run_bch('perf', '-t', 'seq_insert', '-n', '100000', '-j', '1', dev)
+    return dev
+
+# Scenarios: each takes a fresh tmpdir, runs exactly one timed command via
+# bench(), and may return extra text to snapshot alongside the timings.
+
+class Skipped(Exception):
+    pass
+
+def bench_format(tmpdir, bench):
+    dev = sparse_dev(tmpdir)
+    bench('format', '-q', dev)
+
+def bench_fsck(tmpdir, bench):
+    dev = populated_dev(tmpdir)
+    bench('fsck', dev)
+
+def bench_perf_rand(tmpdir, bench):
+    dev = formatted_dev(tmpdir)
+    return bench('perf', '-t', 'rand_insert,rand_lookup', '-n', '100000',
+                 '-j', '1', dev)
+
+def bench_perf_seq(tmpdir, bench):
+    dev = formatted_dev(tmpdir)
+    return bench('perf', '-t', 'seq_insert,seq_lookup,seq_delete',
+                 '-n', '100000', '-j', '1', dev)
+
+def bench_list(tmpdir, bench):
+    dev = populated_dev(tmpdir)
+    bench('list', dev)
+
+def bench_dump(tmpdir, bench):
+    dev = populated_dev(tmpdir)
+    bench('dump', '-o', Path(tmpdir) / 'dump.qcow2', dev)
+
+def bench_raid(tmpdir, bench):
+    return bench('raid-bench')
+
+def bench_fuse_fio(tmpdir, bench):
+    if os.getenv('BCACHEFS_BENCH_FUSE', '0') != '1':
+        raise Skipped('set BCACHEFS_BENCH_FUSE=1 to enable')
+    if not shutil.which('fio') or not shutil.which('fusermount3'):
+        raise Skipped('fio and fusermount3 required')
+    if run_bch('fusemount', check=False)[3].find('Please supply') < 0:
+        raise Skipped('bcachefs not built with BCACHEFS_FUSE')
+
+    dev = formatted_dev(tmpdir)
+    mnt = Path(tmpdir) / 'mnt'
+    mnt.mkdir()
+
+    fuse = subprocess.Popen([str(BCH_PATH), 'fusemount', '-f', str(dev),
+                             str(mnt)],
+                            stdout=subprocess.DEVNULL,
+                            stderr=subprocess.DEVNULL)
+    try:
+        for _ in range(100):
+            if os.path.ismount(mnt):
+                break
+            time.sleep(0.1)
+        else:
+            raise Skipped('fuse mount did not come up')
+
+        return bench.raw('fio', '--name=bench', '--directory={}'.format(mnt),
+                         '--rw=readwrite', '--size=64M', '--bs=64k',
+                         '--ioengine=psync', '--fsync_on_close=1',
+                         '--minimal')
+    finally:
+        subprocess.run(['fusermount3', '-u', str(mnt)],
+                       stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+        fuse.wait()
+
+SCENARIOS = [
+    ('format',          bench_format),
+    ('fsck',            bench_fsck),
+    ('perf_rand',       bench_perf_rand),
+    ('perf_seq',        bench_perf_seq),
+    ('list',            bench_list),
+    ('dump',            bench_dump),
+    ('raid_bench',      bench_raid),
+    ('fuse_fio',        bench_fuse_fio),
+]
+
+class Bench:
+    """Callable handed to scenarios; times exactly one command."""
+    def __init__(self):
+        self.run = None
+
+    def record(self, wall, ru, out):
+        self.run = {
+            'wall':     wall,
+            'utime':    ru.ru_utime,
+            'stime':    ru.ru_stime,
+            'maxrss':   ru.ru_maxrss,
+            'inblock':  ru.ru_inblock,
+            'oublock':  ru.ru_oublock,
+        }
+        return out
+
+    def __call__(self, *args):
+        _, wall, ru, out = run_bch(*args)
+        return self.record(wall, ru, out)
+
+    def raw(self, *args):
+        _, wall, ru, out = run(*args)
+        return self.record(wall, ru, out)
+
+def run_scenario(name, fn, nr_runs):
+    runs = []
+    snapshot = None
+
+    for i in range(nr_runs):
+        with tempfile.TemporaryDirectory(prefix='bcachefs-bench.') as tmpdir:
+            b = Bench()
+            try:
+                out = fn(tmpdir, b)
+            except Skipped as e:
+                print('{:16} skipped ({})'.format(name, e))
+                return {'skipped': str(e)}
+            assert b.run, 'scenario {} timed nothing'.format(name)
+            runs.append(b.run)
+            if out is not None:
+                snapshot = out
+
+    walls = [r['wall'] for r in runs]
+    ret = {
+        'wall':     min(walls),
+        'spread':   (max(walls) - min(walls)) / min(walls),
+        'runs':     runs,
+    }
+    if snapshot is not None:
+        ret['snapshot'] = snapshot
+
+    print('{:16} {:8.3f}s  (spread {:.1%})'.format(name, ret['wall'],
+                                                   ret['spread']))
+    return ret
+
+def compare(results, baseline):
+    """Returns the list of regressed scenario names."""
+    regressed = []
+
+    for name, cur in results['scenarios'].items():
+        base = baseline['scenarios'].get(name)
+        if not base or 'skipped' in base or 'skipped' in cur:
+            continue
+
+        margin = max(MIN_MARGIN, NOISE_FACTOR * base.get('spread', 0))
+        limit = base['wall'] * (1 + margin)
+
+        status = 'ok'
+        if cur['wall'] > limit:
+            status = 'REGRESSED'
+            regressed.append(name)
+
+        print('{:16} {:8.3f}s  baseline {:8.3f}s  limit {:8.3f}s  {}'
+              .format(name, cur['wall'], base['wall'], limit, status))
+
+    return regressed
+
+def main():
+    parser = argparse.ArgumentParser(
+        description='bcachefs-tools benchmark and regression harness')
+    parser.add_argument('--runs', type=int, default=3,
+                        help='runs per scenario (default 3)')
+    parser.add_argument('--cpu', type=int, nargs='+', default=[0],
+                        help='CPUs to pin to (default 0)')
+    parser.add_argument('--scenarios', type=str,
+                        help='comma separated subset of scenarios to run')
+    parser.add_argument('--baseline', type=Path, default=BASELINE,
+                        help='baseline file to compare against')
+    parser.add_argument('--update-baseline', action='store_true',
+                        help='record results as the new baseline')
+    args = parser.parse_args()
+
+    if not BCH_PATH.exists():
+        sys.exit('{} not built - run make first'.format(BCH_PATH))
+
+    try:
+        os.sched_setaffinity(0, set(args.cpu))
+    except OSError as e:
+        print('warning: could not pin CPUs: {}'.format(e))
+
+    only = args.scenarios.split(',') if args.scenarios else None
+
+    results = {
+        'version':  run_bch('version')[3].strip(),
+        'date':     time.strftime('%Y-%m-%d %H:%M:%S'),
+        'cpus':     args.cpu,
+        'runs':     args.runs,
+        'scenarios': {},
+    }
+
+    for name, fn in SCENARIOS:
+        if only and name not in only:
+            continue
+        results['scenarios'][name] = run_scenario(name, fn, args.runs)
+
+    RESULTS_DIR.mkdir(exist_ok=True)
+    out = RESULTS_DIR / time.strftime('bench-%Y%m%d-%H%M%S.json')
+    out.write_text(json.dumps(results, indent=2) + '\n')
+    print('results written to {}'.format(out))
+
+    if args.update_baseline:
+        args.baseline.write_text(json.dumps(results, indent=2) + '\n')
+        print('baseline updated: {}'.format(args.baseline))
+        return
+
+    if not args.baseline.exists():
+        print('no baseline at {} - record one with --update-baseline'
+              .format(args.baseline))
+        return
+
+    baseline = json.loads(args.baseline.read_text())
+
+    print()
+    print('comparing against baseline from {} ({})'
+          .format(baseline.get('date'), baseline.get('version')))
+
+    regressed = compare(results, baseline)
+    if regressed:
+        sys.exit('performance regression in: {}'.format(', '.join(regressed)))
+
+    print('no regressions')
+
+if __name__ == '__main__':
+    main()
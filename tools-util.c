@@ -102,6 +102,90 @@ void xpwrite(int fd, const void *buf, size_t count, off_t offset)
 		die("write error (ret %zi err %m)", r);
 }
 
+/* Buffered sequential reading: */
+
+void seq_reader_init(struct seq_reader *r, int fd, size_t window)
+{
+	memset(r, 0, sizeof(*r));
+	r->fd		= fd;
+	r->window	= max_t(size_t, window, 4096);
+	r->buf		= xmalloc(r->window);
+
+	posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+}
+
+void seq_reader_exit(struct seq_reader *r)
+{
+	free(r->buf);
+	r->buf = NULL;
+}
+
+static void seq_reader_refill(struct seq_reader *r, off_t offset)
+{
+	ssize_t n;
+
+	r->offset	= offset;
+	r->len		= 0;
+
+	do {
+		n = pread(r->fd, r->buf + r->len,
+			  r->window - r->len, offset + r->len);
+		if (n < 0)
+			die("read error: %m");
+		r->len += n;
+	} while (n && r->len < r->window);
+
+	/* start the kernel on the next window while we consume this one: */
+	if (r->len == r->window)
+		posix_fadvise(r->fd, offset + r->window, r->window,
+			      POSIX_FADV_WILLNEED);
+}
+
+size_t seq_read_some(struct seq_reader *r, void *buf, size_t len, off_t offset)
+{
+	size_t done = 0;
+
+	while (done < len) {
+		size_t b;
+
+		if (offset <  r->offset ||
+		    offset >= r->offset + (off_t) r->len) {
+			/* no point copying full windows through the buffer: */
+			if (len - done >= r->window) {
+				ssize_t n = pread(r->fd, buf + done,
+						  len - done, offset);
+				if (n < 0)
+					die("read error: %m");
+				if (!n)
+					break;
+
+				posix_fadvise(r->fd, offset + n, r->window,
+					      POSIX_FADV_WILLNEED);
+				done	+= n;
+				offset	+= n;
+				continue;
+			}
+
+			seq_reader_refill(r, offset);
+			if (!r->len)
+				break;
+		}
+
+		b = min_t(size_t, len - done, r->offset + r->len - offset);
+		memcpy(buf + done, r->buf + (offset - r->offset), b);
+		done	+= b;
+		offset	+= b;
+	}
+
+	return done;
+}
+
+void seq_read(struct seq_reader *r, void *buf, size_t len, off_t offset)
+{
+	if (seq_read_some(r, buf, len, offset) != len)
+		die("pread error: unexpected eof");
+}
+
 struct stat xfstatat(int dirfd, const char *path, int flags)
 {
 	struct stat stat;
@@ -185,14 +269,22 @@ struct units_buf __pr_units(s64 _v, enum units units)
 
 char *read_file_str(int dirfd, const char *path)
 {
+	struct seq_reader r;
 	int fd = xopenat(dirfd, path, O_RDONLY);
-	ssize_t len = xfstat(fd).st_size;
+	size_t size = 4096, len = 0, b;
+	char *buf = xmalloc(size);
 
-	char *buf = xmalloc(len + 1);
+	seq_reader_init(&r, fd, 4096);
 
-	len = read(fd, buf, len);
-	if (len < 0)
-		die("read error: %m");
+	while ((b = seq_read_some(&r, buf + len, size - len - 1, len))) {
+		len += b;
+		if (len == size - 1) {
+			size *= 2;
+			buf = xrealloc(buf, size);
+		}
+	}
+
+	seq_reader_exit(&r);
 
 	buf[len] = '\0';
 	if (len && buf[len - 1] == '\n')
@@ -332,6 +424,10 @@ void ranges_sort_merge(ranges *r)
 	sort(&darray_item(*r, 0), darray_size(*r),
 	     sizeof(darray_item(*r, 0)), range_cmp, NULL);
 
+	/* Worst case nothing merges - one allocation up front: */
+	if (darray_size(*r))
+		darray_realloc(tmp, darray_size(*r));
+
 	/* Merge contiguous ranges: */
 	darray_foreach(i, *r) {
 		t = tmp.size ?  &tmp.item[tmp.size - 1] : NULL;
@@ -367,27 +463,43 @@ void ranges_rounddown(ranges *r, unsigned block_size)
 	}
 }
 
-struct fiemap_extent fiemap_iter_next(struct fiemap_iter *iter)
+struct fiemap_buf {
+	struct fiemap		f;
+	struct fiemap_extent	fe[1024];
+};
+
+/*
+ * Fetch a file's entire extent list, a thousand extents per ioctl - the last
+ * extent is flagged, so fully mapped files cost a single ioctl:
+ */
+void fiemap_get_extents(int fd, fiemap_extents *extents)
 {
-	struct fiemap_extent e;
+	struct fiemap_buf *buf = xcalloc(1, sizeof(*buf));
+	unsigned i;
 
-	BUG_ON(iter->idx > iter->f.fm_mapped_extents);
+	buf->f.fm_extent_count	= ARRAY_SIZE(buf->fe);
+	buf->f.fm_length	= FIEMAP_MAX_OFFSET;
 
-	if (iter->idx == iter->f.fm_mapped_extents) {
-		xioctl(iter->fd, FS_IOC_FIEMAP, &iter->f);
+	while (1) {
+		xioctl(fd, FS_IOC_FIEMAP, &buf->f);
 
-		if (!iter->f.fm_mapped_extents)
-			return (struct fiemap_extent) { .fe_length = 0 };
+		if (!buf->f.fm_mapped_extents)
+			break;
 
-		iter->idx = 0;
-	}
+		for (i = 0; i < buf->f.fm_mapped_extents; i++) {
+			struct fiemap_extent *e = &buf->f.fm_extents[i];
 
-	e = iter->f.fm_extents[iter->idx++];
-	BUG_ON(!e.fe_length);
+			BUG_ON(!e->fe_length);
+			darray_append(*extents, *e);
 
-	iter->f.fm_start = e.fe_logical + e.fe_length;
+			if (e->fe_flags & FIEMAP_EXTENT_LAST)
+				goto out;
 
-	return e;
+			buf->f.fm_start = e->fe_logical + e->fe_length;
+		}
+	}
+out:
+	free(buf);
 }
 
 char *strcmp_prefix(char *a, const char *a_prefix)
@@ -28,6 +28,24 @@ void *xmalloc(size_t);
 void *xrealloc(void *, size_t);
 void xpread(int, void *, size_t, off_t);
 void xpwrite(int, const void *, size_t, off_t);
+
+/*
+ * Buffered sequential reader: batches small reads into a larger window, and
+ * uses posix_fadvise() to have the kernel prefetch the next window while the
+ * current one is consumed. Reads of a full window or more bypass the buffer.
+ */
+struct seq_reader {
+	int		fd;
+	char		*buf;
+	size_t		window;
+	off_t		offset;	/* file offset of buf[0] */
+	size_t		len;	/* valid bytes at buf */
+};
+
+void seq_reader_init(struct seq_reader *, int, size_t);
+void seq_reader_exit(struct seq_reader *);
+size_t seq_read_some(struct seq_reader *, void *, size_t, off_t);
+void seq_read(struct seq_reader *, void *, size_t, off_t);
 struct stat xfstatat(int, const char *, int);
 struct stat xfstat(int);
 struct stat xstat(const char *);
@@ -124,27 +142,13 @@ static inline struct range hole_iter_next(struct hole_iter *iter)
 
 #include <linux/fiemap.h>
 
-struct fiemap_iter {
-	struct fiemap		f;
-	struct fiemap_extent	fe[1024];
-	unsigned		idx;
-	int			fd;
-};
-
-static inline void fiemap_iter_init(struct fiemap_iter *iter, int fd)
-{
-	memset(iter, 0, sizeof(*iter));
-
-	iter->f.fm_extent_count	= ARRAY_SIZE(iter->fe);
-	iter->f.fm_length	= FIEMAP_MAX_OFFSET;
-	iter->fd		= fd;
-}
-
-struct fiemap_extent fiemap_iter_next(struct fiemap_iter *);
+/*
+ * Most files aren't very fragmented - enough inline storage that the common
+ * case never allocates:
+ */
+typedef darray_inline(struct fiemap_extent, 16) fiemap_extents;
 
-#define fiemap_for_each(fd, iter, extent)				\
-	for (fiemap_iter_init(&iter, fd);				\
-	     (extent = fiemap_iter_next(&iter)).fe_length;)
+void fiemap_get_extents(int, fiemap_extents *);
 
 char *strcmp_prefix(char *, const char *);
 